@@ -1,162 +1,340 @@
+// usage: bench [-l] [-w warmups] [-r repeats] [-c 1,2,4,...] [-f text|csv|json]
+//              [config...]
+//
+// Benchmark suite runner: run each named config (all of them by default;
+// -l lists them) at each core count, warmups times unrecorded and then
+// repeats times, and report the time each run took along with how much
+// kstats and the file system's free block count moved during it.  With -f
+// csv or json there is one record per recorded run on stdout, and the
+// benchmarks' own output goes to stderr, so that runs of two kernel builds
+// can be compared by a script.
+
 #include "types.h"
 #include "user.h"
 #include "amd64.h"
-#include "lib.h"
+#include "libutil.h"
+#include "kstats.hh"
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
-static u64
-time_this(const char *av[])
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// A benchmark and how to run it.  "%n" in args stands for the core count;
+// configs without it run once per repeat, whatever -c says.
+struct bench_config
+{
+  const char *name;
+  const char *args[8];
+};
+
+static const bench_config configs[] = {
+  { "mailbench",     { "/mailbench", "-a", "all", "/", "%n" } },
+  { "filebench",     { "/filebench", "%n", "10000" } },
+  { "dirbench",      { "/dirbench", "%n", "1000" } },
+  { "mapbench",      { "/mapbench", "%n", "local" } },
+  { "fdbench",       { "/fdbench", "%n" } },
+  { "countbench",    { "/countbench", "%n" } },
+  { "crwpbench",     { "/crwpbench", "%n", "0" } },
+  { "dbench",        { "/dbench", "-t", "10", "%n", "/" } },
+  { "linkbench",     { "/linkbench", "1", "1" } },
+  { "fsynctest",     { "/fsynctest" } },
+  { "forkexecbench", { "/forkexecbench" } },
+  { "pagebench",     { "/pagebench" } },
+};
+
+enum { FMT_TEXT, FMT_CSV, FMT_JSON };
+
+struct bench_run
+{
+  const bench_config *config;
+  int ncore;                    // 0 if the config takes no core count
+  int rep;
+  int status;
+  u64 usecs;
+  s64 blocks_used;
+  kstats ks;
+};
+
+static int format = FMT_TEXT;
+static u64 hz;
+
+static void
+read_kstats(kstats *out)
+{
+  int fd = open("/dev/kstats", O_RDONLY);
+  if (fd < 0)
+    die("bench: cannot open /dev/kstats");
+  if (xread(fd, out, sizeof *out) != sizeof *out)
+    die("bench: short read from /dev/kstats");
+  close(fd);
+}
+
+// The free block count from the "Total num free blocks: N / M" line of
+// /dev/blkstats.
+static s64
+read_free_blocks(void)
+{
+  static char buf[16384];
+  int fd = open("/dev/blkstats", O_RDONLY);
+  if (fd < 0)
+    die("bench: cannot open /dev/blkstats");
+  size_t n = xread(fd, buf, sizeof buf - 1);
+  close(fd);
+  buf[n] = 0;
+  const char *key = "Total num free blocks: ";
+  const char *p = strstr(buf, key);
+  if (!p)
+    die("bench: no free block count in /dev/blkstats");
+  return atoi(p + strlen(key));
+}
+
+static bool
+takes_cores(const bench_config *c)
+{
+  for (int i = 0; c->args[i]; i++)
+    if (strcmp(c->args[i], "%n") == 0)
+      return true;
+  return false;
+}
+
+static std::string
+command_line(const bench_config *c, int ncore)
 {
+  std::string s;
+  char cores[16];
+  if (ncore > 0)
+    snprintf(cores, sizeof cores, "%d", ncore);
+  else
+    strcpy(cores, "N");
+  for (int i = 0; c->args[i]; i++) {
+    if (i)
+      s += ' ';
+    s += strcmp(c->args[i], "%n") == 0 ? cores : c->args[i];
+  }
+  return s;
+}
+
+static void
+run_one(bench_run *r)
+{
+  char cores[16];
+  const char *av[8];
+  snprintf(cores, sizeof cores, "%d", r->ncore);
+  int i;
+  for (i = 0; r->config->args[i]; i++)
+    av[i] = strcmp(r->config->args[i], "%n") == 0 ? cores : r->config->args[i];
+  av[i] = nullptr;
+
+  kstats before, after;
+  // Start every run from the same place: nothing left to write back.
+  sync();
+  s64 free0 = read_free_blocks();
+  read_kstats(&before);
   u64 t0 = rdtsc();
 
   int pid = fork();
   if (pid < 0)
-    die("time_this: fork failed %s", av[0]);
-
+    die("bench: fork failed");
   if (pid == 0) {
+    // Keep stdout for the records.
+    if (format != FMT_TEXT)
+      dup2(2, 1);
     execv(av[0], const_cast<char * const *>(av));
-    die("time_this: exec failed %s", av[0]);
+    die("bench: exec %s failed", av[0]);
   }
+  wait(&r->status);
 
-  wait(NULL);
   u64 t1 = rdtsc();
-  return t1-t0;
+  read_kstats(&after);
+  r->blocks_used = free0 - read_free_blocks();
+  r->ks = after - before;
+  r->usecs = (t1 - t0) * 1000000 / hz;
 }
 
-struct Bench
+static void
+print_header(void)
 {
-  virtual void run(void) = 0;
-  virtual char* result(void) = 0;  
-};
-
-#define NEW_OPERATOR(classname)                                         \
-  void* operator new(unsigned long nbytes) {                            \
-    assert(nbytes == sizeof(classname));                                \
-    return malloc(sizeof(classname));                                   \
+  if (format == FMT_CSV) {
+    printf("config,ncore,rep,status,usecs,blocks_used");
+#define X(type, name) printf("," #name);
+    KSTATS_ALL(X);
+#undef X
+    printf("\n");
+  } else if (format == FMT_JSON) {
+    printf("[\n");
   }
+}
 
-struct TimedExec : public Bench
+static void
+print_run(const bench_run *r, bool first)
 {
-  TimedExec(const char **argv) : argv_(argv) {}
-  
-  virtual void run(void) {
-    char *str = result_;
-    *str = 0;
-    for (int i = 0; argv_[i]; i++) {
-      int n = sizeof(result_)-(str-result_);
-      snprintf(str, n, i==0?"%s":" %s", argv_[i]);
-      str += strlen(str);
+  if (format == FMT_CSV) {
+    printf("%s,%d,%d,%d,%lu,%ld", r->config->name, r->ncore, r->rep,
+           r->status, r->usecs, r->blocks_used);
+#define X(type, name) printf(",%lu", (u64)r->ks.name);
+    KSTATS_ALL(X);
+#undef X
+    printf("\n");
+  } else if (format == FMT_JSON) {
+    // Only the counters that moved, to keep the records readable.
+    printf("%s  {\"config\": \"%s\", \"cmd\": \"%s\", \"ncore\": %d, "
+           "\"rep\": %d, \"status\": %d, \"usecs\": %lu, "
+           "\"blocks_used\": %ld, \"kstats\": {", first ? "" : ",\n",
+           r->config->name, command_line(r->config, r->ncore).c_str(),
+           r->ncore, r->rep, r->status, r->usecs, r->blocks_used);
+    const char *sep = "";
+#define X(type, name)                                           \
+    if (r->ks.name) {                                           \
+      printf("%s\"" #name "\": %lu", sep, (u64)r->ks.name);     \
+      sep = ", ";                                               \
     }
-
-    printf("%s .. ", result_);
-    u64 r = time_this(argv_);
-    snprintf(str, sizeof(result_)-(str-result_), ": %lu cycles", r);
-    printf("%lu cycles\n", r);
+    KSTATS_ALL(X);
+#undef X
+    printf("}}");
   }
+}
 
-  virtual char* result(void) {
-    return result_;
+// For text output: the runs of one config at one core count, summed up:
+// their times in usecs, and the blocks each read and used on average.
+static void
+print_summary(const std::vector<bench_run> &runs)
+{
+  std::vector<u64> t;
+  u64 sum = 0, read = 0;
+  s64 used = 0;
+  int failed = 0;
+  for (auto &r : runs) {
+    t.push_back(r.usecs);
+    sum += r.usecs;
+    read += r.ks.disk_read_blocks;
+    used += r.blocks_used;
+    failed += r.status != 0;
   }
+  std::sort(t.begin(), t.end());
+  s64 n = runs.size();
+  const bench_run &r0 = runs[0];
+  printf("%-14s %5d %10lu %10lu %10lu %10lu %10lu %10ld", r0.config->name,
+         r0.ncore, t[0], t[n / 2], sum / n, t.back(), read / n, used / n);
+  if (failed)
+    printf(" (%d failed)", failed);
+  printf("\n");
+}
 
-  const char **argv_;
-  char result_[256];
-
-  NEW_OPERATOR(TimedExec)
-};
-
-struct LoopsBench : public Bench
+static std::vector<int>
+parse_counts(const char *list)
 {
-  static const int runs = 1;
-
-  LoopsBench(const char *cmd, int nloops, int cpuinc) :
-    Bench(), cmd_(cmd), nloops_(nloops), cpuinc_(cpuinc) {}
-
-  char* runone(int ncore, const char** argv, char *res, int n) {
-      u64 min = ~0ull;
-      char cores[16];   
-
-      snprintf(cores, sizeof(cores), "%u", ncore);
-      argv[1] = cores;
-      for (int i = 0; i < runs; i++) {
-        u64 r = time_this(argv);      
-        // r in usecs
-        r = (r*(1000*1000)) / cpuhz();
-        min = MIN(r, min);
-      }
-      snprintf(res, n, "%u %lu %u\n", ncore, min, nloops_);
-      return res + strlen(res);
+  std::vector<int> out;
+  for (const char *p = list; *p; ) {
+    int n = atoi(p);
+    if (n <= 0)
+      die("bench: bad core count list %s", list);
+    out.push_back(n);
+    while (*p && *p != ',')
+      p++;
+    if (*p == ',')
+      p++;
   }
+  return out;
+}
 
-  virtual void run(void) {
-    char nloopstr[16];
-    snprintf(nloopstr, sizeof(nloopstr), "%u", nloops_); 
-    const char *argv[] = { cmd_, 0, nloopstr, 0 };
-
-    char *res = result_;
-    char *q = res + sizeof(result_);
+static void
+usage(const char *prog)
+{
+  die("usage: %s [-l] [-w warmups] [-r repeats] [-c 1,2,4,...] "
+      "[-f text|csv|json] [config...]", prog);
+}
 
-    snprintf(res, q-res, "#cores usecs loops/core\n");
-    res += strlen(res);
+int
+main(int argc, char *argv[])
+{
+  int warmups = 1, repeats = 3;
+  std::vector<int> counts = parse_counts("1,2,4,8");
 
-    res = runone(1, argv, res, q-res);
-    for (int i = cpuinc_; i <= NCPU; i += cpuinc_)
-      res = runone(i, argv, res, q-res);
+  int opt;
+  while ((opt = getopt(argc, argv, "lw:r:c:f:")) != -1) {
+    switch (opt) {
+    case 'l':
+      for (auto &c : configs)
+        printf("%-14s %s\n", c.name, command_line(&c, 0).c_str());
+      return 0;
+    case 'w':
+      warmups = atoi(optarg);
+      break;
+    case 'r':
+      repeats = atoi(optarg);
+      break;
+    case 'c':
+      counts = parse_counts(optarg);
+      break;
+    case 'f':
+      if (strcmp(optarg, "text") == 0)
+        format = FMT_TEXT;
+      else if (strcmp(optarg, "csv") == 0)
+        format = FMT_CSV;
+      else if (strcmp(optarg, "json") == 0)
+        format = FMT_JSON;
+      else
+        usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    }
   }
+  if (warmups < 0 || repeats < 1)
+    usage(argv[0]);
 
-  virtual char* result(void) {
-    return result_;
+  std::vector<const bench_config *> selected;
+  for (int i = optind; i < argc; i++) {
+    const bench_config *found = nullptr;
+    for (auto &c : configs)
+      if (strcmp(c.name, argv[i]) == 0)
+        found = &c;
+    if (!found)
+      die("bench: no config named %s (see bench -l)", argv[i]);
+    selected.push_back(found);
   }
+  if (selected.empty())
+    for (auto &c : configs)
+      selected.push_back(&c);
 
-  const char* cmd_;
-  int nloops_;
-  int cpuinc_;
-  char result_[1024];
-  NEW_OPERATOR(LoopsBench)
-};
-
-#define CMD(...) ({ const char* args[] = { __VA_ARGS__, 0 }; \
-                    new TimedExec(args); })
-#define STR_1(x...) #x
-#define STR(x...)   STR_1(x)
-
-int
-main(int ac, char **av)
-{
-  static Bench* the_bench[128];
-  int n = 0;
-
-  //the_bench[n++] = new LoopsBench("/dirbench", 1000, 6);
-  //the_bench[n++] = new LoopsBench("/filebench", 100000, 6);
-  //the_bench[n++] = new LoopsBench("/mapbench", 10000, 6);
-  //the_bench[n++] = CMD("filebench", "6", "10000");
-  //the_bench[n++] = CMD("filebench", "48", "10000");
-
-  //the_bench[n++] = CMD("forkexecbench");
-  //the_bench[n++] = CMD("mktree", STR(NCPU), "tree.xdu", "4", "4");
-  //the_bench[n++] = CMD("xdu", "8");
-  //the_bench[n++] = CMD("xdu", "4");
-  //the_bench[n++] = CMD("xdu", "1");
-  //the_bench[n++] = CMD("xls", "8");
-  //the_bench[n++] = CMD("xls", "4");
-  //the_bench[n++] = CMD("xls", "1");
-
-  //the_bench[n++] = CMD("mapbench", "1");
-  //the_bench[n++] = CMD("mapbench", "2");
-  //the_bench[n++] = CMD("mapbench", "16");
-  //the_bench[n++] = CMD("gcbench", "16");
-  //the_bench[n++] = CMD("metis_wrmem-jo");
-  //the_bench[n++] = CMD("lsocket");
-  
-  for (int i = 0; i < n; i++)
-    the_bench[i]->run();
-
-  printf("\n");
-  for (int i = 0; i < n; i++)
-    printf("%s\n", the_bench[i]->result());
+  hz = cpuhz();
+  if (!hz)
+    die("bench: unknown CPU frequency");
 
+  if (format == FMT_TEXT)
+    printf("%-14s %5s %10s %10s %10s %10s %10s %10s\n", "# config", "ncore",
+           "min", "median", "mean", "max", "blks read", "blks used");
+  print_header();
+  bool first = true;
+  for (auto c : selected) {
+    std::vector<int> ncores = takes_cores(c) ? counts : std::vector<int>();
+    if (ncores.empty())
+      ncores.push_back(0);
+    for (int ncore : ncores) {
+      std::vector<bench_run> runs;
+      for (int rep = -warmups; rep < repeats; rep++) {
+        bench_run r;
+        r.config = c;
+        r.ncore = ncore;
+        r.rep = rep;
+        run_one(&r);
+        if (rep < 0)
+          continue;
+        runs.push_back(r);
+        print_run(&r, first);
+        first = false;
+      }
+      if (format == FMT_TEXT)
+        print_summary(runs);
+    }
+  }
+  if (format == FMT_JSON)
+    printf("\n]\n");
   return 0;
 }
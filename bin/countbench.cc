@@ -224,6 +224,16 @@ main(int argc, char **argv)
 
   printf("%lu cycles/iteration\n",
          (sum(stop_tscs, nthread) - sum(start_tscs, nthread))/iters);
+#ifdef XV6_USER
+  uint64_t hits = kstats_after.refcache_hit_count -
+    kstats_before.refcache_hit_count;
+  uint64_t misses = kstats_after.refcache_miss_count -
+    kstats_before.refcache_miss_count;
+  printf("refcache: %lu hits, %lu misses (%lu%% hit), %lu conflicts\n",
+         hits, misses, hits + misses ? hits * 100 / (hits + misses) : 0,
+         kstats_after.refcache_conflict_count -
+         kstats_before.refcache_conflict_count);
+#endif
   printf("\n");
   sleep(5);
   return 0;
@@ -1,10 +1,42 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "sysstubs.h"
+#include "libutil.h"
+
+// Measure disk read throughput for a range of I/O sizes and stripe units, to
+// find where larger I/Os stop paying off (see DISK_IO_SIZE and
+// DISK_STRIPE_SIZE in param.h).
+static void
+sweep(u64 nbytes)
+{
+  printf("%10s %10s %10s\n", "io_size", "stripe", "MB/s");
+  for (u64 stripe = 64*1024; stripe <= 4*1024*1024; stripe *= 2) {
+    for (u64 io_size = 4096; io_size <= 4*1024*1024; io_size *= 2) {
+      long ns = diskbench(nbytes, io_size, stripe);
+      if (ns < 0)
+        die("disktest: diskbench(%lu, %lu, %lu) failed",
+            nbytes, io_size, stripe);
+
+      u64 mbps = ns ? (nbytes * 1000000000ULL / ns) >> 20 : 0;
+      printf("%10lu %10lu %10lu\n", io_size, stripe, mbps);
+    }
+  }
+}
 
 int
 main(int argc, char *argv[])
 {
+  if (argc >= 2 && strcmp(argv[1], "sweep") == 0) {
+    u64 mbytes = argc >= 3 ? atoi(argv[2]) : 256;
+    sweep(mbytes << 20);
+    return 0;
+  }
+
+  if (argc != 1)
+    die("usage: %s [sweep [mbytes]]", argv[0]);
+
   disktest();
   return 0;
 }
@@ -0,0 +1,269 @@
+// usage: disktrace [-o file] command...
+//
+// Trace the disk I/O issued while command runs (see disktrace.h), and
+// report, per disk: the I/O mix by operation and caller, how sequential
+// the reads and writes were, the queue depth over time, and how many
+// I/Os were adjacent on the disk to another one that was in flight at
+// the same time, and so could have been merged into it.  -o also saves
+// the raw trace records to file.
+
+#include "types.h"
+#include "user.h"
+#include "disktrace.h"
+#include "libutil.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+enum { NBINS = 10 };
+
+static const char *op_names[] = { "?", "read", "write", "flush" };
+static const char *tag_names[DISKTRACE_NTAGS] = {
+  "other", "journal", "apply", "bufcache", "pagefill",
+};
+
+static uint64_t hz;
+
+static double
+usec(uint64_t cycles)
+{
+  return (double)cycles * 1000000 / hz;
+}
+
+static void
+drain(int fd, std::vector<disktrace_rec> *out)
+{
+  disktrace_rec chunk[128];
+  int r;
+  while ((r = read(fd, chunk, sizeof chunk)) > 0)
+    if (out)
+      for (size_t i = 0; i < r / sizeof chunk[0]; i++)
+        out->push_back(chunk[i]);
+  if (r < 0)
+    die("disktrace: read failed");
+}
+
+static void
+set_tracing(int fd, bool on)
+{
+  if (write(fd, on ? "1" : "0", 1) != 1)
+    die("disktrace: cannot turn tracing %s", on ? "on" : "off");
+}
+
+// The I/O mix, by operation and caller
+static void
+print_mix(const std::vector<disktrace_rec> &recs)
+{
+  struct mix { uint64_t n, bytes, iovs, lat, maxlat; };
+  mix m[DISKTRACE_FLUSH + 1][DISKTRACE_NTAGS] = {};
+
+  for (auto &r : recs) {
+    mix &x = m[r.op][r.tag < DISKTRACE_NTAGS ? r.tag : DISKTRACE_OTHER];
+    uint64_t lat = r.complete_tsc - r.submit_tsc;
+    x.n++;
+    x.bytes += r.len;
+    x.iovs += r.iovcnt;
+    x.lat += lat;
+    x.maxlat = std::max(x.maxlat, lat);
+  }
+
+  printf("%-6s %-9s %8s %10s %8s %6s %10s %10s\n", "op", "caller", "count",
+         "KB", "avg KB", "iovs", "avg usec", "max usec");
+  for (int op = DISKTRACE_READ; op <= DISKTRACE_FLUSH; op++) {
+    for (int tag = 0; tag < DISKTRACE_NTAGS; tag++) {
+      mix &x = m[op][tag];
+      if (!x.n)
+        continue;
+      printf("%-6s %-9s %8lu %10lu %8.1f %6.1f %10.1f %10.1f\n",
+             op_names[op], tag_names[tag], x.n, x.bytes / 1024,
+             (double)x.bytes / 1024 / x.n, (double)x.iovs / x.n,
+             usec(x.lat / x.n), usec(x.maxlat));
+    }
+  }
+}
+
+// How many of the reads or writes of one disk started where the last one
+// ended, and how many were adjacent to one that was in flight at the same
+// time.
+static void
+print_pattern(int dev, int op, std::vector<const disktrace_rec *> ios)
+{
+  if (ios.empty())
+    return;
+
+  std::sort(ios.begin(), ios.end(),
+            [](const disktrace_rec *a, const disktrace_rec *b) {
+              return a->submit_tsc < b->submit_tsc;
+            });
+  uint64_t seq = 0;
+  for (size_t i = 1; i < ios.size(); i++)
+    if (ios[i]->off == ios[i - 1]->off + ios[i - 1]->len)
+      seq++;
+
+  std::sort(ios.begin(), ios.end(),
+            [](const disktrace_rec *a, const disktrace_rec *b) {
+              return a->off < b->off;
+            });
+  uint64_t merge = 0;
+  for (size_t i = 1; i < ios.size(); i++) {
+    const disktrace_rec *a = ios[i - 1], *b = ios[i];
+    if (a->off + a->len == b->off && a->len + b->len <= DISK_IO_SIZE &&
+        a->submit_tsc < b->complete_tsc && b->submit_tsc < a->complete_tsc)
+      merge++;
+  }
+
+  printf("disk%d %-5s %8lu I/Os, %5.1f%% sequential, "
+         "%lu mergeable with an adjacent I/O in flight\n",
+         dev, op_names[op], (uint64_t)ios.size(),
+         ios.size() > 1 ? 100.0 * seq / (ios.size() - 1) : 0.0, merge);
+}
+
+// The average and maximum number of I/Os outstanding on one disk, over
+// the whole trace and in each of NBINS equal intervals of it.
+static void
+print_depth(int dev, const std::vector<const disktrace_rec *> &ios,
+            uint64_t start, uint64_t end)
+{
+  if (ios.empty() || end <= start)
+    return;
+
+  struct event {
+    uint64_t tsc;
+    int delta;
+    // Completions first, at the same instant
+    bool operator<(const event &o) const {
+      return tsc < o.tsc || (tsc == o.tsc && delta < o.delta);
+    }
+  };
+  std::vector<event> ev;
+  for (auto r : ios) {
+    ev.push_back({r->submit_tsc, 1});
+    ev.push_back({r->complete_tsc, -1});
+  }
+  std::sort(ev.begin(), ev.end());
+
+  uint64_t len = end - start;
+  double bins[NBINS] = {};
+  double total = 0;
+  int depth = 0, maxdepth = 0;
+  uint64_t prev = start;
+  for (auto &e : ev) {
+    uint64_t t = std::min(std::max(e.tsc, start), end);
+    // Spread depth over [prev, t) across the bins it covers
+    for (uint64_t s = prev; s < t; ) {
+      int b = (s - start) * NBINS / len;
+      uint64_t bend = std::min(start + len * (b + 1) / NBINS, t);
+      if (bend <= s)
+        bend = s + 1;
+      bins[b] += (double)depth * (bend - s);
+      s = bend;
+    }
+    total += (double)depth * (t - prev);
+    prev = t;
+    depth += e.delta;
+    maxdepth = std::max(maxdepth, depth);
+  }
+
+  printf("disk%d queue depth avg %.2f max %d; by tenth:", dev, total / len,
+         maxdepth);
+  for (int b = 0; b < NBINS; b++)
+    printf(" %.1f", bins[b] / ((double)len / NBINS));
+  printf("\n");
+}
+
+int
+main(int ac, char * const av[])
+{
+  const char *outfile = nullptr;
+  int argi = 1;
+
+  if (ac > 2 && strcmp(av[1], "-o") == 0) {
+    outfile = av[2];
+    argi = 3;
+  }
+  if (argi >= ac)
+    die("usage: %s [-o file] command...", av[0]);
+  hz = cpuhz();
+  if (!hz)
+    die("disktrace: unknown CPU frequency");
+
+  int fd = open("/dev/disktrace", O_RDWR);
+  if (fd < 0)
+    die("Couldn't open /dev/disktrace");
+  // Drop whatever an earlier trace left behind
+  drain(fd, nullptr);
+  set_tracing(fd, true);
+
+  int pid = fork();
+  if (pid < 0)
+    die("disktrace: fork failed");
+  if (pid == 0) {
+    std::vector<const char *> args(av + argi, av + ac);
+    args.push_back(nullptr);
+    execv(args[0], const_cast<char * const *>(args.data()));
+    die("disktrace: exec failed");
+  }
+  wait(NULL);
+  set_tracing(fd, false);
+
+  std::vector<disktrace_rec> all;
+  drain(fd, &all);
+  close(fd);
+
+  if (outfile) {
+    int ofd = open(outfile, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (ofd < 0)
+      die("disktrace: cannot create %s", outfile);
+    size_t bytes = all.size() * sizeof all[0];
+    if (write(ofd, all.data(), bytes) != (ssize_t)bytes)
+      die("disktrace: cannot write %s", outfile);
+    close(ofd);
+  }
+
+  std::vector<disktrace_rec> recs;
+  uint64_t lost = 0;
+  for (auto &r : all) {
+    if (r.op == DISKTRACE_LOST)
+      lost += r.off;
+    else if (r.op >= DISKTRACE_READ && r.op <= DISKTRACE_FLUSH)
+      recs.push_back(r);
+  }
+  if (recs.empty()) {
+    printf("no disk I/O traced (%lu records lost)\n", lost);
+    return 0;
+  }
+
+  uint64_t start = recs[0].submit_tsc, end = recs[0].complete_tsc;
+  for (auto &r : recs) {
+    start = std::min(start, r.submit_tsc);
+    end = std::max(end, r.complete_tsc);
+  }
+  printf("%lu I/Os in %.1f usec, %lu records lost\n", (uint64_t)recs.size(),
+         usec(end - start), lost);
+  print_mix(recs);
+
+  for (int dev = 0; dev < NDISK; dev++) {
+    std::vector<const disktrace_rec *> ios, reads, writes;
+    for (auto &r : recs) {
+      if (r.dev != dev)
+        continue;
+      ios.push_back(&r);
+      if (r.op == DISKTRACE_READ)
+        reads.push_back(&r);
+      else if (r.op == DISKTRACE_WRITE)
+        writes.push_back(&r);
+    }
+    if (ios.empty())
+      continue;
+    printf("\n");
+    print_pattern(dev, DISKTRACE_READ, reads);
+    print_pattern(dev, DISKTRACE_WRITE, writes);
+    print_depth(dev, ios, start, end);
+  }
+  return 0;
+}
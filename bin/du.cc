@@ -19,21 +19,28 @@ du(int fd)
 
   int size = st.st_size;
   if (S_ISDIR(st.st_mode)) {
-    struct dirent de;
-    while (read(fd, &de, sizeof(de)) == sizeof(de)) {
-      if (de.inum == 0)
-        continue;
-
-      char buf[DIRSIZ+1];
-      memmove(buf, de.name, DIRSIZ);
-      buf[DIRSIZ] = 0;
-
-      if (!strcmp(buf, ".") || !strcmp(buf, ".."))
-        continue;
-
-      int nfd = openat(fd, buf, 0);
-      if (nfd >= 0)
-        size += du(nfd);  // should go into work queue
+    // Stat each batch of entries with one call, and only open the
+    // subdirectories.
+    struct getdents_rec recs[64];
+    struct stat sts[64];
+    ssize_t r;
+    while ((r = getdents(fd, recs, sizeof(recs))) > 0) {
+      size_t n = r / sizeof(recs[0]);
+      if (statat_many(fd, recs, n, sts, STAT_OMIT_NLINK) != (ssize_t)n) {
+        fprintf(stderr, "du: cannot stat\n");
+        break;
+      }
+      for (size_t i = 0; i < n; i++) {
+        if (!strcmp(recs[i].name, ".") || !strcmp(recs[i].name, ".."))
+          continue;
+        if (!S_ISDIR(sts[i].st_mode)) {
+          size += sts[i].st_size;
+          continue;
+        }
+        int nfd = openat(fd, recs[i].name, 0);
+        if (nfd >= 0)
+          size += du(nfd);  // should go into work queue
+      }
     }
   }
 
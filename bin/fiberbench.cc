@@ -0,0 +1,140 @@
+// Fiber runtime benchmark.
+//
+//   fiberbench [nworkers [nfibers [npairs [rounds]]]]
+//
+// Spawns nfibers fibers that each yield rounds times, then has npairs
+// pairs of fibers pass a byte back and forth over a pair of pipes
+// rounds times, waiting with fiber_wait().
+
+#include "types.h"
+#include "user.h"
+#include <xv6/fiber.h>
+#include <sys/epoll.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <atomic>
+
+static int nfibers = 10000;
+static int npairs = 32;
+static int rounds = 100;
+
+static std::atomic<long> nyields;
+static std::atomic<int> ndone;
+
+struct pair {
+  int ping[2], pong[2];
+};
+
+static void
+yielder(void *arg)
+{
+  for (int i = 0; i < rounds; i++) {
+    fiber_yield();
+    nyields++;
+  }
+}
+
+static void
+xfer(int in, int out, bool first)
+{
+  char c = 0;
+  if (first && write(out, &c, 1) != 1)
+    die("fiberbench: write failed");
+  for (int i = 0; i < rounds; i++) {
+    while (read(in, &c, 1) != 1)
+      if (fiber_wait(in, EPOLLIN) < 0)
+        die("fiberbench: fiber_wait failed");
+    if (first && i == rounds - 1)
+      break;
+    if (write(out, &c, 1) != 1)
+      die("fiberbench: write failed");
+  }
+}
+
+static void
+pinger(void *arg)
+{
+  pair *p = (pair*)arg;
+  xfer(p->pong[0], p->ping[1], true);
+  ndone++;
+}
+
+static void
+ponger(void *arg)
+{
+  pair *p = (pair*)arg;
+  xfer(p->ping[0], p->pong[1], false);
+  ndone++;
+}
+
+static long
+usec_since(struct timeval *start)
+{
+  struct timeval end;
+  gettimeofday(&end, nullptr);
+  return (end.tv_sec - start->tv_sec) * 1000000 +
+    (end.tv_usec - start->tv_usec);
+}
+
+static void
+bench(void *arg)
+{
+  struct timeval start;
+  gettimeofday(&start, nullptr);
+  for (int i = 0; i < nfibers; i++)
+    if (fiber_spawn(yielder, nullptr) < 0)
+      die("fiberbench: fiber_spawn failed");
+  while (nyields < (long)nfibers * rounds)
+    fiber_yield();
+  long usec = usec_since(&start);
+  printf("%d fibers, %ld yields in %ld usec\n", nfibers, nyields.load(), usec);
+
+  pair *pairs = new pair[npairs];
+  for (int i = 0; i < npairs; i++)
+    if (pipe2(pairs[i].ping, O_NONBLOCK) < 0 ||
+        pipe2(pairs[i].pong, O_NONBLOCK) < 0)
+      die("fiberbench: pipe2 failed");
+  gettimeofday(&start, nullptr);
+  for (int i = 0; i < npairs; i++)
+    if (fiber_spawn(pinger, &pairs[i]) < 0 ||
+        fiber_spawn(ponger, &pairs[i]) < 0)
+      die("fiberbench: fiber_spawn failed");
+  while (ndone < 2 * npairs)
+    fiber_yield();
+  usec = usec_since(&start);
+  printf("%d pipe pairs, %ld round trips in %ld usec\n", npairs,
+         (long)npairs * rounds, usec);
+
+  for (int i = 0; i < npairs; i++) {
+    close(pairs[i].ping[0]);
+    close(pairs[i].ping[1]);
+    close(pairs[i].pong[0]);
+    close(pairs[i].pong[1]);
+  }
+  delete[] pairs;
+}
+
+int
+main(int ac, char **av)
+{
+  int nworkers = 2;
+  if (ac > 1)
+    nworkers = atoi(av[1]);
+  if (ac > 2)
+    nfibers = atoi(av[2]);
+  if (ac > 3)
+    npairs = atoi(av[3]);
+  if (ac > 4)
+    rounds = atoi(av[4]);
+
+  struct timeval start;
+  gettimeofday(&start, nullptr);
+  if (fiber_run(nworkers, bench, nullptr) < 0)
+    die("fiberbench: fiber_run failed");
+  printf("%d workers: all done in %ld usec\n", nworkers, usec_since(&start));
+  return 0;
+}
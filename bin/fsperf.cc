@@ -0,0 +1,92 @@
+// usage: fsperf [-s subsys,...] command...
+//
+// Count the file system's performance regions (see kernel fsperf.hh)
+// while command runs, and print their per-core cycle and PMC 0 totals.
+// -s limits counting to the named subsystems: syscall, commit, apply,
+// bufcache and pagecache.  To count PMC events, run command under
+// perf with the event of interest.
+
+#include "types.h"
+#include "user.h"
+#include "fsperf.h"
+#include "libutil.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+static const char *subsys_names[FSPERF_NSUBSYS] = {
+  "syscall", "commit", "apply", "bufcache", "pagecache",
+};
+
+static uint32_t
+parse_subsys(const char *arg)
+{
+  uint32_t mask = 0;
+  char buf[128];
+  strncpy(buf, arg, sizeof(buf) - 1);
+  buf[sizeof(buf) - 1] = 0;
+  for (char *name = buf, *next; name; name = next) {
+    next = strchr(name, ',');
+    if (next)
+      *next++ = 0;
+    int i;
+    for (i = 0; i < FSPERF_NSUBSYS; i++)
+      if (!strcmp(name, subsys_names[i]))
+        break;
+    if (i == FSPERF_NSUBSYS)
+      die("fsperf: unknown subsystem %s", name);
+    mask |= 1u << i;
+  }
+  return mask;
+}
+
+static void
+control(int fd, uint32_t mask, bool reset)
+{
+  struct fsperf_ctl ctl = { mask, reset };
+  if (write(fd, &ctl, sizeof(ctl)) != sizeof(ctl))
+    die("fsperf: cannot write /dev/fsperf");
+}
+
+int
+main(int ac, char * const av[])
+{
+  uint32_t mask = FSPERF_ALL;
+  int argi = 1;
+
+  if (ac > 2 && strcmp(av[1], "-s") == 0) {
+    mask = parse_subsys(av[2]);
+    argi = 3;
+  }
+  if (argi >= ac)
+    die("usage: %s [-s subsys,...] command...", av[0]);
+
+  int fd = open("/dev/fsperf", O_RDWR);
+  if (fd < 0)
+    die("Couldn't open /dev/fsperf");
+  control(fd, mask, true);
+
+  int pid = fork();
+  if (pid < 0)
+    die("fsperf: fork failed");
+  if (pid == 0) {
+    std::vector<const char *> args(av + argi, av + ac);
+    args.push_back(nullptr);
+    execv(args[0], const_cast<char * const *>(args.data()));
+    die("fsperf: exec failed");
+  }
+  wait(NULL);
+  control(fd, 0, false);
+
+  char buf[4096];
+  int r;
+  while ((r = read(fd, buf, sizeof(buf))) > 0)
+    if (write(1, buf, r) != r)
+      die("fsperf: write failed");
+  close(fd);
+  return 0;
+}
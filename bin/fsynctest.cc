@@ -58,6 +58,19 @@ void fsync_run() {
   if (unlink("tmpfile") < 0)
     die("error: unlink failed");
 
+  u64 ticket;
+  if ((fd = open("testdir2", 0)) < 0)
+    die("error: could not open testdir2");
+  if (fsync_async(fd, &ticket) < 0)
+    die("error: fsync_async failed");
+  if (fsync_wait(ticket, 0) < 0)
+    die("error: fsync_wait failed");
+  if (fsync_wait(ticket, 1) < 0)
+    die("error: fsync_wait(nonblock) after commit failed");
+  if (fsync_wait(~0ull, 0) != -1)
+    die("error: fsync_wait accepted -1 as a ticket");
+  close(fd);
+
   if ((fd = open(".", 0)) < 0)
     die("error: could not open .");
   fsync(fd);
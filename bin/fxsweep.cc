@@ -0,0 +1,228 @@
+// usage: fxsweep [-x fxmark] [-r root] [-d secs] [-c 1,2,4,...]
+//                [-p seq,rr] [-a] bench...
+//
+// Core-scaling sweep over the fxmark microbenchmarks: run fxmark once for
+// each bench (MWCL, DWAL, ...) x core count x core policy (see
+// find_core_policy() in fxmark/bench.c; fxmark pins its workers in that
+// order), each in a fresh directory under root, and print one CSV line
+// per run with what fxmark reports and how much the kernel's file and file
+// system counters (or, with -a, all of kstats) moved during the run.
+
+#include "types.h"
+#include "user.h"
+#include "libutil.h"
+#include "shutil.h"
+#include "kstats.hh"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <string>
+#include <vector>
+
+static const char *fxmark = "/fxmark";
+static const char *root = "/fxsweep";
+static const char *duration = "5";
+static bool all_kstats;
+
+static void
+read_kstats(kstats *out)
+{
+  int fd = open("/dev/kstats", O_RDONLY);
+  if (fd < 0)
+    die("fxsweep: cannot open /dev/kstats");
+  if (xread(fd, out, sizeof *out) != sizeof *out)
+    die("fxsweep: short read from /dev/kstats");
+  close(fd);
+}
+
+// Split a comma-separated list.
+static std::vector<std::string>
+split(const char *list)
+{
+  std::vector<std::string> out;
+  std::string cur;
+  for (const char *p = list; ; p++) {
+    if (*p == ',' || *p == 0) {
+      if (!cur.empty())
+        out.push_back(cur);
+      cur.clear();
+      if (*p == 0)
+        break;
+    } else {
+      cur += *p;
+    }
+  }
+  return out;
+}
+
+// Run av[0] with its stdout in out, or just run it if out is null.
+// Returns its exit status.
+static int
+run(const char *const *av, std::string *out)
+{
+  int fds[2];
+  if (out && pipe(fds) < 0)
+    die("fxsweep: pipe failed");
+  int pid = fork();
+  if (pid < 0)
+    die("fxsweep: fork failed");
+  if (pid == 0) {
+    if (out) {
+      dup2(fds[1], 1);
+      close(fds[0]);
+      close(fds[1]);
+    }
+    execv(av[0], const_cast<char * const *>(av));
+    die("fxsweep: exec %s failed", av[0]);
+  }
+  if (out) {
+    close(fds[1]);
+    char buf[512];
+    ssize_t r;
+    while ((r = read(fds[0], buf, sizeof buf)) > 0)
+      out->append(buf, r);
+    close(fds[0]);
+  }
+  int status;
+  wait(&status);
+  return status;
+}
+
+// The numbers on fxmark's result line, which follows its "# ncpu secs
+// works works/sec" header, but for ncpu, as CSV fields; false if there is
+// no such line.
+static bool
+parse_result(const std::string &out, std::string *fields)
+{
+  for (size_t pos = 0, end; pos < out.size(); pos = end + 1) {
+    for (end = pos; end < out.size() && out[end] != '\n'; end++)
+      ;
+    if (end == pos || out[pos] == '#')
+      continue;
+    int n = 0;
+    fields->clear();
+    for (size_t i = pos, j; i < end; i = j) {
+      for (; i < end && out[i] == ' '; i++)
+        ;
+      for (j = i; j < end && out[j] != ' '; j++)
+        ;
+      if (j > i && ++n >= 2 && n <= 4) {
+        if (n > 2)
+          *fields += ',';
+        fields->append(out.data() + i, j - i);
+      }
+    }
+    return n >= 4;
+  }
+  return false;
+}
+
+// The kstats columns: the file and file system ones, or all of them.
+#define SWEEP_KSTATS(X)                         \
+  if (all_kstats) {                             \
+    KSTATS_ALL(X);                              \
+  } else {                                      \
+    KSTATS_FILE(X);                             \
+    KSTATS_FS(X);                               \
+  }
+
+static void
+print_header(void)
+{
+  printf("bench,policy,ncore,secs,works,works_per_sec");
+#define X(type, name) printf("," #name);
+  SWEEP_KSTATS(X);
+#undef X
+  printf("\n");
+}
+
+static void
+sweep_one(const char *bench, const char *policy, const char *ncore)
+{
+  char dir[128];
+  snprintf(dir, sizeof dir, "%s/%s-%s-%s", root, bench, policy, ncore);
+  if (mkdir_if_noent(dir, 0777) < 0)
+    die("fxsweep: cannot create %s", dir);
+
+  const char *av[] = {
+    fxmark, "--type", bench, "--ncore", ncore, "--policy", policy,
+    "--duration", duration, "--root", dir, nullptr,
+  };
+  kstats before, after;
+  std::string out, fields;
+  read_kstats(&before);
+  int status = run(av, &out);
+  read_kstats(&after);
+  kstats d = after - before;
+
+  if (status != 0 || !parse_result(out, &fields)) {
+    fprintf(stderr, "fxsweep: %s %s %s failed:\n%s", bench, policy, ncore,
+            out.c_str());
+    fields = ",,";
+  }
+  printf("%s,%s,%s,%s", bench, policy, ncore, fields.c_str());
+#define X(type, name) printf(",%lu", (u64)d.name);
+  SWEEP_KSTATS(X);
+#undef X
+  printf("\n");
+
+  // Don't let one run's files slow down the next.
+  const char *rm[] = { "/rm", "-r", dir, nullptr };
+  run(rm, nullptr);
+  sync();
+}
+
+static void
+usage(const char *prog)
+{
+  die("usage: %s [-x fxmark] [-r root] [-d secs] [-c 1,2,4,...] "
+      "[-p seq,rr] [-a] bench...", prog);
+}
+
+int
+main(int argc, char *argv[])
+{
+  const char *counts = "1,2,4,8";
+  const char *policies = "seq,rr";
+
+  int opt;
+  while ((opt = getopt(argc, argv, "x:r:d:c:p:a")) != -1) {
+    switch (opt) {
+    case 'x':
+      fxmark = optarg;
+      break;
+    case 'r':
+      root = optarg;
+      break;
+    case 'd':
+      duration = optarg;
+      break;
+    case 'c':
+      counts = optarg;
+      break;
+    case 'p':
+      policies = optarg;
+      break;
+    case 'a':
+      all_kstats = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind == argc)
+    usage(argv[0]);
+  if (mkdir_if_noent(root, 0777) < 0)
+    die("fxsweep: cannot create %s", root);
+
+  print_header();
+  for (int i = optind; i < argc; i++)
+    for (auto &policy : split(policies))
+      for (auto &ncore : split(counts))
+        sweep_one(argv[i], policy.c_str(), ncore.c_str());
+  return 0;
+}
@@ -83,9 +83,9 @@ stats(int print)
       die("gct: unexpected read");
 
     if (print)
-      printf("%d: ndelay %" PRId64 " nfree %" PRId64 " nrun %" PRId64 " ncycles %lu nop %lu cycles/op %lu\n",
+      printf("%d: ndelay %" PRId64 " nfree %" PRId64 " nrun %" PRId64 " ncycles %lu nop %lu cycles/op %lu delayed bytes %lu\n",
             c++, gs.ndelay, gs.nfree, gs.nrun, gs.ncycles, gs.nop, 
-              (gs.nop > 0) ? gs.ncycles/gs.nop : 0);
+              (gs.nop > 0) ? gs.ncycles/gs.nop : 0, gs.delayed_bytes);
   }
 
   close(fd);
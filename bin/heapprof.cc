@@ -0,0 +1,135 @@
+// Dump the kernel heap profile (see KERNEL_HEAP_PROFILE).
+//
+// Prints the per-site report from /dev/heapprof.  With -s, writes the
+// sampled allocation stacks from /dev/heapsamples as a sampler log
+// that tools/perf-report reads.  With -f, writes them as folded
+// stacks, one "caller;...;site count" line per stack, for flame graph
+// tools.  Each sample stands for HEAP_PROFILE_SAMPLE bytes allocated.
+// -a restricts the samples to one arena.
+
+#include "types.h"
+#include "user.h"
+#include "sampler.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+static const char *arenas[] = { "kalloc", "kmalloc", "new" };
+
+static void
+usage(const char *argv0)
+{
+  fprintf(stderr,
+          "usage: %s [-a kalloc|kmalloc|new] [-s sample-file] [-f folded-file]\n",
+          argv0);
+  exit(2);
+}
+
+static std::vector<char>
+readall(const char *path)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    die("heapprof: open %s failed", path);
+  std::vector<char> buf;
+  char chunk[4096];
+  int r;
+  while ((r = read(fd, chunk, sizeof(chunk))) > 0)
+    for (int i = 0; i < r; i++)
+      buf.push_back(chunk[i]);
+  if (r < 0)
+    die("heapprof: read %s failed", path);
+  close(fd);
+  return buf;
+}
+
+static void
+xwrite(int fd, const void *buf, size_t n)
+{
+  if (write(fd, buf, n) != (ssize_t)n)
+    die("heapprof: write failed");
+}
+
+int
+main(int ac, char **av)
+{
+  int arena = -1;
+  const char *samplefile = nullptr, *foldedfile = nullptr;
+  int opt;
+
+  while ((opt = getopt(ac, av, "a:s:f:")) != -1) {
+    switch (opt) {
+    case 'a':
+      for (size_t i = 0; i < sizeof(arenas) / sizeof(arenas[0]); i++)
+        if (strcmp(optarg, arenas[i]) == 0)
+          arena = i;
+      if (arena < 0)
+        usage(av[0]);
+      break;
+    case 's':
+      samplefile = optarg;
+      break;
+    case 'f':
+      foldedfile = optarg;
+      break;
+    default:
+      usage(av[0]);
+    }
+  }
+  if (optind != ac)
+    usage(av[0]);
+
+  std::vector<char> report = readall("/dev/heapprof");
+  xwrite(1, report.data(), report.size());
+
+  if (!samplefile && !foldedfile)
+    return 0;
+
+  // Collect the events of the selected arena from every section
+  std::vector<char> log = readall("/dev/heapsamples");
+  if (log.size() < sizeof(logheader))
+    die("heapprof: no samples (is KERNEL_HEAP_PROFILE set?)");
+  auto hdr = (const logheader*)log.data();
+  std::vector<pmuevent> events;
+  for (u64 i = 0; i < hdr->ncpus; i++) {
+    auto p = (const pmuevent*)(log.data() + hdr->cpu[i].offset);
+    auto q = (const pmuevent*)(log.data() + hdr->cpu[i].offset +
+                               hdr->cpu[i].size);
+    for (; p < q; p++)
+      if (arena < 0 || p->data_source == (u32)arena)
+        events.push_back(*p);
+  }
+
+  if (samplefile) {
+    int fd = open(samplefile, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0)
+      die("heapprof: open %s failed", samplefile);
+    struct {
+      u64 ncpus;
+      u64 offset, size;
+    } __attribute__((packed)) out = {
+      1, sizeof(out), events.size() * sizeof(pmuevent)
+    };
+    xwrite(fd, &out, sizeof(out));
+    xwrite(fd, events.data(), out.size);
+    close(fd);
+  }
+
+  if (foldedfile) {
+    int fd = open(foldedfile, O_WRONLY|O_CREAT|O_TRUNC, 0666);
+    if (fd < 0)
+      die("heapprof: open %s failed", foldedfile);
+    for (auto &ev : events) {
+      // Outermost caller first
+      for (int i = NTRACE - 1; i >= 0; i--)
+        if (ev.trace[i])
+          dprintf(fd, "0x%lx;", ev.trace[i]);
+      dprintf(fd, "0x%lx %u\n", ev.rip, ev.count);
+    }
+    close(fd);
+  }
+  return 0;
+}
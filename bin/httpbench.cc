@@ -0,0 +1,231 @@
+// usage: httpbench addr port path [nconns [secs]]
+//
+// Load generator for httpd.  Runs nconns threads, each fetching path
+// over one keep-alive connection to addr:port (a dotted IPv4 address)
+// for secs seconds, reconnecting if the server closes it.  Reports
+// requests per second and latency percentiles.  Builds natively too,
+// to load the VM from the host (whose port 8080 QEMU forwards to the
+// VM's port 80).
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <atomic>
+
+#include "libutil.h"
+
+#if defined(XV6_USER)
+#include "types.h"
+#include "user.h"
+#include "pthread.h"
+#else
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#endif
+
+// Latency histogram buckets, in microseconds: exact below SUB, and
+// SUB buckets per power of two above that
+enum { SUB = 16, NBUCKETS = 61 * SUB };
+
+struct conn_stats
+{
+  uint64_t requests;
+  uint64_t errors;
+  uint64_t hist[NBUCKETS];
+};
+
+static struct sockaddr_in server;
+static char request[512];
+static int request_len;
+static std::atomic<bool> stop;
+
+static int
+bucket(uint64_t usec)
+{
+  if (usec < SUB)
+    return usec;
+  int e = 63 - __builtin_clzll(usec);
+  return (e - 3) * SUB + ((usec >> (e - 4)) & (SUB - 1));
+}
+
+// The lower bound of bucket b
+static uint64_t
+bucket_usec(int b)
+{
+  if (b < SUB)
+    return b;
+  int e = b / SUB + 3;
+  return (uint64_t)(SUB + b % SUB) << (e - 4);
+}
+
+static int
+connect_server(void)
+{
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+  if (s < 0)
+    die("httpbench: socket failed");
+  if (connect(s, (struct sockaddr *)&server, sizeof(server)) < 0) {
+    close(s);
+    return -1;
+  }
+  return s;
+}
+
+// Read one response off s, using buf (holding *len bytes left over
+// from the last response) as the read buffer.  Returns 1 if the
+// connection can take another request, 0 if the server is closing it,
+// and -1 on failure.
+static int
+read_response(int s, char *buf, size_t size, size_t *len)
+{
+  char *end;
+  for (;;) {
+    buf[*len] = 0;
+    if ((end = strstr(buf, "\r\n\r\n")))
+      break;
+    if (*len == size - 1)
+      return -1;
+    ssize_t r = read(s, buf + *len, size - 1 - *len);
+    if (r <= 0)
+      return -1;
+    *len += r;
+  }
+  end += 4;
+  if (strncmp(buf, "HTTP/1.1 200 ", 13) != 0)
+    return -1;
+  const char *cl = strstr(buf, "Content-Length: ");
+  if (!cl || cl > end)
+    return -1;
+  size_t body = strtoul(cl + 16, nullptr, 10);
+  const char *cc = strstr(buf, "Connection: close");
+  bool keepalive = !cc || cc > end;
+
+  size_t have = *len - (end - buf);
+  if (have > body) {
+    // Part of the next response; keep it
+    memmove(buf, end + body, have - body);
+    *len = have - body;
+    return keepalive ? 1 : 0;
+  }
+  body -= have;
+  *len = 0;
+  while (body) {
+    ssize_t r = read(s, buf, body < size ? body : size);
+    if (r <= 0)
+      return -1;
+    body -= r;
+  }
+  return keepalive ? 1 : 0;
+}
+
+static void *
+run(void *arg)
+{
+  struct conn_stats *st = (struct conn_stats *)arg;
+  char buf[16384];
+  size_t len = 0;
+  int s = -1;
+
+  while (!stop) {
+    if (s < 0) {
+      len = 0;
+      if ((s = connect_server()) < 0) {
+        st->errors++;
+        continue;
+      }
+    }
+    uint64_t start = now_usec();
+    int r = -1;
+    if (write(s, request, request_len) == request_len)
+      r = read_response(s, buf, sizeof(buf), &len);
+    if (r < 0) {
+      st->errors++;
+    } else {
+      st->requests++;
+      st->hist[bucket(now_usec() - start)]++;
+    }
+    if (r <= 0) {
+      close(s);
+      s = -1;
+    }
+  }
+  if (s >= 0)
+    close(s);
+  return nullptr;
+}
+
+int
+main(int ac, char **av)
+{
+  unsigned a, b, c, d;
+  int nconns = 1;
+  int secs = 5;
+
+  if (ac < 4 || sscanf(av[1], "%u.%u.%u.%u", &a, &b, &c, &d) != 4)
+    die("usage: %s addr port path [nconns [secs]]", av[0]);
+  if (ac > 4)
+    nconns = atoi(av[4]);
+  if (ac > 5)
+    secs = atoi(av[5]);
+  if (nconns < 1 || secs < 1)
+    die("httpbench: nconns and secs must be positive");
+
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_addr.s_addr = htonl(a << 24 | b << 16 | c << 8 | d);
+  server.sin_port = htons(atoi(av[2]));
+  request_len = snprintf(request, sizeof(request),
+                         "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+                         av[3], av[1]);
+  if (request_len >= (int)sizeof(request))
+    die("httpbench: path too long");
+
+  struct conn_stats *stats =
+    (struct conn_stats *)calloc(nconns, sizeof(*stats));
+  pthread_t *threads = (pthread_t *)calloc(nconns, sizeof(*threads));
+  if (!stats || !threads)
+    die("httpbench: out of memory");
+
+  uint64_t start = now_usec();
+  for (int i = 0; i < nconns; i++)
+    pthread_create(&threads[i], nullptr, run, &stats[i]);
+  sleep(secs);
+  stop = true;
+  for (int i = 0; i < nconns; i++)
+    pthread_join(threads[i], nullptr);
+  uint64_t usec = now_usec() - start;
+
+  struct conn_stats total = {};
+  for (int i = 0; i < nconns; i++) {
+    total.requests += stats[i].requests;
+    total.errors += stats[i].errors;
+    for (int j = 0; j < NBUCKETS; j++)
+      total.hist[j] += stats[i].hist[j];
+  }
+
+  printf("%d conns: %lu requests, %lu errors in %lu usec, %lu req/sec\n",
+         nconns, total.requests, total.errors, usec,
+         total.requests * 1000000 / usec);
+  if (!total.requests)
+    return 0;
+  // Percentiles in tenths of a percent
+  static const struct { int permille; const char *name; } pcts[] = {
+    { 500, "p50" }, { 900, "p90" }, { 990, "p99" }, { 999, "p99.9" },
+  };
+  uint64_t seen = 0;
+  int j = 0;
+  printf("latency usec:");
+  for (auto &p : pcts) {
+    uint64_t want = total.requests * p.permille / 1000;
+    while (j < NBUCKETS - 1 && seen + total.hist[j] <= want)
+      seen += total.hist[j++];
+    printf(" %s %lu", p.name, bucket_usec(j));
+  }
+  printf("\n");
+  return 0;
+}
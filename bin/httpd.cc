@@ -1,28 +1,83 @@
+// usage: httpd [-v] [nworkers]
+//
+// A small HTTP/1.1 server on port 80.  GET sends a file with
+// sendfile() and PUT stores one.  Connections are kept alive unless
+// the client asks otherwise.  With nworkers, runs one worker thread
+// pinned to each of the first nworkers cores, each with its own
+// SO_REUSEPORT listening socket.  Each worker keeps the files it
+// serves most open, so a hot path costs neither an open() nor a
+// path lookup.  -v logs every connection and request.
+
 #include "types.h"
 #include "user.h"
 #include "lib.h"
+#include "pthread.h"
 
+#include <ctype.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/time.h>
 
 #include "sockutil.h"
 
-#define VERSION "0.1"
-#define HTTP_VERSION "1.0"
+#define VERSION "0.2"
+#define HTTP_VERSION "1.1"
 #define BUFSIZE 512
 
-static int xwrite(int fd, const void *buf, u64 n)
+// Open files each worker keeps, how long it trusts one before
+// checking that its path still names it, and the longest path it
+// keeps
+#define HOT_FILES 64
+#define HOT_TTL_USEC 1000000
+#define HOT_PATH_MAX 128
+
+static bool verbose;
+
+struct hot_file
+{
+  char path[HOT_PATH_MAX];
+  int fd;                       // -1 if unused
+  ino_t ino;
+  off_t size;
+  u64 checked;                  // now_usec() of the last check
+};
+
+struct worker
+{
+  struct hot_file hot[HOT_FILES];
+};
+
+// A connection, with a buffer for reading requests
+struct conn
+{
+  int s;
+  int pos, len;
+  char buf[BUFSIZE];
+};
+
+static u64
+now_usec(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, nullptr);
+  return (u64)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int
+write_all(int fd, const void *buf, u64 n)
 {
   int r;
-  
+
   while (n) {
     r = write(fd, buf, n);
     if (r < 0 || r == 0) {
-      fprintf(stderr, "xwrite: failed %d\n", r);
+      fprintf(stderr, "write_all: failed %d\n", r);
       return -1;
     }
     buf = (char *) buf + r;
@@ -32,6 +87,8 @@ static int xwrite(int fd, const void *buf, u64 n)
   return 0;
 }
 
+// Send an error page.  The connection can't be reused afterwards,
+// since the request may not have been read in full.
 static void
 error(int s, int code)
 {
@@ -43,7 +100,8 @@ error(int s, int code)
     { 404, "Page Not Found" },
     { 500, "Internal Server Error" },
   };
-  
+
+  char body[128];
   char buf[512];
   int i;
   int r;
@@ -55,102 +113,151 @@ error(int s, int code)
   if (i == NELEM(errors))
     die("httpd error: unknown code %u", code);
 
-  snprintf(buf, 512, "HTTP/" HTTP_VERSION" %d %s\r\n"
+  snprintf(body, sizeof(body),
+           "<html><body><p>%d - %s</p></body></html>\r\n",
+           errors[i].code, errors[i].msg);
+  snprintf(buf, sizeof(buf), "HTTP/" HTTP_VERSION " %d %s\r\n"
            "Server: xv6-httpd/" VERSION "\r\n"
            "Connection: close\r\n"
-           "Content-type: text/html\r\n"
+           "Content-Type: text/html\r\n"
+           "Content-Length: %d\r\n"
            "\r\n"
-           "<html><body><p>%d - %s</p></body></html>\r\n",
-           errors[i].code, errors[i].msg, 
-           errors[i].code, errors[i].msg);
+           "%s",
+           errors[i].code, errors[i].msg, (int)strlen(body), body);
   r = strlen(buf);
 
-  if (xwrite(s, buf, r))
+  if (write_all(s, buf, r))
     fprintf(stderr, "httpd error: incomplete write\n");
 }
 
+// Send a 200 header for a body of length bytes, all in one write
 static int
-header(int s)
+header(int s, u64 length, bool keepalive)
 {
-  static const char *h = "HTTP/" HTTP_VERSION " 200 OK\r\n"
-    "Server: xv6-httpd/" VERSION "\r\n";
-
+  char buf[256];
   int len;
 
-  len = strlen(h);
-  if (xwrite(s, h, len))
-    die("httpd header: incomplete write");
-
-  return 0;
+  len = snprintf(buf, sizeof(buf), "HTTP/" HTTP_VERSION " 200 OK\r\n"
+                 "Server: xv6-httpd/" VERSION "\r\n"
+                 "Connection: %s\r\n"
+                 "Content-Type: text/plain\r\n"
+                 "Content-Length: %lu\r\n"
+                 "\r\n",
+                 keepalive ? "keep-alive" : "close", length);
+  return write_all(s, buf, len);
 }
 
-static int
-header_fin(int s)
+static u32
+path_hash(const char *path)
 {
-  static const char *f = "\r\n";
-  
-  int len;
-
-  len = strlen(f);
-  if (xwrite(s, f, len))
-    die("httpd fin: incomplete write");
-
-  return 0;
+  u32 h = 2166136261u;
+  for (; *path; path++)
+    h = (h ^ (u8)*path) * 16777619u;
+  return h;
 }
 
-static int
-content_length(int s, u64 size)
+static void
+hot_forget(struct hot_file *h)
 {
-  char buf[128];
-  int len;
+  if (h->fd >= 0)
+    close(h->fd);
+  h->fd = -1;
+}
 
-  snprintf(buf, 128, "Content-Length: %lu\r\n", size);
-  len = strlen(buf);
+// Return w's open file for path, opening it if needed, or null if
+// path isn't a regular file we can cache.
+static struct hot_file *
+hot_get(struct worker *w, const char *path)
+{
+  struct stat st;
+
+  if (strlen(path) >= HOT_PATH_MAX)
+    return nullptr;
+  struct hot_file *h = &w->hot[path_hash(path) % HOT_FILES];
+  u64 now = now_usec();
+  if (h->fd >= 0 && strcmp(h->path, path) == 0) {
+    if (now - h->checked < HOT_TTL_USEC)
+      return h;
+    // The path may since name another file, or none
+    if (stat(path, &st) == 0 && st.st_ino == h->ino) {
+      h->size = st.st_size;
+      h->checked = now;
+      return h;
+    }
+  }
 
-  if (xwrite(s, buf, len))
-    die("httpd size: incomplete write");
+  hot_forget(h);
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return nullptr;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return nullptr;
+  }
+  strcpy(h->path, path);
+  h->fd = fd;
+  h->ino = st.st_ino;
+  h->size = st.st_size;
+  h->checked = now;
+  return h;
+}
 
-  return 0;
+// Drop path from w's cache, if it's there
+static void
+hot_drop(struct worker *w, const char *path)
+{
+  struct hot_file *h = &w->hot[path_hash(path) % HOT_FILES];
+  if (h->fd >= 0 && strcmp(h->path, path) == 0)
+    hot_forget(h);
 }
 
+// Send a regular file's size bytes from the start, without touching
+// its file offset, so other connections can share the FD
 static int
-content_type(int s)
+content(int s, int fd, off_t size)
 {
-  static const char *t = "Content-Type: text/plain\r\n";
+  off_t off = 0;
+  ssize_t n;
 
-  int len;
-
-  len = strlen(t);
-  if (xwrite(s, t, len))
-    die("httpd content_type: incomplete write");
+  while (off < size) {
+    n = sendfile(s, fd, &off, size - off);
+    if (n <= 0) {
+      fprintf(stderr, "httpd content: sendfile failed %d\n", (int)n);
+      return -1;
+    }
+  }
   return 0;
 }
 
+// Send a device until EOF, which is the only way to end the body
 static int
-content(int s, int fd)
+content_stream(int s, int fd)
 {
-  char buf[256];
-  int n;
+  ssize_t n;
 
   for (;;) {
-    n = read(fd, buf, sizeof(buf));
+    n = sendfile(s, fd, nullptr, 1 << 20);
     if (n < 0) {
-      fprintf(stderr, "send_data: read failed %d\n", n);
+      fprintf(stderr, "httpd content: sendfile failed %d\n", (int)n);
       return n;
     } else if (n == 0) {
       return 0;
     }
-    
-    if (xwrite(s, buf, n) < 0) {
-      fprintf(stderr, "httpd content: write failed\n");
-      return -1;
-    }
   }
 }
 
-static void
-resp_get(int s, const char *url)
+// Returns whether the connection can take another request
+static bool
+resp_get(struct worker *w, int s, const char *url, bool keepalive)
 {
+  struct hot_file *h = hot_get(w, url);
+  if (h) {
+    if (header(s, h->size, keepalive) < 0 || content(s, h->fd, h->size) < 0)
+      return false;
+    return keepalive;
+  }
+
+  // Not a regular file, so don't cache it
   struct stat stat;
   int fd;
   int r;
@@ -158,108 +265,101 @@ resp_get(int s, const char *url)
   fd = open(url, O_RDONLY);
   if (fd < 0) {
     error(s, 404);
-    return;
+    return false;
   }
 
   r = fstat(fd, &stat);
   if (r < 0) {
     fprintf(stderr, "httpd resp: fstat %d\n", r);
     close(fd);
-    return error(s, 404);
+    error(s, 404);
+    return false;
   }
 
-  if (!S_ISREG(stat.st_mode) && !S_ISCHR(stat.st_mode)) {
+  if (!S_ISCHR(stat.st_mode)) {
     close(fd);
-    return error(s, 404);
+    error(s, 404);
+    return false;
   }
 
-  r = header(s);
-  if (r < 0)
-    goto error;
-
-  r = content_length(s, stat.st_size);
-  if (r < 0)
-    goto error;
-
-  r = content_type(s);
-  if (r < 0)
-    goto error;
-
-  r = header_fin(s);
-  if (r < 0)
-    goto error;
-
-  r = content(s, fd);
-  if (r < 0)
-    goto error;
-  
+  if (header(s, stat.st_size, false) == 0)
+    content_stream(s, fd);
   close(fd);
-  return;
+  return false;
+}
 
-error:
-  close(fd);
-  error(s, 500);
+static int
+conn_read(struct conn *c, void *buf, int n)
+{
+  if (c->pos < c->len) {
+    if (n > c->len - c->pos)
+      n = c->len - c->pos;
+    memmove(buf, c->buf + c->pos, n);
+    c->pos += n;
+    return n;
+  }
+  return read(c->s, buf, n);
 }
 
-static void
-resp_put(int s, const char *url, int content_length)
+static bool
+resp_put(struct worker *w, struct conn *c, const char *url,
+         int content_length, bool keepalive)
 {
+  int s = c->s;
   int r;
 
   if (content_length < 0) {
     error(s, 400);
-    return;
+    return false;
   }
 
+  hot_drop(w, url);
   int fd = open(url, O_WRONLY|O_CREAT|O_TRUNC, 0666);
   if (fd < 0) {
     error(s, 404);
-    return;
+    return false;
   }
 
   char buf[1024];
-  while (content_length && (r = read(s, buf, NELEM(buf))) != 0) {
-    if (r < 0) {
+  while (content_length) {
+    r = conn_read(c, buf, content_length < NELEM(buf) ?
+                  content_length : NELEM(buf));
+    if (r <= 0) {
       fprintf(stderr, "httpd client: read %d\n", r);
-      r = -400;
       goto error;
     }
     content_length -= r;
-    r = xwrite(fd, buf, r);
+    r = write_all(fd, buf, r);
     if (r < 0) {
       fprintf(stderr, "httpd client: write %d\n", r);
-      r = -400;
       goto error;
     }
   }
 
-  r = header(s);
-  if (r < 0)
-    goto error;
-
-  r = header_fin(s);
-  if (r < 0)
-    goto error;
-
   close(fd);
-  return;
+  return header(s, 0, keepalive) == 0 && keepalive;
 
  error:
   close(fd);
   error(s, 500);
+  return false;
 }
 
 static int
-readline(int s, char *buf, int limit)
+readline(struct conn *c, char *buf, int limit)
 {
   char *pos = buf;
   while (pos < buf + limit - 1) {
-    int r = read(s, pos, 1);
-    if (r < 0)
-      return r;
-    if (r == 0)
-      break;
-    ++pos;
+    if (c->pos == c->len) {
+      int r = read(c->s, c->buf, sizeof(c->buf));
+      if (r < 0)
+        return r;
+      if (r == 0)
+        break;
+      c->pos = 0;
+      c->len = r;
+    }
+    *pos++ = c->buf[c->pos++];
     if (*(pos - 1) == '\n')
       break;
   }
@@ -268,7 +368,7 @@ readline(int s, char *buf, int limit)
 }
 
 static int
-parse(const char *b, char **rurl, const char **method)
+parse(const char *b, char **rurl, const char **method, bool *http11)
 {
   const char *url;
   int len;
@@ -287,6 +387,7 @@ parse(const char *b, char **rurl, const char **method)
   while (*b && *b != ' ')
     b++;
   len = b - url;
+  *http11 = strncmp(b, " HTTP/1.1", 9) == 0;
 
   r = (char *) malloc(len+1);
   if (r == nullptr)
@@ -298,55 +399,115 @@ parse(const char *b, char **rurl, const char **method)
   return 0;
 }
 
-static void
-client(int s)
+// If line is header name (given in lower case), return its value with
+// the line ending stripped
+static char *
+header_value(char *line, const char *name)
+{
+  for (; *name; line++, name++)
+    if (tolower(*line) != *name)
+      return nullptr;
+  if (*line++ != ':')
+    return nullptr;
+  while (*line == ' ')
+    line++;
+  line[strcspn(line, "\r\n")] = 0;
+  return line;
+}
+
+// Serve one request.  Returns whether the connection can take another.
+static bool
+request(struct worker *w, struct conn *c)
 {
   char b[BUFSIZE];
   char *url;
+  char *v;
   const char *method;
+  bool http11;
+  bool keepalive;
+  bool more;
   int r;
   int content_length = -1;
 
-  r = readline(s, b, NELEM(b));
-  if (r < 0) {
-    fprintf(stderr, "httpd client: read request %d\n", r);
-    return;
+  r = readline(c, b, NELEM(b));
+  if (r <= 0) {
+    if (r < 0)
+      fprintf(stderr, "httpd client: read request %d\n", r);
+    return false;
   }
 
-  r = parse(b, &url, &method);
+  r = parse(b, &url, &method, &http11);
   if (r < 0) {
-    error(s, 400);
-    return;
+    error(c->s, 400);
+    return false;
   }
 
+  // HTTP/1.1 connections persist unless the client says otherwise,
+  // and HTTP/1.0 ones only if it asks
+  keepalive = http11;
   do {
-    r = readline(s, b, NELEM(b));
+    r = readline(c, b, NELEM(b));
     if (r <= 0) {
       fprintf(stderr, "httpd client: read headers %d\n", r);
-      return;
+      free(url);
+      return false;
     }
-    if (strncmp(b, "Content-Length: ", 16) == 0)
-      content_length = atoi(b + 16);
+    if ((v = header_value(b, "content-length")))
+      content_length = atoi(v);
+    else if ((v = header_value(b, "connection")))
+      keepalive = strcasecmp(v, "keep-alive") == 0 ||
+        (keepalive && strcasecmp(v, "close") != 0);
   } while (strcmp(b, "\r\n"));
 
-  fprintf(stderr, "httpd client: %s %s\n", method, url);
+  if (verbose)
+    fprintf(stderr, "httpd client: %s %s\n", method, url);
   if (method[0] == 'G')
-    resp_get(s, url);
-  else if (method[0] == 'P')
-    resp_put(s, url, content_length);
+    more = resp_get(w, c->s, url, keepalive);
+  else
+    more = resp_put(w, c, url, content_length, keepalive);
   free(url);
+  return more;
 }
 
-int
-main(void)
+static void
+client(struct worker *w, int s)
 {
+  struct conn c;
+
+  c.s = s;
+  c.pos = c.len = 0;
+  while (request(w, &c))
+    ;
+}
+
+// Listen on port 80 and serve connections one at a time.  With
+// reuseport, each worker has its own listening socket and the kernel
+// spreads connections across them.
+static void *
+serve(void *arg)
+{
+  bool reuseport = arg != nullptr;
+  struct worker *w;
   int s;
   int r;
 
+  w = (struct worker *) malloc(sizeof(*w));
+  if (w == nullptr)
+    die("httpd: out of memory\n");
+  for (int i = 0; i < HOT_FILES; i++)
+    w->hot[i].fd = -1;
+
   s = socket(AF_INET, SOCK_STREAM, 0);
   if (s < 0)
     die("httpd socket: %d\n", s);
 
+  if (reuseport) {
+    int one = 1;
+    r = setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if (r < 0)
+      die("httpd setsockopt: %d\n", r);
+  }
+
   struct sockaddr_in sin;
   sin.sin_family = AF_INET;
   sin.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -354,26 +515,54 @@ main(void)
   r = bind(s, (struct sockaddr *)&sin, sizeof(sin));
   if (r < 0)
     die("httpd bind: %d\n", r);
-  
+
   r = listen(s, 5);
   if (r < 0)
     die("httpd listen: %d\n", r);
 
-  fprintf(stderr, "httpd: port 80\n");
-
   for (;;) {
     socklen_t socklen;
     int ss;
-    
+
     socklen = sizeof(sin);
     ss = accept(s, (struct sockaddr *)&sin, &socklen);
     if (ss < 0) {
       fprintf(stderr, "httpd accept: %d\n", ss);
       continue;
     }
-    fprintf(stderr, "httpd: connection %s\n", ipaddr(&sin));
+    if (verbose)
+      fprintf(stderr, "httpd: connection %s\n", ipaddr(&sin));
 
-    client(ss);
+    client(w, ss);
     close(ss);
   }
 }
+
+int
+main(int ac, char **av)
+{
+  int nworkers = 1;
+  int i = 1;
+
+  if (ac > i && strcmp(av[i], "-v") == 0) {
+    verbose = true;
+    i++;
+  }
+  if (ac > i)
+    nworkers = atoi(av[i]);
+  if (nworkers < 1)
+    die("usage: httpd [-v] [nworkers]\n");
+
+  fprintf(stderr, "httpd: port 80, %d worker(s)\n", nworkers);
+  if (nworkers == 1)
+    serve(nullptr);
+
+  for (i = 0; i < nworkers; i++) {
+    pthread_t tid;
+    setaffinity(i);
+    pthread_create(&tid, nullptr, serve, (void*)1);
+  }
+  for (i = 0; i < nworkers; i++)
+    wait(nullptr);
+  return 0;
+}
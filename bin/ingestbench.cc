@@ -0,0 +1,330 @@
+// usage: ingestbench serve port dir nconns [fsync-every [shared]]
+//        ingestbench send addr port nconns nrecords [recsize]
+//
+// Network-to-disk ingest benchmark.  The server accepts nconns TCP
+// connections and writes the records each one streams to a file of its
+// own in dir (or, with "shared", all to dir/ingest), calling fsync
+// every fsync-every records and once more at the end.  Then it tells
+// the sender its records are durable, and reports throughput, fsync
+// latency percentiles and the per-core journal stats from
+// /dev/txqstats.  The sender streams nrecords records of recsize bytes
+// on each of nconns connections and reports how long until all of them
+// were durable.  In the VM, the sender can use 127.0.0.1, which skips
+// the NIC.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+#include "libutil.h"
+
+#if defined(XV6_USER)
+#include "types.h"
+#include "user.h"
+#include "pthread.h"
+#else
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <pthread.h>
+#endif
+
+enum { MAGIC = 0x696e6773 };
+
+// Sent first on each connection, in network byte order
+struct hello
+{
+  uint32_t magic;
+  uint32_t recsize;
+  uint32_t nrecords;
+};
+
+struct conn
+{
+  int sock;
+  int fd;
+  uint64_t records;
+  uint64_t bytes;
+  uint64_t usec;
+  // Latency of each fsync, in microseconds
+  std::vector<uint64_t> fsyncs;
+};
+
+static int fsync_every = 16;
+static bool shared;
+static std::atomic<uint64_t> shared_off;
+
+// Read exactly n bytes, or fail
+static bool
+read_all(int s, void *buf, size_t n)
+{
+  char *p = (char *)buf;
+  while (n) {
+    ssize_t r = read(s, p, n);
+    if (r <= 0)
+      return false;
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+static bool
+write_all(int s, const void *buf, size_t n)
+{
+  const char *p = (const char *)buf;
+  while (n) {
+    ssize_t r = write(s, p, n);
+    if (r <= 0)
+      return false;
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+static void
+timed_fsync(struct conn *c)
+{
+  uint64_t start = now_usec();
+  if (fsync(c->fd) < 0)
+    die("ingestbench: fsync failed");
+  c->fsyncs.push_back(now_usec() - start);
+}
+
+static void *
+ingest(void *arg)
+{
+  struct conn *c = (struct conn *)arg;
+  struct hello h;
+  if (!read_all(c->sock, &h, sizeof(h)) || ntohl(h.magic) != MAGIC)
+    die("ingestbench: bad hello");
+  size_t recsize = ntohl(h.recsize);
+  uint32_t nrecords = ntohl(h.nrecords);
+  char *rec = (char *)malloc(recsize);
+  if (!rec)
+    die("ingestbench: out of memory");
+
+  uint64_t start = now_usec();
+  int unsynced = 0;
+  for (uint32_t i = 0; i < nrecords; i++) {
+    if (!read_all(c->sock, rec, recsize))
+      die("ingestbench: connection closed after %u records", i);
+    ssize_t r;
+    if (shared)
+      r = pwrite(c->fd, rec, recsize, shared_off.fetch_add(recsize));
+    else
+      r = write(c->fd, rec, recsize);
+    if (r != (ssize_t)recsize)
+      die("ingestbench: write failed");
+    c->records++;
+    c->bytes += recsize;
+    if (++unsynced == fsync_every) {
+      timed_fsync(c);
+      unsynced = 0;
+    }
+  }
+  if (unsynced)
+    timed_fsync(c);
+  c->usec = now_usec() - start;
+
+  char ack = 1;
+  if (!write_all(c->sock, &ack, 1))
+    die("ingestbench: ack failed");
+  close(c->sock);
+  free(rec);
+  return nullptr;
+}
+
+static void
+print_txqstats(void)
+{
+  char buf[4096];
+  int fd = open("/dev/txqstats", O_RDONLY);
+  if (fd < 0)
+    return;
+  ssize_t r;
+  while ((r = read(fd, buf, sizeof(buf))) > 0)
+    write_all(1, buf, r);
+  close(fd);
+}
+
+static void
+serve(int port, const char *dir, int nconns)
+{
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+  if (s < 0)
+    die("ingestbench: socket failed");
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_addr.s_addr = INADDR_ANY;
+  sin.sin_port = htons(port);
+  if (bind(s, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+    die("ingestbench: bind failed");
+  if (listen(s, nconns) < 0)
+    die("ingestbench: listen failed");
+
+  char path[256];
+  int sharedfd = -1;
+  if (shared) {
+    snprintf(path, sizeof(path), "%s/ingest", dir);
+    if ((sharedfd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+      die("ingestbench: cannot create %s", path);
+  }
+
+  struct conn *conns = new conn[nconns];
+  pthread_t *threads = new pthread_t[nconns];
+  uint64_t start = 0;
+  for (int i = 0; i < nconns; i++) {
+    struct conn *c = &conns[i];
+    socklen_t len = sizeof(sin);
+    if ((c->sock = accept(s, (struct sockaddr *)&sin, &len)) < 0)
+      die("ingestbench: accept failed");
+    if (!start)
+      start = now_usec();
+    if (shared) {
+      c->fd = sharedfd;
+    } else {
+      snprintf(path, sizeof(path), "%s/ingest.%d", dir, i);
+      if ((c->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0)
+        die("ingestbench: cannot create %s", path);
+    }
+    c->records = c->bytes = c->usec = 0;
+    pthread_create(&threads[i], nullptr, ingest, c);
+  }
+  close(s);
+
+  std::vector<uint64_t> fsyncs;
+  uint64_t records = 0, bytes = 0;
+  for (int i = 0; i < nconns; i++) {
+    pthread_join(threads[i], nullptr);
+    records += conns[i].records;
+    bytes += conns[i].bytes;
+    for (uint64_t f : conns[i].fsyncs)
+      fsyncs.push_back(f);
+    if (!shared)
+      close(conns[i].fd);
+  }
+  uint64_t usec = now_usec() - start;
+  if (shared)
+    close(sharedfd);
+  if (!usec)
+    usec = 1;
+
+  printf("%d conns: %lu records, %lu bytes in %lu usec, "
+         "%lu records/sec, %lu KB/sec\n",
+         nconns, records, bytes, usec, records * 1000000 / usec,
+         bytes * 1000000 / 1024 / usec);
+  if (!fsyncs.empty()) {
+    std::sort(fsyncs.begin(), fsyncs.end());
+    size_t n = fsyncs.size();
+    printf("%lu fsyncs, latency usec: p50 %lu p90 %lu p99 %lu max %lu\n",
+           n, fsyncs[n * 50 / 100], fsyncs[n * 90 / 100],
+           fsyncs[n * 99 / 100], fsyncs[n - 1]);
+  }
+  print_txqstats();
+  delete[] threads;
+  delete[] conns;
+}
+
+static struct sockaddr_in server;
+static uint32_t send_records;
+static uint32_t send_recsize = 4096;
+
+static void *
+sender(void *arg)
+{
+  uint64_t *usec = (uint64_t *)arg;
+  int s = socket(AF_INET, SOCK_STREAM, 0);
+  if (s < 0)
+    die("ingestbench: socket failed");
+  if (connect(s, (struct sockaddr *)&server, sizeof(server)) < 0)
+    die("ingestbench: connect failed");
+
+  char *rec = (char *)malloc(send_recsize);
+  if (!rec)
+    die("ingestbench: out of memory");
+  memset(rec, 'x', send_recsize);
+  uint64_t start = now_usec();
+  struct hello h = { htonl(MAGIC), htonl(send_recsize),
+                     htonl(send_records) };
+  if (!write_all(s, &h, sizeof(h)))
+    die("ingestbench: send failed");
+  for (uint32_t i = 0; i < send_records; i++)
+    if (!write_all(s, rec, send_recsize))
+      die("ingestbench: send failed");
+  char ack;
+  if (!read_all(s, &ack, 1))
+    die("ingestbench: no ack");
+  *usec = now_usec() - start;
+  close(s);
+  free(rec);
+  return nullptr;
+}
+
+static void
+send_all(const char *addr, int port, int nconns)
+{
+  unsigned a, b, c, d;
+  if (sscanf(addr, "%u.%u.%u.%u", &a, &b, &c, &d) != 4)
+    die("ingestbench: bad address %s", addr);
+  memset(&server, 0, sizeof(server));
+  server.sin_family = AF_INET;
+  server.sin_addr.s_addr = htonl(a << 24 | b << 16 | c << 8 | d);
+  server.sin_port = htons(port);
+
+  uint64_t *usecs = new uint64_t[nconns];
+  pthread_t *threads = new pthread_t[nconns];
+  uint64_t start = now_usec();
+  for (int i = 0; i < nconns; i++)
+    pthread_create(&threads[i], nullptr, sender, &usecs[i]);
+  uint64_t slowest = 0;
+  for (int i = 0; i < nconns; i++) {
+    pthread_join(threads[i], nullptr);
+    slowest = std::max(slowest, usecs[i]);
+  }
+  uint64_t usec = now_usec() - start;
+  if (!usec)
+    usec = 1;
+
+  uint64_t bytes = (uint64_t)nconns * send_records * send_recsize;
+  printf("%d conns: %lu bytes durable in %lu usec (slowest conn %lu), "
+         "%lu KB/sec\n", nconns, bytes, usec, slowest,
+         bytes * 1000000 / 1024 / usec);
+  delete[] threads;
+  delete[] usecs;
+}
+
+int
+main(int ac, char **av)
+{
+  if (ac >= 5 && strcmp(av[1], "serve") == 0) {
+    if (ac > 5)
+      fsync_every = atoi(av[5]);
+    shared = ac > 6 && strcmp(av[6], "shared") == 0;
+    int nconns = atoi(av[4]);
+    if (nconns < 1 || fsync_every < 1)
+      die("ingestbench: nconns and fsync-every must be positive");
+    serve(atoi(av[2]), av[3], nconns);
+  } else if (ac >= 6 && strcmp(av[1], "send") == 0) {
+    send_records = atoi(av[5]);
+    if (ac > 6)
+      send_recsize = atoi(av[6]);
+    int nconns = atoi(av[4]);
+    if (nconns < 1 || send_recsize < 1)
+      die("ingestbench: nconns and recsize must be positive");
+    send_all(av[2], atoi(av[3]), nconns);
+  } else {
+    die("usage: %s serve port dir nconns [fsync-every [shared]]\n"
+        "       %s send addr port nconns nrecords [recsize]", av[0], av[0]);
+  }
+  return 0;
+}
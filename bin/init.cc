@@ -45,6 +45,20 @@ static struct {
   { "/dev/mfsstats",    MAJ_MFSSTATS},
   { "/dev/blkstats",    MAJ_BLKSTATS},
   { "/dev/evict_caches",    MAJ_EVICTCACHES},
+  { "/dev/mountstats",    MAJ_MOUNTSTATS},
+  { "/dev/heapprof",    MAJ_HEAPPROF},
+  { "/dev/heapsamples",    MAJ_HEAPSAMPLES},
+  { "/dev/bufstats",    MAJ_BUFSTATS},
+  { "/dev/txqstats",    MAJ_TXQSTATS},
+  { "/dev/latstats",    MAJ_LATSTATS},
+  { "/dev/txtrace",     MAJ_TXTRACE},
+  { "/dev/disktrace",    MAJ_DISKTRACE},
+  { "/dev/lockprof",    MAJ_LOCKPROF},
+  { "/dev/fsperf",      MAJ_FSPERF},
+  { "/dev/ioacct",      MAJ_IOACCT},
+  { "/dev/memacct",     MAJ_MEMACCT},
+  { "/dev/memide",      MAJ_MEMIDE},
+  { "/dev/fsflags",     MAJ_FSFLAGS},
 };
 #endif
 
@@ -0,0 +1,135 @@
+// usage: latstats [command...]
+//
+// Print percentiles of the kernel's storage latency histograms (see
+// lathist.hh), merged over all cores.  With a command, only the
+// latencies recorded while it ran.
+
+#include "types.h"
+#include "user.h"
+#include "lathist.hh"
+#include "libutil.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+// The sum of all cores' histograms
+static void
+read_latstats(lathists *out)
+{
+  int fd = open("/dev/latstats", O_RDONLY);
+  if (fd < 0)
+    die("Couldn't open /dev/latstats");
+  std::vector<char> buf;
+  char chunk[4096];
+  int r;
+  while ((r = read(fd, chunk, sizeof chunk)) > 0)
+    for (int i = 0; i < r; i++)
+      buf.push_back(chunk[i]);
+  close(fd);
+  if (r < 0 || buf.size() % sizeof *out)
+    die("Bad read from /dev/latstats");
+
+  memset(out, 0, sizeof *out);
+  uint64_t *sum = (uint64_t *)out;
+  for (size_t off = 0; off < buf.size(); off += sizeof *out) {
+    const uint64_t *h = (const uint64_t *)&buf[off];
+    for (size_t i = 0; i < sizeof *out / sizeof *sum; i++)
+      sum[i] += h[i];
+  }
+}
+
+static uint64_t hz;
+
+// Print cycles as microseconds
+static void
+print_usec(uint64_t cycles)
+{
+  unsigned __int128 ns = (unsigned __int128)cycles * 1000000000 / hz;
+  printf(" %lu.%lu", (uint64_t)(ns / 1000), (uint64_t)(ns % 1000 / 100));
+}
+
+static void
+print_hist(const char *name, const uint64_t *hist)
+{
+  static const struct { int permille; const char *name; } pcts[] = {
+    { 500, "p50" }, { 900, "p90" }, { 990, "p99" }, { 999, "p99.9" },
+  };
+
+  uint64_t count = 0;
+  int last = 0;
+  for (int b = 0; b < LATHIST_BUCKETS; b++) {
+    count += hist[b];
+    if (hist[b])
+      last = b;
+  }
+  printf("%-14s %10lu", name, count);
+  if (!count) {
+    printf("\n");
+    return;
+  }
+
+  // Each percentile is reported as the upper bound of its bucket
+  uint64_t seen = 0;
+  int b = 0;
+  for (auto &p : pcts) {
+    uint64_t want = count * p.permille / 1000;
+    while (b < last && seen + hist[b] <= want)
+      seen += hist[b++];
+    printf(" %s", p.name);
+    print_usec(2ull << b);
+  }
+  printf(" max");
+  print_usec(2ull << last);
+  printf("\n");
+}
+
+int
+main(int ac, char * const av[])
+{
+  struct lathists before, after;
+
+  hz = cpuhz();
+  if (!hz)
+    die("latstats: unknown CPU frequency");
+
+  memset(&before, 0, sizeof before);
+  if (ac > 1) {
+    read_latstats(&before);
+
+    int pid = fork();
+    if (pid < 0)
+      die("latstats: fork failed");
+    if (pid == 0) {
+      std::vector<const char *> args(av + 1, av + ac);
+      args.push_back(nullptr);
+      execv(args[0], const_cast<char * const *>(args.data()));
+      die("latstats: exec failed");
+    }
+    wait(NULL);
+  }
+  read_latstats(&after);
+
+  uint64_t *a = (uint64_t *)&after;
+  const uint64_t *b = (const uint64_t *)&before;
+  for (size_t i = 0; i < sizeof after / sizeof *a; i++)
+    a[i] -= b[i];
+
+  printf("%-14s %10s  latency usec\n", "", "count");
+#define X(name) print_hist(#name, after.name);
+  LATHISTS_ALL(X);
+#undef X
+  for (int d = 0; d < NDISK; d++) {
+    char name[16];
+    snprintf(name, sizeof name, "disk%d", d);
+    bool used = false;
+    for (int i = 0; i < LATHIST_BUCKETS; i++)
+      used |= after.disk[d][i] != 0;
+    if (used)
+      print_hist(name, after.disk[d]);
+  }
+  return 0;
+}
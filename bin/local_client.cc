@@ -1,4 +1,11 @@
+// usage: local_client nmessages [batch]
+//
+// Sends nmessages requests to local_server and reads the replies, and
+// prints the message rate.  With a batch, sends and receives batch
+// messages per system call with sendmmsg() and recvmmsg().
+
 #if defined(LINUX)
+#define _GNU_SOURCE 1
 #include <errno.h>
 #include <unistd.h>
 #define die perror
@@ -15,9 +22,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 #define MAXMSG  512
+#define MAXBATCH 64   // Keep well below the socket queue length
 #define MESSAGE "Hello, local socket server?"
 
 int
@@ -52,12 +62,16 @@ main(int argc, char *argv[])
   struct sockaddr_un name;
   size_t size;
   int nbytes;
-  int nmsg;
+  int nmsg, batch = 1;
 
   if (argc < 2)
-    die("usage: %s nmessages", argv[0]);
+    die("usage: %s nmessages [batch]", argv[0]);
 
   nmsg = atoi(argv[1]);
+  if (argc > 2)
+    batch = atoi(argv[2]);
+  if (batch < 1 || batch > MAXBATCH)
+    die("batch must be between 1 and %d", MAXBATCH);
      
   sock = make_named_socket (CLIENT);
      
@@ -65,7 +79,53 @@ main(int argc, char *argv[])
   strcpy (name.sun_path, SERVER);
   size = strlen (name.sun_path) + sizeof (name.sun_family);
 
-  for (int i = 0; i < nmsg; i++) {
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+
+  for (int i = 0; batch > 1 && i < nmsg; i += batch) {
+    static char replies[MAXBATCH][MAXMSG];
+    struct mmsghdr msgs[MAXBATCH];
+    struct iovec iovs[MAXBATCH];
+    int n = nmsg - i < batch ? nmsg - i : batch;
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int j = 0; j < n; j++) {
+      iovs[j].iov_base = (void *) MESSAGE;
+      iovs[j].iov_len = strlen (MESSAGE) + 1;
+      msgs[j].msg_hdr.msg_name = &name;
+      msgs[j].msg_hdr.msg_namelen = size;
+      msgs[j].msg_hdr.msg_iov = &iovs[j];
+      msgs[j].msg_hdr.msg_iovlen = 1;
+    }
+    for (int sent = 0; sent < n; ) {
+      int r = sendmmsg (sock, msgs + sent, n - sent, 0);
+      if (r < 0)
+        die ("sendmmsg (client)");
+      sent += r;
+    }
+
+    memset(msgs, 0, sizeof(msgs));
+    for (int j = 0; j < n; j++) {
+      iovs[j].iov_base = replies[j];
+      iovs[j].iov_len = MAXMSG;
+      msgs[j].msg_hdr.msg_iov = &iovs[j];
+      msgs[j].msg_hdr.msg_iovlen = 1;
+    }
+    for (int got = 0; got < n; ) {
+      int r = recvmmsg (sock, msgs + got, n - got, MSG_WAITFORONE, NULL);
+      if (r < 0)
+        die ("recvmmsg (client)");
+      got += r;
+    }
+    for (int j = 0; j < n; j++) {
+      if (strcmp(replies[j], "ni hao") != 0) {
+        printf("client: message %s\n", replies[j]);
+        die ("data is incorrect (client)");
+      }
+    }
+  }
+
+  for (int i = 0; batch == 1 && i < nmsg; i++) {
     nbytes = sendto (sock, (void *) MESSAGE, strlen (MESSAGE) + 1, 0,
                      (struct sockaddr *) & name, size);
     if (nbytes < 0) {
@@ -85,6 +145,12 @@ main(int argc, char *argv[])
      
   }
 
+  gettimeofday(&end, NULL);
+  long usec = (end.tv_sec - start.tv_sec) * 1000000 +
+    (end.tv_usec - start.tv_usec);
+  printf("%d messages in %ld usec, %ld messages/sec (batch %d)\n",
+         nmsg, usec, usec ? (long)((double)nmsg * 1000000 / usec) : 0, batch);
+
   unlink (CLIENT);
   close (sock);
   return 0;
@@ -1,4 +1,11 @@
+// usage: local_server nthreads [batch]
+//
+// Answers local_client's requests.  With a batch, each thread
+// receives and answers up to batch requests per system call with
+// recvmmsg() and sendmmsg().
+
 #if defined(LINUX)
+#define _GNU_SOURCE 1
 #include <errno.h>
 #include <unistd.h>
 #define die perror
@@ -14,12 +21,59 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 
 #define MAXMSG  512
+#define MAXBATCH 64
 #define MESSAGE "ni hao"
 
 int sock;
+int batch = 1;
+
+static void
+batch_loop(int id)
+{
+  char messages[MAXBATCH][MAXMSG];
+  struct sockaddr_un names[MAXBATCH];
+  struct mmsghdr msgs[MAXBATCH];
+  struct iovec iovs[MAXBATCH];
+
+  while (1)
+  {
+    memset(msgs, 0, sizeof(msgs));
+    for (int j = 0; j < batch; j++) {
+      iovs[j].iov_base = messages[j];
+      iovs[j].iov_len = MAXMSG;
+      msgs[j].msg_hdr.msg_name = &names[j];
+      msgs[j].msg_hdr.msg_namelen = sizeof (names[j]);
+      msgs[j].msg_hdr.msg_iov = &iovs[j];
+      msgs[j].msg_hdr.msg_iovlen = 1;
+    }
+    int n = recvmmsg (sock, msgs, batch, MSG_WAITFORONE, NULL);
+    if (n < 0) {
+      die ("recvmmsg (server)");
+    }
+
+    for (int j = 0; j < n; j++) {
+      if (strcmp(messages[j], "Hello, local socket server?") != 0) {
+        printf("%d: message %s\n", id, messages[j]);
+        die ("data is incorrect (server)");
+      }
+      strcpy(messages[j], MESSAGE);
+      iovs[j].iov_len = strlen(MESSAGE)+1;
+    }
+
+    for (int sent = 0; sent < n; ) {
+      int r = sendmmsg (sock, msgs + sent, n - sent, 0);
+      if (r < 0)
+      {
+        die ("sendmmsg (server)");
+      }
+      sent += r;
+    }
+  }
+}
 
 int
 make_named_socket(const char *filename)
@@ -53,6 +107,9 @@ thread(void* x)
   socklen_t size;
   int nbytes;
 
+  if (batch > 1)
+    batch_loop(id);
+
   while (1)
   {
     size = sizeof (name);
@@ -88,9 +145,13 @@ main (int argc, char *argv[])
   unlink (SERVER);
 
   if (argc < 2)
-    die("usage: %s nthreads", argv[0]);
+    die("usage: %s nthreads [batch]", argv[0]);
 
   nthread = atoi(argv[1]);
+  if (argc > 2)
+    batch = atoi(argv[2]);
+  if (batch < 1 || batch > MAXBATCH)
+    die("batch must be between 1 and %d", MAXBATCH);
      
   sock = make_named_socket (SERVER);
 
@@ -69,29 +69,51 @@ ls(const std::string &path)
 
   case S_IFDIR:
     std::vector<std::string> names;
+    std::vector<struct stat> stats;
 #ifdef XV6_USER
-    char namebuf[DIRSIZ+1];
-    char *prev = nullptr;
-    while(readdir(fd, prev, namebuf) > 0) {
-      prev = namebuf;
-      names.push_back(path + '/' + namebuf);
+    struct getdents_rec recs[64];
+    struct stat sts[64];
+    ssize_t r;
+    while((r = getdents(fd, recs, sizeof(recs))) > 0) {
+      // Stat the whole batch at once instead of resolving each path.
+      size_t n = r / sizeof(recs[0]);
+      if (statat_many(fd, recs, n, sts, (enum stat_flags)0) != (ssize_t)n) {
+        fprintf(stderr, "ls: cannot stat entries of %s\n", path.c_str());
+        break;
+      }
+      for (size_t i = 0; i < n; i++) {
+        std::string n = path + '/' + recs[i].name;
+        if (sts[i].st_ino == 0) {
+          fprintf(stderr, "ls: cannot stat %s\n", n.c_str());
+          continue;
+        }
+        names.push_back(n);
+        stats.push_back(sts[i]);
+      }
     }
 #else
     DIR *dir = fdopendir(fd);
     struct dirent *de;
-    while ((de = readdir(dir)))
-      names.push_back(path + '/' + de->d_name);
-#endif
-
-    std::sort(names.begin(), names.end());
-
-    for (auto &n: names) {
+    while ((de = readdir(dir))) {
+      std::string n = path + '/' + de->d_name;
       if (stat(n.c_str(), &st) < 0){
         fprintf(stderr, "ls: cannot stat %s\n", n.c_str());
         continue;
       }
-      printout(&st, n);
+      names.push_back(n);
+      stats.push_back(st);
     }
+#endif
+
+    std::vector<size_t> order;
+    for (size_t i = 0; i < names.size(); i++)
+      order.push_back(i);
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return names[a] < names[b];
+      });
+
+    for (size_t i: order)
+      printout(&stats[i], names[i]);
     break;
   }
   close(fd);
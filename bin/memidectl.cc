@@ -0,0 +1,87 @@
+// usage: memidectl [-r read_us] [-w write_us] [-f flush_us] [-b MB/s]
+//                  [-q depth] [-o]
+//
+// Show or change the memory disk's device model (see memide.h): the
+// latencies of its reads, writes and cache flushes, its transfer rate cap
+// and its queue depth.  Options not given leave their part of the model as
+// it is, and -o turns the model off.  Then print the model and what the
+// memory disks have done under it.  For example, -r 80 -w 20 -f 500 -b 500
+// -q 32 is roughly a SATA SSD.
+
+#include "types.h"
+#include "user.h"
+#include "memide.h"
+#include "libutil.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static uint32_t
+parse(const char *arg)
+{
+  char *end;
+  long v = strtol(arg, &end, 10);
+  if (*end || v < 0 || v >= MEMIDE_KEEP)
+    die("memidectl: bad number %s", arg);
+  return v;
+}
+
+static void
+usage(const char *prog)
+{
+  die("usage: %s [-r read_us] [-w write_us] [-f flush_us] [-b MB/s] "
+      "[-q depth] [-o]", prog);
+}
+
+int
+main(int argc, char *argv[])
+{
+  struct memide_model m = {
+    MEMIDE_KEEP, MEMIDE_KEEP, MEMIDE_KEEP, MEMIDE_KEEP, MEMIDE_KEEP,
+  };
+  bool set = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "r:w:f:b:q:o")) != -1) {
+    switch (opt) {
+    case 'r':
+      m.read_us = parse(optarg);
+      break;
+    case 'w':
+      m.write_us = parse(optarg);
+      break;
+    case 'f':
+      m.flush_us = parse(optarg);
+      break;
+    case 'b':
+      m.mbps = parse(optarg);
+      break;
+    case 'q':
+      m.queue_depth = parse(optarg);
+      break;
+    case 'o':
+      m.read_us = m.write_us = m.flush_us = m.mbps = 0;
+      break;
+    default:
+      usage(argv[0]);
+    }
+    set = true;
+  }
+  if (optind != argc)
+    usage(argv[0]);
+
+  int fd = open("/dev/memide", O_RDWR);
+  if (fd < 0)
+    die("memidectl: cannot open /dev/memide");
+  if (set && write(fd, &m, sizeof(m)) != sizeof(m))
+    die("memidectl: cannot set the model (no memory disk?)");
+
+  char buf[1024];
+  ssize_t r;
+  while ((r = read(fd, buf, sizeof buf)) > 0)
+    xwrite(1, buf, r);
+  close(fd);
+  return 0;
+}
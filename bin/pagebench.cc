@@ -0,0 +1,53 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sysstubs.h"
+#include "libutil.h"
+
+// Measure the kernel's page copy and zero variants (see pagecopy.hh), on
+// a working set that fits in the cache and on one that doesn't, and
+// report GB/s for each.  The kernel picks one copy and one zero variant
+// at boot; this shows whether it picked right on this machine.
+
+static const char *copy_names[] = { "movsq", "movsb", "unrolled", "nt" };
+static const char *zero_names[] = { "stosq", "stosb", "zpage", "zpage_nc" };
+
+static void
+bench(int op, const char *const *names, int nvariants, u64 npages,
+      u64 touched)
+{
+  u64 rounds = touched / npages;
+  if (!rounds)
+    rounds = 1;
+  for (int v = 0; v < nvariants; v++) {
+    long ns = pagebench(op, v, npages, rounds);
+    if (ns < 0)
+      die("pagebench: pagebench(%d, %d, %lu, %lu) failed",
+          op, v, npages, rounds);
+    double gbps = ns ? (double)npages * rounds * 4096 / ns : 0;
+    printf("%-6s %-10s %8lu %8.2f\n", op == 0 ? "copy" : "zero", names[v],
+           npages * 4, gbps);
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  // Pages of the large working set, and pages to touch per variant
+  u64 big = argc >= 2 ? atoi(argv[1]) : 8192;
+  u64 touched = 256 * 1024;
+
+  if (argc > 2 || !big)
+    die("usage: %s [pages]", argv[0]);
+
+  // Small enough for the L1 cache to hold both sides of a copy
+  u64 sizes[] = { 2, big };
+
+  printf("%-6s %-10s %8s %8s\n", "op", "variant", "KB", "GB/s");
+  for (u64 npages : sizes) {
+    bench(0, copy_names, 4, npages, touched);
+    bench(1, zero_names, 4, npages, touched);
+  }
+  return 0;
+}
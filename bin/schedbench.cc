@@ -36,19 +36,19 @@ void* worker0(void* x)
 
   if (id & 0x1) {
     for (u64 i = 0; i < iters; i++) {
-      r = futex(f, FUTEX_WAIT, (u64)(i<<1), 0);
+      r = futex(f, FUTEX_WAIT, (u64)(i<<1), 0, nullptr, 0);
       if (r < 0 && r != -EWOULDBLOCK)
         die("futex: %ld", r);
       *f = (i<<1)+2;
-      r = futex(f, FUTEX_WAKE, 1, 0);
-      assert(r == 0);
+      r = futex(f, FUTEX_WAKE, 1, 0, nullptr, 0);
+      assert(r >= 0);
     }
   } else {
     for (u64 i = 0; i < iters; i++) {
       *f = (i<<1)+1;
-      r = futex(f, FUTEX_WAKE, 1, 0);
-      assert(r == 0);
-      r = futex(f, FUTEX_WAIT, (u64)(i<<1)+1, 0);
+      r = futex(f, FUTEX_WAKE, 1, 0, nullptr, 0);
+      assert(r >= 0);
+      r = futex(f, FUTEX_WAIT, (u64)(i<<1)+1, 0, nullptr, 0);
       if (r < 0 && r != -EWOULDBLOCK)
         die("futex: %ld", r);
     }
@@ -106,7 +106,7 @@ void* worker0(void* x)
 
   for (i = 0; i < iters; i++) {
     ++waiting;
-    r = futex((u64*)&ftx, FUTEX_WAIT, (u64)i, 0);
+    r = futex((u64*)&ftx, FUTEX_WAIT, (u64)i, 0, nullptr, 0);
     if (r < 0 && r != -EWOULDBLOCK)
       die("FUTEX_WAIT: %d", r);
     while (waking.load() == 1)
@@ -127,8 +127,8 @@ void master0(void)
     
     waking.store(1);
     ftx = i+1;
-    r = futex((u64*)&ftx, FUTEX_WAKE, nworkers, 0);  
-    assert(r == 0);
+    r = futex((u64*)&ftx, FUTEX_WAKE, nworkers, 0, nullptr, 0);  
+    assert(r >= 0);
     waking.store(0);
   }
 }
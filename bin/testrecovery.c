@@ -8,6 +8,9 @@
 #if !defined(XV6_USER)
 #include <sys/types.h>
 #include <sys/stat.h>
+#else
+#include "types.h"
+#include "user.h"
 #endif
 
 #include "libutil.h"
@@ -17,11 +20,161 @@
 
 void usage(char *prog)
 {
-  fprintf(stderr, "Usage: %s [-c cpus] [-o] <working directory>\n", prog);
+  fprintf(stderr, "Usage: %s [-c cpus] [-o] [-b percent] <working directory>\n"
+          "       %s -r\n", prog, prog);
   fprintf(stderr, "-o overflow some of the per-core journals\n");
+  fprintf(stderr, "-b fill the journals of the first cpus cores to percent "
+          "of their capacity, and halt\n");
+  fprintf(stderr, "-r after the reboot that follows -b, report how long "
+          "mounting took\n");
   exit(1);
 }
 
+#if defined(XV6_USER)
+// Read all of the stats file path into buf, which holds size bytes.
+static void read_stats(const char *path, char *buf, size_t size)
+{
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    die("cannot open %s\n", path);
+  size_t len = 0;
+  ssize_t r;
+  while (len < size - 1 && (r = read(fd, buf + len, size - 1 - len)) > 0)
+    len += r;
+  buf[len] = 0;
+  close(fd);
+}
+
+// The bytes taken up in the journal of cpu, and its capacity, from the
+// "cpu N segments N capacity N stalls N peak N used N" lines of
+// /dev/txqstats.
+static void journal_fill(int cpu, unsigned long *used, unsigned long *cap)
+{
+  static char buf[65536];
+  char key[32];
+  read_stats("/dev/txqstats", buf, sizeof(buf));
+  char *p = strstr(buf, "JOURNAL SIZES:");
+  snprintf(key, sizeof(key), "\ncpu %d segments ", cpu);
+  if (p)
+    p = strstr(p, key);
+  char *c = p ? strstr(p, " capacity ") : NULL;
+  char *u = p ? strstr(p, " used ") : NULL;
+  if (!c || !u)
+    die("no journal size for cpu %d in /dev/txqstats\n", cpu);
+  *cap = strtoul(c + strlen(" capacity "), NULL, 10);
+  *used = strtoul(u + strlen(" used "), NULL, 10);
+}
+#endif
+
+// Fill the per-core journals of cores [0, num_cpus) to percent of their
+// capacity with committed but unapplied transactions (the file system only
+// applies them once a journal runs out of space, or on sync), and crash by
+// halting without a sync, so that the next mount has to recover and replay
+// all of them. Each core creates and fsyncs files in a directory of its own,
+// so that the journals don't depend on each other.
+static void fill_and_halt(const char *dirname, int num_cpus, int percent)
+{
+#if defined(XV6_USER)
+  char buf[128], subdir[128], filename[160];
+  for (int cpu = 0; cpu < num_cpus; cpu++) {
+    setaffinity(cpu);
+    snprintf(subdir, sizeof(subdir), "%s/cpu%d", dirname, cpu);
+    if (mkdir(subdir, 0777) != 0)
+      die("mkdir %s failed\n", subdir);
+  }
+  // Whatever the mkdirs left in the journals goes; the crash should leave
+  // only what we measure.
+  sync();
+
+  for (int cpu = 0; cpu < num_cpus; cpu++) {
+    setaffinity(cpu);
+    snprintf(subdir, sizeof(subdir), "%s/cpu%d", dirname, cpu);
+    unsigned long used, cap, last = 0;
+    int n = 0;
+    for (;;) {
+      journal_fill(cpu, &used, &cap);
+      // Applying the journal empties it: the previous fsync was one too many
+      // for this capacity, so the target can't be reached without overflow.
+      if (used < last)
+        die("journal of cpu %d overflowed at %lu of %lu bytes\n", cpu, last,
+            cap);
+      if (used * 100 >= cap * percent)
+        break;
+      last = used;
+
+      snprintf(filename, sizeof(filename), "%s/file%d.txt", subdir, n);
+      memset(buf, 0, sizeof(buf));
+      snprintf(buf, sizeof(buf), "filenum: %d cpu: %d\n", n, cpu);
+      int fd = open(filename, O_CREAT|O_WRONLY, 0666);
+      if (fd < 0)
+        die("open %s failed\n", filename);
+      if (write(fd, buf, sizeof(buf)) != sizeof(buf))
+        die("write %s failed\n", filename);
+      if (fsync(fd) < 0)
+        die("fsync %s failed\n", filename);
+      close(fd);
+
+      fd = open(subdir, O_RDONLY|O_DIRECTORY);
+      if (fd >= 0) {
+        if (fsync(fd) < 0)
+          die("fsync %s failed\n", subdir);
+        close(fd);
+      }
+      n++;
+    }
+    printf("cpu %d: %d files, journal %lu of %lu bytes (%lu%%)\n", cpu, n,
+           used, cap, used * 100 / cap);
+  }
+
+  printf("halting; run testrecovery -r after the reboot\n");
+  fflush(stdout);
+  halt();
+  die("halt returned\n");
+#else
+  die("-b needs the xv6 kernel's /dev/txqstats and halt()\n");
+#endif
+}
+
+// Print the phases of the last mount from /dev/mountstats, whose lines are
+// "phase: N cycles N blocks read N objects", in milliseconds. recover is
+// recover_journal (reading and checking the journals) plus replay (writing
+// back their blocks).
+static void report_mount(void)
+{
+#if defined(XV6_USER)
+  static char buf[4096];
+  unsigned long hz = cpuhz();
+  if (!hz)
+    die("unknown CPU frequency\n");
+  read_stats("/dev/mountstats", buf, sizeof(buf));
+
+  printf("%-16s %10s %12s %10s\n", "# phase", "ms", "blocks read",
+         "objects");
+  for (char *line = buf; *line; ) {
+    char *end = strchr(line, '\n');
+    if (end)
+      *end = 0;
+    char *colon = strchr(line, ':');
+    if (colon) {
+      *colon = 0;
+      char *p = colon + 1;
+      unsigned long cycles = strtoul(p, &p, 10);
+      p = strstr(p, "cycles");
+      unsigned long blocks = p ? strtoul(p + strlen("cycles"), &p, 10) : 0;
+      p = p ? strstr(p, "read") : NULL;
+      unsigned long objects = p ? strtoul(p + strlen("read"), NULL, 10) : 0;
+      printf("%-16s %10.3f %12lu %10lu\n", line,
+             (double)cycles * 1000 / hz, blocks, objects);
+    }
+    if (!end)
+      break;
+    line = end + 1;
+  }
+#else
+  die("-r needs the xv6 kernel's /dev/mountstats\n");
+#endif
+}
+
 int main(int argc, char **argv)
 {
   char ch;
@@ -29,7 +182,7 @@ int main(int argc, char **argv)
   extern int optind;
 
   char *topdir;
-  int num_cpus, overflow_journal;
+  int num_cpus, overflow_journal, fill_percent, report;
 
   /* Parse and test the arguments. */
   if (argc < 2)
@@ -38,8 +191,10 @@ int main(int argc, char **argv)
   /* Set the defaults */
   num_cpus = 1;
   overflow_journal = 0;
+  fill_percent = 0;
+  report = 0;
 
-  while ((ch = getopt(argc, argv, "c:o")) != -1) {
+  while ((ch = getopt(argc, argv, "c:ob:r")) != -1) {
     switch (ch) {
       case 'c':
         num_cpus = atoi(optarg);
@@ -51,14 +206,31 @@ int main(int argc, char **argv)
         overflow_journal = 1;
         break;
 
+      case 'b':
+        fill_percent = atoi(optarg);
+        if (fill_percent <= 0 || fill_percent >= 100)
+          usage(argv[0]);
+        break;
+
+      case 'r':
+        report = 1;
+        break;
+
       default:
         usage(argv[0]);
         exit(1);
     }
   }
 
+  if (report) {
+    report_mount();
+    return 0;
+  }
+
   argc -= optind;
   argv += optind;
+  if (argc < 1)
+    usage(argv[-optind]);
 
   topdir = argv[0];
 
@@ -70,6 +242,9 @@ int main(int argc, char **argv)
   if (mkdir(dirname, 0777) != 0)
     die("mkdir %s failed\n", dirname);
 
+  if (fill_percent)
+    fill_and_halt(dirname, num_cpus, fill_percent);
+
   sync();
 
   // Create files in a shared directory and fsync the files and the directory
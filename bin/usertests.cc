@@ -4,6 +4,7 @@
 #include "traps.h"
 #include "pthread.h"
 #include "rnd.hh"
+#include "kstats.hh"
 
 #include <fcntl.h>
 #include <sys/mman.h>
@@ -14,6 +15,11 @@
 #include <setjmp.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/io_ring.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 #include <utility>
 
@@ -1992,6 +1998,952 @@ writeprotecttest(void)
   munmap(buffer, 4 * 4096);
 }
 
+// Drop the page cache and then the buffer cache, so that file data has to
+// come back from the disk.
+static void
+evict_caches(void)
+{
+  int fd = open("/dev/evict_caches", O_WRONLY);
+  if (fd < 0)
+    die("cannot open /dev/evict_caches");
+  if (write(fd, "2", 1) != 1 || write(fd, "1", 1) != 1)
+    die("evict_caches failed");
+  close(fd);
+}
+
+// Data that fsync() says is on the disk must read back once the caches are
+// gone.  This covers writes that don't fill a block layer window, which have
+// to be started by the commit itself.
+void
+fsyncdrop(void)
+{
+  enum { NBLOCKS = 3 };
+  static char wbuf[NBLOCKS * BSIZE], rbuf[NBLOCKS * BSIZE];
+
+  printf("fsyncdrop\n");
+  for (int i = 0; i < sizeof(wbuf); i++)
+    wbuf[i] = 'a' + (i / 7) % 26;
+
+  int fd = open("fsyncdrop", O_CREAT|O_RDWR, 0666);
+  if (fd < 0)
+    die("open fsyncdrop failed");
+  if (write(fd, wbuf, sizeof(wbuf)) != sizeof(wbuf))
+    die("write fsyncdrop failed");
+  if (fsync(fd) < 0)
+    die("fsync fsyncdrop failed");
+  close(fd);
+
+  evict_caches();
+
+  fd = open("fsyncdrop", O_RDONLY);
+  if (fd < 0)
+    die("reopen fsyncdrop failed");
+  if (read(fd, rbuf, sizeof(rbuf)) != sizeof(rbuf))
+    die("short read of fsyncdrop");
+  if (memcmp(wbuf, rbuf, sizeof(wbuf)) != 0)
+    die("fsyncdrop: wrong data after dropping the caches");
+  close(fd);
+  unlink("fsyncdrop");
+  printf("fsyncdrop ok\n");
+}
+
+// Drop just the page cache, as the page-cache reclaimer does, leaving the
+// buffer cache alone.
+static void
+evict_pagecache(void)
+{
+  int fd = open("/dev/evict_caches", O_WRONLY);
+  if (fd < 0)
+    die("cannot open /dev/evict_caches");
+  if (write(fd, "2", 1) != 1)
+    die("evict_caches failed");
+  close(fd);
+}
+
+// A page read through the buffer cache, then rewritten and fsynced from the
+// page cache (which bypasses the buffer cache), must not come back with its
+// old contents once the page alone is evicted.
+void
+pagecachestale(void)
+{
+  enum { NBLOCKS = 4 };
+  static char wbuf[NBLOCKS * BSIZE], rbuf[NBLOCKS * BSIZE];
+
+  printf("pagecachestale\n");
+  memset(wbuf, 'a', sizeof(wbuf));
+  int fd = open("pcstale", O_CREAT|O_RDWR, 0666);
+  if (fd < 0 || write(fd, wbuf, sizeof(wbuf)) != sizeof(wbuf) || fsync(fd) < 0)
+    die("pagecachestale: create failed");
+  close(fd);
+  evict_caches();
+
+  // Load the pages, and with them the blocks into the buffer cache.
+  fd = open("pcstale", O_RDWR);
+  if (fd < 0 || read(fd, rbuf, sizeof(rbuf)) != sizeof(rbuf))
+    die("pagecachestale: read failed");
+
+  for (int i = 0; i < sizeof(wbuf); i++)
+    wbuf[i] = 'b' + i % 23;
+  if (pwrite(fd, wbuf, sizeof(wbuf), 0) != sizeof(wbuf) || fsync(fd) < 0)
+    die("pagecachestale: rewrite failed");
+  evict_pagecache();
+  if (pread(fd, rbuf, sizeof(rbuf), 0) != sizeof(rbuf) ||
+      memcmp(wbuf, rbuf, sizeof(wbuf)) != 0)
+    die("pagecachestale: stale data after evicting the rewritten pages");
+
+  // Once more for a single block in the middle.
+  memset(wbuf + BSIZE, 'z', BSIZE);
+  if (pwrite(fd, wbuf + BSIZE, BSIZE, BSIZE) != BSIZE || fsync(fd) < 0)
+    die("pagecachestale: block rewrite failed");
+  evict_pagecache();
+  if (pread(fd, rbuf, sizeof(rbuf), 0) != sizeof(rbuf) ||
+      memcmp(wbuf, rbuf, sizeof(wbuf)) != 0)
+    die("pagecachestale: stale block after evicting its page");
+
+  close(fd);
+  unlink("pcstale");
+  printf("pagecachestale ok\n");
+}
+
+// O_DIRECT on whole pages of anonymous memory goes between them and the
+// file's blocks; anything else goes through the page cache.  Either way,
+// buffered reads must see what a direct write put on the disk.
+void
+directiotest(void)
+{
+  enum { NPAGES = 4 };
+  static char fbuf[NPAGES * 4096];
+  printf("directiotest\n");
+
+  memset(fbuf, 'a', sizeof(fbuf));
+  int fd = open("dio", O_CREAT|O_RDWR, 0666);
+  if (fd < 0 || write(fd, fbuf, sizeof(fbuf)) != sizeof(fbuf) || fsync(fd) < 0)
+    die("directiotest: create failed");
+  // Bring the file into the page cache and its blocks into the buffer cache.
+  evict_caches();
+  if (pread(fd, fbuf, sizeof(fbuf), 0) != sizeof(fbuf))
+    die("directiotest: buffered read failed");
+
+  char *wp = (char*)mmap(0, 2 * 4096, PROT_READ|PROT_WRITE,
+                         MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  char *rp = (char*)mmap(0, 2 * 4096, PROT_READ|PROT_WRITE,
+                         MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  if (wp == MAP_FAILED || rp == MAP_FAILED)
+    die("directiotest: mmap failed");
+  for (int i = 0; i < 2 * 4096; i++)
+    wp[i] = 'b' + i % 19;
+
+  int dfd = open("dio", O_RDWR|O_DIRECT);
+  if (dfd < 0)
+    die("directiotest: open O_DIRECT failed");
+  if (pwrite(dfd, wp, 2 * 4096, 4096) != 2 * 4096)
+    die("directiotest: direct pwrite failed");
+  if (pread(dfd, rp, 2 * 4096, 4096) != 2 * 4096 ||
+      memcmp(wp, rp, 2 * 4096) != 0)
+    die("directiotest: direct pread doesn't match");
+
+  // Buffered reads, from the page cache and then from the disk
+  memcpy(fbuf + 4096, wp, 2 * 4096);
+  static char rbuf[NPAGES * 4096];
+  for (int pass = 0; pass < 2; pass++) {
+    if (pread(fd, rbuf, sizeof(rbuf), 0) != sizeof(rbuf) ||
+        memcmp(fbuf, rbuf, sizeof(rbuf)) != 0)
+      die("directiotest: buffered read after a direct write is stale");
+    evict_pagecache();
+  }
+
+  // Unaligned I/O, and a write that grows the file, fall back to the page
+  // cache.
+  memcpy(fbuf + 4097, "xyz", 3);
+  if (pwrite(dfd, "xyz", 3, 4097) != 3 || pread(dfd, rbuf, 5, 4096) != 5 ||
+      memcmp(rbuf, fbuf + 4096, 5) != 0)
+    die("directiotest: unaligned fallback failed");
+  if (pwrite(dfd, wp, 4096, sizeof(fbuf)) != 4096 ||
+      pread(fd, rbuf, 4096, sizeof(fbuf)) != 4096 ||
+      memcmp(rbuf, wp, 4096) != 0)
+    die("directiotest: extending direct write failed");
+  if (pread(dfd, rp, 4096, 2 * sizeof(fbuf)) != 0)
+    die("directiotest: direct read past the end");
+
+  munmap(wp, 2 * 4096);
+  munmap(rp, 2 * 4096);
+  close(dfd);
+  close(fd);
+  unlink("dio");
+  printf("directiotest ok\n");
+}
+
+// The root file system's SB_* format flags, from /dev/fsflags.
+static unsigned
+fsflags(void)
+{
+  char buf[32];
+  int fd = open("/dev/fsflags", O_RDONLY);
+  if (fd < 0)
+    die("cannot open /dev/fsflags");
+  int n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    die("cannot read /dev/fsflags");
+  buf[n] = 0;
+  return strtoul(buf, nullptr, 10);
+}
+
+// fallocate() reserves unwritten extents, which read as zeros until they are
+// written; block-mapped file systems (no mkfs -e) can't record them.
+void
+fallocatetest(void)
+{
+  static char buf[3 * BSIZE], zero[3 * BSIZE];
+  struct stat st;
+  printf("fallocatetest\n");
+
+  int fd = open("falloc", O_CREAT|O_RDWR, 0666);
+  if (fd < 0)
+    die("fallocatetest: create failed");
+  if (!(fsflags() & SB_EXTENTS)) {
+    if (fallocate(fd, 0, 0, BSIZE) != -1)
+      die("fallocatetest: fallocate on a block-mapped file system");
+    close(fd);
+    unlink("falloc");
+    printf("fallocatetest ok (block-mapped)\n");
+    return;
+  }
+
+  if (fallocate(fd, 0, 0, 0) != -1 || fallocate(fd, 0, -1, BSIZE) != -1 ||
+      fallocate(fd, 0x80, 0, BSIZE) != -1)
+    die("fallocatetest: bad arguments accepted");
+
+  // Without FALLOC_FL_KEEP_SIZE the file grows to cover the range.
+  if (fallocate(fd, 0, 0, 2 * BSIZE + 100) < 0)
+    die("fallocatetest: fallocate failed");
+  if (fstat(fd, &st) < 0 || st.st_size != 2 * BSIZE + 100)
+    die("fallocatetest: size not extended");
+  if (pread(fd, buf, sizeof(buf), 0) != 2 * BSIZE + 100 ||
+      memcmp(buf, zero, 2 * BSIZE + 100) != 0)
+    die("fallocatetest: preallocated range doesn't read as zeros");
+
+  // With it, the size stays put, even for a range past the end.
+  if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, 3 * BSIZE) < 0 ||
+      fallocate(fd, FALLOC_FL_KEEP_SIZE, 8 * BSIZE, BSIZE) < 0)
+    die("fallocatetest: keep-size fallocate failed");
+  if (fstat(fd, &st) < 0 || st.st_size != 2 * BSIZE + 100)
+    die("fallocatetest: keep-size fallocate changed the size");
+
+  // Data written into part of the range survives the caches, with the rest
+  // still zeros.
+  memset(buf, 0, sizeof(buf));
+  memset(buf + BSIZE + 10, 'w', 50);
+  if (pwrite(fd, buf + BSIZE + 10, 50, BSIZE + 10) != 50 || fsync(fd) < 0)
+    die("fallocatetest: write into the range failed");
+  close(fd);
+  evict_caches();
+  fd = open("falloc", O_RDONLY);
+  if (fd < 0 || pread(fd, zero, sizeof(zero), 0) != 2 * BSIZE + 100 ||
+      memcmp(buf, zero, 2 * BSIZE + 100) != 0)
+    die("fallocatetest: wrong data after fsync and evicting the caches");
+
+  close(fd);
+  unlink("falloc");
+  printf("fallocatetest ok\n");
+}
+
+static void
+read_kstats(kstats *out)
+{
+  int fd = open("/dev/kstats", O_RDONLY);
+  if (fd < 0)
+    die("cannot open /dev/kstats");
+  if (read(fd, out, sizeof *out) != sizeof *out)
+    die("short read from /dev/kstats");
+  close(fd);
+}
+
+// fdatasync() and sync_file_range() write a file's data back without always
+// updating its inode; what they write must read back once the caches are
+// gone. Pages that the caches can't drop because they are dirty read back
+// without touching the disk.
+void
+datasynctest(void)
+{
+  enum { NPAGES = 3 };
+  static char buf[NPAGES * 4096], rbuf[NPAGES * 4096];
+  kstats before, after;
+  printf("datasynctest\n");
+
+  memset(buf, 'a', sizeof(buf));
+  int fd = open("dsync", O_CREAT|O_RDWR, 0666);
+  if (fd < 0 || write(fd, buf, sizeof(buf)) != sizeof(buf) || fsync(fd) < 0)
+    die("datasynctest: create failed");
+
+  // A range sync writes back only the pages in the range, and leaves the
+  // file dirty for the rest.
+  memset(buf, 'b', 4096);
+  memset(buf + 2 * 4096, 'c', 4096);
+  if (pwrite(fd, buf, 4096, 0) != 4096 ||
+      pwrite(fd, buf + 2 * 4096, 4096, 2 * 4096) != 4096)
+    die("datasynctest: overwrite failed");
+  if (sync_file_range(fd, 0, 4096) < 0)
+    die("datasynctest: sync_file_range failed");
+  evict_caches();
+  read_kstats(&before);
+  if (pread(fd, rbuf, 4096, 2 * 4096) != 4096 ||
+      memcmp(rbuf, buf + 2 * 4096, 4096) != 0)
+    die("datasynctest: wrong data past the synced range");
+  read_kstats(&after);
+  if (after.disk_read_blocks != before.disk_read_blocks)
+    die("datasynctest: page past the synced range was written back");
+  if (fsync(fd) < 0)
+    die("datasynctest: fsync failed");
+  read_kstats(&before);
+  if (before.fs_sync_file_count == after.fs_sync_file_count)
+    die("datasynctest: file clean after a range sync");
+  evict_caches();
+  if (pread(fd, rbuf, sizeof(rbuf), 0) != sizeof(rbuf) ||
+      memcmp(rbuf, buf, sizeof(rbuf)) != 0)
+    die("datasynctest: wrong data after range sync and fsync");
+
+  // An in-place overwrite needs no inode update.
+  memset(buf + 4096 + 100, 'd', 200);
+  if (pwrite(fd, buf + 4096 + 100, 200, 4096 + 100) != 200 ||
+      fdatasync(fd) < 0)
+    die("datasynctest: in-place fdatasync failed");
+  evict_caches();
+  if (pread(fd, rbuf, sizeof(rbuf), 0) != sizeof(rbuf) ||
+      memcmp(rbuf, buf, sizeof(rbuf)) != 0)
+    die("datasynctest: wrong data after in-place fdatasync");
+
+  // An extending write does: the file's blocks are read back only up to the
+  // size that the inode has.
+  memset(rbuf, 'e', 1000);
+  if (pwrite(fd, rbuf, 1000, sizeof(buf)) != 1000 || fdatasync(fd) < 0)
+    die("datasynctest: extending fdatasync failed");
+  close(fd);
+  evict_caches();
+  fd = open("dsync", O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size != sizeof(buf) + 1000)
+    die("datasynctest: wrong size after extending fdatasync");
+  memset(rbuf, 0, 1000);
+  if (pread(fd, rbuf, 4096, sizeof(buf)) != 1000)
+    die("datasynctest: short read after extending fdatasync");
+  for (int i = 0; i < 1000; i++)
+    if (rbuf[i] != 'e')
+      die("datasynctest: extension lost after fdatasync");
+
+  close(fd);
+  unlink("dsync");
+  printf("datasynctest ok\n");
+}
+
+// Chains of renames within a directory are folded together when the
+// directory's log is applied; check that what sync() writes still matches
+// the names, including when the last rename replaces a file that is itself
+// still in the log.
+void
+renamechain(void)
+{
+  char data[8];
+  printf("renamechain\n");
+  if (mkdir("rc", 0777) < 0)
+    die("mkdir rc failed");
+
+  int fd = open("rc/c", O_CREAT|O_WRONLY, 0666);
+  if (fd < 0 || write(fd, "old", 3) != 3)
+    die("create rc/c failed");
+  close(fd);
+  fd = open("rc/a", O_CREAT|O_WRONLY, 0666);
+  if (fd < 0 || write(fd, "new", 3) != 3)
+    die("create rc/a failed");
+  close(fd);
+
+  if (rename("rc/a", "rc/b") < 0)
+    die("rename rc/a rc/b failed");
+  if (rename("rc/b", "rc/c") < 0)
+    die("rename rc/b rc/c failed");
+  sync();
+
+  if (open("rc/a", O_RDONLY) >= 0 || open("rc/b", O_RDONLY) >= 0)
+    die("renamechain: old names still there");
+  fd = open("rc/c", O_RDONLY);
+  if (fd < 0)
+    die("renamechain: rc/c is gone");
+  if (read(fd, data, sizeof(data)) != 3 || memcmp(data, "new", 3) != 0)
+    die("renamechain: rc/c has the wrong contents");
+  close(fd);
+
+  if (unlink("rc/c") < 0 || unlink("rc") < 0)
+    die("renamechain: cleanup failed");
+  sync();
+  printf("renamechain ok\n");
+}
+
+// Vectored I/O returns what it got done before a short read, an EOF or a
+// bad buffer, and fails only if that happens before the first byte.
+void
+iovtest(void)
+{
+  char a[4], b[100];
+  char *bad = (char*)0xdeadbeef000;
+  printf("iovtest\n");
+
+  int fd = open("iovtest", O_CREAT|O_RDWR, 0666);
+  if (fd < 0)
+    die("iovtest: create failed");
+  struct iovec wv[3] = { { (void*)"abc", 3 }, { (void*)"", 0 },
+                         { (void*)"defgh", 5 } };
+  if (writev(fd, wv, 3) != 8)
+    die("iovtest: writev failed");
+
+  // Short at the end of the file, then at EOF.
+  struct iovec rv[2] = { { a, sizeof(a) }, { b, sizeof(b) } };
+  if (lseek(fd, 0, SEEK_SET) != 0 || readv(fd, rv, 2) != 8)
+    die("iovtest: readv didn't stop at the end of the file");
+  if (memcmp(a, "abcd", 4) != 0 || memcmp(b, "efgh", 4) != 0)
+    die("iovtest: readv read the wrong data");
+  if (readv(fd, rv, 2) != 0)
+    die("iovtest: readv at EOF didn't return 0");
+
+  // A bad buffer after the first one only cuts the transfer short.
+  struct iovec pv[2] = { { a, sizeof(a) }, { bad, 4 } };
+  if (preadv(fd, pv, 2, 0) != 4)
+    die("iovtest: preadv into a bad second buffer");
+  if (pwritev(fd, pv, 2, 8) != 4)
+    die("iovtest: pwritev from a bad second buffer");
+  pv[0].iov_base = bad;
+  if (preadv(fd, pv, 2, 0) != -1 || pwritev(fd, pv, 2, 0) != -1)
+    die("iovtest: a bad first buffer didn't fail");
+  if (readv(fd, rv, 0) != -1 || readv(fd, rv, UIO_MAXIOV + 1) != -1)
+    die("iovtest: bad iovec count accepted");
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size != 12)
+    die("iovtest: wrong file size %d", (int)st.st_size);
+  close(fd);
+  unlink("iovtest");
+  printf("iovtest ok\n");
+}
+
+// sendfile() stops at the end of the file, moves either *offset or the file
+// offset but not both, and doesn't hold up other users of the file's offset
+// while it waits for a full pipe.
+void
+sendfiletest(void)
+{
+  enum { SIZE = 80 * 1024 };     // More than a pipe holds
+  static char buf[SIZE];
+  char c;
+  int pfds[2];
+  printf("sendfiletest\n");
+
+  for (int i = 0; i < SIZE; i++)
+    buf[i] = 'a' + i % 26;
+  int fd = open("sendfile", O_CREAT|O_RDWR, 0666);
+  if (fd < 0 || write(fd, buf, SIZE) != SIZE)
+    die("sendfiletest: create failed");
+  if (pipe(pfds) != 0)
+    die("sendfiletest: pipe failed");
+
+  off_t off = SIZE - 10;
+  if (sendfile(pfds[1], fd, &off, 100) != 10 || off != SIZE)
+    die("sendfiletest: sendfile with an offset didn't stop at EOF");
+  if (sendfile(pfds[1], fd, &off, 100) != 0)
+    die("sendfiletest: sendfile at EOF didn't return 0");
+  off = -1;
+  if (sendfile(pfds[1], fd, &off, 100) != -1)
+    die("sendfiletest: negative offset accepted");
+  if (lseek(fd, 0, SEEK_CUR) != SIZE)
+    die("sendfiletest: sendfile with an offset moved the file offset");
+  if (sendfile(pfds[1], pfds[0], nullptr, 1) != -1)
+    die("sendfiletest: sendfile from a pipe");
+  if (read(pfds[0], buf, 10) != 10 ||
+      memcmp(buf, "abcdefghijklmnopqrstuvwxyz" + (SIZE - 10) % 26, 10) != 0)
+    die("sendfiletest: wrong data in the pipe");
+
+  // The child blocks on the full pipe, mid-file.
+  if (lseek(fd, 0, SEEK_SET) != 0)
+    die("sendfiletest: lseek failed");
+  int pid = fork();
+  if (pid < 0)
+    die("sendfiletest: fork failed");
+  if (pid == 0) {
+    close(pfds[0]);
+    exit(sendfile(pfds[1], fd, nullptr, SIZE) == SIZE ? 0 : 1);
+  }
+  close(pfds[1]);
+  sleep(1);
+  if (lseek(fd, 0, SEEK_CUR) < 0)
+    die("sendfiletest: lseek failed");
+  int n = 0;
+  for (int r; (r = read(pfds[0], buf, sizeof(buf))) > 0; n += r)
+    if (buf[0] != 'a' + n % 26)
+      die("sendfiletest: pipe data out of order");
+  int status;
+  wait(&status);
+  if (n != SIZE || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    die("sendfiletest: child's sendfile sent %d bytes", n);
+  if (read(fd, &c, 1) != 0)
+    die("sendfiletest: file offset not at EOF");
+  close(pfds[0]);
+  close(fd);
+  unlink("sendfile");
+  printf("sendfiletest ok\n");
+}
+
+// io_ring_enter() runs the entries in order, stops when the completion ring
+// is full, reports each op's own failure in its completion, and consumes an
+// entry exactly once even if its completion can't be stored.
+void
+ioringtest(void)
+{
+  struct io_ring_sqe sqes[8];
+  struct io_ring_cqe cqes[4];
+  struct io_ring ring;
+  char buf[8];
+  printf("ioringtest\n");
+
+  int fd = open("ioring", O_CREAT|O_RDWR, 0666);
+  if (fd < 0)
+    die("ioringtest: create failed");
+
+  memset(&ring, 0, sizeof(ring));
+  memset(sqes, 0, sizeof(sqes));
+  ring.sq_entries = 8;
+  ring.cq_entries = 4;
+  ring.sqes = sqes;
+  ring.cqes = cqes;
+  sqes[0].op = IORING_OP_WRITE;
+  sqes[0].fd = fd;
+  sqes[0].addr = (uint64_t)"hello";
+  sqes[0].len = 5;
+  sqes[1].op = IORING_OP_PREAD;
+  sqes[1].fd = fd;
+  sqes[1].addr = (uint64_t)buf;
+  sqes[1].len = sizeof(buf);
+  sqes[2].op = 99;
+  sqes[3].op = IORING_OP_UNLINK;
+  sqes[3].addr = (uint64_t)"ioring-nonexistent";
+  sqes[4].op = IORING_OP_NOP;
+  for (int i = 0; i < 5; i++)
+    sqes[i].user_data = 100 + i;
+  ring.sq_tail = 5;
+
+  if (io_ring_enter(&ring, 5) != 4 || ring.sq_head != 4 || ring.cq_tail != 4)
+    die("ioringtest: didn't stop at a full completion ring");
+  s64 want[4] = { 5, 5, -1, -1 };
+  for (int i = 0; i < 4; i++)
+    if (cqes[i].user_data != 100 + i || cqes[i].res != want[i])
+      die("ioringtest: completion %d is %ld for %ld", i, cqes[i].res,
+          cqes[i].user_data);
+  if (memcmp(buf, "hello", 5) != 0)
+    die("ioringtest: pread didn't see the write before it");
+  ring.cq_head = 4;
+  if (io_ring_enter(&ring, 5) != 1 || ring.sq_head != 5 ||
+      cqes[0].user_data != 104 || cqes[0].res != 0)
+    die("ioringtest: the rest wasn't submitted");
+  ring.cq_head = 5;
+
+  // A write whose completion can't be stored still happens, just once.
+  sqes[5] = sqes[0];
+  sqes[5].addr = (uint64_t)"!";
+  sqes[5].len = 1;
+  ring.sq_tail = 6;
+  ring.cqes = (struct io_ring_cqe*)0xdeadbeef000;
+  if (io_ring_enter(&ring, 1) != -1 || ring.sq_head != 6)
+    die("ioringtest: a bad completion ring didn't consume the entry");
+  ring.cqes = cqes;
+  if (io_ring_enter(&ring, 1) != 0)
+    die("ioringtest: the entry ran again");
+
+  // A bad submission ring leaves the entry in place.
+  ring.sq_tail = 7;
+  ring.sqes = (struct io_ring_sqe*)0xdeadbeef000;
+  if (io_ring_enter(&ring, 1) != -1 || ring.sq_head != 6)
+    die("ioringtest: a bad submission ring consumed an entry");
+  ring.sq_entries = 3;
+  if (io_ring_enter(&ring, 1) != -1)
+    die("ioringtest: ring size accepted");
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size != 6)
+    die("ioringtest: file size %d, wanted 6", (int)st.st_size);
+  close(fd);
+  unlink("ioring");
+  printf("ioringtest ok\n");
+}
+
+// statat_many() stats names as getdents() returns them, leaves st_ino 0 for
+// names that aren't in the directory, and stores nothing into a bad buffer.
+void
+statmanytest(void)
+{
+  struct getdents_rec recs[3];
+  struct stat sts[3];
+  printf("statmanytest\n");
+
+  if (mkdir("sm", 0777) < 0 || mkdir("sm/d", 0777) < 0)
+    die("statmanytest: mkdir failed");
+  int fd = open("sm/f", O_CREAT|O_WRONLY, 0666);
+  if (fd < 0 || write(fd, "12345", 5) != 5)
+    die("statmanytest: create failed");
+  close(fd);
+
+  int dfd = open("sm", O_RDONLY);
+  if (dfd < 0)
+    die("statmanytest: open sm failed");
+  memset(recs, 0, sizeof(recs));
+  strcpy(recs[0].name, "f");
+  strcpy(recs[1].name, "nope");
+  strcpy(recs[2].name, "d");
+  if (statat_many(dfd, recs, 3, sts, (enum stat_flags)0) != 3)
+    die("statmanytest: statat_many failed");
+  if (!sts[0].st_ino || !S_ISREG(sts[0].st_mode) || sts[0].st_size != 5)
+    die("statmanytest: wrong stat for a file");
+  if (sts[1].st_ino)
+    die("statmanytest: missing name got a stat");
+  if (!sts[2].st_ino || !S_ISDIR(sts[2].st_mode))
+    die("statmanytest: wrong stat for a directory");
+
+  if (statat_many(dfd, recs, 3, (struct stat*)0xdeadbeef000,
+                  (enum stat_flags)0) != -1 ||
+      statat_many(dfd, (struct getdents_rec*)0xdeadbeef000, 3, sts,
+                  (enum stat_flags)0) != -1)
+    die("statmanytest: bad buffer accepted");
+  if (statat_many(dfd, recs, 0, sts, (enum stat_flags)0) != 0)
+    die("statmanytest: empty batch");
+  fd = open("sm/f", O_RDONLY);
+  if (statat_many(fd, recs, 1, sts, (enum stat_flags)0) != -1)
+    die("statmanytest: statat_many on a file");
+  close(fd);
+  close(dfd);
+
+  if (unlink("sm/f") < 0 || unlink("sm/d") < 0 || unlink("sm") < 0)
+    die("statmanytest: cleanup failed");
+  printf("statmanytest ok\n");
+}
+
+// MAP_POPULATE and mlock() fault mappings in up front; mlock() fails with
+// part of the range unmapped, and munlock() and munmap() of a locked range
+// let go of it.
+void
+mlocktest(void)
+{
+  static char buf[2 * 4096];
+  printf("mlocktest\n");
+
+  char *a = (char*)mmap(0, 4 * 4096, PROT_READ|PROT_WRITE,
+                        MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+  if (a == MAP_FAILED)
+    die("mlocktest: anonymous MAP_POPULATE failed");
+  for (int i = 0; i < 4 * 4096; i += 4096)
+    if (a[i])
+      die("mlocktest: populated page not zero");
+
+  for (int i = 0; i < sizeof(buf); i++)
+    buf[i] = i % 251;
+  int fd = open("mlock", O_CREAT|O_RDWR, 0666);
+  if (fd < 0 || write(fd, buf, sizeof(buf)) != sizeof(buf))
+    die("mlocktest: create failed");
+  char *f = (char*)mmap(0, sizeof(buf), PROT_READ|PROT_WRITE,
+                        MAP_SHARED|MAP_POPULATE, fd, 0);
+  if (f == MAP_FAILED || memcmp(f, buf, sizeof(buf)) != 0)
+    die("mlocktest: file MAP_POPULATE failed");
+
+  if (mlock(f, sizeof(buf)) < 0 || mlock(f + 100, 10) < 0)
+    die("mlocktest: mlock failed");
+  f[4096] = 'x';
+  if (pread(fd, buf, 1, 4096) != 1 || buf[0] != 'x')
+    die("mlocktest: write through a locked page lost");
+  if (munlock(f, sizeof(buf)) < 0 || munlock(f, sizeof(buf)) < 0)
+    die("mlocktest: munlock failed");
+
+  // The end of the anonymous mapping is unmapped.
+  if (munmap(a + 3 * 4096, 4096) < 0)
+    die("mlocktest: munmap failed");
+  if (mlock(a, 4 * 4096) != -1)
+    die("mlocktest: mlock over an unmapped page");
+  if (mlock((void*)0xfffffffffffff000ull, 8192) != -1)
+    die("mlocktest: mlock wrapped around");
+  if (mlock(a, 3 * 4096) < 0 || munmap(a, 3 * 4096) < 0)
+    die("mlocktest: munmap of a locked range failed");
+
+  munmap(f, sizeof(buf));
+  close(fd);
+  unlink("mlock");
+  printf("mlocktest ok\n");
+}
+
+void
+epolltest(void)
+{
+  struct epoll_event ev, evs[4];
+  int fds[2];
+  char c;
+  printf("epolltest\n");
+
+  int ep = epoll_create1(EPOLL_CLOEXEC);
+  if (ep < 0 || pipe(fds) < 0)
+    die("epolltest: setup failed");
+
+  ev.events = EPOLLIN;
+  ev.data.u64 = 0x1122334455667788ull;
+  if (epoll_ctl(ep, EPOLL_CTL_ADD, fds[0], &ev) < 0)
+    die("epolltest: add read end failed");
+  if (epoll_ctl(ep, EPOLL_CTL_ADD, fds[0], &ev) != -1)
+    die("epolltest: added a watched fd twice");
+  ev.events = EPOLLOUT;
+  ev.data.fd = fds[1];
+  if (epoll_ctl(ep, EPOLL_CTL_ADD, fds[1], &ev) < 0)
+    die("epolltest: add write end failed");
+
+  // Only the write end is ready.
+  if (epoll_wait(ep, evs, 4, 0) != 1 || evs[0].events != EPOLLOUT ||
+      evs[0].data.fd != fds[1])
+    die("epolltest: empty pipe not just writable");
+  if (epoll_ctl(ep, EPOLL_CTL_DEL, fds[1], nullptr) < 0)
+    die("epolltest: del failed");
+  if (epoll_ctl(ep, EPOLL_CTL_DEL, fds[1], nullptr) != -1)
+    die("epolltest: deleted an unwatched fd");
+  if (epoll_wait(ep, evs, 4, 10) != 0)
+    die("epolltest: timed wait on an empty pipe returned events");
+
+  // Level-triggered: ready until drained.
+  if (write(fds[1], "x", 1) != 1)
+    die("epolltest: write failed");
+  for (int i = 0; i < 2; i++)
+    if (epoll_wait(ep, evs, 4, -1) != 1 || evs[0].events != EPOLLIN ||
+        evs[0].data.u64 != 0x1122334455667788ull)
+      die("epolltest: readable pipe not reported");
+  if (read(fds[0], &c, 1) != 1 || epoll_wait(ep, evs, 4, 0) != 0)
+    die("epolltest: drained pipe still readable");
+
+  // One-shot: one event, then nothing until re-armed.
+  ev.events = EPOLLIN | EPOLLONESHOT;
+  ev.data.u64 = 7;
+  if (epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], &ev) < 0)
+    die("epolltest: mod failed");
+  if (write(fds[1], "x", 1) != 1)
+    die("epolltest: write failed");
+  if (epoll_wait(ep, evs, 4, 0) != 1 || evs[0].data.u64 != 7)
+    die("epolltest: oneshot event missing");
+  if (epoll_wait(ep, evs, 4, 0) != 0)
+    die("epolltest: oneshot fired twice");
+  if (epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], &ev) < 0 ||
+      epoll_wait(ep, evs, 4, 0) != 1)
+    die("epolltest: re-armed oneshot missing");
+
+  // A closed write end hangs up the read end.
+  ev.events = EPOLLIN;
+  if (epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], &ev) < 0)
+    die("epolltest: mod failed");
+  close(fds[1]);
+  if (epoll_wait(ep, evs, 4, 0) != 1 || !(evs[0].events & EPOLLHUP))
+    die("epolltest: no hangup after closing the write end");
+
+  // Bad arguments
+  if (epoll_ctl(ep, EPOLL_CTL_MOD, fds[0], (struct epoll_event*)0xdeadbeef000) != -1)
+    die("epolltest: ctl with a bad event pointer");
+  if (epoll_wait(ep, (struct epoll_event*)0xdeadbeef000, 4, 0) != -1)
+    die("epolltest: wait with a bad event pointer");
+  if (epoll_wait(ep, evs, 0, 0) != -1 || epoll_wait(ep, evs, -1, 0) != -1)
+    die("epolltest: wait with maxevents <= 0");
+  if (epoll_wait(fds[0], evs, 4, 0) != -1 ||
+      epoll_ctl(fds[0], EPOLL_CTL_DEL, fds[0], nullptr) != -1)
+    die("epolltest: a pipe used as an epoll fd");
+  if (epoll_ctl(ep, 42, fds[0], &ev) != -1)
+    die("epolltest: unknown ctl op");
+
+  close(fds[0]);
+  close(ep);
+  printf("epolltest ok\n");
+}
+
+// New FDs are the lowest free ones, found from the file table's bitmap
+// (unless SOCK_ANYFD or O_ANYFD say any will do), both for files and for
+// sockets; an FD that dup2() fills in or replaces is in use.
+void
+fdreusetest(void)
+{
+  char c;
+  int status;
+  printf("fdreusetest\n");
+
+  int a = open("fdreuse", O_CREAT|O_RDWR, 0666);
+  if (a < 0 || write(a, "abc", 3) != 3)
+    die("fdreusetest: create failed");
+  int b = open("fdreuse", O_RDONLY);
+  int d = open("fdreuse", O_RDONLY);
+  if (b < 0 || d < 0)
+    die("fdreusetest: open failed");
+
+  // Closing an FD frees it for the next open or socket.
+  close(b);
+  int fd = open("fdreuse", O_RDONLY);
+  if (fd != b)
+    die("fdreusetest: open got fd %d, wanted %d", fd, b);
+  close(a);
+  close(b);
+  int s1 = socket(PF_LOCAL, SOCK_DGRAM, 0);
+  int s2 = socket(PF_LOCAL, SOCK_DGRAM|SOCK_CLOEXEC, 0);
+  int s3 = socket(PF_LOCAL, SOCK_DGRAM|SOCK_ANYFD, 0);
+  if (s1 != a || s2 != b || s3 < 0)
+    die("fdreusetest: socket got fds %d %d %d", s1, s2, s3);
+  if (socket(PF_LOCAL, SOCK_DGRAM|0x4000, 0) != -1)
+    die("fdreusetest: socket accepted unknown flags");
+
+  // accept4() rejects unknown flags, without taking an FD for them.
+  if (accept4(s1, nullptr, nullptr, SOCK_CLOEXEC|0x4000) != -1 ||
+      accept4(s1, nullptr, nullptr, O_RDWR) != -1)
+    die("fdreusetest: accept4 accepted unknown flags");
+  close(s1);
+  close(s2);
+  close(s3);
+  fd = open("fdreuse", O_RDONLY);
+  if (fd != a)
+    die("fdreusetest: open after accept4 got fd %d, wanted %d", fd, a);
+
+  // dup2() onto an FD in use replaces its file, and onto a free one takes
+  // it. Either way the two FDs share the file's offset.
+  if (dup2(fd, d) != d || read(d, &c, 1) != 1 || c != 'a' ||
+      read(fd, &c, 1) != 1 || c != 'b')
+    die("fdreusetest: dup2 onto a used fd");
+  if (dup2(fd, b) != b || read(b, &c, 1) != 1 || c != 'c')
+    die("fdreusetest: dup2 onto a free fd");
+  int fd2 = open("fdreuse", O_RDONLY);
+  if (fd2 == b || fd2 < 0)
+    die("fdreusetest: open got dup2's fd %d", fd2);
+  close(fd2);
+  close(b);
+  close(d);
+
+  // After a fork, each side closing the FD frees it for that side only.
+  if (lseek(fd, 0, SEEK_SET) != 0)
+    die("fdreusetest: lseek failed");
+  int pid = fork();
+  if (pid < 0)
+    die("fdreusetest: fork failed");
+  if (pid == 0) {
+    close(fd);
+    if (read(fd, &c, 1) != -1)
+      die("fdreusetest: read from a closed fd");
+    if (open("fdreuse", O_RDONLY) != fd)
+      die("fdreusetest: child didn't reuse its closed fd");
+    exit(0);
+  }
+  if (wait(&status) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    die("fdreusetest: child failed");
+  if (read(fd, &c, 1) != 1 || c != 'a')
+    die("fdreusetest: fd closed by the child");
+  close(fd);
+  if (read(fd, &c, 1) != -1)
+    die("fdreusetest: read from a closed fd");
+  if (open("fdreuse", O_RDONLY) != fd)
+    die("fdreusetest: parent didn't reuse its closed fd");
+  close(fd);
+
+  unlink("fdreuse");
+  printf("fdreusetest ok\n");
+}
+
+// Packet-mode pipes (pipe2() with O_DIRECT): each write is a packet and each
+// read returns one, or as much of it as fits. Packets from writers on
+// different cores come out in no particular order, so only packets that
+// are alone in the pipe are checked for order.
+void
+packetpipetest(void)
+{
+  enum { NWRITERS = 4, NPACKETS = 200 };
+  struct packet { int writer, seq; char pad[56]; };
+  static char buf[4096 + 200];
+  int fds[2], status;
+  printf("packetpipetest\n");
+
+  // Packet boundaries. A page-sized write and the rest become two packets.
+  if (pipe2(fds, O_DIRECT) < 0)
+    die("packetpipetest: pipe2 failed");
+  if (write(fds[1], "0123456789", 10) != 10 || read(fds[0], buf, 100) != 10 ||
+      memcmp(buf, "0123456789", 10) != 0)
+    die("packetpipetest: packet not read whole");
+  if (write(fds[1], "abcdef", 6) != 6 || read(fds[0], buf, 2) != 2 ||
+      memcmp(buf, "ab", 2) != 0)
+    die("packetpipetest: short read of a packet");
+  if (write(fds[1], "xyz", 3) != 3 || read(fds[0], buf, 100) != 3 ||
+      memcmp(buf, "xyz", 3) != 0)
+    die("packetpipetest: rest of a short-read packet not discarded");
+  memset(buf, 'p', sizeof(buf));
+  if (write(fds[1], buf, 4096 + 100) != 4096 + 100)
+    die("packetpipetest: big write failed");
+  int r1 = read(fds[0], buf, sizeof(buf)), r2 = read(fds[0], buf, sizeof(buf));
+  if (r1 + r2 != 4096 + 100 || (r1 != 4096 && r2 != 4096))
+    die("packetpipetest: big write read as %d and %d bytes", r1, r2);
+
+  // Many writers and one reader. The reader sees every packet whole, once,
+  // and end of file only after the last writer is gone; the first one
+  // holds off for a while.
+  for (int w = 0; w < NWRITERS; w++) {
+    int pid = fork();
+    if (pid < 0)
+      die("packetpipetest: fork failed");
+    if (pid == 0) {
+      close(fds[0]);
+      if (w == 0)
+        usleep(200000);
+      struct packet p;
+      memset(&p, 0, sizeof(p));
+      p.writer = w;
+      for (p.seq = 0; p.seq < NPACKETS; p.seq++)
+        if (write(fds[1], &p, sizeof(p)) != sizeof(p))
+          die("packetpipetest: writer %d: write failed", w);
+      exit(0);
+    }
+  }
+  close(fds[1]);
+  static bool seen[NWRITERS][NPACKETS];
+  int n = 0, r;
+  struct packet p;
+  while ((r = read(fds[0], buf, sizeof(buf))) > 0) {
+    memcpy(&p, buf, sizeof(p));
+    if (r != sizeof(p) || p.writer < 0 || p.writer >= NWRITERS ||
+        p.seq < 0 || p.seq >= NPACKETS || seen[p.writer][p.seq])
+      die("packetpipetest: bad packet of %d bytes", r);
+    seen[p.writer][p.seq] = true;
+    n++;
+  }
+  if (r < 0 || n != NWRITERS * NPACKETS)
+    die("packetpipetest: read %d packets before %d", n, r);
+  for (int w = 0; w < NWRITERS; w++)
+    if (wait(&status) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+      die("packetpipetest: writer failed");
+  close(fds[0]);
+
+  // Without blocking, reads of an empty pipe and writes to a full one fail.
+  if (pipe2(fds, O_DIRECT|O_NONBLOCK) < 0)
+    die("packetpipetest: nonblocking pipe2 failed");
+  if (read(fds[0], buf, 100) != -1)
+    die("packetpipetest: read of an empty pipe didn't fail");
+  n = 0;
+  while (write(fds[1], buf, 1000) == 1000)
+    if (++n > 1000)
+      die("packetpipetest: writes to a full pipe didn't fail");
+  if (n == 0)
+    die("packetpipetest: write to an empty pipe failed");
+  close(fds[1]);
+  while ((r = read(fds[0], buf, sizeof(buf))) == 1000)
+    n--;
+  if (r != 0 || n != 0)
+    die("packetpipetest: %d packets left, then %d", n, r);
+  close(fds[0]);
+
+  // With the reader gone, writes fail.
+  if (pipe2(fds, O_DIRECT) < 0)
+    die("packetpipetest: pipe2 failed");
+  close(fds[0]);
+  if (write(fds[1], "x", 1) != -1)
+    die("packetpipetest: write with no reader didn't fail");
+  close(fds[1]);
+  printf("packetpipetest ok\n");
+}
+
 void
 cloexec(void)
 {
@@ -2118,6 +3070,20 @@ main(int argc, char *argv[])
   TEST(thrtest);
   TEST(ftabletest);
   TEST(renametest);
+  TEST(fsyncdrop);
+  TEST(pagecachestale);
+  TEST(directiotest);
+  TEST(fallocatetest);
+  TEST(datasynctest);
+  TEST(fdreusetest);
+  TEST(packetpipetest);
+  TEST(renamechain);
+  TEST(iovtest);
+  TEST(sendfiletest);
+  TEST(ioringtest);
+  TEST(statmanytest);
+  TEST(mlocktest);
+  TEST(epolltest);
 
   TEST(floattest);
   TEST(writeprotecttest);
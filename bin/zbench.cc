@@ -0,0 +1,162 @@
+// usage: zbench [MB] dir
+//
+// Compare reading a compressed file (see SB_COMPRESS) back from the disk
+// with reading a plain copy of it: write MB (default 16) of compressible
+// text to dir/zbench.z, compressed, and to dir/zbench.raw, sync both, drop
+// the caches, and time sequential reads of each, which come in through
+// mfile::get_page()'s readahead. The kernel's compression counters say how
+// much of the time went into inflating clusters, and how fast that was.
+// Needs a file system made with mkfs -z.
+
+#include "types.h"
+#include "user.h"
+#include "amd64.h"
+#include "libutil.h"
+#include "kstats.hh"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+enum { CHUNK = 64 * 1024 };
+
+static char buf[CHUNK];
+static uint64_t hz;
+
+static void
+read_kstats(kstats *out)
+{
+  int fd = open("/dev/kstats", O_RDONLY);
+  if (fd < 0)
+    die("zbench: cannot open /dev/kstats");
+  if (xread(fd, out, sizeof *out) != sizeof *out)
+    die("zbench: short read from /dev/kstats");
+  close(fd);
+}
+
+static void
+evict_caches(void)
+{
+  int fd = open("/dev/evict_caches", O_WRONLY);
+  if (fd < 0)
+    die("zbench: cannot open /dev/evict_caches");
+  // Pages, then the compressed blocks under them (see evict_caches())
+  xwrite(fd, "2", 1);
+  xwrite(fd, "1", 1);
+  close(fd);
+}
+
+// Log-like lines: repetitive, but not one string over and over.
+static void
+fill(char *p, size_t n, uint64_t seq)
+{
+  static const char *words[] = {
+    "GET", "PUT", "/index.html", "/api/v1/items", "200", "404", "OK",
+    "client", "latency", "bytes", "cache", "miss", "hit",
+  };
+  size_t off = 0;
+  while (off < n) {
+    char line[96];
+    int len = snprintf(line, sizeof line, "%lu %s %s %s %lu\n", seq,
+                       words[seq % 13], words[(seq / 13) % 13],
+                       words[(seq * 7) % 13], (seq * 2654435761u) % 100000);
+    seq++;
+    size_t m = std::min((size_t)len, n - off);
+    memmove(p + off, line, m);
+    off += m;
+  }
+}
+
+static void
+make_file(const char *path, bool compress, uint64_t bytes)
+{
+  unlink(path);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0)
+    die("zbench: cannot create %s", path);
+  if (compress && setcompress(fd, 1) < 0)
+    die("zbench: setcompress failed (not a mkfs -z file system?)");
+  for (uint64_t off = 0; off < bytes; off += CHUNK) {
+    fill(buf, CHUNK, off / 32);
+    xwrite(fd, buf, CHUNK);
+  }
+  if (fsync(fd) < 0)
+    die("zbench: fsync %s failed", path);
+  close(fd);
+}
+
+static void
+read_file(const char *name, const char *path, uint64_t bytes)
+{
+  kstats before, after;
+  evict_caches();
+  read_kstats(&before);
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    die("zbench: cannot open %s", path);
+  uint64_t t0 = rdtsc(), total = 0;
+  ssize_t r;
+  while ((r = read(fd, buf, CHUNK)) > 0)
+    total += r;
+  uint64_t t1 = rdtsc();
+  close(fd);
+  if (total != bytes)
+    die("zbench: read %lu bytes of %s, wanted %lu", total, path, bytes);
+
+  read_kstats(&after);
+  kstats d = after - before;
+  double secs = (double)(t1 - t0) / hz;
+  printf("%-4s %8.1f MB/s %8lu disk blocks", name, bytes / secs / 1e6,
+         d.disk_read_blocks);
+  if (d.fs_decompress_count) {
+    double zsecs = (double)d.fs_decompress_cycles / hz;
+    printf(", %lu clusters inflated at %.1f MB/s (%.0f%% of the time),"
+           " %lu hits", d.fs_decompress_count,
+           d.fs_decompress_bytes / zsecs / 1e6, 100 * zsecs / secs,
+           d.fs_decompress_hit_count);
+  }
+  printf("\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+  uint64_t mb = 16;
+  if (argc == 3)
+    mb = atoi(argv[1]);
+  if (argc < 2 || argc > 3 || !mb)
+    die("usage: %s [MB] dir", argv[0]);
+  const char *dir = argv[argc - 1];
+  hz = cpuhz();
+  if (!hz)
+    die("zbench: unknown CPU frequency");
+
+  char zpath[128], rawpath[128];
+  snprintf(zpath, sizeof zpath, "%s/zbench.z", dir);
+  snprintf(rawpath, sizeof rawpath, "%s/zbench.raw", dir);
+  uint64_t bytes = mb << 20;
+
+  kstats before, after;
+  read_kstats(&before);
+  make_file(zpath, true, bytes);
+  read_kstats(&after);
+  kstats d = after - before;
+  make_file(rawpath, false, bytes);
+  if (d.fs_compress_bytes_in)
+    printf("compressed %lu clusters, %lu KB to %lu KB, at %.1f MB/s\n",
+           d.fs_compress_count, d.fs_compress_bytes_in / 1024,
+           d.fs_compress_bytes_out / 1024,
+           d.fs_compress_bytes_in /
+           ((double)d.fs_compress_cycles / hz) / 1e6);
+
+  read_file("z", zpath, bytes);
+  read_file("raw", rawpath, bytes);
+  unlink(zpath);
+  unlink(rawpath);
+  return 0;
+}
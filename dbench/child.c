@@ -84,11 +84,16 @@ static void nb_time_delay(struct child_struct *child, double targett)
 static void finish_op(struct child_struct *child, struct op *op)
 {
 	double t = timeval_elapsed(&child->lasttime);
+	unsigned us = t * 1.0e6, b = 0;
 	op->count++;
 	op->total_time += t;
 	if (t > op->max_latency) {
 		op->max_latency = t;
 	}
+	while (b < LAT_BUCKETS - 1 && us >= (2u << b)) {
+		b++;
+	}
+	op->hist[b]++;
 }
 
 #define OP_LATENCY(opname) finish_op(child, &child->op.op_ ## opname)
@@ -539,12 +544,14 @@ loop_again:
 
 			if (i>1 && params[1][0] == '/') {
 				snprintf(fname, sizeof(fname), "%s%s", child->directory, params[1]);
-				all_string_sub(fname,"client1", child->cname);
+				if (!options.shared_dir)
+					all_string_sub(fname,"client1", child->cname);
 				pcount++;
 			}
 			if (i>2 && params[2][0] == '/') {
 				snprintf(fname2, sizeof(fname2), "%s%s", child->directory, params[2]);
-				all_string_sub(fname2,"client1", child->cname);
+				if (!options.shared_dir)
+					all_string_sub(fname2,"client1", child->cname);
 				pcount++;
 			}
 
@@ -574,6 +581,8 @@ done:
 		fflush(stdout);
 		if (!options.skip_cleanup) {
 			nb_ops->cleanup(child);
+			if (options.per_client_dirs)
+				rmdir(child->directory);
 		}
 		child->cleanup_finished = 1;
 		if(child->cname){
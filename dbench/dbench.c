@@ -66,6 +66,51 @@ struct child_struct *children __mpalign__ ;
 static volatile int stop __mpalign__ ;
 static double throughput;
 struct nb_operations *nb_ops;
+
+/* -T: one sample per timer tick of the execute phase, with the bytes and
+   the operations of each type done since the previous one */
+struct timeline_sample {
+	double t;
+	double dt;
+	double bytes;
+	unsigned *ops;
+};
+static struct timeline_sample *timeline;
+static int timeline_len, timeline_max;
+static double timeline_last_t, timeline_last_bytes;
+static unsigned timeline_last_ops[MAX_OPS];
+
+static int num_ops(void)
+{
+	int n;
+	for (n=0;nb_ops->ops[n].name;n++) ;
+	return n;
+}
+
+static void record_timeline(double t, double total_bytes)
+{
+	struct timeline_sample *s;
+	int i, j, nops = num_ops();
+
+	if (timeline_len == timeline_max) {
+		return;
+	}
+	s = &timeline[timeline_len++];
+	s->t = t;
+	s->dt = t - timeline_last_t;
+	s->bytes = total_bytes - timeline_last_bytes;
+	s->ops = calloc(nops, sizeof(unsigned));
+	for (i=0;i<nops;i++) {
+		unsigned count = 0;
+		for (j=0;j<options.nprocs*options.clients_per_process;j++) {
+			count += children[j].ops[i].count;
+		}
+		s->ops[i] = count - timeline_last_ops[i];
+		timeline_last_ops[i] = count;
+	}
+	timeline_last_t = t;
+	timeline_last_bytes = total_bytes;
+}
 int global_random;
 
 static void do_timer_thread(void)
@@ -107,6 +152,9 @@ static void do_timer_thread(void)
 			children[i].worst_latency = 0;
 			memset(&children[i].ops, 0, sizeof(children[i].ops));
 		}
+		timeline_last_t = 0;
+		timeline_last_bytes = 0;
+		memset(timeline_last_ops, 0, sizeof(timeline_last_ops));
 		goto next;
 	}
 	if (t < options.warmup) {
@@ -163,6 +211,9 @@ static void do_timer_thread(void)
                        1.0e-6 * total_bytes / t, t, latency*1000);
 	  	       throughput = 1.0e-6 * total_bytes / t;
 		}
+		if (options.timeline) {
+			record_timeline(t, total_bytes);
+		}
         }
 
 	fflush(stdout);
@@ -208,10 +259,92 @@ static void show_one_latency(struct op *ops, struct op *ops_all)
 	printf("\n");
 }
 
+/* the latency under which a fraction q of the operations in op finished,
+   rounded up to the end of its histogram bucket */
+static double hist_quantile(struct op *op, double q)
+{
+	unsigned want = q * op->count, seen = 0;
+	int b;
+
+	for (b=0;b<LAT_BUCKETS-1;b++) {
+		seen += op->hist[b];
+		if (seen > want) break;
+	}
+	if (b == LAT_BUCKETS-1) {
+		return op->max_latency;
+	}
+	return MIN((2u << b) * 1.0e-6, op->max_latency);
+}
+
+static void show_latency_hist(struct op *ops)
+{
+	int i, b;
+
+	printf(" Operation                 p50ms     p90ms     p99ms   p99.9ms\n");
+	printf(" -------------------------------------------------------------\n");
+	for (i=0;nb_ops->ops[i].name;i++) {
+		struct op *op = &ops[i];
+		if (op->count == 0) continue;
+		printf(" %-22s %9.03f %9.03f %9.03f %9.03f\n",
+		       nb_ops->ops[i].name,
+		       1000*hist_quantile(op, 0.5), 1000*hist_quantile(op, 0.9),
+		       1000*hist_quantile(op, 0.99), 1000*hist_quantile(op, 0.999));
+	}
+	printf("\n");
+
+	/* one line per operation and non-empty bucket: op, the bucket's lower
+	   bound in us, and its count */
+	printf(" Latency histograms (operation, >= usec, count)\n");
+	for (i=0;nb_ops->ops[i].name;i++) {
+		struct op *op = &ops[i];
+		for (b=0;b<LAT_BUCKETS;b++) {
+			if (op->hist[b] == 0) continue;
+			printf(" %-22s %9u %9u\n",
+			       nb_ops->ops[i].name, b ? 1u << b : 0, op->hist[b]);
+		}
+	}
+	printf("\n");
+}
+
+static void show_timeline(void)
+{
+	int i, k, nops = num_ops();
+	unsigned any[MAX_OPS];
+
+	memset(any, 0, sizeof(any));
+	for (k=0;k<timeline_len;k++) {
+		for (i=0;i<nops;i++) {
+			any[i] |= timeline[k].ops[i];
+		}
+	}
+
+	printf(" Timeline (per second of each interval)\n");
+	printf("     sec    MB/sec     ops/s");
+	for (i=0;i<nops;i++) {
+		if (any[i]) printf(" %s", nb_ops->ops[i].name);
+	}
+	printf("\n");
+	for (k=0;k<timeline_len;k++) {
+		struct timeline_sample *s = &timeline[k];
+		unsigned total = 0;
+		if (s->dt <= 0) continue;
+		for (i=0;i<nops;i++) {
+			total += s->ops[i];
+		}
+		printf(" %7.1f %9.2f %9.0f", s->t, 1.0e-6 * s->bytes / s->dt,
+		       total / s->dt);
+		for (i=0;i<nops;i++) {
+			if (any[i]) printf(" %.0f", s->ops[i] / s->dt);
+		}
+		printf("\n");
+	}
+	printf("\n");
+}
+
 static void report_latencies(void)
 {
 	struct op sum[MAX_OPS];
-	int i, j;
+	int i, j, k;
 	struct op *op1, *op2;
 	struct child_struct *child;
 
@@ -224,9 +357,15 @@ static void report_latencies(void)
 			op1->count += op2->count;
 			op1->total_time += op2->total_time;
 			op1->max_latency = MAX(op1->max_latency, op2->max_latency);
+			for (k=0;k<LAT_BUCKETS;k++) {
+				op1->hist[k] += op2->hist[k];
+			}
 		}
 	}
 	show_one_latency(sum, sum);
+	if (options.latency_hist) {
+		show_latency_hist(sum);
+	}
 
 	if (!options.per_client_results) {
 		return;
@@ -238,6 +377,9 @@ static void report_latencies(void)
 		printf("Client %u did %u lines and %.0f bytes\n", 
 		       i, child->line, child->bytes - child->bytes_done_warmup);
 		show_one_latency(child->ops, sum);		
+		if (options.latency_hist) {
+			show_latency_hist(child->ops);
+		}
 	}
 }
 
@@ -287,6 +429,13 @@ static void create_procs(int nprocs, void (*fn)(struct child_struct *, const cha
 		children[i].num_clients = nclients;
 		children[i].cleanup = 0;
 		children[i].directory = options.directory;
+		if (options.per_client_dirs) {
+			int len = strlen(options.directory) + 16;
+			char *dir = malloc(len);
+			snprintf(dir, len, "%s/client%d", options.directory, i);
+			mkdir(dir, 0777);
+			children[i].directory = dir;
+		}
 		children[i].starttime = timeval_current();
 		children[i].lasttime = timeval_current();
 	}
@@ -315,6 +464,11 @@ static void create_procs(int nprocs, void (*fn)(struct child_struct *, const cha
 		}
 	}
 
+	if (options.timeline) {
+		timeline_max = options.timelimit + 2;
+		timeline = calloc(timeline_max, sizeof(*timeline));
+	}
+
 	printf("releasing clients\n");
 	tv_start = timeval_current();
 
@@ -340,6 +494,16 @@ static void create_procs(int nprocs, void (*fn)(struct child_struct *, const cha
 	printf("\n");
 
 	report_latencies();
+	if (options.timeline) {
+		show_timeline();
+	}
+	if (options.shared_dir) {
+		unsigned conflicts = 0;
+		for (int i = 0; i < nclients; i++)
+			conflicts += children[i].conflicts;
+		printf("%u operations conflicted with other clients\n\n",
+		       conflicts);
+	}
 }
 
 
@@ -458,8 +622,12 @@ static void process_opts(int argc, char **argv)
 #else
 	char ch;
 
-	// dbench [-t timelimit -S -F] nprocs dir
-	while ((ch = getopt(argc, argv, "t:SF")) != -1) {
+	// dbench [-t timelimit -S -F -H -T -P|-s] nprocs dir
+	//   -H  per-operation latency percentiles and histograms
+	//   -T  throughput timeline, per operation type
+	//   -P  replay each client in its own directory, dir/client<N>
+	//   -s  replay all clients on the same files in dir
+	while ((ch = getopt(argc, argv, "t:SFHTPs")) != -1) {
 		switch (ch) {
 		case 't':
 			options.timelimit = atoi(optarg);
@@ -470,8 +638,24 @@ static void process_opts(int argc, char **argv)
 		case 'F':
 			options.do_fsync = 1;
 			break;
+		case 'H':
+			options.latency_hist = 1;
+			break;
+		case 'T':
+			options.timeline = 1;
+			break;
+		case 'P':
+			options.per_client_dirs = 1;
+			break;
+		case 's':
+			options.shared_dir = 1;
+			break;
 		}
 	}
+	if (options.per_client_dirs && options.shared_dir) {
+		printf("-P and -s don't go together\n");
+		exit(1);
+	}
 	argc -= optind;
 	argv += optind;
 
@@ -487,6 +671,10 @@ static void process_opts(int argc, char **argv)
 	printf("options.do_fsync %d\n", options.do_fsync);
 	printf("options.nprocs %d\n", options.nprocs);
 	printf("options.directory %s\n", options.directory);
+	printf("options.latency_hist %d\n", options.latency_hist);
+	printf("options.timeline %d\n", options.timeline);
+	printf("options.per_client_dirs %d\n", options.per_client_dirs);
+	printf("options.shared_dir %d\n", options.shared_dir);
 
 	printf("\n\n");
 #endif
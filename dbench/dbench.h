@@ -117,10 +117,16 @@
 #define False 0
 #define uint32 unsigned
 
+/* latency histogram buckets: bucket b counts latencies of [2^b, 2^(b+1))
+   microseconds, bucket 0 those under 2us too, and the last one everything
+   past its lower bound */
+#define LAT_BUCKETS 24
+
 struct op {
 	unsigned count;
 	double total_time;
 	double max_latency;
+	unsigned hist[LAT_BUCKETS];
 };
 
 #define ZERO_STRUCT(x) memset(&(x), 0, sizeof(x))
@@ -143,6 +149,7 @@ struct child_struct {
 	struct timeval starttime;
 	struct timeval lasttime;
 	off_t bytes_since_fsync;
+	unsigned conflicts;
 	char *cname;
 	struct {
 		double last_bytes;
@@ -183,6 +190,10 @@ struct options {
 	const char *iscsi_device;
 	const char *iscsi_initiatorname;
 	int machine_readable;
+	int latency_hist;
+	int timeline;
+	int per_client_dirs;
+	int shared_dir;
 	const char *smb_share;
 	const char *smb_user;
 };
@@ -35,6 +35,11 @@ static int find_handle(struct child_struct *child, int handle)
 	for (i=0;i<MAX_FILES;i++) {
 		if (ftable[i].handle == handle) return i;
 	}
+	/* another client got in the way of the open */
+	if (options.shared_dir) {
+		child->conflicts++;
+		return -1;
+	}
 	printf("(%d) ERROR: handle %d was not found\n", 
 	       child->line, handle);
 	exit(1);
@@ -142,6 +147,12 @@ static void resolve_name(struct child_struct *child, const char *name)
 
 static void failed(struct child_struct *child)
 {
+	/* with -s the clients race on the same names, so replies that differ
+	   from the loadfile's are expected */
+	if (options.shared_dir) {
+		child->conflicts++;
+		return;
+	}
 	child->failed = 1;
 	printf("ERROR: child %d failed at line %d\n", child->id, child->line);
 	exit(1);
@@ -277,6 +288,8 @@ static void fio_writex(struct dbench_op *op)
 	struct ftable *ftable = (struct ftable *)op->child->private;
 	ssize_t ret;
 
+	if (i < 0) return;
+
 	if (options.fake_io) {
 		op->child->bytes += ret_size;
 		op->child->bytes_since_fsync += ret_size;
@@ -328,6 +341,8 @@ static void fio_readx(struct dbench_op *op)
 	void *buf;
 	struct ftable *ftable = (struct ftable *)op->child->private;
 
+	if (i < 0) return;
+
 	if (options.fake_io) {
 		op->child->bytes += ret_size;
 		return;
@@ -350,6 +365,7 @@ static void fio_close(struct dbench_op *op)
 	int handle = op->params[0];
 	struct ftable *ftable = (struct ftable *)op->child->private;
 	int i = find_handle(op->child, handle);
+	if (i < 0) return;
 	close(ftable[i].fd);
 	ftable[i].handle = 0;
 	if (ftable[i].name) free(ftable[i].name);
@@ -387,6 +403,7 @@ static void fio_flush(struct dbench_op *op)
 	int handle = op->params[0];
 	struct ftable *ftable = (struct ftable *)op->child->private;
 	int i = find_handle(op->child, handle);
+	if (i < 0) return;
 	fsync(ftable[i].fd);
 }
 
@@ -404,6 +421,7 @@ static void fio_qfileinfo(struct dbench_op *op)
 	int i = find_handle(op->child, handle);
 	(void)op->child;
 	(void)level;
+	if (i < 0) return;
 	fstat(ftable[i].fd, &st);
 }
 
@@ -547,7 +565,15 @@ static void fio_cleanup(struct child_struct *child)
 
 	ZERO_STRUCT(op);
 
-	snprintf(dname, 64, "%s/clients/client%d", child->directory, child->id);
+	/* with -s all the clients replay client1's tree; one is enough to
+	   remove it */
+	if (options.shared_dir && child->id != 0) {
+		free(dname);
+		return;
+	}
+
+	snprintf(dname, 64, "%s/clients/client%d", child->directory,
+		 options.shared_dir ? 1 : child->id);
 	op.child = child;
 	op.fname = dname;
 	fio_deltree(&op);
@@ -40,7 +40,18 @@ static int setaffinity(int c)
         return sched_setaffinity(0, sizeof(cpuset), &cpuset);
 }
 
-struct bench *alloc_bench(int ncpu, int nbg)
+const unsigned int *find_core_policy(const char *name, int *ncores)
+{
+	/* both policies order every hw thread, see gen_corepolicy */
+	*ncores = sizeof(seq_cores) / sizeof(seq_cores[0]);
+	if (!strcmp(name, "seq"))
+		return seq_cores;
+	if (!strcmp(name, "rr"))
+		return rr_cores;
+	return NULL;
+}
+
+struct bench *alloc_bench(int ncpu, int nbg, const unsigned int *cores)
 {
         struct bench *bench; 
         struct worker *worker;
@@ -63,7 +74,7 @@ struct bench *alloc_bench(int ncpu, int nbg)
         for (i = 0; i < ncpu; ++i) {
                 worker = &bench->workers[i];
                 worker->bench = bench;
-                worker->id = seq_cores[i];
+                worker->id = cores[i];
 		worker->is_bg = i >= (ncpu - nbg);
         }
 
@@ -97,7 +108,7 @@ static void worker_main(void *arg)
 
         /* wait for start signal */ 
         worker->ready = 1;
-        if (worker->id) {
+        if (worker != &bench->workers[0]) {
                 while (!bench->start)
                         nop_pause();
         }
@@ -143,7 +154,7 @@ static void worker_main(void *arg)
         e_us = usec();
 
 	/* stop performance profiling */
-        if (!worker->id && bench->profile_stop_cmd[0])
+        if (worker == &bench->workers[0] && bench->profile_stop_cmd[0])
 		system(bench->profile_stop_cmd);
 
         /* post-work */ 
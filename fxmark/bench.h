@@ -59,7 +59,7 @@ struct worker {
 	uint64_t private[WORKER_MAX_PRIVATE];
 } CACHELINE_ALIGNED;
 
-struct bench *alloc_bench(int ncpu, int nbg);
+struct bench *alloc_bench(int ncpu, int nbg, const unsigned int *cores);
 void run_bench(struct bench *bench);
 void report_bench(struct bench *bench, FILE *out);
 
@@ -71,6 +71,11 @@ extern const unsigned int CACHE_PER_CORE;
 extern const unsigned int seq_cores[];
 extern const unsigned int rr_cores[];
 
+/* core policy: the order in which workers are placed on hw threads,
+ * "seq" (the cores of one chip after another) or "rr" (round-robin over
+ * the chips), SMT siblings last in both; NULL if there is no such policy */
+const unsigned int *find_core_policy(const char *name, int *ncores);
+
 /* debug stuff */
 #include <stdio.h>
 #define HERE() printf("%s:%d\n", __func__, __LINE__)
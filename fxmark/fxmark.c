@@ -109,6 +109,7 @@ static int parse_option(int argc, char *argv[], struct cmd_opt *opt)
 		{"nbg",       required_argument, 0, 'g'}, 
 		{"duration",  required_argument, 0, 'd'}, 
 		{"root",      required_argument, 0, 'r'}, 
+		{"policy",    required_argument, 0, 'p'},
 		{"profbegin", required_argument, 0, 'b'},
 		{"profend",   required_argument, 0, 'e'},
 		{"proflog",   required_argument, 0, 'l'},
@@ -122,7 +123,7 @@ static int parse_option(int argc, char *argv[], struct cmd_opt *opt)
 	for(arg_cnt = 0; 1; ++arg_cnt) {
 		int c, idx = 0;
 		c = getopt_long(argc, argv, 
-				"t:n:g:d:r:b:e:l:", options, &idx);
+				"t:n:g:d:r:p:b:e:l:", options, &idx);
 		if (c == -1)
 			break; 
 		switch(c) {
@@ -143,6 +144,11 @@ static int parse_option(int argc, char *argv[], struct cmd_opt *opt)
 		case 'r':
 			opt->root = optarg;
 			break;
+		case 'p':
+			opt->cores = find_core_policy(optarg, &opt->max_ncore);
+			if (!opt->cores)
+				return -EINVAL;
+			break;
 		case 'b':
 			opt->profile_start_cmd = optarg;
 			break;
@@ -171,6 +177,7 @@ static void usage(FILE *out, const char *myname)
 	fprintf(out, "  --nbg       = number of background worker\n");
 	fprintf(out, "  --duration  = duration in seconds\n");
 	fprintf(out, "  --root      = test root directory\n");
+	fprintf(out, "  --policy    = core policy, seq (default) or rr\n");
 	fprintf(out, "  --profbegin = profiling start command\n");
 	fprintf(out, "  --profend   = profiling stop command\n");
 	fprintf(out, "  --proflog   = profiling log file\n");
@@ -196,14 +203,17 @@ int main(int argc, char *argv[])
 	struct cmd_opt opt = {NULL, 0, 0, 0, NULL};
 	struct bench *bench; 
 
+	opt.cores = find_core_policy("seq", &opt.max_ncore);
+
 	/* parse command line options */
-	if (parse_option(argc, argv, &opt) < 4) {
+	if (parse_option(argc, argv, &opt) < 4 ||
+	    opt.ncore < 1 || opt.ncore > opt.max_ncore) {
 		usage(stderr, argv[0]);
 		exit(1);
 	}
 
 	/* create, initialize, and run a bench */ 
-	bench = alloc_bench(opt.ncore, opt.nbg);
+	bench = alloc_bench(opt.ncore, opt.nbg, opt.cores);
 	init_bench(bench, &opt);
 	run_bench(bench);
 	report_bench(bench, stdout);
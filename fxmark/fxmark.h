@@ -28,6 +28,8 @@ struct cmd_opt {
 	int nbg;
 	int duration;
 	char *root;
+	const unsigned int *cores;
+	int max_ncore;
 	char *profile_start_cmd;
 	char *profile_stop_cmd;
 	char *profile_stat_file;
@@ -22,6 +22,7 @@ struct ahci_reg_global {
 
 #define AHCI_CAP_NCS_SHIFT      8
 #define AHCI_CAP_NCS_MASK       0x1f
+#define AHCI_CAP_SNCQ           (1u << 30)
 #define AHCI_GHC_AE		(1 << 31)
 #define AHCI_GHC_IE		(1 << 1)
 #define AHCI_GHC_HR		(1 << 0)
@@ -0,0 +1,135 @@
+#pragma once
+
+// Bump-pointer arenas for short-lived allocations.
+//
+// An arena hands out memory by bumping a pointer through chunks it
+// gets from kalloc, and frees all of it at once when it is destroyed
+// (or reset()).  Individual frees do nothing.  This suits the
+// temporary vectors of a single commit or fsync, which are all dead
+// by the time it finishes: an arena_vector<T> is a std::vector that
+// allocates from an arena.
+//
+// inline_arena<N> carries its first N bytes inline, so a small arena
+// on the stack or in an object never touches the allocator at all.
+
+#include "kernel.hh"
+#include "cpputil.hh"
+
+#include <vector>
+
+class arena
+{
+public:
+  arena(const arena&) = delete;
+  arena& operator=(const arena&) = delete;
+
+  ~arena()
+  {
+    reset();
+  }
+
+  // Allocate n bytes aligned to align (a power of two).  Panics if
+  // kalloc fails, like the vectors that use this.
+  void *alloc(size_t n, size_t align = sizeof(void*))
+  {
+    uintptr_t p = (cur_ + align - 1) & ~(align - 1);
+    if (p + n > end_ || p < cur_) {
+      grow(n + align);
+      p = (cur_ + align - 1) & ~(align - 1);
+    }
+    cur_ = p + n;
+    return (void*)p;
+  }
+
+  // Free everything allocated from this arena.
+  void reset()
+  {
+    while (chunks_) {
+      chunk *c = chunks_;
+      chunks_ = c->next;
+      kfree(c, c->size);
+    }
+    cur_ = (uintptr_t)inline_;
+    end_ = cur_ + inline_size_;
+  }
+
+protected:
+  arena(char *buf, size_t size)
+    : chunks_(nullptr), inline_(buf), inline_size_(size),
+      cur_((uintptr_t)buf), end_((uintptr_t)buf + size) { }
+
+private:
+  struct chunk
+  {
+    chunk *next;
+    size_t size;
+  };
+
+  void grow(size_t n)
+  {
+    size_t size = ARENA_CHUNK;
+    while (size < n + sizeof(chunk))
+      size *= 2;
+    chunk *c = (chunk*)kalloc("arena", size);
+    if (!c)
+      panic("arena: out of memory");
+    c->next = chunks_;
+    c->size = size;
+    chunks_ = c;
+    cur_ = (uintptr_t)(c + 1);
+    end_ = (uintptr_t)c + size;
+  }
+
+  chunk *chunks_;
+  char *inline_;
+  size_t inline_size_;
+  uintptr_t cur_, end_;
+};
+
+template<size_t N>
+class inline_arena : public arena
+{
+public:
+  inline_arena() : arena(buf_, N) { }
+
+private:
+  char buf_[N] __attribute__((aligned(sizeof(void*))));
+};
+
+template<>
+class inline_arena<0> : public arena
+{
+public:
+  inline_arena() : arena(nullptr, 0) { }
+};
+
+// A standard allocator that allocates from an arena.  deallocate()
+// is a no-op; the memory goes away with the arena, so containers
+// using this must not outlive it.
+template<class T>
+class arena_allocator
+{
+public:
+  typedef T value_type;
+
+  arena_allocator(arena *a) noexcept : arena_(a) { }
+  template<class U>
+  arena_allocator(const arena_allocator<U> &o) noexcept : arena_(o.arena_) { }
+
+  T *allocate(size_t n)
+  {
+    return (T*)arena_->alloc(n * sizeof(T), alignof(T));
+  }
+
+  void deallocate(T *p, size_t n) { }
+
+  bool operator==(const arena_allocator &o) const { return arena_ == o.arena_; }
+  bool operator!=(const arena_allocator &o) const { return arena_ != o.arena_; }
+
+private:
+  template<class U> friend class arena_allocator;
+  arena *arena_;
+};
+
+template<class T>
+using arena_vector = std::vector<T, arena_allocator<T>>;
@@ -118,6 +118,10 @@ public:
   }
 
   // Free a region previously allocated with <tt>alloc(size)</tt>.
+  // The region may also be freed piecemeal, in naturally aligned
+  // smaller blocks: the buddy bitmaps of an allocated block look the
+  // same as if all of its sub-blocks had been allocated.  (Only the
+  // !KALLOC_BUDDY_PER_CPU debug checks can't tell the difference.)
   void free(void *ptr, std::size_t size)
   {
     free_bytes += size;
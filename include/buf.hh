@@ -8,21 +8,30 @@
 #include "lockwrap.hh"
 #include "weakcache.hh"
 #include "disk.hh"
+#include "memacct.hh"
 
 class buf : public refcache::weak_referenced {
 public:
+  // A whole page, so that block contents come straight from the page
+  // allocator's per-core lists of free pages.
   struct bufdata {
     char data[BSIZE];
   };
+  static_assert(sizeof(bufdata) == PGSIZE, "Block buffers must be pages");
 
   typedef pair<u32, u64> key_t;
 
   static bool in_bufcache(u32 dev, u64 block);
   static sref<buf> get(u32 dev, u64 block, bool skip_disk_read = false);
+  static void prefetch(u32 dev, const std::vector<u64> &blocks);
+  static std::vector<sref<buf> > get_blocks(u32 dev,
+                                            const std::vector<u64> &blocks);
+  static std::vector<sref<buf> > get_range(u32 dev, u64 start, u64 n);
   static void put(u32 dev, u64 block);
+  static void refresh(u32 dev, u64 block, const char *data);
   void writeback(bool sync = true);
   void writeback_async();
-  void add_to_transaction(transaction *trans);
+  void add_to_transaction(transaction *trans, u64 dirty_chunks = ~0ULL);
   void add_blocknum_to_transaction(transaction *trans);
 
   void async_iowait_init() {
@@ -40,15 +49,25 @@ public:
   u64 block() { return block_; }
   bool dirty() { return dirty_; }
 
+  // The buffer cache holds a reference to a pinned buf, which keeps it
+  // cached even while nobody else is using it. Pinning and unpinning are
+  // idempotent.
   void cache_pin(bool flag) {
+    if (!cmpxch(&pinned_, !flag, flag))
+      return;
     if (flag)
       inc();
     else
       dec();
   }
 
+  // For the buffer cache reclaimer: unpin the buf if it hasn't been looked
+  // up since the last call, and the disk has the same contents. Returns
+  // whether the buf is now unpinned.
+  bool reclaim();
+
   seq_reader<bufdata> read() {
-    return seq_reader<bufdata>(data_, &seq_);
+    return seq_reader<bufdata>(&data_, &seq_);
   }
 
   class buf_dirty {
@@ -62,27 +81,34 @@ public:
     buf* b_;
   };
 
-  class buf_writer : public ptr_wrap<bufdata>,
-                     public lock_guard<sleeplock>,
+  // The data pointer is initialized last, once we hold the write_lock_, since
+  // the writer might have to switch to a private copy of the block (see
+  // unshare_data()).
+  class buf_writer : public lock_guard<sleeplock>,
                      public seq_writer,
-                     public buf_dirty {
+                     public buf_dirty,
+                     public ptr_wrap<bufdata> {
   public:
-    buf_writer(bufdata* d, sleeplock* l, seqcount<u32>* s, buf* b)
-      : ptr_wrap<bufdata>(d), lock_guard<sleeplock>(l),
-        seq_writer(s), buf_dirty(b) {}
+    buf_writer(buf* b, bool dirty)
+      : lock_guard<sleeplock>(&b->write_lock_), seq_writer(&b->seq_),
+        buf_dirty(dirty ? b : nullptr), ptr_wrap<bufdata>(b->unshare_data()) {}
   };
 
   buf_writer write() {
-    return buf_writer(data_, &write_lock_, &seq_, this);
+    return buf_writer(this, true);
   }
 
   // Same as write(), except that the block is not marked dirty.
   // Used to get exclusive (i.e., write) access to the block without
   // disturbing the dirty flag or the reference count.
   buf_writer write_clean() {
-    return buf_writer(data_, &write_lock_, &seq_, nullptr);
+    return buf_writer(this, false);
   }
 
+  // Drop a transaction's reference to the block contents that it logged
+  // without copying (see add_to_transaction()).
+  void put_frozen_data();
+
 private:
   const u32 dev_;
   const u64 block_;
@@ -91,28 +117,60 @@ private:
   sleeplock write_lock_;
   sleeplock writeback_lock_;
   std::atomic<bool> dirty_;
+  std::atomic<bool> pinned_;
+  // Whether the buf has been looked up since the reclaimer last looked at it.
+  std::atomic<bool> referenced_;
+  // Whether the block has not been modified since it was read from the disk.
+  // Blocks that have been modified stay pinned, even once they are clean:
+  // a clean block's contents may only be in the journal so far.
+  std::atomic<bool> on_disk_;
+  // Whether reclaim() unpinned the buf, which had to be re-pinned if somebody
+  // that still held a reference to it modifies it.
+  std::atomic<bool> evicted_;
   sref<disk_completion> dc_;
 
   bufdata *data_;
 
+  // Block contents that transactions hold references to, instead of private
+  // copies, and the number of such references. As long as frozen_ == data_,
+  // the next writer must modify a copy of the block instead (copy-on-write);
+  // after that, frozen_ is owned by the transactions and is freed when the
+  // last one of them drops its reference.
+  bufdata *frozen_;
+  u32 frozen_refs_;
+  spinlock frozen_lock_; // Protects frozen_, frozen_refs_ and updates to data_.
+
   buf(u32 dev, u64 block)
-    : dev_(dev), block_(block), dirty_(false)
+    : dev_(dev), block_(block), write_lock_("buf::write", LOCKSTAT_BIO),
+      writeback_lock_("buf::writeback", LOCKSTAT_BIO), dirty_(false), pinned_(false),
+      referenced_(true), on_disk_(false), evicted_(false), frozen_(nullptr),
+      frozen_refs_(0)
   {
-    data_ = (bufdata *) kmalloc(sizeof(bufdata), "bufdata");
+    data_ = (bufdata *) kalloc("bufdata", sizeof(bufdata));
+    memacct_add(MEMACCT_BUFDATA, 1, sizeof(bufdata));
   }
   void onzero() override;
   NEW_DELETE_OPS(buf);
 
   ~buf()
   {
-    kmfree(data_, sizeof(bufdata));
+    assert(!frozen_);
+    kfree(data_, sizeof(bufdata));
+    memacct_add(MEMACCT_BUFDATA, -1, -(s64)sizeof(bufdata));
   }
 
+  bufdata *unshare_data();
+
   void mark_dirty() {
+    on_disk_ = false;
+    if (evicted_ && cmpxch(&evicted_, true, false))
+      cache_pin(true);
     if (cmpxch(&dirty_, false, true))
       inc();
   }
 
+  void pin_and_track();
+
   void mark_clean() {
     if (cmpxch(&dirty_, true, false))
       dec();
@@ -1,7 +1,15 @@
 #pragma once
 
 /*
- * A bucket-chaining hash table.
+ * A bucket-chaining hash table, whose bucket array grows and shrinks
+ * with the number of keys in it.
+ *
+ * Besides its chain, each bucket keeps an inline index of up to four of
+ * the chain's items, each with a 16-bit tag taken from its hash.  The
+ * tags share one word, so lookup() compares all of them at once (SIMD
+ * within the register, since the kernel doesn't use SSE) and only
+ * dereferences the items whose tag matches.  Only when some of the
+ * bucket's items didn't fit in the index does it walk the chain.
  */
 
 #include "spinlock.hh"
@@ -11,14 +19,17 @@
 #include "ilist.hh"
 #include "hpet.hh"
 #include "cpuid.hh"
+#include "percpu.hh"
+#include "log2.hh"
+#include "memacct.hh"
 
 template<class K, class V>
 class chainhash {
 private:
   struct item : public rcu_freed {
-    item(const K& k, const V& v)
+    item(const K& k, const V& v, u64 h)
       : rcu_freed("chainhash::item", this, sizeof(*this)),
-        key(k), val(v) {}
+        key(k), val(v), hash(h) {}
     void do_gc() override { delete this; }
     NEW_DELETE_OPS(item);
 
@@ -26,33 +37,208 @@ private:
     seqcount<u32> seq;
     const K key;
     V val;
+    const u64 hash;
   };
 
+  enum { NINLINE = 4 };
+
+  // An item's tag; never 0, which marks an empty index slot.
+  static u16 tag_of(u64 h) {
+    return (u16)(h >> 16) | 1;
+  }
+
   struct bucket {
     spinlock lock __mpalign__;
     islist<item, &item::link> chain;
+    // The index: slot j holds inl[j] and its tag in bits 16*j to
+    // 16*j+15 of tags.  Changed under lock.  An item keeps its slot
+    // for as long as it is in the chain, and items that didn't get one
+    // stay out of the index, so a reader that finds neither the item
+    // in the index nor noverflow set knows the item isn't here.
+    std::atomic<u64> tags;
+    std::atomic<item*> inl[NINLINE];
+    // Number of items in the chain but not in the index
+    std::atomic<u32> noverflow;
+
+    bucket() : tags(0), noverflow(0) {
+      for (auto &i : inl)
+        i.store(nullptr, std::memory_order_relaxed);
+    }
+
+    // Add i to the chain and the index.  Caller must hold lock.
+    void link(item *i) {
+      chain.push_front(i);
+      u64 t = tags.load(std::memory_order_relaxed);
+      for (int j = 0; j < NINLINE; j++) {
+        if (!(t & (0xffffull << (16 * j)))) {
+          inl[j].store(i, std::memory_order_release);
+          tags.store(t | ((u64)tag_of(i->hash) << (16 * j)),
+                     std::memory_order_release);
+          return;
+        }
+      }
+      noverflow.store(noverflow.load(std::memory_order_relaxed) + 1,
+                      std::memory_order_release);
+    }
+
+    // Drop i, which the caller just took out of the chain, from the
+    // index.  Caller must hold lock.
+    void unlink(item *i) {
+      for (int j = 0; j < NINLINE; j++) {
+        if (inl[j].load(std::memory_order_relaxed) == i) {
+          // Clear the tag first, so readers skip the slot before it
+          // empties (though they check the item's key anyway).
+          tags.store(tags.load(std::memory_order_relaxed) &
+                     ~(0xffffull << (16 * j)), std::memory_order_release);
+          inl[j].store(nullptr, std::memory_order_relaxed);
+          return;
+        }
+      }
+      noverflow.store(noverflow.load(std::memory_order_relaxed) - 1,
+                      std::memory_order_relaxed);
+    }
+
+    // The index slots whose tag matches h's, as a mask with bit 16*j+15
+    // set for each matching slot j.  This may also report a few slots
+    // that don't match.
+    u64 candidates(u64 h) const {
+      const u64 lo = 0x0001000100010001ull, hi = 0x8000800080008000ull;
+      u64 x = tags.load(std::memory_order_acquire) ^ (tag_of(h) * lo);
+      return (x - lo) & ~x & hi;
+    }
+  };
 
-    ~bucket() {
-      while (!chain.empty()) {
-        item *i = &chain.front();
-        chain.pop_front();
-        gc_delayed(i);
+  // The bucket array. Keys go to buckets by the top bits of their (mixed)
+  // hash, so that doubling the table splits each bucket into two adjacent
+  // ones, and enumerate() sees the keys in the same order across a resize.
+  // A resize copies the items into a new table and marks the old one moved,
+  // holding all of its bucket locks; the old table and its items are freed
+  // once no reader can be looking at them any more. Writers lock a bucket
+  // and then check that its table hasn't been moved.
+  struct table : public rcu_freed {
+    table(u64 n)
+      : rcu_freed("chainhash::table", this, sizeof(*this)),
+        nbuckets(n), shift(64 - floor_log2(n)), moved(false) {
+      buckets = new bucket[nbuckets];
+      assert(buckets);
+      _rcu_size += nbuckets * sizeof(bucket);
+    }
+
+    ~table() {
+      for (u64 i = 0; i < nbuckets; i++) {
+        while (!buckets[i].chain.empty()) {
+          item *it = &buckets[i].chain.front();
+          buckets[i].chain.pop_front();
+          delete it;
+        }
       }
+      delete[] buckets;
     }
+
+    void do_gc() override { delete this; }
+    NEW_DELETE_OPS(table);
+
+    bucket* get(u64 h) const { return &buckets[h >> shift]; }
+
+    const u64 nbuckets;
+    const u32 shift;
+    bool moved;
+    bucket* buckets;
   };
 
-  u64 nbuckets_;
+  static u64 mix(const K& k) {
+    return hash(k) * 0x9e3779b97f4a7c15ull;
+  }
+
+  const u64 min_buckets_;
   bool dead_;
-  bucket* buckets_;
+  std::atomic<table*> table_;
+  spinlock resize_lock_;
+  // Number of items, spread over the cores that inserted or removed them.
+  percpu<std::atomic<s64>> count_;
+
+  s64 count() const {
+    s64 n = 0;
+    for (int i = 0; i < NCPU; i++)
+      n += count_[i];
+    return n;
+  }
+
+  // What to count the table's memory as (see memacct.hh), if anything:
+  // kind for its buckets and kind + 1 for its items.
+  const u8 memacct_;
+
+  void add_count(s64 n) {
+    *count_.get_unchecked() += n;
+    if (memacct_)
+      memacct_add(memacct_ + 1, n, n * (s64)sizeof(item));
+  }
+
+  // Count t's buckets in or (sign -1) out.  A table that a resize
+  // replaced is left to the gc's count, like the items that are removed.
+  void account(table *t, int sign) {
+    if (memacct_)
+      memacct_add(memacct_, sign * (s64)t->nbuckets,
+                  sign * (s64)(sizeof(*t) + t->nbuckets * sizeof(bucket)));
+  }
+
+  // Replace table t, if still current, with one of n buckets.
+  void resize(table *t, u64 n) {
+    scoped_acquire rl(&resize_lock_);
+    if (table_.load() != t || dead_)
+      return;
+
+    // Allocate the new bucket array before stopping every writer; only
+    // the items have to be copied with t's buckets locked.
+    table *nt = new table(n);
+    for (u64 i = 0; i < t->nbuckets; i++)
+      t->buckets[i].lock.acquire();
+
+    for (u64 i = 0; i < t->nbuckets; i++)
+      for (const item& ii: t->buckets[i].chain)
+        nt->get(ii.hash)->link(new item(ii.key, ii.val, ii.hash));
+    t->moved = true;
+    table_.store(nt);
+    account(nt, 1);
+    account(t, -1);
+
+    for (u64 i = 0; i < t->nbuckets; i++)
+      t->buckets[i].lock.release();
+    gc_delayed(t);
+  }
+
+  // Grow the table if an insert found a long chain in it, and the chains
+  // are long on average, or shrink it if a remove emptied a bucket, and
+  // most are empty.
+  void maybe_grow(table *t, u64 chainlen) {
+    if (chainlen >= CHAINHASH_LOAD &&
+        count() > (s64)(t->nbuckets * CHAINHASH_LOAD))
+      resize(t, t->nbuckets * 2);
+  }
+
+  void maybe_shrink(table *t) {
+    if (t->nbuckets > min_buckets_ &&
+        count() < (s64)(t->nbuckets * CHAINHASH_LOAD / 8))
+      resize(t, t->nbuckets / 2);
+  }
 
 public:
-  chainhash(u64 nbuckets) : nbuckets_(nbuckets), dead_(false) {
-    buckets_ = new bucket[nbuckets_];
-    assert(buckets_);
+  // The table starts with nbuckets buckets (rounded up to a power of two),
+  // and never shrinks below that.  A memacct kind with a kind for items
+  // right after it accounts for the table's memory.
+  chainhash(u64 nbuckets, u8 memacct = MEMACCT_NONE)
+    : min_buckets_(round_up_to_pow2(nbuckets < 2 ? 2 : nbuckets)),
+      dead_(false), memacct_(memacct) {
+    table_.store(new table(min_buckets_));
+    for (int i = 0; i < NCPU; i++)
+      count_[i] = 0;
+    account(table_.load(), 1);
   }
 
   ~chainhash() {
-    delete[] buckets_;
+    account(table_.load(), -1);
+    add_count(-count());
+    gc_delayed(table_.load());
   }
 
   NEW_DELETE_OPS(chainhash);
@@ -61,70 +247,114 @@ public:
     if (dead_ || lookup(k))
       return false;
 
-    bucket* b = &buckets_[hash(k) % nbuckets_];
-    scoped_acquire l(&b->lock);
-
-    if (dead_)
-      return false;
+    scoped_gc_epoch rcu_read;
+    u64 h = mix(k);
+    table *t;
+    u64 chainlen;
+    for (;;) {
+      t = table_.load();
+      bucket* b = t->get(h);
+      scoped_acquire l(&b->lock);
+      if (t->moved)
+        continue;
 
-    for (const item& i: b->chain)
-      if (i.key == k)
+      if (dead_)
         return false;
 
-    b->chain.push_front(new item(k, v));
-    if (tsc)
-      *tsc = get_tsc();
+      chainlen = 0;
+      for (const item& i: b->chain) {
+        if (i.key == k)
+          return false;
+        chainlen++;
+      }
+
+      b->link(new item(k, v, h));
+      if (tsc)
+        *tsc = get_tsc();
+      break;
+    }
+
+    add_count(1);
+    maybe_grow(t, chainlen);
     return true;
   }
 
   bool remove(const K& k, const V& v, u64 *tsc = NULL) {
-    if (!lookup(k))
-      return false;
+    return remove_if(k, [&v](const V& val) { return val == v; }, tsc);
+  }
 
-    bucket* b = &buckets_[hash(k) % nbuckets_];
-    scoped_acquire l(&b->lock);
+  bool remove(const K& k, u64 *tsc = NULL) {
+    return remove_if(k, [](const V&) { return true; }, tsc);
+  }
 
-    auto i = b->chain.before_begin();
-    auto end = b->chain.end();
+  // Set this[k] to vnew, if it is currently vold.
+  bool replace(const K& k, const V& vold, const V& vnew) {
+    scoped_gc_epoch rcu_read;
+    u64 h = mix(k);
     for (;;) {
-      auto prev = i;
-      ++i;
-      if (i == end)
-        return false;
-      if (i->key == k && i->val == v) {
-        b->chain.erase_after(prev);
-        gc_delayed(&*i);
-        if (tsc)
-          *tsc = get_tsc();
-        return true;
+      table *t = table_.load();
+      bucket* b = t->get(h);
+      scoped_acquire l(&b->lock);
+      if (t->moved)
+        continue;
+
+      for (item& i: b->chain) {
+        if (i.key == k) {
+          if (i.val != vold)
+            return false;
+          auto w = i.seq.write_begin();
+          i.val = vnew;
+          return true;
+        }
       }
+      return false;
     }
   }
 
-  bool remove(const K& k, u64 *tsc = NULL) {
+private:
+  template<class F>
+  bool remove_if(const K& k, F match, u64 *tsc) {
     if (!lookup(k))
       return false;
 
-    bucket* b = &buckets_[hash(k) % nbuckets_];
-    scoped_acquire l(&b->lock);
-
-    auto i = b->chain.before_begin();
-    auto end = b->chain.end();
+    scoped_gc_epoch rcu_read;
+    u64 h = mix(k);
+    table *t;
+    bool emptied;
     for (;;) {
-      auto prev = i;
-      ++i;
-      if (i == end)
-        return false;
-      if (i->key == k) {
-        b->chain.erase_after(prev);
-        gc_delayed(&*i);
-        if (tsc)
-          *tsc = get_tsc();
-        return true;
+      t = table_.load();
+      bucket* b = t->get(h);
+      scoped_acquire l(&b->lock);
+      if (t->moved)
+        continue;
+
+      auto i = b->chain.before_begin();
+      auto end = b->chain.end();
+      for (;;) {
+        auto prev = i;
+        ++i;
+        if (i == end)
+          return false;
+        if (i->key == k && match(i->val)) {
+          b->chain.erase_after(prev);
+          b->unlink(&*i);
+          gc_delayed(&*i);
+          if (tsc)
+            *tsc = get_tsc();
+          break;
+        }
       }
+      emptied = b->chain.empty();
+      break;
     }
+
+    add_count(-1);
+    if (emptied)
+      maybe_shrink(t);
+    return true;
   }
 
+public:
   bool replace_from(const K& kdst, const V* vpdst, chainhash* src,
                     const K& ksrc, const V& vsrc, chainhash *subdir,
                     const K& ksubdir, const V& vsubdir, u64 *tsc = NULL)
@@ -148,27 +378,40 @@ public:
      *  - TODO: Also deal with the directory that was replaced from the
      *          destination directory by subdir.
      */
-    bucket* bdst = &buckets_[hash(kdst) % nbuckets_];
-    bucket* bsrc = &src->buckets_[hash(ksrc) % src->nbuckets_];
-    bucket* bsubdir = subdir ?
-                     (&subdir->buckets_[hash(ksubdir) % subdir->nbuckets_]) :
-                     nullptr;
+    scoped_gc_epoch rcu_read;
+    u64 hdst = mix(kdst);
+    table *tdst, *tsrc, *tsubdir;
+    bucket *bdst, *bsrc, *bsubdir;
 
     // Acquire the locks for the source, destination and the subdir directory
-    // hash tables in the order of increasing bucket addresses.
+    // hash tables in the order of increasing bucket addresses, and start over
+    // if any of the tables was resized before we got them.
     scoped_acquire lk[3];
-    std::vector<bucket*> buckets;
-
-    if (bsubdir != nullptr && bsubdir != bsrc && bsubdir != bdst)
-      buckets.push_back(bsubdir);
-    if (bsrc != bdst)
-      buckets.push_back(bsrc);
-    buckets.push_back(bdst);
-    std::sort(buckets.begin(), buckets.end());
-
-    int i = 0;
-    for (auto &b : buckets)
-      lk[i++] = b->lock.guard();
+    for (;;) {
+      tdst = table_.load();
+      tsrc = src->table_.load();
+      tsubdir = subdir ? subdir->table_.load() : nullptr;
+      bdst = tdst->get(hdst);
+      bsrc = tsrc->get(mix(ksrc));
+      bsubdir = subdir ? tsubdir->get(mix(ksubdir)) : nullptr;
+
+      std::vector<bucket*> buckets;
+      if (bsubdir != nullptr && bsubdir != bsrc && bsubdir != bdst)
+        buckets.push_back(bsubdir);
+      if (bsrc != bdst)
+        buckets.push_back(bsrc);
+      buckets.push_back(bdst);
+      std::sort(buckets.begin(), buckets.end());
+
+      int i = 0;
+      for (auto &b : buckets)
+        lk[i++] = b->lock.guard();
+
+      if (!tdst->moved && !tsrc->moved && !(tsubdir && tsubdir->moved))
+        break;
+      for (auto &l : lk)
+        l.release();
+    }
 
     /*
      * Abort the rename if the destination directory's hash table has been
@@ -203,6 +446,7 @@ public:
         auto w = i.seq.write_begin();
         i.val = vsrc;
         bsrc->chain.erase_after(srcprev);
+        bsrc->unlink(&*srci);
         gc_delayed(&*srci);
 
         if (bsubdir != nullptr) {
@@ -216,6 +460,7 @@ public:
 
         if (tsc)
           *tsc = get_tsc();
+        src->add_count(-1);
         return true;
       }
     }
@@ -224,8 +469,9 @@ public:
       return false;
 
     bsrc->chain.erase_after(srcprev);
+    bsrc->unlink(&*srci);
     gc_delayed(&*srci);
-    bdst->chain.push_front(new item(kdst, vsrc));
+    bdst->link(new item(kdst, vsrc, hdst));
 
     if (bsubdir != nullptr) {
       for (item& isubdir : bsubdir->chain) {
@@ -238,36 +484,84 @@ public:
 
     if (tsc)
       *tsc = get_tsc();
+    if (src != this) {
+      src->add_count(-1);
+      add_count(1);
+    }
     return true;
   }
 
+  // Enumerate the keys in the order of their hash, and then of the keys
+  // themselves, which does not depend on the size of the table.
   bool enumerate(const K* prev, K* out) const {
     scoped_gc_epoch rcu_read;
 
-    bool prevbucket = (prev != nullptr);
-    for (u64 i = prev ? hash(*prev) % nbuckets_ : 0; i < nbuckets_; i++) {
-      bucket* b = &buckets_[i];
+    table *t = table_.load();
+    u64 ph = prev ? mix(*prev) : 0;
+    u64 outh = 0;
+    for (u64 i = prev ? ph >> t->shift : 0; i < t->nbuckets; i++) {
+      bucket* b = &t->buckets[i];
       bool found = false;
       for (const item& i: b->chain) {
-        if ((!prevbucket || *prev < i.key) && (!found || i.key < *out)) {
+        if (prev && (i.hash < ph || (i.hash == ph && !(*prev < i.key))))
+          continue;
+        if (!found || i.hash < outh || (i.hash == outh && i.key < *out)) {
           *out = i.key;
+          outh = i.hash;
           found = true;
         }
       }
       if (found)
         return true;
-      prevbucket = false;
     }
 
     return false;
   }
 
+  // Like enumerate(prev, out), but return up to n of the keys after prev (and
+  // their values) at once, walking the table just once.
+  size_t enumerate(const K* prev, K* keys, V* vals, size_t n) const {
+    scoped_gc_epoch rcu_read;
+
+    table *t = table_.load();
+    u64 ph = prev ? mix(*prev) : 0;
+    size_t got = 0;
+    for (u64 i = prev ? ph >> t->shift : 0; i < t->nbuckets && got < n; i++) {
+      // Insertion-sort the bucket's keys into keys[first, got), keeping the
+      // smallest ones if there isn't room for all of them.
+      size_t first = got;
+      for (const item& it: t->buckets[i].chain) {
+        if (prev && (it.hash < ph || (it.hash == ph && !(*prev < it.key))))
+          continue;
+        size_t j = got;
+        while (j > first) {
+          u64 h = mix(keys[j - 1]);
+          if (h < it.hash || (h == it.hash && keys[j - 1] < it.key))
+            break;
+          j--;
+        }
+        if (j == n)
+          continue;
+        for (size_t k = (got < n ? got : n - 1); k > j; k--) {
+          keys[k] = keys[k - 1];
+          vals[k] = vals[k - 1];
+        }
+        keys[j] = it.key;
+        vals[j] = *seq_reader<V>(&it.val, &it.seq);
+        if (got < n)
+          got++;
+      }
+    }
+    return got;
+  }
+
   template<class CB>
   void enumerate(CB cb) const {
     scoped_gc_epoch rcu_read;
 
-    for (u64 i = 0; i < nbuckets_; i++) {
-      bucket* b = &buckets_[i];
+    table *t = table_.load();
+    for (u64 i = 0; i < t->nbuckets; i++) {
+      bucket* b = &t->buckets[i];
 
       for (const item& i: b->chain) {
         V val = *seq_reader<V>(&i.val, &i.seq);
@@ -280,7 +574,19 @@ public:
   bool lookup(const K& k, V* vptr = nullptr) const {
     scoped_gc_epoch rcu_read;
 
-    bucket* b = &buckets_[hash(k) % nbuckets_];
+    u64 h = mix(k);
+    bucket* b = table_.load()->get(h);
+    for (u64 m = b->candidates(h); m; m &= m - 1) {
+      item *i = b->inl[__builtin_ctzll(m) / 16].load(std::memory_order_acquire);
+      if (!i || i->key != k)
+        continue;
+      if (vptr)
+        *vptr = *seq_reader<V>(&i->val, &i->seq);
+      return true;
+    }
+    if (!b->noverflow.load(std::memory_order_acquire))
+      return false;
+
     for (const item& i: b->chain) {
       if (i.key != k)
         continue;
@@ -295,31 +601,36 @@ public:
     if (dead_)
       return false;
 
-    for (u64 i = 0; i < nbuckets_; i++)
-      for (const item& ii: buckets_[i].chain)
+    // Holding resize_lock_ keeps the table from changing under us.
+    scoped_acquire rl(&resize_lock_);
+    table *t = table_.load();
+    for (u64 i = 0; i < t->nbuckets; i++)
+      for (const item& ii: t->buckets[i].chain)
         if (ii.key != k || ii.val != v)
           return false;
 
-    for (u64 i = 0; i < nbuckets_; i++)
-      buckets_[i].lock.acquire();
+    for (u64 i = 0; i < t->nbuckets; i++)
+      t->buckets[i].lock.acquire();
 
     bool killed = !dead_;
-    for (u64 i = 0; i < nbuckets_; i++)
-      for (const item& ii: buckets_[i].chain)
+    for (u64 i = 0; i < t->nbuckets; i++)
+      for (const item& ii: t->buckets[i].chain)
         if (ii.key != k || ii.val != v)
           killed = false;
 
     if (killed) {
       dead_ = true;
-      bucket* b = &buckets_[hash(k) % nbuckets_];
+      bucket* b = t->get(mix(k));
       item* i = &b->chain.front();
       assert(i->key == k && i->val == v);
       b->chain.pop_front();
+      b->unlink(i);
       gc_delayed(i);
+      add_count(-1);
     }
 
-    for (u64 i = 0; i < nbuckets_; i++)
-      buckets_[i].lock.release();
+    for (u64 i = 0; i < t->nbuckets; i++)
+      t->buckets[i].lock.release();
 
     return killed;
   }
@@ -30,6 +30,9 @@ struct condvar {
 
   void sleep(struct spinlock *, struct spinlock * = nullptr);
   void sleep_to(struct spinlock*, u64, struct spinlock * = nullptr);
+  // Like sleep_to(), charging the wait to site in the lock profile (see
+  // lockprof.hh), or to nobody if site is 0.
+  void sleep_at(struct spinlock*, u64, struct spinlock*, uptr site);
   void wake_all(int yield=false, proc *callerproc=nullptr);
   void wake_one(proc *p);
 };
@@ -0,0 +1,24 @@
+/*
+ *	crc32c.hh - CRC-32C (Castagnoli) routine
+ *
+ * Implements the CRC-32C used by iSCSI, SCTP and ext4:
+ *   Width 32
+ *   Poly  0x1EDC6F41 (reflected 0x82F63B78)
+ *   Init  caller supplied (typically ~0)
+ *
+ * The routine does not invert its result; callers that want the
+ * standard value pass ~0 as the initial CRC and invert the result.
+ */
+
+#pragma once
+
+#include "types.h"
+
+extern u32 const crc32c_table[256];
+
+extern u32 crc32c(u32 crc, const u8 *buffer, size_t len);
+
+static inline u32 crc32c_byte(u32 crc, const u8 data)
+{
+	return (crc >> 8) ^ crc32c_table[(crc ^ data) & 0xff];
+}
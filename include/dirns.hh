@@ -1,6 +1,33 @@
 #pragma once
 
-#define NDIR_ENTRIES_PRIME	521
+/*
+ * The in-memory index of an on-disk directory: which inode each name
+ * refers to, and the offset of its dirent in the directory.  It is an
+ * open-addressing (linear probing) hash table whose slots hold the names
+ * inline, so that a lookup touches a few adjacent slots rather than
+ * chasing a chain of separately allocated items.  The table grows and
+ * shrinks with the number of names in it.
+ *
+ * Lookups are lock-free: a writer changes the slots inside a seqcount
+ * write section, and readers retry if they overlap one.  Resizing builds
+ * a new table and frees the old one once no reader can be using it.
+ * Writers are serialized by a spinlock.
+ *
+ * The index also keeps track of the free dirent slots in the directory,
+ * and of how many entries each of its blocks holds, so that new entries
+ * fill the holes left by removed ones, and empty blocks at the end of the
+ * directory can be truncated.
+ */
+
+#include "spinlock.hh"
+#include "seqlock.hh"
+#include "hash.hh"
+#include "log2.hh"
+#include "gc.hh"
+#include "memacct.hh"
+
+// Minimum number of slots in a directory index.
+#define NDIR_ENTRIES_MIN	8
 
 struct dir_entry_info {
   u32 inum_;
@@ -21,26 +48,264 @@ struct dir_entry_info {
   }
 };
 
-class dir_entries {
+class dir_entries : public rcu_freed {
 public:
-  dir_entries(u64 size) : map_(size) {}
+  dir_entries()
+    : rcu_freed("dir_entries", this, sizeof(*this)), count_(0),
+      referenced_(true)
+  {
+    table_.store(new table(NDIR_ENTRIES_MIN));
+    account(table_.load(), 1);
+  }
+
+  ~dir_entries()
+  {
+    account(table_.load(), -1);
+    delete table_.load();
+  }
+
+  void do_gc() override { delete this; }
   NEW_DELETE_OPS(dir_entries);
 
   bool lookup(const strbuf<DIRSIZ>& name, dir_entry_info *de_info_ptr)
   {
-    return map_.lookup(name, de_info_ptr);
+    if (!referenced_.load(std::memory_order_relaxed))
+      referenced_.store(true, std::memory_order_relaxed);
+
+    scoped_gc_epoch rcu_read;
+    u32 h = hash_of(name);
+    for (;;) {
+      table *t = table_.load();
+      auto r = t->seq.read_begin();
+      u64 i = t->find(name, h);
+      dir_entry_info de_info;
+      if (i != ~0ull)
+        de_info = dir_entry_info(t->slots[i].inum, t->slots[i].offset);
+      if (r.need_retry())
+        continue;
+      if (i != ~0ull && de_info_ptr)
+        *de_info_ptr = de_info;
+      return i != ~0ull;
+    }
   }
 
   bool insert(const strbuf<DIRSIZ>& name, const dir_entry_info& de_info)
   {
-    return map_.insert(name, de_info);
+    auto l = lock_.guard();
+    u32 h = hash_of(name);
+    table *t = table_.load();
+    if (t->find(name, h) != ~0ull)
+      return false;
+
+    // Keep the table at most 3/4 full.
+    if ((count_ + 1) * 4 > t->nslots * 3)
+      t = resize(t->nslots * 2);
+
+    auto w = t->seq.write_begin();
+    t->place(name.buf_, h, de_info.inum_, de_info.offset_);
+    count_++;
+    return true;
   }
 
   bool remove(const strbuf<DIRSIZ>& name)
   {
-    return map_.remove(name);
+    auto l = lock_.guard();
+    u32 h = hash_of(name);
+    table *t = table_.load();
+    u64 i = t->find(name, h);
+    if (i == ~0ull)
+      return false;
+
+    {
+      auto w = t->seq.write_begin();
+      t->erase(i);
+    }
+    count_--;
+
+    if (t->nslots > NDIR_ENTRIES_MIN && count_ * 8 < t->nslots)
+      resize(t->nslots / 2);
+    return true;
+  }
+
+  // The offset for a new entry: a free slot, if there is one, or else end.
+  u32 next_slot(u32 end)
+  {
+    auto l = lock_.guard();
+    return free_slots_.empty() ? end : free_slots_.back();
+  }
+
+  // Count the slot at offset (as returned by next_slot()) as used.
+  void use_slot(u32 offset)
+  {
+    auto l = lock_.guard();
+    if (!free_slots_.empty() && free_slots_.back() == offset)
+      free_slots_.pop_back();
+    block_entries(offset)++;
+  }
+
+  // Count the slot at offset as free again.
+  void release_slot(u32 offset)
+  {
+    auto l = lock_.guard();
+    free_slots_.push_back(offset);
+    block_entries(offset)--;
+  }
+
+  // Note a free slot found on the disk, while building the index.
+  void note_free_slot(u32 offset)
+  {
+    auto l = lock_.guard();
+    free_slots_.push_back(offset);
+    block_entries(offset);
+  }
+
+  // Forget the empty blocks at the end of a directory that is end bytes
+  // long, and return the offset that the directory can be truncated to.
+  u32 trim(u32 end)
+  {
+    auto l = lock_.guard();
+    u32 nblocks = (end + BSIZE - 1) / BSIZE;
+    while (nblocks && (nblocks > block_entries_.size() ||
+                       !block_entries_[nblocks - 1]))
+      nblocks--;
+    if (nblocks * BSIZE >= end)
+      return end;
+
+    while (block_entries_.size() > nblocks)
+      block_entries_.pop_back();
+    for (size_t i = 0; i < free_slots_.size(); ) {
+      if (free_slots_[i] >= nblocks * BSIZE) {
+        free_slots_[i] = free_slots_.back();
+        free_slots_.pop_back();
+      } else {
+        i++;
+      }
+    }
+    return nblocks * BSIZE;
+  }
+
+  // Whether the index has been looked up in since the last call.
+  bool test_and_clear_referenced()
+  {
+    if (!referenced_.load(std::memory_order_relaxed))
+      return false;
+    referenced_.store(false, std::memory_order_relaxed);
+    return true;
   }
 
 private:
-  chainhash<strbuf<DIRSIZ>, dir_entry_info> map_;
+  struct slot {
+    char name[DIRSIZ];
+    u16 used;
+    u32 hash;
+    u32 inum;
+    u32 offset;
+  };
+
+  struct table : public rcu_freed {
+    table(u64 n)
+      : rcu_freed("dir_entries::table", this, sizeof(*this)),
+        nslots(n), mask(n - 1)
+    {
+      slots = new slot[nslots];
+      assert(slots);
+      _rcu_size += nslots * sizeof(slot);
+      for (u64 i = 0; i < nslots; i++)
+        slots[i].used = 0;
+    }
+
+    ~table()
+    {
+      delete[] slots;
+    }
+
+    void do_gc() override { delete this; }
+    NEW_DELETE_OPS(table);
+
+    // The slot holding name, or ~0 if there is none.  Bounded by the table
+    // size, since a reader racing a writer may see a torn table.
+    u64 find(const strbuf<DIRSIZ>& name, u32 h) const
+    {
+      u64 i = h & mask;
+      for (u64 n = 0; n < nslots && slots[i].used; n++, i = (i + 1) & mask)
+        if (slots[i].hash == h && !strncmp(slots[i].name, name.buf_, DIRSIZ))
+          return i;
+      return ~0ull;
+    }
+
+    void place(const char *name, u32 h, u32 inum, u32 offset)
+    {
+      u64 i = h & mask;
+      while (slots[i].used)
+        i = (i + 1) & mask;
+      strncpy(slots[i].name, name, DIRSIZ);
+      slots[i].hash = h;
+      slots[i].inum = inum;
+      slots[i].offset = offset;
+      slots[i].used = 1;
+    }
+
+    // Empty slot i, moving back the entries after it that would otherwise
+    // no longer be reachable from their home slots.
+    void erase(u64 i)
+    {
+      for (u64 j = (i + 1) & mask; slots[j].used; j = (j + 1) & mask) {
+        u64 home = slots[j].hash & mask;
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+          slots[i] = slots[j];
+          i = j;
+        }
+      }
+      slots[i].used = 0;
+    }
+
+    seqcount<u32> seq;
+    const u64 nslots;
+    const u64 mask;
+    slot *slots;
+  };
+
+  // Count t's slots in or (sign -1) out of the memory accounting. Tables
+  // that a resize replaced are left to the gc's count.
+  static void account(table *t, int sign)
+  {
+    memacct_add(MEMACCT_DIR_ENTRIES, sign * (s64)t->nslots,
+                sign * (s64)(sizeof(*t) + t->nslots * sizeof(slot)));
+  }
+
+  static u32 hash_of(const strbuf<DIRSIZ>& name)
+  {
+    return (hash(name) * 0x9e3779b97f4a7c15ull) >> 32;
+  }
+
+  // Replace the table with one of n slots.  Caller must hold lock_.
+  table* resize(u64 n)
+  {
+    table *t = table_.load();
+    table *nt = new table(n);
+    for (u64 i = 0; i < t->nslots; i++)
+      if (t->slots[i].used)
+        nt->place(t->slots[i].name, t->slots[i].hash, t->slots[i].inum,
+                  t->slots[i].offset);
+    table_.store(nt);
+    account(nt, 1);
+    account(t, -1);
+    gc_delayed(t);
+    return nt;
+  }
+
+  // Caller must hold lock_.
+  u16& block_entries(u32 offset)
+  {
+    while (block_entries_.size() <= offset / BSIZE)
+      block_entries_.push_back(0);
+    return block_entries_[offset / BSIZE];
+  }
+
+  spinlock lock_;
+  std::atomic<table*> table_;
+  u64 count_;
+  std::vector<u32> free_slots_;
+  std::vector<u16> block_entries_;
+  std::atomic<bool> referenced_;
 };
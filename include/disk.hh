@@ -1,10 +1,21 @@
 #pragma once
 
+#include "amd64.h"
 #include "spinlock.hh"
 #include "condvar.hh"
+#include "objcache.hh"
+#include "lathist.hh"
+#include "disktrace.h"
+#include <vector>
+#include <algorithm>
 
 #define IOV_MAX     65535    // Limited by MAX_PRD_ENTRIES
-#define SG_IO_SIZE  64*1024  // Size used for scatter-gather I/O
+#define SG_IO_SIZE  DISK_IO_SIZE  // Size used for scatter-gather I/O
+
+static_assert(SG_IO_SIZE % BSIZE == 0 && SG_IO_SIZE / BSIZE <= IOV_MAX,
+              "Bad scatter-gather I/O size");
+// ATA commands transfer at most 65535 sectors (for our purposes).
+static_assert(SG_IO_SIZE / 512 <= 0xffff, "Scatter-gather I/O size too large");
 
 struct kiovec
 {
@@ -12,33 +23,110 @@ struct kiovec
   u64 iov_len;
 };
 
+// A range of a disk, for discards.
+struct disk_extent
+{
+  u64 off;
+  u64 nbytes;
+};
+
+class disk;
+
+// Log a traced I/O that has just completed (see disktrace.h).
+void disktrace_log(struct disktrace_rec *rec);
+
+// Tags the disk I/O that the current thread issues while this is in scope,
+// for block I/O tracing, unless an enclosing scope has already tagged it.
+class scoped_disk_tag
+{
+public:
+  explicit scoped_disk_tag(u8 tag);
+  ~scoped_disk_tag();
+  scoped_disk_tag(const scoped_disk_tag &) = delete;
+  scoped_disk_tag &operator=(const scoped_disk_tag &) = delete;
+
+private:
+  bool set_;
+};
+
 class disk_completion : public referenced
 {
 public:
-  disk_completion() : done_(false) {}
-  NEW_DELETE_OPS(disk_completion);
+  disk_completion() : pending_(1), done_(false), disk_(nullptr), dev_(0),
+                      start_(0) {}
+  NEW_DELETE_OPS_CACHED(disk_completion);
 
+  // The I/O is done once notify() has been called as many times as expected
+  // (see expect_more()).
   void notify() {
+    if (--pending_ != 0)
+      return;
+
+    if (start_)
+      lathists::record_since(mylathists->disk[dev_], start_);
+    if (traced_) {
+      disktrace_log(&trace_);
+      traced_->notify();
+    }
     scoped_acquire a(&lock_);
-    done_ = true;
+    done_.store(true, std::memory_order_release);
     cv_.wake_all();
   }
 
+  // Checking for completion doesn't take the lock, so that polling waiters
+  // don't contend for its cache line with the core handling the interrupt.
   void wait() {
+    if (done())
+      return;
+
     scoped_acquire a(&lock_);
     while (!done_)
       cv_.sleep(&lock_);
   }
 
   bool done() {
-    scoped_acquire a(&lock_);
-    return done_;
+    return done_.load(std::memory_order_acquire);
+  }
+
+  // Like wait(), but first poll the disk that the I/O was issued to for upto
+  // poll_us microseconds, which avoids the cost of the interrupt and the
+  // wakeup if the I/O completes quickly.
+  void poll_wait(u64 poll_us);
+
+  // Note down the disk that will complete this I/O, for poll_wait().
+  // The first call also starts the round-trip timer.
+  void set_disk(disk *d, u32 dev) {
+    disk_ = d;
+    dev_ = dev;
+    if (!start_)
+      start_ = rdtsc();
+  }
+
+  // Make the I/O wait for n more notify()s, for I/Os that are issued to
+  // several disks (such as writes to mirrored blocks). Must be called before
+  // the I/O is issued.
+  void expect_more(u32 n) {
+    pending_ += n;
+  }
+
+  // Make this the completion of a single traced I/O, described by rec,
+  // which logs the I/O and then notifies parent, the I/O's real
+  // completion. Must be called before the I/O is issued.
+  void trace(const disktrace_rec &rec, sref<disk_completion> parent) {
+    trace_ = rec;
+    traced_ = std::move(parent);
   }
 
 private:
   spinlock lock_;
   condvar cv_;
-  bool done_;
+  std::atomic<u32> pending_;
+  std::atomic<bool> done_;
+  disk *disk_;
+  u32 dev_;
+  u64 start_;
+  sref<disk_completion> traced_;
+  disktrace_rec trace_;
 };
 
 class disk
@@ -73,6 +161,27 @@ public:
     dc->notify();
   }
 
+  // The most extents that one adiscard() can take, and the largest extent (in
+  // bytes). Disks that can't discard return 0.
+  virtual u32 max_discard_extents() { return 0; }
+  virtual u64 max_discard_bytes() { return 0; }
+
+  // Tell the disk that the contents of the extents are no longer needed (such
+  // as with the ATA TRIM command), so that an SSD can reclaim their flash.
+  // The extents must be sorted, and needn't remain valid after the call.
+  virtual void adiscard(const disk_extent *ext, u32 n,
+                        sref<disk_completion> dc) {
+    dc->notify();
+  }
+
+  // Print driver statistics, if the driver keeps any.
+  virtual void print_stats() {}
+
+  // Check for completed I/Os and notify their disk_completions, without
+  // waiting for the interrupt. Drivers that can't do that leave it to the
+  // interrupt.
+  virtual void poll() {}
+
   void read(char* buf, u64 nbytes, u64 off) {
     kiovec iov = { (void*) buf, nbytes };
     readv(&iov, 1, off);
@@ -98,12 +207,54 @@ public:
   }
 };
 
+inline void
+disk_completion::poll_wait(u64 poll_us)
+{
+  if (disk_ && poll_us) {
+    u64 deadline = nsectime() + poll_us * 1000;
+    while (!done() && nsectime() < deadline) {
+      disk_->poll();
+      nop_pause();
+    }
+  }
+  wait();
+}
 
-u32 blknum_to_dev(u32 blknum);
-u32 remap_blknum(u32 blknum);
+
+// A copy of a filesystem block: the disk it is on, and its block number on
+// that disk.
+struct disk_addr {
+  u32 dev;
+  u32 blknum;
+};
+
+// The most copies of a block that any disk layout keeps.
+#define DISK_MAX_COPIES 2
+
+// A disk layout maps the filesystem's block numbers onto the disks (see
+// DISK_LAYOUT in param.h). Layouts map each stripe unit (DISK_STRIPE_SIZE) of
+// contiguous blocks onto contiguous blocks of every disk that holds a copy, so
+// an I/O that doesn't cross a stripe boundary needs one I/O per copy.
+class disk_layout {
+public:
+  // Fill in the copies of blknum (upto DISK_MAX_COPIES), and return their
+  // number. The first copy is the primary one.
+  virtual u32 locate(u32 blknum, disk_addr *copies) const = 0;
+
+  // Choose the copy of blknum to read from.
+  virtual disk_addr locate_read(u32 blknum) const = 0;
+
+  virtual const char *name() const = 0;
+};
+
+const disk_layout *get_disk_layout();
 u32 num_disks();
 
+// The disk that holds the primary copy of blknum.
+u32 blknum_to_dev(u32 blknum);
+
 void disk_register(disk* d);
+void disk_print_stats();
 
 void disk_read(u32 dev, char* buf, u64 nbytes, u64 offset,
                sref<disk_completion> dc = sref<disk_completion>());
@@ -119,23 +270,54 @@ void disk_writev(u32 dev, kiovec *iov, int iov_cnt, u64 offset,
 
 void disk_flush(u32 dev, sref<disk_completion> dc = sref<disk_completion>());
 
+// Discard every copy of the given blocks, which must be sorted and distinct.
+// Contiguous blocks are coalesced into extents, and the extents are issued to
+// each disk in as few discard commands as it can take. Disks that can't
+// discard are skipped; dc is notified once all the discards have completed.
+void disk_discard(const std::vector<u32> &blocks, sref<disk_completion> dc);
+
+// Whether any disk supports discards.
+bool disk_discard_supported();
+
+// Like disk_writev(), except that dev and offset address a disk directly,
+// rather than going through the disk layout.
+void disk_dev_writev(u32 dev, kiovec *iov, int iov_cnt, u64 offset,
+                     sref<disk_completion> dc);
+
+// The system-wide I/O scheduler. Writes submitted from all the cores are queued
+// per disk, and the queue is written out in increasing block order (like an
+// elevator) as soon as the disk is free: by the disk's dispatcher thread, or by
+// a submitter that waits for its writes while no one else is doing so (such as
+// before the dispatcher threads run). Writes that arrive during a
+// dispatch are written out together in the next one, so adjacent blocks
+// written by different processes coalesce into large scatter-gather I/Os. The
+// submitter's disk_completion is notified once all of its writes have
+// completed; the buffers must remain valid until then.
+struct disk_sched_req {
+  u64 blocknum;
+  const char *buf;
+};
+
+void disk_sched_submit(const std::vector<disk_sched_req> &reqs,
+                       sref<disk_completion> dc);
+
+// Wait for the writes submitted along with dc, helping dispatch the queues.
+void disk_sched_wait(sref<disk_completion> dc);
+
 
 // A simple block layer for ScaleFS/sv6, that helps accumulate I/O to contiguous
 // blocks, and issues them to the disk driver in large chunks so as to achieve
-// high throughput disk I/O.  Contiguous writes (i.e., writes to adjacent disk
-// blocks) from the filesystem are buffered upto a specified I/O size
-// (SG_IO_SIZE, which is currently 64KB), and written out to disk using
-// scatter-gather I/O APIs exposed by the disk driver. For simplicity, the block
-// queue implementation assumes that the filesystem issues writes in increasing
-// order of disk block numbers; this allows the block queue to simply accumulate
-// writes as long as they are contiguous, and flush them out as soon as a write
-// operation is encountered that is not contiguous with the previous write, or
-// if the write-buffer fills up to SG_IO_SIZE. This is particularly effective
-// for ScaleFS, as transactions already sort their disk blocks as part of their
-// deduplication procedure, before writing them out. The block layer also
-// transparently handles I/O to multiple disks using the preconfigured striping
-// parameters, thus completely shielding the details of I/O to multiple disks
-// from the higher layers (i.e., the filesystem).
+// high throughput disk I/O.  Writes from the filesystem are buffered in a
+// window of up to WINDOW_BLOCKS pending writes per disk; when the window fills
+// up, or on flush(), the pending writes are sorted by disk offset and written
+// out in runs of contiguous blocks of upto a specified I/O size (SG_IO_SIZE,
+// which is DISK_IO_SIZE in param.h), using scatter-gather I/O APIs exposed by the disk
+// driver. So callers don't need to issue writes in increasing order of disk
+// block numbers to get large I/Os, although ScaleFS transactions do, as they
+// sort their disk blocks as part of their deduplication procedure. The block
+// layer also transparently handles I/O to multiple disks using the
+// preconfigured striping parameters, thus completely shielding the details of
+// I/O to multiple disks from the higher layers (i.e., the filesystem).
 //
 // The block-queue class can be instantiated afresh for any "write-context",
 // i.e., any code that wants to perform a set of writes to the disk. This design
@@ -145,20 +327,28 @@ void disk_flush(u32 dev, sref<disk_completion> dc = sref<disk_completion>());
 // we can also have a global, system-wide instance that accumulates writes from
 // all processes/threads so as to exploit opportunities for contiguous disk I/O
 // across process boundaries. And of course, any combination of these techniques
-// can be used as well.
+// can be used as well. A block queue created with shared set does the latter:
+// it hands its writes to the system-wide I/O scheduler (see disk_sched_submit())
+// instead of issuing them itself. A private block queue created with poll set
+// polls the disks for the completion of its writes for a while (see
+// disk_completion::poll_wait()), for latency-critical writes such as journal
+// commits.
 class block_queue {
 
 public:
   NEW_DELETE_OPS(block_queue);
 
-  block_queue()
+  explicit block_queue(bool shared = false, bool poll = false)
+    : shared_(shared)
   {
+    assert(!(shared && poll));
     for (int i = 0; i < num_disks(); i++)
-      dqueue[i] = new disk_queue(i);
+      dqueue[i] = shared ? nullptr : new disk_queue(i, poll);
   }
 
   ~block_queue()
   {
+    assert(sched_reqs.empty() && sched_dcs.empty());
     for (int i = 0; i < num_disks(); i++)
       delete dqueue[i];
   }
@@ -167,15 +357,49 @@ public:
   {
     assert(nbytes == BSIZE && offset % BSIZE == 0);
 
-    // Remap offset to the correct disknum and offset when using multiple disks.
-    dev = blknum_to_dev(offset/BSIZE);
-    offset = (u64) remap_blknum(offset/BSIZE) * BSIZE;
+    if (shared_) {
+      sched_reqs.push_back({ offset/BSIZE, buf });
+      return;
+    }
+
+    // Write every copy of the block. The copies are on different disks, so
+    // they are written in parallel.
+    disk_addr copies[DISK_MAX_COPIES];
+    u32 ncopies = get_disk_layout()->locate(offset/BSIZE, copies);
+    for (u32 i = 0; i < ncopies; i++)
+      dqueue[copies[i].dev]->add_to_queue(buf, nbytes,
+                                          (u64) copies[i].blknum * BSIZE);
+  }
+
+  // Start the writes queued so far, without waiting for them to complete.
+  // A private block queue issues the writes pending in its windows, including
+  // partly filled runs; a shared one hands them to the I/O scheduler.
+  void submit()
+  {
+    if (!shared_) {
+      for (int i = 0; i < num_disks(); i++)
+        dqueue[i]->submit();
+      return;
+    }
+    if (sched_reqs.empty())
+      return;
 
-    dqueue[dev]->add_to_queue(buf, nbytes, offset);
+    auto dc = make_sref<disk_completion>();
+    disk_sched_submit(sched_reqs, dc);
+    sched_dcs.push_back(dc);
+    sched_reqs.clear();
   }
 
   void flush()
   {
+    if (shared_) {
+      submit();
+      for (auto &dc : sched_dcs)
+        disk_sched_wait(dc);
+      sched_dcs.clear();
+      return;
+    }
+
     for (int i = 0; i < num_disks(); i++)
       dqueue[i]->flush();
   }
@@ -187,7 +411,7 @@ private:
   public:
     NEW_DELETE_OPS(disk_queue);
 
-    explicit disk_queue(u32 dev) : iovec_idx(0), dev_(dev)
+    disk_queue(u32 dev, bool poll) : iovec_idx(0), dev_(dev), poll_(poll)
     {
       for (int i = 0; i < AHCI_QUEUE_DEPTH; i++) {
         start_offset[i] = 0;
@@ -197,11 +421,33 @@ private:
 
     ~disk_queue()
     {
+      assert(window.empty());
       for (int i = 0; i < AHCI_QUEUE_DEPTH; i++)
         assert(iovec[i].empty());
     }
 
     void add_to_queue(const char *buf, u64 nbytes, u64 offset)
+    {
+      window.push_back({ offset, window.size(), buf });
+      if (window.size() == WINDOW_BLOCKS)
+        drain_window();
+    }
+
+    // Issue the pending writes in increasing order of disk offset, so that
+    // they coalesce into the longest possible contiguous runs. Of several
+    // writes to the same block, only the latest one is issued.
+    void drain_window()
+    {
+      std::sort(window.begin(), window.end());
+      for (size_t i = 0; i < window.size(); i++) {
+        if (i + 1 < window.size() && window[i + 1].offset == window[i].offset)
+          continue;
+        issue(window[i].buf, BSIZE, window[i].offset);
+      }
+      window.clear();
+    }
+
+    void issue(const char *buf, u64 nbytes, u64 offset)
     {
       // Flush the existing buffer if this write is going to make it
       // discontiguous.
@@ -234,13 +480,13 @@ private:
 	// approximation; it may or may not map exactly to the same command
 	// slots in the low-level AHCI driver.)
         if (dc[iovec_idx].get()) {
-          dc[iovec_idx]->wait();
+          wait_for(dc[iovec_idx]);
           dc[iovec_idx].reset();
         }
 
         dc[iovec_idx] = make_sref<disk_completion>();
-        disk_writev(dev_, &iovec[iovec_idx][0], iovec[iovec_idx].size(),
-                    start_offset[iovec_idx], dc[iovec_idx]);
+        disk_dev_writev(dev_, &iovec[iovec_idx][0], iovec[iovec_idx].size(),
+                        start_offset[iovec_idx], dc[iovec_idx]);
         iovec[iovec_idx].clear();
         iovec[iovec_idx].reserve(SG_IO_SIZE/BSIZE);
       }
@@ -249,14 +495,33 @@ private:
       // just issued above.
       if (sync) {
         if (dc[iovec_idx].get()) {
-          dc[iovec_idx]->wait();
+          wait_for(dc[iovec_idx]);
           dc[iovec_idx].reset();
         }
       }
     }
 
+    void wait_for(sref<disk_completion> &c)
+    {
+      if (poll_)
+        c->poll_wait(DISK_COMMIT_POLL_US);
+      else
+        c->wait();
+    }
+
+    // Issue everything pending, without waiting for it.
+    void submit()
+    {
+      drain_window();
+      if (!iovec[iovec_idx].empty()) {
+        flush_queue(iovec_idx);
+        iovec_idx = (iovec_idx + 1) % AHCI_QUEUE_DEPTH;
+      }
+    }
+
     void flush()
     {
+      drain_window();
       for (int i = 0; i < AHCI_QUEUE_DEPTH; i++)
         flush_queue(i, true);
     }
@@ -266,13 +531,115 @@ private:
     // the AHCI specification.
     enum { AHCI_QUEUE_DEPTH = 32 };
 
+    // Enough pending writes to fill every command slot with a full-sized I/O.
+    enum { WINDOW_BLOCKS = AHCI_QUEUE_DEPTH * SG_IO_SIZE/BSIZE };
+
+    struct pending_write {
+      u64 offset;
+      u64 seq; // Order of submission, for writes to the same block.
+      const char *buf;
+
+      bool operator<(const pending_write &o) const {
+        if (offset == o.offset)
+          return seq < o.seq;
+        return offset < o.offset;
+      }
+    };
+
+    std::vector<pending_write> window;
+
     std::vector<kiovec> iovec[AHCI_QUEUE_DEPTH];
     sref<disk_completion> dc[AHCI_QUEUE_DEPTH];
     u64 start_offset[AHCI_QUEUE_DEPTH];
     int iovec_idx; // Indicates which iovec to add items to next.
     u32 dev_;
+    bool poll_;
   };
 
 private:
   disk_queue* dqueue[NDISK];
+
+  // For shared block queues: the writes not yet handed to the I/O scheduler,
+  // and the completions of the ones that were.
+  bool shared_;
+  std::vector<disk_sched_req> sched_reqs;
+  std::vector<sref<disk_completion> > sched_dcs;
+};
+
+// The read side of the block layer: reads of disk blocks are queued with
+// read(), and submit() issues them asynchronously, sorted by block number and
+// merged into scatter-gather I/Os of contiguous blocks (of upto SG_IO_SIZE, and
+// never crossing a stripe boundary, so that each I/O goes to a single disk).
+// wait() waits for all the submitted reads to complete. The buffers must remain
+// valid until then, and the next batch of reads can't be submitted before.
+class read_queue {
+
+public:
+  NEW_DELETE_OPS(read_queue);
+
+  read_queue() {}
+
+  ~read_queue()
+  {
+    assert(pending.empty() && dcs.empty());
+  }
+
+  void read(char *buf, u64 blocknum)
+  {
+    pending.push_back({ blocknum, buf });
+  }
+
+  void submit()
+  {
+    if (pending.empty())
+      return;
+    assert(dcs.empty());
+
+    std::sort(pending.begin(), pending.end());
+
+    // The I/O vectors must stay put until the reads complete.
+    iovs.clear();
+    iovs.reserve(pending.size());
+    for (auto &r : pending)
+      iovs.push_back({ (void *)r.buf, BSIZE });
+
+    size_t start = 0;
+    for (size_t i = 1; i <= pending.size(); i++) {
+      if (i < pending.size() &&
+          pending[i].blocknum == pending[i - 1].blocknum + 1 &&
+          pending[i].blocknum % STRIPE_BLOCKS != 0 &&
+          i - start < SG_IO_SIZE/BSIZE)
+        continue;
+
+      auto dc = make_sref<disk_completion>();
+      disk_readv(1, &iovs[start], i - start, pending[start].blocknum * BSIZE,
+                 dc);
+      dcs.push_back(dc);
+      start = i;
+    }
+    pending.clear();
+  }
+
+  void wait()
+  {
+    for (auto &dc : dcs)
+      dc->wait();
+    dcs.clear();
+  }
+
+private:
+  enum { STRIPE_BLOCKS = DISK_STRIPE_SIZE/BSIZE };
+
+  struct pending_read {
+    u64 blocknum;
+    char *buf;
+
+    bool operator<(const pending_read &o) const {
+      return blocknum < o.blocknum;
+    }
+  };
+
+  std::vector<pending_read> pending;
+  std::vector<kiovec> iovs;
+  std::vector<sref<disk_completion> > dcs;
 };
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+
+// Block I/O trace.  While tracing is on (write "1" to /dev/disktrace, and
+// "0" to stop), disk_readv(), disk_dev_writev() and disk_flush() log one
+// record per I/O they issue to a disk, once it completes, into per-core
+// rings of DISKTRACE_RECS records.  Reading /dev/disktrace drains them as
+// an array of struct disktrace_rec; bin/disktrace analyzes them.
+
+enum disktrace_op {
+  DISKTRACE_READ = 1,
+  DISKTRACE_WRITE,
+  DISKTRACE_FLUSH,
+  // off records were overwritten before they could be read
+  DISKTRACE_LOST,
+};
+
+// Who issued the I/O (see scoped_disk_tag).  An I/O issued on behalf of
+// several of these counts for the outermost one, so that buffer-cache
+// reads that fill file pages are DISKTRACE_PAGEFILL.
+enum disktrace_tag {
+  DISKTRACE_OTHER = 0,
+  DISKTRACE_JOURNAL,
+  DISKTRACE_APPLY,
+  DISKTRACE_BUFCACHE,
+  DISKTRACE_PAGEFILL,
+  DISKTRACE_NTAGS,
+};
+
+struct disktrace_rec
+{
+  uint64_t submit_tsc;
+  uint64_t complete_tsc;
+  // Byte offset on the disk, after the disk layout's remapping
+  uint64_t off;
+  uint32_t len;
+  uint16_t iovcnt;
+  uint8_t dev;
+  uint8_t op;
+  uint8_t tag;
+  // The core that issued the I/O
+  uint8_t cpu;
+  uint8_t pad[6];
+};
@@ -0,0 +1,153 @@
+#pragma once
+
+// Readiness notification for epoll.
+//
+// A pollable object (a pipe end, a socket) keeps a poll_slot, which
+// makes a poll_queue the first time an epoll instance watches the
+// object.  The poll_queue holds the object's current readiness -- a
+// mask of EPOLLIN, EPOLLOUT, EPOLLERR and EPOLLHUP -- and the epitems
+// watching it.  Whenever the object's readiness may have changed, it
+// calls update(), which recomputes the mask and queues the interested
+// epitems onto their epoll instance's ready lists.  update() costs one
+// load when nobody watches the object.
+//
+// The poll_queue is reference counted separately from the object, so
+// epitems never hold up the object (or a pipe's close).  When the
+// object's file is closed, shutdown() clears the mask for good and
+// nothing fires again.
+//
+// Lock order: the object's locks, then the poll_queue's lock, then the
+// epoll instance's ready list locks.
+
+#include "spinlock.hh"
+#include "ilist.hh"
+#include "ref.hh"
+#include "atomic_util.hh"
+#include <atomic>
+
+struct file_epoll;
+class poll_queue;
+
+struct epitem {
+  ilink<epitem> elink;          // On ep's items, under ep's lock
+  ilink<epitem> qlink;          // On pq's items, under pq's lock
+  ilink<epitem> rlink;          // On a ready list, under its lock
+  file_epoll *const ep;
+  const int fd;
+  sref<poll_queue> pq;
+  // Watched events and EPOLL flags.  Set under ep's and pq's locks.
+  u32 events;
+  bool armed;                   // False once an EPOLLONESHOT event fires
+  u64 data;
+  // The ready list this is on, or -1.  Changed under that list's lock.
+  std::atomic<int> ready;
+
+  epitem(file_epoll *ep, int fd, sref<poll_queue> &&pq)
+    : ep(ep), fd(fd), pq(std::move(pq)), events(0), armed(false), data(0),
+      ready(-1) { }
+  NEW_DELETE_OPS(epitem);
+};
+
+class poll_queue : public referenced {
+public:
+  explicit poll_queue(u32 revents = 0)
+    : lock_("poll_queue"), revents_(revents), dead_(false) { }
+  NEW_DELETE_OPS(poll_queue);
+
+  // The current readiness mask
+  u32 revents() const { return revents_; }
+
+  // Set the mask to readiness(), which is called with the queue
+  // locked, so the last of several racing updates wins.  Watchers are
+  // notified of bits that were just set and, for edge-triggered
+  // watchers that see every event, of bits in happened.
+  template<class F>
+  void update(u32 happened, F readiness)
+  {
+    scoped_acquire l(&lock_);
+    if (dead_)
+      return;
+    u32 mask = readiness();
+    u32 old = revents_.exchange(mask);
+    u32 fire = mask & (~old | happened);
+    if (fire && !items_.empty())
+      notify(fire);
+  }
+
+  void shutdown()
+  {
+    scoped_acquire l(&lock_);
+    dead_ = true;
+    revents_ = 0;
+  }
+
+  // Start and stop watching this queue with it.  it->events must be
+  // set before add() and may only be changed through modify().
+  void add(epitem *it);
+  void remove(epitem *it);
+  void modify(epitem *it, u32 events, u64 data);
+
+private:
+  void notify(u32 events);
+
+  spinlock lock_;
+  std::atomic<u32> revents_;
+  bool dead_;
+  ilist<epitem, &epitem::qlink> items_;
+};
+
+// A pollable object's poll_queue, made on demand.
+class poll_slot {
+public:
+  poll_slot() : pq_(nullptr) { }
+  ~poll_slot()
+  {
+    if (poll_queue *q = pq_.load()) {
+      q->shutdown();
+      q->dec();
+    }
+  }
+  poll_slot(const poll_slot&) = delete;
+  poll_slot& operator=(const poll_slot&) = delete;
+
+  // Update the queue, if anybody has asked for it.  The object's
+  // state change must be sequentially consistent with the load of
+  // pq_ (or ordered with get() by a lock) so that a concurrent get()
+  // can't miss it.
+  template<class F>
+  void update(u32 happened, F readiness)
+  {
+    poll_queue *q = pq_;
+    if (q)
+      q->update(happened, readiness);
+  }
+
+  // Return the queue, making it if necessary.
+  template<class F>
+  sref<poll_queue> get(F readiness)
+  {
+    poll_queue *q = pq_;
+    if (!q) {
+      poll_queue *nq = new poll_queue();
+      if (cmpxch(&pq_, (poll_queue*) nullptr, nq)) {
+        q = nq;
+        q->update(0, readiness);
+      } else {
+        nq->dec();
+        q = pq_;
+      }
+    }
+    return sref<poll_queue>::newref(q);
+  }
+
+  // The object's file is closed, though operations on the object
+  // may still be in flight.
+  void shutdown()
+  {
+    if (poll_queue *q = pq_.load())
+      q->shutdown();
+  }
+
+private:
+  std::atomic<poll_queue*> pq_;
+};
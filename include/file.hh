@@ -10,12 +10,26 @@
 #include "semaphore.hh"
 #include "mfs.hh"
 #include "sleeplock.hh"
+#include "seqlock.hh"
+#include "epoll.hh"
 #include <uk/unistd.h>
+#include <uk/epoll.h>
 
 class dir_entries;
+struct iovec;
 
 struct file {
   virtual int fsync() { return -1; }
+  // Start an fsync() without waiting for it to complete. *ticket is set to a
+  // commit ticket to be passed to fsync_wait().
+  virtual int fsync_async(u64 *ticket) { return -1; }
+  // Like fsync(), but only for the file's data, and what it takes to read it
+  // back: the bytes [offset, offset + len), or to the end if len is 0.
+  virtual int fdatasync(off_t offset, off_t len) { return -1; }
+  // Reserve space for the bytes [offset, offset + len) (see fallocate()).
+  virtual int fallocate(int mode, off_t offset, off_t len) { return -1; }
+  // Turn compression on or off (see setcompress()).
+  virtual int setcompress(bool on) { return -1; }
   // Duplicate this file so it can be bound to a FD.
   virtual file* dup() { inc(); return this; }
 
@@ -29,10 +43,39 @@ struct file {
   virtual ssize_t write(const char *addr, size_t n) { return -1; }
   virtual ssize_t pread(char *addr, size_t n, off_t offset) { return -1; }
   virtual ssize_t pwrite(const char *addr, size_t n, off_t offset) { return -1; }
+  // read() and write() straight to and from the user's buffer, with no cap
+  // on n. Returns false, for the caller to go through a kernel buffer
+  // instead, if the file has no such path; otherwise *r is the result.
+  virtual bool read_user(userptr<void> buf, size_t n, ssize_t *r)
+  { return false; }
+  virtual bool write_user(userptr<void> buf, size_t n, ssize_t *r)
+  { return false; }
+  // Likewise for pread() and pwrite().
+  virtual bool pread_user(userptr<void> buf, size_t n, off_t offset,
+                          ssize_t *r)
+  { return false; }
+  virtual bool pwrite_user(userptr<void> buf, size_t n, off_t offset,
+                           ssize_t *r)
+  { return false; }
+  // Vectored I/O on the user buffers in iov: at offset, or at the file
+  // offset, advancing it, if offset is -1. Returns false as above.
+  virtual bool readv_user(const struct iovec *iov, int iovcnt, off_t offset,
+                          ssize_t *r)
+  { return false; }
+  virtual bool writev_user(const struct iovec *iov, int iovcnt, off_t offset,
+                           ssize_t *r)
+  { return false; }
+  // write() up to n bytes of this file to out, from *offset, advancing it,
+  // or from the file offset if offset is null.
+  virtual ssize_t sendfile(file *out, off_t *offset, size_t n) { return -1; }
 
   // Socket operations
   virtual int bind(const struct sockaddr *addr, size_t addrlen) { return -1; }
   virtual int listen(int backlog) { return -1; }
+  virtual int connect(const struct sockaddr *addr, size_t addrlen) { return -1; }
+  virtual int setsockopt(int level, int optname, const void *optval,
+                         size_t optlen)
+  { return -1; }
   // Unlike the syscall, the return is only an error status.  The
   // caller will allocate an FD for *out on success.  addrlen is only
   // an out-argument.
@@ -52,6 +95,12 @@ struct file {
                            size_t *addrlen)
   { return -1; }
 
+  // The poll_queue that epoll watches this file's readiness through,
+  // or null if it can't be watched.  Files that never block are
+  // always ready.
+  virtual sref<poll_queue> pollq()
+  { return make_sref<poll_queue>(EPOLLIN | EPOLLOUT); }
+
   virtual sref<mnode> get_mnode() { return sref<mnode>(); }
 
   virtual void inc() = 0;
@@ -63,8 +112,9 @@ protected:
 
 struct file_mnode : public refcache::referenced, public file {
 public:
-  file_mnode(sref<mnode> m, bool r, bool w, bool a)
-    : m(m), readable(r), writable(w), append(a), off(0) {}
+  file_mnode(sref<mnode> m, bool r, bool w, bool a, bool d = false)
+    : m(m), readable(r), writable(w), append(a), direct(d), off(0),
+      ra_next(0), ra_end(0), ra_pages(0) {}
   NEW_DELETE_OPS(file_mnode);
 
   void inc() override { refcache::referenced::inc(); }
@@ -74,21 +124,57 @@ public:
   const bool readable;
   const bool writable;
   const bool append;
+  const bool direct;
   u32 off;
   sleeplock off_lock;
+  // For directories, the last name that getdents() returned (protected by
+  // off_lock); getdents() starts over from the first entry if it is unset.
+  strbuf<DIRSIZ> dir_cursor;
+  bool dir_cursor_set = false;
 
   int fsync() override;
+  int fsync_async(u64 *ticket) override;
+  int fdatasync(off_t offset, off_t len) override;
+  int fallocate(int mode, off_t offset, off_t len) override;
+  int setcompress(bool on) override;
   int stat(struct stat*, enum stat_flags) override;
+  // Fill in st for m, as stat() does, without needing an open file.
+  static void stat_mnode(mnode *m, struct stat *st, enum stat_flags flags);
   ssize_t read(char *addr, size_t n) override;
   ssize_t write(const char *addr, size_t n) override;
   ssize_t pread(char* addr, size_t n, off_t off) override;
   ssize_t pwrite(const char *addr, size_t n, off_t offset) override;
+  bool read_user(userptr<void> buf, size_t n, ssize_t *r) override;
+  bool write_user(userptr<void> buf, size_t n, ssize_t *r) override;
+  bool pread_user(userptr<void> buf, size_t n, off_t off, ssize_t *r) override;
+  bool pwrite_user(userptr<void> buf, size_t n, off_t off,
+                   ssize_t *r) override;
+  bool readv_user(const struct iovec *iov, int iovcnt, off_t offset,
+                  ssize_t *r) override;
+  bool writev_user(const struct iovec *iov, int iovcnt, off_t offset,
+                   ssize_t *r) override;
+  ssize_t sendfile(file *out, off_t *offset, size_t n) override;
   void onzero() override
   {
     delete this;
   }
 
   sref<mnode> get_mnode() override { return m; }
+
+private:
+  int sync_to_journal(int cpu, bool datasync = false, u64 start = 0,
+                      u64 end = ~0ull);
+  u32 readahead_window(u64 pageidx, u64 last);
+  ssize_t read_file(char *addr, size_t n, bool user);
+  ssize_t write_file(const char *addr, size_t n, bool user);
+  bool direct_io(char *addr, size_t n, off_t off, bool write, ssize_t *r);
+
+  // Sequential readahead state: the page that a sequential read() would read
+  // next, the first page that hasn't been read ahead yet, and the number of
+  // pages to read ahead. Only a hint, so it isn't protected by any lock.
+  u64 ra_next;
+  u64 ra_end;
+  u32 ra_pages;
 };
 
 struct file_pipe_reader : public refcache::referenced, public file {
@@ -101,6 +187,7 @@ public:
 
   int stat(struct stat*, enum stat_flags) override;
   ssize_t read(char *addr, size_t n) override;
+  sref<poll_queue> pollq() override;
   void onzero() override;
 
 private:
@@ -136,9 +223,12 @@ private:
 // and release its reference to the file_pipe_writer (potentially
 // closing the pipe).
 
-struct file_pipe_writer_wrapper : public eager_refcache::referenced, public file {
+struct file_pipe_writer_wrapper : public eager_refcache::referenced, public file,
+                                  public rcu_freed {
 public:
-  file_pipe_writer_wrapper(file* f) : inner(f) {}
+  file_pipe_writer_wrapper(file* f)
+    : rcu_freed("file_pipe_writer_wrapper", this, sizeof(*this)), inner(f),
+      dead(false) {}
   NEW_DELETE_OPS(file_pipe_writer_wrapper);
 
   void inc() override { referenced::inc(); }
@@ -156,6 +246,10 @@ public:
     return inner->write(addr, n);
   }
 
+  sref<poll_queue> pollq() override {
+    return inner->pollq();
+  }
+
   void pre_close() override {
     // This FD is being closed.  Now we need to know the moment its
     // reference count actually drops to zero so we can immediately
@@ -177,12 +271,20 @@ public:
   }
 
   void onzero() override {
+    // filetable::getref() may take and drop a reference on a closed
+    // wrapper, bringing it to zero again; only the first time counts.
+    // The memory stays until getref()'s GC epoch is over.
+    if (dead.exchange(true))
+      return;
     inner->dec();
-    delete this;
+    gc_delayed(this);
   }
 
+  void do_gc() override { delete this; }
+
 private:
   file* inner;
+  std::atomic<bool> dead;
 };
 
 struct file_pipe_writer : public referenced, public file {
@@ -201,6 +303,7 @@ public:
 
   int stat(struct stat*, enum stat_flags) override;
   ssize_t write(const char *addr, size_t n) override;
+  sref<poll_queue> pollq() override;
   void onzero() override;
 
 private:
@@ -208,6 +311,20 @@ private:
 };
 
 // in-core file system types
+// A consistent copy of an inode's metadata (see inode::snapshot()).
+struct inode_meta
+{
+  short type;
+  short major;
+  short nlink;
+  u64 size;
+  u32 addrs[NDIRECT+2];
+
+  const dextent_map *extent_map() const { return (const dextent_map *) addrs; }
+  bool inline_data() const { return type == T_FILE && (major & DI_INLINE); }
+  bool compressed() const { return type == T_FILE && (major & DI_COMPRESS); }
+};
+
 struct inode : public referenced, public rcu_freed
 {
   void  init();
@@ -215,6 +332,15 @@ struct inode : public referenced, public rcu_freed
   void  unlink();
   short nlink();
 
+  // Read the metadata that meta_seq covers without the inode lock.  The
+  // caller must be in a gc epoch if it follows addrs[] to indirect or
+  // overflow blocks, which itrunc() frees only after it commits.
+  void  snapshot(inode_meta *m) const;
+  // Change the size or one of addrs[] in a write section of meta_seq.
+  // Caller must hold ilock() for write.
+  void  set_size(u64 s);
+  void  set_addr(u32 i, u32 addr);
+
   inode& operator=(const inode&) = delete;
   inode(const inode& x) = delete;
 
@@ -241,11 +367,29 @@ struct inode : public referenced, public rcu_freed
   bool busy;
   int readbusy;
 
-  u32 size;
+  u64 size;
   u32 addrs[NDIRECT+2];
   short nlink_;
-
-  dir_entries* dir;
+  // Every change to size, addrs[] (and the extent map in it) and nlink_
+  // is a write section of meta_seq, under the lock, so readers that only
+  // need a consistent view of them needn't take the lock.
+  seqcount<u32> meta_seq;
+
+  // The view of addrs[] on a file system with extent-mapped inodes.
+  dextent_map *extent_map() { return (dextent_map *) addrs; }
+  // Whether addrs[] holds the file's data instead (see SB_INLINE). That,
+  // like the major field that says so, changes in write sections of
+  // meta_seq.
+  bool inline_data() const { return type == T_FILE && (major & DI_INLINE); }
+  // Whether the file is written back compressed (see SB_COMPRESS).
+  bool compressed() const { return type == T_FILE && (major & DI_COMPRESS); }
+
+  // Blocks set aside for the file's data by reserve_extent(), which bmap()
+  // allocates from first: [extent_next, extent_end).
+  u32 extent_next;
+  u32 extent_end;
+
+  std::atomic<dir_entries*> dir;
   u32 dir_offset; // The next dir-entry gets added at this offset.
 
   // ??? what's the concurrency control plan?
@@ -286,25 +430,42 @@ typedef struct free_inum {
 // for on-disk inodes.
 struct freeinum_bitmap {
   // We maintain the bitmap as both a vector and a linked-list so that we
-  // can perform both allocations and frees in O(1) time. The inum_vector
-  // contains entries for all inums, whereas the inum_freelist contains
-  // entries only for inums that are actually free. The allocator consumes
-  // items from the inum_freelist in O(1) time; the free code locates the
-  // free_inum data-structure corresponding to the inum being freed in O(1)
-  // time using the inum_vector and inserts it into the inum_freelist (also
-  // in O(1) time). Items are never removed from the inum_vector so as to
-  // enable the O(1) lookups.
-  std::vector<free_inum*> inum_vector;
+  // can perform both allocations and frees in O(1) time. Each group's inums
+  // vector contains entries for all of its inums, whereas the inum_freelist
+  // contains entries only for inums that are actually free. The allocator
+  // consumes items from the inum_freelist in O(1) time; the free code
+  // locates the free_inum data-structure corresponding to the inum being
+  // freed in O(1) time using the group's inums vector and inserts it into
+  // the inum_freelist (also in O(1) time). Items are never removed from the
+  // inums vectors so as to enable the O(1) lookups.
+  //
+  // The inode table is split into groups of INODE_GROUP_BLOCKS inode blocks,
+  // and a group's inums vector is only filled in (from its inode blocks) the
+  // first time the group is needed, so mounting a file system does not have
+  // to read the whole inode table.
+  struct inum_group {
+    sleeplock load_lock; // Serializes loading the group.
+    std::atomic<bool> loaded;
+    std::vector<free_inum> inums;
+
+    inum_group() : loaded(false) {}
+  };
+
+  inum_group *groups;
+  u32 ngroups;
+  u32 ninodes;
 
   struct freelist {
     ilist<free_inum, &free_inum::link> inum_freelist;
     spinlock list_lock; // Guards modifications to the inum_freelist.
   };
 
-  // We maintain per-CPU freelists for scalability. The inum_vector is
-  // read-only after initialization, so a single one will suffice.
+  // We maintain per-CPU freelists for scalability. Each free_inum's cpu
+  // field names the freelist it belongs to, and inums change hands a whole
+  // inode block at a time, under the old owner's list_lock. Each CPU starts
+  // out owning a contiguous range of groups, and loads them in order as its
+  // freelist runs dry.
   percpu<struct freelist> freelists;
-  struct freelist reserve_freelist; // Global reserve pool of free inums.
 };
 
 // device implementations
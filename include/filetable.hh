@@ -10,39 +10,31 @@ private:
   static const int cpushift = 16;
   static const int fdmask = (1 << cpushift) - 1;
 
+  class fdarray;
+
 public:
   static sref<filetable> alloc() {
     return sref<filetable>::transfer(new filetable());
   }
 
+  // Copy this table, for a fork, exec or spawn.  The copy shares each of
+  // this table's per-CPU FD arrays until one of the tables modifies it (see
+  // begin_write()), so this doesn't touch the FDs themselves.  With
+  // close_cloexec, arrays with open O_CLOEXEC FDs are copied right away
+  // without them: were they closed lazily instead, the shared array would
+  // keep their files open for as long as the copy lived.
   sref<filetable> copy(bool close_cloexec = false) {
     filetable* t = new filetable(false);
 
-    fdinfo init(nullptr, false);
+    auto l = own_lock_.guard();
     for(int cpu = 0; cpu < NCPU; cpu++) {
-      for(int fd = 0; fd < NOFILE; fd++) {
-        // XXX Relaxed load?
-        fdinfo info;
-        // Avoid reading info_ altogether if we're closing cloexec FDs
-        // and this is a cloexec FD.
-        if (close_cloexec && cloexec_[cpu][fd])
-          info = init;
-        else
-          info = info_[cpu][fd].load();
-        file *f = info.get_file();
-        if (f && (!close_cloexec || !info.get_cloexec())) {
-          // XXX f's refcount could have dropped to zero between the
-          // load and here
-          file* newf = f->dup();
-          fdinfo newinfo(newf, info.get_cloexec());
-
-          t->info_[cpu][fd].store(newinfo, std::memory_order_relaxed);
-          t->cloexec_[cpu][fd].store(
-            info.get_cloexec(), std::memory_order_relaxed);
-        } else {
-          t->info_[cpu][fd].store(init, std::memory_order_relaxed);
-          t->cloexec_[cpu][fd].store(true, std::memory_order_relaxed);
-        }
+      fdarray *a = arrays_[cpu].load(std::memory_order_relaxed);
+      share(a);
+      if (close_cloexec && a->ncloexec.load(std::memory_order_relaxed)) {
+        t->arrays_[cpu].store(copy_array(a, true), std::memory_order_relaxed);
+        unshare(a);
+      } else {
+        t->arrays_[cpu].store(a, std::memory_order_relaxed);
       }
     }
     std::atomic_thread_fence(std::memory_order_release);
@@ -61,10 +53,7 @@ public:
     if (fd < 0 || fd >= NOFILE)
       return sref<file>();
 
-    // XXX This isn't safe: there could be a concurrent close that
-    // drops the reference count to zero.
-    file* f = info_[cpu][fd].load().get_file();
-    return sref<file>::newref(f);
+    return getref(cpu, fd);
   }
 
   // Allocate a FD and point it to f.  This takes over the reference
@@ -76,20 +65,32 @@ public:
     // sref's in the info table.
     file *fptr = f->dup();
     fdinfo newinfo(fptr, cloexec, true);
-    for (int fd = 0; fd < NOFILE; fd++) {
-      // Note that we skip over locked FDs because that means they're
-      // either non-null or about to be.
-      if (info_[cpu][fd].load(std::memory_order_relaxed) == none &&
-          cmpxch(&info_[cpu][fd], none, newinfo)) {
-        // The default state of cloexec_ is 'true', so we only need to
-        // write to it if this is a keep-exec FD.
-        if (!cloexec)
-          cloexec_[cpu][fd] = cloexec;
-        // Unlock FD
-        info_[cpu][fd].store(newinfo.with_locked(false),
-                             std::memory_order_release);
-        return (cpu << cpushift) | fd;
+    {
+      scoped_gc_epoch gc;
+      fdarray *a = begin_write(cpu);
+      int fd;
+      while ((fd = a->claim_free()) >= 0) {
+        // The slot can only be locked by a close() about to clear it, or
+        // by a replace(), which fills it, in which case we move on.
+        fdinfo cur;
+        while ((cur = a->info[fd].load(std::memory_order_relaxed)) != none &&
+               cur.get_locked())
+          nop_pause();
+        if (cur == none && cmpxch(&a->info[fd], none, newinfo)) {
+          // The default state of cloexec is 'true', so we only need to
+          // write to it if this is a keep-exec FD.
+          if (!cloexec)
+            a->cloexec[fd] = cloexec;
+          else
+            a->ncloexec++;
+          // Unlock FD
+          a->info[fd].store(newinfo.with_locked(false),
+                            std::memory_order_release);
+          end_write(a);
+          return (cpu << cpushift) | fd;
+        }
       }
+      end_write(a);
     }
     cprintf("filetable::allocfd: failed\n");
     // The "dup" call told f that we're binding it to a FD.  That
@@ -117,17 +118,27 @@ public:
       return;
     }
 
-    // Lock the FD to prevent concurrent modifications
-    std::atomic<fdinfo> *infop = &info_[cpu][fd];
-    fdinfo info = lock_fdinfo(infop);
-
-    // Clear cloexec_ back to default state of 'true'
-    if (!cloexec_[cpu][fd])
-      cloexec_[cpu][fd] = true;
-
-    // Update and unlock the FD
-    fdinfo newinfo(nullptr, false);
-    infop->store(newinfo, std::memory_order_release);
+    fdinfo info;
+    {
+      scoped_gc_epoch gc;
+      fdarray *a = begin_write(cpu);
+
+      // Lock the FD to prevent concurrent modifications
+      std::atomic<fdinfo> *infop = &a->info[fd];
+      info = lock_fdinfo(infop);
+
+      // Clear cloexec back to default state of 'true'
+      if (!a->cloexec[fd])
+        a->cloexec[fd] = true;
+      if (info.get_file() && info.get_cloexec())
+        a->ncloexec--;
+      a->mark_free(fd);
+
+      // Update and unlock the FD
+      fdinfo newinfo(nullptr, false);
+      infop->store(newinfo, std::memory_order_release);
+      end_write(a);
+    }
 
     // Close old file
     if (info.get_file()) {
@@ -154,18 +165,30 @@ public:
       return false;
     }
 
-    // Lock the FD to prevent concurrent modifications
-    std::atomic<fdinfo> *infop = &info_[cpu][fd];
-    fdinfo oldinfo = lock_fdinfo(infop);
-
-    // Update to new info and unlock.  It's safe to update cloexec_
-    // non-atomically with info even with concurrent lock-free readers
-    // because any that care will double-check the fdinfo bit.
     file *newfptr = newf->dup();
-    fdinfo newinfo(newfptr, cloexec);
-    if (cloexec != cloexec_[cpu][fd])
-      cloexec_[cpu][fd] = cloexec;
-    infop->store(newinfo, std::memory_order_release);
+    fdinfo oldinfo;
+    {
+      scoped_gc_epoch gc;
+      fdarray *a = begin_write(cpu);
+
+      // Lock the FD to prevent concurrent modifications
+      std::atomic<fdinfo> *infop = &a->info[fd];
+      oldinfo = lock_fdinfo(infop);
+
+      // Update to new info and unlock.  It's safe to update cloexec
+      // non-atomically with info even with concurrent lock-free readers
+      // because any that care will double-check the fdinfo bit.
+      fdinfo newinfo(newfptr, cloexec);
+      if (cloexec != a->cloexec[fd])
+        a->cloexec[fd] = cloexec;
+      if (oldinfo.get_file() && oldinfo.get_cloexec())
+        a->ncloexec--;
+      if (cloexec)
+        a->ncloexec++;
+      a->mark_used(fd);
+      infop->store(newinfo, std::memory_order_release);
+      end_write(a);
+    }
 
     // Close the old FD
     if (oldinfo.get_file() && oldinfo.get_file() != newfptr) {
@@ -179,27 +202,14 @@ private:
   filetable(bool clear = true) {
     if (!clear)
       return;
-    fdinfo none(nullptr, false);
-    for(int cpu = 0; cpu < NCPU; cpu++) {
-      for(int fd = 0; fd < NOFILE; fd++) {
-        info_[cpu][fd].store(none, std::memory_order_relaxed);
-        cloexec_[cpu][fd].store(true, std::memory_order_relaxed);
-      }
-    }
+    for(int cpu = 0; cpu < NCPU; cpu++)
+      arrays_[cpu].store(new fdarray(), std::memory_order_relaxed);
     std::atomic_thread_fence(std::memory_order_release);
   }
 
   ~filetable() {
-    // Close all FDs
-    for(int cpu = 0; cpu < NCPU; cpu++){
-      for(int fd = 0; fd < NOFILE; fd++){
-        fdinfo info = info_[cpu][fd].load();
-        if (info.get_file()) {
-          info.get_file()->pre_close();
-          info.get_file()->dec();
-        }
-      }
-    }
+    for(int cpu = 0; cpu < NCPU; cpu++)
+      unshare(arrays_[cpu].load());
   }
 
   filetable& operator=(const filetable&) = delete;
@@ -251,6 +261,209 @@ private:
     }
   };
 
+  // One CPU's FDs, shared by every table copied from the one that
+  // created it until one of them writes to it.  Each open FD holds a
+  // reference to its file (taken with dup()) on behalf of all of the
+  // tables sharing the array.  The array is only modified in place while
+  // refs is 1; a table that wants to modify a shared array makes a copy
+  // of its own first (see begin_write()).
+  class fdarray : public rcu_freed
+  {
+  public:
+    fdarray() : rcu_freed("filetable::fdarray", this, sizeof(*this)),
+                refs(1), writers(0), ncloexec(0) {
+      fdinfo none(nullptr, false);
+      for (int fd = 0; fd < NOFILE; fd++) {
+        info[fd].store(none, std::memory_order_relaxed);
+        cloexec[fd].store(true, std::memory_order_relaxed);
+      }
+      for (int w = 0; w < nwords; w++)
+        used[w].store(0, std::memory_order_relaxed);
+    }
+    NEW_DELETE_OPS(fdarray);
+
+    void do_gc() override { delete this; }
+
+    // Claim the lowest FD whose used bit is clear, returning it, or -1 if
+    // there are none.
+    int claim_free() {
+      for (int w = 0; w < nwords; w++) {
+        u64 bits = used[w].load(std::memory_order_relaxed);
+        while (~bits) {
+          int bit = __builtin_ctzll(~bits);
+          int fd = w * 64 + bit;
+          if (fd >= NOFILE)
+            break;
+          bits = used[w].fetch_or(1ull << bit);
+          if (!(bits & (1ull << bit)))
+            return fd;
+        }
+      }
+      return -1;
+    }
+
+    // Called with fd's fdinfo locked.
+    void mark_used(int fd) {
+      used[fd / 64].fetch_or(1ull << (fd % 64));
+    }
+
+    void mark_free(int fd) {
+      used[fd / 64].fetch_and(~(1ull << (fd % 64)));
+    }
+
+    // The number of tables using this array.
+    std::atomic<int> refs;
+    // The number of in-place modifications in progress.
+    std::atomic<int> writers;
+    // The number of open O_CLOEXEC FDs.
+    std::atomic<int> ncloexec;
+    __padout__;
+
+    std::atomic<fdinfo> info[NOFILE];
+    // In addition to storing O_CLOEXEC with each fdinfo so it can be
+    // read atomically with the FD, we store it separately so we can
+    // scan for keep-exec FDs without reading from info, which would
+    // cause unnecessary sharing between the scan and creating O_CLOEXEC
+    // FDs.  To avoid unnecessary sharing on this array itself, the
+    // *default* state of this array for closed FDs must be 'true', so
+    // we only have to write to it when opening a keep-exec FD.
+    // Modifications to this array are protected by the fdinfo lock.
+    // Lock-free readers should double-check the O_CLOEXEC bit in
+    // fdinfo.
+    std::atomic<bool> cloexec[NOFILE];
+
+    // A bit for each FD that is open or being opened, so allocfd() can
+    // find the lowest free FD with a bit scan.  These change under the
+    // FD's fdinfo lock, except that allocfd() sets a bit before it takes
+    // the FD.
+    static const int nwords = (NOFILE + 63) / 64;
+    std::atomic<u64> used[nwords];
+  };
+
+  // Take a reference to a, for a table to share.  Waits for in-place
+  // modifications that started before a was shared; any that start
+  // afterwards will see a is shared and copy it instead.
+  static void share(fdarray *a)
+  {
+    a->refs++;
+    while (a->writers.load())
+      nop_pause();
+  }
+
+  // Drop a table's reference to a, closing its FDs if it was the last.
+  // The memory stays around for lock-free readers until the GC epoch ends.
+  static void unshare(fdarray *a)
+  {
+    if (--a->refs)
+      return;
+    fdinfo none(nullptr, false);
+    for (int fd = 0; fd < NOFILE; fd++) {
+      fdinfo info = a->info[fd].load();
+      if (info.get_file()) {
+        a->info[fd].store(none, std::memory_order_release);
+        info.get_file()->pre_close();
+        info.get_file()->dec();
+      }
+    }
+    gc_delayed(a);
+  }
+
+  // Return this table's array for cpu, ready to be modified in place, and
+  // end_write() it when done.  If the array is shared, this first replaces
+  // it with a private copy.  Must be called in a GC epoch.
+  fdarray *begin_write(int cpu)
+  {
+    for (;;) {
+      fdarray *a = arrays_[cpu].load(std::memory_order_acquire);
+      a->writers++;
+      if (a->refs.load() == 1 && arrays_[cpu].load() == a)
+        return a;
+      a->writers--;
+      make_private(cpu);
+    }
+  }
+
+  void end_write(fdarray *a)
+  {
+    a->writers--;
+  }
+
+  // Give this table a private copy of its array for cpu, if it isn't
+  // private already.
+  void make_private(int cpu)
+  {
+    auto l = own_lock_.guard();
+    fdarray *a = arrays_[cpu].load(std::memory_order_relaxed);
+    if (a->refs.load() == 1)
+      return;
+
+    // Holding a reference of our own keeps a shared, so it can't change
+    // under the copy.
+    share(a);
+    arrays_[cpu].store(copy_array(a, false), std::memory_order_release);
+    unshare(a);
+    unshare(a);
+  }
+
+  // Return a new array with the FDs of a, which must be shared (and so
+  // can't change), less its O_CLOEXEC FDs if close_cloexec is set.
+  static fdarray *copy_array(fdarray *a, bool close_cloexec)
+  {
+    fdarray *b = new fdarray();
+    for (int fd = 0; fd < NOFILE; fd++) {
+      // Avoid reading info altogether if we're closing cloexec FDs
+      // and this is a cloexec FD.
+      if (close_cloexec && a->cloexec[fd].load(std::memory_order_relaxed))
+        continue;
+      fdinfo info = a->info[fd].load(std::memory_order_relaxed);
+      file *f = info.get_file();
+      if (!f || (close_cloexec && info.get_cloexec()))
+        continue;
+      b->info[fd].store(fdinfo(f->dup(), info.get_cloexec()),
+                        std::memory_order_relaxed);
+      b->cloexec[fd].store(info.get_cloexec(), std::memory_order_relaxed);
+      if (info.get_cloexec())
+        b->ncloexec++;
+      b->mark_used(fd);
+    }
+    return b;
+  }
+
+  // Take a reference to the file in FD fd of cpu's array, if any, and
+  // set *infoout to the fdinfo it came from.  The file is only known to
+  // be alive while the FD still holds it, so the reference is taken
+  // optimistically and kept only if the FD is unchanged afterwards;
+  // close() drops the FD's reference only after clearing the FD.  Until
+  // then the reference can't be freed out from under us: refcache won't
+  // free a file before this core has flushed its reference cache, which
+  // can't happen with interrupts disabled, and file_pipe_writer_wrapper,
+  // the one eagerly counted file, frees itself through gc_delayed().
+  // Both the reference and the FD are per-core or read-shared, so this
+  // writes no shared cache lines.
+  sref<file> getref(int cpu, int fd, fdinfo *infoout = nullptr)
+  {
+    scoped_gc_epoch gc;
+    for (;;) {
+      std::atomic<fdinfo> *infop =
+        &arrays_[cpu].load(std::memory_order_acquire)->info[fd];
+      fdinfo info;
+      file *f;
+      {
+        scoped_cli cli;
+        info = infop->load(std::memory_order_acquire);
+        f = info.get_file();
+        if (f)
+          f->inc();
+      }
+      if (!f || infop->load(std::memory_order_acquire) == info) {
+        if (infoout)
+          *infoout = info;
+        return sref<file>::transfer(f);
+      }
+      f->dec();
+    }
+  }
+
   fdinfo lock_fdinfo(std::atomic<fdinfo> *infop)
   {
     fdinfo info, newinfo;
@@ -267,16 +480,7 @@ private:
     return info;
   }
 
-  percpu<std::atomic<fdinfo>[NOFILE]> info_;
-  // In addition to storing O_CLOEXEC with each fdinfo so it can be
-  // read atomically with the FD, we store it separately so we can
-  // scan for keep-exec FDs without reading from info_, which would
-  // cause unnecessary sharing between the scan and creating O_CLOEXEC
-  // FDs.  To avoid unnecessary sharing on this array itself, the
-  // *default* state of this array for closed FDs must be 'true', so
-  // we only have to write to it when opening a keep-exec FD.
-  // Modifications to this array are protected by the fdinfo lock.
-  // Lock-free readers should double-check the O_CLOEXEC bit in
-  // fdinfo.
-  percpu<std::atomic<bool>[NOFILE]> cloexec_;
+  std::atomic<fdarray*> arrays_[NCPU];
+  // Serializes copy() and make_private(), the only changes to arrays_.
+  sleeplock own_lock_;
 };
@@ -32,8 +32,26 @@ struct superblock {
     u32 start_blknum;
     u32 end_blknum; // Inclusive
   } journal_blknums[NCPU];
+  u32 flags;        // SB_* feature flags.
 };
 
+// The flags double as the format version: a kernel must understand every
+// flag set in a superblock that it mounts.
+#define SB_EXTENTS   0x1  // Inodes map their blocks with extents (mkfs -e).
+#define SB_LARGEFILE 0x2  // 64-bit file sizes (mkfs -l); needs SB_EXTENTS.
+#define SB_HASHDIR   0x4  // Hashed directories (mkfs -H); see dirent_block().
+#define SB_INLINE    0x8  // Small files inside their inodes (mkfs -i).
+#define SB_COMPRESS  0x10 // Compressed files (mkfs -z); needs SB_EXTENTS.
+#define SB_FLAGS     (SB_EXTENTS | SB_LARGEFILE | SB_HASHDIR | SB_INLINE | \
+                      SB_COMPRESS)
+
+// The rest of the superblock's block holds the orphan table: the numbers of
+// the inodes that lost their last link on the disk while still open, so that
+// mount can reclaim them without scanning the inode table. Unused slots are 0.
+#define ORPHAN_BLOCK  1
+#define ORPHAN_OFFSET 512
+#define NORPHANS      ((BSIZE - ORPHAN_OFFSET) / sizeof(u32))
+
 
 #define NDIRECT 10
 #define NINDIRECT (BSIZE / sizeof(u32))
@@ -89,6 +107,68 @@ struct dinode {
   u32 addrs[NDIRECT+2]; // Data block addresses
 };
 
+// With SB_EXTENTS, the space of addrs[] holds a struct dextent_map instead,
+// which maps the file's blocks as extents (runs of contiguous disk blocks),
+// sorted by file block. Upto NIEXTENT extents fit in the inode itself; beyond
+// that, all of them move out to a single overflow block of upto NOEXTENT
+// extents. Unlike with indirect blocks, the number of metadata blocks that a
+// truncate or unlink has to journal is then at most 1, however large the file.
+struct dextent {
+  u32 fbn;              // First file block
+  u32 addr;             // First disk block
+  u32 len;              // Number of blocks, and maybe DEXTENT_FLAGS
+};
+
+// The extent's blocks were preallocated (see fallocate()) but have never been
+// written, so they read as zeros whatever is on the disk.
+#define DEXTENT_UNWRITTEN  0x80000000
+// The extent holds a compressed cluster (see SB_COMPRESS).
+#define DEXTENT_COMPRESSED 0x40000000
+#define DEXTENT_FLAGS      (DEXTENT_UNWRITTEN | DEXTENT_COMPRESSED)
+#define DEXTENT_LEN(e)     ((e)->len & ~DEXTENT_FLAGS)
+
+#define NIEXTENT 3
+#define NOEXTENT (BSIZE / sizeof(struct dextent))
+
+struct dextent_map {
+  u32 nextents;
+  u32 overflow;         // Overflow block, if nextents > NIEXTENT
+  struct dextent ext[NIEXTENT];
+  u32 size_hi;          // High 32 bits of dinode::size, with SB_LARGEFILE
+};
+
+// With SB_INLINE, a file of upto DINODE_INLINE_SIZE bytes may keep its data in
+// the space of addrs[] instead of in a block of its own, so that writing it
+// back takes no block allocation, no bitmap update and no data block write:
+// only the inode's block goes into the journal. DI_INLINE in the major field
+// (which only device inodes use otherwise) marks such inodes. The data stops
+// short of dextent_map::size_hi, which keeps its meaning. A file that grows
+// past DINODE_INLINE_SIZE moves out to a block, and back into its inode when
+// it is written back small enough again.
+#define DI_INLINE          0x1
+#define DINODE_INLINE_SIZE (sizeof(struct dextent_map) - sizeof(u32))
+
+// With SB_COMPRESS, the data of a file with DI_COMPRESS in its major field
+// is written back in clusters of ZCLUSTER_BLOCKS blocks, each compressed on
+// its own, and kept compressed if that saves at least a block. A compressed
+// cluster is a single DEXTENT_COMPRESSED extent at the cluster's first file
+// block, of fewer than ZCLUSTER_BLOCKS blocks, which start with a struct
+// dzcluster and go on with the zlib stream; the rest of the cluster's file
+// blocks are unmapped. Other clusters are mapped like in any other file. A
+// directory's DI_COMPRESS is passed on to the files and directories created
+// in it.
+#define DI_COMPRESS        0x2
+#define ZCLUSTER_BLOCKS    16
+#define ZCLUSTER_BYTES     (ZCLUSTER_BLOCKS * BSIZE)
+#define ZCLUSTER_MAGIC     0x7a636c75
+
+struct dzcluster {
+  u32 magic;            // ZCLUSTER_MAGIC
+  u32 zlen;             // Bytes of the zlib stream that follows
+  u32 rawlen;           // Bytes it decompresses to, upto ZCLUSTER_BYTES
+  u32 pad;
+};
+
 // Inodes per block.
 #define IPB           (BSIZE / sizeof(struct dinode))
 
@@ -101,23 +181,13 @@ struct dinode {
 // Block containing bit for block b
 #define BBLOCK(b, ninodes) ((b)/BPB + (ninodes)/IPB + 3)
 
-// Number of inodes to create in the filesystem. Consumed by tools/mkfs.c
-// as well as kernel/scalefs.cc (to decide the size of the inum<->mnode
-// lookup tables). If you change this number, remember to update NINODES_PRIME
-// in kernel/scalefs.cc
+// Number of inodes to create in the filesystem. Consumed by tools/mkfs.c.
 #if defined(HW_qemu)
 #define NINODES		4000
 #else
 #define NINODES		1000000
 #endif
 
-// A prime number larger than NINODES
-#if defined(HW_qemu)
-#define NINODES_PRIME	4013
-#else
-#define NINODES_PRIME	1010003
-#endif
-
 // A prime number larger than the total number of inode and bitmap blocks.
 // (They are currently around 15000 for a 16GB filesystem).
 #if defined(HW_qemu)
@@ -134,6 +204,48 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+#define DIRENTS_PER_BLOCK (BSIZE / sizeof(struct dirent))
+
+// A directory entry as getdents() returns it: the name, the number of the
+// mnode it refers to, and the mnode's type (T_DIR, T_FILE, ...).  The mnode
+// number and type are 0 if the kernel hasn't read the entry's inode yet.
+struct getdents_rec {
+  u64 mnum;
+  u8 type;
+  char name[DIRSIZ + 1];  // NUL-terminated
+};
+
+// With SB_HASHDIR, a directory is a sequence of whole blocks, and the hash
+// of an entry's name decides which of them the entry is in, so a lookup
+// reads just one block. The blocks are the buckets of a linear hash table:
+// a directory grows by a block at a time, splitting one existing block's
+// entries between that block and the new one. The layout follows from the
+// number of blocks alone.
+static inline u32
+dirent_hash(const char *name)
+{
+  u32 h = 2166136261u;  // FNV-1a
+  int i;
+
+  for (i = 0; i < DIRSIZ && name[i]; i++)
+    h = (h ^ (u8)name[i]) * 16777619u;
+  return h;
+}
+
+// The block of a directory of nblocks blocks that holds the entry whose name
+// hashes to h.
+static inline u32
+dirent_block(u32 h, u32 nblocks)
+{
+  u32 level = 1;
+
+  while (level < nblocks)
+    level <<= 1;
+  if ((h & (level - 1)) < nblocks)
+    return h & (level - 1);
+  return h & (level / 2 - 1);
+}
+
 // XXX(Austin) PATH_MAX sucks.  It would be nice if we didn't need it
 // to size kernel copy buffers.
 #define PATH_MAX 256
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stdint.h>
+
+// File system performance counting regions; see fsperf.hh.  Writing a
+// struct fsperf_ctl to /dev/fsperf sets the subsystems whose regions
+// count, as a mask of 1 << FSPERF_x, and can clear what they counted.
+
+enum fsperf_subsys {
+  FSPERF_SYSCALL,               // sys_* in sysfile.cc
+  FSPERF_COMMIT,                // Logging and committing transactions
+  FSPERF_APPLY,                 // Applying them to the disk
+  FSPERF_BUFCACHE,              // buf::get
+  FSPERF_PAGECACHE,             // mfile::get_page
+  FSPERF_NSUBSYS,
+};
+
+#define FSPERF_ALL ((1u << FSPERF_NSUBSYS) - 1)
+
+struct fsperf_ctl
+{
+  uint32_t mask;
+  // If non-zero, first zero every region's counts
+  uint32_t reset;
+};
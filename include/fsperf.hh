@@ -0,0 +1,85 @@
+#pragma once
+
+// Performance counting regions in the file system, built on scopedperf.
+// FSPERF_REGION(subsys, name) counts, per core, how many times the rest
+// of the enclosing scope ran and the TSC cycles and PMC 0 events it
+// took, but only while subsys is enabled in /dev/fsperf (see fsperf.h);
+// otherwise it costs a relaxed load and a branch.  PMC 0 counts whatever
+// /dev/sampler last programmed it with (see bin/perf), and reads as 0
+// without a PMU.  Reading /dev/fsperf reports the regions that counted.
+
+#include "critical.hh"
+#include "scopedperf.hh"
+#include "fsperf.h"
+#include <atomic>
+
+extern std::atomic<u32> fsperf_mask;
+extern bool fsperf_have_pmc;
+
+class fsperf_pmc : public scopedperf::namedctr<48>
+{
+public:
+  fsperf_pmc() : namedctr("pmc0") {}
+  uint64_t sample() const {
+    if (!fsperf_have_pmc)
+      return 0;
+    uint64_t a, d;
+    __asm __volatile("rdpmc" : "=a" (a), "=d" (d) : "c" (0));
+    return a | (d << 32);
+  }
+};
+
+extern scopedperf::ctrgroup_chain<scopedperf::tsc_ctr, fsperf_pmc>
+  fsperf_group;
+
+// The counts of one region, in the form scopedperf::perf_region wants.
+class fsperf_sum
+{
+public:
+  static const u32 ps_nctr = 2;
+
+  struct stats
+  {
+    u64 count;
+    u64 sum[ps_nctr];
+  } __mpalign__;
+
+  const char *const name;
+  const u8 subsys;
+  stats stat[NCPU];
+  fsperf_sum *next;
+
+  fsperf_sum(u8 subsys, const char *name);
+
+  bool enabled() const {
+    return fsperf_mask.load(std::memory_order_relaxed) & (1u << subsys);
+  }
+
+  void get_samples(uint64_t *s) const {
+    scopedperf::compiler_barrier();
+    fsperf_group.cg_get_samples(s);
+    scopedperf::compiler_barrier();
+  }
+
+  // Regions that sleep may end on another core, whose PMC 0 has
+  // nothing to do with the one they started on.  They count for the
+  // core they end on, without PMC events.
+  void record(u32 cpu, uint64_t *s) {
+    uint64_t delta[ps_nctr];
+    scoped_cli cli;
+    scopedperf::compiler_barrier();
+    fsperf_group.cg_get_delta(delta, s);
+    scopedperf::compiler_barrier();
+    u32 me = myid();
+    if (me != cpu)
+      delta[1] = 0;
+    for (u32 i = 0; i < ps_nctr; i++)
+      stat[me].sum[i] += delta[i];
+    stat[me].count++;
+  }
+};
+
+#define FSPERF_REGION(subsys, name)                                     \
+  static fsperf_sum __PERF_CONCAT(__fsperf_sum_, __LINE__)(subsys, name); \
+  auto __PERF_CONCAT(__fsperf_region_, __LINE__) =                      \
+    scopedperf::perf_region(&__PERF_CONCAT(__fsperf_sum_, __LINE__))
@@ -1,2 +1,11 @@
 #define FUTEX_WAIT 0
 #define FUTEX_WAKE 1
+// Wake val waiters and move up to timer more to addr2.  CMP_REQUEUE
+// first checks that *addr is val3.
+#define FUTEX_REQUEUE 2
+#define FUTEX_CMP_REQUEUE 3
+// Like WAIT and WAKE, but a wake only wakes waiters whose bitset
+// (val3) shares a bit with its own.
+#define FUTEX_WAIT_BITSET 4
+#define FUTEX_WAKE_BITSET 5
+#define FUTEX_BITSET_MATCH_ANY (~0ull)
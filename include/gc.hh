@@ -21,13 +21,18 @@ class rcu_freed {
  public:
   u64 _rcu_epoch;
   rcu_freed *_rcu_next;
+  // Bytes this frees, for the deferred-bytes accounting.  Subclasses
+  // that own separately allocated memory add it in.
+  u64 _rcu_size;
 #if RCU_TYPE_DEBUG
   const char *_rcu_type;
 #endif
 
   rcu_freed(const char *debug_type, void* objbase, uint64_t objsize)
 #if RCU_TYPE_DEBUG
-    : _rcu_next(nullptr), _rcu_type(debug_type)
+    : _rcu_next(nullptr), _rcu_size(objsize), _rcu_type(debug_type)
+#else
+    : _rcu_size(objsize)
 #endif
   {
     mtgcregister(objbase, objsize, debug_type);
@@ -57,3 +62,4 @@ class scoped_gc_epoch {
 void            initgc(void);
 void            gc_delayed(rcu_freed *);
 void            gc_wakeup(void);
+u64             gc_delayed_bytes(void);
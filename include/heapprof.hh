@@ -1,21 +1,25 @@
 #pragma once
 
-#include <sys/types.h>
+#include "types.h"
 
 enum heap_profile_arena {
   HEAP_PROFILE_KALLOC,
   HEAP_PROFILE_KMALLOC,
-  HEAP_PROFILE_NEWARRAY
+  HEAP_PROFILE_NEWARRAY,
+  HEAP_PROFILE_NARENAS
 };
 
 class print_stream;
 
+// Account bytes (negative for a free) to the allocation site rip.  On
+// a free, lifetime is how long the allocation lived, in nanoseconds.
 #if KERNEL_HEAP_PROFILE
 bool heap_profile_update(heap_profile_arena arena, const void *rip,
-                         ssize_t bytes);
+                         ssize_t bytes, u64 lifetime = 0);
 #else
 static inline bool
-heap_profile_update(heap_profile_arena arena, const void *rip, ssize_t bytes)
+heap_profile_update(heap_profile_arena arena, const void *rip, ssize_t bytes,
+                    u64 lifetime = 0)
 {
   return false;
 }
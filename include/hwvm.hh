@@ -142,6 +142,15 @@ namespace mmu_shared_page_table {
       __invalidate(start, len, sd);
     }
 
+    // Large pages aren't supported: a core that dropped one in
+    // insert() couldn't shoot it down on the other cores.  Callers map
+    // the pages one at a time instead.
+    template<class ForwardIterator>
+    bool insert_huge(uintptr_t va, ForwardIterator tracker_it, pme_t pte)
+    {
+      return false;
+    }
+
     // Switch to this page_map_cache on this CPU.
     void switch_to() const;
 
@@ -201,13 +210,17 @@ namespace mmu_per_core_page_table {
   class page_map_cache
   {
     percpu<struct pgmap*> pml4;
+    // Set once any core has mapped a large page.
+    std::atomic<bool> huge_mapped_;
     friend class shootdown;
 
     // Clear and TLB flush a region of this core's page table.
     void clear(uintptr_t start, uintptr_t end);
 
+    bool insert_huge(uintptr_t va, pme_t pte);
+
   public:
-    page_map_cache()
+    page_map_cache() : huge_mapped_(false)
     {
       for (size_t i = 0; i < NCPU; ++i)
         pml4[i] = nullptr;
@@ -220,6 +233,25 @@ namespace mmu_per_core_page_table {
 
     void insert(uintptr_t va, page_tracker *t, pme_t pte);
 
+    // Map the HUGE_PGSIZE-aligned va with a single large page, whose
+    // address and flags are in @c pte (without PTE_PS).  @c
+    // tracker_it points to the trackers for the pages it covers, all
+    // of which are marked as cached on this core.  Returns false if
+    // this core already maps part of the range with small pages, in
+    // which case the caller should map it a page at a time.
+    template<class ForwardIterator>
+    bool insert_huge(uintptr_t va, ForwardIterator tracker_it, pme_t pte)
+    {
+      assert(check_critical(NO_SCHED));
+      if (!insert_huge(va, pte))
+        return false;
+      auto end = tracker_it + HUGE_PGSIZE / PGSIZE;
+      for (; tracker_it < end; tracker_it += tracker_it.span())
+        if (tracker_it.is_set())
+          tracker_it->tracker_cores.set(myid());
+      return true;
+    }
+
     template<class ForwardIterator>
     void invalidate(uintptr_t start, uintptr_t len,
                     ForwardIterator tracker_it, shootdown *sd)
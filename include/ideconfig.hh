@@ -3,10 +3,12 @@
 #if defined(HW_qemu)
 #define MEMIDE        1
 #define AHCIIDE       0
+#define NVMEIDE       0
 
 #elif defined(HW_ben)
 #define MEMIDE        1
 #define AHCIIDE       0
+#define NVMEIDE       0
 #endif
 
 #ifndef MEMIDE
@@ -15,3 +17,6 @@
 #ifndef AHCIIDE
 #define AHCIIDE 0
 #endif
+#ifndef NVMEIDE
+#define NVMEIDE 0
+#endif
@@ -36,6 +36,7 @@
 #define IDE_CMD_WRITE_DMA             0xca
 #define IDE_CMD_WRITE_DMA_EXT         0x35
 #define IDE_CMD_WRITE_FPDMA_QUEUED    0x61
+#define IDE_CMD_DSM                   0x06  // DATA SET MANAGEMENT
 #define IDE_CMD_FLUSH_CACHE           0xe7
 #define IDE_CMD_FLUSH_CACHE_EXT       0xea
 #define IDE_CMD_IDENTIFY              0xec
@@ -71,12 +72,22 @@ struct identify_device {
   u16 pad5[4];            // Words 89-92
   u16 hwreset;            // Word 93
   u16 pad6[6];            // Words 94-99
-  u64 lba48_sectors;      // Words 100-104, assuming little-endian
+  u64 lba48_sectors;      // Words 100-103, assuming little-endian
+  u16 pad7;               // Word 104
+  u16 dsm_max_blocks;     // Word 105
+  u16 pad8[63];           // Words 106-168
+  u16 dsm_caps;           // Word 169
 };
 
 #define IDE_SATA_NCQ_SUPPORTED          (1 << 8)
 #define IDE_SATA_NCQ_QUEUE_DEPTH        0x1f
 
 #define IDE_FEATURE86_LBA48     (1 << 10)
+
+// DATA SET MANAGEMENT
+#define IDE_DSM_TRIM_SUPPORTED  (1 << 0)  // In dsm_caps
+#define IDE_DSM_FEATURE_TRIM    0x01
+#define IDE_DSM_RANGES_PER_BLOCK 64       // LBA range entries per 512 bytes
+#define IDE_DSM_RANGE_MAX       0xffff    // Sectors per LBA range entry
 #define IDE_HWRESET_CBLID       0x2000
 
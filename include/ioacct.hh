@@ -0,0 +1,41 @@
+#pragma once
+
+#include <atomic>
+
+// Per-process and per-file I/O accounting, for telling which processes
+// (and files) are behind a box's I/O load.  Every I/O event is charged
+// to the process it happens in, by pid, and while per-file accounting is
+// on (write "1" to /dev/ioacct, "0" to turn it off and "c" to clear the
+// counts), also to the file it is for, by mnode number (the st_ino of
+// stat()).  Every core counts into a table of IOACCT_SLOTS entries of its
+// own, so charging an event touches only core-local memory; reading
+// /dev/ioacct folds the cores' tables together.  Entries outlive their
+// process, so short-lived processes still show up.
+//
+// Background work is charged to whoever does it: pages read ahead by a
+// worker to its process, and the journal blocks and disk writes of a
+// group commit to the process that led it.
+
+enum ioacct_counter : u8 {
+  // Bytes copied out of and into the page cache by read(), write() and
+  // exec()
+  IOACCT_RBYTES,
+  IOACCT_WBYTES,
+  // Pages read in from the disk
+  IOACCT_PAGEFILLS,
+  // fsync(), fdatasync() and sync_file_range() calls
+  IOACCT_FSYNCS,
+  // Journal blocks written (not per-file)
+  IOACCT_JOURNAL,
+  // Bytes read from and written to the disks, every copy counted (not
+  // per-file)
+  IOACCT_DISK_RBYTES,
+  IOACCT_DISK_WBYTES,
+  IOACCT_NCOUNTERS,
+};
+
+extern std::atomic<bool> ioacct_files_enabled;
+
+// Charge n to counter c of the current process, and of the file mnum if
+// it is not 0 and per-file accounting is on.
+void ioacct_charge(u8 c, u64 n, u64 mnum = 0);
@@ -43,12 +43,15 @@ struct localsock;
 struct work;
 struct dwork;
 struct irq;
+struct net_txcsum;
 class print_stream;
 class mnode;
 class inode;
+class dir_entries;
 class buf;
 class transaction;
 class disk_completion;
+class poll_queue;
 
 // acpi.c
 typedef void *ACPI_HANDLE;
@@ -78,6 +81,7 @@ void            binit(void);
 buf*            bread(u32, u64, int writer);
 void            brelse(buf*, int writer);
 void            bwrite(buf*);
+size_t          buf_reclaim(int cpu);
 
 // cga.c
 void            cgaputc(int c);
@@ -100,32 +104,53 @@ int             load_image(proc *p, const char *path, const char * const *argv,
                            sref<vmap> *oldvmap_out);
 
 // fs.c
-sref<inode>     dirlookup(sref<inode>, char*);
+sref<inode>     dirlookup(borrowed<inode>, char*);
 sref<inode>     ialloc(u32, short);
 void            free_inode_number(u32 inum);
-void            free_inode(sref<inode>, transaction *trans = NULL);
-sref<inode>     namei(sref<inode> cwd, const char*);
+void            free_inode(borrowed<inode>, transaction *trans = NULL);
+sref<inode>     namei(borrowed<inode> cwd, const char*);
 sref<inode>     iget(u32 dev, u32 inum);
 #define		READLOCK	0
 #define		WRITELOCK	1
-void            ilock(sref<inode>, int lock_type);
-void            iupdate(sref<inode>, transaction *trans);
-void            iunlock(sref<inode>);
-void            drop_bufcache(sref<inode> ip);
-void            itrunc(sref<inode>, u32 offset = 0, transaction *trans = NULL);
-int             readi(sref<inode>, char*, u32, u32);
-void            stati(sref<inode>, struct stat*);
-int             writei(sref<inode>, const char*, u32, u32, transaction *trans = NULL,
+void            ilock(borrowed<inode>, int lock_type);
+void            iupdate(borrowed<inode>, transaction *trans);
+void            iunlock(borrowed<inode>);
+void            drop_bufcache(borrowed<inode> ip);
+u32             inode_blocknum(borrowed<inode> ip, u32 bn);
+void            itrunc(borrowed<inode>, u64 offset = 0, transaction *trans = NULL);
+void            reserve_extent(borrowed<inode>, u32 nblocks);
+void            release_extent(borrowed<inode>);
+bool            alloc_file_pages(borrowed<inode>, const std::vector<u32> &pages,
+                                 transaction *trans);
+int             readi(borrowed<inode>, char*, u64, u32);
+void            readahead(borrowed<inode>, u64, u32);
+void            iprefetch(u32 dev, const std::vector<u32> &inums);
+bool            is_hole(borrowed<inode>, u64, u32);
+void            file_blocks(borrowed<inode>, u32, u32, u32*);
+void            stati(borrowed<inode>, struct stat*);
+int             writei(borrowed<inode>, const char*, u64, u32, transaction *trans = NULL,
                        bool writeback = false, bool lazy_trans_update = false,
                        bool dont_cache = false);
-void            update_size(sref<inode>, u32, transaction *trans = NULL);
-sref<inode>     nameiparent(sref<inode> cwd, const char*, char*);
-int             dirlink(sref<inode>, const char*, u32, bool inc_link, transaction *trans);
-int             dirunlink(sref<inode>, const char*, u32, bool dec_link, transaction *trans);
-void            dir_init(sref<inode> dp);
-void            dir_flush(sref<inode> dp, transaction *trans = NULL);
-void            dir_remove_entries(sref<inode> dp, std::vector<char*> names_vec);
-void            dir_remove_entry(sref<inode> dp, char *entry_name);
+void            update_size(borrowed<inode>, u64, transaction *trans = NULL);
+bool            inline_fits(u64 size);
+void            inline_write(borrowed<inode>, const char *data, u64 size,
+                             u64 keep, transaction *trans);
+bool            inline_promote(borrowed<inode>, transaction *trans);
+bool            compress_supported(void);
+int             set_compress(borrowed<inode>, bool on);
+bool            zcluster_write(borrowed<inode>, u32 c, const char *z, u32 zlen,
+                               char *const *pages, u32 npages,
+                               transaction *trans);
+int             preallocate(borrowed<inode>, u64 off, u64 len, bool keep_size,
+                            transaction *trans);
+sref<inode>     nameiparent(borrowed<inode> cwd, const char*, char*);
+int             dirlink(borrowed<inode>, const char*, u32, bool inc_link, transaction *trans);
+int             dirunlink(borrowed<inode>, const char*, u32, bool dec_link, transaction *trans);
+dir_entries*    dir_init(borrowed<inode> dp);
+size_t          dir_reclaim(void);
+void            dir_flush(borrowed<inode> dp, transaction *trans = NULL);
+void            dir_remove_entries(borrowed<inode> dp, std::vector<char*> names_vec);
+void            dir_remove_entry(borrowed<inode> dp, char *entry_name);
 void            get_superblock(struct superblock *sb);
 void		balloc_free_on_disk(std::vector<u32>& blocks, transaction *trans, bool alloc);
 #define 	balloc_on_disk(blocks, trans)	balloc_free_on_disk(blocks, trans, true)
@@ -134,8 +159,11 @@ void		balloc_free_on_disk(std::vector<u32>& blocks, transaction *trans, bool all
 // futex.cc
 typedef u64* futexkey_t;
 int             futexkey(const u64* useraddr, vmap* vmap, futexkey_t* key);
-long            futexwait(futexkey_t key, u64 val, u64 timer);
-long            futexwake(futexkey_t key, u64 nwake);
+long            futexwait(futexkey_t key, u64 val, u64 timer,
+                          u64 bitset = ~0ull);
+long            futexwake(futexkey_t key, u64 nwake, u64 bitset = ~0ull);
+long            futexrequeue(futexkey_t key, u64 nwake, u64 nrequeue,
+                             futexkey_t key2, bool cmp, u64 val);
 
 // hz.c
 void            microdelay(u64);
@@ -155,13 +183,17 @@ void            kfree(void*, size_t size = PGSIZE);
 void*           ksalloc(int slabtype);
 void            ksfree(int slabtype, void*);
 void*           early_kalloc(size_t size, size_t align);
+size_t          early_phys_bytes(void);
 void*           kmalloc(u64 nbytes, const char *name, int cpu = -1);
 void            kmfree(void*, u64 nbytes);
+bool            kmalloc_object(const void *p, const void **base, u32 *size,
+                               int *cpu);
 int             kmalign(void **p, int align, u64 size, const char *name);
 void            kmalignfree(void *, int align, u64 size);
 void            verifyfree(char *ptr, u64 nbytes);
 void            kminit(void);
 void            kmemprint(print_stream *s);
+int             kfree_percent(int cpu);
 void            kmbalance(void);
 
 // kbd.c
@@ -176,9 +208,11 @@ extern int      ncpu;
 // net.c
 void            netfree(void *va);
 void*           netalloc(void);
-void            netrx(void *va, u16 len);
-int             nettx(void *va, u16 len);
+void            netrx(void *va, u16 len, u32 csum_flags = 0);
+int             nettx(void *va, u16 len, const struct net_txcsum *csum = nullptr);
+void            nettx_flush(void);
 void            nethwaddr(u8 *hwaddr);
+u32             netfeatures(void);
 
 // picirq.c
 void            picenable(int);
@@ -188,6 +222,7 @@ void            picdump(void);
 // pipe.c
 int             pipealloc(sref<file>*, sref<file>*, int flags);
 void            pipeclose(struct pipe*, int);
+sref<poll_queue> pipepollq(struct pipe*, int);
 int             piperead(struct pipe*, char*, int);
 int             pipewrite(struct pipe*, const char*, int);
 struct pipe*    pipesockalloc();
@@ -213,6 +248,7 @@ void            procdumpall(void);
 void            scheduler(void) __noret__;
 void            userinit(void);
 void            yield(void);
+int             myhome(void);
 struct proc*    threadalloc(void (*fn)(void*), void *arg);
 struct proc*    threadpin(void (*fn)(void*), void *arg, const char *name, int cpu);
 
@@ -221,6 +257,7 @@ void            sampstart(void);
 int             sampintr(struct trapframe*);
 void            sampconf(void);
 void            sampidle(bool);
+bool            samphavepmc(void);
 void            wdpoke(void);
 
 // scalefs.cc
@@ -234,6 +271,7 @@ void            scheddump(void);
 int             steal(void);
 void            addrun(struct proc*);
 int             dwork_push(struct dwork*, int);
+void            idle_halt(void);
 
 // syscall.c
 int             fetchint64(uptr, u64*);
@@ -261,6 +299,10 @@ void            pushcli(void);
 void            popcli(void);
 void            getcallerpcs(void*, uptr*, int);
 
+// txtrace.cc
+void            txtrace(u8 type, int journal, u64 txn, u64 arg = 0,
+                        u32 aux = 0);
+
 // uart.c
 void            uartputc(char c);
 void            uartintr(void);
@@ -281,6 +323,7 @@ size_t          safe_read_vm(void *dst, uintptr_t src, size_t n);
 // zalloc.cc
 char*           zalloc(const char* name);
 void            zfree(void* p);
+bool            zrefill_idle(void);
 
 // other exported/imported functions
 void cmain(u64 mbmagic, u64 mbaddr);
@@ -61,8 +61,30 @@
   X(uint64_t, refcache_item_disowned_count)     \
   X(uint64_t, refcache_dirtied_count)           \
   X(uint64_t, refcache_conflict_count)          \
+  /* Delta cache lookups that found (hit) or had to insert (miss) \
+   * the object. */                             \
+  X(uint64_t, refcache_hit_count)               \
+  X(uint64_t, refcache_miss_count)              \
+  /* Forced epoch advances (see refcache::expedite). */ \
+  X(uint64_t, refcache_expedite_count)          \
+  X(uint64_t, refcache_expedite_cycles)         \
+  /* Cycles from the start of the epoch in which a freed object's \
+   * count reached zero to its review, summed over count objects. */ \
+  X(uint64_t, refcache_free_latency_count)      \
+  X(uint64_t, refcache_free_latency_cycles)     \
   X(uint64_t, refcache_weakref_break_failed)    \
 
+#define KSTATS_OPLOG(X)                         \
+  /* Logger cache lookups that found (hit) or had to tag (miss) a \
+   * way for the object. */                     \
+  X(uint64_t, oplog_hit_count)                  \
+  X(uint64_t, oplog_miss_count)                 \
+  /* Misses that had to flush another object's logger first. */ \
+  X(uint64_t, oplog_conflict_flush_count)       \
+  /* Long loggers flushed by the reclaimers (see \
+   * logged_object::flush_long_logs). */        \
+  X(uint64_t, oplog_background_flush_count)     \
+
 #define KSTATS_SOCKET(X)\
   X(uint64_t, socket_load_balance) \
   X(uint64_t, socket_local_read)   \
@@ -73,11 +95,67 @@
   X(uint64_t, socket_local_recvfrom_cycles)   \
   X(uint64_t, socket_local_recvfrom_cnt)   \
 
+#define KSTATS_NET(X)                           \
+  /* Packet buffers allocated from the per-core pools, and   \
+   * allocations that found their pool empty. */ \
+  X(uint64_t, net_buf_alloc_count)              \
+  X(uint64_t, net_buf_miss_count)               \
+  /* Buffers freed back to another core's pool. */ \
+  X(uint64_t, net_buf_remote_free_count)        \
+  /* 2MB chunks added to the pools. */          \
+  X(uint64_t, net_buf_chunk_count)              \
+
 #define KSTATS_FILE(X)                          \
   X(uint64_t, write_cycles)                     \
   X(uint64_t, write_count)                      \
   X(uint64_t, mnode_alloc)                      \
   X(uint64_t, mnode_free)                       \
+  /* Blocks read from the disks. */             \
+  X(uint64_t, disk_read_blocks)                 \
+
+// The ScaleFS fsync pipeline.  Each _cycles field is the total time
+// spent in _count calls of the step.
+#define KSTATS_FS(X)                            \
+  /* Turning logged metadata operations into transactions. */ \
+  X(uint64_t, fs_process_log_count)             \
+  X(uint64_t, fs_process_log_cycles)            \
+  /* Writing out a file's dirty pages and inode (mfile::sync_file). */ \
+  X(uint64_t, fs_sync_file_count)               \
+  X(uint64_t, fs_sync_file_cycles)              \
+  /* Sorting and deduplicating transactions' blocks. */ \
+  X(uint64_t, fs_dedup_count)                   \
+  X(uint64_t, fs_dedup_cycles)                  \
+  /* Writing batches to the journal, cache flushes included. */ \
+  X(uint64_t, fs_journal_write_count)           \
+  X(uint64_t, fs_journal_write_cycles)          \
+  /* Disk cache flushes that make commits durable. */ \
+  X(uint64_t, fs_commit_flush_count)            \
+  X(uint64_t, fs_commit_flush_cycles)           \
+  /* Writing committed batches to their home locations. */ \
+  X(uint64_t, fs_apply_count)                   \
+  X(uint64_t, fs_apply_cycles)                  \
+  /* Commits that waited for other journals' transactions. */ \
+  X(uint64_t, fs_dep_wait_count)                \
+  X(uint64_t, fs_dep_wait_cycles)               \
+  /* Commits that waited for journal space. */  \
+  X(uint64_t, fs_journal_stall_count)           \
+  X(uint64_t, fs_journal_stall_cycles)          \
+  /* Clusters of compressed files compressed (see SB_COMPRESS), the bytes \
+   * that went in, and the bytes of the ones that were kept compressed. */ \
+  X(uint64_t, fs_compress_count)                \
+  X(uint64_t, fs_compress_cycles)               \
+  X(uint64_t, fs_compress_bytes_in)             \
+  X(uint64_t, fs_compress_bytes_out)            \
+  /* Compressed clusters decompressed, the bytes they decompressed to, and \
+   * reads that found their cluster already decompressed. */ \
+  X(uint64_t, fs_decompress_count)              \
+  X(uint64_t, fs_decompress_cycles)             \
+  X(uint64_t, fs_decompress_bytes)              \
+  X(uint64_t, fs_decompress_hit_count)          \
+  /* Batches committed, and the blocks and transactions in them. */ \
+  X(uint64_t, fs_commit_batch_count)            \
+  X(uint64_t, fs_commit_batch_blocks)           \
+  X(uint64_t, fs_commit_batch_txns)             \
 
 #define KSTATS_SCHED(X)                         \
   X(uint64_t, sched_tick_count)                 \
@@ -89,9 +167,12 @@
   KSTATS_VM(X)                                  \
   KSTATS_KALLOC(X)                              \
   KSTATS_REFCACHE(X)                            \
+  KSTATS_OPLOG(X)                               \
   KSTATS_SOCKET(X)                              \
+  KSTATS_NET(X)                                 \
   KSTATS_SCHED(X)                               \
   KSTATS_FILE(X)                                \
+  KSTATS_FS(X)                                  \
 
 struct kstats;
 #ifdef XV6_KERNEL
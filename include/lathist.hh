@@ -0,0 +1,61 @@
+#pragma once
+
+#include <cstdint>
+
+#include "amd64.h"
+
+#ifdef XV6_KERNEL
+#include "spercpu.hh"
+#endif
+
+// Latency histograms of the storage stack, in TSC cycles.  Bucket b
+// counts latencies in [2^b, 2^(b+1)) (bucket 0 also takes 0).  Each
+// core has its own, which it updates with relaxed atomic adds, so an
+// update that migrates or races with an interrupt isn't lost.
+// /dev/latstats returns a struct lathists per core, in core order, and
+// bin/latstats merges them.
+
+#define LATHIST_BUCKETS 64
+
+#define LATHISTS_ALL(X)                         \
+  /* sys_fsync(), entry to return. */           \
+  X(fsync)                                      \
+  /* sys_sync(), entry to return. */            \
+  X(sync)                                       \
+  /* A batch's commit to the end of its apply. */ \
+  X(commit_apply)                               \
+
+struct lathists;
+#ifdef XV6_KERNEL
+DECLARE_PERCPU(struct lathists, mylathists, NO_CRITICAL);
+#endif
+
+struct lathists
+{
+#define X(name) uint64_t name[LATHIST_BUCKETS];
+  LATHISTS_ALL(X)
+#undef X
+  // disk_completion round trips, from submitting the I/O to the
+  // notify() that completes it, by disk.  An I/O issued to several
+  // disks counts for the last one.
+  uint64_t disk[NDISK][LATHIST_BUCKETS];
+
+  static int bucket(uint64_t cycles)
+  {
+    return cycles < 2 ? 0 : 63 - __builtin_clzll(cycles);
+  }
+
+#ifdef XV6_KERNEL
+  // Count a latency of cycles in hist, one of this core's histograms
+  static void record(uint64_t *hist, uint64_t cycles)
+  {
+    __atomic_fetch_add(&hist[bucket(cycles)], 1, __ATOMIC_RELAXED);
+  }
+
+  // Count the time since start, a rdtsc()
+  static void record_since(uint64_t *hist, uint64_t start)
+  {
+    record(hist, rdtsc() - start);
+  }
+#endif
+};
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <atomic>
+
+// Lock contention profile, for sleeplocks and condvars.  Unlike LOCKSTAT
+// it is always compiled in, and costs one relaxed load per acquire and
+// release while it is off.  While it is on (write "1" to /dev/lockprof,
+// "0" to turn it off and "c" to clear it), each named sleeplock counts
+// its acquisitions, contended acquisitions and the cycles spent waiting
+// for and holding it under its name, and each contended acquisition and
+// condvar wait is also charged to the call site it came from.  Every core
+// counts into a table of LOCKPROF_SITES entries of its own.  Reading
+// /dev/lockprof reports the locks and the top call sites by wait time;
+// resolve the sites with addr2line on kernel.elf.
+
+enum lockprof_kind : u8 {
+  LOCKPROF_SLEEPLOCK = 1,
+  LOCKPROF_CONDVAR,
+};
+
+extern std::atomic<bool> lockprof_enabled;
+
+static inline bool
+lockprof_on()
+{
+  return lockprof_enabled.load(std::memory_order_relaxed);
+}
+
+// Count n acquisitions (or waits), contended of them contended, with
+// wait cycles of waiting and hold cycles of holding, against the kind of
+// lock called name at site (0 for the lock as a whole).
+void lockprof_record(u8 kind, const char *name, uptr site, u64 n,
+                     u64 contended, u64 wait, u64 hold);
@@ -20,6 +20,13 @@ struct klockstat : public rcu_freed {
   static void* operator new(unsigned long nbytes);
   static void operator delete(void *p);
 };
+
+// Whether lockstat is recording.
+extern int lockstat_enable;
+// Give *stat (which is &klockstat_lazy if lazy) a klockstat of its own.
+void lockstat_init(struct klockstat **stat, const char *name, bool lazy);
+// Retire *stat, for lockstat_clear to free, and clear it.
+void lockstat_stop(struct klockstat **stat);
 #else
 struct klockstat;
 #endif
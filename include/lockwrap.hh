@@ -33,6 +33,18 @@ public:
     }
   }
 
+  // Same as above, except that the location of the data is itself protected
+  // by the seqcount (i.e., writers may replace *vp), so re-read it on every
+  // attempt.
+  seq_reader(T* const* vp, const seqcount<u32>* seq) {
+    for (;;) {
+      auto r = seq->read_begin();
+      state_ = **vp;
+      if (!r.need_retry())
+        return;
+    }
+  }
+
   const T* operator->() const {
     return &state_;
   }
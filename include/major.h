@@ -11,3 +11,17 @@
 #define MAJ_MFSSTATS 11
 #define MAJ_BLKSTATS 12
 #define MAJ_EVICTCACHES 13
+#define MAJ_MOUNTSTATS 14
+#define MAJ_HEAPPROF 15
+#define MAJ_HEAPSAMPLES 16
+#define MAJ_BUFSTATS 17
+#define MAJ_TXQSTATS 18
+#define MAJ_LATSTATS 19
+#define MAJ_TXTRACE  20
+#define MAJ_DISKTRACE 21
+#define MAJ_LOCKPROF 22
+#define MAJ_FSPERF   23
+#define MAJ_IOACCT   24
+#define MAJ_MEMACCT  25
+#define MAJ_MEMIDE   26
+#define MAJ_FSFLAGS  27
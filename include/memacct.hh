@@ -0,0 +1,57 @@
+#pragma once
+
+#include "spercpu.hh"
+#include <atomic>
+
+// What the file system's caches and metadata spend memory on, split up
+// more finely than the allocators can.  The places that allocate and
+// free each kind of memory count the objects and bytes into per-core
+// counters, which a core's count may take negative when it frees what
+// another core allocated; only the sum over all cores means anything.
+// Reading /dev/memacct sums them up (see memacct.cc).
+
+enum memacct_kind : u8 {
+  MEMACCT_NONE = 0,
+  // Buffer cache block contents, including the frozen copies that
+  // transactions hold on to
+  MEMACCT_BUFDATA,
+  // Page cache pages of files on the root file system and of anonymous
+  // (anon_fs) files, from allocation until the last reference goes,
+  // whether or not they are still in the file
+  MEMACCT_FILE_PAGES,
+  MEMACCT_ANON_PAGES,
+  // The in-memory free block bitmap and its summaries, and the free_inum
+  // objects of the inode allocator
+  MEMACCT_FREEBLOCK_BITMAP,
+  MEMACCT_FREE_INUM,
+  // Directory name hash tables of mdirs: buckets and items
+  MEMACCT_MDIR_BUCKETS,
+  MEMACCT_MDIR_ITEMS,
+  // The dir_entries indexes of on-disk directories: slots
+  MEMACCT_DIR_ENTRIES,
+  // Operations queued in oplog loggers
+  MEMACCT_OPLOG_OPS,
+  // Blocks of transactions that are not yet applied to the disk
+  MEMACCT_TXN_DISKBLOCKS,
+  MEMACCT_NKINDS,
+};
+
+struct memacct_counts
+{
+  std::atomic<s64> objs[MEMACCT_NKINDS];
+  std::atomic<s64> bytes[MEMACCT_NKINDS];
+};
+
+DECLARE_PERCPU(struct memacct_counts, mymemacct, NO_CRITICAL);
+
+// Count n objects of kind taking up bytes bytes (both negative for
+// frees) on the current core.
+static inline void
+memacct_add(u8 kind, s64 n, s64 bytes)
+{
+  if (kind == MEMACCT_NONE)
+    return;
+  memacct_counts *c = mymemacct.get_unchecked();
+  c->objs[kind].fetch_add(n, std::memory_order_relaxed);
+  c->bytes[kind].fetch_add(bytes, std::memory_order_relaxed);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+// The memory disk's device model (see kernel/memide.cc), which makes its
+// I/Os take about as long as a real disk's would.  Writing a struct
+// memide_model to /dev/memide changes the model of every memory disk for
+// the I/Os issued from then on; fields set to MEMIDE_KEEP keep their
+// current value.  Reading /dev/memide shows the model and what the disks
+// have done under it.
+
+#define MEMIDE_KEEP 0xffffffffu
+
+struct memide_model
+{
+  uint32_t read_us;             // Latency of a read, past its transfer
+  uint32_t write_us;            // Latency of a write, past its transfer
+  uint32_t flush_us;            // Latency of a cache flush, past the writes
+  uint32_t mbps;                // Transfer rate cap in MB/s, 0 for none
+  uint32_t queue_depth;         // Most I/Os in flight, 0 for the maximum
+};
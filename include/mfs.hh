@@ -9,9 +9,11 @@ extern mfs* anon_fs;
 
 sref<mnode> namei(sref<mnode> cwd, const char* path);
 sref<mnode> nameiparent(sref<mnode> cwd, const char* path, strbuf<DIRSIZ>* buf);
-s64 readm(sref<mnode> m, char* buf, u64 start, u64 nbytes);
+// With user set, buf is a user address, copied to and from with putmem() and
+// fetchmem(); a fault ends the I/O early, as if it were short.
+s64 readm(sref<mnode> m, char* buf, u64 start, u64 nbytes, bool user = false);
 s64 writem(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
-           mfile::resizer* resize = nullptr);
+           mfile::resizer* resize = nullptr, bool user = false);
 
 class print_stream;
 void mfsprint(print_stream *s);
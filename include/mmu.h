@@ -6,6 +6,7 @@
 
 #define PGSIZE          4096
 #define PGSHIFT		12		// log2(PGSIZE)
+#define HUGE_PGSIZE	(PGSIZE << 9)	// 2MB page mapped by one PD entry
 
 #define PXSHIFT(n)	(PGSHIFT+(9*(n)))
 #define PX(n, la)	((((uintptr_t) (la)) >> PXSHIFT(n)) & 0x1FF)
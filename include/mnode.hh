@@ -2,12 +2,14 @@
 
 #include "kernel.hh"
 #include "refcache.hh"
+#include "snzi.hh"
 #include "chainhash.hh"
 #include "radix_array.hh"
 #include "page_info.hh"
 #include "kalloc.hh"
 #include "fs.h"
 #include "scalefs.hh"
+#include "condvar.hh"
 
 #include <limits.h>
 
@@ -58,8 +60,18 @@ public:
   void cache_pin(bool flag);
   void dirty(bool flag);
   bool is_dirty();
+  // When the mnode last went from clean to dirty, in nsectime() nanoseconds.
+  u64 dirtied_at() const { return dirtied_at_; }
   void mark_inode_for_deletion();
   u8 type() const { return mnumber(mnum_).type(); }
+  // The type of the mnode numbered mnum.
+  static u8 type_of(u64 mnum) { return mnumber(mnum).type(); }
+  // What a directory maps a name to before the mnode for its inode, inum,
+  // has been created (see mdir::insert_unloaded()). It has type 0, so it is
+  // never a valid mnode number.
+  static u64 unloaded_mnum(u64 inum) { return inum << mnumber::type_bits; }
+  static bool is_unloaded(u64 mnum) { return !type_of(mnum); }
+  static u64 unloaded_inum(u64 mnum) { return mnum >> mnumber::type_bits; }
   void initialized(bool flag) { initialized_ = flag; }
   bool is_initialized() { return initialized_; }
 
@@ -72,10 +84,30 @@ public:
   msock* as_sock();
   const msock* as_sock() const;
 
+  // The link count is a FS_NLINK_REFCOUNT counter, whose zero
+  // detection may lag, or for the types in FS_NLINK_SNZI_TYPES, a SNZI
+  // that unpins the mnode as soon as the last link goes (and re-pins
+  // it if a link comes back).
   class linkcount : public FS_NLINK_REFCOUNT referenced {
   public:
-    linkcount() {};
+    linkcount(u8 type);
+    ~linkcount();
+    void inc() { if (snzi_) snzi_->inc(); else referenced::inc(); }
+    void dec() { if (snzi_) snzi_->dec(); else referenced::dec(); }
+    u64 get_consistent() {
+      return snzi_ ? snzi_->get_consistent() : referenced::get_consistent();
+    }
     void onzero() override;
+
+  private:
+    struct snzi_count : public locked_snzi::counter {
+      linkcount *const lc_;
+      snzi_count(linkcount *lc) : lc_(lc) {}
+      void onzero() override;
+      void onnonzero() override;
+      NEW_DELETE_OPS(snzi_count);
+    };
+    snzi_count *const snzi_;
   };
 
   mfs* const fs_;
@@ -94,6 +126,7 @@ private:
   std::atomic<bool> dirty_;
   std::atomic<bool> valid_;
   bool delete_inode_;
+  u64 dirtied_at_;
 };
 
 /*
@@ -156,6 +189,10 @@ public:
   NEW_DELETE_OPS(mfs);
 
   sref<mnode> mget(u64 mnum);
+  // Like mget(), but without taking a reference, for callers that keep the
+  // mnode from being freed some other way. Returns null if the mnode isn't
+  // cached or isn't ready yet.
+  mnode* mpeek(u64 mnum);
   mlinkref alloc(u8 type, u64 parent_mnum = 0);
   sleeplock dir_rename_lock __mpalign__;
 };
@@ -163,18 +200,17 @@ public:
 
 class mdir : public mnode {
 private:
-  // ~32K cache
   mdir(mfs* fs, u64 mnum, u64 parent_mnum) : mnode(fs, mnum),
-      parent_mnum_(parent_mnum), map_(1367) {}
+      parent_mnum_(parent_mnum),
+      map_(MDIR_MIN_BUCKETS, MEMACCT_MDIR_BUCKETS) {}
   NEW_DELETE_OPS(mdir);
   friend class mnode;
   friend class mfs;
   u64 parent_mnum_;
 
-  // XXX We should deal with varying directory sizes better.  One way
-  // would be to make this a resizable hash table.  Linux uses a
-  // unified directory cache hash table, but that would make
-  // serializing a directory much harder for us.
+  // Starts small and grows with the directory.  Linux uses a unified
+  // directory cache hash table, but that would make serializing a
+  // directory much harder for us.
   chainhash<strbuf<DIRSIZ>, u64> map_;
 
 public:
@@ -189,6 +225,43 @@ public:
     return true;
   }
 
+  // Add a name found on the disk without creating the mnode that it refers
+  // to; lookup() creates it the first time the name is looked up. The
+  // mnode's link count only covers the names that refer to it this way
+  // once they have been looked up.
+  bool insert_unloaded(const strbuf<DIRSIZ>& name, u64 inum) {
+    return map_.insert(name, unloaded_mnum(inum));
+  }
+
+  // Make name, which maps to the unloaded entry, refer to mlink's mnode.
+  bool set_loaded(const strbuf<DIRSIZ>& name, u64 entry, mlinkref* mlink) {
+    if (!map_.replace(name, entry, mlink->mn()->mnum_))
+      return false;
+    assert(mlink->held());
+    mlink->mn()->nlink_.inc();
+    return true;
+  }
+
+  // The ".." of a subdirectory found on the disk holds a link to this
+  // directory, but the entry is only added once the subdirectory is looked
+  // up. load_dir() counts those links up front, so that the link count is
+  // right from the start, and insert_dotdot() then adds the entry without
+  // taking another link.
+  void count_subdir_links(u32 n) {
+    for (u32 i = 0; i < n; i++)
+      nlink_.inc();
+  }
+
+  bool insert_dotdot(u64 parent_mnum) {
+    return map_.insert(strbuf<DIRSIZ>(".."), parent_mnum);
+  }
+
+  // Drop an unloaded entry that turned out not to refer to a file or a
+  // directory.
+  bool remove_unloaded(const strbuf<DIRSIZ>& name, u64 entry) {
+    return map_.remove(name, entry);
+  }
+
   bool remove(const strbuf<DIRSIZ>& name, sref<mnode> m, u64 *tsc = NULL) {
     if (!map_.remove(name, m->mnum_, tsc))
       return false;
@@ -239,6 +312,17 @@ public:
     return map_.lookup(name);
   }
 
+  // Unlike lookup(), this can return an unloaded entry, which is never in
+  // the mnode cache.
+  bool lookup_mnum(const strbuf<DIRSIZ>& name, u64 *mnum) const {
+    if (name == ".") {
+      *mnum = mnum_;
+      return true;
+    }
+
+    return map_.lookup(name, mnum);
+  }
+
   sref<mnode> lookup(const strbuf<DIRSIZ>& name) const {
     if (name == ".")
       return fs_->mget(mnum_);
@@ -249,6 +333,11 @@ public:
       if (!map_.lookup(name, &mnum))
         return sref<mnode>();
 
+      if (is_unloaded(mnum)) {
+        rootfs_interface->load_dir_entry(fs_->mget(mnum_), name, mnum);
+        continue;
+      }
+
       sref<mnode> m = fs_->mget(mnum);
       if (m)
         return m;
@@ -330,6 +419,26 @@ public:
     return map_.enumerate(prev, name);
   }
 
+  // Return up to n of the entries after *prev (or from the start, if prev is
+  // null), in enumerate() order, with the mnode numbers they refer to.
+  size_t enumerate(const strbuf<DIRSIZ>* prev, strbuf<DIRSIZ>* names,
+                   u64* mnums, size_t n) const {
+    if (!n)
+      return 0;
+
+    size_t got = 0;
+    if (!prev) {
+      names[0] = ".";
+      mnums[0] = mnum_;
+      got = 1;
+    } else if (*prev == ".") {
+      prev = nullptr;
+    }
+
+    return got + map_.enumerate(got ? nullptr : prev, names + got,
+                                mnums + got, n - got);
+  }
+
   bool kill(sref<mnode> parent) {
     if (!map_.remove_and_kill("..", parent->mnum_))
       return false;
@@ -369,7 +478,10 @@ mnode::as_dir() const
 class mfile : public mnode {
 private:
   mfile(mfs* fs, u64 mnum, u64 parent_mnum) : mnode(fs, mnum),
-        parent_mnum_(parent_mnum), size_(0) {}
+        parent_mnum_(parent_mnum), resize_lock_("mfile::resize", LOCKSTAT_FS),
+        size_(0), trunc_size_(~0ull),
+        fsync_lock_("mfile::fsync", LOCKSTAT_FS), dj_cpu_(0), dj_enq_tsc_(0), append_end_(0), append_published_(0),
+        seq_ra_next_(0), seq_drop_next_(0) {}
   NEW_DELETE_OPS(mfile);
   friend class mnode;
   friend class mfs;
@@ -386,17 +498,21 @@ public:
       FLAG_DIRTY_PAGE = 1 << FLAG_DIRTY_PAGE_BIT,
       FLAG_VALID_BIT = 3,
       FLAG_VALID = 1 << FLAG_VALID_BIT,
+      // The page is being read in from the disk; lookups wait for it.
+      FLAG_LOADING_BIT = 4,
+      FLAG_LOADING = 1 << FLAG_LOADING_BIT,
+      FLAG_MASK = 0x1F,
     };
 
     /*
      * Low bits are flags, as above.  High bits are page_info pointer.
      */
     u64 value_;
-    static_assert((alignof(page_info) & 0xF) == 0,
-                  "page_info must be at least 16 byte aligned");
+    static_assert((alignof(page_info) & FLAG_MASK) == 0,
+                  "page_info must be at least 32 byte aligned");
 
     page_info* get_page_info_raw() const {
-      return (page_info*) (value_ & ~0xF);
+      return (page_info*) (value_ & ~FLAG_MASK);
     }
 
   public:
@@ -464,7 +580,17 @@ public:
     }
 
     void reset_page_info() {
-      value_ = value_ & 0xF;
+      value_ = value_ & FLAG_MASK;
+    }
+
+    bool has_page_info(const page_info *pi) const {
+      return get_page_info_raw() == pi;
+    }
+
+    void mark_referenced() {
+      page_info* pi = get_page_info_raw();
+      if (pi)
+        pi->mark_referenced();
     }
 
     bool is_valid() const {
@@ -507,6 +633,17 @@ public:
       else
         locked_reset_bit(FLAG_DIRTY_PAGE_BIT, &value_);
     }
+
+    bool is_loading() const {
+      return !!(value_ & FLAG_LOADING);
+    }
+
+    void set_loading(bool flag) {
+      if (flag)
+        locked_set_bit(FLAG_LOADING_BIT, &value_);
+      else
+        locked_reset_bit(FLAG_LOADING_BIT, &value_);
+    }
   };
 
 private:
@@ -518,9 +655,57 @@ private:
   seqcount<u32> size_seq_;
   u64 size_;
 
+  // The smallest size the file has been truncated to since it was last
+  // synced, or ~0. The disk blocks past it may still hold old data, which
+  // holes in the file mustn't show.
+  std::atomic<u64> trunc_size_;
+
   // Only one fsync can execute on the mnode at a time
   sleeplock fsync_lock_;
 
+  // The journal and enqueue timestamp of the last transaction that logged
+  // the file's data (see DATA_JOURNAL_MAX_PAGES), or 0. Its blocks mustn't be
+  // written in place until that is applied, or the apply would overwrite
+  // them with the older contents. Protected by fsync_lock_.
+  int dj_cpu_;
+  u64 dj_enq_tsc_;
+  void flush_journaled_data();
+  // sync_file() for compressed files (see SB_COMPRESS).
+  int sync_compressed_file(int cpu, bool datasync, u64 mlen);
+
+  // Appenders (see append()) reserve the bytes [s, s + n) by fetch-adding n
+  // to append_end_, and publish in reservation order: each waits for
+  // append_published_ to reach s and moves it on to s + n. The reservations
+  // only predict where the data lands; they stay right as long as nothing
+  // but appends changes the file's size.
+  std::atomic<u64> append_end_;
+  u64 append_published_;        // Protected by append_lock_
+  spinlock append_lock_;
+  condvar append_cv_;
+
+  // The pages that have gone from clean to dirty since sync_file() last
+  // collected them, so that it needn't look at the clean ones. A page may
+  // show up more than once, or after it has been cleaned or truncated;
+  // take_dirty_pages() sorts that out. Only kept for root_fs files.
+  spinlock dirty_list_lock_;
+  std::vector<u64> dirty_list_;
+
+  // For faults on MADV_SEQUENTIAL mappings (see sequential_fault()): the
+  // page whose fault starts the next readahead, and the first page that
+  // hasn't been dropped behind the reader yet. Faults only mark where the
+  // reader is; fault-around maps pages without faulting on them.
+  std::atomic<u64> seq_ra_next_;
+  std::atomic<u64> seq_drop_next_;
+  void note_dirty_page(u64 pageidx);
+  void take_dirty_pages(u64 first, u64 end, std::vector<u32> *pages);
+
+  typedef std::vector<std::pair<u64, sref<page_info>>> page_load_list;
+  sref<page_info> claim_page(u64 pageidx, bool readahead);
+  void claim_pages(u64 first, u64 npages, page_load_list *claimed);
+  bool claim_huge_span(u64 pageidx, page_load_list *claimed);
+  void load_pages(const page_load_list &claimed);
+  void wait_for_load(u64 pageidx);
+
 public:
   class resizer : public lock_guard<sleeplock>,
                   public seq_writer {
@@ -537,6 +722,8 @@ public:
     u64 read_size() { return mf_->size_; }
     void resize_nogrow(u64 size);
     void resize_append(u64 size, sref<page_info> pi);
+    void resize_append_holes(u64 size);
+    void resize_prealloc(u64 size);
     void initialize_from_disk(u64 size);
   };
 
@@ -548,12 +735,31 @@ public:
     return seq_reader<u64>(&size_, &size_seq_);
   }
 
-  page_state get_page(u64 pageidx);
+  enum class reclaim_result { gone, kept, evicted };
+
+  page_state get_page(u64 pageidx, u32 readahead_pages = 0);
+  u32 get_pages(u64 first, u32 npages, sref<page_info> *pis, bool *partial);
+  u32 set_pages_dirty(u64 first, u32 npages, const sref<page_info> *pis);
+  void read_ahead(u64 first, u32 npages);
+  void readahead_async(u64 first, u32 npages);
+  void sequential_fault(u64 pageidx);
   void put_page(u64 pageidx);
-  void set_page_dirty(u64 pageidx);
-  void sync_file(int cpu);
+  s64 append(const char *buf, u64 n, bool user, u64 *end);
+  reclaim_result reclaim_page(u64 pageidx, page_info *pi, bool evict);
+  bool set_page_dirty(u64 pageidx, page_info *pi);
+  bool unshare_zero_page(u64 pageidx);
+  sref<page_info> new_page(char *p);
+  int sync_file(int cpu, bool datasync = false, u64 start = 0,
+                u64 end = ~0ull);
+  // For O_DIRECT (see file_mnode::direct_io()): wait until the journal no
+  // longer holds copies of the file's data to apply (see
+  // DATA_JOURNAL_MAX_PAGES), and keep sync_file() from journaling more of
+  // them while the returned guard is held.
+  lock_guard<sleeplock> begin_direct_io();
+  int fallocate(int cpu, u64 off, u64 len, bool keep_size);
   void remove_pgtable_mappings(u64 start_offset);
   void drop_pagecache();
+  void uncount_dirty_pages();
 };
 
 inline mfile*
@@ -678,3 +884,20 @@ public:
     return "Blocking IO attempted while scheduler disabled";
   }
 };
+
+// Start the per-core readahead threads (see mnode.cc).
+void init_readahead(void);
+
+// Start the per-core writeback threads, and hold up writers while there are
+// too many dirty file pages (see mnode.cc).
+void init_writeback(void);
+void writeback_throttle(void);
+
+// The root_fs mnodes dirtied since the last sync() (see mnode.cc).
+void take_dirty_mnodes(std::vector<u64> *mnums);
+void requeue_dirty_mnode(u64 mnum);
+
+// The shared, read-only page of zeros that holes in files map to (see
+// mnode.cc).
+sref<page_info> pagecache_zero_page(void);
+bool is_zero_page(const page_info *pi);
@@ -1,10 +1,39 @@
 #pragma once
 
+// Offloads a netdev can do (see netdev::features())
+enum {
+  // Fill in the checksums described by a net_txcsum on transmit
+  NETDEV_TX_CSUM = 1 << 0,
+  // Check IPv4 and TCP/UDP checksums on receive, see NETRX_*
+  NETDEV_RX_CSUM = 1 << 1,
+};
+
+// What a device checked on a received packet, for netrx()
+enum {
+  NETRX_IP_CSUM_OK = 1 << 0,
+  NETRX_L4_CSUM_OK = 1 << 1,
+};
+
+// Checksums for the device to compute on transmit.  Offsets are in
+// bytes from the start of the frame.  The IPv4 header's checksum field
+// must be zero and the TCP/UDP one must hold the folded pseudo-header
+// sum.
+struct net_txcsum
+{
+  uint8_t ip_start;
+  uint8_t ip_end;               // Last byte of the IPv4 header
+  uint8_t l4_start;             // 0 if only the IPv4 header's
+  uint8_t l4_sum;               // Offset of the TCP/UDP checksum field
+};
+
 class netdev
 {
 public:
-  virtual int transmit(void *buf, uint32_t len) = 0;
+  // May queue buf without giving it to the device until flush()
+  virtual int transmit(void *buf, uint32_t len, const net_txcsum *csum) = 0;
+  virtual void flush() { }
   virtual void get_hwaddr(uint8_t *hwaddr) = 0;
+  virtual uint32_t features() { return 0; }
 };
 
 // For now, we only support one network device
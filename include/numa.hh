@@ -38,3 +38,9 @@ enum {
 };
 
 extern static_vector<numa_node, MAX_NUMA_NODES> numa_nodes;
+
+// Fill order[0..n-2] with the CPUs other than cpu, in the order cpu should
+// steal resources from them: first the CPUs on its own NUMA node, then the
+// rest.  Within each group the search starts just past cpu, so that
+// different CPUs don't all pick on the same victim.
+void numa_steal_order(int cpu, int *order, int n);
@@ -0,0 +1,133 @@
+#pragma once
+
+/*
+ * NVM Express registers and data structures (NVMe 1.2).
+ */
+
+struct nvme_reg {
+  u64 cap;		/* controller capabilities */
+  u32 vs;		/* version */
+  u32 intms;		/* interrupt mask set */
+  u32 intmc;		/* interrupt mask clear */
+  u32 cc;		/* controller configuration */
+  u32 reserved;
+  u32 csts;		/* controller status */
+  u32 nssr;		/* NVM subsystem reset */
+  u32 aqa;		/* admin queue attributes */
+  u64 asq;		/* admin submission queue base address */
+  u64 acq;		/* admin completion queue base address */
+} __attribute__((packed));
+
+#define NVME_CAP_MQES(cap)	((cap) & 0xffff)	 /* 0's based */
+#define NVME_CAP_TO(cap)	(((cap) >> 24) & 0xff)	 /* in 500 ms units */
+#define NVME_CAP_DSTRD(cap)	(((cap) >> 32) & 0xf)
+#define NVME_CAP_MPSMIN(cap)	(((cap) >> 48) & 0xf)
+
+#define NVME_CC_EN		(1 << 0)
+#define NVME_CC_CSS_NVM		(0 << 4)
+#define NVME_CC_MPS(shift)	(((shift) - 12) << 7)
+#define NVME_CC_AMS_RR		(0 << 11)
+#define NVME_CC_IOSQES(shift)	((shift) << 16)
+#define NVME_CC_IOCQES(shift)	((shift) << 20)
+
+#define NVME_CSTS_RDY		(1 << 0)
+#define NVME_CSTS_CFS		(1 << 1)
+
+/* Doorbells start at this offset, with a stride of (4 << CAP.DSTRD) bytes:
+ * the submission queue tail doorbell of queue y is doorbell 2y, and the
+ * completion queue head doorbell is doorbell 2y+1. */
+#define NVME_DOORBELL_BASE	0x1000
+
+/* Submission queue entry */
+struct nvme_cmd {
+  u8 opc;
+  u8 flags;
+  u16 cid;
+  u32 nsid;
+  u64 reserved;
+  u64 mptr;
+  u64 prp1;
+  u64 prp2;
+  u32 cdw10;
+  u32 cdw11;
+  u32 cdw12;
+  u32 cdw13;
+  u32 cdw14;
+  u32 cdw15;
+} __attribute__((packed));
+
+#define NVME_SQE_SHIFT		6
+static_assert(sizeof(nvme_cmd) == (1 << NVME_SQE_SHIFT), "Bad SQ entry size");
+
+/* Completion queue entry */
+struct nvme_cpl {
+  u32 dw0;		/* command specific */
+  u32 reserved;
+  u16 sqhd;		/* submission queue head pointer */
+  u16 sqid;
+  u16 cid;
+  u16 status;		/* bit 0 is the phase tag */
+} __attribute__((packed));
+
+#define NVME_CQE_SHIFT		4
+static_assert(sizeof(nvme_cpl) == (1 << NVME_CQE_SHIFT), "Bad CQ entry size");
+
+#define NVME_CPL_PHASE(st)	((st) & 1)
+#define NVME_CPL_STATUS(st)	(((st) >> 1) & 0x7fff)
+
+/* Admin command set */
+#define NVME_ADMIN_CREATE_SQ	0x01
+#define NVME_ADMIN_CREATE_CQ	0x05
+#define NVME_ADMIN_IDENTIFY	0x06
+#define NVME_ADMIN_SET_FEATURES	0x09
+
+#define NVME_QUEUE_PHYS_CONTIG	(1 << 0)
+#define NVME_CQ_IRQ_ENABLED	(1 << 1)
+
+#define NVME_IDENTIFY_NS	0x00
+#define NVME_IDENTIFY_CTRL	0x01
+
+#define NVME_FEAT_VWC		0x06	/* volatile write cache */
+#define NVME_FEAT_NUM_QUEUES	0x07
+
+/* NVM command set */
+#define NVME_CMD_FLUSH		0x00
+#define NVME_CMD_WRITE		0x01
+#define NVME_CMD_READ		0x02
+
+struct nvme_identify_ctrl {
+  u16 vid;
+  u16 ssvid;
+  char sn[20];
+  char mn[40];
+  char fr[8];
+  u8 rab;
+  u8 ieee[3];
+  u8 cmic;
+  u8 mdts;		/* max data transfer size, log2 of CAP.MPSMIN pages */
+  u8 reserved78[525 - 78];
+  u8 vwc;		/* bit 0: volatile write cache present */
+  u8 reserved526[4096 - 526];
+} __attribute__((packed));
+
+static_assert(sizeof(nvme_identify_ctrl) == 4096, "Bad identify size");
+
+struct nvme_lbaf {
+  u16 ms;		/* metadata size */
+  u8 lbads;		/* log2 of the LBA data size */
+  u8 rp;		/* relative performance */
+} __attribute__((packed));
+
+struct nvme_identify_ns {
+  u64 nsze;		/* namespace size, in LBAs */
+  u64 ncap;
+  u64 nuse;
+  u8 nsfeat;
+  u8 nlbaf;
+  u8 flbas;		/* bits 0-3: the LBA format in use */
+  u8 reserved27[128 - 27];
+  nvme_lbaf lbaf[16];
+  u8 reserved192[4096 - 192];
+} __attribute__((packed));
+
+static_assert(sizeof(nvme_identify_ns) == 4096, "Bad identify size");
@@ -0,0 +1,169 @@
+#pragma once
+
+// Typed per-CPU object caches.
+//
+// An objcache<T> keeps a magazine of free T-sized blocks on each core
+// in front of kmalloc, so a hot object that is allocated and freed on
+// the same core (say, on the commit path) skips the slab locks and
+// comes back cache-hot.  Classes opt in with NEW_DELETE_OPS_CACHED in
+// place of NEW_DELETE_OPS.
+//
+// With Ctor set, objects are cached constructed: get() returns a
+// default-constructed T the first time and whatever put() handed back
+// after that, and T is only destroyed when it falls out of the cache.
+// Such objects must be reset by their users, and are allocated with
+// get()/put() rather than new/delete.
+
+#include "cpputil.hh"
+#include "kernel.hh"
+#include "critical.hh"
+#include "percpu.hh"
+
+#include <atomic>
+#include <new>
+#include <type_traits>
+
+class objcache_base
+{
+public:
+  // Print the statistics of every objcache (for /dev/kmemstats).
+  static void print_all(print_stream *s);
+
+protected:
+  struct stats
+  {
+    u64 hits, misses, frees, spills;
+  };
+
+  struct magazine
+  {
+    void *obj[OBJCACHE_MAGAZINE];
+    u32 n;
+    stats st;
+  };
+
+  explicit objcache_base(const char *name) : name_(name)
+  {
+    next_ = all_.load(std::memory_order_relaxed);
+    while (!all_.compare_exchange_weak(next_, this))
+      ;
+  }
+
+  void print(print_stream *s) const;
+
+  const char *name_;
+  objcache_base *next_;
+  percpu<magazine, NO_INT> mags_;
+
+private:
+  static std::atomic<objcache_base*> all_;
+};
+
+template<class T, bool Ctor = false>
+class objcache : public objcache_base
+{
+public:
+  explicit objcache(const char *name) : objcache_base(name) { }
+
+  // The cache for T, created on first use.
+  static objcache &instance(const char *name)
+  {
+    static objcache cache(name);
+    return cache;
+  }
+
+  // Allocate a block for a T (uninitialized unless Ctor).
+  void *alloc_raw()
+  {
+    {
+      scoped_cli cli;
+      magazine *m = &*mags_;
+      if (m->n) {
+        m->st.hits++;
+        return m->obj[--m->n];
+      }
+      m->st.misses++;
+    }
+    void *p = kmalloc(sizeof(T), name_);
+    if (p)
+      construct(p, std::integral_constant<bool, Ctor>());
+    return p;
+  }
+
+  // Return a block obtained from alloc_raw().  A full magazine hands
+  // its older half back to kmalloc.
+  void free_raw(void *p)
+  {
+    void *spill[OBJCACHE_MAGAZINE / 2];
+    u32 nspill = 0;
+    {
+      scoped_cli cli;
+      magazine *m = &*mags_;
+      m->st.frees++;
+      if (m->n == OBJCACHE_MAGAZINE) {
+        nspill = OBJCACHE_MAGAZINE / 2;
+        memmove(spill, m->obj, sizeof(spill));
+        memmove(m->obj, m->obj + nspill, (m->n - nspill) * sizeof(void*));
+        m->n -= nspill;
+        m->st.spills += nspill;
+      }
+      m->obj[m->n++] = p;
+    }
+    for (u32 i = 0; i < nspill; i++) {
+      destroy(spill[i], std::integral_constant<bool, Ctor>());
+      kmfree(spill[i], sizeof(T));
+    }
+  }
+
+  // Constructed-object interface (Ctor only).
+  T *get()
+  {
+    static_assert(Ctor, "objcache::get requires constructor caching");
+    return static_cast<T*>(alloc_raw());
+  }
+
+  void put(T *obj)
+  {
+    static_assert(Ctor, "objcache::put requires constructor caching");
+    free_raw(obj);
+  }
+
+private:
+  static void construct(void *p, std::true_type) { ::new (p) T(); }
+  static void construct(void *p, std::false_type) { }
+  static void destroy(void *p, std::true_type) { static_cast<T*>(p)->~T(); }
+  static void destroy(void *p, std::false_type) { }
+};
+
+// Like NEW_DELETE_OPS, but allocate through classname's objcache.
+#define NEW_DELETE_OPS_CACHED(classname)                            \
+  static objcache<classname> &objcache_() {                         \
+    return objcache<classname>::instance(#classname);               \
+  }                                                                 \
+                                                                    \
+  static void* operator new(unsigned long nbytes,                   \
+                            const std::nothrow_t&) noexcept {       \
+    assert(nbytes == sizeof(classname));                            \
+    return objcache_().alloc_raw();                                 \
+  }                                                                 \
+                                                                    \
+  static void* operator new(unsigned long nbytes) {                 \
+    void *p = classname::operator new(nbytes, std::nothrow);        \
+    if (p == nullptr)                                               \
+      throw_bad_alloc();                                            \
+    return p;                                                       \
+  }                                                                 \
+                                                                    \
+  static void* operator new(unsigned long nbytes, classname *buf) { \
+    assert(nbytes == sizeof(classname));                            \
+    return buf;                                                     \
+  }                                                                 \
+                                                                    \
+  static void operator delete(void *p,                              \
+                              const std::nothrow_t&) noexcept {     \
+    objcache_().free_raw(p);                                        \
+  }                                                                 \
+                                                                    \
+  static void operator delete(void *p) {                            \
+    classname::operator delete(p, std::nothrow);                    \
+  }
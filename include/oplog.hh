@@ -8,6 +8,8 @@
 #include "cpuid.hh"
 #include "sleeplock.hh"
 #include "lockwrap.hh"
+#include "kstats.hh"
+#include "memacct.hh"
 
 #include <atomic>
 #include <cstdint>
@@ -22,7 +24,11 @@
 // operations when a read needs to observe the object's state.
 namespace oplog {
   enum {
-    CACHE_SLOTS = 4096
+    CACHE_SLOTS = 4096,
+    // Each object can be cached in any of the CACHE_WAYS ways of one
+    // set, so a few objects that hash alike don't evict each other.
+    CACHE_WAYS = 4,
+    CACHE_SETS = CACHE_SLOTS / CACHE_WAYS,
   };
 
   // A base class for objects whose modification operations are logged
@@ -40,13 +46,16 @@ namespace oplog {
   // @c logged_object takes care of making this memory-efficient:
   // rather than simply keeping per-CPU logs for every object, it
   // maintains a fixed size cache of logs per CPU so that only
-  // recently modified objects are likely to have logs.
+  // recently modified objects are likely to have logs.  The cache is
+  // set-associative with LRU replacement.  In the background, each
+  // CPU's reclaimer flushes long logs out of its cache (see
+  // flush_long_logs), but only once that cache has had conflicts.
   //
   // @tparam Logger A class that logs operations to be applied to the
   // object later.  This is the type returned by get_logger.  There
   // may be many Logger instances created per logged_object.  Logger
-  // must have a default constructor, but there are no other
-  // requirements.
+  // must have a default constructor and a size() method returning
+  // roughly how many operations it holds.
   template<typename Logger>
   class logged_object
   {
@@ -100,57 +109,84 @@ namespace oplog {
     locked_logger get_logger(int cpu)
     {
       auto id = cpu;
-      auto my_way = cache_[id].hash_way(this);
-    back_out:
-      auto guard = my_way->lock_.guard();
-      auto cur_obj = my_way->obj_.load(std::memory_order_relaxed);
-
-      if (cur_obj != this) {
-        if (cur_obj) {
-          // Evict this logger.  In the unlikely event of a race
-          // between this and synchronize, we may deadlock here if we
-          // simply acquire cur_obj's sync lock.  Hence, we perform
-          // deadlock avoidance.
-	  // (Furthermore, since the sync lock can be a sleeplock, while
-	  // way->lock_ is a spinlock, we can't actually afford to sleep on
-	  // contention here; if we did, it would lead to "sleeping inside
-	  // atomic section" bug).
-          lock_guard<spinlock> sync_spin_guard;
-          lock_guard<sleeplock> sync_sleep_guard;
-
-          if (cur_obj->use_sleeplock_) {
-            sync_sleep_guard = cur_obj->sync_sleeplock_.try_guard();
-            if (!sync_sleep_guard)
-              // We would deadlock with synchronize; back out.
-              goto back_out;
-          } else {
-            sync_spin_guard = cur_obj->sync_spinlock_.try_guard();
-            if (!sync_spin_guard)
-              // We would deadlock with synchronize; back out.
-              goto back_out;
+      auto &c = cache_[id];
+      auto my_set = c.hash_set(this);
+      for (;;) {
+        // Way tags only change under the way's lock, so a hit needs
+        // only that lock.
+        if (auto my_way = my_set->find(this)) {
+          auto guard = my_way->lock_.guard();
+          if (my_way->obj_.load(std::memory_order_relaxed) == this) {
+            assert(cpus_[id]);
+            my_set->touch(my_way);
+            kstats::inc(&kstats::oplog_hit_count);
+            return locked_logger(std::move(guard), &my_way->logger_);
           }
+          // Evicted before we got the lock
+          continue;
+        }
 
-          // XXX Since we don't do a full synchronize here, we lose
-          // some of the potential memory overhead benefits of the
-          // logger cache for ordered loggers like tsc_logged_object.
-          // These have to keep around all operations anyway until
-          // someone calls synchronize.  We could keep track of this
-          // object in the locked_logger and call synchronize when it
-          // gets released.
-          cur_obj->flush_logger(&my_way->logger_);
-          cur_obj->cpus_.atomic_reset(id);
+        // Choosing a way and tagging it is serialized by the set's
+        // lock, so an object is never cached in two ways of a set.
+        auto set_guard = my_set->lock_.guard();
+        if (my_set->find(this))
+          continue;
+        auto my_way = my_set->victim();
+        auto guard = my_way->lock_.guard();
+        if (my_way->obj_.load(std::memory_order_relaxed)) {
+          if (!evict(my_way, id))
+            // We would deadlock with synchronize; back out.
+            continue;
+          c.nconflicts_.store(c.nconflicts_.load(std::memory_order_relaxed) + 1,
+                              std::memory_order_relaxed);
+          kstats::inc(&kstats::oplog_conflict_flush_count);
         }
         // Put this object in this way's tag
         my_way->obj_.store(this, std::memory_order_relaxed);
-      } else {
-        assert(cpus_[id]);
+        my_set->touch(my_way);
+        kstats::inc(&kstats::oplog_miss_count);
+
+        if (!cpus_[id])
+          cpus_.atomic_set(id);
+        return locked_logger(std::move(guard), &my_way->logger_);
       }
+    }
 
-      if (!cpus_[id])
-        cpus_.atomic_set(id);
-      return locked_logger(std::move(guard), &my_way->logger_);
+  public:
+    // Flush the loggers in CPU cpu's cache that hold at least min_ops
+    // operations back to their objects, if the cache has had any
+    // conflicts since the last call.  This keeps long logs from
+    // occupying ways that other objects keep conflicting over, and
+    // leaves the objects' synchronize less to gather.  Returns the
+    // number of loggers flushed.
+    static size_t flush_long_logs(int cpu, size_t min_ops)
+    {
+      auto &c = cache_[cpu];
+      if (!c.nconflicts_.exchange(0, std::memory_order_relaxed))
+        return 0;
+      size_t n = 0;
+      for (auto &s : c.sets_) {
+        for (auto &w : s.ways_) {
+          if (!w.obj_.load(std::memory_order_relaxed) ||
+              w.logger_.size() < min_ops)
+            continue;
+          auto guard = w.lock_.guard();
+          if (!w.obj_.load(std::memory_order_relaxed) ||
+              w.logger_.size() < min_ops)
+            continue;
+          // Skip objects that are busy synchronizing.
+          if (evict(&w, cpu)) {
+            w.obj_.store(nullptr, std::memory_order_relaxed);
+            n++;
+          }
+        }
+      }
+      kstats::inc(&kstats::oplog_background_flush_count, (u64)n);
+      return n;
     }
 
+  protected:
+
     // This is a helper function; do not call it directly. Use
     // synchronize_with_spinlock() or synchronize_with_sleeplock() instead.
     void __synchronize()
@@ -167,9 +203,7 @@ namespace oplog {
         bool any = false;
         // Gather loggers
         for (auto cpu : cpus_) {
-          // XXX Is the optimizer smart enough to lift the hash
-          // computation?
-          auto way = cache_[cpu].hash_way(this);
+          auto way = cached_way(cpu);
           auto way_guard = way->lock_.guard();
           auto cur_obj = way->obj_.load(std::memory_order_relaxed);
           assert(cur_obj == this);
@@ -228,26 +262,117 @@ namespace oplog {
     {
       std::atomic<logged_object*> obj_;
       spinlock lock_;
+      // The set's clock_ as of the last use of this way
+      std::atomic<u32> used_;
       Logger logger_;
     };
 
+    struct set
+    {
+      // Serializes choosing a way for an object and tagging it
+      spinlock lock_;
+      // Ticks on every use of a way.  Updated without a lock, so
+      // racing uses may lose ticks; that only blurs the LRU order.
+      std::atomic<u32> clock_;
+      way ways_[CACHE_WAYS];
+
+      way *find(logged_object *obj)
+      {
+        for (auto &w : ways_)
+          if (w.obj_.load(std::memory_order_relaxed) == obj)
+            return &w;
+        return nullptr;
+      }
+
+      void touch(way *w)
+      {
+        u32 now = clock_.load(std::memory_order_relaxed) + 1;
+        clock_.store(now, std::memory_order_relaxed);
+        w->used_.store(now, std::memory_order_relaxed);
+      }
+
+      // An empty way, or else the least recently used one.
+      way *victim()
+      {
+        way *best = &ways_[0];
+        u32 now = clock_.load(std::memory_order_relaxed);
+        for (auto &w : ways_) {
+          if (!w.obj_.load(std::memory_order_relaxed))
+            return &w;
+          if (now - w.used_.load(std::memory_order_relaxed) >
+              now - best->used_.load(std::memory_order_relaxed))
+            best = &w;
+        }
+        return best;
+      }
+    };
+
     struct cache
     {
-      way ways_[CACHE_SLOTS];
+      set sets_[CACHE_SETS];
+      // Conflict evictions since the last flush_long_logs
+      std::atomic<u64> nconflicts_;
 
-      way *hash_way(logged_object *obj) const
+      set *hash_set(logged_object *obj)
       {
         // Hash based on Java's HashMap re-hashing function.
-        uint64_t wayno = (uintptr_t)obj;
-        wayno ^= (wayno >> 32) ^ (wayno >> 20) ^ (wayno >> 12);
-        wayno ^= (wayno >> 7) ^ (wayno >> 4);
-        wayno %= CACHE_SLOTS;
-        return const_cast<way *>(&ways_[wayno]);
-        //return &ways_[wayno];
+        uint64_t setno = (uintptr_t)obj;
+        setno ^= (setno >> 32) ^ (setno >> 20) ^ (setno >> 12);
+        setno ^= (setno >> 7) ^ (setno >> 4);
+        setno %= CACHE_SETS;
+        return &sets_[setno];
       }
     };
 
+    // Flush w's logger to the object tagged in it and take the object
+    // off CPU cpu.  The caller must hold w->lock_.  Returns false
+    // without doing anything if the object's sync lock is busy.
+    static bool evict(way *w, int cpu)
+    {
+      auto cur_obj = w->obj_.load(std::memory_order_relaxed);
+      // In the unlikely event of a race between this and synchronize,
+      // we may deadlock here if we simply acquire cur_obj's sync lock.
+      // Hence, we perform deadlock avoidance.
+      // (Furthermore, since the sync lock can be a sleeplock, while
+      // way->lock_ is a spinlock, we can't actually afford to sleep on
+      // contention here; if we did, it would lead to "sleeping inside
+      // atomic section" bug).
+      lock_guard<spinlock> sync_spin_guard;
+      lock_guard<sleeplock> sync_sleep_guard;
+
+      if (cur_obj->use_sleeplock_) {
+        sync_sleep_guard = cur_obj->sync_sleeplock_.try_guard();
+        if (!sync_sleep_guard)
+          return false;
+      } else {
+        sync_spin_guard = cur_obj->sync_spinlock_.try_guard();
+        if (!sync_spin_guard)
+          return false;
+      }
+
+      // XXX Since we don't do a full synchronize here, we lose
+      // some of the potential memory overhead benefits of the
+      // logger cache for ordered loggers like tsc_logged_object.
+      // These have to keep around all operations anyway until
+      // someone calls synchronize.  We could keep track of this
+      // object in the locked_logger and call synchronize when it
+      // gets released.
+      cur_obj->flush_logger(&w->logger_);
+      cur_obj->cpus_.atomic_reset(cpu);
+      return true;
+    }
+
   protected:
+    // The way caching this object's logger on CPU cpu.  The caller
+    // must hold the sync lock and have seen cpu in cpus_, so the
+    // object can't be evicted or move.
+    way *cached_way(int cpu)
+    {
+      way *w = cache_[cpu].hash_set(this)->find(this);
+      assert(w);
+      return w;
+    }
+
     // Per-type, per-CPU, per-object logger.  The per-CPU part of this
     // is unprotected because we lock internally.
     static percpu<cache, NO_CRITICAL> cache_;
@@ -294,8 +419,14 @@ namespace oplog {
       CB cb_;
     public:
       NEW_DELETE_OPS(op_inst);
-      op_inst(uint64_t tsc, CB &&cb) : op(tsc), cb_(cb) { }
-      ~op_inst() { }
+      op_inst(uint64_t tsc, CB &&cb) : op(tsc), cb_(cb)
+      {
+        memacct_add(MEMACCT_OPLOG_OPS, 1, sizeof(*this));
+      }
+      ~op_inst()
+      {
+        memacct_add(MEMACCT_OPLOG_OPS, -1, -(s64)sizeof(*this));
+      }
 
       void run() override
       {
@@ -324,6 +455,11 @@ namespace oplog {
     tsc_logger(tsc_logger &&o) = default;
     tsc_logger &operator=(tsc_logger &&o) = default;
 
+    size_t size() const
+    {
+      return ops_.size();
+    }
+
     // Log the operation cb, which must be a callable.  cb will be
     // called with no arguments when the logs need to be
     // synchronized.
@@ -361,7 +497,9 @@ namespace oplog {
     }
 
     void sort_ops() {
-      std::sort(ops_.begin(), ops_.end(), compare_tsc);
+      // Operations are nearly always logged in timestamp order already.
+      if (!std::is_sorted(ops_.begin(), ops_.end(), compare_tsc))
+        std::sort(ops_.begin(), ops_.end(), compare_tsc);
     }
     
     void print_ops() {
@@ -370,13 +508,13 @@ namespace oplog {
     }
 
     // Returns an iterator 'it' where all operations in [ops_.begin(),
-    // it) have timestamps less than or equal to max_tsc.
+    // it) have timestamps less than or equal to max_tsc. The operations
+    // must be sorted.
     op_iter ops_before_max_tsc(u64 max_tsc) {
-      auto it = ops_.begin(), end = ops_.end();
-      for (; it != end; it++)
-        if ((*it)->tsc > max_tsc)
-          break;
-      return it;
+      return std::upper_bound(ops_.begin(), ops_.end(), max_tsc,
+                              [](u64 tsc, const std::unique_ptr<op> &o) {
+                                return tsc < o->tsc;
+                              });
     }
   };
 
@@ -405,9 +543,7 @@ namespace oplog {
         bool any = false;
         // Gather loggers
         for (auto cpu : cpus_) {
-          // XXX Is the optimizer smart enough to lift the hash
-          // computation?
-          auto way = cache_[cpu].hash_way(this);
+          auto way = cached_way(cpu);
           auto way_guard = way->lock_.guard();
           auto cur_obj = way->obj_.load(std::memory_order_relaxed);
           assert(cur_obj == this);
@@ -515,7 +651,10 @@ namespace oplog {
     u64 synced_upto_tsc;
 
     // Heap-merges pending loggers and applies the operations, leaving behind
-    // operations that have timestamps greater than max_tsc.
+    // operations that have timestamps greater than max_tsc. Each operation is
+    // run and freed as soon as it comes off the merge, rather than being
+    // collected into a merged copy of the log first; a single logger (the
+    // common case for an object written from one core) isn't merged at all.
     void flush_finish_max_timestamp(u64 max_tsc) {
       if (pending_.empty())
         return;
@@ -525,7 +664,6 @@ namespace oplog {
         tsc_logger *logger;
       };
       std::vector<pos> posns;
-      std::vector<std::unique_ptr<tsc_logger::op> > merged_ops;
       for(auto &logger : pending_) {
         logger.sort_ops();
         auto end = logger.ops_before_max_tsc(max_tsc);
@@ -536,27 +674,33 @@ namespace oplog {
       if (posns.empty())
         return;
 
-      // Merge the operations using a heap of indices into posns
-      auto compare = [&](size_t a, size_t b) -> bool {
-        return (*posns[a].next)->tsc > (*posns[b].next)->tsc;
+      u64 last_tsc = synced_upto_tsc;
+      auto run = [&](std::unique_ptr<tsc_logger::op> &op) {
+        assert(op->tsc >= last_tsc);
+        last_tsc = op->tsc;
+        op->run();
+        op.reset();
       };
-      std::priority_queue<size_t, std::vector<size_t>, decltype(compare)> heap(
-        compare, seq_vector(posns.size()));
-      while (!heap.empty()) {
-        auto top = heap.top();
-        merged_ops.push_back(std::move(*posns[top].next));
-        ++posns[top].next;
-        heap.pop();
-        if (posns[top].next != posns[top].end)
-          heap.push(top);
-      }
-      assert(std::is_sorted(merged_ops.begin(), merged_ops.end(),
-                            tsc_logger::compare_tsc));
 
-      assert(merged_ops.front()->tsc >= synced_upto_tsc);
+      if (posns.size() == 1) {
+        for (auto it = posns[0].next; it != posns[0].end; ++it)
+          run(*it);
+      } else {
+        // Merge the operations using a heap of indices into posns
+        auto compare = [&](size_t a, size_t b) -> bool {
+          return (*posns[a].next)->tsc > (*posns[b].next)->tsc;
+        };
+        std::priority_queue<size_t, std::vector<size_t>, decltype(compare)> heap(
+          compare, seq_vector(posns.size()));
+        while (!heap.empty()) {
+          auto top = heap.top();
+          heap.pop();
+          run(*posns[top].next);
+          if (++posns[top].next != posns[top].end)
+            heap.push(top);
+        }
+      }
 
-      for(auto &op : merged_ops)
-        op->run();
       for(auto &pos : posns)
         pos.logger->ops_.erase(pos.logger->ops_.begin(), pos.end);
 
@@ -635,7 +779,7 @@ namespace oplog {
         bool any = false;
         // Gather loggers
         for (auto cpu : cpus_) {
-          auto way = cache_[cpu].hash_way(this);
+          auto way = cached_way(cpu);
           auto way_guard = way->lock_.guard();
           auto cur_obj = way->obj_.load(std::memory_order_relaxed);
           assert(cur_obj == this);
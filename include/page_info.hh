@@ -6,8 +6,10 @@
 #include "gc.hh"
 #include "types.h"
 #include "oplog.hh"
+#include "memacct.hh"
 
 #include <cstddef>
+#include <atomic>
 #include <vector>
 
 using namespace oplog;
@@ -24,6 +26,10 @@ struct alloc_debug_info
   const void *kmalloc_rip() const { return kmalloc_rip_; }
   void set_newarr_rip(const void *newarr_rip) { newarr_rip_ = newarr_rip; }
   const void *newarr_rip() const { return newarr_rip_; }
+  // nsectime() of allocation
+  u64 alloc_time_;
+  void set_alloc_time(u64 t) { alloc_time_ = t; }
+  u64 alloc_time() const { return alloc_time_; }
 #else
   void set_kalloc_rip(const void *kalloc_rip) { }
   const void *kalloc_rip() const { return nullptr; }
@@ -31,6 +37,8 @@ struct alloc_debug_info
   const void *kmalloc_rip() const { return nullptr; }
   void set_newarr_rip(const void *newarr_rip) { }
   const void *newarr_rip() const { return nullptr; }
+  void set_alloc_time(u64 t) { }
+  u64 alloc_time() const { return 0; }
 #endif
 
   static size_t expand_size(size_t size);
@@ -65,6 +73,7 @@ class page_info : public PAGE_REFCOUNT referenced, public alloc_debug_info
 protected:
   void onzero()
   {
+    memacct_add(memacct_, -1, -PGSIZE);
     this->~page_info();
     kfree(va());
   }
@@ -133,8 +142,15 @@ public:
         get_logger(myid())->push<rem_op>(rem_op(this, map));
       }
 
+      // Move the entries out into vec.  Into an empty vec this just
+      // swaps the vectors, so even a page that hundreds of vmaps map
+      // costs no allocation or copying here.
       void sync(std::vector<rmap_entry> &vec) {
         auto guard = synchronize_with_spinlock();
+        if (vec.empty()) {
+          vec.swap(rmap_vec);
+          return;
+        }
         for (auto it = rmap_vec.begin(); it != rmap_vec.end(); it++)
           vec.emplace_back(*it);
         rmap_vec.clear();
@@ -148,7 +164,8 @@ public:
       std::vector<rmap_entry> rmap_vec;
   };
 
-  page_info() {
+  page_info() : referenced_(false), memacct_(MEMACCT_NONE), pinned_(0),
+                dirty_chunks_(0) {
     rmap_pte = new rmap(false); // use_sleeplock = false.
     for (int cpu = 0; cpu < NCPU; cpu++)
       outstanding_ops[cpu] = 0;
@@ -224,8 +241,8 @@ public:
     outstanding_ops[cpu]++;
   }
 
-  // Synchronizes the oplog-maintained rmap and returns the <vmap, vaddr> pairs
-  // that have this page mapped.
+  // Synchronizes the oplog-maintained rmap and moves the <vmap, vaddr> pairs
+  // that have this page mapped out of it, appending them to vec.
   void get_rmap_vector(std::vector<rmap_entry> &vec) {
     assert(rmap_pte);
     int cpu = myid();
@@ -233,9 +250,52 @@ public:
     outstanding_ops[cpu] = 0;
   }
 
+  // The page cache sets the referenced bit on every lookup of a file page,
+  // and the page-cache reclaimer clears it as its CLOCK hand passes, only
+  // evicting pages that haven't been looked up since the last pass.
+  void mark_referenced() {
+    if (!referenced_)
+      referenced_ = true;
+  }
+
+  bool test_and_clear_referenced() {
+    if (!referenced_)
+      return false;
+    referenced_ = false;
+    return true;
+  }
+
+  // mlock() pins the page-cache pages it covers, which page-cache
+  // reclaim and eviction then leave in memory until they are unpinned.
+  void pin() { pinned_++; }
+  void unpin() { assert(pinned_); pinned_--; }
+  bool is_pinned() const { return pinned_.load(std::memory_order_relaxed); }
+
+  // The chunks (see TXN_CHUNK_SIZE) of a file page written since it was
+  // last synced, so that the sync can log just those in the journal (see
+  // DATA_JOURNAL_MAX_PAGES).
+  void note_dirty_chunks(u64 mask) {
+    if ((dirty_chunks_ & mask) != mask)
+      dirty_chunks_ |= mask;
+  }
+
+  u64 take_dirty_chunks() {
+    return dirty_chunks_.exchange(0);
+  }
+
+  // Count the page as memory of kind (see memacct.hh) until it is freed.
+  void set_memacct(u8 kind) {
+    memacct_ = kind;
+    memacct_add(kind, 1, PGSIZE);
+  }
+
 private:
   rmap *rmap_pte;
   percpu<u64> outstanding_ops;
+  bool referenced_;
+  u8 memacct_;
+  std::atomic<u32> pinned_;
+  std::atomic<u64> dirty_chunks_;
 
-} __attribute__((aligned(16)));
+} __attribute__((aligned(32)));
 
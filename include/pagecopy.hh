@@ -0,0 +1,37 @@
+#pragma once
+
+// Whole-page copy and zero primitives, picked for the CPU at boot by
+// initpagecopy(): ERMS "rep movsb" and "rep stosb" where CPUID says they
+// are fast, "rep movsq" and "rep stosq" elsewhere.  pagecopy_nt() copies
+// with non-temporal stores instead, for pages that only a device will
+// read, such as journal blocks on their way to the disk, so that they
+// don't push what the CPU is working on out of its caches.
+//
+// The kernel is built without SSE and doesn't save the vector registers
+// on entry, so there are no AVX variants; saving and restoring the
+// state for each 4KB copy would cost more than it gains.  The pages
+// need not be aligned, but the copies are fastest when they are.
+
+enum pagecopy_variant {
+  PAGECOPY_MOVSQ,
+  PAGECOPY_MOVSB,
+  PAGECOPY_UNROLLED,
+  PAGECOPY_NT,
+  PAGECOPY_NVARIANTS,
+};
+
+extern "C" {
+void pagecopy_movsq(void *dst, const void *src);
+void pagecopy_movsb(void *dst, const void *src);
+void pagecopy_unrolled(void *dst, const void *src);
+void pagecopy_nt(void *dst, const void *src);
+void pagezero_stosq(void *dst);
+void pagezero_stosb(void *dst);
+void zpage(void *dst);
+void zpage_nc(void *dst);
+}
+
+// Copy the PGSIZE bytes at src to dst, which must not overlap.
+extern void (*pagecopy)(void *dst, const void *src);
+// Zero the PGSIZE bytes at dst.
+extern void (*pagezero)(void *dst);
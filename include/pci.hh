@@ -37,7 +37,8 @@ void pci_register_class_driver(u32 class_id, u32 subclass_id,
                                int (*attachfn)(struct pci_func *pcif));
 
 void pci_func_enable(struct pci_func *f);
-irq pci_map_msi_irq(struct pci_func *f);
+// Route the function's MSI to the given CPU.
+irq pci_map_msi_irq(struct pci_func *f, int cpu = 0);
 
 u32 pci_conf_read(u32 seg, u32 bus, u32 dev, u32 func, u32 offset, int width);
 void pci_conf_write(u32 seg, u32 bus, u32 dev, u32 func, u32 offset,
@@ -69,9 +69,15 @@ struct sys_stat {
     that = new sys_stat();    
     for (int i = 0; i < NCPU; i++) {
       that->stats[i].enqs = stats[i].enqs - o->stats[i].enqs;
+      that->stats[i].remote_enqs =
+        stats[i].remote_enqs - o->stats[i].remote_enqs;
       that->stats[i].deqs = stats[i].deqs - o->stats[i].deqs;
       that->stats[i].steals = stats[i].steals - o->stats[i].steals;
+      that->stats[i].remote_steals =
+        stats[i].remote_steals - o->stats[i].remote_steals;
       that->stats[i].misses = stats[i].misses - o->stats[i].misses;
+      that->stats[i].steal_fails =
+        stats[i].steal_fails - o->stats[i].steal_fails;
       that->stats[i].idle = stats[i].idle - o->stats[i].idle;
       that->stats[i].busy = stats[i].busy - o->stats[i].busy;
     }
@@ -85,6 +85,12 @@ struct proc {
   struct gc_handle *gc;
   char lockname[16];
   int cpu_pin;
+  // The core whose per-core FS resources (journal, block and inode
+  // allocators) the proc uses, or -1 until its first FS operation
+  // makes that the current core.  Unless home_set_, the home follows
+  // the proc when it's pinned or stolen.
+  int home_cpu;
+  bool home_set_;
 #if MTRACE
   struct mtrace_stacks mtrace_stacks;
 #endif
@@ -92,7 +98,9 @@ struct proc {
   u64 cv_wakeup;               // Wakeup time for this process
   ilink<proc> cv_waiters;      // Linked list of processes waiting for oncv
   ilink<proc> cv_sleep;        // Linked list of processes sleeping on a cv
-  struct spinlock futex_lock;
+  ilink<proc> futex_link;      // Wait list of the futex bucket
+  std::atomic<u64*> futex_key; // Futex waited on, or null once woken
+  u64 futex_bitset;            // Wakes this waiter accepts
   u64 user_fs_;
   u64 unmap_tlbreq_;
   int data_cpuid;              // Where vmap and kstack is likely to be cached
@@ -100,6 +108,8 @@ struct proc {
   int in_exec_;
   int uaccess_;
   bool yield_;                 // yield cpu up when returning to user space
+  u8 disk_tag;                 // Tag of the disk I/O it issues (see disktrace.h)
+  u16 cur_syscall;             // Number of the syscall it is in, or 0
 
   userptr_str upath;
   userptr<userptr_str> uargv;
@@ -116,12 +126,14 @@ struct proc {
   void         set_state(procstate_t s);
   procstate_t  get_state(void) const { return state_; }
   int          set_cpu_pin(int cpu);
+  int          set_home(int cpu);
   static int   kill(int pid);
   int          kill();
   bool         cansteal(bool nonexec) {
     return (get_state() == RUNNABLE && !cpu_pin && 
           (in_exec_ || nonexec) &&
-          curcycles != 0 && curcycles > VICTIMAGE);
+          curcycles != 0 &&
+          curcycles > ((int)cpuid == home_cpu ? HOME_VICTIMAGE : VICTIMAGE));
   };
 
 
@@ -883,6 +883,30 @@ public:
     return true;
   }
 
+  /**
+   * Call <tt>cb(index, span, value)</tt> for each set value in
+   * <tt>[low, high)</tt>, in index order.  A value is passed once for
+   * each run of indexes that share it: @c span is 1 for an individual
+   * value, and the part of the run that lies in <tt>[low, high)</tt>
+   * for a compressed range.
+   *
+   * This walks the tree node by node, skipping unset subtrees without
+   * visiting them and prefetching each node before it is needed,
+   * rather than looking up every index from the root.  The same
+   * concurrency rules apply as for iterators.  @c cb may modify
+   * values in place, but must not modify the shape of the array
+   * (e.g., by filling or unsetting part of a compressed range).
+   */
+  template<class CB>
+  void
+  for_each_set(size_type low, size_type high, CB cb)
+  {
+    if (high > N)
+      high = N;
+    if (low < high)
+      visit_set(get_root_ptr(), LEVELS, 0, low, high, cb);
+  }
+
   /**
    * Copy-assign all values in the range <tt>[low, high)</tt> to @c x.
    *
@@ -1426,4 +1450,58 @@ private:
   {
     return node_ptr(reinterpret_cast<upper_node*>(&root_), false);
   }
+
+  /**
+   * Implement #for_each_set() for the node @c np at @c level, whose
+   * first child starts at key @c base.
+   */
+  template<class CB>
+  void
+  visit_set(node_ptr np, unsigned level, key_type base, key_type low,
+            key_type high, CB &cb)
+  {
+    if (level == 0) {
+      leaf_node *leaf = np.as_leaf_node();
+      key_type k = low > base ? low : base;
+      key_type end = high < base + LEAF_FANOUT ? high : base + LEAF_FANOUT;
+      for (; k < end; ++k) {
+        auto &v = leaf->child[k - base];
+        if (v.is_set())
+          cb((size_type)k, (size_type)1, v);
+      }
+      return;
+    }
+
+    upper_node *node = np.as_upper_node();
+    key_type span = level_span(level);
+    std::size_t i = low > base ? (low - base) / span : 0;
+    node_ptr c(node->child[i]);
+    for (key_type cbase = base + i * span; cbase < high;
+         cbase += span, ++i) {
+      // Start fetching the next child while we visit this one.  The
+      // root only has one child, and neither it nor the top node has
+      // children past N, so stop at high.
+      node_ptr next;
+      if (cbase + span < high) {
+        next = node_ptr(node->child[i + 1]);
+        if (!next.is_null())
+          __builtin_prefetch(reinterpret_cast<void*>(next.v & ~node_ptr::mask));
+      }
+
+      switch (c.get_type()) {
+      case node_ptr::NONE:
+        break;
+      case node_ptr::EXTERNAL: {
+        key_type s = low > cbase ? low : cbase;
+        key_type e = high < cbase + span ? high : cbase + span;
+        cb((size_type)s, (size_type)(e - s), *c.as_external());
+        break;
+      }
+      default:
+        visit_set(c, level - 1, cbase, low, high, cb);
+        break;
+      }
+      c = next;
+    }
+  }
 };
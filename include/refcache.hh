@@ -168,11 +168,26 @@
 
 namespace refcache {
   enum {
-    CACHE_SLOTS = 4096
+    CACHE_SLOTS = 4096,
+    // Ways per set.  An object's delta may be cached in any way of the
+    // set it hashes to.  Must be 1, 2 or 4 (see cache::lru_).
+    CACHE_WAYS = 4,
+    CACHE_SETS = CACHE_SLOTS / CACHE_WAYS,
   };
 
   template<class T> class weakref;
 
+  // Advance every core through enough epochs, by IPI, that everything
+  // that was on a review list when this was called gets reviewed (and
+  // freed if its count stayed zero).  This flushes every core's delta
+  // cache three times.  Must be called from a thread with interrupts
+  // enabled and no spinlocks held.
+  void expedite();
+
+  // Ask the expediter thread to call expedite() soon.  Safe to call
+  // with interrupts disabled or spinlocks held.
+  void request_expedite();
+
   // Base class for an object that's reference counted using the
   // refcaching scheme.
   class referenced
@@ -384,6 +399,15 @@ namespace refcache {
     // Convert this weak reference into a regular reference.  If the
     // pointed-to object has been collected, this will return sref().
     sref<T> get() const;
+
+    // Return the pointed-to object without taking a reference to it
+    // (or reviving it), or nullptr if it has been collected.  The
+    // caller must know some other way that the object can't be
+    // collected while it uses the pointer.
+    T* peek() const
+    {
+      return ptr_and_state(ptr_and_state_.load()).ptr_;
+    }
   };
 
   // The reference delta cache.  There is one instance of class cache
@@ -402,10 +426,18 @@ namespace refcache {
       constexpr way() : obj(), delta() { }
     };
 
-    // The ways of the cache.  This must be accessed with interrupts
-    // disabled to prevent interference between a review process and
-    // capacity evictions.
-    way ways_[CACHE_SLOTS];
+    // The ways of the cache, CACHE_WAYS consecutive ways per set.
+    // This must be accessed with interrupts disabled to prevent
+    // interference between a review process and capacity evictions.
+    way ways_[CACHE_SLOTS] __mpalign__;
+
+    // The recency order of each set's ways.  Each set's byte holds
+    // its way numbers, WAY_BITS bits each, most recently used in the
+    // low bits.  Accessed like ways_.
+    enum { WAY_BITS = CACHE_WAYS == 1 ? 0 : CACHE_WAYS == 2 ? 1 : 2 };
+    static_assert(CACHE_WAYS == 1 || CACHE_WAYS == 2 || CACHE_WAYS == 4,
+                  "CACHE_WAYS must be 1, 2 or 4");
+    uint8_t lru_[CACHE_SETS];
 
     // The list of objects to review in increasing epoch order.  This
     // must be accessed only by the local core and there must be at
@@ -422,33 +454,79 @@ namespace refcache {
     // The last global epoch number observed by this core.
     uint64_t local_epoch;
 
-    // Return the way in which a particular object's delta could be stored.
-    way *hash_way(referenced *obj)
+    // The length of review_.  Accessed like review_.
+    uint64_t review_len_;
+
+    // Return the set in which a particular object's delta could be
+    // stored.
+    static std::size_t hash_set(referenced *obj)
     {
       // Hash based on Java's HashMap re-hashing function.
-      std::uint64_t wayno = (uintptr_t)obj;
-      wayno ^= (wayno >> 32) ^ (wayno >> 20) ^ (wayno >> 12);
-      wayno ^= (wayno >> 7) ^ (wayno >> 4);
-      wayno %= CACHE_SLOTS;
-      struct way *way = &ways_[wayno];
-      // XXX More associativity.  Since this is in the critical path
-      // of every reference operation, perhaps we should do something
-      // like hash-rehash caching?  Would require returning multiple
-      // candidate ways.
-      return way;
+      std::uint64_t setno = (uintptr_t)obj;
+      setno ^= (setno >> 32) ^ (setno >> 20) ^ (setno >> 12);
+      setno ^= (setno >> 7) ^ (setno >> 4);
+      return setno % CACHE_SETS;
+    }
+
+    // Return the first of the CACHE_WAYS ways in which a particular
+    // object's delta could be stored.
+    way *hash_way(referenced *obj)
+    {
+      return &ways_[hash_set(obj) * CACHE_WAYS];
+    }
+
+    // Make way w the most recently used of set's ways.
+    void touch(std::size_t set, unsigned w)
+    {
+      uint8_t order = lru_[set];
+      const uint8_t mask = (1 << WAY_BITS) - 1;
+      if ((order & mask) == w)
+        return;
+      // Find w's position, shift the more recently used ways up one
+      // position, and put w first.
+      unsigned pos = 1;
+      while (((order >> (pos * WAY_BITS)) & mask) != w)
+        ++pos;
+      uint8_t below = order & ((1 << (pos * WAY_BITS)) - 1);
+      uint8_t above = pos + 1 < CACHE_WAYS ?
+        order & ~((1 << ((pos + 1) * WAY_BITS)) - 1) : 0;
+      lru_[set] = above | (below << WAY_BITS) | w;
+    }
+
+    // The least recently used of set's ways
+    unsigned lru_way(std::size_t set) const
+    {
+      return (lru_[set] >> ((CACHE_WAYS - 1) * WAY_BITS)) &
+        ((1 << WAY_BITS) - 1);
     }
 
     // Place obj in the cache if necessary and return its assigned
     // way.  Interrupts must be disabled.
     way *get_way(referenced *obj)
     {
-      struct way *way = hash_way(obj);
-      if (way->obj != obj) {
+      std::size_t set = hash_set(obj);
+      struct way *ways = &ways_[set * CACHE_WAYS], *way = nullptr;
+      struct way *empty = nullptr;
+      for (unsigned i = 0; i < CACHE_WAYS; ++i) {
+        if (ways[i].obj == obj) {
+          way = &ways[i];
+          break;
+        }
+        if (!ways[i].obj && !empty)
+          empty = &ways[i];
+      }
+      if (way) {
+        kstats::inc(&kstats::refcache_hit_count);
+      } else {
         // This object is not in the cache
-        if (way->obj) {
-          // Need to evict to free up an entry.  Since this is a
-          // capacity eviction, local_epoch may be behind
+        kstats::inc(&kstats::refcache_miss_count);
+        if (empty) {
+          way = empty;
+        } else {
+          // Need to evict the set's least recently used way.  Since
+          // this is a capacity eviction, local_epoch may be behind
           // global_epoch.
+          way = &ways[lru_way(set)];
           evict(way, false);
           kstats::inc(&kstats::refcache_conflict_count);
         }
@@ -456,6 +534,7 @@ namespace refcache {
         auto w = way->seq.write_begin();
         way->obj = obj;
       }
+      touch(set, way - ways);
       // If the delta is getting close to overflowing, evict.
       if (way->delta == INT_MAX || way->delta == INT_MIN) {
         evict(way, false);
@@ -480,8 +559,19 @@ namespace refcache {
     // call may be active at a time per core.
     void review();
 
+    friend void expedite();
+
   public:
-    cache() = default;
+    cache() : review_len_(0)
+    {
+      // Start each set with the identity order, so every way number
+      // appears once
+      uint8_t order = 0;
+      for (unsigned i = 0; i < CACHE_WAYS; ++i)
+        order |= i << (i * WAY_BITS);
+      for (auto &o : lru_)
+        o = order;
+    }
     cache(const cache &o) = delete;
     cache(cache &&o) = delete;
     cache &operator=(const cache &o) = delete;
@@ -28,15 +28,46 @@ struct perf_selector
 
 #define NTRACE 4
 
+// Return addresses recorded per sample, by following the frame
+// pointer chain out of the interrupted code
+#define NCALLCHAIN 16
+
+// What the load_address of a load latency sample is in
+enum perf_obj_kind {
+  PERF_OBJ_NONE = 0,
+  // Kernel image data.  obj_base is the address itself, for the
+  // report to look up in the symbol table.
+  PERF_OBJ_STATIC,
+  // obj_cpu's instance of a per-CPU variable.  obj_base is the address
+  // of CPU 0's instance, which is the one in the symbol table.
+  PERF_OBJ_PERCPU,
+  // A kmalloc object of obj_size bytes (its size class) at obj_base,
+  // from a slab of core obj_cpu
+  PERF_OBJ_SLAB,
+  // Some other page of kernel memory
+  PERF_OBJ_PAGE,
+  PERF_OBJ_USER,
+};
+
 struct pmuevent {
   u8 idle:1;
   u8 ints_disabled:1;
   u8 kernel:1;
+  // The syscall the sampled process was in, or 0 (the numbers are
+  // those of tools/syscalls.py)
+  u16 sysno;
   u32 count;
   u64 rip;
-  uptr trace[NTRACE];
+  uptr trace[NCALLCHAIN];
   u32 latency, data_source;
   u64 load_address;
+  u32 pid;
+  u8 obj_kind;
+  u8 obj_cpu;
+  u64 obj_base;
+  u32 obj_size;
+  // load_address's offset in the object
+  u32 obj_off;
 };
 
 struct logheader {
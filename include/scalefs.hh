@@ -6,10 +6,85 @@
 #include "oplog.hh"
 #include "bitset.hh"
 #include "disk.hh"
+#include "kstats.hh"
+#include "objcache.hh"
+#include "pagecopy.hh"
+#include "arena.hh"
+#include "taskgroup.hh"
+#include "memacct.hh"
 #include <vector>
 #include <algorithm>
 
 class mnode;
+
+// The phases of mounting the file system, timed for /dev/mountstats.
+// MOUNT_RECOVER_JOURNAL and MOUNT_REPLAY are the two halves of
+// MOUNT_RECOVER, which includes them.
+enum mount_phase {
+  MOUNT_RECOVER,          // recover_scalefs()
+  MOUNT_RECOVER_JOURNAL,  // recover_journal(), objects are transactions
+  MOUNT_REPLAY,           // apply_recovered_transactions(), objects are
+                          // blocks written
+  MOUNT_FREEINUM,         // initialize_freeinum_bitmap()
+  MOUNT_FREEBLOCK,        // initialize_freeblock_bitmap()
+  MOUNT_LOCKS,            // alloc_inodebitmap_locks()
+  MOUNT_ORPHANS,          // load_orphan_table()
+  MOUNT_LOAD_ROOT,        // load_root()
+  NMOUNT_PHASES,
+};
+
+struct mount_phase_stats {
+  u64 cycles;
+  u64 blocks_read;
+  u64 objects;      // mnodes, plus whatever the phase counts itself
+};
+extern mount_phase_stats mount_stats[NMOUNT_PHASES];
+
+// Adds the cycles, disk blocks read and mnodes allocated between its
+// construction and destruction to the stats of a mount phase. Mounting runs
+// on the boot CPU alone, so its own kstats tell the whole story.
+class mount_phase_timer {
+public:
+  mount_phase_timer(mount_phase p)
+    : st_(&mount_stats[p]), start_(rdtsc()),
+      blocks_read_((*mykstats).disk_read_blocks),
+      mnodes_((*mykstats).mnode_alloc) {}
+
+  ~mount_phase_timer()
+  {
+    st_->cycles += rdtsc() - start_;
+    st_->blocks_read += (*mykstats).disk_read_blocks - blocks_read_;
+    st_->objects += (*mykstats).mnode_alloc - mnodes_;
+  }
+
+  void add_objects(u64 n) { st_->objects += n; }
+
+  mount_phase_timer(const mount_phase_timer&) = delete;
+  mount_phase_timer& operator=(const mount_phase_timer&) = delete;
+
+private:
+  mount_phase_stats *st_;
+  u64 start_, blocks_read_, mnodes_;
+};
+
+// Transactions track the modified parts of a disk block at the granularity of
+// TXN_CHUNK_SIZE-byte chunks (one dinode), using a 64-bit mask. The journal can
+// then log just the modified chunks of inode and bitmap blocks.
+#define TXN_CHUNK_SIZE 64
+#define TXN_ALL_CHUNKS (~0ULL)
+static_assert(BSIZE / TXN_CHUNK_SIZE == 64, "Chunk mask must cover BSIZE");
+static_assert(sizeof(dinode) == TXN_CHUNK_SIZE, "dinode must be one chunk");
+
+// Returns the mask of chunks that overlap bytes [off, off+len) of a block.
+static inline u64
+txn_chunk_mask(u32 off, u32 len)
+{
+  u32 first = off / TXN_CHUNK_SIZE;
+  u32 last = (off + len - 1) / TXN_CHUNK_SIZE;
+  if (last - first == 63)
+    return TXN_ALL_CHUNKS;
+  return ((1ULL << (last - first + 1)) - 1) << first;
+}
 class transaction;
 class mfs_interface;
 class mfs_operation;
@@ -66,27 +141,68 @@ struct transaction_diskblock {
 
   sref<disk_completion> dc;
 
-  NEW_DELETE_OPS(transaction_diskblock);
+  // If set, blockdata points to the frozen contents of this buf, rather than
+  // to a private copy (see buf::add_to_transaction()).
+  sref<buf> frozen_buf;
+
+  // Chunks of the block modified by the transaction (see TXN_CHUNK_SIZE).
+  // Blocks recovered from delta records of the journal hold valid contents
+  // only in these chunks.
+  u64 dirty_chunks;
+
+  NEW_DELETE_OPS_CACHED(transaction_diskblock);
 
   transaction_diskblock(u32 n, char buf[BSIZE])
   {
-    blockdata = (char *) kmalloc(BSIZE, "transaction_diskblock");
+    blockdata = kalloc("transaction_diskblock", BSIZE);
     blocknum = n;
-    memmove(blockdata, buf, BSIZE);
+    pagecopy(blockdata, buf);
     timestamp = get_tsc();
+    dirty_chunks = TXN_ALL_CHUNKS;
+    account(1);
   }
 
-  transaction_diskblock(u32 n, char buf[BSIZE], u64 blk_timestamp)
+  // streaming copies buf with non-temporal stores, for blocks that nothing
+  // but the disk will read again, such as journal blocks.
+  transaction_diskblock(u32 n, char buf[BSIZE], u64 blk_timestamp,
+                        bool streaming = false)
   {
-    blockdata = (char *) kmalloc(BSIZE, "transaction_diskblock");
+    blockdata = kalloc("transaction_diskblock", BSIZE);
     blocknum = n;
-    memmove(blockdata, buf, BSIZE);
+    if (streaming)
+      pagecopy_nt(blockdata, buf);
+    else
+      pagecopy(blockdata, buf);
     timestamp = blk_timestamp;
+    dirty_chunks = TXN_ALL_CHUNKS;
+    account(1);
+  }
+
+  transaction_diskblock(u32 n, sref<buf> bp, char *frozen_data)
+    : frozen_buf(bp)
+  {
+    blockdata = frozen_data;
+    blocknum = n;
+    timestamp = get_tsc();
+    dirty_chunks = TXN_ALL_CHUNKS;
+    account(1);
   }
 
   ~transaction_diskblock()
   {
-    kmfree(blockdata, BSIZE);
+    account(-1);
+    if (frozen_buf)
+      frozen_buf->put_frozen_data();
+    else
+      kfree(blockdata, BSIZE);
+  }
+
+  // Count the block in or (sign -1) out of the memory accounting. The
+  // contents of a frozen buf count as bufdata.
+  void account(int sign)
+  {
+    memacct_add(MEMACCT_TXN_DISKBLOCKS, sign,
+                sign * (s64)(sizeof(*this) + (frozen_buf ? 0 : BSIZE)));
   }
 
   transaction_diskblock(const transaction_diskblock&) = delete;
@@ -118,10 +234,23 @@ struct transaction_diskblock {
 
   void writeback_through_bufcache()
   {
-    sref<buf> bp = buf::get(1, blocknum, true);
+    bool partial = dirty_chunks != TXN_ALL_CHUNKS;
+    sref<buf> bp = buf::get(1, blocknum, !partial);
     {
       auto locked = bp->write();
-      memmove(locked->data, blockdata, BSIZE);
+      if (partial) {
+        // Only the dirty chunks are valid; merge them into the block's current
+        // contents and write out the result.
+        for (u32 c = 0; c < BSIZE / TXN_CHUNK_SIZE; c++) {
+          if (dirty_chunks & (1ULL << c))
+            memmove(locked->data + c * TXN_CHUNK_SIZE,
+                    blockdata + c * TXN_CHUNK_SIZE, TXN_CHUNK_SIZE);
+        }
+        pagecopy(blockdata, locked->data);
+        dirty_chunks = TXN_ALL_CHUNKS;
+      } else {
+        pagecopy(locked->data, blockdata);
+      }
     }
     // Can't use async I/O here (which uses sleep) because this is called during
     // early boot, before the process is fully setup for scheduling.
@@ -135,12 +264,18 @@ struct transaction_diskblock {
 class transaction {
   friend mfs_interface;
   public:
-    NEW_DELETE_OPS(transaction);
-    explicit transaction(u64 t) : timestamp_(t), htable_initialized(false),
-                                  bqueue_initialized(false) {}
-
-    transaction() : timestamp_(get_tsc()), htable_initialized(false),
-                    bqueue_initialized(false) {}
+    NEW_DELETE_OPS_CACHED(transaction);
+    explicit transaction(u64 t) : timestamp_(t), dependent_txq(&arena_),
+                                  journal_end_off(0),
+                                  htable_initialized(false),
+                                  inodebitmap_blk_list(&arena_),
+                                  bqueue_initialized(false),
+                                  blocks_sorted(true) {}
+
+    transaction() : timestamp_(get_tsc()), dependent_txq(&arena_),
+                    journal_end_off(0), htable_initialized(false),
+                    inodebitmap_blk_list(&arena_), bqueue_initialized(false),
+                    blocks_sorted(true) {}
 
     ~transaction()
     {
@@ -170,6 +305,14 @@ class transaction {
 
     void add_block(transaction_diskblock *b)
     {
+      // Appending a block past the last one keeps the list sorted and free
+      // of duplicates, which spares deduplicate_blocks() a sort when blocks
+      // are added in order. A newer version of the last block sorts after
+      // it, but still has to be compacted.
+      if (blocks_sorted && !blocks.empty() &&
+          (!compare_transaction_db(blocks.back(), b) ||
+           blocks.back()->blocknum == b->blocknum))
+        blocks_sorted = false;
       blocks.push_back(std::move(b));
     }
 
@@ -177,7 +320,32 @@ class transaction {
     void add_blocks(std::vector<transaction_diskblock*> bvec)
     {
       for (auto &b : bvec)
-        blocks.push_back(std::move(b));
+        add_block(std::move(b));
+    }
+
+    // Move the disk blocks of another (later) transaction into this one. Both
+    // block lists are deduplicated first, so that the merge takes linear time
+    // on top of that; the result is sorted and deduplicated too, and for each
+    // block number the later transaction's diskblock wins ties in timestamp.
+    void merge_blocks(transaction *other)
+    {
+      deduplicate_blocks();
+      other->deduplicate_blocks();
+
+      std::vector<transaction_diskblock*> merged;
+      merged.reserve(blocks.size() + other->blocks.size());
+      auto a = blocks.begin(), b = other->blocks.begin();
+      while (a != blocks.end() || b != other->blocks.end()) {
+        if (b == other->blocks.end() ||
+            (a != blocks.end() && !compare_transaction_db(*b, *a)))
+          merged.push_back(*a++);
+        else
+          merged.push_back(*b++);
+      }
+      other->blocks.clear();
+
+      blocks.swap(merged);
+      compact_sorted_blocks();
     }
 
     void add_free_blocks(std::vector<u32> free_list)
@@ -207,12 +375,18 @@ class transaction {
       free_inum_list.push_back(inum);
     }
 
+    void note_orphan(u32 inum, bool orphan)
+    {
+      orphan_updates.push_back({inum, orphan});
+    }
+
     void add_dirty_blocks_lazy()
     {
       deduplicate_dirty_blocknums();
 
       for (auto &bno : dirty_blocknums) {
         sref<buf> bp = buf::get(1, bno);
+        auto locked = bp->write_clean();
         bp->add_to_transaction(this);
       }
 
@@ -221,86 +395,64 @@ class transaction {
 
     void deduplicate_dirty_blocknums()
     {
-      // Sort the diskblocks in increasing timestamp order.
       std::sort(dirty_blocknums.begin(), dirty_blocknums.end());
-
-      // Make a list of the most current version of the diskblocks. For each
-      // block number pick the diskblock with the highest timestamp and
-      // discard the rest.
-
-      std::vector<unsigned long> erase_indices;
-      for (auto b = dirty_blocknums.begin(); b != dirty_blocknums.end(); b++) {
-        if ((b+1) != dirty_blocknums.end() && (*b) == (*(b+1))) {
-          erase_indices.push_back(b - dirty_blocknums.begin());
-        }
-      }
-
-      std::sort(erase_indices.begin(), erase_indices.end(),
-                std::greater<unsigned long>());
-
-      for (auto &idx : erase_indices)
-        dirty_blocknums.erase(dirty_blocknums.begin() + idx);
+      compact_sorted_list(dirty_blocknums);
     }
 
     void deduplicate_freeblock_list()
     {
       std::sort(free_block_list.begin(), free_block_list.end());
-
-      std::vector<unsigned long> erase_indices;
-      for (auto b = free_block_list.begin(); b != free_block_list.end(); b++) {
-        if ((b+1) != free_block_list.end() && (*b) == (*(b+1))) {
-          erase_indices.push_back(b - free_block_list.begin());
-        }
-      }
-
-      std::sort(erase_indices.begin(), erase_indices.end(),
-                std::greater<unsigned long>());
-
-      for (auto &idx : erase_indices)
-        free_block_list.erase(free_block_list.begin() + idx);
+      compact_sorted_list(free_block_list);
     }
 
     void deduplicate_freeinum_list()
     {
       std::sort(free_inum_list.begin(), free_inum_list.end());
-
-      std::vector<unsigned long> erase_indices;
-      for (auto b = free_inum_list.begin(); b != free_inum_list.end(); b++) {
-        if ((b+1) != free_inum_list.end() && (*b) == (*(b+1))) {
-          erase_indices.push_back(b - free_inum_list.begin());
-        }
-      }
-
-      std::sort(erase_indices.begin(), erase_indices.end(),
-                std::greater<unsigned long>());
-
-      for (auto &idx : erase_indices)
-        free_inum_list.erase(free_inum_list.begin() + idx);
+      compact_sorted_list(free_inum_list);
     }
 
     void deduplicate_blocks()
     {
+      if (blocks_sorted)
+        return;
+
+      kstats::timer timer(&kstats::fs_dedup_cycles);
+      kstats::inc(&kstats::fs_dedup_count);
       // Sort the diskblocks in increasing timestamp order.
       std::sort(blocks.begin(), blocks.end(), compare_transaction_db);
+      compact_sorted_blocks();
+    }
 
-      // Make a list of the most current version of the diskblocks. For each
-      // block number pick the diskblock with the highest timestamp and
-      // discard the rest.
-
-      std::vector<unsigned long> erase_indices;
-      for (auto b = blocks.begin(); b != blocks.end(); b++) {
-        if ((b+1) != blocks.end() && (*b)->blocknum == (*(b+1))->blocknum) {
-          erase_indices.push_back(b - blocks.begin());
-        }
+    // Remove the duplicates from a sorted list, in a single pass.
+    static void compact_sorted_list(std::vector<u32> &list)
+    {
+      size_t n = 0;
+      for (size_t i = 0; i < list.size(); i++) {
+        if (!n || list[n - 1] != list[i])
+          list[n++] = list[i];
       }
+      list.erase(list.begin() + n, list.end());
+    }
 
-      std::sort(erase_indices.begin(), erase_indices.end(),
-                std::greater<unsigned long>());
-
-      for (auto &idx : erase_indices) {
-        delete blocks[idx];
-        blocks.erase(blocks.begin() + idx);
+    // Make a list of the most current version of the diskblocks, in a single
+    // pass over the sorted block list. For each block number keep the diskblock
+    // with the highest timestamp and discard the rest.
+    void compact_sorted_blocks()
+    {
+      size_t n = 0;
+      for (size_t i = 0; i < blocks.size(); i++) {
+        if (n && blocks[n - 1]->blocknum == blocks[i]->blocknum) {
+          // The surviving (latest) diskblock of each block number also covers
+          // the chunks modified in the discarded ones.
+          blocks[i]->dirty_chunks |= blocks[n - 1]->dirty_chunks;
+          delete blocks[n - 1];
+          blocks[n - 1] = blocks[i];
+        } else {
+          blocks[n++] = blocks[i];
+        }
       }
+      blocks.erase(blocks.begin() + n, blocks.end());
+      blocks_sorted = true;
     }
 
     // Comparison function to order diskblock updates. Diskblocks are ordered in
@@ -316,33 +468,52 @@ class transaction {
       return (b1->blocknum < b2->blocknum);
     }
 
-    // Write a block to the disk via the transaction's block-queue.
+    // Write a block to the disk via the transaction's block-queue. These
+    // writes bypass the buffer-cache, so any cached copy of the block is
+    // brought up to date first (see buf::refresh()).
     void write_block(u32 dev, const char *buf, u64 blocknum)
     {
+      buf::refresh(dev, blocknum, buf);
       if (!bqueue_initialized) {
         bqueue = new block_queue();
         bqueue_initialized = true;
       }
 
       bqueue->write(dev, buf, BSIZE, blocknum * BSIZE);
-      disks_written.set(blknum_to_dev(blocknum));
+      mark_disks_written(blocknum);
     }
 
     // Write the blocks in this transaction to disk. Used to write the journal.
-    void write_to_disk()
+    // If shared_io is set, the writes go through the system-wide I/O scheduler
+    // (see disk_sched_submit()). If poll_io is set, their completion is polled
+    // for (see DISK_COMMIT_POLL_US).
+    void write_to_disk(bool shared_io = false, bool poll_io = false)
+    {
+      start_write_to_disk(shared_io, poll_io);
+      wait_for_write_to_disk();
+    }
+
+    // Issue the writes for the blocks in this transaction, without waiting
+    // for them to complete.
+    void start_write_to_disk(bool shared_io = false, bool poll_io = false)
     {
       deduplicate_blocks();
 
       if (!bqueue_initialized) {
-        bqueue = new block_queue();
+        bqueue = new block_queue(shared_io, poll_io);
         bqueue_initialized = true;
       }
 
       for (auto b = blocks.begin(); b != blocks.end(); b++) {
         bqueue->write(1, (*b)->blockdata, BSIZE, (*b)->blocknum * BSIZE);
-        disks_written.set(blknum_to_dev((*b)->blocknum));
+        mark_disks_written((*b)->blocknum);
       }
+      bqueue->submit();
+    }
 
+    // Wait for the writes issued by start_write_to_disk() to complete.
+    void wait_for_write_to_disk()
+    {
       // Make sure all the block-writes complete.
       bqueue->flush();
       delete bqueue;
@@ -362,10 +533,23 @@ class transaction {
       disks_written.reset();
     }
 
-    void write_to_disk_and_flush()
+    void write_to_disk_and_flush(bool shared_io = false, bool poll_io = false)
     {
-      write_to_disk();
+      write_to_disk(shared_io, poll_io);
+      flush_disks(poll_io);
+    }
 
+    // Same as write_to_disk_and_flush(), for a transaction whose writes have
+    // already been issued using start_write_to_disk().
+    void finish_write_to_disk_and_flush()
+    {
+      wait_for_write_to_disk();
+      flush_disks();
+    }
+
+    // Flush the caches of the disks written to by this transaction.
+    void flush_disks(bool poll_io = false)
+    {
       sref<disk_completion> dc_vec[NDISK];
 
       for (auto d : disks_written) {
@@ -374,7 +558,10 @@ class transaction {
       }
 
       for (auto d : disks_written) {
-        dc_vec[d]->wait();
+        if (poll_io)
+          dc_vec[d]->poll_wait(DISK_COMMIT_POLL_US);
+        else
+          dc_vec[d]->wait();
         dc_vec[d].reset();
       }
 
@@ -390,7 +577,7 @@ class transaction {
 
       for (auto b = blocks.begin(); b != blocks.end(); b++) {
         (*b)->writeback();
-        disks_written.set(blknum_to_dev((*b)->blocknum));
+        mark_disks_written((*b)->blocknum);
       }
     }
 
@@ -415,6 +602,13 @@ class transaction {
     // have been logged in the journal in timestamp order.
     const u64 timestamp_;
 
+  private:
+    // Scratch memory for the transaction's short-lived lists, freed with
+    // the transaction.  Declared ahead of the lists that use it.
+    inline_arena<ARENA_INLINE> arena_;
+
+  public:
+
     // Timestamp at which this transaction was enqueued to a journal's
     // transaction queue, and the queue's id.
     u64 enq_tsc; // Guaranteed to be monotonically increasing, for a given queue.
@@ -423,11 +617,16 @@ class transaction {
     // List of transaction queues and the transaction timestamps that this
     // transaction depends on. Applying this transaction to the disk must be
     // postponed until all these dependent transactions are applied.
-    std::vector<tx_queue_info> dependent_txq;
+    arena_vector<tx_queue_info> dependent_txq;
 
     u64 last_group_txn_tsc;
     u64 commit_tsc;
 
+    // Offset in the on-disk journal just past this transaction's last block.
+    // Once the transaction is applied, the journal space upto this offset can
+    // be reused.
+    u32 journal_end_off;
+
   private:
     // List of updated diskblocks
     std::vector<transaction_diskblock*> blocks;
@@ -454,24 +653,65 @@ class transaction {
     // available for reuse only after this transaction commits successfully.
     std::vector<u32> free_inum_list;
 
+    // Inodes that this transaction made orphans (allocated, with no links)
+    // or stopped being orphans, in order; see update_orphan_table().
+    struct orphan_update {
+      u32 inum;
+      bool orphan;
+    };
+    std::vector<orphan_update> orphan_updates;
+
     // Set of inode-block and bitmap-block locks that this transaction owns.
-    std::vector<u32> inodebitmap_blk_list;
+    arena_vector<u32> inodebitmap_blk_list;
     std::vector<sleeplock*> inodebitmap_locks;
 
     // A bitmap of disks written to by this transaction, which is used to call
     // disk_flush() on exactly those set of disks.
     bitset<NDISK> disks_written;
+
+    // Note down the disks that hold the copies of blocknum as written to.
+    void mark_disks_written(u32 blocknum)
+    {
+      disk_addr copies[DISK_MAX_COPIES];
+      u32 ncopies = get_disk_layout()->locate(blocknum, copies);
+      for (u32 i = 0; i < ncopies; i++)
+        disks_written.set(copies[i].dev);
+    }
+
     block_queue *bqueue; // Access to the block layer.
     bool bqueue_initialized;
+
+    // Whether blocks is sorted (see compare_transaction_db()) and free of
+    // duplicates, so that deduplicate_blocks() has nothing to do.
+    bool blocks_sorted;
 };
 
+// Journal space is managed in segments of JOURNAL_SEGMENT_BLOCKS blocks. Each
+// per-core journal file (laid out by mkfs) holds a skip block followed by
+// JOURNAL_FILE_SEGMENTS segments; all those segments form a pool shared by the
+// per-core journals. Segment s is segment (s % JOURNAL_FILE_SEGMENTS) of the
+// journal file of cpu (s / JOURNAL_FILE_SEGMENTS).
+#define JOURNAL_SEGMENT_BLOCKS 64
+#define JOURNAL_FILE_SEGMENTS \
+  ((PHYS_JOURNAL_SIZE / BSIZE - 1) / JOURNAL_SEGMENT_BLOCKS)
+#define JOURNAL_MAX_BLOCKS (1 + JOURNAL_MAX_SEGMENTS * JOURNAL_SEGMENT_BLOCKS)
+
+static_assert(JOURNAL_MIN_SEGMENTS <= JOURNAL_FILE_SEGMENTS,
+              "Not enough journal segments for every core");
+static_assert(JOURNAL_MIN_SEGMENTS <= JOURNAL_MAX_SEGMENTS,
+              "Bad journal segment limits");
+
 // The "physical" journal is made up of transactions, which in turn are made up of
 // updated diskblocks.
 class journal {
   friend mfs_interface;
   public:
     NEW_DELETE_OPS(journal);
-    journal() : last_applied_commit_tsc(0), current_off(0),
+    journal() : commitq_insert_lock("commitq_insert", LOCKSTAT_FS),
+                commitq_remove_lock("commitq_remove", LOCKSTAT_FS),
+                last_applied_commit_tsc(0), last_enq_tsc(0), flush_req_tsc(0),
+                journal_lock("journal_lock", LOCKSTAT_FS), nsegments(0), capacity_(BSIZE), space_stalls(0), peak_used(0),
+                commits_since_resize(0), current_off(0), tail_off(0),
                 committed_trans_tsc(0), applied_trans_tsc(0)
     {
       apply_dedup_trans = new transaction();
@@ -487,6 +727,34 @@ class journal {
     void enqueue_transaction(transaction *tr)
     {
       tx_commit_queue.push_back(tr);
+      last_enq_tsc = tr->enq_tsc;
+    }
+
+    // Returns the enqueue timestamp of the last transaction added to this
+    // journal. Once committed_trans_tsc reaches it, everything enqueued so far
+    // has been committed.
+    u64 get_last_enq_tsc() {
+      scoped_acquire a(&tx_commit_queue_lock);
+      return last_enq_tsc;
+    }
+
+    // Ask this journal's flusher thread to commit the transactions enqueued
+    // upto upto_enq_tsc.
+    void request_flush(u64 upto_enq_tsc) {
+      scoped_acquire a(&flush_req_lock_);
+      if (upto_enq_tsc > flush_req_tsc) {
+        flush_req_tsc = upto_enq_tsc;
+        flush_req_cv_.wake_all();
+      }
+    }
+
+    // Called by the flusher thread: wait for a flush request that hasn't been
+    // committed yet, and return it.
+    u64 wait_for_flush_request() {
+      scoped_acquire a(&flush_req_lock_);
+      while (flush_req_tsc <= get_committed_tsc())
+        flush_req_cv_.sleep(&flush_req_lock_);
+      return flush_req_tsc;
     }
 
     // comparison function to order journal transactions in timestamp order
@@ -500,18 +768,79 @@ class journal {
       return current_off;
     }
 
+    // Size of the journal in bytes, including the skip block.
+    u32 capacity() {
+      scoped_acquire l(&offset_lock);
+      return capacity_;
+    }
+
+    // Number of bytes taken up by unapplied transactions.
+    u32 used_space() {
+      scoped_acquire l(&offset_lock);
+      if (current_off >= tail_off)
+        return current_off - tail_off;
+      return capacity_ - BSIZE - (tail_off - current_off);
+    }
+
     void update_offset(u32 new_off) {
-      assert(new_off <= PHYS_JOURNAL_SIZE);
+      assert(new_off <= capacity());
       scoped_acquire l(&offset_lock);
       current_off = new_off;
     }
 
+    // The journal is used as a ring buffer between the skip block (the first
+    // block) and the end of the journal. New transactions are written at
+    // current_off (the head), and tail_off is the start of the oldest
+    // transaction that hasn't been applied yet. A transaction is never split
+    // across the end of the journal; if it doesn't fit there, it is written at
+    // the beginning instead. head == tail means the journal is empty.
+    u32 tail_offset() {
+      scoped_acquire l(&offset_lock);
+      return tail_off;
+    }
+
+    void update_tail_offset(u32 new_off) {
+      assert(new_off >= BSIZE && new_off <= capacity());
+      scoped_acquire l(&offset_lock);
+      tail_off = new_off;
+    }
+
+    // Returns the offset at which trans_size bytes can be written contiguously
+    // to the journal without overwriting unapplied transactions, or 0 if there
+    // isn't enough free space in the journal.
+    u32 space_offset(u64 trans_size) {
+      scoped_acquire l(&offset_lock);
+      if (current_off >= tail_off) {
+        if (current_off + trans_size <= capacity_)
+          return current_off;
+        // Wrap around, but don't run into the tail.
+        if (BSIZE + trans_size < tail_off)
+          return BSIZE;
+        return 0;
+      }
+      if (current_off + trans_size < tail_off)
+        return current_off;
+      return 0;
+    }
+
     void wait_for_commit(u64 upto_enq_tsc) {
       scoped_acquire a(&commit_cv_lock_);
       while (committed_trans_tsc < upto_enq_tsc)
         commit_cv_.sleep(&commit_cv_lock_);
     }
 
+    // Same as wait_for_commit(), but gives up at the given deadline (in
+    // nsectime()). Returns true if the transactions got committed.
+    bool wait_for_commit_until(u64 upto_enq_tsc, u64 deadline) {
+      scoped_acquire a(&commit_cv_lock_);
+      while (committed_trans_tsc < upto_enq_tsc) {
+        if (nsectime() >= deadline)
+          return false;
+        commit_cv_.sleep_to(&commit_cv_lock_, deadline);
+      }
+      return true;
+    }
+
     void wait_for_apply(u64 upto_enq_tsc) {
       scoped_acquire a(&apply_cv_lock_);
       while (applied_trans_tsc < upto_enq_tsc)
@@ -542,6 +871,13 @@ class journal {
       return applied_trans_tsc;
     }
 
+    // Whether every transaction enqueued so far has been applied to the disk,
+    // so that there is nothing to flush.
+    bool all_applied() {
+      u64 enq_tsc = get_last_enq_tsc();
+      return get_applied_tsc() >= enq_tsc;
+    }
+
   private:
     std::vector<transaction*> tx_commit_queue;
     std::vector<transaction*> tx_apply_queue;
@@ -562,6 +898,16 @@ class journal {
 
     u64 last_applied_commit_tsc;
 
+  private:
+    // The enqueue timestamp of the last transaction added to the commit queue.
+    // Protected by tx_commit_queue_lock.
+    u64 last_enq_tsc;
+
+    // Pending request for the flusher thread (see request_flush()).
+    u64 flush_req_tsc;
+    spinlock flush_req_lock_;
+    condvar flush_req_cv_;
+
   private:
     transaction *apply_dedup_trans;
 
@@ -573,9 +919,29 @@ class journal {
     // path.
     sleeplock journal_lock;
 
-    // Current size of flushed out transactions on the disk.
+    // Segments making up the journal, in the order they appear in the ring.
+    u32 nsegments;
+    u32 segments[JOURNAL_MAX_SEGMENTS];
+
+    // Disk block numbers of the journal's blocks, indexed by the block's
+    // offset within the journal: the skip block of this core's journal file,
+    // followed by the blocks of the segments. Journal writes go directly to
+    // these blocks, bypassing the inode layer.
+    u32 blocknums[JOURNAL_MAX_BLOCKS];
+    u32 capacity_;
+
+    // Statistics used to size the journal (see mfs_interface::resize_journal()).
+    // The number of times a commit had to wait for journal space, the largest
+    // amount of journal space in use, and the number of commits, since the
+    // journal was last resized.
+    u64 space_stalls;
+    u32 peak_used;
+    u64 commits_since_resize;
+
+    // Offsets of the head and the tail of the on-disk journal.
     u32 current_off;
-    spinlock offset_lock; // Protects access to current_off.
+    u32 tail_off;
+    spinlock offset_lock; // Protects access to current_off and tail_off.
 
     // The timestamp of the last transaction that was committed to the on-disk
     // filesystem via this journal.
@@ -596,18 +962,41 @@ class mfs_interface
 {
   public:
 
-    // Headers used by the journal to indicate start and commit of transactions.
+    // Headers used by the journal to indicate the start of transactions and
+    // the point from which crash-recovery should scan the journal.
     typedef struct journal_header_block {
-      journal_header_block() : timestamp(0), header_type(0) {}
-      journal_header_block(u64 t, u8 bt) : timestamp(t), header_type(bt) {}
+      journal_header_block() : timestamp(0), header_type(0), checksum(0) {}
+      journal_header_block(u64 t, u8 bt) : timestamp(t), header_type(bt),
+                                           checksum(0) {}
 
       u64 timestamp; // The transaction timestamp, serves as the transaction ID.
-      u8 header_type; // The type of the journal header (start or commit)
+      u8 header_type; // The type of the journal header (start or skip)
 
       // The following fields are used only if this is a start block.
       u8 num_addr_blocks; // No. of address-blocks that follow the start block.
-      u8 padding[2];
-      u32 blocknums[1021]; // Block numbers of the data blocks in the transaction.
+      u8 num_delta_blocks; // No. of delta-blocks that follow the data blocks.
+      // The cpu whose journal the transaction belongs to. Journal segments
+      // move between journals (see class journal), so a segment may still
+      // contain transactions of the journal that used it before.
+      u8 cpu;
+      // CRC-32C over the start block (with this field zeroed), the address
+      // blocks, the data blocks and the delta blocks of the transaction. A
+      // transaction whose checksum matches during recovery is committed; there
+      // is no separate commit block.
+      u32 checksum;
+      union {
+        u32 blocknums[1020]; // Block numbers of the data blocks in the transaction.
+
+        // Used only if this is a skip block.
+        struct {
+          // Where to start looking for unapplied transactions during
+          // crash-recovery.
+          u32 tail_offset;
+          // The segments making up the journal (see class journal).
+          u32 nsegments;
+          u32 segments[JOURNAL_MAX_SEGMENTS];
+        };
+      };
 
     } journal_header;
 
@@ -626,14 +1015,36 @@ class mfs_interface
     static_assert(sizeof(journal_addr_block) == BSIZE,
                   "Journal address block size should be equal to BSIZE\n");
 
-    static_assert((PHYS_JOURNAL_SIZE/BSIZE) <= 1021 + 1024,
-                   "Add more address blocks in the transaction commit code\n");
+    // Enough address blocks to describe a transaction that fills the largest
+    // journal, and the most data blocks a transaction can have with them.
+    static const u32 max_addr_blocks = (JOURNAL_MAX_BLOCKS + 1023) / 1024;
+    static_assert(max_addr_blocks <= 255,
+                  "num_addr_blocks can't count the address blocks\n");
+    static const u32 max_txn_blocks = 1020 + 1024 * max_addr_blocks;
+
+    // The number of address blocks needed for a transaction with n data blocks.
+    static u32 num_addr_blocks_for(size_t n) {
+      return n <= 1020 ? 0 : (n - 1020 + 1023) / 1024;
+    }
+
+    static_assert(2 + JOURNAL_MAX_SEGMENTS <= 1020,
+                  "Skip block can't hold the journal's segment list\n");
+
+    // Delta block(s) : log the modified chunks of disk blocks whose changes are
+    // small (inode and bitmap updates), instead of whole blocks. A delta block
+    // is a sequence of delta records, each made up of this header followed by
+    // the contents of the chunks in chunk_mask, in increasing order. A record
+    // with a zero blocknum, or the end of the block, ends the sequence.
+    typedef struct journal_delta_record {
+      u32 blocknum;
+      u32 padding;
+      u64 chunk_mask;
+    } journal_delta_record;
 
     // Types of journal headers
     enum : u8 {
       JOURNAL_TXN_START = 1,     // Start block
-      JOURNAL_TXN_COMMIT,        // Commit block
-      JOURNAL_TXN_SKIP,          // Skip block
+      JOURNAL_TXN_SKIP = 3,      // Skip block
     };
 
     struct pending_metadata {
@@ -657,51 +1068,316 @@ class mfs_interface
       u64 timestamp;
     };
 
-    // Keeps track of free and allocated blocks on the disk. Transactions that
-    // modify the block free bitmap on the disk go through a list of free_bit
-    // structs in memory first.
-    typedef struct free_bit {
-      u32 bno_;
-      int cpu;
-      bool is_free;
-      ilink<free_bit> link;
-
-      free_bit(u32 bno, bool f): bno_(bno), is_free(f) {}
-      NEW_DELETE_OPS(free_bit);
-
-      free_bit& operator=(const free_bit&) = delete;
-      free_bit(const free_bit&) = delete;
-
-      free_bit& operator=(free_bit&&) = default;
-      free_bit(free_bit&&) = default;
-    } free_bit;
-
     // The free block bitmap in memory. All block allocations (in transactions)
     // are performed using this in-memory data-structure. Blocks freed by a
     // transaction are freed in this bitmap *after* the transaction commits.
     // This helps us guarantee that the blocks freed by a transaction are not
     // reused until it successfully commits to disk.
     struct freeblock_bitmap {
-      // We maintain the bitmap as both a vector and a linked-list so that we
-      // can perform both allocations and frees in O(1) time. The bit_vector
-      // contains entries for all blocks, whereas the bit_freelist contains
-      // entries only for blocks that are actually free. The allocator consumes
-      // items from the bit_freelist in O(1) time; the free code locates the
-      // free_bit data-structure corresponding to the block being freed in O(1)
-      // time using the bit_vector and inserts it into the bit_freelist (also
-      // in O(1) time). Items are never removed from the bit_vector so as to
-      // enable the O(1) lookups.
-      std::vector<free_bit*> bit_vector;
-
-      struct freelist {
-        ilist<free_bit, &free_bit::link> bit_freelist;
-        spinlock list_lock; // Guards modifications to the bit_freelist
+      // One bit per block, set if the block is free, packed into words. The
+      // blocks are divided among per-CPU pools, each a contiguous range of
+      // whole bitmap blocks (and hence of words), and a global reserve pool
+      // of whatever is left over. Every word belongs to a single pool, which
+      // keeps it, and is protected by that pool's lock.
+      u32 nblocks;
+      u32 cpu_start;      // The first block of CPU 0's pool.
+      u32 blocks_per_cpu;
+
+      // Each pool summarizes which of its words have free bits (l1), and
+      // which words of l1 are non-zero (l2), so that allocation finds a free
+      // block with a few bit scans rather than by walking the bitmap. A
+      // per-CPU pool's words and summary are allocated on its CPU's NUMA
+      // node, since that CPU is nearly the only one to touch them.
+      struct pool {
+        spinlock lock;
+        u32 first_word;
+        u32 nwords;
+        u32 nfree;
+        u64 *bits;   // Words [first_word, first_word + nwords) of the bitmap.
+        u64 *l1;     // Bit i is set if bits[i] != 0.
+        u64 *l2;     // Bit i is set if l1[i] != 0.
+        u32 nl2;
+
+        // Word w of the bitmap, which must be in this pool.
+        u64 &word(u32 w) { return bits[w - first_word]; }
+      };
+
+      percpu<struct pool> pools;
+      struct pool reserve; // Global reserve pool of free blocks.
+
+      // The order in which each CPU falls back on other CPUs' pools and
+      // stashes: see numa_steal_order().
+      int steal_order[NCPU][NCPU - 1];
+
+      // The pool that block bno belongs to: a CPU number, or NCPU for the
+      // reserve pool.
+      int owner(u32 bno) const
+      {
+        if (bno >= cpu_start && bno - cpu_start < NCPU * blocks_per_cpu)
+          return (bno - cpu_start) / blocks_per_cpu;
+        return NCPU;
+      }
+
+      struct pool &pool_of(int cpu)
+      {
+        return cpu < NCPU ? pools[cpu] : reserve;
+      }
+
+      // Set up p to cover nwords words from first_word, with no free blocks,
+      // allocating its memory on the NUMA node of CPU cpu (-1 for the
+      // current CPU).
+      void init_pool(struct pool &p, u32 first_word, u32 nwords, int cpu)
+      {
+        p.first_word = first_word;
+        p.nwords = nwords;
+        p.nfree = 0;
+        u32 nl1 = (nwords + 63) / 64;
+        p.nl2 = (nl1 + 63) / 64;
+        p.bits = alloc_words(nwords, cpu);
+        p.l1 = alloc_words(nl1, cpu);
+        p.l2 = alloc_words(p.nl2, cpu);
+      }
+
+      static u64 *alloc_words(u32 n, int cpu)
+      {
+        u64 *w = (u64 *) kmalloc(std::max(n, 1u) * sizeof(u64),
+                                 "freeblock_bitmap", cpu);
+        assert(w);
+        memset(w, 0, n * sizeof(u64));
+        memacct_add(MEMACCT_FREEBLOCK_BITMAP, 1,
+                    std::max(n, 1u) * sizeof(u64));
+        return w;
+      }
+
+      // Note down that word w (which belongs to p) has free bits.
+      void summarize_word(struct pool &p, u32 w)
+      {
+        u32 i = w - p.first_word;
+        p.l1[i / 64] |= 1ULL << (i % 64);
+        p.l2[i / 4096] |= 1ULL << ((i / 64) % 64);
+      }
+
+      // Note down that word w (which belongs to p) has no free bits left.
+      void unsummarize_word(struct pool &p, u32 w)
+      {
+        u32 i = w - p.first_word;
+        p.l1[i / 64] &= ~(1ULL << (i % 64));
+        if (!p.l1[i / 64])
+          p.l2[i / 4096] &= ~(1ULL << ((i / 64) % 64));
+      }
+
+      // Find the first word of p from w on that has free bits.
+      bool next_free_word(struct pool &p, u32 w, u32 *found)
+      {
+        if (w >= p.first_word + p.nwords)
+          return false;
+
+        u32 i = w - p.first_word;
+        u32 i1 = i / 64;
+        u64 bits = p.l1[i1] & (~0ULL << (i % 64));
+        while (!bits) {
+          // Skip the words of l1 without free bits using l2.
+          i1++;
+          u32 i2 = i1 / 64;
+          if (i2 >= p.nl2)
+            return false;
+          u64 bits2 = p.l2[i2] & (~0ULL << (i1 % 64));
+          while (!bits2) {
+            if (++i2 >= p.nl2)
+              return false;
+            bits2 = p.l2[i2];
+          }
+          i1 = i2 * 64 + __builtin_ctzll(bits2);
+          bits = p.l1[i1];
+        }
+        *found = p.first_word + i1 * 64 + __builtin_ctzll(bits);
+        return true;
+      }
+
+      // Find the first free block of p from block bno on, which must be in p.
+      bool next_free_block(struct pool &p, u32 bno, u32 *found)
+      {
+        u32 w = bno / 64;
+        u64 bits = p.word(w) & (~0ULL << (bno % 64));
+        if (!bits) {
+          if (!next_free_word(p, w + 1, &w))
+            return false;
+          bits = p.word(w);
+        }
+        *found = w * 64 + __builtin_ctzll(bits);
+        return true;
+      }
+
+      // The number of free blocks (upto n) in the run that starts at bno,
+      // without leaving p.
+      u32 run_length(struct pool &p, u32 bno, u32 n)
+      {
+        u32 len = 0;
+        while (len < n && (bno + len) / 64 < p.first_word + p.nwords) {
+          u32 shift = (bno + len) % 64;
+          u64 rest = ~(p.word((bno + len) / 64) >> shift);
+          len += rest ? __builtin_ctzll(rest) : 64;
+          if ((bno + len) % 64)
+            break; // The run ends within this word.
+        }
+        return std::min(len, n);
+      }
+
+      // Find a run of n free blocks in p from block bno on, or the longest
+      // of the first EXTENT_SEARCH_RUNS runs. Caller must hold p.lock.
+      bool find_run(struct pool &p, u32 bno, u32 n, u32 *start, u32 *len)
+      {
+        enum { EXTENT_SEARCH_RUNS = 64 };
+
+        *len = 0;
+        for (int i = 0; i < EXTENT_SEARCH_RUNS; i++) {
+          u32 f;
+          if (!next_free_block(p, bno, &f))
+            break;
+          u32 l = run_length(p, f, n);
+          if (l > *len) {
+            *start = f;
+            *len = l;
+            if (l == n)
+              break;
+          }
+          bno = f + l;
+          if (bno / 64 >= p.first_word + p.nwords)
+            break;
+        }
+        return *len > 0;
+      }
+
+      // Allocate the free blocks [start, start + len) of p. Caller must hold
+      // p.lock.
+      void take_run(struct pool &p, u32 start, u32 len)
+      {
+        for (u32 b = start; b < start + len; ) {
+          u32 shift = b % 64;
+          u32 cnt = std::min(64 - shift, start + len - b);
+          u64 mask = (cnt == 64 ? ~0ULL : (1ULL << cnt) - 1) << shift;
+          u64 &w = p.word(b / 64);
+          assert((w & mask) == mask);
+          w &= ~mask;
+          if (!w)
+            unsummarize_word(p, b / 64);
+          b += cnt;
+        }
+        p.nfree -= len;
+      }
+
+      // Allocate the lowest-numbered free block of p, if any. Caller must
+      // hold p.lock.
+      bool alloc_from(struct pool &p, u32 *bno)
+      {
+        if (!p.nfree)
+          return false;
+
+        for (u32 i2 = 0; i2 < p.nl2; i2++) {
+          if (!p.l2[i2])
+            continue;
+
+          u32 i1 = i2 * 64 + __builtin_ctzll(p.l2[i2]);
+          u32 i = i1 * 64 + __builtin_ctzll(p.l1[i1]);
+          u64 &w = p.bits[i];
+          *bno = (p.first_word + i) * 64 + __builtin_ctzll(w);
+
+          w &= w - 1;
+          if (!w)
+            unsummarize_word(p, p.first_word + i);
+          p.nfree--;
+          return true;
+        }
+        panic("freeblock_bitmap: pool has %u free blocks but none in its "
+              "summary\n", p.nfree);
+      }
+
+      // Mark block bno (which belongs to p) as free. Caller must hold p.lock.
+      void free_to(struct pool &p, u32 bno)
+      {
+        u64 &w = p.word(bno / 64);
+        u64 mask = 1ULL << (bno % 64);
+        assert(!(w & mask));
+        if (!w)
+          summarize_word(p, bno / 64);
+        w |= mask;
+        p.nfree++;
+      }
+
+      // A per-CPU stash of free blocks that belong to other pools: blocks
+      // stolen a bitmap block's worth at a time once the CPU's own pool runs
+      // dry, and blocks of other pools that the CPU frees. The stash holds
+      // whole words (or parts of words) taken out of the bitmap, so their
+      // blocks are marked in use in the pools while stashed. A stash is used
+      // before the CPU's own pool, so stolen blocks drain away on their own,
+      // and only overflows go back to the owning pools.
+      struct stash {
+        enum { NWORDS = BPB / 64 };
+        spinlock lock;  // Acquired before, never after, any pool lock.
+        u32 nwords;
+        u32 nfree;
+        struct {
+          u32 word;
+          u64 bits;
+        } ent[NWORDS];
       };
 
-      // We maintain per-CPU freelists for scalability. The bit_vector is
-      // read-only after initialization, so a single one will suffice.
-      percpu<struct freelist> freelists;
-      struct freelist reserve_freelist; // Global reserve pool of free blocks.
+      percpu<struct stash> stashes;
+
+      // Take a block out of stash s, if any. Caller must hold s.lock.
+      bool stash_pop(struct stash &s, u32 *bno)
+      {
+        if (!s.nwords)
+          return false;
+
+        auto &e = s.ent[s.nwords - 1];
+        *bno = e.word * 64 + __builtin_ctzll(e.bits);
+        e.bits &= e.bits - 1;
+        if (!e.bits)
+          s.nwords--;
+        s.nfree--;
+        return true;
+      }
+
+      // Put the free block bno into stash s, unless s is full. Caller must
+      // hold s.lock.
+      bool stash_push(struct stash &s, u32 bno)
+      {
+        u64 mask = 1ULL << (bno % 64);
+        if (s.nwords && s.ent[s.nwords - 1].word == bno / 64) {
+          assert(!(s.ent[s.nwords - 1].bits & mask));
+          s.ent[s.nwords - 1].bits |= mask;
+        } else if (s.nwords < stash::NWORDS) {
+          s.ent[s.nwords].word = bno / 64;
+          s.ent[s.nwords].bits = mask;
+          s.nwords++;
+        } else {
+          return false;
+        }
+        s.nfree++;
+        return true;
+      }
+
+      // Move as many whole words of free blocks out of pool p into stash s as
+      // fit, and return the number of blocks moved. Caller must hold s.lock,
+      // and acquires p.lock here.
+      u32 refill_stash(struct stash &s, struct pool &p)
+      {
+        u32 moved = 0, w = p.first_word;
+        auto pool_lock = p.lock.guard();
+        while (s.nwords < stash::NWORDS && next_free_word(p, w, &w)) {
+          u32 n = __builtin_popcountll(p.word(w));
+          s.ent[s.nwords].word = w;
+          s.ent[s.nwords].bits = p.word(w);
+          s.nwords++;
+          p.word(w) = 0;
+          unsummarize_word(p, w);
+          p.nfree -= n;
+          moved += n;
+        }
+        s.nfree += moved;
+        return moved;
+      }
     } freeblock_bitmap;
 
     NEW_DELETE_OPS(mfs_interface);
@@ -709,17 +1385,35 @@ class mfs_interface
 
     // File functions
     u64 get_file_size(u64 mfile_mnum);
-    void update_file_size(u64 mfile_mnum, u32 size, transaction *tr);
+    void update_file_size(u64 mfile_mnum, u64 size, transaction *tr);
     void initialize_file(sref<mnode> m);
     int load_file_page(u64 mfile_mnum, char *p, size_t pos, size_t nbytes);
-    sref<inode> prepare_sync_file_pages(u64 mfile_mnum, transaction *tr);
-    int sync_file_page(sref<inode> ip, char *p, size_t pos, size_t nbytes,
+    void readahead_file(u64 mfile_mnum, size_t pos, size_t nbytes);
+    bool is_file_hole(u64 mfile_mnum, size_t pos, size_t nbytes);
+    bool direct_io_file(u64 mfile_mnum, char **pages, u64 pos, u32 npages,
+                        bool write, int cpu);
+    sref<inode> prepare_sync_file_pages(u64 mfile_mnum, transaction *tr,
+                                        const std::vector<u32> &pages,
+                                        bool *allocated);
+    int sync_file_page(borrowed<inode> ip, char *p, size_t pos, size_t nbytes,
                        transaction *tr);
-    void finish_sync_file_pages(sref<inode> ip, transaction *tr);
+    bool journal_file_page(borrowed<inode> ip, char *p, size_t pos, u64 chunks,
+                           transaction *tr);
+    void finish_sync_file_pages(borrowed<inode> ip, transaction *tr);
+    bool sync_inline_file(u64 mfile_mnum, const char *data, u64 size,
+                          u64 keep, transaction *tr);
+    bool file_compressed(u64 mfile_mnum);
+    bool sync_file_cluster(borrowed<inode> ip, u32 c, const char *z, u32 zlen,
+                           char *const *pages, u32 npages, transaction *tr);
+    int set_compress_flag(u64 mnum, bool on, int cpu);
+    bool inherit_compress_flag(u64 parent_mnum, borrowed<inode> ip);
     sref<inode> alloc_inode_for_mnode(u64 mnum, u8 type);
-    void create_file(u64 mnum, u8 type, transaction *tr);
+    void create_file(u64 mnum, u64 parent_mnum, u8 type, transaction *tr);
     void create_dir(u64 mnum, u64 parent_mnum, u8 type, transaction *tr);
-    void truncate_file(u64 mfile_mnum, u32 offset, transaction *tr);
+    void truncate_file(u64 mfile_mnum, u64 offset, transaction *tr,
+                       bool unmap = true);
+    int preallocate_file(u64 mfile_mnum, u64 off, u64 len, bool keep_size,
+                         transaction *tr);
 
     // Directory functions
     void initialize_dir(sref<mnode> m);
@@ -739,24 +1433,55 @@ class mfs_interface
 
     // Initializes the root directory. Called during boot.
     sref<mnode> load_root();
+    // Creates the mnode for an entry of parent that load_dir() left
+    // unloaded, if nobody else has.
+    void load_dir_entry(sref<mnode> parent, const strbuf<DIRSIZ>& name,
+                        u64 entry);
 
     // Journal functions
     void add_transaction_to_queue(transaction *tr, int cpu);
     void pre_process_transaction(transaction *tr);
     void post_process_transaction(transaction *tr);
-    void apply_trans_on_disk(transaction *tr);
+    void apply_trans_on_disk(transaction *tr, bool writes_started = false);
     void commit_transaction_to_disk(int cpu, transaction *trans);
-    void apply_transaction_to_disk(int cpu, transaction *trans);
+    void apply_transaction_to_disk(int cpu, transaction *trans,
+                                   bool writes_started = false);
+    transaction *dequeue_commit_batch(int cpu);
+    transaction *dequeue_ready_commit_batch(int cpu);
+    bool help_commit_transactions(int cpu, u64 upto_enq_tsc);
     void commit_all_transactions(int cpu);
+    void apply_transactions(int cpu, bool oldest_only);
     void apply_all_transactions(int cpu);
+    void pipeline_commit_apply(int cpu);
     void flush_transaction_queue(int cpu, bool apply_transactions = false);
-    void print_txq_stats();
+    void note_journaled_data(int cpu, u64 enq_tsc);
+    void apply_journaled_data(int cpu, u64 enq_tsc);
+    void release_freed_blocks(const std::vector<u32> &blocks);
+    bool defer_block_frees(const std::vector<u32> &blocks);
+    void release_deferred_frees();
+    void group_commit_transactions(int cpu);
+    u64 fsync_ticket(int cpu);
+    int wait_for_fsync_ticket(u64 ticket, bool nonblock);
+    void run_journal_flusher(int cpu);
+    void print_txq_stats(print_stream *s);
     bool fits_in_journal(size_t num_trans_blocks, int cpu);
+    void map_journal_blocks(int cpu);
+    void open_journal(int cpu);
+    void init_journal_pool();
+    void set_journal_segments(int cpu, const u32 *segs, u32 nsegs);
+    void resize_journal(int cpu, size_t num_trans_blocks);
+    bool read_journal_block(int cpu, u32 offset, char *buf);
+    bool read_journal_blocks(int cpu, u32 offset, const std::vector<char*> &bufs);
     void write_journal(char *buf, size_t size, transaction *tr, int cpu);
+    u32 journal_checksum(const std::vector<const char*> &jblocks);
+    void pack_journal_deltas(
+           const std::vector<transaction_diskblock*> &datablocks,
+           std::vector<transaction_diskblock*> &fullblocks,
+           std::vector<char*> &deltablocks);
     void write_journal_transaction_blocks(const
            std::vector<transaction_diskblock*> &vec, const u64 timestamp,
-           bitset<NDISK> &disks_written, int cpu);
-    void write_journal_commit_block(u64 timestamp, int cpu);
+           bitset<NDISK> &disks_written, int cpu,
+           bitset<NDISK> *flush_disks = nullptr);
     void write_journal_skip_block(u64 timestamp, int cpu,
                                   bool use_async_io = true);
 
@@ -764,14 +1489,13 @@ class mfs_interface
     journal_header *get_txn_start_block(int cpu);
     bool get_txn_data_blocks(int cpu, journal_header *hdstartptr,
                              transaction *trans);
-    bool get_txn_commit_block(int cpu, transaction *trans);
     void recover_journal(int cpu, std::vector<transaction*> &trans_vec);
+    void write_recovered_blocks(const std::vector<transaction_diskblock*> &dbs);
+    size_t apply_recovered_transactions(std::vector<transaction*> *trans_vecs);
     void reset_journal(int cpu);
     void init_journal(int cpu);
 
     // Metadata functions
-    void alloc_mnode_lock(u64 mnum);
-    void free_mnode_lock(u64 mnum);
     void alloc_metadata_log(u64 mnum);
     void free_metadata_log(u64 mnum);
     lock_guard<sleeplock> metadata_op_lockguard(u64 mnum, int cpu);
@@ -782,6 +1506,7 @@ class mfs_interface
     void dec_mfslog_linkcount(u64 mnum);
     u64  get_mfslog_linkcount(u64 mnum);
     void sync_dirty_files_and_dirs(int cpu, std::vector<u64> &mnum_list);
+    void sync_mnodes(int cpu, std::vector<u64> &mnum_list);
     void evict_bufcache();
     void evict_pagecache();
     void process_metadata_log_and_flush(int cpu);
@@ -790,31 +1515,48 @@ class mfs_interface
                                      transaction *tr = nullptr,
                                      bool skip_add = false);
     void absorb_file_link_unlink(mfs_logical_log *mfs_log,
-                                 std::vector<u64> &absorb_mnum_list);
+                                 arena_vector<u64> &absorb_mnum_list);
+    void absorb_file_renames(mfs_logical_log *mfs_log, u64 max_tsc);
+    static bool is_rename_unlink_of(const mfs_operation_vec &ops,
+                                    unsigned long idx,
+                                    const mfs_operation_rename_link *rl,
+                                    u64 max_tsc);
+    void absorb_operations(mfs_logical_log *mfs_log, u64 max_tsc,
+                           arena_vector<u64> &absorb_mnum_list);
     void absorb_delete_inode(mfs_logical_log *mfs_log, u64 mnum, int cpu,
-                             std::vector<u64> &unlink_mnum_list);
+                             arena_vector<u64> &unlink_mnum_list);
     int  process_ops_from_oplog(mfs_logical_log *mfs_log, u64 max_tsc, int count,
                   int cpu,
-                  std::vector<pending_metadata> &pending_stack,
-                  std::vector<u64> &unlink_mnum_list,
-                  std::vector<dirunlink_metadata> &dirunlink_stack,
-                  std::vector<rename_metadata> &rename_stack,
-                  std::vector<rename_barrier_metadata> &rename_barrier_stack,
-                  std::vector<u64> &absorb_mnum_list);
-    void apply_rename_pair(std::vector<rename_metadata> &rename_stack, int cpu);
+                  arena_vector<pending_metadata> &pending_stack,
+                  arena_vector<u64> &unlink_mnum_list,
+                  arena_vector<dirunlink_metadata> &dirunlink_stack,
+                  arena_vector<rename_metadata> &rename_stack,
+                  arena_vector<rename_barrier_metadata> &rename_barrier_stack,
+                  arena_vector<u64> &absorb_mnum_list);
+    void apply_rename_pair(arena_vector<rename_metadata> &rename_stack, int cpu);
     void mfs_create(mfs_operation_create *op, transaction *tr);
     void mfs_link(mfs_operation_link *op, transaction *tr);
     void mfs_unlink(mfs_operation_unlink *op, transaction *tr);
     void mfs_rename_link(mfs_operation_rename_link *op, transaction *tr);
     void mfs_rename_unlink(mfs_operation_rename_unlink *op, transaction *tr);
-    void reclaim_unreachable_inodes();
+
+    // The on-disk orphan table (see ORPHAN_BLOCK in fs.h).
+    void load_orphan_table();
+    void update_orphan_table(transaction *tr);
+    void reclaim_orphans();
 
     // Block allocator functionality
     void initialize_freeblock_bitmap();
     u32  alloc_block();
+    u32  alloc_extent(u32 n, u32 goal, u32 *len);
     void free_block(u32 bno);
     void print_free_blocks(print_stream *s);
 
+    // Discards of freed blocks (see DISK_DISCARD in param.h).
+    void init_discards();
+    bool queue_discard(const std::vector<u32> &blocks);
+    void run_discarder();
+
     enum {
       INODE_BLOCK = 1,
       BITMAP_BLOCK,
@@ -824,19 +1566,28 @@ class mfs_interface
     void acquire_inodebitmap_locks(std::vector<u64> &num_list, int type,
                                    transaction *tr);
     void release_inodebitmap_locks(transaction *tr);
+    sleeplock *inodebitmap_lock(u32 blknum);
 
     void preload_oplog();
 
   private:
-    void load_dir(sref<inode> i, sref<mnode> m);
+    void load_dir(borrowed<inode> i, sref<mnode> m);
     sref<mnode> load_dir_entry(u64 inum, sref<mnode> parent);
     sref<mnode> mnode_alloc(u64 inum, u8 mtype);
+    // Serialize load_dir_entry() per inode (hashed by inode number), so that
+    // the names of an inode in different directories load to the same mnode,
+    // while entries of different inodes load in parallel.
+    sleeplock load_entry_locks[LOAD_ENTRY_LOCKS];
     sref<inode> get_inode(u64 mnum, const char *str);
     // Mapping from disk inode numbers to the corresponding mnode numbers
     chainhash<u64, u64> *inum_to_mnum;
     // Mapping from in-memory mnode numbers to disk inode numbers
     chainhash<u64, u64> *mnum_to_inum;
-    chainhash<u64, sleeplock*> *mnum_to_lock;
+    // Serialize alloc_inode_for_mnode() per mnode (hashed by mnode number).
+    struct mnode_lock {
+      sleeplock lock __mpalign__;
+    };
+    mnode_lock mnode_locks[MNODE_LOCKS];
     chainhash<u64, strbuf<DIRSIZ>> *mnum_to_name;
 
     typedef struct mfs_op_idx {
@@ -860,6 +1611,12 @@ class mfs_interface
     percpu<journal*> fs_journal;
     percpu<sref<inode> > sv6_journal;
 
+    // Disk block numbers of each per-core journal file's blocks, and the pool
+    // of journal segments that are not part of any journal.
+    u32 journal_file_blocknums[NCPU][PHYS_JOURNAL_SIZE / BSIZE];
+    std::vector<u32> journal_pool;
+    spinlock journal_pool_lock;
+
     // A hash-table to track the last transaction(*) that modified a given
     // inode-block or bitmap-block. (* = specifically, which journal's
     // transaction-queue that transaction went into and at what timestamp).
@@ -873,12 +1630,61 @@ class mfs_interface
     };
     percpu<delete_inums> delete_inums;
 
+    // The enqueue timestamp of the last transaction in each journal that
+    // logged file data (see DATA_JOURNAL_MAX_PAGES). Blocks freed before
+    // those are applied are held back from reuse until they are, along with
+    // the timestamps they wait for.
+    std::atomic<u64> data_journal_tsc[NCPU];
+    struct deferred_free {
+      u64 upto[NCPU];
+      std::vector<u32> blocks;
+    };
+    std::vector<deferred_free> deferred_frees;
+    spinlock deferred_frees_lock;
+
+    // The slot of every inode in the orphan table, and the unused slots.
+    // Both are guarded by the orphan table's inodebitmap_lock. The orphans
+    // found at mount are reclaimed in the background by reclaim_orphans().
+    chainhash<u32, u32> *orphan_slots;
+    std::vector<u32> free_orphan_slots;
+    std::vector<u32> mount_orphans;
+
 
   private:
     chainhash<u64, mfs_logical_log*> *metadata_log_htab; // The logical log
 
-    // Set of locks, one per inode-block and one per bitmap-block.
-    std::vector<sleeplock*> inodebitmap_locks;
+    // Set of locks, one per inode-block and one per bitmap-block, created
+    // on first use.
+    std::atomic<sleeplock*> *inodebitmap_locks;
+    u32 ninodebitmap_locks;
+
+    // The currently open group-commit window, if any. Cores that call
+    // group_commit_transactions() while the window is open add themselves to
+    // the set of members, and the leader commits all their journals together
+    // once the window closes.
+    struct group_commit_window {
+      spinlock lock;
+      condvar cv;
+      bitset<NCPU> members;
+      bool open;
+
+      group_commit_window() : lock("group_commit_window"),
+                              cv("group_commit_window"), open(false) {}
+    } group_window;
+
+    // The blocks freed by applied transactions that are waiting to be
+    // discarded. They are returned to the block allocator only once their
+    // discards have completed, so that a discard can never hit a block that
+    // has been reused in the meantime.
+    struct discard_queue {
+      spinlock lock;
+      condvar cv;
+      std::vector<u32> blocks;
+      bool enabled;
+
+      discard_queue() : lock("discard_queue"), cv("discard_queue"),
+                        enabled(false) {}
+    } discards;
 };
 
 class mfs_operation
@@ -915,15 +1721,9 @@ class mfs_operation_create: public mfs_operation
                             MFS_OP_CREATE_DIR : MFS_OP_CREATE_FILE),
         mnode_mnum(mnum), parent_mnum(pt), mnode_type(m_type)
     {
-      name = new char[DIRSIZ];
       strncpy(name, nm, DIRSIZ);
     }
 
-    ~mfs_operation_create()
-    {
-      delete[] name;
-    }
-
     void apply(transaction *tr) override
     {
       parent_mfs->mfs_create(this, tr);
@@ -943,7 +1743,7 @@ class mfs_operation_create: public mfs_operation
   private:
     u64 mnode_mnum;   // mnode number of the new file/directory
     u64 parent_mnum;  // mnode number of the parent directory
-    char *name;       // name of the new file/directory
+    char name[DIRSIZ]; // name of the new file/directory
     short mnode_type; // type for the new mnode
 };
 
@@ -959,15 +1759,9 @@ class mfs_operation_link: public mfs_operation
                             MFS_OP_LINK_DIR : MFS_OP_LINK_FILE),
         mnode_mnum(mnum), parent_mnum(pt), mnode_type(m_type)
     {
-      name = new char[DIRSIZ];
       strncpy(name, nm, DIRSIZ);
     }
 
-    ~mfs_operation_link()
-    {
-      delete[] name;
-    }
-
     void apply(transaction *tr) override
     {
       parent_mfs->mfs_link(this, tr);
@@ -987,7 +1781,7 @@ class mfs_operation_link: public mfs_operation
   private:
     u64 mnode_mnum;   // mnode number of the file/directory to be linked
     u64 parent_mnum;  // mnode number of the parent directory
-    char *name;       // name of the file/directory
+    char name[DIRSIZ]; // name of the file/directory
     short mnode_type; // type of the mnode (file/dir)
 };
 
@@ -1003,15 +1797,9 @@ class mfs_operation_unlink: public mfs_operation
                             MFS_OP_UNLINK_DIR : MFS_OP_UNLINK_FILE),
         mnode_mnum(mnum), parent_mnum(pt), mnode_type(m_type)
     {
-      name = new char[DIRSIZ];
       strncpy(name, nm, DIRSIZ);
     }
 
-    ~mfs_operation_unlink()
-    {
-      delete[] name;
-    }
-
     void apply(transaction *tr) override
     {
       parent_mfs->mfs_unlink(this, tr);
@@ -1031,7 +1819,7 @@ class mfs_operation_unlink: public mfs_operation
   private:
     u64 mnode_mnum;   // mnode number of the file/directory to be unlinked
     u64 parent_mnum;  // mnode number of the parent directory
-    char *name;       // name of the file/directory
+    char name[DIRSIZ]; // name of the file/directory
     short mnode_type; // type of the mnode (file/dir)
 };
 
@@ -1048,18 +1836,10 @@ class mfs_operation_rename_link: public mfs_operation
         mnode_mnum(mnum), src_parent_mnum(src_pt), dst_parent_mnum(dst_pt),
         mnode_type(m_type)
     {
-      name = new char[DIRSIZ];
-      newname = new char[DIRSIZ];
       strncpy(name, oldnm, DIRSIZ);
       strncpy(newname, newnm, DIRSIZ);
     }
 
-    ~mfs_operation_rename_link()
-    {
-      delete[] name;
-      delete[] newname;
-    }
-
     void apply(transaction *tr) override
     {
       parent_mfs->mfs_rename_link(this, tr);
@@ -1083,8 +1863,8 @@ class mfs_operation_rename_link: public mfs_operation
     u64 src_parent_mnum;   // mnode number of the source directory
     u64 dst_parent_mnum;   // mnode number of the destination directory
     short mnode_type;      // type of the mnode
-    char *name;            // source name
-    char *newname;         // destination name
+    char name[DIRSIZ];     // source name
+    char newname[DIRSIZ];  // destination name
 };
 
 class mfs_operation_rename_unlink: public mfs_operation
@@ -1100,18 +1880,10 @@ class mfs_operation_rename_unlink: public mfs_operation
         mnode_mnum(mnum), src_parent_mnum(src_pt), dst_parent_mnum(dst_pt),
         mnode_type(m_type)
     {
-      name = new char[DIRSIZ];
-      newname = new char[DIRSIZ];
       strncpy(name, oldnm, DIRSIZ);
       strncpy(newname, newnm, DIRSIZ);
     }
 
-    ~mfs_operation_rename_unlink()
-    {
-      delete[] name;
-      delete[] newname;
-    }
-
     void apply(transaction *tr) override
     {
       parent_mfs->mfs_rename_unlink(this, tr);
@@ -1135,8 +1907,8 @@ class mfs_operation_rename_unlink: public mfs_operation
     u64 src_parent_mnum;   // mnode number of the source directory
     u64 dst_parent_mnum;   // mnode number of the destination directory
     short mnode_type;      // type of the mnode
-    char *name;            // source name
-    char *newname;         // destination name
+    char name[DIRSIZ];     // source name
+    char newname[DIRSIZ];  // destination name
 };
 
 // Rename barriers are used only for directory renames, in order to avoid
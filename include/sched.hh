@@ -3,9 +3,12 @@
 struct sched_stat
 {
   u64 enqs;
+  u64 remote_enqs;    // by other cores, or past a full deque
   u64 deqs;
   u64 steals;
+  u64 remote_steals;  // steals from another NUMA node
   u64 misses;
+  u64 steal_fails;    // times an idle core found nothing to steal
   u64 idle;
   u64 busy;
   u64 schedstart;
@@ -0,0 +1,50 @@
+#pragma once
+
+// Memory-pressure shrinkers.
+//
+// A cache that can give memory back registers a shrinker (typically a
+// static object, which registers itself when constructed).  Each core
+// runs a reclaimer thread that wakes up every RECLAIM_INTERVAL_MS, or
+// right away when kalloc() finds the core's local memory exhausted.
+// Once the memory local to the core drops below RECLAIM_LOW_PCT
+// percent free, the reclaimer asks every shrinker to scan on behalf of
+// that core, a round at a time, until free memory is back above
+// RECLAIM_HIGH_PCT percent or a round frees nothing.
+
+class shrinker
+{
+public:
+  explicit shrinker(const char *name);
+
+  // Roughly how many objects this could free for CPU cpu.
+  virtual size_t count(int cpu) = 0;
+
+  // Try to free up to nr objects on behalf of CPU cpu.  Returns the
+  // number freed.  Called from cpu's reclaimer thread, which may
+  // sleep.
+  virtual size_t scan(int cpu, size_t nr) = 0;
+
+  // Called by cpu's reclaimer on each wakeup without memory pressure,
+  // for housekeeping.
+  virtual void idle(int cpu) { }
+
+  const char *name() const { return name_; }
+
+private:
+  friend void reclaim_run(int cpu);
+  friend void reclaim_idle(int cpu);
+  friend void shrinker_print(print_stream *s);
+
+  const char *name_;
+  shrinker *next_;
+  u64 nscanned_, nfreed_;
+};
+
+// Wake up CPU cpu's reclaimer, if it isn't already awake.
+void kick_reclaim(int cpu);
+
+// Start the per-core reclaimer threads.
+void init_reclaim(void);
+
+// Print the shrinkers' statistics (for /dev/kmemstats).
+void shrinker_print(print_stream *s);
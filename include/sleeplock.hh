@@ -2,11 +2,43 @@
 
 #include "spinlock.hh"
 #include "condvar.hh"
+#include "lockprof.hh"
 
+#include <atomic>
+
+// A lock that may be held across sleeps.
+//
+// Most sleeplock critical sections are short, so an acquire that
+// finds the lock held first spins for as long as the holder is
+// running on another core (up to SLEEPLOCK_SPIN_MAX pauses), and only
+// sleeps if the holder is not running or takes too long.  Uncontended
+// acquires and releases don't touch the spinlock at all.
+//
+// Named sleeplocks are covered by the lock profile (see lockprof.hh).
 class sleeplock {
  public:
   NEW_DELETE_OPS(sleeplock);
-  sleeplock() : held_(false) {}
+  sleeplock()
+    : held_(false), nwaiters_(0), owner_(nullptr), owner_cpu_(0),
+      name_(nullptr), prof_ts_(0)
+#if LOCKSTAT
+    , stat_(nullptr), locked_ts_(0)
+#endif
+  {}
+
+  // Create a named sleeplock.  If lockstat, LOCKSTAT records its
+  // contention, alongside the spinlocks.
+  sleeplock(const char *name, bool lockstat = false)
+    : spinlock_(name), cv_(name), held_(false), nwaiters_(0),
+      owner_(nullptr), owner_cpu_(0), name_(name), prof_ts_(0)
+#if LOCKSTAT
+    , stat_(lockstat ? &klockstat_lazy : nullptr), locked_ts_(0)
+#endif
+  {}
+
+#if LOCKSTAT
+  ~sleeplock();
+#endif
 
   void check_locking_context_is_safe() {
     if (mycpu()->ncli != 0)
@@ -15,28 +47,52 @@ class sleeplock {
 
   void acquire() {
     check_locking_context_is_safe();
-    scoped_acquire x(&spinlock_);
-    while (held_)
-      cv_.sleep(&spinlock_);
-    held_ = true;
+    if (!try_lock()) {
+      acquire_slow();
+      return;
+    }
+    set_owner();
+    if (lockprof_on())
+      prof_acquired(0, 0);
+#if LOCKSTAT
+    if (stat_)
+      lockstat_acquired(0, false, false);
+#endif
   }
 
   bool try_acquire() {
     // We don't call check_locking_context_is_safe() here to avoid
     // false-positives: it _is_ safe to try-acquire a sleeplock while
     // holding a spinlock.
-    scoped_acquire x(&spinlock_);
-    if (held_)
+    if (!try_lock())
       return false;
-    held_ = true;
+    set_owner();
+    if (lockprof_on())
+      prof_acquired(0, 0);
+#if LOCKSTAT
+    if (stat_)
+      lockstat_acquired(0, false, false);
+#endif
     return true;
   }
 
   void release() {
-    scoped_acquire x(&spinlock_);
     assert(held_);
-    held_ = false;
-    cv_.wake_all();
+    if (prof_ts_)
+      prof_released();
+#if LOCKSTAT
+    if (stat_)
+      lockstat_released();
+#endif
+    owner_.store(nullptr, std::memory_order_relaxed);
+    // Sequentially consistent with the waiters' increment of
+    // nwaiters_ and their try_lock(), so either they see the lock free
+    // or we see them waiting.
+    held_.store(false);
+    if (nwaiters_.load() != 0) {
+      scoped_acquire x(&spinlock_);
+      cv_.wake_all();
+    }
   }
 
   lock_guard<sleeplock> guard() {
@@ -51,12 +107,50 @@ class sleeplock {
   sleeplock(const sleeplock &o) = delete;
   sleeplock &operator=(const sleeplock &o) = delete;
 
-  // Sleeplocks can be moved.
-  sleeplock(sleeplock &&o) = default;
-  sleeplock &operator=(sleeplock &&o) = default;
+  // Sleeplocks can be moved (though not while held or waited on).
+  sleeplock(sleeplock &&o);
+  sleeplock &operator=(sleeplock &&o);
 
  private:
+  bool try_lock() {
+    bool expected = false;
+    return !held_.load(std::memory_order_relaxed) &&
+      held_.compare_exchange_strong(expected, true);
+  }
+
+  // Record the holder, for waiters deciding whether to spin.
+  void set_owner() {
+    owner_cpu_.store(myid(), std::memory_order_relaxed);
+    owner_.store(myproc(), std::memory_order_relaxed);
+  }
+
+  void acquire_slow();
+  void prof_acquired(u64 wait, uptr site);
+  void prof_released();
+#if LOCKSTAT
+  u64 lockstat_ts();
+  void lockstat_acquired(u64 locking_ts, bool spun, bool slept);
+  void lockstat_released();
+#else
+  u64 lockstat_ts() { return 0; }
+  void lockstat_acquired(u64 locking_ts, bool spun, bool slept) { }
+#endif
+
   spinlock spinlock_;
   condvar cv_;
-  bool held_;
+  std::atomic<bool> held_;
+  // Procs sleeping (or about to sleep) in acquire_slow()
+  std::atomic<u32> nwaiters_;
+  // The holder and the CPU it acquired the lock on.  Only a hint:
+  // it's set just after the lock is taken and cleared just before
+  // it's released.
+  std::atomic<struct proc*> owner_;
+  std::atomic<int> owner_cpu_;
+  const char *name_;
+  // When the holder acquired the lock, if the lock profile was on then
+  u64 prof_ts_;
+#if LOCKSTAT
+  struct klockstat *stat_;
+  u64 locked_ts_;
+#endif
 };
@@ -8,8 +8,10 @@
 
 namespace locked_snzi
 {
-  class referenced
+  // The node tree shared by the SNZI variants below.
+  class tree
   {
+  protected:
     enum {
       LEVELS = ceil_log2_const(NCPU) + 1,
       FIRST_LEAF = (1 << (LEVELS - 1)) - 1
@@ -30,7 +32,7 @@ namespace locked_snzi
       spinlock lock;
       uint64_t val;
 
-      constexpr node() : lock("locked_snzi::referenced::node"), val(0) {}
+      constexpr node() : lock("locked_snzi::node"), val(0) {}
     } nodes[FIRST_LEAF + NCPU];
 
     /// Return the parent of @c nodes[n].
@@ -52,8 +54,13 @@ namespace locked_snzi
       return ((n + 1) ^ 1) - 1;
     }
 
+    tree() : nodes{} { }
+  };
+
+  class referenced : private tree
+  {
   public:
-    referenced() : nodes{} { }
+    referenced() { }
 
     referenced(const referenced &o) = delete;
     referenced(referenced &&o) = delete;
@@ -132,6 +139,129 @@ namespace locked_snzi
     virtual ~referenced() { }
     virtual void onzero() { delete this; }
   };
+
+  // A count with immediate zero detection, for counts that are
+  // incremented on one core and decremented on another, like link
+  // counts.  Each core's leaf counts the increments made there, less
+  // the decrements taken from it, and each inner node counts its
+  // non-zero children, so the count is zero exactly when the root is.
+  // A decrement takes from its own core's leaf when it can and
+  // otherwise from any non-zero leaf.
+  //
+  // onzero() and onnonzero() are called with the root locked, so they
+  // are ordered with each other even if the count keeps coming back.
+  class counter : private tree
+  {
+    // Arrive at leaf, which is locked, releasing it.
+    void arrive(std::size_t n)
+    {
+      while (true) {
+        if (nodes[n].val++) {
+          nodes[n].lock.release();
+          return;
+        } else if (n == 0) {
+          // Transitioned from zero to non-zero at root
+          onnonzero();
+          nodes[n].lock.release();
+          return;
+        }
+        std::size_t next = parent(n);
+        nodes[next].lock.acquire();
+        nodes[n].lock.release();
+        n = next;
+      }
+    }
+
+    // Depart from leaf, which is locked and non-zero, releasing it.
+    void depart(std::size_t n)
+    {
+      while (true) {
+        assert(nodes[n].val);
+        if (--nodes[n].val) {
+          nodes[n].lock.release();
+          return;
+        } else if (n == 0) {
+          // Transitioned from non-zero to zero at root
+          onzero();
+          nodes[n].lock.release();
+          return;
+        }
+        std::size_t next = parent(n);
+        nodes[next].lock.acquire();
+        nodes[n].lock.release();
+        n = next;
+      }
+    }
+
+  public:
+    // Start with a count of n, on this core's leaf.  This doesn't call
+    // onnonzero().
+    counter(uint64_t n = 1)
+    {
+      if (!n)
+        return;
+      std::size_t node = myid() + FIRST_LEAF;
+      nodes[node].val = n;
+      while (node) {
+        node = parent(node);
+        nodes[node].val = 1;
+      }
+    }
+    virtual ~counter() { }
+
+    counter(const counter &o) = delete;
+    counter(counter &&o) = delete;
+    counter &operator=(const counter &o) = delete;
+    counter &operator=(counter &&o) = delete;
+
+    void inc()
+    {
+      std::size_t node = myid() + FIRST_LEAF;
+      nodes[node].lock.acquire();
+      arrive(node);
+    }
+
+    // The caller must hold one of the counts being dropped, so some
+    // leaf is non-zero; another core's decrement can take the one we
+    // were about to, so keep looking until we find one.
+    void dec()
+    {
+      std::size_t mine = myid();
+      for (std::size_t i = 0; ; i = (i + 1) % NCPU) {
+        std::size_t node = (mine + i) % NCPU + FIRST_LEAF;
+        if (i && !nodes[node].val)
+          continue;
+        nodes[node].lock.acquire();
+        if (nodes[node].val) {
+          depart(node);
+          return;
+        }
+        nodes[node].lock.release();
+      }
+    }
+
+    // The sum of the leaves.  This locks every leaf, so it costs
+    // O(NCPU) and contends with updates.
+    uint64_t get_consistent()
+    {
+      if (!nodes[0].val)
+        return 0;
+      // Decrements only ever lock a leaf and then its ancestors, so
+      // taking all of the leaves in order can't deadlock.
+      uint64_t n = 0;
+      for (std::size_t i = 0; i < NCPU; i++)
+        nodes[i + FIRST_LEAF].lock.acquire();
+      for (std::size_t i = 0; i < NCPU; i++) {
+        n += nodes[i + FIRST_LEAF].val;
+        nodes[i + FIRST_LEAF].lock.release();
+      }
+      return n;
+    }
+
+  protected:
+    virtual void onzero() = 0;
+    virtual void onnonzero() = 0;
+  };
 }
 
 #if 0
@@ -0,0 +1,112 @@
+#pragma once
+
+// Fork-join task groups, run by a pinned worker thread on each core.
+//
+// Unlike a dwork, a task runs in a thread and may sleep (read the
+// disk, take sleeplocks, wait for a journal), so task groups suit the
+// FS's maintenance work.  A task_group spawns tasks onto chosen cores
+// -- for the FS, usually the core whose journal the task writes into
+// -- and wait() returns once all of them have finished.  Tasks for the
+// calling core (and any spawned before the workers start) run in
+// wait() on the calling thread.
+//
+//   task_group g;
+//   for (int c = 0; c < ncpu; c++)
+//     g.spawn(c, [&, c]() { work(c); });
+//   g.wait();
+//
+// cancel() makes the group skip the tasks that haven't started yet;
+// long tasks can poll cancelled() to stop early.  Tasks must not wait
+// on task groups themselves, since every worker could end up waiting.
+
+#include "spinlock.hh"
+#include "condvar.hh"
+
+#include <atomic>
+#include <type_traits>
+#include <utility>
+
+class task_group;
+
+struct task
+{
+  task() : next_(nullptr), group_(nullptr) { }
+  virtual ~task() { }
+  virtual void run() = 0;
+
+  task *next_;
+  task_group *group_;
+};
+
+class task_group
+{
+public:
+  task_group()
+    : lock_("task_group"), cv_("task_group"), pending_(0),
+      local_(nullptr), local_tail_(nullptr), cancelled_(false) { }
+  ~task_group() { wait(); }
+
+  task_group(const task_group&) = delete;
+  task_group& operator=(const task_group&) = delete;
+
+  // Run fn() on CPU cpu.  A cpu outside [0, ncpu) means wherever is
+  // convenient, which is the calling thread.
+  template<class F>
+  void spawn(int cpu, F &&fn)
+  {
+    submit(cpu, new fn_task<typename std::decay<F>::type>(
+             std::forward<F>(fn)));
+  }
+
+  // Wait for all spawned tasks to finish (or be skipped).  Returns
+  // false if the group was cancelled.
+  bool wait();
+
+  void cancel() { cancelled_ = true; }
+  bool cancelled() const { return cancelled_; }
+
+  // Run t, which belongs to some group, and retire it.
+  static void run(task *t);
+
+private:
+  template<class F>
+  struct fn_task : public task
+  {
+    F fn_;
+    explicit fn_task(F &&fn) : fn_(std::move(fn)) { }
+    explicit fn_task(const F &fn) : fn_(fn) { }
+    void run() override { fn_(); }
+    NEW_DELETE_OPS(fn_task);
+  };
+
+  void submit(int cpu, task *t);
+
+  spinlock lock_;
+  condvar cv_;
+  int pending_;
+  task *local_, *local_tail_;
+  std::atomic<bool> cancelled_;
+};
+
+// Run fn(i) for each i in [0, n), iteration i on CPU cpu_of(i), and
+// wait for all of them.
+template<class F, class C>
+void
+parallel_for(size_t n, F fn, C cpu_of)
+{
+  task_group g;
+  for (size_t i = 0; i < n; i++)
+    g.spawn(cpu_of(i), [&fn, i]() { fn(i); });
+  g.wait();
+}
+
+// Likewise, with iteration i on CPU i % ncpu.
+template<class F>
+void
+parallel_for(size_t n, F fn)
+{
+  parallel_for(n, fn, [](size_t i) { return (int)(i % ncpu); });
+}
+
+// Start the per-core task workers.
+void init_taskgroups(void);
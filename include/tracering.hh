@@ -0,0 +1,103 @@
+#pragma once
+
+#include "percpu.hh"
+#include "spinlock.hh"
+#include "critical.hh"
+
+// Per-core rings of N fixed-size trace records of type T, for tracing hot
+// paths without any locks or shared cache lines.  Each core logs into its
+// own ring with interrupts off, overwriting its oldest records; readers
+// drain the records logged since the last drain, core by core, under a
+// lock.  See txtrace.cc and disk.cc.
+template<class T, u64 N>
+class tracering
+{
+public:
+  tracering() : lock_("tracering") {}
+
+  // Allocate the rings.  Until then, log() drops records.
+  void init(const char *name)
+  {
+    for (int c = 0; c < ncpu; c++) {
+      auto recs = (T*)kalloc(name, N * sizeof(T), c);
+      if (!recs)
+        panic("tracering::init: out of memory");
+      rings_[c].recs = recs;
+    }
+  }
+
+  // Log a record on this core: fill(T*) fills it in, with interrupts
+  // off.
+  template<class F>
+  void log(F fill)
+  {
+    scoped_cli cli;
+    ring &r = *rings_;
+    if (!r.recs)
+      return;
+    u64 h = r.head.load(std::memory_order_relaxed);
+    fill(&r.recs[h % N]);
+    r.head.store(h + 1, std::memory_order_release);
+  }
+
+  // Move up to room records into out, and return how many.  If some of a
+  // core's records were overwritten before they could be drained, its
+  // records are preceded by lost(T*, cpu, n), which fills in a record
+  // standing for the n lost ones.
+  template<class L>
+  u32 drain(T *out, u32 room, L lost)
+  {
+    u32 used = 0;
+
+    scoped_acquire l(&lock_);
+    for (int c = 0; c < ncpu && used + 1 < room; c++) {
+      ring &r = rings_[c];
+      if (!r.recs)
+        continue;
+      u64 head = r.head.load(std::memory_order_acquire);
+      u64 nlost = 0;
+      if (head - r.tail > N) {
+        nlost = head - N - r.tail;
+        r.tail = head - N;
+      }
+
+      // Copy after the slot for a lost record, then drop any records the
+      // core overwrote while we were copying them.
+      u64 first = r.tail;
+      u32 k = std::min(head - first, (u64)(room - used - 1));
+      for (u32 i = 0; i < k; i++)
+        out[used + 1 + i] = r.recs[(first + i) % N];
+      std::atomic_thread_fence(std::memory_order_acquire);
+      u64 now = r.head.load(std::memory_order_relaxed);
+      u32 torn = 0;
+      if (now > N && now - N > first)
+        torn = std::min(now - N - first, (u64)k);
+      r.tail = first + k;
+      nlost += torn;
+
+      if (nlost) {
+        memset(&out[used], 0, sizeof(T));
+        lost(&out[used], c, nlost);
+        used++;
+      }
+      memmove(&out[used], &out[used + (nlost ? 0 : 1) + torn],
+              (k - torn) * sizeof(T));
+      used += k - torn;
+    }
+    return used;
+  }
+
+private:
+  struct ring
+  {
+    T *recs;
+    // Records this core has logged, of which the last N are still in
+    // recs.  Only the owning core writes head, with interrupts off.
+    std::atomic<u64> head;
+    // Records drained by readers, under lock_
+    u64 tail;
+  };
+
+  percpu<ring, NO_INT> rings_;
+  spinlock lock_;
+};
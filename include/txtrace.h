@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+
+// Transaction trace.  Each core logs the ScaleFS transaction lifecycle
+// events it handles into a ring of TXTRACE_EVENTS events, overwriting
+// the oldest.  Reading /dev/txtrace drains the events logged since the
+// last read, core by core, as an array of struct txtrace_event;
+// tools/txtrace-report turns a saved drain into per-batch timelines.
+//
+// A batch is named by the enqueue timestamp of its first transaction
+// (the one that was at the head of the commit queue).
+
+enum txtrace_type {
+  // A transaction joined a journal's commit queue.  txn is its enq_tsc,
+  // arg its block count.
+  TXTRACE_ENQUEUE = 1,
+  // The batch txn waits for journal aux to commit up to arg
+  TXTRACE_DEP_WAIT_BEGIN,
+  TXTRACE_DEP_WAIT_END,
+  // The transaction arg was merged into the batch txn
+  TXTRACE_MERGE,
+  // The batch txn, of arg blocks, is being written to the journal, and
+  // is durable there at COMMIT_END
+  TXTRACE_COMMIT_START,
+  TXTRACE_COMMIT_END,
+  // The batch txn is being written to its home locations
+  TXTRACE_APPLY_START,
+  TXTRACE_APPLY_END,
+  // arg events were overwritten before they could be read
+  TXTRACE_LOST,
+};
+
+struct txtrace_event
+{
+  uint64_t tsc;
+  uint64_t txn;
+  uint64_t arg;
+  uint32_t aux;
+  uint8_t type;
+  // The journal the transaction belongs to, and the core that logged
+  // the event
+  uint8_t journal;
+  uint8_t cpu;
+  uint8_t pad;
+};
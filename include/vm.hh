@@ -48,6 +48,10 @@ struct vmdesc : public mmu::page_tracker
 
     // Set if the page should be shared across fork().
     FLAG_SHARED = 1<<5,
+
+    // Set by madvise(MADV_SEQUENTIAL): faults on this file page frame
+    // read ahead of themselves and drop the pages they left behind.
+    FLAG_SEQUENTIAL = 1<<6,
   };
 
   // Flags
@@ -142,16 +146,35 @@ struct vmap : public referenced {
   // truncated (or swapped out). The entry is unset from vpfs_ as well.
   void delete_mapping(uptr addr);
 
+  // Like delete_mapping, for the n pages at the sorted addresses addrs,
+  // with a single TLB shootdown.
+  void delete_mappings(const uptr *addrs, size_t n);
+
   // Unmap a single virtual page, but don't unset it from vpfs_. Clear the
   // mapping from vmdesc. Used while evicting pages from the page-cache.
   void clear_mapping(uptr addr);
 
-  // Populate vmdesc's.
+  // Populate vmdesc's, reading file pages that aren't in memory in
+  // the background first.
   int willneed(uptr start, uptr len);
 
+  // Set (or clear) FLAG_SEQUENTIAL on a range.
+  int set_sequential(uptr start, uptr len, bool seq);
+
+  // Drop the pages of a range, as madvise(MADV_DONTNEED) does: the
+  // next touch faults in zeros for anonymous memory and the file's
+  // contents for a file mapping.  The clean page-cache pages that were
+  // mapped are released from the cache.
+  int dontneed(uptr start, uptr len);
+
   // Invalidate page caches.
   int invalidate_cache(uptr start, uptr len);
 
+  // Fault in a range and pin the page-cache pages it maps, so that
+  // they stay in memory (and mapped) until munlock() or munmap().
+  int mlock(uptr start, uptr len);
+  int munlock(uptr start, uptr len);
+
   // Modify protection on a range.  flags must be 0 or FLAG_MAPPED.
   int mprotect(uptr start, uptr len, uint64_t flags);
 
@@ -167,6 +190,12 @@ struct vmap : public referenced {
   // say, this mapping is only valid within the returned page.
   void* pagelookup(uptr va);
 
+  // Return the anonymous memory page mapped at va, faulting it in if
+  // necessary, with a reference that keeps it allocated even if it is
+  // unmapped, for I/O straight to or from it. If write is set, the page is
+  // the process's own writable copy. Returns null if va is not so mapped.
+  sref<page_info> pin_page(uptr va, bool write);
+
   // Copy len bytes from p to user address va in vmap.  Most useful
   // when vmap is not the current page table.
   int copyout(uptr va, const void *p, u64 len);
@@ -205,6 +234,14 @@ private:
 
   struct spinlock brklock_;
 
+  // The page-cache pages mlock() has pinned, by virtual address
+  // (protected by mlock_lock_).
+  std::vector<std::pair<uptr, sref<page_info>>> mlocked_;
+  struct spinlock mlock_lock_;
+
+  // Unpin the pages mlock() pinned in [start, start+len).
+  void unpin_range(uptr start, uptr len);
+
   enum class access_type
   {
     READ, WRITE
@@ -216,4 +253,24 @@ private:
   // allocated and cannot be.
   page_info *ensure_page(const vpf_array::iterator &it, access_type type,
                          bool *allocated = nullptr);
+
+  // Map the 2MB region around @c va with one large page, if it is a
+  // read-only file mapping of a physically contiguous page-cache span.
+  // Like ensure_page, this may throw blocking_io.
+  bool pagefault_huge(uptr va);
+
+  // Map the 2MB region around @c va with one large page, if it is all
+  // private anonymous memory that is either untouched (in which case
+  // this allocates a 2MB block for it) or already backed by a
+  // physically contiguous block.
+  bool pagefault_huge_anon(uptr va);
+
+  // After a read fault at @c va, map the pages of file mappings around
+  // it that are already in the page cache, so that reading through
+  // them doesn't fault on every page.
+  void fault_around(uptr va);
+
+  // Queue background reads of the file pages in [start, start+len) that
+  // this vmap doesn't have, in batches of up to READAHEAD_MAX_PAGES.
+  void readahead_range(uptr start, uptr len);
 };
@@ -1,10 +1,33 @@
 #pragma once
 
+/*
+ * A hash table of weak references, keyed by K.
+ *
+ * The table is open-addressed with linear probing.  Each slot holds a
+ * pointer to an item and a 16-bit tag from the item's hash, packed into
+ * one word.  Kernel heap pointers all have their top 16 bits set, so
+ * the tag takes their place, and a lookup only dereferences the items
+ * whose tag matches.  The items themselves stay separately allocated:
+ * their weakref's address is registered with the object, so they can't
+ * move.
+ *
+ * Lookups take no locks.  Inserts and removes lock one of NSTRIPES
+ * stripe locks, chosen by the key's hash independently of the table
+ * size.  Removing an item leaves a tombstone in its slot.  Once an
+ * insert has to probe WEAKCACHE_PROBE slots and the table is more than
+ * WEAKCACHE_LOAD_PCT percent full (tombstones included), the table is
+ * rebuilt with twice as many slots as a half-full table would need for
+ * the live items.  The rebuild holds every stripe lock but leaves
+ * lookups running on the old table, which is freed once no reader can
+ * be looking at it any more.
+ */
+
 #include "gc.hh"
 #include "spinlock.hh"
 #include "refcache.hh"
 #include "hash.hh"
 #include "log2.hh"
+#include "percpu.hh"
 
 template<class K, class V>
 class weakcache
@@ -13,105 +36,228 @@ public:
   struct stats
   {
     size_t items;
+    // Slots in the table, and slots holding an item
     size_t total_buckets, used_buckets;
+    // The longest run of non-empty slots, which bounds a lookup's probe
     size_t max_chain;
+    size_t tombstones;
+    size_t resizes;
   };
 
 private:
-  class bucket;
+  enum { NSTRIPES = 1024 };
 
   class item : public rcu_freed
   {
   public:
     const K key_;
     const refcache::weakref<V> weakref_;
-    bucket* const parent_;
-    islink<item> link_;
+    const u64 hash_;
 
-    item(const K& k, V* v, bucket* b)
+    item(const K& k, V* v, u64 h)
       : rcu_freed("weakcache::item", this, sizeof(*this)),
-        key_(k), weakref_(v), parent_(b) {}
+        key_(k), weakref_(v), hash_(h) {}
     void do_gc() override { delete this; }
     NEW_DELETE_OPS(item)
   };
 
-  class bucket
+  // Slot values.  Anything else is an item pointer with its top 16
+  // bits replaced by its tag.
+  static constexpr uintptr_t EMPTY = 0, TOMBSTONE = 1;
+  static constexpr uintptr_t PTR_MASK = (1ull << 48) - 1;
+
+  static u64 mix(const K& k)
   {
-  private:
-    spinlock writelock_;
-    islist<item, &item::link_> chain_;
+    return hash(k) * 0x9e3779b97f4a7c15ull;
+  }
 
-  public:
-    sref<V>
-    lookup(const K& k) const
+  static uintptr_t tag_of(u64 h)
+  {
+    return ((h >> 8) & 0xffff) << 48;
+  }
+
+  static uintptr_t pack(item *i)
+  {
+    assert(((uintptr_t)i & ~PTR_MASK) == ~PTR_MASK);
+    return ((uintptr_t)i & PTR_MASK) | tag_of(i->hash_);
+  }
+
+  static item *unpack(uintptr_t v)
+  {
+    return (item*)(v | ~PTR_MASK);
+  }
+
+  struct table : public rcu_freed
+  {
+    const u64 nslots;
+    const u32 shift;
+    // Allocated from the boot allocator, and never freed
+    const bool early;
+    std::atomic<uintptr_t> *slots;
+
+    table(u64 n, std::atomic<uintptr_t> *s, bool early)
+      : rcu_freed("weakcache::table", this, sizeof(*this)),
+        nslots(n), shift(64 - floor_log2(n)), early(early), slots(s)
     {
-      scoped_gc_epoch reader;
-      for (auto &i: chain_) {
-        if (!(i.key_ == k))
-          continue;
-        return i.weakref_.get();
-      }
-      return sref<V>();
+      _rcu_size += n * sizeof *slots;
+      memset(slots, 0, n * sizeof *slots);
     }
 
-    bool
-    insert(const K& k, V* v)
+    static std::atomic<uintptr_t> *early_slots(u64 n)
     {
-      scoped_acquire l(&writelock_);
-      for (auto &i: chain_)
-        if (i.key_ == k)
-          return false;
+      void *s = early_kalloc(n * sizeof *slots, PGSIZE);
+      if (!s)
+        throw_bad_alloc();
+      return (std::atomic<uintptr_t>*)s;
+    }
 
-      chain_.push_front(new item(k, v, this));
-      return true;
+    static table *alloc(u64 n)
+    {
+      auto s = (std::atomic<uintptr_t>*)kalloc("weakcache::table",
+                                               n * sizeof *slots);
+      if (!s)
+        return nullptr;
+      return new table(n, s, false);
     }
 
-    void
-    remove(item* victim)
+    void do_gc() override
     {
-      scoped_acquire l(&writelock_);
-      auto i = chain_.before_begin();
-      auto end = chain_.end();
-      for (;;) {
-        auto prev = i;
-        ++i;
-        assert(i != end);
-        if (&*i == victim) {
-          chain_.erase_after(prev);
-          gc_delayed(victim);
-          return;
+      kfree(slots, nslots * sizeof *slots);
+      delete this;
+    }
+    NEW_DELETE_OPS(table);
+
+    u64 home(u64 h) const { return h >> shift; }
+    u64 next(u64 i) const { return (i + 1) & (nslots - 1); }
+
+    item *find(const K& k, u64 h) const
+    {
+      uintptr_t tag = tag_of(h);
+      for (u64 i = home(h), n = 0; n < nslots; i = next(i), n++) {
+        uintptr_t v = slots[i].load(std::memory_order_acquire);
+        if (v == EMPTY)
+          break;
+        if (v == TOMBSTONE || (v & ~PTR_MASK) != tag)
+          continue;
+        item *it = unpack(v);
+        if (it->key_ == k)
+          return it;
+      }
+      return nullptr;
+    }
+
+    // Put it in the first free slot of its probe sequence, without
+    // checking for its key.  Returns the number of slots probed, or
+    // nslots if the table is full.  Sets *tomb if the slot was a
+    // tombstone.
+    u64 place(item *it, bool *tomb)
+    {
+      for (u64 i = home(it->hash_), n = 0; n < nslots; i = next(i), n++) {
+        uintptr_t v = slots[i].load(std::memory_order_relaxed);
+        // Other stripes' inserts may race for free slots
+        while (v == EMPTY || v == TOMBSTONE) {
+          if (slots[i].compare_exchange_weak(v, pack(it))) {
+            *tomb = v == TOMBSTONE;
+            return n;
+          }
         }
       }
+      return nslots;
     }
 
-    void
-    update_stats(struct stats *stats) const
+    // Replace its slot with a tombstone.  Returns false if it isn't
+    // in the table.
+    bool erase(item *it)
     {
-      size_t my_items = 0;
-      for (auto it = chain_.begin(), end = chain_.end(); it != end; ++it)
-        ++my_items;
-      stats->items += my_items;
-      if (my_items)
-        stats->used_buckets += 1;
-      if (my_items > stats->max_chain)
-        stats->max_chain = my_items;
+      uintptr_t pv = pack(it);
+      for (u64 i = home(it->hash_), n = 0; n < nslots; i = next(i), n++) {
+        uintptr_t v = slots[i].load(std::memory_order_relaxed);
+        if (v == EMPTY)
+          break;
+        if (v == pv) {
+          slots[i].store(TOMBSTONE, std::memory_order_release);
+          return true;
+        }
+      }
+      return false;
     }
   };
 
-  const uintptr_t mask_;
-  bucket *buckets_;
+  const u64 min_slots_;
+  table initial_;
+  std::atomic<table*> table_;
+  struct stripe_lock {
+    spinlock lock __mpalign__;
+  } stripes_[NSTRIPES];
+  spinlock resize_lock_;
+  u64 nresizes_;
+  // Items and tombstones in the current table, spread over the cores
+  // that made them.
+  percpu<std::atomic<s64>> count_, tombs_;
+
+  spinlock *stripe(u64 h)
+  {
+    return &stripes_[(h >> 20) % NSTRIPES].lock;
+  }
+
+  static s64 sum(const percpu<std::atomic<s64>> &c)
+  {
+    s64 n = 0;
+    for (int i = 0; i < NCPU; i++)
+      n += c[i];
+    return n;
+  }
+
+  // Replace table t, if still current, with one sized for its live
+  // items, which also drops its tombstones.
+  void resize(table *t)
+  {
+    scoped_acquire rl(&resize_lock_);
+    if (table_.load() != t)
+      return;
+
+    for (auto &s : stripes_)
+      s.lock.acquire();
+    auto cleanup = scoped_cleanup([this]() {
+        for (auto &s : stripes_)
+          s.lock.release();
+      });
+
+    s64 live = sum(count_);
+    u64 n = min_slots_;
+    while ((u64)live * 200 > n * WEAKCACHE_LOAD_PCT)
+      n *= 2;
+    table *nt = table::alloc(n);
+    if (!nt)
+      return;
+    for (u64 i = 0; i < t->nslots; i++) {
+      uintptr_t v = t->slots[i].load(std::memory_order_relaxed);
+      if (v != EMPTY && v != TOMBSTONE) {
+        bool tomb;
+        nt->place(unpack(v), &tomb);
+      }
+    }
+    table_.store(nt);
+    for (int i = 0; i < NCPU; i++)
+      tombs_[i] = 0;
+    nresizes_++;
+
+    if (!t->early)
+      gc_delayed(t);
+  }
 
 public:
-  // Construct a weak cache whose bucket array fits in size bytes.
-  // This must be called before initkalloc since it requires large,
-  // raw allocations from the boot allocator.
+  // Construct a weak cache whose initial table fits in size bytes.
+  // The table never shrinks below that.  This must be called before
+  // initkalloc since it requires large, raw allocations from the boot
+  // allocator.
   weakcache(std::size_t size)
-    : mask_(round_down_to_pow2(size / sizeof *buckets_) - 1)
+    : min_slots_(round_down_to_pow2(size / sizeof(uintptr_t))),
+      initial_(min_slots_, table::early_slots(min_slots_), true),
+      table_(&initial_), nresizes_(0)
   {
-    buckets_ = (bucket*)early_kalloc((mask_ + 1) * sizeof *buckets_, PGSIZE);
-    if (!buckets_)
-      throw_bad_alloc();
-    new (buckets_) bucket[mask_ + 1];
+    for (int i = 0; i < NCPU; i++)
+      count_[i] = tombs_[i] = 0;
   }
 
   ~weakcache()
@@ -127,13 +273,57 @@ public:
   sref<V>
   lookup(const K& k) const
   {
-    return buckets_[hash(k) & mask_].lookup(k);
+    scoped_gc_epoch reader;
+    item *i = table_.load()->find(k, mix(k));
+    return i ? i->weakref_.get() : sref<V>();
+  }
+
+  // Look up k without taking a reference to its object; see
+  // refcache::weakref::peek().
+  V*
+  peek(const K& k) const
+  {
+    scoped_gc_epoch reader;
+    item *i = table_.load()->find(k, mix(k));
+    return i ? i->weakref_.peek() : nullptr;
   }
 
   bool
   insert(const K& k, V* v)
   {
-    return buckets_[hash(k) & mask_].insert(k, v);
+    u64 h = mix(k);
+    item *it = new item(k, v, h);
+    for (;;) {
+      table *t;
+      u64 probe;
+      bool tomb;
+      {
+        scoped_acquire l(stripe(h));
+        t = table_.load();
+        if (t->find(k, h)) {
+          delete it;
+          return false;
+        }
+        probe = t->place(it, &tomb);
+      }
+      if (probe == t->nslots) {
+        // Full.  Grow (or at least clear out the tombstones) and try
+        // again.
+        resize(t);
+        if (table_.load() == t)
+          panic("weakcache: table full");
+        continue;
+      }
+
+      ++*count_.get_unchecked();
+      if (tomb)
+        --*tombs_.get_unchecked();
+      if (probe >= WEAKCACHE_PROBE &&
+          (u64)(sum(count_) + sum(tombs_)) * 100 >
+          t->nslots * WEAKCACHE_LOAD_PCT)
+        resize(t);
+      return true;
+    }
   }
 
   void
@@ -141,16 +331,40 @@ public:
   {
     refcache::weakref<V>* vrefp = reinterpret_cast<refcache::weakref<V>*>(refp);
     item* i = container_from_member(vrefp, &item::weakref_);
-    i->parent_->remove(i);
+    {
+      scoped_acquire l(stripe(i->hash_));
+      if (!table_.load()->erase(i))
+        panic("weakcache::cleanup: item not found");
+      --*count_.get_unchecked();
+      ++*tombs_.get_unchecked();
+    }
+    gc_delayed(i);
   }
 
   struct stats
   get_stats() const
   {
     struct stats res{};
-    res.total_buckets = mask_ + 1;
-    for (std::size_t i = 0; i < mask_ + 1; ++i)
-      buckets_[i].update_stats(&res);
+    scoped_gc_epoch reader;
+    table *t = table_.load();
+    res.total_buckets = t->nslots;
+    res.resizes = nresizes_;
+    size_t run = 0;
+    for (u64 i = 0; i < t->nslots; i++) {
+      uintptr_t v = t->slots[i].load(std::memory_order_relaxed);
+      if (v == EMPTY) {
+        run = 0;
+        continue;
+      }
+      if (++run > res.max_chain)
+        res.max_chain = run;
+      if (v == TOMBSTONE) {
+        res.tombstones++;
+      } else {
+        res.items++;
+        res.used_buckets++;
+      }
+    }
     return res;
   };
 };
@@ -1,7 +1,6 @@
 #pragma once
 
 #include "sched.hh"
-#include "ilist.hh"
 
 // Structures for deferring work.  The deferrred work must not go to block/sleep.
 // If it goes to sleep, create a thread and pin it on the desired core.
@@ -9,7 +8,7 @@
 struct dwork {
   dwork() {}
   virtual void run() = 0;
-  islink<dwork> link_;
+  dwork *next_;   // Link in a core's dwork queue
 };
 
 struct dwframe {
@@ -0,0 +1,25 @@
+#pragma once
+
+// Compression and decompression of the clusters of compressed files (see
+// SB_COMPRESS in fs.h), with the in-tree zlib. Each core has a deflate
+// stream of its own, and an inflate stream with the last cluster it
+// decompressed, so that reading a cluster's blocks one after another (as
+// readi() and mfile::load_pages() do) decompresses it once.
+
+// Compress the first rawlen bytes of the cluster made of the pages at
+// pages[0..npages), into dst, which has room for ZCLUSTER_BYTES. Returns
+// the size of the compressed cluster, its struct dzcluster included, or 0
+// if compressing it doesn't save a block. The blocks past that size that
+// the last one is part of are zeroed.
+u32 zcluster_compress(const char *const *pages, u32 npages, u32 rawlen,
+                      char *dst);
+
+// Copy the n bytes at offset off of the uncompressed cluster that is
+// stored compressed in the nblocks disk blocks from addr, to dst. Bytes past
+// what the cluster decompresses to read as zeros.
+void zcluster_read(u32 dev, u32 addr, u32 nblocks, u32 off, char *dst, u32 n);
+
+// Forget the clusters that the cores have decompressed, so that freed
+// blocks of a compressed cluster can't be read back from memory once they
+// hold something else.
+void zcluster_forget(void);
@@ -4,3 +4,8 @@
 
 int zlib_decompress(unsigned char *src, u64 srclen, u64 dstlen,
                     void (*copy_output)(const char *buf, u64 offset, u64 size));
+
+// zalloc and zfree for the kernel's zlib streams; opaque is the name that
+// the memory is charged to.
+void *zlib_alloc(void *opaque, unsigned count, unsigned nbytes);
+void zlib_free(void *opaque, void *p);
@@ -56,8 +56,15 @@ public:
   void awritev(kiovec *iov, int iov_cnt, u64 off,
               sref<disk_completion> dc) override;
   void aflush(sref<disk_completion> dc) override;
+  u32 max_discard_extents() override;
+  u64 max_discard_bytes() override;
+  void adiscard(const disk_extent *ext, u32 n,
+                sref<disk_completion> dc) override;
+  void print_stats() override;
+  void poll() override;
 
   void handle_port_irq();
+  void reap_cmdslots();
   void handle_error();
   void read_error_log();
 
@@ -69,6 +76,13 @@ private:
   volatile ahci_reg_port *const preg;
   ahci_port_mem *portmem;
   int num_cmdslots;
+  bool ncq; // Reads and writes are issued as NCQ (FPDMA QUEUED) commands.
+
+  // The LBA range entries of the outstanding TRIM, upto trim_blocks 512-byte
+  // blocks of them, or null if the disk can't TRIM. TRIMs are issued as
+  // exclusive commands, so only one uses the buffer at a time.
+  u64 *trim_buf;
+  u32 trim_blocks;
 
   u64 fill_prd(int cmdslot, void* addr, u64 nbytes);
   u64 fill_prd_v(int, kiovec* iov, int iov_cnt);
@@ -87,6 +101,20 @@ private:
   condvar cmdslot_alloc_cv;
   sref<disk_completion> cmdslot_dc[32];
 
+  // The number of allocated command slots, and the slot of the non-NCQ command
+  // that is outstanding (or about to be issued) while NCQ is in use, or -1.
+  // Once a non-NCQ command claims exclusive_slot, no other command is issued
+  // until it completes. Protected by cmdslot_alloc_lock.
+  int inflight;
+  int exclusive_slot;
+  bool exclusive_pending; // A non-NCQ command is waiting for the queue to drain.
+
+  // Queue-depth statistics. Protected by cmdslot_alloc_lock.
+  u64 stat_cmds;       // Commands issued.
+  u64 stat_depth_sum;  // Sum of the queue depths at which they were issued.
+  int stat_max_depth;
+  u64 stat_drains;     // Non-NCQ commands that waited for the queue to drain.
+
   int alloc_cmdslot(sref<disk_completion> dc, bool no_pending_ncq = false);
 
   void blocking_wait(sref<disk_completion> dc) {
@@ -120,6 +148,7 @@ private:
 
 public:
   const int ncs;  // max number of command slots in each port
+  const bool sncq; // whether the HBA supports Native Command Queuing
 };
 
 void
@@ -150,7 +179,8 @@ ahci_hba::attach(struct pci_func *pcif)
 ahci_hba::ahci_hba(struct pci_func *pcif)
   : membase(pcif->reg_base[5]),
     reg((ahci_reg*) p2v(membase)),
-    ncs(((reg->g.cap >> AHCI_CAP_NCS_SHIFT) & AHCI_CAP_NCS_MASK) + 1)
+    ncs(((reg->g.cap >> AHCI_CAP_NCS_SHIFT) & AHCI_CAP_NCS_MASK) + 1),
+    sncq(reg->g.cap & AHCI_CAP_SNCQ)
 {
   reg->g.ghc |= AHCI_GHC_AE;
 
@@ -163,7 +193,11 @@ ahci_hba::ahci_hba(struct pci_func *pcif)
   irq ahci_irq;
 
 #ifdef HW_ben
-  ahci_irq = pci_map_msi_irq(pcif);
+  // MSI doesn't allow steering the interrupts of the individual ports (all the
+  // messages of a function go to the same CPU), so spread whole controllers
+  // across the CPUs instead.
+  static int nhba;
+  ahci_irq = pci_map_msi_irq(pcif, (AHCI_IRQ_CPU + nhba++) % ncpu);
 #endif
 
   if (!ahci_irq.valid()) {
@@ -214,7 +248,10 @@ ata_byteswap(char* buf, u64 len)
 
 
 ahci_port::ahci_port(ahci_hba *h, int p, volatile ahci_reg_port* reg)
-  : hba(h), pid(p), preg(reg), num_cmdslots(0), cmds_issued(0), last_cmdslot(-1)
+  : hba(h), pid(p), preg(reg), num_cmdslots(0), ncq(false),
+    trim_buf(nullptr), trim_blocks(0), cmds_issued(0),
+    last_cmdslot(-1), inflight(0), exclusive_slot(-1), exclusive_pending(false),
+    stat_cmds(0), stat_depth_sum(0), stat_max_depth(0), stat_drains(0)
 {
   // Round up the size to make it an integral multiple of PGSIZE.
   // Crashes on boot otherwise.
@@ -319,15 +356,28 @@ ahci_port::ahci_port(ahci_hba *h, int p, volatile ahci_reg_port* reg)
   }
 
   /* Check support for Native Command Queueing */
-  if (!(id_buf.id.sata_caps & IDE_SATA_NCQ_SUPPORTED)) {
+  num_cmdslots = hba->ncs;
+  if (!(id_buf.id.sata_caps & IDE_SATA_NCQ_SUPPORTED) || !hba->sncq) {
     cprintf("AHCI: port %d: SATA Native Command Queuing not supported\n", pid);
-    return;
+  } else if (USE_SATA_NCQ) {
+    ncq = true;
+    int depth = 1 + (id_buf.id.queue_depth & IDE_SATA_NCQ_QUEUE_DEPTH);
+    if (depth < hba->ncs) {
+      cprintf("AHCI: port %d: NCQ queue depth limited to %d (out of %d)\n",
+              pid, depth, hba->ncs);
+      num_cmdslots = depth;
+    }
   }
 
-  num_cmdslots = 1 + (id_buf.id.queue_depth & IDE_SATA_NCQ_QUEUE_DEPTH);
-  if (num_cmdslots < hba->ncs)
-    cprintf("AHCI: port %d: NCQ queue depth limited to %d (out of %d)\n",
-            pid, num_cmdslots, hba->ncs);
+  /* Check support for TRIM */
+  if (id_buf.id.dsm_caps & IDE_DSM_TRIM_SUPPORTED) {
+    // 0 means that the disk doesn't say how many blocks of entries it takes,
+    // in which case only one is safe.
+    trim_blocks = std::max<u32>(1, std::min<u32>(id_buf.id.dsm_max_blocks,
+                                                 PGSIZE / 512));
+    trim_buf = (u64*) kalloc("ahci_trim");
+    assert(trim_buf);
+  }
 
   /* Enable write-caching, read look-ahead */
   memset(&fis, 0, sizeof(fis));
@@ -412,15 +462,27 @@ ahci_port::alloc_cmdslot(sref<disk_completion> dc, bool no_pending_ncq)
 {
   scoped_acquire a(&cmdslot_alloc_lock);
 
+  // Nothing may be issued while a non-NCQ command is in flight or waiting for
+  // the NCQ commands ahead of it to drain. Letting new commands in while it
+  // waits would starve it, and since commands are issued after the slot is
+  // allocated (outside this lock), they could even end up mixed with it.
+  while (exclusive_pending || exclusive_slot >= 0)
+    cmdslot_alloc_cv.sleep(&cmdslot_alloc_lock);
+
   if (no_pending_ncq) {
     // Make sure that no NCQ commands are still in flight. This is primarily
     // used so that FLUSH CACHE (EXT) commands (which are not NCQ commands) are
     // not mixed with NCQ commands such as READ/WRITE FPDMA QUEUED. (The spec
     // mandates that non-NCQ commands must not be issued while any NCQ command
-    // is still outstanding).
+    // is still outstanding). Commands that have been allocated a slot but not
+    // issued yet count as outstanding too.
 
-    while (preg->ci || preg->sact)
+    if (inflight)
+      stat_drains++;
+    exclusive_pending = true;
+    while (inflight || preg->ci || preg->sact)
       cmdslot_alloc_cv.sleep(&cmdslot_alloc_lock);
+    exclusive_pending = false;
   }
 
   for (;;) {
@@ -434,6 +496,13 @@ ahci_port::alloc_cmdslot(sref<disk_completion> dc, bool no_pending_ncq)
 
         cmdslot_dc[cmdslot] = dc;
         last_cmdslot = cmdslot;
+        if (no_pending_ncq)
+          exclusive_slot = cmdslot;
+
+        inflight++;
+        stat_cmds++;
+        stat_depth_sum += inflight;
+        stat_max_depth = std::max(stat_max_depth, inflight);
         return cmdslot;
       }
 
@@ -603,7 +672,14 @@ ahci_port::handle_port_irq()
 #endif
 
   preg->is = ~0;
+  reap_cmdslots();
+}
 
+// Notify the completions of the commands that the disk has finished. Caller
+// must hold cmdslot_alloc_lock.
+void
+ahci_port::reap_cmdslots()
+{
   for (int cmdslot = 0; cmdslot < 32; cmdslot++) {
 
     if (cmdslot_dc[cmdslot] && (cmds_issued & (1 << cmdslot)) &&
@@ -612,12 +688,28 @@ ahci_port::handle_port_irq()
       cmdslot_dc[cmdslot]->notify();
       cmdslot_dc[cmdslot].reset();
       cmds_issued &= ~(1 << cmdslot);
+      inflight--;
+      if (cmdslot == exclusive_slot)
+        exclusive_slot = -1;
 
       cmdslot_alloc_cv.wake_all();
     }
   }
 }
 
+void
+ahci_port::poll()
+{
+  // This doesn't wait for cmdslot_alloc_lock, so that pollers don't pile up
+  // on it behind the interrupt handler (or each other); whoever holds it is
+  // about to reap the completed commands anyway. The interrupt status is left
+  // for the interrupt handler to acknowledge.
+  if (!cmdslot_alloc_lock.try_acquire())
+    return;
+  reap_cmdslots();
+  cmdslot_alloc_lock.release();
+}
+
 void
 ahci_port::readv(kiovec* iov, int iov_cnt, u64 off)
 {
@@ -631,11 +723,10 @@ ahci_port::areadv(kiovec* iov, int iov_cnt, u64 off,
                   sref<disk_completion> dc)
 {
   int cmdslot = alloc_cmdslot(dc);
-#if USE_SATA_NCQ
-  issue(cmdslot, iov, iov_cnt, off, IDE_CMD_READ_FPDMA_QUEUED, true);
-#else
-  issue(cmdslot, iov, iov_cnt, off, IDE_CMD_READ_DMA_EXT);
-#endif
+  if (ncq)
+    issue(cmdslot, iov, iov_cnt, off, IDE_CMD_READ_FPDMA_QUEUED, true);
+  else
+    issue(cmdslot, iov, iov_cnt, off, IDE_CMD_READ_DMA_EXT);
 }
 
 void
@@ -651,11 +742,10 @@ ahci_port::awritev(kiovec* iov, int iov_cnt, u64 off,
                    sref<disk_completion> dc)
 {
   int cmdslot = alloc_cmdslot(dc);
-#if USE_SATA_NCQ
-  issue(cmdslot, iov, iov_cnt, off, IDE_CMD_WRITE_FPDMA_QUEUED, true);
-#else
-  issue(cmdslot, iov, iov_cnt, off, IDE_CMD_WRITE_DMA_EXT);
-#endif
+  if (ncq)
+    issue(cmdslot, iov, iov_cnt, off, IDE_CMD_WRITE_FPDMA_QUEUED, true);
+  else
+    issue(cmdslot, iov, iov_cnt, off, IDE_CMD_WRITE_DMA_EXT);
 }
 
 void
@@ -669,17 +759,63 @@ ahci_port::flush()
 void
 ahci_port::aflush(sref<disk_completion> dc)
 {
-#if USE_SATA_NCQ
   // FLUSH CACHE (EXT) is not an NCQ command and hence must not be issued if any
   // NCQ commands are still outstanding. So allocate a command slot only after
   // draining out all pending commands.
-  int cmdslot = alloc_cmdslot(dc, true);
-#else
-  int cmdslot = alloc_cmdslot(dc);
-#endif
+  int cmdslot = alloc_cmdslot(dc, ncq);
   issue(cmdslot, nullptr, 0, 0, IDE_CMD_FLUSH_CACHE_EXT);
 }
 
+u32
+ahci_port::max_discard_extents()
+{
+  return trim_blocks * IDE_DSM_RANGES_PER_BLOCK;
+}
+
+u64
+ahci_port::max_discard_bytes()
+{
+  return trim_buf ? (u64) IDE_DSM_RANGE_MAX * 512 / BSIZE * BSIZE : 0;
+}
+
+void
+ahci_port::adiscard(const disk_extent *ext, u32 n, sref<disk_completion> dc)
+{
+  assert(trim_buf && n && n <= max_discard_extents());
+
+  // DATA SET MANAGEMENT is not an NCQ command, and the slot being exclusive
+  // also means that no earlier TRIM is still reading trim_buf.
+  int cmdslot = alloc_cmdslot(dc, true);
+
+  for (u32 i = 0; i < n; i++) {
+    assert(ext[i].off % 512 == 0 && ext[i].nbytes % 512 == 0);
+    u64 count = ext[i].nbytes / 512;
+    assert(count && count <= IDE_DSM_RANGE_MAX);
+    trim_buf[i] = (ext[i].off / 512) | (count << 48);
+  }
+
+  // Pad the entries out to a whole block; entries with a count of 0 are
+  // ignored.
+  u32 nblocks = (n + IDE_DSM_RANGES_PER_BLOCK - 1) / IDE_DSM_RANGES_PER_BLOCK;
+  memset(&trim_buf[n], 0,
+         (nblocks * IDE_DSM_RANGES_PER_BLOCK - n) * sizeof(trim_buf[0]));
+
+  kiovec iov = { (void*) trim_buf, (u64) nblocks * 512 };
+  issue(cmdslot, &iov, 1, 0, IDE_CMD_DSM);
+}
+
+void
+ahci_port::print_stats()
+{
+  scoped_acquire a(&cmdslot_alloc_lock);
+  cprintf("%s: %s, %d slots: %lu cmds, avg depth %lu.%02lu, max depth %d, "
+          "%lu drains, %d in flight\n", dk_busloc, ncq ? "NCQ" : "no NCQ",
+          num_cmdslots, stat_cmds,
+          stat_cmds ? stat_depth_sum / stat_cmds : 0,
+          stat_cmds ? (stat_depth_sum * 100 / stat_cmds) % 100 : 0,
+          stat_max_depth, stat_drains, inflight);
+}
+
 void
 ahci_port::issue(int cmdslot, kiovec* iov, int iov_cnt, u64 off, int cmd,
                  bool cmd_is_ncq)
@@ -710,6 +846,11 @@ ahci_port::issue(int cmdslot, kiovec* iov, int iov_cnt, u64 off, int cmd,
     fis.lba_4 = (sector_off >> 32) & 0xff;
     fis.lba_5 = (sector_off >> 40) & 0xff;
 
+    // The block layer's largest I/O (one PRD per block) must fit in a
+    // command table and in the 16-bit sector count.
+    static_assert(SG_IO_SIZE / 512 <= 0xffff &&
+                  SG_IO_SIZE / 512 < MAX_PRD_ENTRIES,
+                  "DISK_IO_SIZE too large for one AHCI command");
     u64 num_sectors = len / 512;
     if (cmd_is_ncq) {
       fis.features = num_sectors & 0xff;
@@ -721,12 +862,17 @@ ahci_port::issue(int cmdslot, kiovec* iov, int iov_cnt, u64 off, int cmd,
     }
   }
 
+  // For DATA SET MANAGEMENT, the data is the LBA range entries, at LBA 0.
+  if (cmd == IDE_CMD_DSM)
+    fis.features = IDE_DSM_FEATURE_TRIM;
+
   fill_fis(cmdslot, &fis);
 
   // Update the Write bit in the flags *after* invoking fill_fis(), to ensure
   // that it remains set (and hence allow the disk write to go through).
   // Otherwise, disk writes never complete on ben.
-  if (cmd == IDE_CMD_WRITE_DMA_EXT || cmd == IDE_CMD_WRITE_FPDMA_QUEUED)
+  if (cmd == IDE_CMD_WRITE_DMA_EXT || cmd == IDE_CMD_WRITE_FPDMA_QUEUED ||
+      cmd == IDE_CMD_DSM)
     portmem->cmdh[cmdslot].flags |= AHCI_CMD_FLAGS_WRITE;
 
   // Mark the command as issued, for the interrupt handler's benefit.
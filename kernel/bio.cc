@@ -4,9 +4,118 @@
 #include "weakcache.hh"
 #include "mfs.hh"
 #include "scalefs.hh"
+#include "shrinker.hh"
+#include "major.h"
+#include "kstream.hh"
+#include "file.hh"
+#include "fsperf.hh"
+#include "pagecopy.hh"
 
 
-static weakcache<buf::key_t, buf> bufcache(64 << 20);
+static weakcache<buf::key_t, buf> bufcache(early_phys_bytes() /
+                                           BUFCACHE_HASH_RATIO);
+
+namespace {
+  // The pinned bufs that each core brought into the buffer cache, swept in
+  // CLOCK order by buf_reclaim() under memory pressure.
+  struct buf_clock {
+    struct entry {
+      u32 dev;
+      u64 block;
+    };
+
+    spinlock lock;
+    std::vector<entry> entries;
+    size_t hand;
+  };
+
+  percpu<buf_clock> buf_clocks;
+}
+
+// Pin a buf that was just inserted into (or found unpinned in) the buffer
+// cache, and add it to this core's reclaim list.
+void
+buf::pin_and_track()
+{
+  if (!cmpxch(&pinned_, false, true))
+    return;
+  inc();
+  auto &clock = *buf_clocks.get_unchecked();
+  auto l = clock.lock.guard();
+  clock.entries.push_back(buf_clock::entry{dev_, block_});
+}
+
+bool
+buf::reclaim()
+{
+  if (!pinned_)
+    return true;
+  if (referenced_) {
+    referenced_ = false;
+    return false;
+  }
+  if (dirty_ || !on_disk_)
+    return false;
+
+  evicted_ = true;
+  cache_pin(false);
+  // A lookup or a modification may have raced with us; either re-pins the
+  // buf itself if it saw it unpinned, and otherwise we do.
+  if (referenced_ || !on_disk_) {
+    evicted_ = false;
+    cache_pin(true);
+    return false;
+  }
+  return true;
+}
+
+// Unpin up to BUF_RECLAIM_BATCH of the bufs on CPU cpu's list that haven't
+// been used since the last sweep, so that they are freed once nobody holds a
+// reference to them. Called by the buffer-cache shrinker when memory runs
+// low. Returns the number of bufs unpinned.
+size_t
+buf_reclaim(int cpu)
+{
+  auto &clock = buf_clocks[cpu];
+  auto l = clock.lock.guard();
+  size_t nunpinned = 0;
+  for (size_t n = 0; n < BUF_RECLAIM_BATCH && !clock.entries.empty(); n++) {
+    if (clock.hand >= clock.entries.size())
+      clock.hand = 0;
+    auto &e = clock.entries[clock.hand];
+    sref<buf> b = bufcache.lookup(buf::key_t{e.dev, e.block});
+    if (b && !b->reclaim()) {
+      clock.hand++;
+      continue;
+    }
+    clock.entries[clock.hand] = clock.entries.back();
+    clock.entries.pop_back();
+    nunpinned++;
+  }
+  return nunpinned;
+}
+
+namespace {
+  class buf_shrinker : public shrinker
+  {
+  public:
+    buf_shrinker() : shrinker("bufcache") { }
+
+    size_t count(int cpu) override
+    {
+      auto &clock = buf_clocks[cpu];
+      auto l = clock.lock.guard();
+      return clock.entries.size();
+    }
+
+    size_t scan(int cpu, size_t nr) override
+    {
+      return buf_reclaim(cpu);
+    }
+  };
+
+  buf_shrinker the_buf_shrinker;
+}
 
 
 // Returns true if the specified block is cached in the buffer-cache, false
@@ -24,10 +133,16 @@ buf::in_bufcache(u32 dev, u64 block)
 sref<buf>
 buf::get(u32 dev, u64 block, bool skip_disk_read)
 {
+  FSPERF_REGION(FSPERF_BUFCACHE, "buf::get");
   buf::key_t k = { dev, block };
   for (;;) {
     sref<buf> b = bufcache.lookup(k);
     if (b.get() != nullptr) {
+      b->referenced_ = true;
+      if (!b->pinned_) {
+        b->evicted_ = false;
+        b->pin_and_track();
+      }
       // Wait for buffer to load, by getting a read seqlock,
       // which waits for the write seqlock bit to be cleared.
       b->seq_.read_begin();
@@ -37,15 +152,82 @@ buf::get(u32 dev, u64 block, bool skip_disk_read)
     sref<buf> nb = sref<buf>::transfer(new buf(dev, block));
     auto locked = nb->write(); // marks the block as dirty automatically
     if (bufcache.insert(k, nb.get())) {
-      nb->cache_pin(true); // keep it in the cache
-      if (!skip_disk_read)
+      nb->pin_and_track(); // keep it in the cache
+      if (!skip_disk_read) {
+        scoped_disk_tag tag(DISKTRACE_BUFCACHE);
         disk_read(dev, locked->data, BSIZE, block * BSIZE);
+      }
       nb->mark_clean(); // we just loaded the contents from the disk!
+      nb->on_disk_ = !skip_disk_read;
       return nb;
     }
   }
 }
 
+// Load the given blocks into the buffer-cache, if they aren't there already,
+// reading them from the disk in as few I/Os as possible. Like get(), each new
+// buf is inserted into the cache write-locked, so that concurrent lookups wait
+// for its contents to arrive.
+void
+buf::prefetch(u32 dev, const std::vector<u64> &blocks)
+{
+  std::vector<sref<buf> > bufs;
+  std::vector<buf_writer> locks;
+  read_queue rq;
+
+  for (auto block : blocks) {
+    buf::key_t k = { dev, block };
+    if (bufcache.lookup(k).get() != nullptr)
+      continue;
+
+    sref<buf> nb = sref<buf>::transfer(new buf(dev, block));
+    auto locked = nb->write(); // marks the block as dirty automatically
+    if (!bufcache.insert(k, nb.get()))
+      continue; // Someone else just started loading it.
+
+    nb->pin_and_track(); // keep it in the cache
+    rq.read(locked->data, block);
+    locks.push_back(std::move(locked));
+    bufs.push_back(nb);
+  }
+
+  {
+    scoped_disk_tag tag(DISKTRACE_BUFCACHE);
+    rq.submit();
+  }
+  rq.wait();
+
+  for (auto &b : bufs) {
+    b->mark_clean(); // we just loaded the contents from the disk!
+    b->on_disk_ = true;
+  }
+}
+
+// Like get() for each of the blocks, except that the ones that aren't cached
+// are read from the disk together (see prefetch()).
+std::vector<sref<buf> >
+buf::get_blocks(u32 dev, const std::vector<u64> &blocks)
+{
+  prefetch(dev, blocks);
+
+  std::vector<sref<buf> > bufs;
+  bufs.reserve(blocks.size());
+  for (auto block : blocks)
+    bufs.push_back(get(dev, block));
+  return bufs;
+}
+
+// The bufs for blocks [start, start + n).
+std::vector<sref<buf> >
+buf::get_range(u32 dev, u64 start, u64 n)
+{
+  std::vector<u64> blocks;
+  blocks.reserve(n);
+  for (u64 i = 0; i < n; i++)
+    blocks.push_back(start + i);
+  return get_blocks(dev, blocks);
+}
+
 // Evict a (clean) block from the buffer-cache
 void
 buf::put(u32 dev, u64 block)
@@ -61,6 +243,23 @@ buf::put(u32 dev, u64 block)
   }
 }
 
+// A block is being written with data straight to the disk, bypassing the
+// buffer-cache (file data goes from the page cache to the disk that way).
+// If the block is cached anyway, from an earlier readi(), give the cached
+// copy the same contents, so that the next read of the block doesn't get
+// what was there before. Its dirty flag is left alone.
+void
+buf::refresh(u32 dev, u64 block, const char *data)
+{
+  buf::key_t k = { dev, block };
+
+  sref<buf> bp = bufcache.lookup(k);
+  if (bp.get() != nullptr) {
+    auto locked = bp->write_clean();
+    memmove(locked->data, data, BSIZE);
+  }
+}
+
 void
 buf::writeback(bool sync)
 {
@@ -86,6 +285,7 @@ buf::writeback(bool sync)
   // lifetime properly!
 
   async_iowait_init();
+  scoped_disk_tag tag(DISKTRACE_BUFCACHE);
   disk_write(dev_, copy->data, BSIZE, block_ * BSIZE, dc_);
 
   if (sync) // Synchronous disk I/O
@@ -98,9 +298,10 @@ buf::writeback_async()
   writeback(false);
 }
 
-// Must be invoked with the buf's write_lock_ held.
+// Must be invoked with the buf's write_lock_ held. dirty_chunks is the mask of
+// the chunks of the block that the caller modified (see txn_chunk_mask()).
 void
-buf::add_to_transaction(transaction *trans)
+buf::add_to_transaction(transaction *trans, u64 dirty_chunks)
 {
   // It doesn't matter whether we mark it clean before or after we add it to
   // the transaction, as long as we mark it clean while still holding the
@@ -111,7 +312,85 @@ buf::add_to_transaction(transaction *trans)
   // We can't issue a read() to read the contents of the buf because we are
   // already holding the seq-lock for write (hence we'll end up in a self-
   // deadlock if we do so). So read directly from data_ instead.
-  trans->add_block(block_, data_->data);
+  if (TXN_ZERO_COPY) {
+    // Instead of copying the block, freeze its current contents and let the
+    // transaction refer to them. The next writer will make a copy, if the
+    // transaction is still around by then. We fall back to copying if an
+    // older version of the block is still frozen.
+    scoped_acquire l(&frozen_lock_);
+    if (!frozen_ || frozen_ == data_) {
+      frozen_ = data_;
+      frozen_refs_++;
+      l.release();
+      auto db = new transaction_diskblock(block_, sref<buf>::newref(this),
+                                          data_->data);
+      db->dirty_chunks = dirty_chunks;
+      trans->add_block(db);
+      return;
+    }
+  }
+
+  auto db = new transaction_diskblock(block_, data_->data);
+  db->dirty_chunks = dirty_chunks;
+  trans->add_block(db);
+}
+
+// Called with the write_lock_ held, before modifying the block. If the current
+// contents of the block are frozen (i.e., referenced by a transaction), switch
+// to a private copy of the block, leaving the frozen contents to the
+// transactions.
+buf::bufdata*
+buf::unshare_data()
+{
+  bufdata *frozen;
+  {
+    scoped_acquire l(&frozen_lock_);
+    frozen = frozen_;
+  }
+
+  // Only writers (which hold the write_lock_) freeze or replace data_, so it
+  // can't change under us.
+  if (frozen != data_)
+    return data_;
+
+  bufdata *copy = (bufdata *) kalloc("bufdata", sizeof(bufdata));
+  pagecopy(copy, data_);
+  memacct_add(MEMACCT_BUFDATA, 1, sizeof(bufdata));
+
+  bool free_frozen;
+  {
+    scoped_acquire l(&frozen_lock_);
+    data_ = copy;
+    // The transactions might have dropped their references in the meantime,
+    // in which case they left the (then current) data for us to free.
+    free_frozen = !frozen_;
+  }
+
+  if (free_frozen) {
+    kfree(frozen, sizeof(bufdata));
+    memacct_add(MEMACCT_BUFDATA, -1, -(s64)sizeof(bufdata));
+  }
+  return data_;
+}
+
+void
+buf::put_frozen_data()
+{
+  bufdata *to_free = nullptr;
+  {
+    scoped_acquire l(&frozen_lock_);
+    assert(frozen_ && frozen_refs_);
+    if (--frozen_refs_ == 0) {
+      if (frozen_ != data_)
+        to_free = frozen_;
+      frozen_ = nullptr;
+    }
+  }
+
+  if (to_free) {
+    kfree(to_free, sizeof(bufdata));
+    memacct_add(MEMACCT_BUFDATA, -1, -(s64)sizeof(bufdata));
+  }
 }
 
 void
@@ -126,3 +405,25 @@ buf::onzero()
   bufcache.cleanup(weakref_);
   delete this;
 }
+
+static int
+bufstatsread(mdev*, char *dst, u32 off, u32 n)
+{
+  window_stream s(dst, off, n);
+  auto stats = bufcache.get_stats();
+  s.println("buffer cache:");
+  s.println("  ", stats.items, " items");
+  s.println("  ", stats.used_buckets, " used / ",
+            stats.total_buckets, " total slots (",
+            stats.used_buckets * 100 / stats.total_buckets, "%)");
+  s.println("  ", stats.tombstones, " tombstones");
+  s.println("  ", stats.max_chain, " max probe length");
+  s.println("  ", stats.resizes, " resizes");
+  return s.get_used();
+}
+
+void
+initbio(void)
+{
+  devsw[MAJ_BUFSTATS].pread = bufstatsread;
+}
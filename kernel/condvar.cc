@@ -8,6 +8,7 @@
 #include "cpu.hh"
 #include "hpet.hh"
 #include "ipi.hh"
+#include "lockprof.hh"
 
 static u64 ticks __mpalign__;
 
@@ -81,6 +82,15 @@ timerintr(void)
 void
 condvar::sleep_to(struct spinlock *lk, u64 timeout, struct spinlock *lk2)
 {
+  sleep_at(lk, timeout, lk2, (uptr)__builtin_return_address(0));
+}
+
+void
+condvar::sleep_at(struct spinlock *lk, u64 timeout, struct spinlock *lk2,
+                  uptr site)
+{
+  u64 prof_start = site && lockprof_on() ? rdtsc() : 0;
+
   if(myproc() == 0)
     panic("sleep");
 
@@ -115,6 +125,9 @@ condvar::sleep_to(struct spinlock *lk, u64 timeout, struct spinlock *lk2)
   lk->acquire();
   if (lk2)
     lk2->acquire();
+  if (prof_start)
+    lockprof_record(LOCKPROF_CONDVAR, nullptr, site, 1, 1,
+                    rdtsc() - prof_start, 0);
   if (myproc()->killed) {
     // Callers should use scoped locks to ensure locks are released as the stack
     // is unwinded.  But, callers don't have to check for p->killed to ensure
@@ -126,7 +139,7 @@ condvar::sleep_to(struct spinlock *lk, u64 timeout, struct spinlock *lk2)
 void
 condvar::sleep(struct spinlock *lk, struct spinlock *lk2)
 {
-  sleep_to(lk, 0, lk2);
+  sleep_at(lk, 0, lk2, (uptr)__builtin_return_address(0));
 }
 
 void
@@ -307,6 +307,10 @@ consoleintr(int (*getc)(void))
       extern void print_all_txq_stats();
       print_all_txq_stats();
       break;
+    case C('K'):  // Print disk queue-depth statistics.
+      extern void disk_print_stats();
+      disk_print_stats();
+      break;
     case C('U'):  // Kill line.
       while(input.e != input.w &&
             input.buf[(input.e-1) % INPUT_BUF] != '\n'){
@@ -4,10 +4,12 @@
 #include "file.hh"
 #include "major.h"
 #include "kstats.hh"
+#include "lathist.hh"
 
 extern const char *kconfig;
 
 DEFINE_PERCPU(struct kstats, mykstats, NO_CRITICAL);
+DEFINE_PERCPU(struct lathists, mylathists, NO_CRITICAL);
 
 static int
 kconfigread(mdev*, char *dst, u32 off, u32 n)
@@ -35,9 +37,29 @@ kstatsread(mdev*, char *dst, u32 off, u32 n)
   return n;
 }
 
+// Each core's histograms, one after another
+static int
+latstatsread(mdev*, char *dst, u32 off, u32 n)
+{
+  u64 size = ncpu * sizeof(struct lathists);
+  if (off >= size)
+    return 0;
+  if (n > size - off)
+    n = size - off;
+  for (u32 done = 0; done < n; ) {
+    u32 cpu = (off + done) / sizeof(struct lathists);
+    u32 coff = (off + done) % sizeof(struct lathists);
+    u32 k = std::min(n - done, (u32)sizeof(struct lathists) - coff);
+    memmove(dst + done, (char*)&mylathists[cpu] + coff, k);
+    done += k;
+  }
+  return n;
+}
+
 void
 initdev(void)
 {
   devsw[MAJ_KCONFIG].pread = kconfigread;
   devsw[MAJ_KSTATS].pread = kstatsread;
+  devsw[MAJ_LATSTATS].pread = latstatsread;
 }
@@ -4,10 +4,19 @@
 #include "ideconfig.hh"
 #include "vector.hh"
 #include "amd64.h"
+#include "percpu.hh"
+#include "kstats.hh"
+#include "proc.hh"
+#include "fs.h"
+#include "file.hh"
+#include "major.h"
+#include "tracering.hh"
+#include "ioacct.hh"
 #include <cstring>
 #include <sys/time.h>
+#include <algorithm>
 
-#if AHCIIDE
+#if AHCIIDE || NVMEIDE
 
 #include "zlib-decompress.hh"
 extern u8 _fs_imgz_start[];
@@ -108,6 +117,13 @@ disk_test(disk *d)
   cprintf("disk_test: test done\n");
 }
 
+void
+disk_print_stats()
+{
+  for (disk* d : disks)
+    d->print_stats();
+}
+
 static void
 disk_test_all()
 {
@@ -123,19 +139,169 @@ sys_disktest(void)
   disk_test_all();
 }
 
-// Stripe across all the (four) disks, with a stripe size of 64KB.
-#define STRIPE_SIZE_BLKS		(64 * 1024 / BSIZE)
+// Measure the throughput of reading nbytes from the start of the disks, using
+// I/Os of io_size bytes, and striping across the disks with a stripe unit of
+// stripe_size bytes (regardless of the stripe unit that the filesystem uses;
+// nothing is written). Keeps up to NCQ_DEPTH I/Os in flight. Returns the time
+// taken, in nanoseconds.
+static long
+disk_bench(u64 nbytes, u64 io_size, u64 stripe_size)
+{
+  enum { NCQ_DEPTH = 32 };
+
+  u32 nvec = io_size / BSIZE;
+  char *page = kalloc("diskbench");
+  kiovec *iov[NCQ_DEPTH];
+  sref<disk_completion> dc[NCQ_DEPTH];
+
+  if (!page)
+    return -1;
+  for (int i = 0; i < NCQ_DEPTH; i++) {
+    iov[i] = (kiovec *)kmalloc(nvec * sizeof(kiovec), "diskbench");
+    assert(iov[i]);
+  }
 
-// Given a block offset as argument, return the disk number that hosts that block.
-u32 blknum_to_dev(u32 blknum)
+  u64 start = nsectime();
+  u64 off = 0;
+  for (int n = 0; off < nbytes; n = (n + 1) % NCQ_DEPTH) {
+    // A single I/O doesn't cross a stripe boundary.
+    u64 stripe = off / stripe_size;
+    u64 len = std::min(std::min(io_size, stripe_size - off % stripe_size),
+                       nbytes - off);
+    u32 dev = stripe % disks.size();
+    u64 disk_off = (stripe / disks.size()) * stripe_size + off % stripe_size;
+
+    if (dc[n]) {
+      dc[n]->wait();
+      dc[n].reset();
+    }
+
+    u32 cnt = len / BSIZE;
+    for (u32 i = 0; i < cnt; i++)
+      iov[n][i] = { page, BSIZE };
+
+    dc[n] = make_sref<disk_completion>();
+    disks[dev]->areadv(iov[n], cnt, disk_off, dc[n]);
+    off += len;
+  }
+
+  for (int i = 0; i < NCQ_DEPTH; i++) {
+    if (dc[i])
+      dc[i]->wait();
+  }
+  u64 elapsed = nsectime() - start;
+
+  for (int i = 0; i < NCQ_DEPTH; i++)
+    kmfree(iov[i], nvec * sizeof(kiovec));
+  kfree(page);
+  return elapsed;
+}
+
+//SYSCALL
+long
+sys_diskbench(u64 nbytes, u64 io_size, u64 stripe_size)
 {
-  return (blknum / STRIPE_SIZE_BLKS) % num_disks();
+  if (disks.size() == 0 || !io_size || !stripe_size ||
+      io_size % BSIZE || stripe_size % BSIZE || io_size / BSIZE > IOV_MAX ||
+      io_size / 512 > 0xffff)
+    return -1;
+
+  u64 disk_size = ~0ULL;
+  for (disk *d : disks)
+    disk_size = std::min(disk_size, d->dk_nbytes);
+  if (nbytes % BSIZE || nbytes / disks.size() > disk_size - stripe_size)
+    return -1;
+
+  return disk_bench(nbytes, io_size, stripe_size);
+}
+
+#define STRIPE_SIZE_BLKS		(DISK_STRIPE_SIZE / BSIZE)
+static_assert(DISK_STRIPE_SIZE % BSIZE == 0, "Bad stripe size");
+
+namespace {
+  // RAID-0: stripe across all the disks, with a stripe size of
+  // DISK_STRIPE_SIZE.
+  class raid0_layout : public disk_layout {
+  public:
+    u32 locate(u32 blknum, disk_addr *copies) const override {
+      u32 stripe = blknum / STRIPE_SIZE_BLKS;
+      copies[0].dev = stripe % num_disks();
+      copies[0].blknum = STRIPE_SIZE_BLKS * (stripe / num_disks())
+                         + blknum % STRIPE_SIZE_BLKS;
+      return 1;
+    }
+
+    disk_addr locate_read(u32 blknum) const override {
+      disk_addr a;
+      locate(blknum, &a);
+      return a;
+    }
+
+    const char *name() const override { return "RAID-0"; }
+  };
+
+  // RAID-10: stripe across mirrored pairs of disks (disks 0 and 1 make up the
+  // first pair, disks 2 and 3 the second, and so on). Reads alternate between
+  // the two disks of a pair, so that mirrored reads scale with the number of
+  // disks; each core keeps its own rotation, to avoid sharing a counter.
+  class raid10_layout : public disk_layout {
+  public:
+    u32 locate(u32 blknum, disk_addr *copies) const override {
+      u32 npairs = num_disks() / 2;
+      u32 stripe = blknum / STRIPE_SIZE_BLKS;
+      u32 pair = stripe % npairs;
+      u32 b = STRIPE_SIZE_BLKS * (stripe / npairs) + blknum % STRIPE_SIZE_BLKS;
+      copies[0] = { 2 * pair, b };
+      copies[1] = { 2 * pair + 1, b };
+      return 2;
+    }
+
+    disk_addr locate_read(u32 blknum) const override;
+
+    const char *name() const override { return "RAID-10"; }
+  };
 }
 
-u32 remap_blknum(u32 blknum)
+DEFINE_PERCPU(u32, next_read_copy, NO_CRITICAL);
+
+disk_addr
+raid10_layout::locate_read(u32 blknum) const
+{
+  disk_addr copies[DISK_MAX_COPIES];
+  locate(blknum, copies);
+  return copies[(*next_read_copy)++ % 2];
+}
+
+static raid0_layout raid0;
+static raid10_layout raid10;
+
+const disk_layout *
+get_disk_layout()
 {
-  return STRIPE_SIZE_BLKS * ((blknum / STRIPE_SIZE_BLKS) / num_disks())
-         + (blknum % STRIPE_SIZE_BLKS);
+#if DISK_LAYOUT == DISK_LAYOUT_RAID10
+  return &raid10;
+#else
+  return &raid0;
+#endif
+}
+
+static void
+check_disk_layout()
+{
+  assert(disks.size() > 0);
+#if DISK_LAYOUT == DISK_LAYOUT_RAID10
+  static_assert(DISK_MAX_COPIES >= 2, "RAID-10 keeps two copies");
+  if (disks.size() % 2)
+    panic("disk: RAID-10 needs an even number of disks, found %ld\n",
+          disks.size());
+#endif
+}
+
+u32 blknum_to_dev(u32 blknum)
+{
+  disk_addr copies[DISK_MAX_COPIES];
+  get_disk_layout()->locate(blknum, copies);
+  return copies[0].dev;
 }
 
 u32 num_disks()
@@ -143,19 +309,137 @@ u32 num_disks()
   return (u32) disks.size();
 }
 
+// Block I/O tracing; see disktrace.h.
+static tracering<struct disktrace_rec, DISKTRACE_RECS> disktrace_ring;
+static std::atomic<bool> disktrace_on;
+
+scoped_disk_tag::scoped_disk_tag(u8 tag) : set_(false)
+{
+  proc *p = myproc();
+  if (p && p->disk_tag == DISKTRACE_OTHER) {
+    p->disk_tag = tag;
+    set_ = true;
+  }
+}
+
+scoped_disk_tag::~scoped_disk_tag()
+{
+  if (set_)
+    myproc()->disk_tag = DISKTRACE_OTHER;
+}
+
+void
+disktrace_log(disktrace_rec *rec)
+{
+  rec->complete_tsc = rdtsc();
+  disktrace_ring.log([&](disktrace_rec *r) { *r = *rec; });
+}
+
+// Traces one I/O to a disk, if tracing is on.
+class disktrace_io
+{
+public:
+  disktrace_io(u8 op, u32 dev, u64 off, const kiovec *iov, int iov_cnt)
+    : on_(disktrace_on.load(std::memory_order_relaxed))
+  {
+    if (!on_)
+      return;
+    memset(&rec_, 0, sizeof(rec_));
+    for (int i = 0; i < iov_cnt; i++)
+      rec_.len += iov[i].iov_len;
+    rec_.off = off;
+    rec_.iovcnt = iov_cnt;
+    rec_.dev = dev;
+    rec_.op = op;
+    proc *p = myproc();
+    rec_.tag = p ? p->disk_tag : DISKTRACE_OTHER;
+    rec_.cpu = myid();
+    rec_.submit_tsc = rdtsc();
+  }
+
+  // The completion to issue an asynchronous I/O with: dc, or with tracing
+  // on, one that logs the I/O and then notifies dc.
+  sref<disk_completion> completion(sref<disk_completion> dc)
+  {
+    if (!on_)
+      return dc;
+    auto tdc = make_sref<disk_completion>();
+    tdc->trace(rec_, std::move(dc));
+    return tdc;
+  }
+
+  // Log a synchronous I/O, once it has completed.
+  void done()
+  {
+    if (on_)
+      disktrace_log(&rec_);
+  }
+
+private:
+  bool on_;
+  disktrace_rec rec_;
+};
+
+// Drain as many whole records as fit in dst.  Reads consume the records,
+// so off is ignored.
+static int
+disktraceread(mdev*, char *dst, u32 off, u32 n)
+{
+  auto out = (struct disktrace_rec*)dst;
+  u32 used = disktrace_ring.drain(out, n / sizeof(*out),
+                                  [](disktrace_rec *r, int cpu, u64 lost) {
+                                    r->submit_tsc = r->complete_tsc = rdtsc();
+                                    r->off = lost;
+                                    r->op = DISKTRACE_LOST;
+                                    r->cpu = cpu;
+                                  });
+  return used * sizeof(*out);
+}
+
+// "1" turns tracing on, "0" off.
+static int
+disktracewrite(mdev*, const char *buf, u32 n)
+{
+  if (n < 1 || (buf[0] != '0' && buf[0] != '1'))
+    return -1;
+  disktrace_on.store(buf[0] == '1');
+  return n;
+}
+
+void
+initdisktrace(void)
+{
+  disktrace_ring.init("disktrace");
+  devsw[MAJ_DISKTRACE].pread = disktraceread;
+  devsw[MAJ_DISKTRACE].write = disktracewrite;
+}
+
+// Reads and writes must not cross a stripe boundary, since the rest of the I/O
+// would be on another disk (see disk_layout).
 void
 disk_readv(u32 dev, kiovec *iov, int iov_cnt, u64 offset,
            sref<disk_completion> dc)
 {
-  assert(disks.size() > 0);
+  check_disk_layout();
   assert(iov_cnt <= IOV_MAX);
-  dev = blknum_to_dev(offset/BSIZE);
-  offset = (u64)remap_blknum(offset/BSIZE) * BSIZE;
-
-  if (dc) // Asynchronous
-    disks[dev]->areadv(iov, iov_cnt, offset, dc);
-  else
+  disk_addr a = get_disk_layout()->locate_read(offset/BSIZE);
+  dev = a.dev;
+  offset = (u64)a.blknum * BSIZE;
+
+  u64 nbytes = 0;
+  for (int i = 0; i < iov_cnt; i++)
+    nbytes += iov[i].iov_len;
+  kstats::inc(&kstats::disk_read_blocks, (nbytes + BSIZE - 1) / BSIZE);
+  ioacct_charge(IOACCT_DISK_RBYTES, nbytes);
+
+  disktrace_io t(DISKTRACE_READ, dev, offset, iov, iov_cnt);
+  if (dc) { // Asynchronous
+    dc->set_disk(disks[dev], dev);
+    disks[dev]->areadv(iov, iov_cnt, offset, t.completion(dc));
+  } else {
     disks[dev]->readv(iov, iov_cnt, offset);
+    t.done();
+  }
 }
 
 void
@@ -166,19 +450,44 @@ disk_read(u32 dev, char* buf, u64 nbytes, u64 offset,
   disk_readv(dev, &iov, 1, offset, dc);
 }
 
+// Write every copy. Asynchronous writes of several copies are issued in
+// parallel, and complete when all the copies are on the disks.
 void
 disk_writev(u32 dev, kiovec *iov, int iov_cnt, u64 offset,
             sref<disk_completion> dc)
 {
-  assert(disks.size() > 0);
+  check_disk_layout();
   assert(iov_cnt <= IOV_MAX);
-  dev = blknum_to_dev(offset/BSIZE);
-  offset = (u64)remap_blknum(offset/BSIZE) * BSIZE;
+  disk_addr copies[DISK_MAX_COPIES];
+  u32 ncopies = get_disk_layout()->locate(offset/BSIZE, copies);
+
+  if (dc)
+    dc->expect_more(ncopies - 1);
+  for (u32 i = 0; i < ncopies; i++)
+    disk_dev_writev(copies[i].dev, iov, iov_cnt, (u64)copies[i].blknum * BSIZE,
+                    dc);
+}
 
-  if (dc) // Asynchronous
-    disks[dev]->awritev(iov, iov_cnt, offset, dc);
-  else
+void
+disk_dev_writev(u32 dev, kiovec *iov, int iov_cnt, u64 offset,
+                sref<disk_completion> dc)
+{
+  assert(dev < disks.size());
+  assert(iov_cnt <= IOV_MAX);
+
+  u64 nbytes = 0;
+  for (int i = 0; i < iov_cnt; i++)
+    nbytes += iov[i].iov_len;
+  ioacct_charge(IOACCT_DISK_WBYTES, nbytes);
+
+  disktrace_io t(DISKTRACE_WRITE, dev, offset, iov, iov_cnt);
+  if (dc) { // Asynchronous
+    dc->set_disk(disks[dev], dev);
+    disks[dev]->awritev(iov, iov_cnt, offset, t.completion(dc));
+  } else {
     disks[dev]->writev(iov, iov_cnt, offset);
+    t.done();
+  }
 }
 
 void
@@ -193,9 +502,220 @@ void
 disk_flush(u32 dev, sref<disk_completion> dc)
 {
   assert(dev < disks.size());
-  if (dc) // Asynchronous
-    disks[dev]->aflush(dc);
-  else
+  disktrace_io t(DISKTRACE_FLUSH, dev, 0, nullptr, 0);
+  if (dc) { // Asynchronous
+    dc->set_disk(disks[dev], dev);
+    disks[dev]->aflush(t.completion(dc));
+  } else {
     disks[dev]->flush();
+    t.done();
+  }
+}
+
+bool
+disk_discard_supported()
+{
+  for (auto d : disks)
+    if (d->max_discard_extents())
+      return true;
+  return false;
+}
+
+void
+disk_discard(const std::vector<u32> &blocks, sref<disk_completion> dc)
+{
+  check_disk_layout();
+
+  // The layouts map contiguous blocks onto contiguous blocks of each disk, in
+  // increasing order, so the extents of every disk come out sorted.
+  std::vector<disk_extent> ext[NDISK];
+  for (auto b : blocks) {
+    disk_addr copies[DISK_MAX_COPIES];
+    u32 ncopies = get_disk_layout()->locate(b, copies);
+    for (u32 i = 0; i < ncopies; i++) {
+      u32 dev = copies[i].dev;
+      u64 max_bytes = disks[dev]->max_discard_bytes();
+      if (!max_bytes)
+        continue;
+
+      u64 off = (u64)copies[i].blknum * BSIZE;
+      auto &e = ext[dev];
+      if (!e.empty() && e.back().off + e.back().nbytes == off &&
+          e.back().nbytes + BSIZE <= max_bytes)
+        e.back().nbytes += BSIZE;
+      else
+        e.push_back({ off, BSIZE });
+    }
+  }
+
+  // Count the commands first, since dc must expect all of them before any is
+  // issued.
+  u32 ncmds = 0;
+  for (u32 dev = 0; dev < disks.size(); dev++) {
+    u32 max = disks[dev]->max_discard_extents();
+    if (max)
+      ncmds += (ext[dev].size() + max - 1) / max;
+  }
+
+  if (!ncmds) {
+    dc->notify();
+    return;
+  }
+
+  dc->expect_more(ncmds - 1);
+  for (u32 dev = 0; dev < disks.size(); dev++) {
+    u32 max = disks[dev]->max_discard_extents();
+    for (size_t i = 0; i < ext[dev].size(); i += max) {
+      u32 n = (u32) std::min(ext[dev].size() - i, (size_t) max);
+      dc->set_disk(disks[dev], dev);
+      disks[dev]->adiscard(&ext[dev][i], n, dc);
+    }
+  }
+}
+
+
+namespace {
+  // The writes submitted together to the I/O scheduler, possibly spanning
+  // several disks.
+  struct sched_batch {
+    NEW_DELETE_OPS(sched_batch);
+    sched_batch(u32 n, sref<disk_completion> d) : pending(n), dc(d) {}
+
+    std::atomic<u32> pending; // No. of writes in the batch not yet on the disk.
+    sref<disk_completion> dc;
+  };
+
+  struct sched_write {
+    u64 blocknum;
+    u64 seq; // Order of submission, for writes to the same block.
+    const char *buf;
+    sched_batch *batch;
+
+    bool operator<(const sched_write &o) const {
+      if (blocknum == o.blocknum)
+        return seq < o.seq;
+      return blocknum < o.blocknum;
+    }
+  };
+
+  // The I/O scheduler's queue for one disk. lock protects the rest.
+  struct disk_sched {
+    disk_sched() : dispatching(false), next_seq(0) {}
+
+    spinlock lock;
+    condvar cv; // Wakes the disk's dispatcher thread when writes are queued.
+    std::vector<sched_write> queue;
+    bool dispatching; // Set while some process is writing out the queue.
+    u64 next_seq;
+  };
+}
+
+static disk_sched io_sched[NDISK];
+
+void
+disk_sched_submit(const std::vector<disk_sched_req> &reqs,
+                  sref<disk_completion> dc)
+{
+  if (reqs.empty()) {
+    dc->notify();
+    return;
+  }
+
+  auto batch = new sched_batch(reqs.size(), dc);
+  for (u32 dev = 0; dev < num_disks(); dev++) {
+    disk_sched *ds = &io_sched[dev];
+    scoped_acquire l(&ds->lock);
+    size_t queued = ds->queue.size();
+    for (auto &r : reqs) {
+      if (blknum_to_dev(r.blocknum) == dev)
+        ds->queue.push_back({ r.blocknum, ds->next_seq++, r.buf, batch });
+    }
+    if (ds->queue.size() != queued && !ds->dispatching)
+      ds->cv.wake_all();
+  }
+}
+
+// Write out the queue of the given disk, unless someone else is already doing
+// so. Writes queued in the meantime are written out in further rounds, each
+// started as soon as the previous one completes, until the queue is empty;
+// that way no write is left behind without a dispatcher. Only the latest of
+// the writes to the same block in a round is issued, so that the disk can't
+// reorder them.
+static void
+disk_sched_dispatch(u32 dev)
+{
+  disk_sched *ds = &io_sched[dev];
+  std::vector<sched_write> round;
+
+  ds->lock.acquire();
+  if (ds->dispatching) {
+    ds->lock.release();
+    return;
+  }
+  ds->dispatching = true;
+
+  while (!ds->queue.empty()) {
+    round.swap(ds->queue);
+    ds->lock.release();
+
+    std::sort(round.begin(), round.end());
+
+    block_queue bq;
+    for (size_t i = 0; i < round.size(); i++) {
+      if (i + 1 < round.size() && round[i + 1].blocknum == round[i].blocknum)
+        continue;
+      bq.write(1, round[i].buf, BSIZE, round[i].blocknum * BSIZE);
+    }
+    bq.flush();
+
+    for (auto &w : round) {
+      if (--w.batch->pending == 0) {
+        w.batch->dc->notify();
+        delete w.batch;
+      }
+    }
+    round.clear();
+
+    ds->lock.acquire();
+  }
+
+  ds->dispatching = false;
+  ds->lock.release();
+}
+
+// Each disk's dispatcher thread starts writing out its queue as soon as
+// writes are queued on an idle disk, so that they don't sit in the queue
+// until someone waits for them.
+static void
+disk_sched_thread(void *arg)
+{
+  u32 dev = (uptr)arg;
+  disk_sched *ds = &io_sched[dev];
+
+  for (;;) {
+    {
+      scoped_acquire l(&ds->lock);
+      while (ds->queue.empty() || ds->dispatching)
+        ds->cv.sleep(&ds->lock);
+    }
+    disk_sched_dispatch(dev);
+  }
 }
 
+void
+initdisk_sched(void)
+{
+  for (u32 dev = 0; dev < num_disks(); dev++) {
+    char namebuf[32];
+    snprintf(namebuf, sizeof(namebuf), "disk_sched_%u", dev);
+    threadpin(disk_sched_thread, (void *)(uptr)dev, namebuf, dev % ncpu);
+  }
+}
+
+void
+disk_sched_wait(sref<disk_completion> dc)
+{
+  for (u32 dev = 0; dev < num_disks() && !dc->done(); dev++)
+    disk_sched_dispatch(dev);
+  dc->wait();
+}
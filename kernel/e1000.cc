@@ -4,6 +4,8 @@
 #include "pci.hh"
 #include "pcireg.hh"
 #include "spinlock.hh"
+#include "condvar.hh"
+#include "proc.hh"
 #include "apic.hh"
 #include "irq.hh"
 #include "e1000reg.hh"
@@ -12,6 +14,12 @@
 
 #define TX_RING_SIZE 64
 #define RX_RING_SIZE 64
+// Most packets cleanrx takes off the RX ring before handing them up
+// and giving the device back their descriptors.
+#define RX_BATCH     16
+
+// The interrupts that the RX poller takes over while it runs
+#define RX_INTRS     (ICR_RXO|ICR_RXT0)
 
 static console_stream verbose(false);
 
@@ -23,18 +31,34 @@ class e1000 : public netdev, irq_handler
   const u32 membase_;
   const u32 iobase_;
 
+  // The TX and RX rings have separate locks, so transmits don't wait
+  // for receive processing.  The tails are our copies of WMREG_TDT
+  // and WMREG_RDT, so the hot paths don't read device registers.
   volatile u32 txclean_;
   volatile u32 txinuse_;
+  u32 txtail_;
+  // Descriptors before txtail_ that the device hasn't been told about
+  u32 txpending_;
+  // The checksum context last loaded into the device (IPCS in the
+  // high half, TUCS in the low), or 0
+  u64 txctx_;
 
   volatile u32 rxclean_;
-  volatile u32 rxuse_;
+  u32 rxtail_;
 
   u8 hwaddr_[6];
 
   struct wiseman_txdesc txd_[TX_RING_SIZE] __attribute__((aligned (16)));
   struct wiseman_rxdesc rxd_[RX_RING_SIZE] __attribute__((aligned (16)));
 
-  struct spinlock lk_;
+  struct spinlock txlk_;
+  struct spinlock rxlk_;
+
+  // handle_irq masks the RX interrupts and wakes the RX poller, which
+  // unmasks them once it has emptied the ring (like Linux's NAPI).
+  struct spinlock rxpoll_lk_;
+  struct condvar rxpoll_cv_;
+  bool rxpoll_;
 
   bool valid_;
 
@@ -47,9 +71,14 @@ class e1000 : public netdev, irq_handler
   int eeprom_read(u16 *buf, int off, int count);
 
   void cleantx();
+  void reclaimtx();
+  void doorbelltx();
   void allocrx();
 
-  void cleanrx();
+  int cleanrx(int budget);
+  bool rxready();
+  void rxpoll();
+  static void rxpoll_thread(void *arg);
 
   void reset();
 public:                         // Meh, e1000_models points to these
@@ -76,8 +105,10 @@ public:
     return valid_;
   }
 
-  int transmit(void *buf, uint32_t len);
+  int transmit(void *buf, uint32_t len, const net_txcsum *csum);
+  void flush();
   void get_hwaddr(uint8_t *hwaddr);
+  uint32_t features();
 };
 
 struct eerd {
@@ -206,22 +237,83 @@ e1000::eeprom_read(u16 *buf, int off, int count)
   return 0;
 }
 
+// Is desc a context descriptor, rather than one with a buffer?
+static bool
+is_txctx(const struct wiseman_txdesc *desc)
+{
+  return (desc->wtx_cmdlen & WTX_CMD_DEXT) &&
+    !(desc->wtx_cmdlen & WTX_DTYP_D);
+}
+
 int
-e1000::transmit(void *buf, u32 len)
+e1000::transmit(void *buf, u32 len, const net_txcsum *csum)
 {
   struct wiseman_txdesc *desc;
   u32 tail;
 
-  scoped_acquire l(&lk_);
+  // [E1000 3.3.6] A packet with checksum offload needs a context
+  // descriptor ahead of it, unless the device already has that context.
+  u32 ipcs = 0, tucs = 0;
+  u8 popts = 0;
+  if (csum) {
+    ipcs = WTX_TCPIP_IPCSS(csum->ip_start) |
+      WTX_TCPIP_IPCSO(csum->ip_start + 10) | WTX_TCPIP_IPCSE(csum->ip_end);
+    popts = WTX_IXSM;
+    if (csum->l4_start) {
+      // A TUCSE of 0 means to the end of the packet
+      tucs = WTX_TCPIP_TUCSS(csum->l4_start) |
+        WTX_TCPIP_TUCSO(csum->l4_sum);
+      popts |= WTX_TXSM;
+    }
+  }
+  u64 ctx = (u64)ipcs << 32 | tucs;
+  bool newctx = csum && ctx != txctx_;
+  u32 need = newctx ? 2 : 1;
+
+  scoped_acquire l(&txlk_);
   // WMREG_TDT should only equal WMREG_TDH when we have
   // nothing to transmit.  Therefore, we can accomodate
   // TX_RING_SIZE-1 buffers.
-  if (txinuse_ == TX_RING_SIZE-1) {
-    cprintf("TX ring overflow\n");
-    return -1;
+  if (txinuse_ + need > TX_RING_SIZE-1) {
+    // Let the device at what we've queued and give it a little while
+    // to make room, since lwIP doesn't retry dropped packets.
+    doorbelltx();
+    for (int us = 0; ; us++) {
+      reclaimtx();
+      if (txinuse_ + need <= TX_RING_SIZE-1)
+        break;
+      if (us == E1000_TX_WAIT_US) {
+        verbose.println("e1000: TX ring full, dropping packet");
+        return -1;
+      }
+      microdelay(1);
+    }
+  }
+
+  if (newctx) {
+    tail = txtail_;
+    desc = &txd_[tail];
+    if (!(desc->wtx_fields.wtxu_status & WTX_ST_DD))
+      panic("e1000tx");
+
+    // The context descriptor shares the ring slot's layout, so build it
+    // separately rather than through a cast of desc.
+    static_assert(sizeof(struct livengood_tcpip_ctxdesc) == sizeof(*desc),
+                  "context and data descriptors differ in size");
+    struct livengood_tcpip_ctxdesc cd;
+    cd.tcpip_ipcs = ipcs;
+    cd.tcpip_tucs = tucs;
+    cd.tcpip_cmdlen = WTX_CMD_DEXT | WTX_DTYP_C | WTX_CMD_RS |
+      WTX_TCPIP_CMD_IP;
+    cd.tcpip_seg = 0;
+    memcpy(desc, &cd, sizeof(cd));
+    txtail_ = (tail+1) % TX_RING_SIZE;
+    txinuse_++;
+    txpending_++;
+    txctx_ = ctx;
   }
 
-  tail = erd(WMREG_TDT);
+  tail = txtail_;
   desc = &txd_[tail];
   if (!(desc->wtx_fields.wtxu_status & WTX_ST_DD))
     panic("e1000tx");
@@ -229,28 +321,61 @@ e1000::transmit(void *buf, u32 len)
   desc->wtx_addr = v2p(buf);
   desc->wtx_cmdlen = len | WTX_CMD_RS | WTX_CMD_EOP | WTX_CMD_IFCS;
   memset(&desc->wtx_fields, 0, sizeof(desc->wtx_fields));
-  ewr(WMREG_TDT, (tail+1) % TX_RING_SIZE);
+  if (csum) {
+    desc->wtx_cmdlen |= WTX_CMD_DEXT | WTX_DTYP_D;
+    desc->wtx_fields.wtxu_options = popts;
+  }
+  txtail_ = (tail+1) % TX_RING_SIZE;
   txinuse_++;
+  if (++txpending_ >= E1000_TX_BATCH)
+    doorbelltx();
 
   if (0) console.print("Transmit ", shexdump(buf, len));
 
   return 0;
 }
 
+// Hand the queued packets to the device.  Called with txlk_ held.
+void
+e1000::doorbelltx()
+{
+  if (!txpending_)
+    return;
+  ewr(WMREG_TDT, txtail_);
+  txpending_ = 0;
+}
+
+void
+e1000::flush()
+{
+  scoped_acquire l(&txlk_);
+  doorbelltx();
+}
+
 void
 e1000::cleantx()
+{
+  scoped_acquire l(&txlk_);
+  reclaimtx();
+}
+
+// Free the buffers of the packets the device has sent.  Called with
+// txlk_ held.
+void
+e1000::reclaimtx()
 {
   struct wiseman_txdesc *desc;
   void *va;
 
-  scoped_acquire l(&lk_);
   while (txinuse_) {
     desc = &txd_[txclean_];
     if (!(desc->wtx_fields.wtxu_status & WTX_ST_DD))
       break;
 
-    va = p2v(desc->wtx_addr);
-    netfree(va);
+    if (!is_txctx(desc)) {
+      va = p2v(desc->wtx_addr);
+      netfree(va);
+    }
     desc->wtx_fields.wtxu_status = WTX_ST_DD;
 
     txclean_ = (txclean_+1) % TX_RING_SIZE;
@@ -259,15 +384,15 @@ e1000::cleantx()
   }
 }
 
+// Give the descriptor at the tail a fresh buffer.  The caller hands
+// it to the device by writing WMREG_RDT.  Called with rxlk_ held.
 void
 e1000::allocrx()
 {
   struct wiseman_rxdesc *desc;
   void *buf;
-  u32 i;
 
-  i = erd(WMREG_RDT);
-  desc = &rxd_[i];
+  desc = &rxd_[rxtail_];
   if (desc->wrx_status & WRX_ST_DD)
     panic("allocrx");
   buf = netalloc();
@@ -275,36 +400,116 @@ e1000::allocrx()
     panic("Oops");
   desc->wrx_addr = v2p(buf);
 
-  ewr(WMREG_RDT, (i+1) % RX_RING_SIZE);
+  rxtail_ = (rxtail_+1) % RX_RING_SIZE;
 }
 
-void
-e1000::cleanrx()
+// Hand up to budget received packets to the network stack.  Returns
+// how many there were.
+int
+e1000::cleanrx(int budget)
 {
   struct wiseman_rxdesc *desc;
-  void *va;
-  u16 len;
-
-  acquire(&lk_);
-  desc = &rxd_[rxclean_];
-  while (desc->wrx_status & WRX_ST_DD) {
-    va = p2v(desc->wrx_addr);
-    len = desc->wrx_len;
+  struct {
+    void *va;
+    u16 len;
+    u32 csum;
+  } batch[RX_BATCH];
+  int done = 0;
+
+  while (done < budget) {
+    // Descriptors taken off the ring, and packets to pass up
+    int taken = 0, n = 0;
+    {
+      // Take a batch off the ring and refill it, then hand the batch
+      // up without the lock.
+      scoped_acquire l(&rxlk_);
+      desc = &rxd_[rxclean_];
+      while (taken < RX_BATCH && done + taken < budget &&
+             (desc->wrx_status & WRX_ST_DD)) {
+        u8 status = desc->wrx_status, errors = desc->wrx_errors;
+        void *va = p2v(desc->wrx_addr);
+        taken++;
+        if (!(status & WRX_ST_IXSM) && (errors & (WRX_ER_IPE|WRX_ER_TCPE))) {
+          // The device found a bad checksum
+          netfree(va);
+        } else {
+          batch[n].va = va;
+          batch[n].len = desc->wrx_len;
+          batch[n].csum = 0;
+          if (!(status & WRX_ST_IXSM)) {
+            if (status & WRX_ST_IPCS)
+              batch[n].csum |= NETRX_IP_CSUM_OK;
+            if (status & WRX_ST_TCPCS)
+              batch[n].csum |= NETRX_L4_CSUM_OK;
+          }
+          n++;
+        }
+
+        desc->wrx_status = 0;
+        allocrx();
+
+        rxclean_ = (rxclean_+1) % RX_RING_SIZE;
+        desc = &rxd_[rxclean_];
+      }
+      if (taken)
+        ewr(WMREG_RDT, rxtail_);
+    }
+    if (!taken)
+      break;
 
-    desc->wrx_status = 0;
-    allocrx();
+    for (int i = 0; i < n; i++) {
+      if (0) console.print("Receive ", shexdump(batch[i].va, batch[i].len));
+      netrx(batch[i].va, batch[i].len, batch[i].csum);
+    }
+    done += taken;
+  }
+  return done;
+}
 
-    rxclean_ = (rxclean_+1) % RX_RING_SIZE;
+bool
+e1000::rxready()
+{
+  scoped_acquire l(&rxlk_);
+  return rxd_[rxclean_].wrx_status & WRX_ST_DD;
+}
 
-    if (0) console.print("Receive ", shexdump(va, len));
+void
+e1000::rxpoll()
+{
+  for (;;) {
+    {
+      scoped_acquire l(&rxpoll_lk_);
+      while (!rxpoll_)
+        rxpoll_cv_.sleep(&rxpoll_lk_);
+    }
 
-    release(&lk_);
-    netrx(va, len);
-    acquire(&lk_);
+    if (cleanrx(E1000_RX_BUDGET) == E1000_RX_BUDGET) {
+      // There may be more; let everything else run first.
+      yield();
+      continue;
+    }
 
-    desc = &rxd_[rxclean_];
+    // The ring is empty, so go back to interrupts.  A TX interrupt may
+    // have read (and so cleared) the cause of a packet that arrived
+    // while they were masked, so look at the ring once more after
+    // unmasking them.
+    {
+      scoped_acquire l(&rxpoll_lk_);
+      rxpoll_ = false;
+    }
+    ewr(WMREG_IMS, RX_INTRS);
+    if (rxready()) {
+      ewr(WMREG_IMC, RX_INTRS);
+      scoped_acquire l(&rxpoll_lk_);
+      rxpoll_ = true;
+    }
   }
-  release(&lk_);
+}
+
+void
+e1000::rxpoll_thread(void *arg)
+{
+  ((e1000*)arg)->rxpoll();
 }
 
 void
@@ -316,8 +521,12 @@ e1000::handle_irq()
     if (icr & ICR_TXDW)
       cleantx();
 
-    if (icr & ICR_RXT0)
-      cleanrx();
+    if (icr & RX_INTRS) {
+      ewr(WMREG_IMC, RX_INTRS);
+      scoped_acquire l(&rxpoll_lk_);
+      rxpoll_ = true;
+      rxpoll_cv_.wake_all();
+    }
 
     if (icr & ICR_RXO) {
       //panic("ICR_RXO");
@@ -334,6 +543,13 @@ e1000::get_hwaddr(uint8_t *hwaddr)
   memmove(hwaddr, hwaddr_, sizeof(hwaddr_));
 }
 
+uint32_t
+e1000::features()
+{
+  // Every model we drive has the 82540's checksum offloads
+  return NETDEV_TX_CSUM | NETDEV_RX_CSUM;
+}
+
 int
 e1000::attach(struct pci_func *pcif)
 {
@@ -371,8 +587,10 @@ e1000::attach(struct pci_func *pcif)
 
 e1000::e1000(const struct e1000_model *model, struct pci_func *pcif)
   : model_(model), membase_(pcif->reg_base[0]), iobase_(pcif->reg_base[2]),
-    txclean_(0), txinuse_(0), rxclean_(0), rxuse_(0), txd_{}, rxd_{},
-    lk_("e1000", true), valid_(false)
+    txclean_(0), txinuse_(0), txtail_(0), txpending_(0), txctx_(0),
+    rxclean_(0), rxtail_(0), txd_{}, rxd_{}, txlk_("e1000:tx", true),
+    rxlk_("e1000:rx", true), rxpoll_lk_("e1000:rxpoll", true),
+    rxpoll_cv_("e1000:rxpoll"), rxpoll_(false), valid_(false)
 {
   verbose.println("e1000: Initializing");
 
@@ -398,11 +616,14 @@ e1000::e1000(const struct e1000_model *model, struct pci_func *pcif)
     e1000irq.enable();
   }
   e1000irq.register_handler(this);
+  // The poller runs where the interrupts go
+  threadpin(rxpoll_thread, this, "e1000rx", 0);
 
   // Enable interrupts
   verbose.println("e1000: Enable interrupts");
   ewr(WMREG_IMC, ~0);
   erd(WMREG_STATUS);
+  ewr(WMREG_ITR, E1000_ITR);
   ewr(WMREG_IMS, ICR_TXDW | ICR_RXO | ICR_RXT0);
   erd(WMREG_STATUS);
 
@@ -563,9 +784,13 @@ e1000::init_rx()
   ewr(WMREG_RDBAL, rpa & 0xffffffff);
   ewr(WMREG_RDLEN, sizeof(rxd_));
   ewr(WMREG_RDH, 0);
-  ewr(WMREG_RDT, RX_RING_SIZE>>1);
+  rxtail_ = RX_RING_SIZE>>1;
+  ewr(WMREG_RDT, rxtail_);
   ewr(WMREG_RDTR, 0);
   ewr(WMREG_RADV, 0);
+  // [E1000 13.4.29] Check IP and TCP/UDP checksums, reported in the
+  // descriptors' status and error bits
+  ewr(WMREG_RXCSUM, RXCSUM_IPOFL | RXCSUM_TUOFL);
   ewr(WMREG_RCTL,
       RCTL_EN | RCTL_RDMTS_1_2 | RCTL_DPF | RCTL_BAM | RCTL_2k);
 }
@@ -0,0 +1,340 @@
+// epoll: readiness notification for many files at once.
+//
+// A file_epoll keeps an epitem for each watched FD.  The epitem sits
+// on the watched object's poll_queue (see epoll.hh) and, while it may
+// be ready, on one of the epoll's per-core ready lists: the list of
+// whichever core queued it, so notifying files on different cores
+// doesn't share a lock.  epoll_wait() takes items from its own core's
+// list first, rechecks their readiness, and re-queues level-triggered
+// items that are still ready.  Sleepers are woken through a condvar,
+// which puts them back on the run queue of their own core.
+
+#include "types.h"
+#include "kernel.hh"
+#include "spinlock.hh"
+#include "condvar.hh"
+#include "proc.hh"
+#include "cpu.hh"
+#include "file.hh"
+#include "epoll.hh"
+#include "mmu.h"
+#include <uk/epoll.h>
+#include <uk/fcntl.h>
+
+#define EPOLL_EVENTS (EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP)
+#define EPOLL_FLAGS  (EPOLLET | EPOLLONESHOT)
+
+struct file_epoll : public refcache::referenced, public file
+{
+  struct readylist {
+    spinlock lock;
+    ilist<epitem, &epitem::rlink> items;
+    std::atomic<int> n;
+
+    readylist() : lock("epoll:ready"), n(0) { }
+  } __mpalign__;
+
+  // Protects items_ and the harvesting of the ready lists
+  spinlock lock_;
+  ilist<epitem, &epitem::elink> items_;
+  readylist ready_[NCPU];
+  spinlock wait_lock_;
+  condvar wait_cv_;
+  std::atomic<int> nwaiters_;   // Procs asleep (or about to be) in wait()
+
+  file_epoll()
+    : lock_("epoll"), wait_lock_("epoll:wait"), wait_cv_("epoll:wait"),
+      nwaiters_(0) { }
+  NEW_DELETE_OPS(file_epoll);
+
+  ~file_epoll()
+  {
+    while (!items_.empty())
+      detach(&items_.front());
+  }
+
+  void inc() override { referenced::inc(); }
+  void dec() override { referenced::dec(); }
+
+  // Epoll instances don't nest
+  sref<poll_queue> pollq() override { return sref<poll_queue>(); }
+
+  void onzero() override
+  {
+    delete this;
+  }
+
+  epitem* find(int fd)
+  {
+    for (auto &it : items_)
+      if (it.fd == fd)
+        return &it;
+    return nullptr;
+  }
+
+  // Queue it on this core's ready list, unless it's already queued.
+  // Called with it->pq's lock or lock_ held.
+  void enqueue(epitem *it)
+  {
+    if (it->ready.load(std::memory_order_relaxed) >= 0)
+      return;
+    int c = myid();
+    readylist &rl = ready_[c];
+    {
+      scoped_acquire l(&rl.lock);
+      int expected = -1;
+      if (!it->ready.compare_exchange_strong(expected, c))
+        return;
+      rl.items.push_back(it);
+      // Sequentially consistent with the waiters' nwaiters_ increment
+      rl.n++;
+    }
+    if (nwaiters_) {
+      scoped_acquire l(&wait_lock_);
+      wait_cv_.wake_all();
+    }
+  }
+
+  // Take it off its ready list, if it's on one.  Returns false if it
+  // wasn't on one.
+  bool dequeue(epitem *it)
+  {
+    for (;;) {
+      int c = it->ready;
+      if (c < 0 || c >= NCPU)
+        return false;
+      readylist &rl = ready_[c];
+      scoped_acquire l(&rl.lock);
+      if (it->ready == c) {
+        rl.items.erase(rl.items.iterator_to(it));
+        rl.n--;
+        it->ready = -1;
+        return true;
+      }
+    }
+  }
+
+  // Stop watching it and free it.  Called with lock_ held (or from
+  // the destructor).
+  void detach(epitem *it)
+  {
+    it->pq->remove(it);
+    dequeue(it);
+    items_.erase(items_.iterator_to(it));
+    delete it;
+  }
+
+  int ctl(int op, int fd, sref<poll_queue> &&pq, u32 events, u64 data)
+  {
+    events &= EPOLL_EVENTS | EPOLL_FLAGS;
+    scoped_acquire l(&lock_);
+    epitem *it = find(fd);
+    switch (op) {
+    case EPOLL_CTL_ADD:
+      if (it)
+        return -1;
+      it = new epitem(this, fd, std::move(pq));
+      it->events = events;
+      it->armed = true;
+      it->data = data;
+      items_.push_back(it);
+      it->pq->add(it);
+      return 0;
+    case EPOLL_CTL_MOD:
+      if (!it)
+        return -1;
+      it->pq->modify(it, events, data);
+      return 0;
+    case EPOLL_CTL_DEL:
+      if (!it)
+        return -1;
+      detach(it);
+      return 0;
+    }
+    return -1;
+  }
+
+  bool any_ready() const
+  {
+    for (int c = 0; c < ncpu; c++)
+      if (ready_[c].n)
+        return true;
+    return false;
+  }
+
+  // Fill evs with up to max ready events.
+  int harvest(struct epoll_event *evs, int max)
+  {
+    scoped_acquire l(&lock_);
+    // Level-triggered items to re-queue.  While here, their ready is
+    // NCPU, so notifications leave them alone.
+    ilist<epitem, &epitem::rlink> again;
+    int n = 0;
+    int id = myid();
+    for (int i = 0; i < ncpu && n < max; i++) {
+      readylist &rl = ready_[(id + i) % ncpu];
+      while (n < max && rl.n) {
+        epitem *it;
+        {
+          scoped_acquire rll(&rl.lock);
+          if (rl.items.empty())
+            break;
+          it = &rl.items.front();
+          rl.items.pop_front();
+          rl.n--;
+          it->ready = -1;
+        }
+
+        u32 r = it->pq->revents() & (it->events | EPOLLERR | EPOLLHUP);
+        if (!it->armed || !r)
+          continue;
+        evs[n].events = r;
+        // epoll_event is packed, so data is unaligned
+        u64 data = it->data;
+        memcpy(&evs[n].data, &data, sizeof(data));
+        n++;
+        if (it->events & EPOLLONESHOT)
+          it->armed = false;
+        else if (!(it->events & EPOLLET)) {
+          int expected = -1;
+          if (it->ready.compare_exchange_strong(expected, NCPU))
+            again.push_back(it);
+        }
+      }
+    }
+
+    while (!again.empty()) {
+      epitem *it = &again.front();
+      again.pop_front();
+      it->ready = -1;
+      enqueue(it);
+    }
+    return n;
+  }
+
+  // Wait up to timeout ms (forever if negative) for ready events.
+  int wait(struct epoll_event *evs, int max, int timeout)
+  {
+    u64 deadline = timeout > 0 ? nsectime() + (u64)timeout * 1000000 : 0;
+    for (;;) {
+      int n = harvest(evs, max);
+      if (n || timeout == 0)
+        return n;
+
+      scoped_acquire l(&wait_lock_);
+      nwaiters_++;
+      auto cleanup = scoped_cleanup([this](){ nwaiters_--; });
+      if (any_ready())
+        continue;
+      if (deadline && nsectime() >= deadline)
+        return 0;
+      wait_cv_.sleep_to(&wait_lock_, deadline);
+    }
+  }
+};
+
+void
+poll_queue::add(epitem *it)
+{
+  scoped_acquire l(&lock_);
+  items_.push_back(it);
+  if (revents_ & (it->events | EPOLLERR | EPOLLHUP))
+    it->ep->enqueue(it);
+}
+
+void
+poll_queue::remove(epitem *it)
+{
+  scoped_acquire l(&lock_);
+  items_.erase(items_.iterator_to(it));
+}
+
+void
+poll_queue::modify(epitem *it, u32 events, u64 data)
+{
+  scoped_acquire l(&lock_);
+  it->events = events;
+  it->armed = true;
+  it->data = data;
+  if (revents_ & (it->events | EPOLLERR | EPOLLHUP))
+    it->ep->enqueue(it);
+}
+
+void
+poll_queue::notify(u32 events)
+{
+  for (auto &it : items_)
+    if (it.armed && (events & (it.events | EPOLLERR | EPOLLHUP)))
+      it.ep->enqueue(&it);
+}
+
+//SYSCALL
+int
+sys_epoll_create1(int flags)
+{
+  static_assert(EPOLL_CLOEXEC == O_CLOEXEC, "epoll flags must match open flags");
+  if (flags & ~EPOLL_CLOEXEC)
+    return -1;
+  sref<file> ep;
+  try {
+    ep = make_sref<file_epoll>();
+  } catch (std::bad_alloc &e) {
+    return -1;
+  }
+  return fdalloc(std::move(ep), flags);
+}
+
+//SYSCALL
+int
+sys_epoll_ctl(int epfd, int op, int fd, userptr<struct epoll_event> event)
+{
+  sref<file> f = getfile(epfd);
+  if (!f)
+    return -1;
+  file_epoll *ep = dynamic_cast<file_epoll*>(f.get());
+  if (!ep)
+    return -1;
+
+  struct epoll_event ev = {};
+  sref<poll_queue> pq;
+  if (op != EPOLL_CTL_DEL) {
+    if (!event.load(&ev))
+      return -1;
+  }
+  if (op == EPOLL_CTL_ADD) {
+    sref<file> target = getfile(fd);
+    if (!target)
+      return -1;
+    pq = target->pollq();
+    if (!pq)
+      return -1;
+  }
+  u64 data;
+  memcpy(&data, &ev.data, sizeof(data));
+  return ep->ctl(op, fd, std::move(pq), ev.events, data);
+}
+
+//SYSCALL
+int
+sys_epoll_wait(int epfd, userptr<struct epoll_event> events, int maxevents,
+               int timeout)
+{
+  sref<file> f = getfile(epfd);
+  if (!f)
+    return -1;
+  file_epoll *ep = dynamic_cast<file_epoll*>(f.get());
+  if (!ep || maxevents <= 0)
+    return -1;
+
+  // Return at most a page's worth at a time
+  int max = std::min(maxevents, (int)(PGSIZE / sizeof(struct epoll_event)));
+  auto evs = (struct epoll_event*)kalloc("epoll_wait");
+  if (!evs)
+    return -1;
+  auto cleanup = scoped_cleanup([evs](){ kfree(evs); });
+
+  int n = ep->wait(evs, max, timeout);
+  if (n > 0 && !userptr<void>(events.unsafe_get()).store_bytes(evs, n * sizeof(*evs)))
+    return -1;
+  return n;
+}
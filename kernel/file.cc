@@ -5,31 +5,114 @@
 #include "fs.h"
 #include "file.hh"
 #include <uk/stat.h>
+#include <uk/fcntl.h>
+#include <uk/uio.h>
 #include "net.hh"
+#include "proc.hh"
+#include "vm.hh"
+#include "ioacct.hh"
 
 struct devsw __mpalign__ devsw[NDEV];
 
+// Add the transactions needed to make this file durable to the given core's
+// journal, without committing them. For a file, datasync and the byte range
+// [start, end) narrow that down as sync_file() describes.
+// Returns -1 if some of the file's data couldn't get disk blocks, and stays
+// dirty.
 int
-file_mnode::fsync() {
+file_mnode::sync_to_journal(int cpu, bool datasync, u64 start, u64 end) {
 
-  if (!m)
-    return -1;
-
-  int cpu = myid();
   u64 fsync_tsc = get_tsc();
   rootfs_interface->process_metadata_log(fsync_tsc, m->mnum_, cpu);
 
   if (m->type() == mnode::types::file)
-    m->as_file()->sync_file(cpu);
+    return m->as_file()->sync_file(cpu, datasync, start, end);
   else if (m->type() == mnode::types::dir)
     m->as_dir()->sync_dir(cpu);
-
-  rootfs_interface->flush_transaction_queue(cpu);
   return 0;
 }
 
+int
+file_mnode::fsync() {
+
+  if (!m)
+    return -1;
+
+  ioacct_charge(IOACCT_FSYNCS, 1, m->mnum_);
+  int cpu = myhome();
+  int r = sync_to_journal(cpu);
+  rootfs_interface->group_commit_transactions(cpu);
+  return r;
+}
+
+int
+file_mnode::fdatasync(off_t offset, off_t len) {
+
+  if (!m || offset < 0 || len < 0)
+    return -1;
+
+  ioacct_charge(IOACCT_FSYNCS, 1, m->mnum_);
+  int cpu = myhome();
+  int r = sync_to_journal(cpu, true, offset, len ? offset + len : ~0ull);
+  rootfs_interface->group_commit_transactions(cpu);
+  return r;
+}
+
+// The journal's flusher thread commits the transactions in the background;
+// the returned ticket tells when they have been committed.
+int
+file_mnode::fsync_async(u64 *ticket) {
+
+  if (!m)
+    return -1;
+
+  int cpu = myhome();
+  int r = sync_to_journal(cpu);
+  *ticket = rootfs_interface->fsync_ticket(cpu);
+  return r;
+}
+
+// The file is synced to the journal first, so that the preallocation applies
+// to the file as it is in memory.
+int
+file_mnode::fallocate(int mode, off_t offset, off_t len) {
+
+  if (!m || m->type() != mnode::types::file || !writable)
+    return -1;
+  if (mode & ~FALLOC_FL_KEEP_SIZE || offset < 0 || len <= 0)
+    return -1;
+
+  int cpu = myhome();
+  sync_to_journal(cpu);
+  return m->as_file()->fallocate(cpu, offset, len,
+                                 mode & FALLOC_FL_KEEP_SIZE);
+}
+
+// As with fallocate(), the file is synced to the journal first, so that its
+// inode exists and has the size the file has in memory.
+int
+file_mnode::setcompress(bool on) {
+
+  if (!m || m->fs_ != root_fs)
+    return -1;
+  if (m->type() != mnode::types::dir &&
+      (m->type() != mnode::types::file || !writable))
+    return -1;
+
+  int cpu = myhome();
+  sync_to_journal(cpu);
+  return rootfs_interface->set_compress_flag(m->mnum_, on, cpu);
+}
+
 int
 file_mnode::stat(struct stat *st, enum stat_flags flags)
+{
+  stat_mnode(m.get(), st, flags);
+  return 0;
+}
+
+void
+file_mnode::stat_mnode(mnode *m, struct stat *st, enum stat_flags flags)
 {
   u8 stattype = 0;
   switch (m->type()) {
@@ -52,7 +135,6 @@ file_mnode::stat(struct stat *st, enum stat_flags flags)
       m->as_dev()->major() < NDEV &&
       devsw[m->as_dev()->major()].stat)
     devsw[m->as_dev()->major()].stat(m->as_dev(), st);
-  return 0;
 }
 
 ssize_t
@@ -78,21 +160,74 @@ file_mnode::read(char *addr, size_t n)
   } else if (m->type() != mnode::types::file) {
     return -1;
   } else {
-    mfile::page_state ps = m->as_file()->get_page(off / PGSIZE);
-    if (!ps.get_page_info())
-      return 0;
+    return read_file(addr, n, false);
+  }
+  if (r > 0)
+    off += r;
+  return r;
+}
 
-    if (ps.is_partial_page() && off >= *m->as_file()->read_size())
-      return 0;
+bool
+file_mnode::read_user(userptr<void> buf, size_t n, ssize_t *r)
+{
+  if (!readable || m->type() != mnode::types::file)
+    return false;
+  *r = read_file((char*)buf.unsafe_get(), n, true);
+  return true;
+}
 
-    l = off_lock.guard();
-    r = readm(m, addr, off, n);
+// read() of a regular file, into a user buffer if user is set.
+ssize_t
+file_mnode::read_file(char *addr, size_t n, bool user)
+{
+  u64 pageidx = off / PGSIZE;
+  u64 last = (off + (n ? n - 1 : 0)) / PGSIZE;
+  u32 ra = readahead_window(pageidx, last);
+  mfile *mf = m->as_file();
+  // Should the first page of the read have to come from the disk, the rest
+  // of the read's pages come along with it, and so does the readahead
+  // window if this read starts a sequential run.
+  u64 npages = std::min(last - pageidx, (u64)READAHEAD_MAX_PAGES);
+  bool new_run = ra && ra_end <= last;
+  mfile::page_state ps = mf->get_page(pageidx, npages + (new_run ? ra : 0));
+  if (new_run) {
+    ra_end = last + 1 + ra;
+  } else if (ra && ra_end < last + 1 + ra / 2) {
+    // Keep the next window on its way in while the reader works through
+    // the last one.
+    mf->readahead_async(ra_end, last + 1 + ra - ra_end);
+    ra_end = last + 1 + ra;
   }
+  if (!ps.get_page_info())
+    return 0;
+
+  if (ps.is_partial_page() && off >= *m->as_file()->read_size())
+    return 0;
+
+  auto l = off_lock.guard();
+  ssize_t r = readm(m, addr, off, n, user);
   if (r > 0)
     off += r;
   return r;
 }
 
+// Update the readahead state for a read() of the pages [pageidx, last], and
+// return the number of pages to read ahead of it. The window grows while the
+// reads are sequential, and collapses on a seek.
+u32
+file_mnode::readahead_window(u64 pageidx, u64 last)
+{
+  if (pageidx == ra_next) {
+    ra_pages = std::min(std::max(2 * ra_pages, (u32)READAHEAD_MIN_PAGES),
+                        (u32)READAHEAD_MAX_PAGES);
+  } else if (pageidx + 1 != ra_next) {
+    ra_pages = 0;
+    ra_end = 0;
+  }
+  ra_next = last + 1;
+  return ra_pages;
+}
+
 ssize_t
 file_mnode::write(const char *addr, size_t n)
 {
@@ -114,14 +249,7 @@ file_mnode::write(const char *addr, size_t n)
       return -1;
     }
   } else if (m->type() == mnode::types::file) {
-    l = off_lock.guard();
-    mfile::resizer resize;
-    if (append) {
-      resize = m->as_file()->write_size();
-      off = resize.read_size();
-    }
-
-    r = writem(m, addr, off, n, append ? &resize : nullptr);
+    return write_file(addr, n, false);
   } else {
     return -1;
   }
@@ -131,6 +259,44 @@ file_mnode::write(const char *addr, size_t n)
   return r;
 }
 
+bool
+file_mnode::write_user(userptr<void> buf, size_t n, ssize_t *r)
+{
+  if (!writable || m->type() != mnode::types::file)
+    return false;
+  *r = write_file((const char*)buf.unsafe_get(), n, true);
+  return true;
+}
+
+// write() of a regular file, from a user buffer if user is set. Appends
+// don't take off_lock until they're done: they land wherever the file ends
+// (see mfile::append()), and run in parallel with each other until then.
+ssize_t
+file_mnode::write_file(const char *addr, size_t n, bool user)
+{
+  if (append) {
+    ssize_t r = 0;
+    u64 end = 0;
+    while ((size_t)r < n) {
+      s64 w = m->as_file()->append(addr + r, n - r, user, &end);
+      if (w <= 0)
+        break;
+      r += w;
+    }
+    if (!r)
+      return n ? -1 : 0;
+    auto l = off_lock.guard();
+    off = end;
+    return r;
+  }
+
+  auto l = off_lock.guard();
+  ssize_t r = writem(m, addr, off, n, nullptr, user);
+  if (r > 0)
+    off += r;
+  return r;
+}
+
 ssize_t
 file_mnode::pread(char *addr, size_t n, off_t off)
 {
@@ -142,6 +308,9 @@ file_mnode::pread(char *addr, size_t n, off_t off)
       return -1;
     return devsw[major].pread(m->as_dev(), addr, off, n);
   }
+  ssize_t r;
+  if (direct_io(addr, n, off, false, &r))
+    return r;
   return readm(m, addr, off, n);
 }
 
@@ -156,9 +325,235 @@ file_mnode::pwrite(const char *addr, size_t n, off_t off)
       return -1;
     return devsw[major].pwrite(m->as_dev(), addr, off, n);
   }
+  ssize_t r;
+  if (direct_io((char *)addr, n, off, true, &r))
+    return r;
   return writem(m, addr, off, n);
 }
 
+bool
+file_mnode::pread_user(userptr<void> buf, size_t n, off_t off, ssize_t *r)
+{
+  if (!readable || m->type() != mnode::types::file)
+    return false;
+  char *addr = (char*)buf.unsafe_get();
+  if (!direct_io(addr, n, off, false, r))
+    *r = readm(m, addr, off, n, true);
+  return true;
+}
+
+bool
+file_mnode::pwrite_user(userptr<void> buf, size_t n, off_t off, ssize_t *r)
+{
+  if (!writable || m->type() != mnode::types::file)
+    return false;
+  char *addr = (char*)buf.unsafe_get();
+  if (!direct_io(addr, n, off, true, r))
+    *r = writem(m, addr, off, n, nullptr, true);
+  return true;
+}
+
+// The file offset is locked once for the whole vector, so a readv() or
+// writev() isn't interleaved with other I/O through this file.
+bool
+file_mnode::readv_user(const struct iovec *iov, int iovcnt, off_t offset,
+                       ssize_t *r)
+{
+  if (!readable || m->type() != mnode::types::file)
+    return false;
+
+  lock_guard<sleeplock> l;
+  bool at_off = offset < 0;
+  if (at_off) {
+    l = off_lock.guard();
+    offset = off;
+  }
+  ssize_t done = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    if (!iov[i].iov_len)
+      continue;
+    s64 n = readm(m, (char*)iov[i].iov_base, offset + done, iov[i].iov_len,
+                  true);
+    if (n < 0) {
+      if (!done)
+        done = -1;
+      break;
+    }
+    done += n;
+    if ((size_t)n < iov[i].iov_len)
+      break;
+  }
+  if (at_off && done > 0)
+    off += done;
+  *r = done;
+  return true;
+}
+
+bool
+file_mnode::writev_user(const struct iovec *iov, int iovcnt, off_t offset,
+                        ssize_t *r)
+{
+  // Appends go through a kernel buffer, one page at a time, since unlike a
+  // write() they'd need all of the vector's bytes to land together.
+  if (!writable || m->type() != mnode::types::file ||
+      (append && offset < 0))
+    return false;
+
+  lock_guard<sleeplock> l;
+  bool at_off = offset < 0;
+  if (at_off) {
+    l = off_lock.guard();
+    offset = off;
+  }
+  ssize_t done = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    if (!iov[i].iov_len)
+      continue;
+    // writem() takes the resizer only around the pages that grow the file,
+    // as it can't be held across copies from user memory.
+    s64 n = writem(m, (const char*)iov[i].iov_base, offset + done,
+                   iov[i].iov_len, nullptr, true);
+    if (n < 0) {
+      if (!done)
+        done = -1;
+      break;
+    }
+    done += n;
+    if ((size_t)n < iov[i].iov_len)
+      break;
+  }
+  if (at_off && done > 0)
+    off += done;
+  *r = done;
+  return true;
+}
+
+// The pages go to out->write() straight from the page cache, each held by
+// its page_info reference for the duration, so a pipe or socket copies the
+// data once, into its own buffer. Without an offset, each page's worth of
+// the file offset is claimed under off_lock, which isn't held across the
+// write: a pipe can block it for as long as its reader likes. The part of a
+// short write that wasn't sent goes back, unless others have read on since.
+ssize_t
+file_mnode::sendfile(file *out, off_t *offset, size_t n)
+{
+  if (!readable || m->type() != mnode::types::file || out == this)
+    return -1;
+  if (offset && *offset < 0)
+    return -1;
+
+  mfile *mf = m->as_file();
+  ssize_t done = 0;
+  while ((u64)done < n) {
+    u64 size = *mf->read_size();
+    u64 pos, len;
+    {
+      lock_guard<sleeplock> l;
+      if (offset) {
+        pos = *offset + done;
+      } else {
+        l = off_lock.guard();
+        pos = off;
+      }
+      if (pos >= size)
+        break;
+      len = std::min(std::min(n - done, size - pos),
+                     PGROUNDDOWN(pos) + PGSIZE - pos);
+      if (!offset)
+        off = pos + len;
+    }
+
+    u64 pgbase = PGROUNDDOWN(pos);
+    u64 end = std::min(pos + (n - done), size);
+    mfile::page_state ps = mf->get_page(
+      pgbase / PGSIZE,
+      std::min((PGROUNDUP(end) - pgbase) / PGSIZE - 1,
+               (u64)READAHEAD_MAX_PAGES));
+    sref<page_info> pi = ps.get_page_info();
+    ssize_t w = pi ? out->write((const char*)pi->va() + (pos - pgbase), len) :
+                     -1;
+    if ((u64)std::max(w, (ssize_t)0) < len && !offset) {
+      auto l = off_lock.guard();
+      if (off == pos + len)
+        off = pos + std::max(w, (ssize_t)0);
+    }
+    if (w <= 0) {
+      if (!done)
+        done = -1;
+      break;
+    }
+    done += w;
+    if ((u64)w < len)
+      break;
+  }
+
+  if (done > 0 && offset)
+    *offset += done;
+  return done;
+}
+
+// O_DIRECT: a pread() or pwrite() of whole pages of anonymous memory goes
+// straight between the user's pages and the file's disk blocks. Dirty
+// page-cache pages in the range are synced first, and a write drops the
+// cached copies of the pages it overwrote. Returns false, for the caller to
+// go through the page cache instead, if the I/O isn't page-aligned, or a
+// write would grow the file or fill in holes; otherwise *r is the result.
+bool
+file_mnode::direct_io(char *addr, size_t n, off_t off, bool write, ssize_t *r)
+{
+  if (!direct || m->type() != mnode::types::file || m->fs_ != root_fs ||
+      off < 0 || !n || ((u64)off | n | (uptr)addr) % PGSIZE)
+    return false;
+
+  mfile *mf = m->as_file();
+  u64 size = *mf->read_size();
+  if (write && off + n > size)
+    return false;
+  if ((u64)off >= size) {
+    *r = 0;
+    return true;
+  }
+  u64 len = std::min((u64)n, PGROUNDUP(size) - off);
+
+  // Pages that couldn't get disk blocks are only in the page cache.
+  int cpu = myhome();
+  if (sync_to_journal(cpu, true, off, off + len) < 0)
+    return false;
+
+  // Reads must find journaled copies of the pages applied to the blocks, and
+  // writes must not have older journaled copies applied over them. No sync
+  // journals pages of the file until the cached copies that a write makes
+  // stale are dropped.
+  auto lock = mf->begin_direct_io();
+
+  u64 done = 0;
+  while (done < len) {
+    u32 npages = std::min((len - done) / PGSIZE, (u64)DIRECT_IO_BATCH_PAGES);
+    sref<page_info> pis[DIRECT_IO_BATCH_PAGES];
+    char *pages[DIRECT_IO_BATCH_PAGES];
+    u32 i;
+    for (i = 0; i < npages; i++) {
+      pis[i] = myproc()->vmap->pin_page((uptr)addr + done + i * PGSIZE, !write);
+      if (!pis[i])
+        break;
+      pages[i] = (char *)pis[i]->va();
+    }
+    if (i < npages ||
+        !rootfs_interface->direct_io_file(m->mnum_, pages, off + done, npages,
+                                          write, cpu)) {
+      if (!done)
+        return false;
+      break;
+    }
+    if (write)
+      for (i = 0; i < npages; i++)
+        mf->put_page((off + done) / PGSIZE + i);
+    done += npages * PGSIZE;
+  }
+
+  *r = std::min(done, size - off);
+  return true;
+}
 
 int
 file_pipe_reader::stat(struct stat *st, enum stat_flags flags)
@@ -177,6 +572,12 @@ file_pipe_reader::read(char *addr, size_t n)
   return piperead(pipe, addr, n);
 }
 
+sref<poll_queue>
+file_pipe_reader::pollq(void)
+{
+  return pipepollq(pipe, false);
+}
+
 void
 file_pipe_reader::onzero(void)
 {
@@ -202,6 +603,12 @@ file_pipe_writer::write(const char *addr, size_t n)
   return pipewrite(pipe, addr, n);
 }
 
+sref<poll_queue>
+file_pipe_writer::pollq(void)
+{
+  return pipepollq(pipe, true);
+}
+
 void
 file_pipe_writer::onzero(void)
 {
@@ -40,6 +40,10 @@
 #include "dirns.hh"
 #include "kstream.hh"
 #include "scalefs.hh"
+#include "numa.hh"
+#include "shrinker.hh"
+#include "pagecopy.hh"
+#include "zcluster.hh"
 
 #define BLOCKROUNDUP(off) (((off)%BSIZE) ? (off)/BSIZE+1 : (off)/BSIZE)
 
@@ -66,6 +70,9 @@ get_superblock(struct superblock *sb)
   sb->size = sb_root.size;
   sb->ninodes = sb_root.ninodes;
   sb->nblocks = sb_root.nblocks;
+  memmove(sb->journal_blknums, sb_root.journal_blknums,
+          sizeof(sb->journal_blknums));
+  sb->flags = sb_root.flags;
 }
 
 // Zero the in-memory buffer-cache block corresponding to a disk block.
@@ -77,7 +84,7 @@ bzero(int dev, int bno, bool writeback = false)
   sref<buf> bp = buf::get(dev, bno, true);
   {
     auto locked = bp->write();
-    memset(locked->data, 0, BSIZE);
+    pagezero(locked->data);
   }
   if (writeback)
     bp->writeback_async();
@@ -103,13 +110,26 @@ throw_out_of_blocks()
 
 // Allocate a disk block. This makes changes only to the in-memory
 // free-bit-vector (maintained by rootfs_interface), not the one on the disk.
+//
+// Blocks for file data pass the file's inode and a goal block (the one after
+// the file's previous block, if any), so that files are laid out contiguously:
+// the block comes from the extent reserved for the inode (see
+// reserve_extent()) if there is one, or else as close after the goal as
+// possible.
 static u32
-balloc(u32 dev, transaction *trans = NULL, bool zero_on_alloc = false)
+balloc(u32 dev, transaction *trans = NULL, bool zero_on_alloc = false,
+       inode *ip = nullptr, u32 goal = 0)
 {
-  int b;
+  u32 b, len;
 
   if (dev == 1) {
-    b = rootfs_interface->alloc_block();
+    if (ip && ip->extent_next < ip->extent_end)
+      b = ip->extent_next++;
+    else if (goal)
+      b = rootfs_interface->alloc_extent(1, goal, &len);
+    else
+      b = rootfs_interface->alloc_block();
+
     if (b < sb_root.size) {
       if (trans)
         trans->add_allocated_block(b);
@@ -125,6 +145,34 @@ balloc(u32 dev, transaction *trans = NULL, bool zero_on_alloc = false)
   return 0;
 }
 
+// Allocate exactly block goal for the file data of inode ip, if it is free
+// (nearby), or else return 0.
+static u32
+balloc_exact(u32 dev, transaction *trans, bool zero_on_alloc, inode *ip,
+             u32 goal)
+{
+  u32 b, len;
+
+  if (ip->extent_next < ip->extent_end) {
+    if (ip->extent_next != goal)
+      return 0;
+    b = ip->extent_next++;
+  } else {
+    b = rootfs_interface->alloc_extent(1, goal, &len);
+    if (b != goal) {
+      // Never handed out, so it can go straight back.
+      rootfs_interface->free_block(b);
+      return 0;
+    }
+  }
+
+  if (trans)
+    trans->add_allocated_block(b);
+  if (zero_on_alloc)
+    bzero(dev, b);
+  return b;
+}
+
 // Free a disk block. We never zero out blocks during free (we do that only
 // during allocation, if desired).
 //
@@ -165,10 +213,12 @@ balloc_free_on_disk(std::vector<u32>& blocks, transaction *trans, bool alloc)
     // Record the highest block-number represented in this free bitmap block,
     // to facilitate merging of all updates that touch the same bitmap block.
     u32 max_bno = *bno | (BPB - 1);
+    u64 dirty_chunks = 0;
 
     do {
       int bi = *bno % BPB;
       int m = 1 << (bi % 8);
+      dirty_chunks |= txn_chunk_mask(bi/8, 1);
       if (alloc) {
         if ((locked->data[bi/8] & m) != 0)
           panic("balloc_free_on_disk: block %d already in use", *bno);
@@ -180,7 +230,7 @@ balloc_free_on_disk(std::vector<u32>& blocks, transaction *trans, bool alloc)
       }
     } while (++bno && bno != blocks.end() && *bno <= max_bno);
 
-    bp->add_to_transaction(trans);
+    bp->add_to_transaction(trans, dirty_chunks);
   }
 }
 
@@ -216,106 +266,178 @@ balloc_free_on_disk(std::vector<u32>& blocks, transaction *trans, bool alloc)
 // A non-zero ip->ref keeps these unlocked inodes in the cache.
 
 
-// Initialize the freeinum_bitmap from the disk when the system boots.
+static const u32 inums_per_group = INODE_GROUP_BLOCKS * IPB;
+
+// Set up the (empty) inode groups when the system boots; the inode blocks
+// themselves are only read as the groups get loaded.
 static void
 initialize_freeinum_bitmap(void)
 {
-  sref<buf> bp;
   superblock sb;
-  int ninums;
-  u32 first_free_inodeblock_inum = 0;
 
   get_superblock(&sb);
 
-  // Allocate the memory for the inum_vector in one shot, instead of doing it
-  // piecemeal using .push_back() in a loop.
-  freeinum_bitmap.inum_vector.reserve(sb.ninodes);
-
-  for (u32 inum = 0; inum < sb.ninodes; inum += IPB) {
-    bp = buf::get(1, IBLOCK(inum));
-    auto copy = bp->read();
+  freeinum_bitmap.ninodes = sb.ninodes;
+  freeinum_bitmap.ngroups = (sb.ninodes + inums_per_group - 1) / inums_per_group;
+  freeinum_bitmap.groups =
+    new freeinum_bitmap::inum_group[freeinum_bitmap.ngroups];
 
-    ninums = std::min((u32)IPB, sb.ninodes - inum);
+  if (VERBOSE)
+    for (int cpu = 0; cpu < NCPU; cpu++)
+      cprintf("Per-CPU inode allocator: CPU %d   inode groups [%u - %u)\n",
+              cpu, cpu * freeinum_bitmap.ngroups / NCPU,
+              (cpu+1) * freeinum_bitmap.ngroups / NCPU);
+}
 
-    for (int i = 0; i < ninums; i++) {
-      const dinode *dip = (const struct dinode*)copy->data + (inum + i)%IPB;
+// The CPU that group g is handed to when it is loaded for its own sake,
+// rather than by a CPU that ran out of groups of its own.
+static int
+inum_group_home(u32 g)
+{
+  return (u64)g * NCPU / freeinum_bitmap.ngroups;
+}
 
-      // Maintain a vector as well as a linked-list representation of the free
-      // inums, to speed up freeing and allocation of blocks, respectively.
-      free_inum *finum = new free_inum(inum + i, !dip->type);
-      freeinum_bitmap.inum_vector.push_back(finum);
+// Read the inode blocks of group g and add its free inums to cpu's freelist,
+// unless another CPU got there first. Returns true if the group was loaded
+// here and had any free inums.
+static bool
+load_inum_group(u32 g, int cpu)
+{
+  auto &group = freeinum_bitmap.groups[g];
+  if (group.loaded)
+    return false;
+
+  auto load_lock = group.load_lock.guard();
+  if (group.loaded)
+    return false;
+
+  u32 first = g * inums_per_group;
+  u32 ninums = std::min(inums_per_group, freeinum_bitmap.ninodes - first);
+  u32 nblocks = (ninums + IPB - 1) / IPB;
+  std::vector<sref<buf> > bufs = buf::get_range(1, IBLOCK(first), nblocks);
+
+  // Fill in the whole vector before linking any of it, so that it never gets
+  // reallocated underneath the freelist.
+  group.inums.reserve(ninums);
+  memacct_add(MEMACCT_FREE_INUM, ninums, ninums * sizeof(free_inum));
+  for (u32 k = 0; k < nblocks; k++) {
+    auto copy = bufs[k]->read();
+    u32 n = std::min((u32)IPB, (u32)(ninums - k * IPB));
+    for (u32 i = 0; i < n; i++) {
+      const dinode *dip = (const struct dinode*)copy->data + i;
+      u32 inum = first + k * IPB + i;
+      // inum 0 is not used, so don't add it to any freelist.
+      group.inums.emplace_back(inum, inum != 0 && !dip->type);
+      group.inums.back().cpu = cpu;
+    }
+  }
 
-      // Make note of the first inode block (inum) that starts with a free inum
-      // (which is an approximation that, that entire inode block (and all
-      // the subsequent ones) contains only free inums). That's where we'll
-      // start allocating per-CPU resources from (further down in the code),
-      // in order to avoid initializing CPU0 with nearly no free inums.
-      if (!first_free_inodeblock_inum && !dip->type && i == 0)
-        first_free_inodeblock_inum = inum;
+  bool any_free = false;
+  {
+    auto &fl = freeinum_bitmap.freelists[cpu];
+    auto list_lock = fl.list_lock.guard();
+    for (auto &finum : group.inums) {
+      if (finum.is_free) {
+        fl.inum_freelist.push_back(&finum);
+        any_free = true;
+      }
     }
   }
 
-  // Distribute the inums among the CPUs and add the free inums to the per-CPU
-  // freelists.
+  group.loaded = true;
+  return any_free;
+}
 
-  // TODO: Remove this assert and handle cases where multiple CPUs have to share
-  // the same inode blocks.
-  static_assert(NINODES/IPB >= NCPU, "No. of inode blocks < NCPU\n");
+// Load the next unloaded group that has free inums for cpu: its own groups
+// first, in order, then those that other CPUs have not got to yet, preferring
+// CPUs on our own NUMA node. Returns false once every group is loaded.
+static bool
+load_free_inum_group(int cpu)
+{
+  u32 ngroups = freeinum_bitmap.ngroups;
+  int order[NCPU];
+  order[0] = cpu;
+  numa_steal_order(cpu, order + 1, NCPU);
+
+  for (int i = 0; i < NCPU; i++) {
+    for (u32 g = order[i] * ngroups / NCPU; g < (order[i]+1) * ngroups / NCPU;
+         g++) {
+      if (load_inum_group(g, cpu))
+        return true;
+    }
+  }
+  return false;
+}
 
-  u32 ninodeblocks = sb.ninodes/IPB - first_free_inodeblock_inum/IPB;
-  u32 inodeblocks_per_cpu = ninodeblocks/NCPU;
-  u32 inums_per_cpu = inodeblocks_per_cpu * IPB;
+static free_inum *
+inum_entry(u32 inum)
+{
+  auto &group = freeinum_bitmap.groups[inum / inums_per_group];
+  assert(group.loaded);
+  return &group.inums.at(inum % inums_per_group);
+}
 
-  for (int cpu = 0; cpu < NCPU; cpu++) {
-    auto list_lock = freeinum_bitmap.freelists[cpu].list_lock.guard();
+// Take a free inum off the freelist fl, if it has any.
+static bool
+pop_free_inum(struct freeinum_bitmap::freelist &fl, u32 *inum)
+{
+  if (fl.inum_freelist.empty())
+    return false;
+
+  auto list_lock = fl.list_lock.guard();
+  if (fl.inum_freelist.empty())
+    return false;
+
+  auto it = fl.inum_freelist.begin();
+  assert(it->is_free);
+  it->is_free = false;
+  *inum = it->inum_;
+  fl.inum_freelist.erase(it);
+  return true;
+}
 
-    if (VERBOSE)
-      cprintf("Per-CPU inode allocator: CPU %d   inodes [%u - %u]\n",
-              cpu, first_free_inodeblock_inum + cpu * inums_per_cpu,
-              first_free_inodeblock_inum + ((cpu+1) * inums_per_cpu) - 1);
+// Hand the inode block (IPB inums) that holds the first free inum of
+// from_cpu's freelist over to cpu, in one go. All of the block's inums that
+// from_cpu owns change owner, in-use ones included, so that from now on they
+// are allocated and freed only on cpu: creates on different CPUs keep
+// updating disjoint inode blocks (and hence take disjoint inodebitmap_locks).
+// Returns false if there was nothing to hand over.
+static bool
+adopt_inode_block(int cpu, int from_cpu)
+{
+  auto &from = freeinum_bitmap.freelists[from_cpu];
+  free_inum *moved[IPB];
+  u32 nmoved = 0;
 
-    for (u32 inum = cpu * inums_per_cpu; inum < (cpu+1) * inums_per_cpu; inum++) {
-      if (!inum)
-        continue; // inum 0 is not used, so don't add it to any freelist.
+  if (from.inum_freelist.empty())
+    return false;
 
-      auto finum = freeinum_bitmap.inum_vector.at(inum +
-                                                  first_free_inodeblock_inum);
-      finum->cpu = cpu;
-      if (finum->is_free)
-        freeinum_bitmap.freelists[cpu].inum_freelist.push_back(finum);
-    }
-  }
+  {
+    auto list_lock = from.list_lock.guard();
+    if (from.inum_freelist.empty())
+      return false;
+
+    // Groups are made of whole inode blocks, so the block is all loaded.
+    u32 first = from.inum_freelist.begin()->inum_ / IPB * IPB;
+    u32 last = std::min(first + (u32)IPB, freeinum_bitmap.ninodes);
+    for (u32 inum = first; inum < last; inum++) {
+      free_inum *finum = inum_entry(inum);
+      if (finum->cpu != from_cpu)
+        continue;
 
-  // Build a global reserve pool of free inums using whatever is remaining,
-  // to be used when a per-CPU freelist runs out, before stealing free inums
-  // from other CPUs' freelists.
-  if (NCPU * inodeblocks_per_cpu < ninodeblocks) {
-    auto list_lock = freeinum_bitmap.reserve_freelist.list_lock.guard();
-    for (u32 inum = NCPU * inums_per_cpu;
-         inum + first_free_inodeblock_inum < sb.ninodes; inum++) {
-      if (!inum)
-        continue; // inum 0 is not used, so don't add it to any freelist.
-
-      auto finum = freeinum_bitmap.inum_vector.at(inum +
-                                                  first_free_inodeblock_inum);
-      finum->cpu = NCPU; // Invalid CPU number to denote reserve pool.
-      if (finum->is_free)
-        freeinum_bitmap.reserve_freelist.inum_freelist.push_back(finum);
+      finum->cpu = cpu;
+      if (finum->is_free) {
+        from.inum_freelist.erase(from.inum_freelist.iterator_to(finum));
+        moved[nmoved++] = finum;
+      }
     }
   }
 
-  // Any other leftover free inums from [1 to first_free_inodeblock_inum) also
-  // go to the reserve pool. Also make sure to set the CPU number for those
-  // free-inums irrespective of whether they are free.
-  {
-    auto list_lock = freeinum_bitmap.reserve_freelist.list_lock.guard();
-    for (u32 inum = 1; inum < first_free_inodeblock_inum; inum++) {
-      auto finum = freeinum_bitmap.inum_vector.at(inum);
-      finum->cpu = NCPU; // Invalid CPU number to denote reserve pool.
-      if (finum->is_free)
-        freeinum_bitmap.reserve_freelist.inum_freelist.push_back(finum);
-    }
-  }
+  auto &to = freeinum_bitmap.freelists[cpu];
+  auto list_lock = to.list_lock.guard();
+  for (u32 i = 0; i < nmoved; i++)
+    to.inum_freelist.push_back(moved[i]);
+  return nmoved > 0;
 }
 
 // Allocate an inode number from the freeinum_bitmap.
@@ -323,101 +445,62 @@ static u32
 alloc_inode_number(void)
 {
   u32 inum;
-  int cpu = myid();
-  static bool warned_once = false;
+  int cpu = myhome();
 
   // Use the linked-list representation of the free-inums to perform inum
   // allocation in O(1) time. This list only contains the inums that are
   // actually free, so we can allocate any one of them.
-
-  {
-    auto list_lock = freeinum_bitmap.freelists[cpu].list_lock.guard();
-
-    if (!freeinum_bitmap.freelists[cpu].inum_freelist.empty()) {
-      auto it = freeinum_bitmap.freelists[cpu].inum_freelist.begin();
-      assert(it->is_free);
-      it->is_free = false;
-      inum = it->inum_;
-      freeinum_bitmap.freelists[cpu].inum_freelist.erase(it);
+  for (;;) {
+    if (pop_free_inum(freeinum_bitmap.freelists[cpu], &inum))
       return inum;
-    }
-  }
 
-  // If we run out of inums in our local CPU's freelist, tap into the global
-  // reserve pool first.
-  if (VERBOSE && !warned_once) {
-    cprintf("WARNING: alloc_inum(): CPU %d allocating inums from the global "
-            "reserve pool.\nThis could be a sign that inums are getting "
-            "leaked!\n", cpu);
-    warned_once = true;
-  }
-
-  // TODO: Allocate from the reserve pool in bulk in order to reduce the
-  // chances of contention even further.
-  {
-    if (freeinum_bitmap.reserve_freelist.inum_freelist.empty())
-      goto try_neighbor;
-
-    auto list_lock = freeinum_bitmap.reserve_freelist.list_lock.guard();
-
-    if (!freeinum_bitmap.reserve_freelist.inum_freelist.empty()) {
-      auto it = freeinum_bitmap.reserve_freelist.inum_freelist.begin();
-      assert(it->is_free);
-      it->is_free = false;
-      inum = it->inum_;
-      freeinum_bitmap.reserve_freelist.inum_freelist.erase(it);
-      return inum;
-    }
-  }
-
-  // We failed to allocate even from the reserve pool. So steal free inums
-  // from other CPUs. Each CPU starts its fallback-search at a different
-  // point, in order to avoid hotspots. Note that these inums are only
-  // borrowed temporarily and are prompty returned to the original CPU's
-  // freelists upon being freed.
-try_neighbor:
-  for (int fallback_cpu = cpu + 1; fallback_cpu % NCPU != cpu; fallback_cpu++) {
-    int fcpu = fallback_cpu % NCPU;
-
-    if (freeinum_bitmap.freelists[fcpu].inum_freelist.empty())
+    // If we run out of inums in our local CPU's freelist, load the next
+    // group that nobody has touched yet.
+    if (load_free_inum_group(cpu))
       continue;
 
-    auto list_lock = freeinum_bitmap.freelists[fcpu].list_lock.guard();
-
-    if (!freeinum_bitmap.freelists[fcpu].inum_freelist.empty()) {
-      auto it = freeinum_bitmap.freelists[fcpu].inum_freelist.begin();
-      assert(it->is_free);
-      it->is_free = false;
-      inum = it->inum_;
-      freeinum_bitmap.freelists[fcpu].inum_freelist.erase(it);
-      return inum;
+    // Every group is loaded. So take over an inode block from another CPU,
+    // preferring CPUs on our own NUMA node. Each CPU starts its
+    // fallback-search at a different point, in order to avoid hotspots.
+    bool adopted = false;
+    int order[NCPU - 1];
+    numa_steal_order(cpu, order, NCPU);
+    for (int i = 0; i < NCPU - 1; i++) {
+      if (adopt_inode_block(cpu, order[i])) {
+        adopted = true;
+        break;
+      }
     }
+    if (!adopted)
+      break;
   }
 
   panic("alloc_inum(): Out of inums on CPU %d\n", cpu);
   return 0; // out of inode numbers
 }
 
-// Mark an inode number as free in the freeinum_bitmap.
+// Mark an inode number as free in the freeinum_bitmap. Its group is already
+// loaded, by free_inode().
 void
 free_inode_number(u32 inum)
 {
   // Use the vector representation of the free-inums to free the inum in
   // O(1) time (by optimizing the blocknumber-to-free_inum lookup).
-  free_inum *finum = freeinum_bitmap.inum_vector.at(inum);
+  free_inum *finum = inum_entry(inum);
+
+  // The owner of an inum only changes under the old owner's list_lock (see
+  // adopt_inode_block()), so recheck it once the lock is held.
+  for (;;) {
+    int cpu = finum->cpu;
+    auto &fl = freeinum_bitmap.freelists[cpu];
+    auto list_lock = fl.list_lock.guard();
+    if (finum->cpu != cpu)
+      continue;
 
-  int cpu = finum->cpu;
-  if (cpu < NCPU) {
-    auto list_lock = freeinum_bitmap.freelists[cpu].list_lock.guard();
-    assert(!finum->is_free);
-    finum->is_free = true;
-    freeinum_bitmap.freelists[cpu].inum_freelist.push_front(finum);
-  } else {
-    // This inum belongs to the global reserve pool.
-    auto list_lock = freeinum_bitmap.reserve_freelist.list_lock.guard();
     assert(!finum->is_free);
     finum->is_free = true;
-    freeinum_bitmap.reserve_freelist.inum_freelist.push_front(finum);
+    fl.inum_freelist.push_front(finum);
+    return;
   }
 }
 
@@ -428,7 +511,14 @@ initinode_early(void)
   scoped_gc_epoch e;
 
   readsb(ROOTDEV, &sb_root); // Initialize sb_root by reading the superblock.
-  ins = new chainhash<pair<u32, u32>, inode*>(NINODES_PRIME);
+  if (sb_root.flags & ~SB_FLAGS)
+    panic("initinode_early: unknown file system format flags %#x\n",
+          sb_root.flags);
+  if ((sb_root.flags & SB_LARGEFILE) && !(sb_root.flags & SB_EXTENTS))
+    panic("initinode_early: large files need extent-mapped inodes\n");
+  if ((sb_root.flags & SB_COMPRESS) && !(sb_root.flags & SB_EXTENTS))
+    panic("initinode_early: compressed files need extent-mapped inodes\n");
+  ins = new chainhash<pair<u32, u32>, inode*>(FS_MAP_MIN_BUCKETS);
 
   the_root = inode::alloc(ROOTDEV, ROOTINO);
   if (!ins->insert(make_pair(the_root->dev, the_root->inum), the_root.get()))
@@ -444,7 +534,10 @@ initinode_late(void)
   // Re-initialize the root directory after crash-recovery, so as to reflect the
   // most up-to-date state.
   the_root->init();
+
+  mount_phase_timer t(MOUNT_FREEINUM);
   initialize_freeinum_bitmap();
+  t.add_objects(freeinum_bitmap.ngroups);
 }
 
 // Returns an inode locked for write, on success.
@@ -482,10 +575,14 @@ ialloc(u32 dev, short type)
 }
 
 void
-free_inode(sref<inode> ip, transaction *tr)
+free_inode(borrowed<inode> ip, transaction *tr)
 {
   ilock(ip, WRITELOCK);
   assert(ip->nlink() == 0);
+  // Load the inode's group while the inode still reads as in use on the disk,
+  // so that loading it later cannot hand the inum out before the commit.
+  u32 g = ip->inum / inums_per_group;
+  load_inum_group(g, inum_group_home(g));
   // Postpone reusing this inode number until transaction commit.
   tr->add_free_inum(ip->inum);
   // Release the inode on the disk.
@@ -508,7 +605,7 @@ free_inode(sref<inode> ip, transaction *tr)
 // need to hold it for write, in order to log the correct snapshot of the inode
 // to the transaction).
 void
-iupdate(sref<inode> ip, transaction *trans)
+iupdate(borrowed<inode> ip, transaction *trans)
 {
   scoped_gc_epoch e;
 
@@ -516,29 +613,42 @@ iupdate(sref<inode> ip, transaction *trans)
   auto locked = bp->write();
 
   dinode *dip = (struct dinode*)locked->data + ip->inum%IPB;
+  // An allocated inode whose last link goes away (unlinked while still open)
+  // is an orphan; the transaction keeps the on-disk orphan table up to date
+  // (see update_orphan_table()). Inodes that are created and not linked yet
+  // are left out, so that creates don't all touch the one orphan block.
+  bool was_orphan = dip->type && !dip->nlink;
+  bool was_linked = dip->type && dip->nlink;
   dip->type = ip->type;
   dip->major = ip->major;
   dip->minor = ip->minor;
   dip->nlink = ip->nlink();
   dip->size = ip->size;
   dip->gen = ip->gen;
+  if (sb_root.flags & SB_LARGEFILE) {
+    auto w = ip->meta_seq.write_begin();
+    ip->extent_map()->size_hi = ip->size >> 32;
+  }
   memmove(dip->addrs, ip->addrs, sizeof(ip->addrs));
-  bp->add_to_transaction(trans);
+  bool is_orphan = dip->type && !dip->nlink;
+  if (was_linked && is_orphan)
+    trans->note_orphan(ip->inum, true);
+  else if (was_orphan && !is_orphan)
+    trans->note_orphan(ip->inum, false);
+  bp->add_to_transaction(trans, txn_chunk_mask((ip->inum%IPB) * sizeof(*dip),
+                                               sizeof(*dip)));
 }
 
 inode::inode(u32 d, u32 i)
   : rcu_freed("inode", this, sizeof(*this)), dev(d), inum(i),
-    valid(false), busy(false), readbusy(0), dir(nullptr), dir_offset(0)
+    valid(false), busy(false), readbusy(0), extent_next(0), extent_end(0),
+    dir(nullptr), dir_offset(0)
 {
 }
 
 inode::~inode()
 {
-  if (dir) {
-    dir->remove(strbuf<DIRSIZ>("."));
-    dir->remove(strbuf<DIRSIZ>(".."));
-    delete dir;
-  }
+  delete dir.load();
 }
 
 sref<inode>
@@ -596,21 +706,72 @@ inode::alloc(u32 dev, u32 inum)
   return ip;
 }
 
+namespace {
+  // The last inode block that each core read (or read ahead) from the disk,
+  // to spot sequential scans of the inode table.
+  struct inode_scan {
+    u32 dev;
+    u64 last;
+  };
+
+  percpu<inode_scan> inode_scans;
+}
+
+// Read the inode blocks of inums into the buffer cache, in one batch of disk
+// requests, for walks that know which inodes they will get next.
+void
+iprefetch(u32 dev, const std::vector<u32> &inums)
+{
+  std::vector<u64> blocks;
+  for (auto inum : inums) {
+    if (ins->lookup(make_pair(dev, inum)))
+      continue;
+    u64 b = IBLOCK(inum);
+    if (std::find(blocks.begin(), blocks.end(), b) == blocks.end())
+      blocks.push_back(b);
+  }
+  if (!blocks.empty())
+    buf::prefetch(dev, blocks);
+}
+
 void
 inode::init(void)
 {
   scoped_gc_epoch e;
+  u64 blk = IBLOCK(inum);
+  if (!buf::in_bufcache(dev, blk)) {
+    // This is only a hint, so it doesn't matter if we race with another
+    // thread on this core.
+    auto &scan = *inode_scans.get_unchecked();
+    if (scan.dev == dev && scan.last + 1 == blk) {
+      u64 end = std::min(blk + INODE_READAHEAD_BLOCKS,
+                         (u64)IBLOCK(sb_root.ninodes - 1) + 1);
+      std::vector<u64> blocks;
+      for (u64 b = blk; b < end; b++)
+        blocks.push_back(b);
+      buf::prefetch(dev, blocks);
+      blk = end - 1;
+    }
+    scan.dev = dev;
+    scan.last = blk;
+  }
+
   sref<buf> bp = buf::get(dev, IBLOCK(inum));
   auto copy = bp->read();
   const dinode *dip = (const struct dinode*)copy->data + inum%IPB;
 
-  type = dip->type;
-  major = dip->major;
-  minor = dip->minor;
-  nlink_ = dip->nlink;
-  size = dip->size;
-  gen = dip->gen;
-  memmove(addrs, dip->addrs, sizeof(addrs));
+  {
+    auto w = meta_seq.write_begin();
+    type = dip->type;
+    major = dip->major;
+    minor = dip->minor;
+    nlink_ = dip->nlink;
+    size = dip->size;
+    gen = dip->gen;
+    memmove(addrs, dip->addrs, sizeof(addrs));
+    if (sb_root.flags & SB_LARGEFILE)
+      size |= (u64)extent_map()->size_hi << 32;
+  }
 
   if (nlink_ > 0)
     inc();
@@ -629,7 +790,12 @@ inode::init(void)
 void
 inode::link(void)
 {
-  if (++nlink_ == 1) {
+  short n;
+  {
+    auto w = meta_seq.write_begin();
+    n = ++nlink_;
+  }
+  if (n == 1) {
     // A non-zero nlink_ holds a reference to the inode
     inc();
   }
@@ -640,7 +806,12 @@ inode::link(void)
 void
 inode::unlink(void)
 {
-  if (--nlink_ == 0) {
+  short n;
+  {
+    auto w = meta_seq.write_begin();
+    n = --nlink_;
+  }
+  if (n == 0) {
     // This should never be the last reference..
     dec();
   }
@@ -652,6 +823,33 @@ inode::nlink(void)
   return nlink_;
 }
 
+void
+inode::snapshot(inode_meta *m) const
+{
+  auto r = meta_seq.read_begin();
+  do {
+    m->type = type;
+    m->major = major;
+    m->nlink = nlink_;
+    m->size = size;
+    memmove(m->addrs, addrs, sizeof(addrs));
+  } while (r.do_retry());
+}
+
+void
+inode::set_size(u64 s)
+{
+  auto w = meta_seq.write_begin();
+  size = s;
+}
+
+void
+inode::set_addr(u32 i, u32 addr)
+{
+  auto w = meta_seq.write_begin();
+  addrs[i] = addr;
+}
+
 void
 inode::onzero(void)
 {
@@ -676,7 +874,7 @@ inode::onzero(void)
 // Lock the given inode, for write if @lock_type == WRITELOCK, and for read
 // otherwise.
 void
-ilock(sref<inode> ip, int lock_type)
+ilock(borrowed<inode> ip, int lock_type)
 {
   if (!ip)
     panic("ilock(): illegal inode pointer\n");
@@ -699,7 +897,7 @@ ilock(sref<inode> ip, int lock_type)
 
 // Unlock the given inode.
 void
-iunlock(sref<inode> ip)
+iunlock(borrowed<inode> ip)
 {
   if (!ip)
     panic("iunlock(): illegal inode pointer\n");
@@ -725,16 +923,554 @@ iunlock(sref<inode> ip)
 // such block, bmap allocates one. The caller must hold ilock() for write if
 // invoking bmap() from writei().
 static u32
-bmap(sref<inode> ip, u32 bn, transaction *trans = NULL, bool zero_on_alloc = false,
-     bool lazy_trans_update = false)
+bmap(borrowed<inode> ip, u32 bn, transaction *trans = NULL,
+     bool zero_on_alloc = false, bool lazy_trans_update = false);
+
+// Return the disk block address of the nth block in inode ip, which must
+// already have been allocated. The caller must hold ilock().
+u32
+inode_blocknum(borrowed<inode> ip, u32 bn)
+{
+  u32 blocknum = bmap(ip, bn);
+  assert(blocknum);
+  return blocknum;
+}
+
+// Extent-mapped inodes (see struct dextent_map). Their extents live either in
+// ip->addrs[] itself or, once there are more than NIEXTENT of them, in the
+// overflow block; either way they are sorted by file block and don't overlap.
+
+static_assert(sizeof(dextent_map) <= sizeof(((dinode *)0)->addrs),
+              "dextent_map doesn't fit in a dinode");
+
+static bool
+extent_mapped(inode *ip)
+{
+  return ip->dev == 1 && (sb_root.flags & SB_EXTENTS);
+}
+
+// The largest size (in bytes) that inode ip's file can grow to: what fits in
+// dinode::size, or with SB_LARGEFILE, what the u32 extent fields can map.
+static u64
+max_file_size(inode *ip)
+{
+  if (ip->dev == 1 && (sb_root.flags & SB_LARGEFILE))
+    return (u64)(u32)~0 * BSIZE;
+  return std::min((u64)MAXFILE * BSIZE, (u64)(u32)~0);
+}
+
+// The number of extents in ext[0..n) that start at or before file block bn.
+static u32
+extent_index(const dextent *ext, u32 n, u32 bn)
+{
+  u32 lo = 0, hi = n;
+  while (lo < hi) {
+    u32 mid = (lo + hi) / 2;
+    if (ext[mid].fbn <= bn)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// The extent of ext[0..n) that holds file block bn, or null.
+static const dextent *
+extent_at(const dextent *ext, u32 n, u32 bn)
+{
+  u32 i = extent_index(ext, n, bn);
+  if (i && bn < ext[i-1].fbn + DEXTENT_LEN(&ext[i-1]))
+    return &ext[i-1];
+  return nullptr;
+}
+
+// The disk block holding file block bn according to ext[0..n), or 0. If
+// unwritten isn't null, *unwritten is set to whether the block is unwritten
+// (see DEXTENT_UNWRITTEN).
+static u32
+extent_find(const dextent *ext, u32 n, u32 bn, bool *unwritten = nullptr)
+{
+  const dextent *e = extent_at(ext, n, bn);
+  if (!e)
+    return 0;
+  if (unwritten)
+    *unwritten = e->len & DEXTENT_UNWRITTEN;
+  return e->addr + (bn - e->fbn);
+}
+
+static u32
+extent_lookup(inode *ip, const dextent_map *map, u32 bn,
+              bool *unwritten = nullptr)
+{
+  if (map->nextents <= NIEXTENT)
+    return extent_find(map->ext, map->nextents, bn, unwritten);
+
+  sref<buf> bp = buf::get(ip->dev, map->overflow);
+  auto copy = bp->read();
+  return extent_find((const dextent *)copy->data, map->nextents, bn,
+                     unwritten);
+}
+
+// Copy the extent that holds file block bn to *out. Returns false if the
+// block isn't mapped.
+static bool
+extent_get(inode *ip, const dextent_map *map, u32 bn, dextent *out)
+{
+  const dextent *e;
+  if (map->nextents <= NIEXTENT) {
+    if (!(e = extent_at(map->ext, map->nextents, bn)))
+      return false;
+    *out = *e;
+    return true;
+  }
+
+  sref<buf> bp = buf::get(ip->dev, map->overflow);
+  auto copy = bp->read();
+  if (!(e = extent_at((const dextent *)copy->data, map->nextents, bn)))
+    return false;
+  *out = *e;
+  return true;
+}
+
+// Whether extent b directly follows extent a, on the disk as well as in the
+// file, so that they can be one extent.
+static bool
+extent_contiguous(const dextent *a, const dextent *b)
+{
+  return a->fbn + DEXTENT_LEN(a) == b->fbn &&
+         a->addr + DEXTENT_LEN(a) == b->addr &&
+         (a->len & DEXTENT_FLAGS) == (b->len & DEXTENT_FLAGS);
+}
+
+// Allocate a block for file block bn (which must not be mapped yet) and add it
+// to ext[0..*n), which has room for max extents, with the given DEXTENT_FLAGS.
+// Returns 0 if the block would need a new extent and there is no room for
+// one.
+static u32
+extent_add(inode *ip, dextent *ext, u32 *n, u32 max, u32 bn,
+           transaction *trans, bool zero_on_alloc, u32 flag = 0)
+{
+  u32 i = extent_index(ext, *n, bn);
+  dextent *prev = i ? &ext[i-1] : nullptr;
+  u32 goal = prev ? prev->addr + (bn - prev->fbn) : 0;
+  bool extends = prev && prev->fbn + DEXTENT_LEN(prev) == bn &&
+                 (prev->len & DEXTENT_FLAGS) == flag;
+  u32 b;
+
+  if (*n < max) {
+    b = balloc(ip->dev, trans, zero_on_alloc, ip, goal);
+  } else if (extends) {
+    // Full; only the block right after the previous extent's will do.
+    b = balloc_exact(ip->dev, trans, zero_on_alloc, ip, goal);
+    if (!b)
+      return 0;
+  } else {
+    return 0;
+  }
+
+  auto w = ip->meta_seq.write_begin();
+  dextent added = { bn, b, 1 | flag };
+  if (extends && b == goal) {
+    prev->len++;
+    // The extent may now run into the next one.
+    if (i < *n && extent_contiguous(&added, &ext[i])) {
+      prev->len += DEXTENT_LEN(&ext[i]);
+      memmove(&ext[i], &ext[i+1], (*n - i - 1) * sizeof(ext[0]));
+      memset(&ext[--*n], 0, sizeof(ext[0]));
+    }
+  } else if (i < *n && extent_contiguous(&added, &ext[i])) {
+    ext[i].fbn--;
+    ext[i].addr--;
+    ext[i].len++;
+  } else {
+    memmove(&ext[i+1], &ext[i], (*n - i) * sizeof(ext[0]));
+    ext[i] = added;
+    ++*n;
+  }
+  return b;
+}
+
+// Mark file block bn, which is in an unwritten extent of ext[0..*n), as
+// written. This splits the extent into upto three, merging the written part
+// with the written extent before or after it where they are contiguous.
+// Returns false (leaving ext alone) if that would take more than max
+// extents.
+static bool
+extent_convert(dextent *ext, u32 *n, u32 max, u32 bn)
+{
+  u32 i = extent_index(ext, *n, bn);
+  assert(i);
+  dextent *e = &ext[--i];
+  assert((e->len & DEXTENT_UNWRITTEN) && bn < e->fbn + DEXTENT_LEN(e));
+
+  u32 head = bn - e->fbn;
+  u32 tail = DEXTENT_LEN(e) - head - 1;
+  dextent rep[3];
+  u32 k = 0;
+  if (head)
+    rep[k++] = { e->fbn, e->addr, head | DEXTENT_UNWRITTEN };
+  u32 mid = k;
+  rep[k++] = { bn, e->addr + head, 1 };
+  if (tail)
+    rep[k++] = { bn + 1, e->addr + head + 1, tail | DEXTENT_UNWRITTEN };
+
+  // The extents ext[first..last) are replaced by rep[0..k).
+  u32 first = i, last = i + 1;
+  if (!head && first && extent_contiguous(&ext[first-1], &rep[mid])) {
+    rep[mid].fbn = ext[first-1].fbn;
+    rep[mid].addr = ext[first-1].addr;
+    rep[mid].len += ext[first-1].len;
+    first--;
+  }
+  if (!tail && last < *n && extent_contiguous(&rep[mid], &ext[last])) {
+    rep[mid].len += ext[last].len;
+    last++;
+  }
+
+  u32 newn = *n - (last - first) + k;
+  if (newn > max)
+    return false;
+
+  memmove(&ext[first + k], &ext[last], (*n - last) * sizeof(ext[0]));
+  memmove(&ext[first], rep, k * sizeof(ext[0]));
+  if (newn < *n)
+    memset(&ext[newn], 0, (*n - newn) * sizeof(ext[0]));
+  *n = newn;
+  return true;
+}
+
+// The overflow block of an extent-mapped inode, after copying the extents out
+// of the inode to a new one if they are still inline. The caller must then add
+// an extent, so that more than NIEXTENT of them say they are in the overflow
+// block, and then clear the inline copy with extent_clear_inline(). Until
+// then, lockless readers still find the extents inline.
+static sref<buf>
+extent_overflow(borrowed<inode> ip, transaction *trans)
+{
+  dextent_map *map = ip->extent_map();
+  if (map->nextents > NIEXTENT)
+    return buf::get(ip->dev, map->overflow);
+
+  u32 overflow = balloc(ip->dev, trans, true);
+  {
+    auto w = ip->meta_seq.write_begin();
+    map->overflow = overflow;
+  }
+  // We allocated the block just now. So need to read it from the disk.
+  sref<buf> bp = buf::get(ip->dev, map->overflow, true);
+  {
+    auto locked = bp->write();
+    memmove(locked->data, map->ext, map->nextents * sizeof(map->ext[0]));
+  }
+  return bp;
+}
+
+// Zero the inline extents of an inode whose extents have moved to its overflow
+// block, so that they don't linger in the dinode.
+static void
+extent_clear_inline(inode *ip)
+{
+  dextent_map *map = ip->extent_map();
+  if (map->nextents <= NIEXTENT || !map->ext[0].len)
+    return;
+  auto w = ip->meta_seq.write_begin();
+  memset(map->ext, 0, sizeof(map->ext));
+}
+
+// bmap() for extent-mapped inodes. A newly allocated block gets the given
+// DEXTENT_FLAGS.
+static u32
+extent_bmap(borrowed<inode> ip, u32 bn, transaction *trans, bool zero_on_alloc,
+            bool lazy_trans_update, u32 flag = 0)
+{
+  scoped_gc_epoch e;
+  dextent_map *map = ip->extent_map();
+  u32 b;
+
+  if ((b = extent_lookup(ip.get(), map, bn)))
+    return b;
+
+  // Keep the extents inline for as long as they fit.
+  if (map->nextents <= NIEXTENT &&
+      (b = extent_add(ip.get(), map->ext, &map->nextents, NIEXTENT, bn,
+                      trans, zero_on_alloc, flag)))
+    return b;
+
+  sref<buf> bp = extent_overflow(ip, trans);
+  auto locked = bp->write();
+  dextent *ext = (dextent *)locked->data;
+
+  b = extent_add(ip.get(), ext, &map->nextents, NOEXTENT, bn, trans,
+                 zero_on_alloc, flag);
+  extent_clear_inline(ip.get());
+  if (trans) {
+    if (lazy_trans_update)
+      bp->add_blocknum_to_transaction(trans);
+    else
+      bp->add_to_transaction(trans);
+  }
+
+  if (!b)
+    throw_out_of_blocks(); // Too fragmented for one overflow block.
+  return b;
+}
+
+// Mark the unwritten file block bn of an extent-mapped inode as written, in
+// the same transaction that writes it.
+static void
+extent_mark_written(borrowed<inode> ip, u32 bn, transaction *trans,
+                    bool lazy_trans_update)
+{
+  scoped_gc_epoch e;
+  dextent_map *map = ip->extent_map();
+
+  if (map->nextents <= NIEXTENT) {
+    auto w = ip->meta_seq.write_begin();
+    if (extent_convert(map->ext, &map->nextents, NIEXTENT, bn))
+      return;
+  }
+
+  sref<buf> bp = extent_overflow(ip, trans);
+  auto locked = bp->write();
+  bool converted;
+  {
+    auto w = ip->meta_seq.write_begin();
+    converted = extent_convert((dextent *)locked->data, &map->nextents,
+                               NOEXTENT, bn);
+  }
+  extent_clear_inline(ip.get());
+  if (trans) {
+    if (lazy_trans_update)
+      bp->add_blocknum_to_transaction(trans);
+    else
+      bp->add_to_transaction(trans);
+  }
+
+  if (!converted)
+    throw_out_of_blocks(); // Too fragmented for one overflow block.
+}
+
+// Free the blocks from file block bn on out of ext[0..*n). A compressed
+// cluster that bn falls inside of stays whole, since none of it can be read
+// back without the rest; the caller rewrites it (see mfile::sync_file()).
+static void
+extent_cut(inode *ip, dextent *ext, u32 *n, u32 bn, transaction *trans)
+{
+  while (*n) {
+    dextent *last = &ext[*n - 1];
+    if (last->fbn + DEXTENT_LEN(last) <= bn)
+      break;
+
+    u32 keep = last->fbn < bn ? bn - last->fbn : 0;
+    if (keep && (last->len & DEXTENT_COMPRESSED))
+      break;
+    if (last->len & DEXTENT_COMPRESSED)
+      zcluster_forget();
+    for (u32 i = keep; i < DEXTENT_LEN(last); i++)
+      bfree(ip->dev, last->addr + i, trans, true);
+
+    auto w = ip->meta_seq.write_begin();
+    if (keep) {
+      last->len = keep | (last->len & DEXTENT_FLAGS);
+      break;
+    }
+    memset(last, 0, sizeof(*last));
+    --*n;
+  }
+}
+
+// itrunc() for extent-mapped inodes: drop the blocks from file block bn on.
+// This journals at most the overflow block, besides the inode itself.
+static void
+extent_trunc(borrowed<inode> ip, u32 bn, transaction *trans)
+{
+  dextent_map *map = ip->extent_map();
+
+  if (map->nextents <= NIEXTENT) {
+    extent_cut(ip.get(), map->ext, &map->nextents, bn, trans);
+    return;
+  }
+
+  {
+    sref<buf> bp = buf::get(ip->dev, map->overflow);
+    auto locked = bp->write();
+    dextent *ext = (dextent *)locked->data;
+
+    extent_cut(ip.get(), ext, &map->nextents, bn, trans);
+    if (map->nextents > NIEXTENT) {
+      bp->add_to_transaction(trans);
+      return;
+    }
+    // Few enough extents left to move them back into the inode.
+    auto w = ip->meta_seq.write_begin();
+    memmove(map->ext, ext, map->nextents * sizeof(ext[0]));
+  }
+
+  bfree(ip->dev, map->overflow, trans, true);
+  auto w = ip->meta_seq.write_begin();
+  map->overflow = 0;
+}
+
+// Unmap the file blocks [first, end) from ext[0..*n), which has room for max
+// extents, and free their disk blocks. Returns false, leaving ext alone, if an
+// extent would have to be split in two and there is no room for the extra
+// one.
+static bool
+extent_remove(inode *ip, dextent *ext, u32 *n, u32 max, u32 first, u32 end,
+              transaction *trans)
+{
+  u32 i = extent_index(ext, *n, first);
+  if (i && first < ext[i-1].fbn + DEXTENT_LEN(&ext[i-1]))
+    i--;
+  if (i == *n || ext[i].fbn >= end)
+    return true;
+
+  dextent *e = &ext[i];
+  u32 flags = e->len & DEXTENT_FLAGS;
+  if (e->fbn < first && e->fbn + DEXTENT_LEN(e) > end) {
+    if (*n == max)
+      return false;
+    for (u32 bn = first; bn < end; bn++)
+      bfree(ip->dev, e->addr + (bn - e->fbn), trans, true);
+    if (flags & DEXTENT_COMPRESSED)
+      zcluster_forget();
+
+    auto w = ip->meta_seq.write_begin();
+    dextent tail = { end, e->addr + (end - e->fbn),
+                     (e->fbn + DEXTENT_LEN(e) - end) | flags };
+    memmove(&ext[i+2], &ext[i+1], (*n - i - 1) * sizeof(ext[0]));
+    e->len = (first - e->fbn) | flags;
+    ext[i+1] = tail;
+    ++*n;
+    return true;
+  }
+
+  u32 last = i;
+  for (; last < *n && ext[last].fbn < end; last++) {
+    e = &ext[last];
+    u32 from = std::max(first, e->fbn);
+    u32 to = std::min(end, e->fbn + DEXTENT_LEN(e));
+    for (u32 bn = from; bn < to; bn++)
+      bfree(ip->dev, e->addr + (bn - e->fbn), trans, true);
+    if (e->len & DEXTENT_COMPRESSED)
+      zcluster_forget();
+  }
+
+  // What is left of ext[i..last) is at most a head and a tail.
+  auto w = ip->meta_seq.write_begin();
+  u32 out = i;
+  for (u32 j = i; j < last; j++) {
+    dextent k = ext[j];
+    flags = k.len & DEXTENT_FLAGS;
+    if (k.fbn < first) {
+      k.len = (first - k.fbn) | flags;
+      ext[out++] = k;
+    } else if (k.fbn + DEXTENT_LEN(&k) > end) {
+      k.addr += end - k.fbn;
+      k.len = (k.fbn + DEXTENT_LEN(&k) - end) | flags;
+      k.fbn = end;
+      ext[out++] = k;
+    }
+  }
+  memmove(&ext[out], &ext[last], (*n - last) * sizeof(ext[0]));
+  u32 newn = *n - (last - out);
+  memset(&ext[newn], 0, (*n - newn) * sizeof(ext[0]));
+  *n = newn;
+  return true;
+}
+
+// Unmap the file blocks [first, end) of an extent-mapped inode and free them,
+// in the fsync path. As with extent_trunc(), the extents move back into the
+// inode once few enough are left.
+static void
+extent_punch(borrowed<inode> ip, u32 first, u32 end, transaction *trans)
+{
+  scoped_gc_epoch e;
+  dextent_map *map = ip->extent_map();
+
+  if (map->nextents <= NIEXTENT &&
+      extent_remove(ip.get(), map->ext, &map->nextents, NIEXTENT, first, end,
+                    trans))
+    return;
+
+  {
+    sref<buf> bp = extent_overflow(ip, trans);
+    auto locked = bp->write();
+    dextent *ext = (dextent *)locked->data;
+
+    if (!extent_remove(ip.get(), ext, &map->nextents, NOEXTENT, first, end,
+                       trans))
+      throw_out_of_blocks(); // Too fragmented for one overflow block.
+    if (map->nextents > NIEXTENT) {
+      extent_clear_inline(ip.get());
+      bp->add_blocknum_to_transaction(trans);
+      return;
+    }
+    auto w = ip->meta_seq.write_begin();
+    memmove(map->ext, ext, map->nextents * sizeof(ext[0]));
+  }
+
+  bfree(ip->dev, map->overflow, trans, true);
+  auto w = ip->meta_seq.write_begin();
+  map->overflow = 0;
+}
+
+// Whether the cluster that file block bn is in is compressed (see
+// SB_COMPRESS) according to map, and if so, its extent in *z.
+static bool
+zcluster_extent(inode *ip, const dextent_map *map, u32 bn, dextent *z)
+{
+  return extent_get(ip, map, bn - bn % ZCLUSTER_BLOCKS, z) &&
+         (z->len & DEXTENT_COMPRESSED);
+}
+
+// drop_bufcache() for extent-mapped inodes.
+static void
+extent_drop_bufcache(borrowed<inode> ip)
+{
+  dextent_map *map = ip->extent_map();
+
+  if (map->nextents <= NIEXTENT) {
+    for (u32 i = 0; i < map->nextents; i++)
+      for (u32 j = 0; j < DEXTENT_LEN(&map->ext[i]); j++)
+        buf::put(ip->dev, map->ext[i].addr + j);
+    return;
+  }
+
+  // As with indirect blocks, if the overflow block isn't in the bufcache,
+  // none of the data-blocks it maps will be either.
+  if (!buf::in_bufcache(ip->dev, map->overflow))
+    return;
+
+  {
+    sref<buf> bp = buf::get(ip->dev, map->overflow);
+    auto copy = bp->read();
+    const dextent *ext = (const dextent *)copy->data;
+    for (u32 i = 0; i < map->nextents; i++)
+      for (u32 j = 0; j < DEXTENT_LEN(&ext[i]); j++)
+        buf::put(ip->dev, ext[i].addr + j);
+  }
+  buf::put(ip->dev, map->overflow);
+}
+
+static u32
+bmap(borrowed<inode> ip, u32 bn, transaction *trans, bool zero_on_alloc,
+     bool lazy_trans_update)
 {
   scoped_gc_epoch e;
   bool skip_disk_read = false;
   u32* ap;
 
+  assert(!ip->inline_data());
+  if (extent_mapped(ip.get()))
+    return extent_bmap(ip, bn, trans, zero_on_alloc, lazy_trans_update);
+
   if (bn < NDIRECT) {
-    if (ip->addrs[bn] == 0)
-      ip->addrs[bn] = balloc(ip->dev, trans, zero_on_alloc);
+    if (ip->addrs[bn] == 0) {
+      u32 prev = bn ? ip->addrs[bn - 1] : 0;
+      ip->set_addr(bn, balloc(ip->dev, trans, zero_on_alloc, ip.get(),
+                              prev ? prev + 1 : 0));
+    }
 
     return ip->addrs[bn];
   }
@@ -742,7 +1478,7 @@ bmap(sref<inode> ip, u32 bn, transaction *trans = NULL, bool zero_on_alloc = fal
 
   if (bn < NINDIRECT) {
     if (ip->addrs[NDIRECT] == 0) {
-      ip->addrs[NDIRECT] = balloc(ip->dev, trans, true);
+      ip->set_addr(NDIRECT, balloc(ip->dev, trans, true));
       // We allocated the block just now. So need to read it from the disk.
       skip_disk_read = true;
     }
@@ -753,7 +1489,9 @@ bmap(sref<inode> ip, u32 bn, transaction *trans = NULL, bool zero_on_alloc = fal
     ap = (u32 *)locked->data;
 
     if (ap[bn] == 0) {
-      ap[bn] = balloc(ip->dev, trans, zero_on_alloc);
+      u32 prev = bn ? ap[bn - 1] : ip->addrs[NDIRECT - 1];
+      ap[bn] = balloc(ip->dev, trans, zero_on_alloc, ip.get(),
+                      prev ? prev + 1 : 0);
       if (trans) {
         if (lazy_trans_update)
           bp->add_blocknum_to_transaction(trans);
@@ -770,7 +1508,7 @@ bmap(sref<inode> ip, u32 bn, transaction *trans = NULL, bool zero_on_alloc = fal
     panic("bmap: %d out of range", bn);
 
   if (ip->addrs[NDIRECT+1] == 0) {
-    ip->addrs[NDIRECT+1] = balloc(ip->dev, trans, true);
+    ip->set_addr(NDIRECT+1, balloc(ip->dev, trans, true));
     // We allocated the block just now. So need to read it from the disk.
     skip_disk_read = true;
   }
@@ -801,7 +1539,9 @@ bmap(sref<inode> ip, u32 bn, transaction *trans = NULL, bool zero_on_alloc = fal
   ap = (u32 *)slocked->data;
 
   if (ap[bn % NINDIRECT] == 0) {
-    ap[bn % NINDIRECT] = balloc(ip->dev, trans, zero_on_alloc);
+    u32 prev = bn % NINDIRECT ? ap[bn % NINDIRECT - 1] : 0;
+    ap[bn % NINDIRECT] = balloc(ip->dev, trans, zero_on_alloc, ip.get(),
+                                prev ? prev + 1 : 0);
     if (trans) {
       if (lazy_trans_update)
         sp->add_blocknum_to_transaction(trans);
@@ -813,20 +1553,188 @@ bmap(sref<inode> ip, u32 bn, transaction *trans = NULL, bool zero_on_alloc = fal
   return ap[bn % NINDIRECT];
 }
 
+// Like bmap(), except that this returns 0 instead of allocating the block if
+// the file doesn't have it, and works from m, a snapshot of the inode's
+// metadata, so it needs no lock. If unwritten isn't null, *unwritten is set to
+// whether the block is unwritten (see DEXTENT_UNWRITTEN).
+static u32
+bmap_lookup(borrowed<inode> ip, const inode_meta &m, u32 bn,
+            bool *unwritten = nullptr)
+{
+  scoped_gc_epoch e;
+
+  if (unwritten)
+    *unwritten = false;
+  if (m.inline_data())
+    return 0;
+  if (extent_mapped(ip.get()))
+    return extent_lookup(ip.get(), m.extent_map(), bn, unwritten);
+
+  if (bn < NDIRECT)
+    return m.addrs[bn];
+  bn -= NDIRECT;
+
+  if (bn < NINDIRECT) {
+    if (!m.addrs[NDIRECT])
+      return 0;
+    sref<buf> bp = buf::get(ip->dev, m.addrs[NDIRECT]);
+    auto copy = bp->read();
+    return ((const u32 *)copy->data)[bn];
+  }
+  bn -= NINDIRECT;
+
+  if (bn >= NINDIRECT * NINDIRECT || !m.addrs[NDIRECT+1])
+    return 0;
+
+  u32 blocknum;
+  {
+    sref<buf> fp = buf::get(ip->dev, m.addrs[NDIRECT+1]);
+    auto copy = fp->read();
+    blocknum = ((const u32 *)copy->data)[bn / NINDIRECT];
+  }
+  if (!blocknum)
+    return 0;
+
+  sref<buf> sp = buf::get(ip->dev, blocknum);
+  auto copy = sp->read();
+  return ((const u32 *)copy->data)[bn % NINDIRECT];
+}
+
+static u32
+bmap_lookup(borrowed<inode> ip, u32 bn, bool *unwritten = nullptr)
+{
+  inode_meta m;
+  ip->snapshot(&m);
+  return bmap_lookup(ip, m, bn, unwritten);
+}
+
+// Set aside a contiguous extent of (upto) nblocks blocks for the data blocks
+// that the inode's file is about to allocate. The caller must hold ilock() for
+// write, and release the extent with release_extent() before dropping it.
+void
+reserve_extent(borrowed<inode> ip, u32 nblocks)
+{
+  if (ip->dev != 1)
+    return;
+
+  release_extent(ip);
+
+  // Continue from the file's last block, if it has any.
+  u32 goal = 0;
+  u64 nfileblocks = (ip->size + BSIZE - 1) / BSIZE;
+  if (nfileblocks && nfileblocks <= max_file_size(ip.get()) / BSIZE) {
+    u32 last = bmap_lookup(ip, nfileblocks - 1);
+    if (last)
+      goal = last + 1;
+  }
+
+  u32 len;
+  ip->extent_next = rootfs_interface->alloc_extent(nblocks, goal, &len);
+  ip->extent_end = ip->extent_next + len;
+}
+
+// Give back the unused part of the inode's reserved extent. Those blocks were
+// never handed out, so they can be reused right away.
+void
+release_extent(borrowed<inode> ip)
+{
+  for (; ip->extent_next < ip->extent_end; ip->extent_next++)
+    rootfs_interface->free_block(ip->extent_next);
+  ip->extent_next = ip->extent_end = 0;
+}
+
+// Delayed allocation: file data only gets disk blocks when sync_file() writes
+// it back, so a file that is deleted before it is synced never touches the
+// allocator. Allocate, in one go and in file order, every block that the
+// given pages (sorted page indices) of the file still lack, reserving them as
+// one extent. The caller must hold ilock() for write, and release the extent
+// with release_extent() when done with it. Returns whether the block map
+// changed, which the disk inode then has to be updated for.
+bool
+alloc_file_pages(borrowed<inode> ip, const std::vector<u32> &pages,
+                 transaction *trans)
+{
+  std::vector<u32> holes, unwritten;
+  u64 maxblocks = max_file_size(ip.get()) / BSIZE;
+
+  for (u32 pg : pages) {
+    for (u64 bn = (u64)pg * (PGSIZE / BSIZE);
+         bn < (u64)(pg + 1) * (PGSIZE / BSIZE) && bn < maxblocks; bn++) {
+      bool u;
+      if (!bmap_lookup(ip, bn, &u))
+        holes.push_back(bn);
+      else if (u)
+        unwritten.push_back(bn);
+    }
+  }
+
+  // Preallocated blocks become written along with the pages that fill them.
+  for (u32 bn : unwritten)
+    extent_mark_written(ip, bn, trans, true);
+
+  if (holes.empty())
+    return !unwritten.empty();
+
+  // The pages are written back in whole blocks, so these need no zeroing.
+  // If the disk runs out of blocks (or an extent map of its overflow
+  // block), the pages left without blocks fail to write back, and stay
+  // dirty (see mfile::sync_file()).
+  try {
+    if (holes.size() > 1)
+      reserve_extent(ip, holes.size());
+    for (u32 bn : holes)
+      bmap(ip, bn, trans, false, true);
+  } catch (out_of_blocks& e) {
+    console.println("alloc_file_pages: out of blocks");
+  }
+  return true;
+}
+
+
 // Caller must hold ilock for write. The caller must also arrange to invoke
 // iupdate() when suitable, to flush the new inode size to the disk.
 void
-itrunc(sref<inode> ip, u32 offset, transaction *trans)
+itrunc(borrowed<inode> ip, u64 offset, transaction *trans)
 {
   scoped_gc_epoch e;
 
-  if (ip->size <= offset || offset >= MAXFILE*BSIZE)
+  if (offset >= max_file_size(ip.get()))
+    return;
+
+  // Inline data (see SB_INLINE) past offset is zeroed, which keeps it from
+  // showing through if the file grows again.
+  if (ip->inline_data()) {
+    auto w = ip->meta_seq.write_begin();
+    if (offset < ip->size) {
+      memset((char *)ip->addrs + offset, 0, DINODE_INLINE_SIZE - offset);
+      ip->size = offset;
+    }
+    if (!offset)
+      ip->major &= ~DI_INLINE;
     return;
+  }
 
   // Wipe out everything from bn (inclusive) till the end of the file.
   // After itrunc() returns, appends will occur at 'offset'.
   u32 bn = BLOCKROUNDUP(offset);
 
+  // Extent-mapped files may have blocks preallocated past their end (see
+  // preallocate()), which go as well, even if the size stays.
+  // The size goes first, so that lockless readers (see inode::snapshot())
+  // stop short of the blocks being freed.  Those aren't reused until the
+  // transaction commits.
+  if (extent_mapped(ip.get())) {
+    if (offset < ip->size)
+      ip->set_size(offset);
+    extent_trunc(ip, bn, trans);
+    assert(offset || !ip->extent_map()->nextents);
+    return;
+  }
+
+  if (ip->size <= offset)
+    return;
+  ip->set_size(offset);
+
   enum {
     DIRECT_BLOCKS = 1,
     INDIRECT_BLOCKS,
@@ -853,7 +1761,7 @@ itrunc(sref<inode> ip, u32 offset, transaction *trans)
       if (!ip->addrs[i])
         break;
       bfree(ip->dev, ip->addrs[i], trans, true);
-      ip->addrs[i] = 0;
+      ip->set_addr(i, 0);
     }
     start_index = 0; // Fall through to next stage.
 
@@ -881,7 +1789,7 @@ itrunc(sref<inode> ip, u32 offset, transaction *trans)
 
     if (start_index == 0) {
       bfree(ip->dev, ip->addrs[NDIRECT], trans, true);
-      ip->addrs[NDIRECT] = 0;
+      ip->set_addr(NDIRECT, 0);
     }
 
     start_index = 0; // Fall through to next stage.
@@ -897,6 +1805,13 @@ itrunc(sref<inode> ip, u32 offset, transaction *trans)
       u32 *ap1 = (u32 *)locked1->data;
       u32 begin = start_index;
 
+      // Read all the second-level blocks in one go, rather than one at a
+      // time below.
+      std::vector<u64> blocks;
+      for (u32 i = begin / NINDIRECT; i < NINDIRECT && ap1[i]; i++)
+        blocks.push_back(ap1[i]);
+      buf::prefetch(ip->dev, blocks);
+
       for (u32 i = begin / NINDIRECT; i < NINDIRECT; i++) {
         if (!ap1[i])
           break;
@@ -934,7 +1849,7 @@ itrunc(sref<inode> ip, u32 offset, transaction *trans)
 
     if (start_index == 0) {
       bfree(ip->dev, ip->addrs[NDIRECT+1], trans, true);
-      ip->addrs[NDIRECT+1] = 0;
+      ip->set_addr(NDIRECT+1, 0);
     }
   }
 
@@ -943,17 +1858,22 @@ itrunc(sref<inode> ip, u32 offset, transaction *trans)
     for (u32 i = 0; i < NDIRECT + 2; i++)
       assert(ip->addrs[i] == 0);
   }
-
-  ip->size = offset;
 }
 
 // Drop the (clean) buffer-cache blocks associated with this file.
 // Caller must hold ilock for read.
 void
-drop_bufcache(sref<inode> ip)
+drop_bufcache(borrowed<inode> ip)
 {
   scoped_gc_epoch e;
 
+  if (ip->inline_data())
+    return;
+  if (extent_mapped(ip.get())) {
+    extent_drop_bufcache(ip);
+    return;
+  }
+
   for (int i = 0; i < NDIRECT; i++) {
     if (ip->addrs[i])
       buf::put(ip->dev, ip->addrs[i]);
@@ -1015,38 +1935,136 @@ drop_bufcache(sref<inode> ip)
 // the writei() (in the fsync path) doesn't modify any clean blocks. Thus, even
 // if we have concurrent calls to readi() and writei() on the same inode, they
 // will touch a mutually exclusive set of blocks, which implies that we don't
-// need any synchronization between them.
+// need any synchronization between them. The size and block map come from
+// one snapshot of the inode (see inode::snapshot()), so they are consistent
+// with each other even while a writer (or a directory update) changes them.
 int
-readi(sref<inode> ip, char *dst, u32 off, u32 n)
+readi(borrowed<inode> ip, char *dst, u64 off, u32 n)
 {
   scoped_gc_epoch e;
 
   u32 tot, m;
   sref<buf> bp;
+  inode_meta meta;
+  ip->snapshot(&meta);
 
-  if (ip->type == T_DEV)
+  if (meta.type == T_DEV)
     return -1;
 
-  if (off > ip->size || off + n < off)
+  if (off > meta.size || off + n < off)
     return -1;
-  if (off + n > ip->size)
-    n = ip->size - off;
+  if (off + n > meta.size)
+    n = meta.size - off;
+
+  if (meta.inline_data()) {
+    memmove(dst, (const char *)meta.addrs + off, n);
+    return n;
+  }
+  bool compressed = meta.compressed() && extent_mapped(ip.get());
+
+  // Read all the blocks in one go, rather than one at a time below.
+  if (off/BSIZE != (off + n - 1)/BSIZE)
+    readahead(ip, off, n);
 
   for (tot=0; tot<n; tot+=m, off+=m, dst+=m) {
-    try {
-      bp = buf::get(ip->dev, bmap(ip, off/BSIZE, NULL, true));
-    } catch (out_of_blocks& e) {
-      // Read operations should never cause out-of-blocks conditions
-      panic("readi: out of blocks");
+    m = std::min(n - tot, (u32)(BSIZE - off%BSIZE));
+
+    dextent z;
+    if (compressed && zcluster_extent(ip.get(), meta.extent_map(),
+                                      off/BSIZE, &z)) {
+      zcluster_read(ip->dev, z.addr, DEXTENT_LEN(&z), off % ZCLUSTER_BYTES,
+                    dst, m);
+      continue;
     }
-    m = std::min(n - tot, BSIZE - off%BSIZE);
 
+    // Holes (and unwritten extents) read as zeros, without allocating.
+    bool unwritten;
+    u32 addr = bmap_lookup(ip, meta, off/BSIZE, &unwritten);
+    if (!addr || unwritten) {
+      memset(dst, 0, m);
+      continue;
+    }
+
+    bp = buf::get(ip->dev, addr);
     auto copy = bp->read();
     memmove(dst, copy->data + off%BSIZE, m);
   }
   return n;
 }
 
+// Load the blocks holding the given range of the inode's data into the
+// buffer-cache, using batched, asynchronous reads (see buf::prefetch()).
+void
+readahead(borrowed<inode> ip, u64 off, u32 n)
+{
+  scoped_gc_epoch e;
+  std::vector<u64> blocks;
+  inode_meta m;
+  ip->snapshot(&m);
+
+  if (m.type == T_DEV || off >= m.size || off + n < off)
+    return;
+  if (off + n > m.size)
+    n = m.size - off;
+
+  for (u64 bn = off/BSIZE; bn <= (off + n - 1)/BSIZE; bn++) {
+    bool unwritten;
+    u32 addr = bmap_lookup(ip, m, bn, &unwritten);
+    if (addr && !unwritten)
+      blocks.push_back(addr);
+  }
+  buf::prefetch(ip->dev, blocks);
+}
+
+// Return whether [off, off + n) of the inode's data is all holes (or
+// unwritten extents, or past the end of the file), and so reads as zeros.
+bool
+is_hole(borrowed<inode> ip, u64 off, u32 n)
+{
+  scoped_gc_epoch e;
+  inode_meta m;
+  ip->snapshot(&m);
+
+  if (m.type == T_DEV)
+    return false;
+  if (off >= m.size || n == 0)
+    return true;
+  if (m.inline_data())
+    return false;
+  if (off + n > m.size)
+    n = m.size - off;
+  bool compressed = m.compressed() && extent_mapped(ip.get());
+
+  for (u64 bn = off/BSIZE; bn <= (off + n - 1)/BSIZE; bn++) {
+    bool unwritten;
+    dextent z;
+    if (bmap_lookup(ip, m, bn, &unwritten) && !unwritten)
+      return false;
+    // Only the start of a compressed cluster is mapped.
+    if (compressed && zcluster_extent(ip.get(), m.extent_map(), bn, &z))
+      return false;
+  }
+  return true;
+}
+
+// Look up the disk blocks of the n file blocks from bn on, for I/O that
+// bypasses the buffer cache: blocks[i] is 0 if the block is a hole or
+// unwritten, and so reads as zeros. The caller must hold ilock().
+void
+file_blocks(borrowed<inode> ip, u32 bn, u32 n, u32 *blocks)
+{
+  scoped_gc_epoch e;
+  inode_meta m;
+  ip->snapshot(&m);
+
+  for (u32 i = 0; i < n; i++) {
+    bool unwritten;
+    blocks[i] = bmap_lookup(ip, m, bn + i, &unwritten);
+    if (unwritten)
+      blocks[i] = 0;
+  }
+}
+
 // Write data to the inode. Called in the fsync() path to flush dirty data from
 // the page-cache (MemFS) to the inode's data blocks on the disk via the
 // bufcache.
@@ -1061,7 +2079,7 @@ readi(sref<inode> ip, char *dst, u32 off, u32 n)
 // locks). But we enforce this locking protocol here anyway to maintain writei()'s
 // correctness guarantees independent of fsync()'s concurrency strategy.
 int
-writei(sref<inode> ip, const char *src, u32 off, u32 n, transaction *trans,
+writei(borrowed<inode> ip, const char *src, u64 off, u32 n, transaction *trans,
        bool writeback, bool lazy_trans_update, bool dont_cache)
 {
   scoped_gc_epoch e;
@@ -1077,13 +2095,15 @@ writei(sref<inode> ip, const char *src, u32 off, u32 n, transaction *trans,
   if (off + n < off)
     return -1;
 
-  if (off + n > MAXFILE*BSIZE)
-    n = MAXFILE*BSIZE - off;
+  if (off >= max_file_size(ip.get()))
+    return -1;
+  if (off + n > max_file_size(ip.get()))
+    n = max_file_size(ip.get()) - off;
 
   for (tot=0; tot<n; tot+=m, off+=m, src+=m) {
 
     bool skip_disk_read = false;
-    m = std::min(n - tot, BSIZE - off%BSIZE);
+    m = std::min(n - tot, (u32)(BSIZE - off%BSIZE));
 
     try {
 
@@ -1134,30 +2154,232 @@ writei(sref<inode> ip, const char *src, u32 off, u32 n, transaction *trans,
 }
 
 void
-update_size(sref<inode> ip, u32 size, transaction *trans)
+update_size(borrowed<inode> ip, u64 size, transaction *trans)
 {
+  ip->set_size(size);
+  iupdate(ip, trans);
+}
+
+// Whether a file of size bytes on the root file system can keep its data in
+// its inode (see SB_INLINE).
+bool
+inline_fits(u64 size)
+{
+  return (sb_root.flags & SB_INLINE) && size <= DINODE_INLINE_SIZE;
+}
+
+// Make the size bytes at data the whole of the file's data, kept in the inode
+// (see SB_INLINE); if data is null, the first keep bytes of what the file
+// holds now stay instead, and the rest reads as zeros. Any blocks the file
+// had are freed. The caller must have checked inline_fits(size), must hold
+// ilock() for write, and must call iupdate() afterwards.
+void
+inline_write(borrowed<inode> ip, const char *data, u64 size, u64 keep,
+             transaction *trans)
+{
+  assert(ip->dev == 1 && ip->type == T_FILE && inline_fits(size));
+
+  char buf[DINODE_INLINE_SIZE];
+  memset(buf, 0, sizeof(buf));
+  if (data)
+    memmove(buf, data, size);
+  else if (keep)
+    readi(ip, buf, 0, std::min(keep, size));
+
+  if (!ip->inline_data())
+    itrunc(ip, 0, trans);
+  auto w = ip->meta_seq.write_begin();
+  memmove(ip->addrs, buf, sizeof(buf));
+  ip->major |= DI_INLINE;
   ip->size = size;
+}
+
+// Move the data of an inline inode (see SB_INLINE) out to a block of its own,
+// for a file that is about to outgrow its inode. The block goes to the disk
+// before this returns, ahead of the transaction that makes the inode point to
+// it. Returns whether the inode was inline. The caller must hold ilock() for
+// write, and must call iupdate() afterwards.
+bool
+inline_promote(borrowed<inode> ip, transaction *trans)
+{
+  if (!ip->inline_data())
+    return false;
+
+  char *page = zalloc("inline_promote");
+  if (!page)
+    throw_bad_alloc();
+  memmove(page, ip->addrs, ip->size);
+  {
+    auto w = ip->meta_seq.write_begin();
+    memset(ip->addrs, 0, DINODE_INLINE_SIZE);
+    ip->major &= ~DI_INLINE;
+  }
+  if (ip->size) {
+    if (writei(ip, page, 0, BSIZE, trans, true, false, true) != BSIZE)
+      panic("inline_promote: out of blocks");
+    trans->flush_block_queue();
+  }
+  kfree(page);
+  return true;
+}
+
+// Whether the root file system can have compressed files (see SB_COMPRESS).
+bool
+compress_supported(void)
+{
+  return sb_root.flags & SB_COMPRESS;
+}
+
+// Turn compression on or off for a directory's new files, or for an empty
+// file. The caller must hold ilock() for write, and must call iupdate()
+// afterwards. Returns -1 if the file isn't empty, preallocated blocks
+// included.
+int
+set_compress(borrowed<inode> ip, bool on)
+{
+  assert(ip->dev == 1 && compress_supported());
+  if (ip->type != T_DIR &&
+      (ip->type != T_FILE || ip->size || ip->extent_map()->nextents))
+    return -1;
+  auto w = ip->meta_seq.write_begin();
+  if (on)
+    ip->major |= DI_COMPRESS;
+  else
+    ip->major &= ~DI_COMPRESS;
+  return 0;
+}
+
+// Write cluster c of a compressed file (see SB_COMPRESS) back, either
+// compressed, as the zlen bytes at z (see zcluster_compress()), or if z is
+// null, as is, from its npages pages. Whatever blocks the cluster had that
+// the new copy doesn't go in place are freed first. The blocks go out
+// through the transaction's block queue, so z and the pages must stay put
+// until it is flushed. The caller must hold ilock() for write, and must
+// call iupdate() afterwards. Returns false if the disk is out of blocks.
+bool
+zcluster_write(borrowed<inode> ip, u32 c, const char *z, u32 zlen,
+               char *const *pages, u32 npages, transaction *trans)
+{
+  scoped_gc_epoch e;
+  assert(extent_mapped(ip.get()) && ip->compressed());
+  assert(npages && npages <= ZCLUSTER_BLOCKS);
+
+  u32 first = c * ZCLUSTER_BLOCKS;
+  dextent old;
+  bool was_compressed = zcluster_extent(ip.get(), ip->extent_map(), first,
+                                        &old);
+  try {
+    if (z || was_compressed)
+      extent_punch(ip, first, first + ZCLUSTER_BLOCKS, trans);
+
+    if (!z) {
+      if (!extent_lookup(ip.get(), ip->extent_map(), first))
+        reserve_extent(ip, npages);
+      for (u32 i = 0; i < npages; i++)
+        if (writei(ip, pages[i], (u64)(first + i) * BSIZE, BSIZE, trans,
+                   true, true, true) != BSIZE)
+          return false;
+      return true;
+    }
+
+    u32 nblocks = PGROUNDUP(zlen) / BSIZE;
+    assert(nblocks < npages);
+    reserve_extent(ip, nblocks);
+    for (u32 i = 0; i < nblocks; i++) {
+      u32 b = extent_bmap(ip, first + i, trans, false, true,
+                          DEXTENT_COMPRESSED);
+      trans->write_block(ip->dev, z + i * BSIZE, b);
+    }
+  } catch (out_of_blocks& e) {
+    console.println("zcluster_write: out of blocks");
+    return false;
+  }
+  return true;
+}
+
+// Reserve disk blocks for the bytes [off, off + len) of a file, without
+// writing them: the blocks that the file lacks in that range are allocated
+// (as one extent, if possible) and marked unwritten, so that they read as
+// zeros without any zeroing I/O, until sync_file() writes them. Unless
+// keep_size is set, the file grows to cover the range. Only extent-mapped
+// inodes can record unwritten blocks. The caller must hold ilock() for write.
+int
+preallocate(borrowed<inode> ip, u64 off, u64 len, bool keep_size,
+            transaction *trans)
+{
+  scoped_gc_epoch e;
+
+  if (!extent_mapped(ip.get()) || ip->type != T_FILE || ip->compressed())
+    return -1;
+  if (!len || off + len < off || off + len > max_file_size(ip.get()))
+    return -1;
+  inline_promote(ip, trans);
+
+  u32 first = off / BSIZE, last = (off + len - 1) / BSIZE;
+  u32 nholes = 0;
+  for (u64 bn = first; bn <= last; bn++)
+    if (!extent_lookup(ip.get(), ip->extent_map(), bn))
+      nholes++;
+
+  int r = 0;
+  if (nholes > 1)
+    reserve_extent(ip, nholes);
+  try {
+    // The blocks that the file already has are left alone.
+    for (u64 bn = first; bn <= last; bn++)
+      extent_bmap(ip, bn, trans, false, false, DEXTENT_UNWRITTEN);
+  } catch (out_of_blocks& e) {
+    // Whatever was allocated stays allocated, but the size doesn't change.
+    r = -1;
+  }
+  release_extent(ip);
+
+  if (!r && !keep_size && off + len > ip->size)
+    ip->set_size(off + len);
   iupdate(ip, trans);
+  return r;
 }
 
 // Directories
 
-void
-dir_init(sref<inode> dp)
+// The directories whose indexes dir_init() has built, swept in CLOCK order
+// by dir_reclaim() to evict the indexes that haven't been used for a while.
+// Entries name the inode by number, since it may be gone by the time the
+// sweep gets to it.
+static struct {
+  struct entry {
+    u32 dev;
+    u32 inum;
+  };
+
+  spinlock lock;
+  std::vector<entry> dirs;
+  size_t hand;
+} dir_cache;
+
+// Return the index of directory dp, building it from the directory's
+// contents if it doesn't have one (yet, or any more). The index may be
+// evicted once the caller leaves its gc epoch, unless the caller holds the
+// ilock.
+dir_entries*
+dir_init(borrowed<inode> dp)
 {
   scoped_gc_epoch e;
 
-  if (dp->dir)
-    return;
+  dir_entries *dir = dp->dir.load();
+  if (dir)
+    return dir;
 
   if (dp->type != T_DIR)
     panic("dir_init: inode is not a directory\n");
 
-  dp->dir = new dir_entries(NDIR_ENTRIES_PRIME);
+  dir = new dir_entries();
   u32 dir_offset = 0;
 
   for (u32 off = 0; off < dp->size; off += BSIZE) {
     assert(dir_offset == off);
+    if (off % (DIR_READAHEAD_BLOCKS * BSIZE) == 0)
+      readahead(dp, off, DIR_READAHEAD_BLOCKS * BSIZE);
     sref<buf> bp;
     try {
       bp = buf::get(dp->dev, bmap(dp, off / BSIZE, NULL, true));
@@ -1173,25 +2395,116 @@ dir_init(sref<inode> dp)
 
       if (de->inum) {
         dir_entry_info de_info(de->inum, dir_offset);
-        dp->dir->insert(strbuf<DIRSIZ>(de->name), de_info);
+        dir->insert(strbuf<DIRSIZ>(de->name), de_info);
+        dir->use_slot(dir_offset);
+      } else {
+        dir->note_free_slot(dir_offset);
       }
 
       dir_offset += sizeof(*de);
     }
   }
 
-  dp->dir_offset = dir_offset;
+  // Someone else may have built the index meanwhile. Whoever installs it also
+  // sets dir_offset, before anyone can get hold of the index to add entries.
+  {
+    auto l = dp->lock.guard();
+    dir_entries *other = dp->dir.load();
+    if (other) {
+      delete dir;
+      return other;
+    }
+    dp->dir_offset = dir_offset;
+    dp->dir.store(dir);
+  }
+
+  auto l = dir_cache.lock.guard();
+  dir_cache.dirs.push_back({dp->dev, dp->inum});
+  return dir;
+}
+
+// Evict the indexes of up to DIR_RECLAIM_BATCH directories that haven't been
+// looked up in since the last sweep, and that nobody has locked. Called by the
+// directory shrinker when memory runs low; the indexes get rebuilt from the
+// disk on their next use. Returns the number of indexes evicted.
+size_t
+dir_reclaim(void)
+{
+  scoped_gc_epoch e;
+
+  // One sweep at a time is plenty.
+  auto l = dir_cache.lock.try_guard();
+  if (!l)
+    return 0;
+
+  size_t nevicted = 0;
+  size_t size = dir_cache.dirs.size();
+  for (size_t n = 0; n < size && n < DIR_RECLAIM_BATCH; n++) {
+    if (dir_cache.hand >= dir_cache.dirs.size())
+      dir_cache.hand = 0;
+    auto d = dir_cache.dirs[dir_cache.hand];
+
+    inode *ip = nullptr;
+    dir_entries *dir = nullptr;
+    bool drop = true;
+    if (ins->lookup(make_pair(d.dev, d.inum), &ip) && (dir = ip->dir.load())) {
+      drop = false;
+      if (!dir->test_and_clear_referenced()) {
+        // Writers of the directory hold its ilock, which keeps them from
+        // modifying an index that we're about to get rid of.
+        auto il = ip->lock.guard();
+        if (!ip->busy && !ip->readbusy && ip->dir.load() == dir) {
+          ip->dir.store(nullptr);
+          gc_delayed(dir);
+          drop = true;
+          nevicted++;
+        }
+      }
+    }
+
+    if (drop) {
+      dir_cache.dirs[dir_cache.hand] = dir_cache.dirs.back();
+      dir_cache.dirs.pop_back();
+    } else {
+      dir_cache.hand++;
+    }
+  }
+  return nevicted;
+}
+
+namespace {
+  // The directory indexes are shared by all cores, so any core under
+  // pressure may evict them.
+  class dir_shrinker : public shrinker
+  {
+  public:
+    dir_shrinker() : shrinker("dirs") { }
+
+    size_t count(int cpu) override
+    {
+      auto l = dir_cache.lock.guard();
+      return dir_cache.dirs.size();
+    }
+
+    size_t scan(int cpu, size_t nr) override
+    {
+      return dir_reclaim();
+    }
+  };
+
+  dir_shrinker the_dir_shrinker;
 }
 
 // Caller must hold ilock for write.
 void
-dir_flush_entry(sref<inode> dp, const char *name, transaction *trans)
+dir_flush_entry(borrowed<inode> dp, const char *name, transaction *trans)
 {
-  if (!dp->dir)
+  dir_entries *dir = dp->dir.load();
+  if (!dir)
     return;
 
   dir_entry_info de_info;
-  dp->dir->lookup(strbuf<DIRSIZ>(name), &de_info);
+  dir->lookup(strbuf<DIRSIZ>(name), &de_info);
 
   struct dirent de;
   strncpy(de.name, name, DIRSIZ);
@@ -1201,20 +2514,182 @@ dir_flush_entry(sref<inode> dp, const char *name, transaction *trans)
     panic("dir_flush_entry");
 
   if (dp->size < de_info.offset_ + sizeof(de)) {
-    dp->size = de_info.offset_ + sizeof(de);
+    dp->set_size(de_info.offset_ + sizeof(de));
   }
 
   iupdate(dp, trans);
 }
 
+// Hashed directories (SB_HASHDIR). These don't need an in-memory index:
+// the name alone says which block to look in, so lookups, links and unlinks
+// each read one block.
+
+static bool
+hashed_dir(inode *dp)
+{
+  return dp->dev == 1 && (sb_root.flags & SB_HASHDIR);
+}
+
+// Read block bn of hashed directory dp into des. Blocks past the end of the
+// directory read as empty.
+static void
+hdir_read_block(borrowed<inode> dp, u32 bn, struct dirent *des)
+{
+  if ((u64)(bn + 1) * BSIZE > dp->size) {
+    memset(des, 0, BSIZE);
+    return;
+  }
+  if (readi(dp, (char *)des, (u64)bn * BSIZE, BSIZE) != BSIZE)
+    panic("hdir_read_block");
+}
+
+// The slot of name in the block des, or -1 if it isn't there.
+static int
+hdir_find(const struct dirent *des, const char *name)
+{
+  for (int i = 0; i < DIRENTS_PER_BLOCK; i++)
+    if (des[i].inum && !strncmp(des[i].name, name, DIRSIZ))
+      return i;
+  return -1;
+}
+
+static void
+hdir_write_slot(borrowed<inode> dp, u32 bn, int slot, const struct dirent *de,
+                transaction *trans)
+{
+  u64 off = (u64)bn * BSIZE + slot * sizeof(*de);
+  if (writei(dp, (const char *)de, off, sizeof(*de), trans) != sizeof(*de))
+    panic("hdir_write_slot");
+}
+
+// Grow hashed directory dp by a block, moving to it the entries of the block
+// that it splits. Caller must hold ilock for write.
+static void
+hdir_split(borrowed<inode> dp, struct dirent *des, transaction *trans)
+{
+  u32 n = dp->size / BSIZE;
+  assert(n > 0);
+
+  u32 level = 1;
+  while (level < n + 1)
+    level <<= 1;
+  u32 sibling = n - level / 2;
+
+  hdir_read_block(dp, sibling, des);
+  int nmoved = 0;
+  for (int i = 0; i < DIRENTS_PER_BLOCK; i++) {
+    if (!des[i].inum ||
+        dirent_block(dirent_hash(des[i].name), n + 1) != n)
+      continue;
+    hdir_write_slot(dp, n, nmoved++, &des[i], trans);
+    memset(&des[i], 0, sizeof(des[i]));
+    hdir_write_slot(dp, sibling, i, &des[i], trans);
+  }
+  // Allocate the new block even if it's empty.
+  if (!nmoved) {
+    struct dirent de;
+    memset(&de, 0, sizeof(de));
+    hdir_write_slot(dp, n, 0, &de, trans);
+  }
+  dp->set_size((u64)(n + 1) * BSIZE);
+}
+
+// The inode number that name refers to in hashed directory dp, or 0.
+static u32
+hdir_lookup(borrowed<inode> dp, const char *name)
+{
+  struct dirent *des = (struct dirent *)kalloc("hdir_lookup", BSIZE);
+  if (!des)
+    throw_bad_alloc();
+
+  ilock(dp, READLOCK);
+  hdir_read_block(dp, dirent_block(dirent_hash(name), dp->size / BSIZE), des);
+  int i = hdir_find(des, name);
+  u32 inum = i < 0 ? 0 : des[i].inum;
+  iunlock(dp);
+
+  kfree(des, BSIZE);
+  return inum;
+}
+
+// Add (name, inum) to hashed directory dp, growing it until the name's block
+// has room. Caller must hold ilock for write.
+static int
+hdir_link(borrowed<inode> dp, const char *name, u32 inum, transaction *trans)
+{
+  struct dirent *des = (struct dirent *)kalloc("hdir_link", BSIZE);
+  if (!des)
+    throw_bad_alloc();
+
+  u32 h = dirent_hash(name);
+  int r = -1;
+  for (;;) {
+    u32 bn = dirent_block(h, dp->size / BSIZE);
+    hdir_read_block(dp, bn, des);
+    if (hdir_find(des, name) >= 0)
+      break;
+
+    int slot = -1;
+    for (int i = 0; i < DIRENTS_PER_BLOCK && slot < 0; i++)
+      if (!des[i].inum)
+        slot = i;
+    if (slot < 0) {
+      hdir_split(dp, des, trans);
+      continue;
+    }
+
+    struct dirent de;
+    memset(&de, 0, sizeof(de));
+    strncpy(de.name, name, DIRSIZ);
+    de.inum = inum;
+    hdir_write_slot(dp, bn, slot, &de, trans);
+    // An empty directory gets its first block.
+    if (dp->size < BSIZE)
+      dp->set_size(BSIZE);
+    r = 0;
+    break;
+  }
+
+  kfree(des, BSIZE);
+  return r;
+}
+
+// Remove name from hashed directory dp. Caller must hold ilock for write.
+static int
+hdir_unlink(borrowed<inode> dp, const char *name, transaction *trans)
+{
+  struct dirent *des = (struct dirent *)kalloc("hdir_unlink", BSIZE);
+  if (!des)
+    throw_bad_alloc();
+
+  u32 bn = dirent_block(dirent_hash(name), dp->size / BSIZE);
+  hdir_read_block(dp, bn, des);
+  int i = hdir_find(des, name);
+  if (i >= 0) {
+    memset(&des[i], 0, sizeof(des[i]));
+    hdir_write_slot(dp, bn, i, &des[i], trans);
+  }
+
+  kfree(des, BSIZE);
+  return i < 0 ? -1 : 0;
+}
+
 // Look for a directory entry in a directory.
 sref<inode>
-dirlookup(sref<inode> dp, char *name)
+dirlookup(borrowed<inode> dp, char *name)
 {
-  dir_init(dp);
+  scoped_gc_epoch e;
+  if (hashed_dir(dp.get())) {
+    u32 inum = hdir_lookup(dp, name);
+    if (!inum)
+      return sref<inode>();
+    return iget(dp->dev, inum);
+  }
+
+  dir_entries *dir = dir_init(dp);
 
   dir_entry_info de_info;
-  dp->dir->lookup(strbuf<DIRSIZ>(name), &de_info);
+  dir->lookup(strbuf<DIRSIZ>(name), &de_info);
 
   if (de_info.inum_ == 0)
     return sref<inode>();
@@ -1223,19 +2698,29 @@ dirlookup(sref<inode> dp, char *name)
 
 // Write a new directory entry (name, inum) into the directory dp.
 int
-dirlink(sref<inode> dp, const char *name, u32 inum, bool inc_link,
+dirlink(borrowed<inode> dp, const char *name, u32 inum, bool inc_link,
         transaction *trans)
 {
   bool ip_updated = false;
   sref<inode> ip;
-  dir_init(dp);
+  bool hashed = hashed_dir(dp.get());
+
+  if (hashed) {
+    if (hdir_link(dp, name, inum, trans) < 0)
+      return -1;
+  } else {
+    dir_entries *dir = dir_init(dp);
 
-  dir_entry_info de_info(inum, dp->dir_offset);
+    // Reuse the slot of a removed entry, if there is one.
+    dir_entry_info de_info(inum, dir->next_slot(dp->dir_offset));
 
-  if (!dp->dir->insert(strbuf<DIRSIZ>(name), de_info))
-    return -1;
+    if (!dir->insert(strbuf<DIRSIZ>(name), de_info))
+      return -1;
 
-  dp->dir_offset += sizeof(struct dirent);
+    dir->use_slot(de_info.offset_);
+    if (de_info.offset_ == dp->dir_offset)
+      dp->dir_offset += sizeof(struct dirent);
+  }
 
   // If adding the ".." link in a directory, don't change *any* link counts.
   if (strncmp(name, "..", DIRSIZ) != 0) {
@@ -1249,7 +2734,10 @@ dirlink(sref<inode> dp, const char *name, u32 inum, bool inc_link,
       dp->link();
   }
 
-  dir_flush_entry(dp, name, trans);
+  if (hashed)
+    iupdate(dp, trans);
+  else
+    dir_flush_entry(dp, name, trans);
 
   // Update the on-disk link count of the inode being linked.
   if (ip_updated)
@@ -1259,22 +2747,29 @@ dirlink(sref<inode> dp, const char *name, u32 inum, bool inc_link,
 
 // Remove a directory entry (name, inum) from the directory dp.
 int
-dirunlink(sref<inode> dp, const char *name, u32 inum, bool dec_link,
+dirunlink(borrowed<inode> dp, const char *name, u32 inum, bool dec_link,
           transaction *trans)
 {
   bool ip_updated = false;
   sref<inode> ip;
-  dir_init(dp);
-
+  bool hashed = hashed_dir(dp.get());
+  dir_entries *dir = nullptr;
   dir_entry_info de_info;
-  dp->dir->lookup(strbuf<DIRSIZ>(name), &de_info);
 
-  if (!dp->dir->remove(strbuf<DIRSIZ>(name)))
-    return -1;
+  if (hashed) {
+    if (hdir_unlink(dp, name, trans) < 0)
+      return -1;
+  } else {
+    dir = dir_init(dp);
+    dir->lookup(strbuf<DIRSIZ>(name), &de_info);
 
-  de_info.inum_ = 0;
-  if (!dp->dir->insert(strbuf<DIRSIZ>(name), de_info))
-    return -1;
+    if (!dir->remove(strbuf<DIRSIZ>(name)))
+      return -1;
+
+    de_info.inum_ = 0;
+    if (!dir->insert(strbuf<DIRSIZ>(name), de_info))
+      return -1;
+  }
 
   // If removing the ".." link in a directory, don't change *any* link counts.
   if (strncmp(name, "..", DIRSIZ) != 0) {
@@ -1288,8 +2783,22 @@ dirunlink(sref<inode> dp, const char *name, u32 inum, bool dec_link,
       dp->unlink();
   }
 
-  dir_flush_entry(dp, name, trans);
-  dp->dir->remove(strbuf<DIRSIZ>(name));
+  if (hashed) {
+    iupdate(dp, trans);
+  } else {
+    dir_flush_entry(dp, name, trans);
+    dir->remove(strbuf<DIRSIZ>(name));
+    dir->release_slot(de_info.offset_);
+
+    // Truncate any blocks at the end of the directory that are empty now.
+    u32 end = dir->trim(dp->dir_offset);
+    if (end < dp->dir_offset) {
+      itrunc(dp, end, trans);
+      dp->set_size(end);
+      dp->dir_offset = end;
+      iupdate(dp, trans);
+    }
+  }
 
   // Update the on-disk link count of the inode being unlinked.
   if (ip_updated)
@@ -1348,7 +2857,7 @@ skipelem(const char **rpath, char *name)
 // If parent != 0, return the inode for the parent and copy the final
 // path element into name, which must have room for DIRSIZ bytes.
 static sref<inode>
-namex(sref<inode> cwd, const char *path, int nameiparent, char *name)
+namex(borrowed<inode> cwd, const char *path, int nameiparent, char *name)
 {
   // Assumes caller is holding a gc_epoch
 
@@ -1359,7 +2868,7 @@ namex(sref<inode> cwd, const char *path, int nameiparent, char *name)
   if (*path == '/')
     ip = the_root;
   else
-    ip = cwd;
+    ip = cwd.ref();
 
   while ((r = skipelem(&path, name)) == 1) {
     // XXX Doing this here requires some annoying reasoning about all
@@ -1393,7 +2902,7 @@ namex(sref<inode> cwd, const char *path, int nameiparent, char *name)
 }
 
 sref<inode>
-namei(sref<inode> cwd, const char *path)
+namei(borrowed<inode> cwd, const char *path)
 {
   // Assumes caller is holding a gc_epoch
   char name[DIRSIZ];
@@ -1401,7 +2910,7 @@ namei(sref<inode> cwd, const char *path)
 }
 
 sref<inode>
-nameiparent(sref<inode> cwd, const char *path, char *name)
+nameiparent(borrowed<inode> cwd, const char *path, char *name)
 {
   // Assumes caller is holding a gc_epoch
   return namex(cwd, path, 1, name);
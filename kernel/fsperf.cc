@@ -0,0 +1,99 @@
+// File system performance counting regions; see fsperf.hh.
+
+#include "types.h"
+#include "kernel.hh"
+#include "fs.h"
+#include "file.hh"
+#include "major.h"
+#include "kstream.hh"
+#include "fsperf.hh"
+
+using namespace scopedperf;
+
+std::atomic<u32> fsperf_mask;
+bool fsperf_have_pmc;
+
+static tsc_ctr fsperf_tsc;
+static fsperf_pmc fsperf_pmc0;
+ctrgroup_chain<tsc_ctr, fsperf_pmc> fsperf_group(&fsperf_tsc, &fsperf_pmc0);
+
+static const char *subsys_names[FSPERF_NSUBSYS] = {
+  "syscall", "commit", "apply", "bufcache", "pagecache",
+};
+
+// Every region, most recently first seen first
+static std::atomic<fsperf_sum*> fsperf_sums;
+
+fsperf_sum::fsperf_sum(u8 subsys, const char *name)
+  : name(name), subsys(subsys), stat()
+{
+  next = fsperf_sums.load(std::memory_order_relaxed);
+  while (!fsperf_sums.compare_exchange_weak(next, this))
+    ;
+}
+
+static void
+print_fsperf(print_stream *s)
+{
+  u32 mask = fsperf_mask.load(std::memory_order_relaxed);
+  s->print("fsperf enabled:");
+  for (int i = 0; i < FSPERF_NSUBSYS; i++)
+    if (mask & (1u << i))
+      s->print(" ", subsys_names[i]);
+  s->println(fsperf_have_pmc ? "" : " (no PMU, pmc0 reads 0)");
+  s->println("       count          cycles    avg cycles            pmc0"
+             "  region");
+
+  for (fsperf_sum *p = fsperf_sums; p; p = p->next) {
+    fsperf_sum::stats tot{};
+    for (int c = 0; c < ncpu; c++) {
+      tot.count += p->stat[c].count;
+      for (int i = 0; i < fsperf_sum::ps_nctr; i++)
+        tot.sum[i] += p->stat[c].sum[i];
+    }
+    if (!tot.count)
+      continue;
+    s->println(sfmt(tot.count).width(12), sfmt(tot.sum[0]).width(16),
+               sfmt(tot.sum[0] / tot.count).width(14),
+               sfmt(tot.sum[1]).width(16), "  ", p->name, " (",
+               subsys_names[p->subsys], ")");
+    for (int c = 0; c < ncpu; c++) {
+      auto &st = p->stat[c];
+      if (!st.count)
+        continue;
+      s->println(sfmt(st.count).width(12), sfmt(st.sum[0]).width(16),
+                 sfmt(st.sum[0] / st.count).width(14),
+                 sfmt(st.sum[1]).width(16), "    core ", c);
+    }
+  }
+}
+
+static int
+fsperfread(mdev*, char *dst, u32 off, u32 n)
+{
+  window_stream s(dst, off, n);
+  print_fsperf(&s);
+  return s.get_used();
+}
+
+static int
+fsperfwrite(mdev*, const char *buf, u32 n)
+{
+  struct fsperf_ctl ctl;
+  if (n != sizeof(ctl))
+    return -1;
+  memcpy(&ctl, buf, sizeof(ctl));
+  if (ctl.reset)
+    for (fsperf_sum *p = fsperf_sums; p; p = p->next)
+      memset(p->stat, 0, sizeof(p->stat));
+  fsperf_mask = ctl.mask & FSPERF_ALL;
+  return n;
+}
+
+void
+initfsperf(void)
+{
+  fsperf_have_pmc = samphavepmc();
+  devsw[MAJ_FSPERF].pread = fsperfread;
+  devsw[MAJ_FSPERF].write = fsperfwrite;
+}
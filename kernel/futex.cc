@@ -2,12 +2,10 @@
 #include "kernel.hh"
 #include "spinlock.hh"
 #include "cpputil.hh"
-#include "ns.hh"
 #include "errno.h"
 #include "condvar.hh"
 #include "proc.hh"
 #include "cpu.hh"
-#include "spercpu.hh"
 #include "kmtrace.hh"
 
 //
@@ -47,222 +45,165 @@ futexkey(const u64* useraddr, vmap* vmap, futexkey_t* key)
 }
 
 //
-// nscache
+// futex hash
 //
-struct nscache {
-  struct spinlock lock_;
-  volatile u64 head_;
-  volatile u64 tail_;
-  xns<u32, proc*, proc::hash>* ns_[16];
-
-  nscache();
-  xns<u32, proc*, proc::hash>* alloc();
-  bool cache(xns<u32, proc*, proc::hash>* ns);
-
-  NEW_DELETE_OPS(nscache);
-};
-
-// XXX(austin) If we used percpu_safety::cli here, would nscache no
-// longer need the lock?
-DEFINE_PERCPU(nscache, nscache_, NO_CRITICAL);
-
-nscache::nscache(void)
-  : lock_("nscache::lock_", LOCKSTAT_FUTEX), head_(0), tail_(0)
-{
-}
-
-xns<u32, proc*, proc::hash>*
-nscache::alloc(void)
-{
-  xns<u32, proc*, proc::hash>* ns = nullptr;
-  
-  acquire(&lock_);
-  if (head_ - tail_ > 0) {
-    u64 i = tail_%NELEM(ns_);
-    ++tail_;
-    ns = ns_[i];
-  }
-  release(&lock_);
-  return ns;
-}
-
-bool
-nscache::cache(xns<u32, proc*, proc::hash>* ns)
-{
-  bool cached = false;
-
-  acquire(&lock_);
-  if (head_ - tail_ < NELEM(ns_)) {
-    u64 i = head_%NELEM(ns_);
-    ++head_;
-    ns_[i] = ns;
-    cached = true;
-  }
-  release(&lock_);
-  return cached;
-}
-
-//
-// futexaddr
-//
-struct futexaddr : public referenced, public rcu_freed
+// Waiters queue on the bucket their key hashes to, linked through
+// their proc's futex_link, and sleep on their own proc's condvar, so
+// a wait allocates nothing.  A waiter's futex_key says which futex it
+// is waiting on; it only changes with that futex's bucket locked.  A
+// wake dequeues the waiters it wakes and clears their futex_key, and
+// a requeue moves waiters to another futex's bucket and changes their
+// futex_key to match.
+
+struct futex_bucket
 {
-  static futexaddr* alloc(futexkey_t key);
-
-  virtual void do_gc() override;
-  virtual void onzero() override;
-
-  futexkey_t key_;
-  bool inserted_;
-  xns<u32, proc*, proc::hash>* const nspid_;
+  struct spinlock lock;
+  ilist<proc, &proc::futex_link> waiters;
 
-private:
-  futexaddr(futexkey_t key, xns<u32, proc*, proc::hash>* nspid);
-  NEW_DELETE_OPS(futexaddr);
-};
-
-xns<futexkey_t, futexaddr*, futexkey_hash> *nsfutex __mpalign__;
-
-futexaddr*
-futexaddr::alloc(futexkey_t key)
-{
-  xns<u32, proc*, proc::hash>* nspid;
-  futexaddr* fa;
-
-  nspid = nscache_->alloc();
-  if (nspid == nullptr)
-    nspid = new xns<u32, proc*, proc::hash>(false);
-
-  if (nspid == nullptr)
-    return nullptr;
-  fa = new futexaddr(key, nspid);
-  if (fa == nullptr) {
-    delete nspid;
-    return nullptr;
-  }
+  futex_bucket() : lock("futex_bucket", LOCKSTAT_FUTEX) { }
+} __mpalign__;
 
-  return fa;
-}
+static futex_bucket futex_buckets[FUTEX_HASH_BUCKETS];
 
-futexaddr::futexaddr(futexkey_t key, xns<u32, proc*, proc::hash>* nspid)
-  : rcu_freed("futexaddr", this, sizeof(*this)),
-    key_(key), inserted_(false), nspid_(nspid)
+static futex_bucket*
+futex_bucket_of(futexkey_t key)
 {
+  // Keys are u64-aligned, and futexes often share a page
+  u64 h = (u64)key >> 3;
+  h ^= h >> 12;
+  return &futex_buckets[h % FUTEX_HASH_BUCKETS];
 }
 
-void
-futexaddr::do_gc(void)
+// With b locked, lock p's current bucket instead, following any
+// requeues of p.  Returns the locked bucket, which is b if p has been
+// woken.
+static futex_bucket*
+futex_relock(proc* p, futex_bucket* b)
 {
-  delete this;
+  for (;;) {
+    futexkey_t key = p->futex_key;
+    if (key == nullptr || futex_bucket_of(key) == b)
+      return b;
+    release(&b->lock);
+    b = futex_bucket_of(key);
+    acquire(&b->lock);
+  }
 }
 
-void
-futexaddr::onzero(void)
+// Wake p, which waits in the locked bucket b.  p's futex_key is
+// cleared last: until then a woken p still looks queued, so it waits
+// for b's lock before it can return and go away.
+static void
+futex_wake_one(futex_bucket* b, proc* p)
 {
-  if (inserted_)
-    assert(nsfutex->remove(key_, nullptr));
-  // Normally deallocate members in the destructor, but in this case
-  // we don't want to wait for the gc to fill the cache
-  if (!nscache_->cache(nspid_))
-    delete nspid_;
-  gc_delayed((futexaddr*)this);
+  b->waiters.erase(b->waiters.iterator_to(p));
+  p->cv->wake_all();
+  p->futex_key = nullptr;
 }
 
 long
-futexwait(futexkey_t key, u64 val, u64 timer)
+futexwait(futexkey_t key, u64 val, u64 timer, u64 bitset)
 {
-  futexaddr* fa;
-
-  mtreadavar("futex:ns:%p", key);
-  {
-    scoped_gc_epoch gc;
-  again:
-    fa = nsfutex->lookup(key);
-    if (fa == nullptr) {
-      fa = futexaddr::alloc(key);
-      if (fa == nullptr) {
-        cprintf("futexwait futexaddr::alloc failed\n");
-        return -1;
-      }
-      if (!nsfutex->insert(key, fa)) {
-        fa->dec();
-        goto again;
-      }
-      mtwriteavar("futex:ns:%p", key);
-      fa->inserted_ = true;
-    } else {
-      if (!fa->tryinc()) {
-        goto again;
-      }
-    }
-  }
-  assert(fa->key_ == key);
-  mtwriteavar("futex:%p.%p", key, fa);
-
-  acquire(&myproc()->futex_lock);  
-  auto cleanup = scoped_cleanup([&fa](){
-    release(&myproc()->futex_lock);
-    fa->dec();
-  });
+  proc* p = myproc();
+  futex_bucket* b = futex_bucket_of(key);
 
-  // This first check is an optimization
-  if (futexkey_val(fa->key_) != val)
-    return -EWOULDBLOCK;
-
-  if (!fa->nspid_->insert(myproc()->pid, myproc()))
+  if (bitset == 0)
     return -1;
 
-  if (futexkey_val(fa->key_) != val) {
-    fa->nspid_->remove(myproc()->pid, nullptr);
+  mtreadavar("futex:%p", key);
+  acquire(&b->lock);
+  // A waker changes *key before it locks the bucket, so checking with
+  // the bucket locked can't miss a wake.
+  if (futexkey_val(key) != val) {
+    release(&b->lock);
     return -EWOULDBLOCK;
   }
+  mtwriteavar("futex:%p", key);
+
+  p->futex_key = key;
+  p->futex_bitset = bitset;
+  b->waiters.push_back(p);
+
+  // However we leave (woken, timed out, or killed), leave the bucket.
+  auto cleanup = scoped_cleanup([&p, &b](){
+    b = futex_relock(p, b);
+    if (p->futex_key != nullptr) {
+      b->waiters.erase(b->waiters.iterator_to(p));
+      p->futex_key = nullptr;
+    }
+    release(&b->lock);
+  });
 
+  // p->cv is also p's wait() condvar, so wakes can be spurious.
   u64 nsecto = timer == 0 ? 0 : timer+nsectime();
-  myproc()->cv->sleep_to(&myproc()->futex_lock, nsecto);
-
-  assert(fa->nspid_->remove(myproc()->pid, nullptr));
+  do {
+    p->cv->sleep_to(&b->lock, nsecto);
+    b = futex_relock(p, b);
+  } while (p->futex_key != nullptr && (nsecto == 0 || nsectime() < nsecto));
   return 0;
 }
 
 long
-futexwake(futexkey_t key, u64 nwake)
+futexwake(futexkey_t key, u64 nwake, u64 bitset)
 {
-  futexaddr* fa;
+  futex_bucket* b = futex_bucket_of(key);
   u64 nwoke = 0;
 
-  if (nwake == 0)
+  if (nwake == 0 || bitset == 0)
     return -1;
 
-  mtreadavar("futex:ns:%p", key);
-  {
-    scoped_gc_epoch gc;
-    fa = nsfutex->lookup(key);
-    if (fa == nullptr || !fa->tryinc())
-      return 0;
-  }
-
-  auto cleanup = scoped_cleanup([&fa](){
-    fa->dec();
-  });
-  mtwriteavar("futex:%p.%p", key, fa);
-
-  fa->nspid_->enumerate([&nwoke, &nwake](u32 pid, proc* p) {
-    acquire(&p->futex_lock);
-    p->cv->wake_all();
-    release(&p->futex_lock);
+  mtreadavar("futex:%p", key);
+  scoped_acquire l(&b->lock);
+  for (auto it = b->waiters.begin(); it != b->waiters.end() && nwoke < nwake; ) {
+    proc* p = &*it++;
+    if (p->futex_key != key || !(p->futex_bitset & bitset))
+      continue;
+    futex_wake_one(b, p);
     ++nwoke;
-    if (nwoke >= nwake)
-      return 1;
-    return 0;
-  });
-
-  return 0;
+  }
+  return nwoke;
 }
 
-void
-initfutex(void)
+// Wake up to nwake waiters of key and move up to nrequeue more to
+// wait on key2, so a condvar broadcast wakes one waiter rather than a
+// herd that would all contend for the mutex.  If cmp, fail unless
+// *key is val.  Returns the number of waiters woken or moved.
+long
+futexrequeue(futexkey_t key, u64 nwake, u64 nrequeue, futexkey_t key2,
+             bool cmp, u64 val)
 {
-  nsfutex = new xns<futexkey_t, futexaddr*, futexkey_hash>(false);
-  if (nsfutex == 0)
-    panic("initfutex");
+  futex_bucket* b = futex_bucket_of(key);
+  futex_bucket* b2 = futex_bucket_of(key2);
+  u64 nwoke = 0, nmoved = 0;
+
+  mtreadavar("futex:%p", key);
+  // Lock the buckets in address order
+  lock_guard<spinlock> l, l2;
+  l = (b < b2 ? b : b2)->lock.guard();
+  if (b != b2)
+    l2 = (b < b2 ? b2 : b)->lock.guard();
+
+  if (cmp && futexkey_val(key) != val)
+    return -EWOULDBLOCK;
+
+  for (auto it = b->waiters.begin();
+       it != b->waiters.end() && (nwoke < nwake || nmoved < nrequeue); ) {
+    proc* p = &*it++;
+    if (p->futex_key != key)
+      continue;
+    if (nwoke < nwake) {
+      futex_wake_one(b, p);
+      ++nwoke;
+      continue;
+    }
+    if (b2 != b) {
+      b->waiters.erase(b->waiters.iterator_to(p));
+      b2->waiters.push_back(p);
+    }
+    p->futex_key = key2;
+    ++nmoved;
+  }
+  if (nmoved != 0)
+    mtwriteavar("futex:%p", key2);
+  return nwoke + nmoved;
 }
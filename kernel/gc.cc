@@ -47,10 +47,11 @@ using std::atomic;
 
 enum { gc_debug = 0, gc_global = GC_GLOBAL };
 
-// Head of a delayed free list. Always read and updated while holding lock_
+// Head of a delayed free list.  gc_delayed() pushes onto it and do_gc()
+// takes the whole list at once, both without locks.  Since nothing
+// pops single elements, there's no ABA problem.
 struct headinfo {
-  rcu_freed* head;
-  u64 epoch;
+  atomic<rcu_freed*> head;
 };
 
 // nexttofree_epoch << min_epoch << global_epoch (or cur_epoch)
@@ -59,15 +60,18 @@ struct gc_state {
   atomic<u64> min_epoch;        // the lowest epoch # a process on this core is in
   atomic<u64> cur_epoch;        // the current epoch this core is running in
   atomic<u64> global_min;       // used to compute global_min over nexttofree
+  headinfo delayed[NEPOCH];     // NEPOCH delayed-free lists
+  atomic<u64> ndelay;           // elements ever queued here
+  atomic<u64> delayed_bytes;    // bytes queued here and not freed yet
+  // Protects proclist and sleeping on cv
   struct spinlock lock_ __mpalign__;
   struct condvar cv;
-  headinfo delayed[NEPOCH];     // NEPOCH delayed-free lists
   gc_handle proclist;           // list of process in an epoch on this core
 public:
   gc_state();
   void dequeue(gc_handle *h);
   void enqueue(gc_handle *h);
-  int gc_free(rcu_freed *r, u64 epoch);
+  int gc_free(rcu_freed *r, u64 epoch, u64 *bytes);
   void do_gc(void);
   void inc_cur_epoch(void);
 };
@@ -150,12 +154,13 @@ gc_state::inc_cur_epoch(void)
 }
 
 gc_state::gc_state() :
+  ndelay(0), delayed_bytes(0),
   lock_("gc_state", LOCKSTAT_GC), cv(condvar("gc_cv"))
 {
   proclist.next = &proclist;
   proclist.prev = &proclist;
   for (int i = 0; i < NEPOCH; i++) {
-    delayed[i].epoch = i;
+    delayed[i].head = nullptr;
   }
   cur_epoch = NEPOCH-2;
 }
@@ -190,13 +195,14 @@ gc_state::dequeue(gc_handle *h)
   }
 }
 
-// Free the elements in delayed-free list r (from epoch epoch).
-// Runs without holding _lock
+// Free the elements in delayed-free list r (from epoch epoch), adding
+// up the bytes freed in *bytes.
 int
-gc_state::gc_free(rcu_freed *r, u64 epoch)
+gc_state::gc_free(rcu_freed *r, u64 epoch, u64 *bytes)
 {
   int nfree = 0;
   rcu_freed *nr;
+  *bytes = 0;
   for (; r; r = nr) {
     if (r->_rcu_epoch > epoch) {
       cprintf("gc_free: r->epoch %ld > epoch %ld\n", r->_rcu_epoch, epoch);
@@ -206,14 +212,16 @@ gc_state::gc_free(rcu_freed *r, u64 epoch)
       assert(0);
     }
     nr = r->_rcu_next;
+    *bytes += r->_rcu_size;
     r->do_gc();
     nfree++;
   }
   return nfree;
 }
 
-// Caller must hold lock_.  This function cannot be called recursively,
-// but it won't if only gc_worker() runs do_gc.
+// Runs without holding lock_, since gc_free() may call
+// gc_begin/end_epoch or gc_delayed.  This function cannot be called
+// recursively, but it won't if only gc_worker() runs do_gc.
 void
 gc_state::do_gc(void)
 {
@@ -223,16 +231,16 @@ gc_state::do_gc(void)
 
   // free all delayed-free lists until min_epoch
   for (i = nexttofree_epoch; i < min_epoch; i++) {
-    rcu_freed *head = delayed[i%NEPOCH].head;
-
-    // give up lock during free; gc_free() may call gc_begin/end_epoch
-    release(&lock_);
-
-    int nfree = gc_free(head,i);
-
-    acquire(&lock_);
-    delayed[i%NEPOCH].head = nullptr;
-    delayed[i%NEPOCH].epoch += NEPOCH;
+    // An element that was being queued for epoch i as we take the list
+    // lands on the fresh list and waits for epoch i + NEPOCH, which is
+    // only later than necessary.  The global epoch can't get far enough
+    // ahead of nexttofree_epoch for anything to land on a list before
+    // its epoch is freed.
+    rcu_freed *head = delayed[i%NEPOCH].head.exchange(nullptr);
+
+    u64 bytes;
+    int nfree = gc_free(head, i, &bytes);
+    delayed_bytes -= bytes;
     stat->nfree += nfree;
     if (gc_debug && nfree > 0) {
       cprintf("%d: epoch %lu freed %d\n", mycpu()->id, i, nfree);
@@ -252,19 +260,30 @@ gc_worker(void *x)
   if (VERBOSE)
     cprintf("gc_worker: %d\n", mycpu()->id);
 
-  acquire(&gc_states->lock_);
   for (;;) {
-    gc_states->cv.sleep_to(&gc_states->lock_,
-                          nsectime() + ((u64)GCINTERVAL)*1000000ull);
-
-    // if no processes are running on this core, update min_epoch
-    if (gc_states->proclist.next == &gc_states->proclist) {
-      gc_states->min_epoch = gc_global ? global_epoch.load() :
-        gc_states->cur_epoch.load();
+    bool expedite;
+    {
+      scoped_acquire x(&gc_states->lock_);
+      // Checked under lock_, so gc_delayed's wakeup can't be missed
+      expedite = GC_EXPEDITE_BYTES &&
+        gc_states->delayed_bytes >= GC_EXPEDITE_BYTES;
+      u64 ms = expedite ? GC_EXPEDITE_MS : GCINTERVAL;
+      gc_states->cv.sleep_to(&gc_states->lock_,
+                             nsectime() + ms*1000000ull);
+
+      // if no processes are running on this core, update min_epoch
+      if (gc_states->proclist.next == &gc_states->proclist) {
+        gc_states->min_epoch = gc_global ? global_epoch.load() :
+          gc_states->cur_epoch.load();
+      }
     }
 
     gc_states->do_gc();
 
+    // The epoch only advances once every core has freed its old lists,
+    // so get the other cores' GC threads going too.
+    if (GC_EXPEDITE_BYTES && gc_states->delayed_bytes >= GC_EXPEDITE_BYTES)
+      gc_wakeup();
   }
 }
 
@@ -278,11 +297,15 @@ readstat(mdev*, char *dst, u32 off, u32 n)
     return -1;
 
   if (i >= NCPU) {
-    for (int n = 0; n < NCPU; n++)
+    for (int n = 0; n < NCPU; n++) {
       memset((void *) &stat[n], 0, sz);
+      gc_states[n].ndelay = 0;
+    }
     return 0;
   }
 
+  stat[i].ndelay = gc_states[i].ndelay;
+  stat[i].delayed_bytes = gc_states[i].delayed_bytes;
   memcpy(dst, &stat[i], sz);
 
   return n;
@@ -334,25 +357,37 @@ gc_delayed(rcu_freed *e)
   int c =  mycpu()->id;
   struct gc_state *gs = &gc_states[c];
 
-  scoped_acquire x(&gs->lock_);
-
   u64 epoch = gc_global ? global_epoch : gs->cur_epoch;
 
   if (gc_debug)
     cprintf("(%d, %d): gc_delayed: %lu ndelayed %lu\n", c, myproc()->pid,
-            epoch, stat[c].ndelay);
-
-  if (epoch != gs->delayed[epoch % NEPOCH].epoch) {
-    cprintf("%d: epoch %lu minepoch %lu my freeto %lu my min %lu\n", c, epoch,
-            gs->delayed[epoch % NEPOCH].epoch, gs->nexttofree_epoch.load(),
-            gs->min_epoch.load());
-    if (c >= ngc_cpu) return;
-    panic("gc_delayed");
-  }
-  stat[c].ndelay++;
+            epoch, gs->ndelay.load());
+
   e->_rcu_epoch = epoch;
-  e->_rcu_next = gs->delayed[epoch % NEPOCH].head;
-  gs->delayed[epoch % NEPOCH].head = e;
+  auto &head = gs->delayed[epoch % NEPOCH].head;
+  e->_rcu_next = head.load(std::memory_order_relaxed);
+  while (!head.compare_exchange_weak(e->_rcu_next, e))
+    ;
+  gs->ndelay++;
+
+  u64 size = e->_rcu_size;
+  u64 bytes = gs->delayed_bytes.fetch_add(size) + size;
+  if (GC_EXPEDITE_BYTES && bytes >= GC_EXPEDITE_BYTES &&
+      bytes - size < GC_EXPEDITE_BYTES) {
+    // Just went over; get this core's GC thread going
+    scoped_acquire x(&gs->lock_);
+    gs->cv.wake_all();
+  }
+}
+
+// Bytes queued for freeing on all cores and not freed yet
+u64
+gc_delayed_bytes(void)
+{
+  u64 bytes = 0;
+  for (int c = 0; c < ncpu; c++)
+    bytes += gc_states[c].delayed_bytes;
+  return bytes;
 }
 
 void
@@ -395,8 +430,8 @@ gc_end_epoch(void)
   gc_states[c].dequeue(myproc()->gc);
   myproc()->gc->core = -1;
 
-  if (stat[c].ndelay - stat[c].lastwake >= gc_batchsize) {
-    stat[c].lastwake = stat[c].ndelay;
+  if (gs->ndelay - stat[c].lastwake >= gc_batchsize) {
+    stat[c].lastwake = gs->ndelay;
     // calling gs->do_gc() works for gcbench, because gcbench threads are pinned
     // to a core.  do_gc is correct when it uses one core's gc_state, so better
     // to wakeup this core's gc thread, and yield the core to it.
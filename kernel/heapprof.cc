@@ -1,7 +1,13 @@
+#include "types.h"
+#include "kernel.hh"
 #include "heapprof.hh"
 #include "ilist.hh"
 #include "kstream.hh"
 #include "percpu.hh"
+#include "file.hh"
+#include "major.h"
+#include "sampler.h"
+#include "log2.hh"
 
 #include <algorithm>
 #include <vector>
@@ -11,13 +17,29 @@ struct loc
   islink<loc> link;
   const void *rip;
   ssize_t bytes, count;
+  // Allocations ever made here, and bytes ever allocated
+  u64 nallocs, nalloc_bytes;
+  // Lifetimes of freed allocations, by floor(log2(ns))
+  u64 lifetime[HEAP_PROFILE_LIFETIMES];
 
   islink<loc> prlink;
   ssize_t prbytes, prcount;
+  u64 prnallocs, prnalloc_bytes;
+  u64 prlifetime[HEAP_PROFILE_LIFETIMES];
 
   NEW_DELETE_OPS(loc);
 };
 
+// A sampled allocation call stack.  Every HEAP_PROFILE_SAMPLE bytes
+// allocated in an arena, the allocation that crosses the boundary
+// records its stack here.
+struct sample_site
+{
+  uptr pcs[NTRACE + 1];
+  u32 count;
+  u16 next;
+};
+
 struct heap_profile
 {
   islist<loc, &loc::link> rip_hash[1024];
@@ -28,24 +50,51 @@ struct heap_profile
   size_t prealloc_pos;
   bool recursive, initialzed;
 
-  heap_profile() : prealloc_pos(0), recursive(false), initialzed(true) { }
+  // Bytes left until the next sample
+  ssize_t sample_left;
+  // Sampled stacks, in the order first seen, chained by hash of the
+  // stack from site_hash.  The index 0 is the end of a chain.
+  sample_site sites[HEAP_PROFILE_STACKS];
+  u16 site_hash[256];
+  std::atomic<u32> nsites;
+  u64 dropped;
 
-  bool update(const void *rip, ssize_t bytes)
+  heap_profile() : prealloc_pos(0), recursive(false), initialzed(true),
+                   sample_left(HEAP_PROFILE_SAMPLE), nsites(1),
+                   dropped(0) { }
+
+  bool update(const void *rip, ssize_t bytes, u64 lifetime, void *frame)
   {
     if (!initialzed)
       return false;
 
-    size_t slot = (uintptr_t)rip % NELEM(rip_hash);
-    for (auto &l : rip_hash[slot]) {
-      if (l.rip == rip) {
-        l.bytes += bytes;
-        if (bytes > 0)
-          l.count++;
-        else if (bytes < 0)
-          l.count--;
-        return true;
+    struct loc *loc = lookup(rip);
+    if (!loc)
+      return false;
+    loc->bytes += bytes;
+    if (bytes > 0) {
+      loc->count++;
+      loc->nallocs++;
+      loc->nalloc_bytes += bytes;
+      sample_left -= bytes;
+      if (sample_left <= 0) {
+        sample_left = HEAP_PROFILE_SAMPLE;
+        sample(frame);
       }
+    } else if (bytes < 0) {
+      loc->count--;
+      loc->lifetime[std::min((size_t)floor_log2(lifetime | 1),
+                             (size_t)HEAP_PROFILE_LIFETIMES - 1)]++;
     }
+    return true;
+  }
+
+  struct loc *lookup(const void *rip)
+  {
+    size_t slot = (uintptr_t)rip % NELEM(rip_hash);
+    for (auto &l : rip_hash[slot])
+      if (l.rip == rip)
+        return &l;
 
     struct loc *loc;
     if (recursive) {
@@ -56,36 +105,70 @@ struct heap_profile
       loc = new struct loc;
       recursive = false;
     }
+    memset(loc, 0, sizeof(*loc));
     loc->rip = rip;
-    loc->bytes = bytes;
-    if (bytes > 0)
-      loc->count = 1;
-    else if (bytes < 0)
-      loc->count = -1;
     rip_hash[slot].push_front(loc);
-    return true;
+    return loc;
+  }
+
+  // Record the call stack of the current allocation, starting from
+  // heap_profile_update()'s frame.  The first return address is into
+  // the allocator, so pcs[0] is the allocation site.
+  void sample(void *frame)
+  {
+    uptr stack[NTRACE + 2];
+    getcallerpcs(frame, stack, NELEM(stack));
+    uptr *pcs = stack + 1;
+
+    u64 h = 0;
+    for (int i = 0; i < NTRACE + 1; i++)
+      h = h * 31 + pcs[i];
+    u16 *slot = &site_hash[h % NELEM(site_hash)];
+    for (u16 i = *slot; i; i = sites[i].next) {
+      if (!memcmp(sites[i].pcs, pcs, sizeof(sites[i].pcs))) {
+        sites[i].count++;
+        return;
+      }
+    }
+
+    u32 n = nsites.load(std::memory_order_relaxed);
+    if (n == NELEM(sites)) {
+      dropped++;
+      return;
+    }
+    auto s = &sites[n];
+    memmove(s->pcs, pcs, sizeof(s->pcs));
+    s->count = 1;
+    s->next = *slot;
+    *slot = n;
+    // Publish the site for heapsamplesread
+    nsites.store(n + 1, std::memory_order_release);
   }
 };
 
 struct heap_profile_array
 {
 #if KERNEL_HEAP_PROFILE
-  heap_profile arena[3];
+  heap_profile arena[HEAP_PROFILE_NARENAS];
 #else
   heap_profile arena[0];
 #endif
 };
 DEFINE_PERCPU(heap_profile_array, heap_profiles);
 
+// nsectime() when profiling started, for allocation rates.
+static u64 heap_profile_start;
+
 // (If !KERNEL_HEAP_PROFILE, this is an empty inline function in the
 // header.)
 #if KERNEL_HEAP_PROFILE
 bool
 heap_profile_update(heap_profile_arena arena, const void *rip,
-                    ssize_t bytes)
+                    ssize_t bytes, u64 lifetime)
 {
   scoped_critical c(NO_SCHED);
-  return heap_profiles->arena[arena].update(rip, bytes);
+  return heap_profiles->arena[arena].update(rip, bytes, lifetime,
+                                           __builtin_frame_address(0));
 }
 #endif
 
@@ -105,12 +188,19 @@ heap_profile_print1(print_stream *s, int limit, heap_profile_arena arena)
           if (loc.rip == prloc.rip) {
             prloc.prbytes += loc.bytes;
             prloc.prcount += loc.count;
+            prloc.prnallocs += loc.nallocs;
+            prloc.prnalloc_bytes += loc.nalloc_bytes;
+            for (size_t b = 0; b < HEAP_PROFILE_LIFETIMES; ++b)
+              prloc.prlifetime[b] += loc.lifetime[b];
             goto found;
           }
         }
         // No existing print entry.  Use this loc.
         loc.prbytes = loc.bytes;
         loc.prcount = loc.count;
+        loc.prnallocs = loc.nallocs;
+        loc.prnalloc_bytes = loc.nalloc_bytes;
+        memmove(loc.prlifetime, loc.lifetime, sizeof(loc.prlifetime));
         chain.push_front(&loc);
       found:;
       }
@@ -138,11 +228,19 @@ heap_profile_print1(print_stream *s, int limit, heap_profile_arena arena)
   }
 
   // Print
+  u64 secs = std::max((nsectime() - heap_profile_start) / 1000000000ull, 1ull);
   for (auto &loc : sorted) {
     if (limit-- == 0)
       break;
     s->println(loc.rip, " ", loc.prbytes, " bytes in ", loc.prcount,
-               " allocations");
+               " allocations, ", loc.prnallocs / secs, " allocs/s ",
+               loc.prnalloc_bytes / secs, " bytes/s");
+    // Lifetime histogram, by powers of two nanoseconds
+    s->print("  lifetimes:");
+    for (size_t b = 0; b < HEAP_PROFILE_LIFETIMES; ++b)
+      if (loc.prlifetime[b])
+        s->print(" 2^", b, "ns:", loc.prlifetime[b]);
+    s->println();
   }
 
   // Total
@@ -168,7 +266,95 @@ heap_profile_print(print_stream *s)
     heap_profile_print1(s, 10, HEAP_PROFILE_KMALLOC);
     s->println("Top 10 new[] allocations:");
     heap_profile_print1(s, 10, HEAP_PROFILE_NEWARRAY);
+
+    u64 dropped = 0;
+    for (int i = 0; i < ncpu; ++i)
+      for (auto &p : heap_profiles[i].arena)
+        dropped += p.dropped;
+    s->println("Stack samples: 1 per ", HEAP_PROFILE_SAMPLE,
+               " bytes allocated, ", dropped, " dropped");
   } else {
     s->println("KERNEL_HEAP_PROFILE is not set");
   }
 }
+
+static int
+heapprofread(mdev*, char *dst, u32 off, u32 n)
+{
+  window_stream s(dst, off, n);
+  heap_profile_print(&s);
+  return s.get_used();
+}
+
+// The sampled stacks, in the sampler's log format (see sampler.h), so
+// tools/perf-report can read them.  Each "CPU" of the log is one arena
+// of one CPU, in the order of heap_profile_arena.  Each event's rip is
+// the allocation site, trace its callers, count the number of samples,
+// and data_source the arena.
+static int
+heapsamplesread(mdev*, char *dst, u32 off, u32 n)
+{
+#if !KERNEL_HEAP_PROFILE
+  return 0;
+#else
+  const int nlogs = ncpu * HEAP_PROFILE_NARENAS;
+  size_t hdrsize = sizeof(logheader) + sizeof(logheader::cpu[0]) * nlogs;
+  u32 ret = 0;
+
+  // Copy [pos, pos+size) of the virtual log from buf, if it overlaps
+  // the requested window.
+  size_t pos = 0;
+  auto emit = [&](const void *buf, size_t size) {
+    if (off < pos + size && off + n > pos) {
+      size_t start = off > pos ? off - pos : 0;
+      size_t cc = std::min(size - start, (size_t)(off + n) - (pos + start));
+      memmove(dst + (pos + start - off), (const char*)buf + start, cc);
+      ret += cc;
+    }
+    pos += size;
+  };
+
+  // Snapshot the number of sites, so the header and the body agree.
+  u32 counts[NCPU * HEAP_PROFILE_NARENAS];
+  for (int i = 0; i < nlogs; ++i)
+    counts[i] = heap_profiles[i / HEAP_PROFILE_NARENAS]
+      .arena[i % HEAP_PROFILE_NARENAS].nsites.load(
+        std::memory_order_acquire) - 1;
+
+  u64 ncpus = nlogs;
+  emit(&ncpus, sizeof(ncpus));
+  u64 offset = hdrsize;
+  for (int i = 0; i < nlogs; ++i) {
+    u64 ent[2] = {offset, counts[i] * sizeof(pmuevent)};
+    emit(ent, sizeof(ent));
+    offset += ent[1];
+  }
+
+  for (int i = 0; i < nlogs && pos < off + n; ++i) {
+    int arena = i % HEAP_PROFILE_NARENAS;
+    auto p = &heap_profiles[i / HEAP_PROFILE_NARENAS].arena[arena];
+    for (u32 j = 1; j <= counts[i]; ++j) {
+      if (pos + sizeof(pmuevent) <= off) {
+        pos += sizeof(pmuevent);
+        continue;
+      }
+      pmuevent ev{};
+      ev.kernel = 1;
+      ev.count = p->sites[j].count;
+      ev.rip = p->sites[j].pcs[0];
+      memmove(ev.trace, &p->sites[j].pcs[1], sizeof(ev.trace));
+      ev.data_source = arena;
+      emit(&ev, sizeof(ev));
+    }
+  }
+  return ret;
+#endif
+}
+
+void
+initheapprof(void)
+{
+  heap_profile_start = nsectime();
+  devsw[MAJ_HEAPPROF].pread = heapprofread;
+  devsw[MAJ_HEAPSAMPLES].pread = heapsamplesread;
+}
@@ -58,7 +58,7 @@ private:
     if (level != 0) {
       for (int i = 0; i < end; i++) {
         pme_t entry = e[i].load(memory_order_relaxed);
-        if (entry & PTE_P)
+        if ((entry & PTE_P) && !(entry & PTE_PS))
           ((pgmap*) p2v(PTE_ADDR(entry)))->free(level - 1);
       }
     }
@@ -74,7 +74,7 @@ private:
     if (level != 0) {
       for (int i = 0; i < end; i++) {
         pme_t entry = e[i].load(memory_order_relaxed);
-        if (entry & PTE_P)
+        if ((entry & PTE_P) && !(entry & PTE_PS))
           count += ((pgmap*) p2v(PTE_ADDR(entry)))->internal_pages(level - 1);
       }
     }
@@ -127,6 +127,15 @@ public:
     return internal_pages(L_PML4, PX(L_PML4, KGLOBAL));
   }
 
+  // Return true if no entry of this pgmap is present.
+  bool empty() const
+  {
+    for (auto &entry : e)
+      if (entry.load(memory_order_relaxed) & PTE_P)
+        return false;
+    return true;
+  }
+
   // An iterator that references the page structure entry on a fixed
   // level of the page structure tree for some virtual address.
   // Moving the iterator changes the virtual address, but not the
@@ -160,7 +169,9 @@ public:
     // Walk the page table structure to find @c va at @c level and set
     // @c cur.  If @c create is zero and the path to @c va does not
     // exist, sets @c cur to nullptr.  Otherwise, the path will be
-    // created with the flags @c create.
+    // created with the flags @c create.  A large page mapping @c va
+    // above @c level also sets @c cur to nullptr, even if @c create
+    // is set; the caller has to remove it to map @c va at @c level.
     void resolve(pme_t create = 0)
     {
       cur = pml4;
@@ -168,7 +179,10 @@ public:
         atomic<pme_t> *entryp = &cur->e[PX(reached, va)];
         pme_t entry = entryp->load(memory_order_relaxed);
       retry:
-        if (entry & PTE_P) {
+        if ((entry & PTE_P) && (entry & PTE_PS)) {
+          cur = nullptr;
+          break;
+        } else if (entry & PTE_P) {
           cur = (pgmap*) p2v(PTE_ADDR(entry));
         } else if (!create) {
           cur = nullptr;
@@ -625,10 +639,45 @@ namespace mmu_per_core_page_table {
     scoped_cli cli;
     auto mypml4 = *pml4;
     assert(mypml4);
-    mypml4->find(va).create(PTE_U)->store(pte, memory_order_relaxed);
+    auto it = mypml4->find(va).create(PTE_U);
+    if (!it.exists()) {
+      // va is covered by a read-only large page, which this fault is
+      // upgrading (say, after an mprotect).  Drop the large page from
+      // this core; the rest of it will fault back in a page at a time.
+      mypml4->find(va, pgmap::L_2M)->store(0, memory_order_relaxed);
+      invlpg((void*)va);
+      it = mypml4->find(va).create(PTE_U);
+    }
+    it->store(pte, memory_order_relaxed);
     t->tracker_cores.set(myid());
   }
 
+  bool
+  page_map_cache::insert_huge(uintptr_t va, pme_t pte)
+  {
+    assert(va % HUGE_PGSIZE == 0);
+    scoped_cli cli;
+    auto mypml4 = *pml4;
+    assert(mypml4);
+    auto it = mypml4->find(va, pgmap::L_2M).create(PTE_U);
+    pme_t entry = it->load(memory_order_relaxed);
+    pgmap *pt = nullptr;
+    if ((entry & PTE_P) && !(entry & PTE_PS)) {
+      // There's already a page table here.  If it has been emptied
+      // by invalidations, the large page can take its place.
+      pt = (pgmap*) p2v(PTE_ADDR(entry));
+      if (!pt->empty())
+        return false;
+    }
+    huge_mapped_.store(true, memory_order_relaxed);
+    it->store(pte | PTE_PS, memory_order_relaxed);
+    // Flush any cached walk through the old entry.
+    invlpg((void*)va);
+    if (pt)
+      kfree(pt);
+    return true;
+  }
+
   void
   page_map_cache::switch_to() const
   {
@@ -667,6 +716,19 @@ namespace mmu_per_core_page_table {
     // inserted something into it previously.  (Note that this may
     // not hold if we start tracking shootdowns conservatively.)
     assert(mypml4);
+    // Large pages overlapping the range go entirely; the 4K walk
+    // below steps over them.
+    if (huge_mapped_.load(memory_order_relaxed)) {
+      for (auto it = mypml4->find(start & ~(uintptr_t)(HUGE_PGSIZE - 1),
+                                  pgmap::L_2M);
+           it.index() < end; it += it.span()) {
+        if (it.is_set() && (it->load(memory_order_relaxed) & PTE_PS)) {
+          it->store(0, memory_order_relaxed);
+          if (current)
+            invlpg((void*)it.index());
+        }
+      }
+    }
     for (auto it = mypml4->find(start); it.index() < end; it += it.span()) {
       if (it.is_set()) {
         it->store(0, memory_order_relaxed);
@@ -18,7 +18,7 @@
 #define IDE_CMD_WRITE 0x30
 
 #define IDEBSIZE 512
-#if !MEMIDE && !AHCIIDE
+#if !MEMIDE && !AHCIIDE && !NVMEIDE
 
 static struct spinlock idelock;
 static int havedisk1;
@@ -77,11 +77,11 @@ idleloop(void)
     myproc()->set_state(RUNNABLE);
     sched();
     finishzombies();
-    if (steal() == 0) {
+    if (steal() == 0 && !zrefill_idle()) {
         // XXX(Austin) This will prevent us from immediately picking
         // up work that's trying to push itself to this core (pinned
         // thread).  Use an IPI to poke idle cores.
-        asm volatile("hlt");
+        idle_halt();
     }
   }
 }
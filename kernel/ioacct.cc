@@ -0,0 +1,238 @@
+// Per-process and per-file I/O accounting; see ioacct.hh.
+
+#include "types.h"
+#include "kernel.hh"
+#include "percpu.hh"
+#include "critical.hh"
+#include "proc.hh"
+#include "fs.h"
+#include "file.hh"
+#include "major.h"
+#include "kstream.hh"
+#include "ioacct.hh"
+#include <algorithm>
+#include <vector>
+
+// Files reported by /dev/ioacct
+#define IOACCT_TOP_FILES 32
+
+enum ioacct_kind : u8 {
+  IOACCT_PROC = 1,
+  IOACCT_FILE,
+};
+
+struct ioacct_entry
+{
+  u8 kind;
+  // The process's name when it was first charged
+  char name[16];
+  // pid or mnode number
+  u64 id;
+  u64 c[IOACCT_NCOUNTERS];
+};
+
+struct ioacct_table
+{
+  struct ioacct_entry *entries;
+  // Charges that found no free entry within IOACCT_PROBE slots
+  u64 dropped;
+};
+
+enum { IOACCT_PROBE = 16 };
+
+std::atomic<bool> ioacct_files_enabled;
+DEFINE_PERCPU(struct ioacct_table, ioacct_tables, NO_INT);
+
+static void
+charge_entry(ioacct_table &t, u8 kind, u64 id, const char *name, u8 c, u64 n)
+{
+  u64 h = (id * 0x9e3779b97f4a7c15ull) ^ kind;
+  h ^= h >> 29;
+  for (int i = 0; i < IOACCT_PROBE; i++) {
+    ioacct_entry *e = &t.entries[(h + i) % IOACCT_SLOTS];
+    if (!e->kind) {
+      e->kind = kind;
+      e->id = id;
+      if (name)
+        strncpy(e->name, name, sizeof(e->name) - 1);
+    } else if (e->kind != kind || e->id != id) {
+      continue;
+    }
+    e->c[c] += n;
+    return;
+  }
+  t.dropped++;
+}
+
+void
+ioacct_charge(u8 c, u64 n, u64 mnum)
+{
+  if (!n)
+    return;
+  scoped_cli cli;
+  ioacct_table &t = *ioacct_tables;
+  if (!t.entries)
+    return;
+
+  proc *p = myproc();
+  if (p)
+    charge_entry(t, IOACCT_PROC, p->pid, p->name, c, n);
+  if (mnum && ioacct_files_enabled.load(std::memory_order_relaxed))
+    charge_entry(t, IOACCT_FILE, mnum, nullptr, c, n);
+}
+
+static bool
+entry_order(const ioacct_entry &a, const ioacct_entry &b)
+{
+  if (a.kind != b.kind)
+    return a.kind < b.kind;
+  return a.id < b.id;
+}
+
+// Sum the entries of different cores for the same process or file.
+static void
+merge_entries(std::vector<ioacct_entry> *v)
+{
+  std::sort(v->begin(), v->end(), entry_order);
+  size_t out = 0;
+  for (size_t i = 0; i < v->size(); i++) {
+    ioacct_entry &e = (*v)[i];
+    if (out && (*v)[out - 1].kind == e.kind && (*v)[out - 1].id == e.id) {
+      ioacct_entry &m = (*v)[out - 1];
+      for (int c = 0; c < IOACCT_NCOUNTERS; c++)
+        m.c[c] += e.c[c];
+      if (!m.name[0])
+        memmove(m.name, e.name, sizeof(m.name));
+    } else {
+      (*v)[out++] = e;
+    }
+  }
+  v->erase(v->begin() + out, v->end());
+}
+
+static u64
+disk_bytes(const ioacct_entry &e)
+{
+  return e.c[IOACCT_DISK_RBYTES] + e.c[IOACCT_DISK_WBYTES];
+}
+
+static u64
+cache_bytes(const ioacct_entry &e)
+{
+  return e.c[IOACCT_RBYTES] + e.c[IOACCT_WBYTES];
+}
+
+static void
+print_ioacct(print_stream *s)
+{
+  std::vector<ioacct_entry> all;
+  u64 dropped = 0;
+  for (int c = 0; c < ncpu; c++) {
+    ioacct_table &t = ioacct_tables[c];
+    if (!t.entries)
+      continue;
+    for (int i = 0; i < IOACCT_SLOTS; i++)
+      if (t.entries[i].kind)
+        all.push_back(t.entries[i]);
+    dropped += t.dropped;
+    merge_entries(&all);
+  }
+
+  // The heaviest disk users first, then the heaviest page cache users
+  auto by_load = [](const ioacct_entry &a, const ioacct_entry &b) {
+    if (disk_bytes(a) != disk_bytes(b))
+      return disk_bytes(a) > disk_bytes(b);
+    return cache_bytes(a) > cache_bytes(b);
+  };
+  std::sort(all.begin(), all.end(), by_load);
+
+  s->println("ioacct: per-file accounting ",
+             ioacct_files_enabled ? "on" : "off", ", ", dropped,
+             " charges dropped");
+  s->println("processes:   pid   read KB  write KB pagefills    fsyncs"
+             "   journal disk rd KB disk wr KB  name");
+  for (auto &e : all) {
+    if (e.kind != IOACCT_PROC)
+      continue;
+    s->println("  ", sfmt(e.id).width(14),
+               sfmt(e.c[IOACCT_RBYTES] / 1024).width(10),
+               sfmt(e.c[IOACCT_WBYTES] / 1024).width(10),
+               sfmt(e.c[IOACCT_PAGEFILLS]).width(10),
+               sfmt(e.c[IOACCT_FSYNCS]).width(10),
+               sfmt(e.c[IOACCT_JOURNAL]).width(10),
+               sfmt(e.c[IOACCT_DISK_RBYTES] / 1024).width(11),
+               sfmt(e.c[IOACCT_DISK_WBYTES] / 1024).width(11),
+               "  ", e.name);
+  }
+
+  bool any_files = std::any_of(all.begin(), all.end(),
+                               [](const ioacct_entry &e) {
+                                 return e.kind == IOACCT_FILE;
+                               });
+  if (!any_files)
+    return;
+  s->println("top files:                 mnum   read KB  write KB"
+             " pagefills    fsyncs");
+  int shown = 0;
+  for (auto &e : all) {
+    if (e.kind != IOACCT_FILE)
+      continue;
+    if (shown++ == IOACCT_TOP_FILES)
+      break;
+    s->println("  ", sfmt(e.id).width(29),
+               sfmt(e.c[IOACCT_RBYTES] / 1024).width(10),
+               sfmt(e.c[IOACCT_WBYTES] / 1024).width(10),
+               sfmt(e.c[IOACCT_PAGEFILLS]).width(10),
+               sfmt(e.c[IOACCT_FSYNCS]).width(10));
+  }
+}
+
+static int
+ioacctread(mdev*, char *dst, u32 off, u32 n)
+{
+  window_stream s(dst, off, n);
+  print_ioacct(&s);
+  return s.get_used();
+}
+
+// "1" turns per-file accounting on, "0" off, and "c" clears the counts.
+static int
+ioacctwrite(mdev*, const char *buf, u32 n)
+{
+  if (n < 1)
+    return -1;
+  switch (buf[0]) {
+  case '1':
+    ioacct_files_enabled = true;
+    break;
+  case '0':
+    ioacct_files_enabled = false;
+    break;
+  case 'c':
+    for (int c = 0; c < ncpu; c++) {
+      ioacct_table &t = ioacct_tables[c];
+      if (t.entries)
+        memset(t.entries, 0, IOACCT_SLOTS * sizeof(ioacct_entry));
+      t.dropped = 0;
+    }
+    break;
+  default:
+    return -1;
+  }
+  return n;
+}
+
+void
+initioacct(void)
+{
+  for (int c = 0; c < ncpu; c++) {
+    auto e = (ioacct_entry*)
+      kalloc("ioacct", IOACCT_SLOTS * sizeof(ioacct_entry), c);
+    if (!e)
+      panic("initioacct: out of memory");
+    memset(e, 0, IOACCT_SLOTS * sizeof(ioacct_entry));
+    ioacct_tables[c].entries = e;
+  }
+  devsw[MAJ_IOACCT].pread = ioacctread;
+  devsw[MAJ_IOACCT].write = ioacctwrite;
+}
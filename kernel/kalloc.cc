@@ -18,10 +18,11 @@
 #include "kstats.hh"
 #include "vector.hh"
 #include "numa.hh"
-#include "lb.hh"
 #include "file.hh"
 #include "major.h"
 #include "heapprof.hh"
+#include "objcache.hh"
+#include "shrinker.hh"
 
 #include <algorithm>
 #include <iterator>
@@ -56,42 +57,61 @@ struct locked_buddy
 
 static static_vector<locked_buddy, MAX_BUDDIES> buddies;
 
-struct mempool : public balance_pool<mempool> {
+struct mempool {
   int buddy_;      // the buddy allocator this pool; it can contain any phys mem
   uintptr_t base_; // base this pool's local memory
   uintptr_t lim_;  // first address beyond this pool's local memory
+  int node_;       // NUMA node of this pool's local memory
+  size_t nfree_;   // free bytes this pool started with
 
-  mempool(int buddy, int nfree, uintptr_t base,  uintptr_t sz) :
-    balance_pool(nfree), buddy_(buddy), base_(base), lim_ (base+sz) {};
+  // Balancing statistics, for kmemprint
+  std::atomic<u64> balance_events_, bytes_in_, bytes_out_;
+  // nsectime() of the last proactive balance into this pool
+  std::atomic<u64> last_balance_;
+
+  mempool(int buddy, size_t nfree, uintptr_t base, uintptr_t sz, int node) :
+    buddy_(buddy), base_(base), lim_ (base+sz), node_(node), nfree_(nfree),
+    balance_events_(0), bytes_in_(0), bytes_out_(0), last_balance_(0) {};
   ~mempool() {};
   NEW_DELETE_OPS(mempool);
 
-  u64 balance_count() const {
-    auto l = buddies[buddy_].lock.guard();
+  // The free bytes of this pool.  This is read without the lock, so
+  // it may be a little stale.
+  size_t free_bytes() const {
     return buddies[buddy_].alloc.get_free_bytes();
-  };
+  }
 
-  void balance_move_to(mempool *target) {
-    u64 avail = balance_count();
-    // steal no more than max:
-    size_t size = (buddy_allocator::MAX_SIZE > avail/2) ?
-      avail / 2 : buddy_allocator::MAX_SIZE;
+  // Move up to bytes of free memory to target, in the largest blocks
+  // the buddy allocator will give us.  Returns the number of bytes
+  // moved.
+  size_t balance_move_to(mempool *target, size_t bytes) {
     auto lb = &buddies[buddy_];
-    auto l = lb->lock.guard();
-    // XXX we should steal memory that is close to us. lb helps with this
-    // because it is aware of interconnect topology, but does this always line
-    // up with NUMA nodes?
-    // XXX update stats
-    void *res = lb->alloc.alloc_nothrow(size);
+    size_t moved = 0;
+    size_t chunk = buddy_allocator::MAX_SIZE;
+    while (chunk >= PGSIZE && moved + PGSIZE <= bytes) {
+      while (chunk > bytes - moved)
+        chunk /= 2;
+      void *res;
+      {
+        auto l = lb->lock.guard();
+        res = lb->alloc.alloc_nothrow(chunk);
+      }
+      if (!res) {
+        chunk /= 2;
+        continue;
+      }
 #if PRINT_STEAL
-    cprintf("balance_move_to: stole %ld at %p from buddy %d\n", size, res, buddy_);
+      cprintf("balance_move_to: moved %ld at %p from buddy %d to %d\n",
+              chunk, res, buddy_, target->buddy_);
 #endif
-    if (res) {
-      // XXX not exactly hot list stealing but it is stealing
       kstats::inc(&kstats::kalloc_hot_list_steal_count);
-      target->kfree(res, size);
+      target->kfree(res, chunk);
+      moved += chunk;
     }
-  };
+    bytes_out_ += moved;
+    target->bytes_in_ += moved;
+    return moved;
+  }
 
   void *get_base() const {
     return (void*)base_;
@@ -109,12 +129,33 @@ struct mempool : public balance_pool<mempool> {
     return (char *) res;
   }
 
+  // Allocate up to n blocks of size bytes into out, taking the lock once.
+  // Returns the number allocated.
+  size_t kalloc_batch(size_t size, void **out, size_t n)
+  {
+    auto lb = &buddies[buddy_];
+    auto l = lb->lock.guard();
+    size_t i;
+    for (i = 0; i < n; i++)
+      if (!(out[i] = lb->alloc.alloc_nothrow(size)))
+        break;
+    return i;
+  }
+
   void kfree(void *v, size_t size)
   {
     auto lb = &buddies[buddy_];
     auto l = lb->lock.guard();
     lb->alloc.free(v, size);
   }
+
+  void kfree_batch(void **v, size_t n, size_t size)
+  {
+    auto lb = &buddies[buddy_];
+    auto l = lb->lock.guard();
+    for (size_t i = 0; i < n; i++)
+      lb->alloc.free(v[i], size);
+  }
 };
 
 static static_vector<mempool, MAX_BUDDIES> mempools;
@@ -282,8 +323,38 @@ struct cpu_mem
   // Hot page cache of recently freed pages
   void *hot_pages[KALLOC_HOT_PAGES];
   size_t nhot;
+
+  // Hot caches of recently freed multi-page blocks, indexed by
+  // hot_order_slot()
+  struct {
+    void *blocks[KALLOC_HOT_BLOCKS];
+    size_t n;
+  } hot_orders[5];
 };
 
+// Return the index in cpu_mem::hot_orders caching blocks of size
+// bytes, or -1 if blocks of that size aren't cached.
+static int
+hot_order_slot(size_t size)
+{
+  switch (size) {
+  case PGSIZE << 1: return 0;
+  case PGSIZE << 2: return 1;
+  case PGSIZE << 3: return 2;
+  case PGSIZE << 4: return 3;
+  case HUGE_PGSIZE: return 4;
+  }
+  return -1;
+}
+
+// The number of blocks each cpu_mem::hot_orders slot may hold.  2MB
+// blocks are cached more sparingly.
+static size_t
+hot_order_max(int slot)
+{
+  return slot == 4 ? KALLOC_HOT_HUGE_BLOCKS : KALLOC_HOT_BLOCKS;
+}
+
 // Prefer mycpu()->mem for local access to this.  This is NOINIT since
 // we set up the cpu_mems during CPU 0 boot.
 DEFINE_PERCPU_NOINIT(struct cpu_mem, cpu_mem);
@@ -295,23 +366,57 @@ void *percpu_offsets[NCPU];
 static int kinited __mpalign__;
 
 struct memory {
-  balancer<memory, mempool> b_;
-
-  memory() : b_(this) {};
+  memory() {};
   ~memory() {};
 
   NEW_DELETE_OPS(memory);
 
-  mempool* balance_get(int id) const {
-    auto mempool = cpu_mem[id].mempool;
-    return &(mempools[mempool]);
-  }
-
-  void add(int buddy, void *base, size_t size) {
+  void add(int buddy, void *base, size_t size, int node) {
     auto l = buddies[buddy].lock.guard();
     auto free = buddies[buddy].alloc.get_free_bytes();
-    auto m = mempool(buddy, free, (uintptr_t) base, size);
-    mempools.emplace_back(m);
+    mempools.emplace_back(buddy, free, (uintptr_t) base, size, node);
+  }
+
+  // Move free memory into cpu's pool from pools with at least twice
+  // as much free memory, preferring pools on the same NUMA node and
+  // only going to other nodes if that found nothing.  Each donor gives
+  // half the difference, up to KALLOC_BALANCE_MAX_BYTES in all.
+  // Unless forced, this happens at most once every
+  // KALLOC_BALANCE_INTERVAL_US per pool.
+  void balance(int cpu, bool force) {
+    mempool *target = &mempools[cpu_mem[cpu].mempool];
+    if (!force) {
+      u64 now = nsectime(), last = target->last_balance_;
+      if (now < last + KALLOC_BALANCE_INTERVAL_US * 1000ull ||
+          !target->last_balance_.compare_exchange_strong(last, now))
+        return;
+    }
+
+    size_t moved = 0;
+    for (int remote = 0; remote < 2 && !moved; remote++) {
+      for (auto &donor : mempools) {
+        if (&donor == target || (donor.node_ != target->node_) != remote)
+          continue;
+        size_t have = target->free_bytes(), dfree = donor.free_bytes();
+        if (dfree < 2 * have + PGSIZE)
+          continue;
+        size_t want = std::min((dfree - have) / 2,
+                               (size_t)KALLOC_BALANCE_MAX_BYTES - moved);
+        moved += donor.balance_move_to(target, want);
+        if (moved + PGSIZE > KALLOC_BALANCE_MAX_BYTES)
+          break;
+      }
+    }
+    if (moved)
+      target->balance_events_++;
+  }
+
+  // Balance proactively once the pool of cpu drops under
+  // KALLOC_BALANCE_LOW_PCT percent of the memory it started with.
+  void maybe_balance(int cpu) {
+    mempool *pool = &mempools[cpu_mem[cpu].mempool];
+    if (pool->free_bytes() * 100 < pool->nfree_ * KALLOC_BALANCE_LOW_PCT)
+      balance(cpu, false);
   }
 
   char* kalloc(const char *name, size_t size, int cpu)
@@ -321,18 +426,26 @@ struct memory {
     void *res = nullptr;
     auto mem = cpu >= 0 ? cpus[cpu].mem : mycpu()->mem;
     if (size == PGSIZE) {
-      // allocate from page cache, if possible
+      // allocate from page cache, if possible, refilling half of it at a
+      // time from the pool when it runs dry
+      scoped_cli cli;
+      mem = cpu >= 0 ? cpus[cpu].mem : mycpu()->mem;
+      if (mem->nhot == 0)
+        mem->nhot = mempools[mem->mempool].kalloc_batch(
+          PGSIZE, mem->hot_pages, KALLOC_HOT_PAGES / 2);
       if (mem->nhot > 0) {
         res = mem->hot_pages[--mem->nhot];
       }
     }
+    int id = cpu >= 0 ? cpu : myid();
     if (!res) {
       res = mempools[mem->mempool].kalloc(size);
       if (!res) {
-        b_.balance();
+        balance(id, true);
         res = mempools[mem->mempool].kalloc(size);
       }
     }
+    maybe_balance(id);
     if (res) {
       if (ALLOC_MEMSET) {
         char* chk = (char*)res;
@@ -362,10 +475,9 @@ struct memory {
   // XXX Is the right policy?  Maybe leave in it this node's pool?  Or, only
   // return when we have a big chucnk of memory to return? (e.g., a MAX_SIZE
   // buddy area).
-  void kfree_pool(void *v, size_t size)
+  // The pool that manages the memory that contains v.
+  size_t pool_of(void *v)
   {
-    // Find the allocator to return v to.
-    // XXX update stats
     auto pool = mycpu()->mem->mempool;
     if (!(mempools[pool].get_base() <= v && v < mempools[pool].get_limit())) {
       // memory from a remote pool; which one?
@@ -380,7 +492,29 @@ struct memory {
       cprintf("return memory %p to pool %d\n", v, pool);
 #endif
     }
-    mempools[pool].kfree(v, size);
+    return pool;
+  }
+
+  void kfree_pool(void *v, size_t size)
+  {
+    // XXX update stats
+    mempools[pool_of(v)].kfree(v, size);
+  }
+
+  // Return the n blocks at v (sorted by address) to their pools, taking each
+  // pool's lock once per run of blocks that belong to it.
+  void kfree_pool_batch(void **v, size_t n, size_t size)
+  {
+    size_t start = 0;
+    while (start < n) {
+      size_t pool = pool_of(v[start]);
+      size_t end = start + 1;
+      while (end < n && mempools[pool].get_base() <= v[end] &&
+             v[end] < mempools[pool].get_limit())
+        end++;
+      mempools[pool].kfree_batch(v + start, end - start, size);
+      start = end;
+    }
   }
 
   void kfree(void *v, size_t size)
@@ -402,11 +536,7 @@ struct memory {
         // allocator list.
         kstats::inc(&kstats::kalloc_hot_list_flush_count);
         std::sort(mem->hot_pages, mem->hot_pages + (KALLOC_HOT_PAGES / 2));
-        // XXX make kfree_batch_pool to batch moving hot pages
-        for (size_t i = 0; i < KALLOC_HOT_PAGES / 2; ++i) {
-          void *ptr = mem->hot_pages[i];
-          kfree_pool(ptr, size);
-        }
+        kfree_pool_batch(mem->hot_pages, KALLOC_HOT_PAGES / 2, size);
         // Shift hot page list down
         // XXX(Austin) Could use two lists and switch off
         mem->nhot = KALLOC_HOT_PAGES - (KALLOC_HOT_PAGES / 2);
@@ -636,6 +766,15 @@ early_kalloc(size_t size, size_t align)
   return (char*)p2v(pa);
 }
 
+// The amount of physical memory that the boot allocator has left, for sizing
+// the hash tables that global constructors allocate from it.
+size_t
+early_phys_bytes(void)
+{
+  assert(!kinited);
+  return mem.bytes();
+}
+
 void
 kmemprint(print_stream *s)
 {
@@ -677,6 +816,39 @@ kmemprint(print_stream *s)
            total_lowest_free / buddy_allocator::MIN_SIZE);
 
   s->println();
+
+#if KALLOC_LOAD_BALANCE
+  for (size_t i = 0; i < mempools.size(); ++i) {
+    auto &pool = mempools[i];
+    s->println("pool ", i, " node ", pool.node_, ": free (pages) ",
+               pool.free_bytes() / buddy_allocator::MIN_SIZE,
+               " balances ", pool.balance_events_.load(),
+               " in (pages) ", pool.bytes_in_ / buddy_allocator::MIN_SIZE,
+               " out (pages) ", pool.bytes_out_ / buddy_allocator::MIN_SIZE);
+  }
+#endif
+
+  objcache_base::print_all(s);
+  shrinker_print(s);
+}
+
+// Return how much of the memory of the buddy allocators local to CPU cpu is
+// still free, as a percentage.  Below a low watermark, that CPU's allocations
+// are about to start stealing from remote buddies (or failing), which the
+// page-cache reclaimer watches for.
+int
+kfree_percent(int cpu)
+{
+  auto &local = cpu_mem[cpu].steal.get_local();
+  size_t free = 0, limit = 0;
+  for (auto buddy = local.low; buddy < local.high; ++buddy) {
+    auto l = buddies[buddy].lock.guard();
+    free += buddies[buddy].alloc.get_free_bytes();
+    limit += buddies[buddy].free_limit;
+  }
+  if (!limit)
+    return 100;
+  return free * 100 / limit;
 }
 
 static int
@@ -691,9 +863,99 @@ kmemstatsread(mdev*, char *dst, u32 off, u32 n)
 char*
 kalloc(const char *name, size_t size, int cpu)
 {
-  return allmem.kalloc(name, size);
+  return allmem.kalloc(name, size, cpu);
 }
 #else
+// Fill the hot list list, holding *n of max blocks, to half full with
+// blocks of size bytes, taking them from mem's buddies in steal order
+// under as few locks as possible.  Returns false if it couldn't get
+// any blocks.  Sets *stole if it had to go past the local buddies.
+// The caller must have interrupts disabled.
+static bool
+hot_refill(struct cpu_mem *mem, void **list, size_t *n, size_t max, size_t size,
+           int cpu, bool *stole)
+{
+  kstats::inc(&kstats::kalloc_hot_list_refill_count);
+  auto buddyit = mem->steal.begin(), buddyend = mem->steal.end();
+  auto lb = &buddies[*buddyit];
+  auto l = lb->lock.guard();
+  size_t want = max / 2 ? max / 2 : 1;
+  while (*n < want && buddyit != buddyend) {
+    void *block = lb->alloc.alloc_nothrow(size);
+    if (!block) {
+      // Move to the next allocator
+      if (++buddyit == buddyend)
+        break;
+      lb = &buddies[*buddyit];
+      l.release();
+      l = lb->lock.guard();
+      if (!mem->steal.is_local(*buddyit)) {
+        kstats::inc(&kstats::kalloc_hot_list_steal_count);
+        *stole = true;
+#if PRINT_STEAL
+        cprintf("CPU %d stealing hot list from buddy %lu\n",
+                cpu >= 0 ? cpu : myid(), *buddyit);
+#endif
+      }
+    } else {
+      list[(*n)++] = block;
+    }
+  }
+  return *n > 0;
+}
+
+// Return the older half of the full hot list list, holding *n of max
+// blocks of size bytes, to the buddy allocators.  We sort the blocks
+// so we can merge them with the buddy allocator lists, minimizing and
+// batching our locks.  The caller must have interrupts disabled.
+static void
+hot_flush(struct cpu_mem *mem, void **list, size_t *n, size_t max, size_t size)
+{
+  kstats::inc(&kstats::kalloc_hot_list_flush_count);
+  size_t nflush = max / 2 ? max / 2 : 1;
+  std::sort(list, list + nflush);
+  locked_buddy *lb = nullptr;
+  lock_guard<spinlock> lock;
+  for (size_t i = 0; i < nflush; ++i) {
+    void *ptr = list[i];
+    // Do we have the right buddy?
+    if (!lb || !(lb->alloc.contains(ptr) &&
+                 lb->alloc.get_free_bytes() < lb->free_limit)) {
+      // Find the first buddy in steal order that contains ptr and
+      // hasn't reached its free limit.  We do it this way in case
+      // there are overlapping buddies.
+      lock.release();
+      lb = nullptr;
+      for (auto buddyidx : mem->steal) {
+        auto lbtry = &buddies[buddyidx];
+        // We can access free_bytes and free_limit without locking
+        // here since it's okay if we actually go a little over
+        // free_limit.
+        if (lbtry->alloc.contains(ptr) &&
+            lbtry->alloc.get_free_bytes() < lbtry->free_limit) {
+          lb = lbtry;
+          break;
+        }
+      }
+      assert(lb);
+      if (!mem->steal.is_local(lb - &buddies[0])) {
+        kstats::inc(&kstats::kalloc_hot_list_remote_free_count);
+#if PRINT_STEAL
+        cprintf("CPU %d returning hot list to buddy %lu\n", myid(),
+                lb - &buddies[0]);
+#endif
+      }
+      lock = lb->lock.guard();
+    }
+    lb->alloc.free(ptr, size);
+  }
+  lock.release();
+  // Shift hot list down
+  // XXX(Austin) Could use two lists and switch off
+  *n = max - nflush;
+  memmove(list, list + nflush, *n * sizeof *list);
+}
+
 char*
 kalloc(const char *name, size_t size, int cpu)
 {
@@ -702,47 +964,42 @@ kalloc(const char *name, size_t size, int cpu)
 
   void *res = nullptr;
   const char *source = nullptr;
+  // Set if this core's local memory has run out
+  bool pressure = false;
 
+  int slot;
   if (size == PGSIZE) {
     // Go to the hot list
     scoped_cli cli;
     auto mem = cpu >= 0 ? cpus[cpu].mem : mycpu()->mem;
     if (mem->nhot == 0) {
       // No hot pages; fill half of the cache
-      kstats::inc(&kstats::kalloc_hot_list_refill_count);
-      auto buddyit = mem->steal.begin(), buddyend = mem->steal.end();
-      auto lb = &buddies[*buddyit];
-      auto l = lb->lock.guard();
-      while (mem->nhot < KALLOC_HOT_PAGES / 2 && buddyit != buddyend) {
-        void *page = lb->alloc.alloc_nothrow(PGSIZE);
-        if (!page) {
-          // Move to the next allocator
-          if (++buddyit == buddyend && mem->nhot == 0) {
-            // We couldn't allocate any pages; we're probably out of
-            // memory, but drop through to the more aggressive
-            // general-purpose allocator.
-            goto general;
-          }
-          lb = &buddies[*buddyit];
-          l.release();
-          l = lb->lock.guard();
-          if (!mem->steal.is_local(*buddyit)) {
-            kstats::inc(&kstats::kalloc_hot_list_steal_count);
-#if PRINT_STEAL
-            cprintf("CPU %d stealing hot list from buddy %lu\n",
-                    cpu >= 0 ? cpu : myid(), *buddyit);
-#endif
-          }
-        } else {
-          mem->hot_pages[mem->nhot++] = page;
-        }
-      }
+      if (!hot_refill(mem, mem->hot_pages, &mem->nhot, KALLOC_HOT_PAGES,
+                      PGSIZE, cpu, &pressure))
+        // We couldn't allocate any pages; we're probably out of
+        // memory, but drop through to the more aggressive
+        // general-purpose allocator.
+        goto general;
       source = "refilled hot list";
     }
     res = mem->hot_pages[--mem->nhot];
     kstats::inc(&kstats::kalloc_page_alloc_count);
     if (!source)
       source = "hot list";
+  } else if ((slot = hot_order_slot(size)) >= 0) {
+    // Go to the hot list for this order
+    scoped_cli cli;
+    auto mem = cpu >= 0 ? cpus[cpu].mem : mycpu()->mem;
+    auto &hot = mem->hot_orders[slot];
+    if (hot.n == 0) {
+      if (!hot_refill(mem, hot.blocks, &hot.n, hot_order_max(slot), size, cpu,
+                      &pressure))
+        goto general;
+      source = "refilled hot list";
+    }
+    res = hot.blocks[--hot.n];
+    if (!source)
+      source = "hot list";
   } else {
     // General allocation path for non-PGSIZE allocations or if we
     // can't fill our hot page cache.
@@ -758,11 +1015,19 @@ kalloc(const char *name, size_t size, int cpu)
       if (res && mem->steal.is_local(idx))
         cprintf("CPU %d stole from buddy %lu\n", cpu >= 0 ? cpu : myid(), idx);
 #endif
-      if (res)
+      if (res) {
+        if (!mem->steal.is_local(idx))
+          pressure = true;
         break;
+      }
     }
+    if (!res)
+      pressure = true;
     source = "buddy";
   }
+  if (pressure)
+    // Get the shrinkers going before we run out for good
+    kick_reclaim(cpu >= 0 ? cpu : myid());
   if (res) {
     if (ALLOC_MEMSET) {
       char* chk = (char*)res;
@@ -785,9 +1050,10 @@ kalloc(const char *name, size_t size, int cpu)
     alloc_debug_info *adi = alloc_debug_info::of(res, size);
     if (KERNEL_HEAP_PROFILE) {
       auto alloc_rip = __builtin_return_address(0);
-      if (heap_profile_update(HEAP_PROFILE_KALLOC, alloc_rip, size))
+      if (heap_profile_update(HEAP_PROFILE_KALLOC, alloc_rip, size)) {
         adi->set_kalloc_rip(alloc_rip);
-      else
+        adi->set_alloc_time(nsectime());
+      } else
         adi->set_kalloc_rip(nullptr);
     }
 
@@ -1052,7 +1318,7 @@ initkalloc(void)
           node_stats.waste_bytes += stats.waste_bytes;
           // Add to buddies
           buddies.emplace_back(std::move(buddy));
-          allmem.add(buddies.size()-1, p2v(remaining.base), subsize);
+          allmem.add(buddies.size()-1, p2v(remaining.base), subsize, node.id);
         }
         // XXX(Austin) It would be better if we knew what free_init
         // has rounded the upper bound to.
@@ -1085,6 +1351,8 @@ initkalloc(void)
       // there's only one subnode).
       cpu->mem->steal.add(node_low, node_low + node_buddies);
       cpu->mem->nhot = 0;
+      for (auto &hot : cpu->mem->hot_orders)
+        hot.n = 0;
       cpu->mem->mempool = node_low;
       ++cpu_index;
     }
@@ -1137,66 +1405,34 @@ kfree(void *v, size_t size)
   if (KERNEL_HEAP_PROFILE) {
     auto alloc_rip = adi->kalloc_rip();
     if (alloc_rip)
-      heap_profile_update(HEAP_PROFILE_KALLOC, alloc_rip, -size);
+      heap_profile_update(HEAP_PROFILE_KALLOC, alloc_rip, -size,
+                          nsectime() - adi->alloc_time());
   }
 
   auto mem = mycpu()->mem;
   if (size == PGSIZE) {
     // Free to the hot list
     scoped_cli cli;
-    if (mem->nhot == KALLOC_HOT_PAGES) {
+    if (mem->nhot == KALLOC_HOT_PAGES)
       // There's no more room in the hot pages list, so free half of
-      // it.  We sort the list so we can merge it with the buddy
-      // allocator list, minimizing and batching our locks.
-      kstats::inc(&kstats::kalloc_hot_list_flush_count);
-      std::sort(mem->hot_pages, mem->hot_pages + (KALLOC_HOT_PAGES / 2));
-      locked_buddy *lb = nullptr;
-      lock_guard<spinlock> lock;
-      for (size_t i = 0; i < KALLOC_HOT_PAGES / 2; ++i) {
-        void *ptr = mem->hot_pages[i];
-        // Do we have the right buddy?
-        if (!lb || !(lb->alloc.contains(ptr) &&
-                     lb->alloc.get_free_bytes() < lb->free_limit)) {
-          // Find the first buddy in steal order that contains ptr and
-          // hasn't reached its free limit.  We do it this way in case
-          // there are overlapping buddies.
-          lock.release();
-          lb = nullptr;
-          for (auto buddyidx : mem->steal) {
-            auto lbtry = &buddies[buddyidx];
-            // We can access free_bytes and free_limit without locking
-            // here since it's okay if we actually go a little over
-            // free_limit.
-            if (lbtry->alloc.contains(ptr) &&
-                lbtry->alloc.get_free_bytes() < lbtry->free_limit) {
-              lb = lbtry;
-              break;
-            }
-          }
-          assert(lb);
-          if (!mem->steal.is_local(lb - &buddies[0])) {
-            kstats::inc(&kstats::kalloc_hot_list_remote_free_count);
-#if PRINT_STEAL
-            cprintf("CPU %d returning hot list to buddy %lu\n", myid(),
-                    lb - &buddies[0]);
-#endif
-          }
-          lock = lb->lock.guard();
-        }
-        lb->alloc.free(ptr, PGSIZE);
-      }
-      lock.release();
-      // Shift hot page list down
-      // XXX(Austin) Could use two lists and switch off
-      mem->nhot = KALLOC_HOT_PAGES - (KALLOC_HOT_PAGES / 2);
-      memmove(mem->hot_pages, mem->hot_pages + (KALLOC_HOT_PAGES / 2),
-              mem->nhot * sizeof *mem->hot_pages);
-    }
+      // it.
+      hot_flush(mem, mem->hot_pages, &mem->nhot, KALLOC_HOT_PAGES, PGSIZE);
     mem->hot_pages[mem->nhot++] = v;
     kstats::inc(&kstats::kalloc_page_free_count);
     return;
   }
 
+  int slot = hot_order_slot(size);
+  if (slot >= 0) {
+    // Free to the hot list for this order
+    scoped_cli cli;
+    auto &hot = mem->hot_orders[slot];
+    if (hot.n == hot_order_max(slot))
+      hot_flush(mem, hot.blocks, &hot.n, hot_order_max(slot), size);
+    hot.blocks[hot.n++] = v;
+    return;
+  }
+
   // Find the first allocator in steal order to return v to.  This
   // will check our local allocators first and handle overlapping
   // buddies.
@@ -44,9 +44,10 @@ operator new[](std::size_t nbytes)
   alloc_debug_info *adi = alloc_debug_info::of(x+1, nbytes);
   if (KERNEL_HEAP_PROFILE) {
     auto alloc_rip = __builtin_return_address(0);
-    if (heap_profile_update(HEAP_PROFILE_NEWARRAY, alloc_rip, nbytes))
+    if (heap_profile_update(HEAP_PROFILE_NEWARRAY, alloc_rip, nbytes)) {
       adi->set_newarr_rip(alloc_rip);
-    else
+      adi->set_alloc_time(nsectime());
+    } else
       adi->set_newarr_rip(nullptr);
   }
 
@@ -64,7 +65,8 @@ operator delete[](void* p)
   if (KERNEL_HEAP_PROFILE) {
     auto alloc_rip = adi->newarr_rip();
     if (alloc_rip)
-      heap_profile_update(HEAP_PROFILE_NEWARRAY, alloc_rip, -nbytes);
+      heap_profile_update(HEAP_PROFILE_NEWARRAY, alloc_rip, -nbytes,
+                          nsectime() - adi->alloc_time());
   }
 
   kmfree(x-1, nbytes + sizeof(u64));
@@ -16,24 +16,64 @@
 #include "page_info.hh"
 #include "heapprof.hh"
 #include "numa.hh"
+#include "objcache.hh"
+#include "shrinker.hh"
 
+#include <atomic>
 #include <type_traits>
 
-// allocate in power-of-two sizes up to 2^KMMAX (PGSIZE)
-#define KMMAX PGSHIFT
+// Sub-page objects come from page-sized slabs, one size class per
+// slab.  Classes step by 16 bytes up to 256 bytes and then grow
+// geometrically, with the larger classes picked to divide a slab's
+// object area evenly.  Every class above 64 bytes is a multiple of 64,
+// so cacheline-sized objects stay cacheline-aligned.
+static constexpr u16 class_size[] = {
+  16, 32, 48, 64, 80, 96, 112, 128, 144, 160, 176, 192, 208, 224, 240, 256,
+  320, 384, 448, 512, 640, 768, 960, 1344, 1984,
+};
+#define NCLASS (sizeof(class_size) / sizeof(class_size[0]))
+// Largest sub-page allocation
+#define KMSMALL_MAX 1984
 
 struct header {
   struct header *next;
 };
 
-struct bucket {
+// Slab header, at the start of each slab page.  A slab is owned by the
+// core that allocated it and is protected by that core's kmcache lock
+// for its class.  Other cores free its objects onto the owner's remote
+// list.
+struct slab {
+  slab *next, *prev;            // Owner's list of non-full slabs
+  header *free;                 // Free objects in this slab
+  u16 inuse;
+  u16 nobj;
+  u16 cpu;
+  u8 k;                         // Size class
+  u8 skew;                      // Cache lines between header and objects
+  u32 magic;                    // SLAB_MAGIC while this page is a slab
+} __attribute__((aligned(CACHELINE)));
+
+#define SLAB_MAGIC 0x51ab51ab
+
+static_assert(sizeof(slab) == CACHELINE, "slab header too big");
+
+struct kmcache {
   spinlock lock;
-  header* hdr;
-  u64 count;
+  // Recently freed objects, handed out before touching any slab
+  void *mag[KMALLOC_MAGAZINE];
+  u32 nmag;
+  // Objects of our slabs freed by other cores.  Pushed lock-free and
+  // taken all at once by the owner, so there is no ABA problem.
+  std::atomic<header*> remote;
+  // Slabs with free objects, fully free slabs at the tail
+  slab *head, *tail;
+  u32 nempty;
+  u64 nslab;
 };
 
 struct freelist {
-  struct bucket buckets[KMMAX+1];
+  struct kmcache caches[NCLASS];
   char name[MAXNAME];
 };
 
@@ -42,20 +82,83 @@ DEFINE_PERCPU(struct freelist, freelists);
 void
 kminit(void)
 {
+  static_assert(class_size[NCLASS - 1] == KMSMALL_MAX, "bad KMSMALL_MAX");
   for (int c = 0; c < ncpu; c++) {
     freelists[c].name[0] = (char) c + '0';
     safestrcpy(freelists[c].name+1, "freelist", MAXNAME-1);
-    for (int b = 0; b < KMMAX+1; b++) {
-      scoped_acquire guard(&freelists[c].buckets[b].lock);
-      freelists[c].buckets[b].hdr = nullptr;
-      freelists[c].buckets[b].count = 0;
+    for (int k = 0; k < NCLASS; k++) {
+      auto &kc = freelists[c].caches[k];
+      scoped_acquire guard(&kc.lock);
+      kc.nmag = 0;
+      kc.remote.store(nullptr, std::memory_order_relaxed);
+      kc.head = kc.tail = nullptr;
+      kc.nempty = 0;
+      kc.nslab = 0;
     }
   }
 }
 
-// get more space for freelists[c].buckets[b]
 static int
-morecore(int c, int b)
+size_class(u64 nbytes)
+{
+  int k;
+  if (nbytes <= 256) {
+    k = nbytes ? (nbytes - 1) / 16 : 0;
+  } else {
+    for (k = 16; class_size[k] < nbytes; k++)
+      ;
+  }
+  assert(k < NCLASS && class_size[k] >= nbytes);
+  return k;
+}
+
+static slab *
+slab_of(void *p)
+{
+  return (slab*)PGROUNDDOWN((uptr)p);
+}
+
+static void
+slab_unlink(kmcache *kc, slab *s)
+{
+  if (s->prev)
+    s->prev->next = s->next;
+  else
+    kc->head = s->next;
+  if (s->next)
+    s->next->prev = s->prev;
+  else
+    kc->tail = s->prev;
+  s->next = s->prev = nullptr;
+}
+
+static void
+slab_push_head(kmcache *kc, slab *s)
+{
+  s->prev = nullptr;
+  s->next = kc->head;
+  if (kc->head)
+    kc->head->prev = s;
+  else
+    kc->tail = s;
+  kc->head = s;
+}
+
+static void
+slab_push_tail(kmcache *kc, slab *s)
+{
+  s->next = nullptr;
+  s->prev = kc->tail;
+  if (kc->tail)
+    kc->tail->next = s;
+  else
+    kc->head = s;
+  kc->tail = s;
+}
+
+// Allocate a new slab of class k for core c and put it on c's list.
+static int
+morecore(int c, int k)
 {
   char *p = kalloc("kmalloc", PGSIZE, c);
   if(p == 0)
@@ -64,88 +167,235 @@ morecore(int c, int b)
   if (ALLOC_MEMSET)
     memset(p, 3, PGSIZE);
 
+  int sz = class_size[k];
+  assert(sz >= sizeof(header));
+  slab *s = (slab*)p;
+  s->nobj = (PGSIZE - sizeof(slab)) / sz;
+  s->inuse = 0;
+  s->cpu = c;
+  s->k = k;
+  s->free = nullptr;
+
 #if RANDOMIZE_KMALLOC
+  size_t slack = PGSIZE - sizeof(slab) - s->nobj * sz;
 #if CODEX
-  u8 r = rnd() % 11;
+  u8 r = rnd() % (slack / CACHELINE + 1);
 #else
-  u8 r = rdtsc() % 11;
+  u8 r = rdtsc() % (slack / CACHELINE + 1);
 #endif
 #else
   u8 r = 0;
 #endif
 
-  int sz = 1 << b;
-  assert(sz >= sizeof(header));
-  scoped_acquire guard(&freelists[c].buckets[b].lock);
-  for(char *q = p + CACHELINE * r; q + sz <= p + PGSIZE; q += sz){
-    struct header *h = (struct header *) q;
-    h->next = freelists[c].buckets[b].hdr;
-    freelists[c].buckets[b].hdr = h;
-    freelists[c].buckets[b].count++;
+  s->skew = r;
+  s->magic = SLAB_MAGIC;
+  char *base = p + sizeof(slab) + CACHELINE * r;
+  for (int i = s->nobj - 1; i >= 0; i--) {
+    struct header *h = (struct header *) (base + i * sz);
+    h->next = s->free;
+    s->free = h;
   }
 
+  auto &kc = freelists[c].caches[k];
+  scoped_acquire guard(&kc.lock);
+  slab_push_tail(&kc, s);
+  kc.nempty++;
+  kc.nslab++;
   return 0;
 }
 
-static int
-bucket(u64 nbytes)
+// Return a slab's page to kalloc.
+static void
+slab_destroy(slab *s)
+{
+  s->magic = 0;
+  kfree(s, PGSIZE);
+}
+
+// Return object p to its slab, which must belong to kc (locked).  If
+// this leaves more than KMALLOC_EMPTY_SLABS fully free slabs on kc,
+// returns the slab, which the caller should kfree once it drops the
+// lock.
+static slab *
+slab_put(kmcache *kc, void *p)
+{
+  slab *s = slab_of(p);
+  struct header *h = (struct header *) p;
+  h->next = s->free;
+  s->free = h;
+  if (s->inuse-- == s->nobj)
+    // Was full, so it wasn't on the list
+    slab_push_head(kc, s);
+  if (s->inuse == 0) {
+    slab_unlink(kc, s);
+    if (kc->nempty >= KMALLOC_EMPTY_SLABS) {
+      kc->nslab--;
+      return s;
+    }
+    // Keep partially used slabs in front of free ones
+    slab_push_tail(kc, s);
+    kc->nempty++;
+  }
+  return nullptr;
+}
+
+// Return object p to its slab.  The caller must not hold any kmcache
+// lock.
+static void
+slab_free(void *p, int k)
 {
-  int b = ceil_log2(nbytes);
-  if (b < 6)
-    b = 6;
-  assert((1<<b) >= nbytes);
-  assert(b <= KMMAX);
-  return b;
+  slab *s = slab_of(p);
+  auto &kc = freelists[s->cpu].caches[k];
+  slab *release;
+  {
+    scoped_acquire guard(&kc.lock);
+    release = slab_put(&kc, p);
+  }
+  if (release)
+    slab_destroy(release);
+}
+
+// Return the objects in v to their slabs.
+static void
+slab_free_many(void **v, u32 n, int k)
+{
+  for (u32 i = 0; i < n; i++)
+    slab_free(v[i], k);
+}
+
+// Take the objects other cores have freed into kc's slabs (kc must be
+// locked).  They refill the magazine and anything beyond that goes
+// back to the slabs; slabs this frees are chained on *release.
+static void
+drain_remote(kmcache *kc, slab **release)
+{
+  header *h = kc->remote.exchange(nullptr, std::memory_order_acquire);
+  while (h) {
+    header *next = h->next;
+    if (kc->nmag < KMALLOC_MAGAZINE) {
+      kc->mag[kc->nmag++] = h;
+    } else if (slab *s = slab_put(kc, h)) {
+      s->next = *release;
+      *release = s;
+    }
+    h = next;
+  }
+}
+
+static void
+release_slabs(slab *release)
+{
+  while (release) {
+    slab *next = release->next;
+    slab_destroy(release);
+    release = next;
+  }
 }
 
 static void *
-kmalloc_small(size_t b, const char *name, int cpu)
+kmalloc_small(int k, const char *name, int cpu)
 {
   struct header *h;
   int c = cpu >= 0 ? cpu : mycpu()->id;
+  auto &kc = freelists[c].caches[k];
+  slab *release = nullptr;
 
   for (;;) {
-    scoped_acquire guard(&freelists[c].buckets[b].lock);
-    h = freelists[c].buckets[b].hdr;
-    if (h) {
-      freelists[c].buckets[b].hdr = h->next;
-      freelists[c].buckets[b].count--;
+    scoped_acquire guard(&kc.lock);
+    if (!kc.nmag)
+      drain_remote(&kc, &release);
+    if (kc.nmag) {
+      h = (struct header *) kc.mag[--kc.nmag];
+      break;
+    }
+    slab *s = kc.head;
+    if (s) {
+      if (s->inuse++ == 0)
+        kc.nempty--;
+      h = s->free;
+      s->free = h->next;
+      if (s->inuse == s->nobj)
+        slab_unlink(&kc, s);
       break;
     }
 
     guard.release();
-    if (morecore(c, b) < 0) {
-      cprintf("kmalloc(%d) failed\n", 1 << b);
+    release_slabs(release);
+    release = nullptr;
+    if (morecore(c, k) < 0) {
+      cprintf("kmalloc(%d) failed\n", class_size[k]);
       return 0;
     }
   }
 
+  release_slabs(release);
+
   if (ALLOC_MEMSET) {
+    int sz = class_size[k];
     char* chk = (char*)h + sizeof(struct header);
-    for (int i = 0; i < (1<<b)-sizeof(struct header); i++)
+    for (int i = 0; i < sz-sizeof(struct header); i++)
       if (chk[i] != 3) {
-        console.print(shexdump(chk, 1<<b));
+        console.print(shexdump(chk, sz));
         panic("kmalloc: free memory was overwritten %p+%x", chk, i);
       }
-    memset(h, 4, (1<<b));
+    memset(h, 4, sz);
   }
 
   return h;
 }
 
+static void
+kmfree_small(void *ap, int k)
+{
+  void *spill[KMALLOC_MAGAZINE / 2];
+  u32 nspill = 0;
+
+  if (ALLOC_MEMSET)
+    memset(ap, 3, class_size[k]);
+
+  int c = mycpu()->id;
+  slab *s = slab_of(ap);
+  if (s->cpu != c) {
+    // Another core's object.  Hand it back to the owner instead of
+    // stranding it in our magazine.
+    auto &okc = freelists[s->cpu].caches[k];
+    struct header *h = (struct header *) ap;
+    h->next = okc.remote.load(std::memory_order_relaxed);
+    while (!okc.remote.compare_exchange_weak(h->next, h,
+                                             std::memory_order_release,
+                                             std::memory_order_relaxed))
+      ;
+    return;
+  }
+
+  auto &kc = freelists[c].caches[k];
+  {
+    scoped_acquire guard(&kc.lock);
+    if (kc.nmag == KMALLOC_MAGAZINE) {
+      // Magazine is full.  Hand back the older half so their slabs
+      // can drain and be returned to kalloc.
+      nspill = KMALLOC_MAGAZINE / 2;
+      memmove(spill, kc.mag, sizeof(spill));
+      memmove(kc.mag, kc.mag + nspill, (kc.nmag - nspill) * sizeof(void*));
+      kc.nmag -= nspill;
+    }
+    kc.mag[kc.nmag++] = ap;
+  }
+  slab_free_many(spill, nspill, k);
+}
+
 void *
 kmalloc(u64 nbytes, const char *name, int cpu)
 {
   void *h;
   uint64_t mbytes = alloc_debug_info::expand_size(nbytes);
 
-  if (mbytes > PGSIZE / 2) {
+  if (mbytes > KMSMALL_MAX) {
     // Full page allocation
     h = kalloc(name, round_up_to_pow2(mbytes), cpu);
   } else {
     // Sub-page allocation
-    int b = bucket(mbytes);
-    h = kmalloc_small(b, name, cpu);
+    h = kmalloc_small(size_class(mbytes), name, cpu);
   }
   if (!h)
     return nullptr;
@@ -154,9 +404,10 @@ kmalloc(u64 nbytes, const char *name, int cpu)
   alloc_debug_info *adi = alloc_debug_info::of(h, nbytes);
   if (KERNEL_HEAP_PROFILE) {
     auto alloc_rip = __builtin_return_address(0);
-    if (heap_profile_update(HEAP_PROFILE_KMALLOC, alloc_rip, nbytes))
+    if (heap_profile_update(HEAP_PROFILE_KMALLOC, alloc_rip, nbytes)) {
       adi->set_kmalloc_rip(alloc_rip);
-    else
+      adi->set_alloc_time(nsectime());
+    } else
       adi->set_kmalloc_rip(nullptr);
   }
 
@@ -168,7 +419,6 @@ kmalloc(u64 nbytes, const char *name, int cpu)
 void
 kmfree(void *ap, u64 nbytes)
 {
-  struct header *h = (struct header *) ap;
   mtunlabel(mtrace_label_heap, ap);
 
   // Update debug_info
@@ -176,27 +426,40 @@ kmfree(void *ap, u64 nbytes)
   if (KERNEL_HEAP_PROFILE) {
     auto alloc_rip = adi->kmalloc_rip();
     if (alloc_rip)
-      heap_profile_update(HEAP_PROFILE_KMALLOC, alloc_rip, -nbytes);
+      heap_profile_update(HEAP_PROFILE_KMALLOC, alloc_rip, -nbytes,
+                          nsectime() - adi->alloc_time());
   }
 
-  if (nbytes > PGSIZE / 2) {
+  uint64_t mbytes = alloc_debug_info::expand_size(nbytes);
+  if (mbytes > KMSMALL_MAX) {
     // Free full page allocation
-    kfree(ap, round_up_to_pow2(nbytes));
+    kfree(ap, round_up_to_pow2(mbytes));
   } else {
     // Free sub-page allocation
-    int b = bucket(nbytes);
-
-    if (ALLOC_MEMSET)
-      memset(ap, 3, (1<<b));
-
-    int c = mycpu()->id;
-    scoped_acquire guard(&freelists[c].buckets[b].lock);
-    h->next = freelists[c].buckets[b].hdr;
-    freelists[c].buckets[b].hdr = h;
-    freelists[c].buckets[b].count++;
+    kmfree_small(ap, size_class(mbytes));
   }
 }
 
+// If p, a direct-mapped address the caller knows to be mapped, is in a
+// slab, return the start, size class and owning core of its object.
+// This takes no locks, so the sampler can call it from NMIs; the
+// object may be free.
+bool
+kmalloc_object(const void *p, const void **base, u32 *size, int *cpu)
+{
+  slab *s = slab_of((void*)p);
+  if (s->magic != SLAB_MAGIC || s->k >= NCLASS || s->cpu >= ncpu)
+    return false;
+  int sz = class_size[s->k];
+  const char *objs = (const char*)s + sizeof(slab) + CACHELINE * s->skew;
+  if ((const char*)p < objs || (const char*)p >= objs + s->nobj * sz)
+    return false;
+  *base = objs + ((const char*)p - objs) / sz * sz;
+  *size = sz;
+  *cpu = s->cpu;
+  return true;
+}
+
 int
 kmalign(void **p, int align, u64 size, const char *name)
 {
@@ -227,15 +490,15 @@ alloc_debug_info::expand_size(size_t size)
   size_t aligned = (size + (alignof(alloc_debug_info) - 1)) &
     ~(alignof(alloc_debug_info) - 1);
   size_t want = aligned + sizeof(alloc_debug_info);
-  if (want > PGSIZE / 2) {
+  if (want > KMSMALL_MAX) {
     // Store alloc_debug_info in page_info.  Round the size up
     // enough to make sure it allocates a whole page (we can't just
-    // return size, because that may be <= PGSIZE / 2)
-    if (size <= PGSIZE / 2)
+    // return size, because that may be <= KMSMALL_MAX)
+    if (size <= KMSMALL_MAX)
       // We can't just return size because that would cause a
       // sub-page allocation, so make it just big enough to force a
       // full page allocation.
-      return PGSIZE / 2;
+      return KMSMALL_MAX + 1;
     return size;
   }
   // Sub-page allocations store the alloc_debug_info at the end
@@ -254,58 +517,93 @@ alloc_debug_info::of(void *p, size_t size)
     ~(alignof(alloc_debug_info) - 1);
   size_t want = aligned + sizeof(alloc_debug_info);
 
-  if (want > PGSIZE / 2)
+  if (want > KMSMALL_MAX)
     return page_info::of(p);
   return (alloc_debug_info*)((char*)p + aligned);
 }
 
+// Drain core c's magazines and remote lists back into their slabs,
+// returning any slabs this frees beyond KMALLOC_EMPTY_SLABS per core to
+// kalloc.  Returns the number of objects drained.
+static size_t
+kmdrain(int c)
+{
+  void *spill[KMALLOC_MAGAZINE];
+  size_t total = 0;
+
+  for (int k = 0; k < NCLASS; k++) {
+    auto &kc = freelists[c].caches[k];
+    u32 n;
+    slab *release = nullptr;
+    {
+      scoped_acquire guard(&kc.lock);
+      drain_remote(&kc, &release);
+      n = kc.nmag;
+      memmove(spill, kc.mag, n * sizeof(void*));
+      kc.nmag = 0;
+    }
+    slab_free_many(spill, n, k);
+    release_slabs(release);
+    total += n;
+  }
+  return total;
+}
+
 void
 kmbalance(void)
 {
-  for (int b = 0; b < KMMAX+1; b++) {
-    for (auto &node : numa_nodes)
-      for (auto cpuid : node.cpuids)
-        freelists[cpuid].buckets[b].lock.acquire();
-
-    u64 total = 0;
-    u64 ncpu = 0;
-    for (auto &node : numa_nodes) {
-      for (auto cpuid : node.cpuids) {
-        total += freelists[cpuid].buckets[b].count;
-        ncpu++;
-      }
-    }
+  for (int c = 0; c < ncpu; c++)
+    kmdrain(c);
+}
 
-    header* extras = nullptr;
-    for (auto &node : numa_nodes) {
-      for (auto cpuid : node.cpuids) {
-        while (freelists[cpuid].buckets[b].count > total/ncpu) {
-          header* h = freelists[cpuid].buckets[b].hdr;
-          assert(h);
-          freelists[cpuid].buckets[b].hdr = h->next;
-          freelists[cpuid].buckets[b].count--;
-          h->next = extras;
-          extras = h;
-        }
-      }
+namespace {
+  // Under memory pressure, hand a core's cached objects back to their
+  // slabs so that free slabs go back to kalloc.
+  class kmalloc_shrinker : public shrinker
+  {
+  public:
+    kmalloc_shrinker() : shrinker("kmalloc") { }
+
+    size_t count(int cpu) override
+    {
+      size_t n = 0;
+      for (int k = 0; k < NCLASS; k++)
+        n += freelists[cpu].caches[k].nmag;
+      return n;
     }
 
-    for (auto &node : numa_nodes) {
-      for (auto cpuid : node.cpuids) {
-        while (extras && freelists[cpuid].buckets[b].count <= total/ncpu + 1) {
-          header* h = extras;
-          extras = h->next;
-          h->next = freelists[cpuid].buckets[b].hdr;
-          freelists[cpuid].buckets[b].hdr = h;
-          freelists[cpuid].buckets[b].count++;
-        }
-      }
+    size_t scan(int cpu, size_t nr) override
+    {
+      return kmdrain(cpu);
     }
+  };
+
+  kmalloc_shrinker the_kmalloc_shrinker;
+}
 
-    for (auto &node : numa_nodes)
-      for (auto cpuid : node.cpuids)
-        freelists[cpuid].buckets[b].lock.release();
+std::atomic<objcache_base*> objcache_base::all_;
 
-    assert(!extras);
+void
+objcache_base::print(print_stream *s) const
+{
+  stats total{};
+  u64 cached = 0;
+  for (int c = 0; c < ncpu; c++) {
+    const magazine &m = mags_[c];
+    total.hits += m.st.hits;
+    total.misses += m.st.misses;
+    total.frees += m.st.frees;
+    total.spills += m.st.spills;
+    cached += m.n;
   }
+  s->println("objcache ", name_, ": hits ", total.hits, " misses ",
+             total.misses, " frees ", total.frees, " spills ", total.spills,
+             " cached ", cached);
+}
+
+void
+objcache_base::print_all(print_stream *s)
+{
+  for (auto c = all_.load(); c; c = c->next_)
+    c->print(s);
 }
@@ -0,0 +1,209 @@
+// Lock contention profile; see lockprof.hh.
+
+#include "types.h"
+#include "kernel.hh"
+#include "percpu.hh"
+#include "critical.hh"
+#include "fs.h"
+#include "file.hh"
+#include "major.h"
+#include "kstream.hh"
+#include "lockprof.hh"
+#include <algorithm>
+#include <vector>
+
+// Call sites reported by /dev/lockprof
+#define LOCKPROF_TOP 20
+
+struct lockprof_entry
+{
+  u8 kind;
+  // The name as passed to lockprof_record(), which identifies the
+  // entry, and a copy of it, which outlives the lock
+  const char *key;
+  char name[32];
+  uptr site;
+  u64 n, contended, wait, maxwait, hold;
+};
+
+struct lockprof_table
+{
+  struct lockprof_entry *entries;
+  // Records that found no free entry within LOCKPROF_PROBE slots
+  u64 dropped;
+};
+
+enum { LOCKPROF_PROBE = 16 };
+
+std::atomic<bool> lockprof_enabled;
+DEFINE_PERCPU(struct lockprof_table, lockprof_tables, NO_INT);
+
+void
+lockprof_record(u8 kind, const char *name, uptr site, u64 n,
+                u64 contended, u64 wait, u64 hold)
+{
+  scoped_cli cli;
+  lockprof_table &t = *lockprof_tables;
+  if (!t.entries)
+    return;
+
+  u64 h = ((uptr)name * 0x9e3779b97f4a7c15ull) ^
+    (site * 0xff51afd7ed558ccdull) ^ kind;
+  h ^= h >> 29;
+  for (int i = 0; i < LOCKPROF_PROBE; i++) {
+    lockprof_entry *e = &t.entries[(h + i) % LOCKPROF_SITES];
+    if (!e->kind) {
+      e->kind = kind;
+      e->key = name;
+      e->site = site;
+      strncpy(e->name, name ? name : "condvar", sizeof(e->name) - 1);
+    } else if (e->kind != kind || e->key != name || e->site != site) {
+      continue;
+    }
+    e->n += n;
+    e->contended += contended;
+    e->wait += wait;
+    e->hold += hold;
+    if (wait > e->maxwait)
+      e->maxwait = wait;
+    return;
+  }
+  t.dropped++;
+}
+
+// Entries of different cores (and of different copies of the same name)
+// that count the same thing are summed.
+static bool
+same_entry(const lockprof_entry &a, const lockprof_entry &b)
+{
+  return a.kind == b.kind && a.site == b.site && !strcmp(a.name, b.name);
+}
+
+static bool
+entry_order(const lockprof_entry &a, const lockprof_entry &b)
+{
+  if (a.kind != b.kind)
+    return a.kind < b.kind;
+  if (a.site != b.site)
+    return a.site < b.site;
+  return strcmp(a.name, b.name) < 0;
+}
+
+static void
+merge_entries(std::vector<lockprof_entry> *v)
+{
+  std::sort(v->begin(), v->end(), entry_order);
+  size_t out = 0;
+  for (size_t i = 0; i < v->size(); i++) {
+    lockprof_entry &e = (*v)[i];
+    if (out && same_entry((*v)[out - 1], e)) {
+      lockprof_entry &m = (*v)[out - 1];
+      m.n += e.n;
+      m.contended += e.contended;
+      m.wait += e.wait;
+      m.hold += e.hold;
+      m.maxwait = std::max(m.maxwait, e.maxwait);
+    } else {
+      (*v)[out++] = e;
+    }
+  }
+  v->erase(v->begin() + out, v->end());
+}
+
+static void
+print_lockprof(print_stream *s)
+{
+  std::vector<lockprof_entry> all;
+  u64 dropped = 0;
+  for (int c = 0; c < ncpu; c++) {
+    lockprof_table &t = lockprof_tables[c];
+    if (!t.entries)
+      continue;
+    for (int i = 0; i < LOCKPROF_SITES; i++)
+      if (t.entries[i].kind)
+        all.push_back(t.entries[i]);
+    dropped += t.dropped;
+    merge_entries(&all);
+  }
+
+  auto by_wait = [](const lockprof_entry &a, const lockprof_entry &b) {
+    return a.wait > b.wait;
+  };
+  std::sort(all.begin(), all.end(), by_wait);
+
+  s->println("lockprof ", lockprof_on() ? "on" : "off", ", ", dropped,
+             " records dropped; times in cycles");
+  s->println("sleeplocks:  acquires   contended        wait        hold"
+             "     maxwait  name");
+  for (auto &e : all) {
+    if (e.kind != LOCKPROF_SLEEPLOCK || e.site)
+      continue;
+    s->println("  ", sfmt(e.n).width(14), sfmt(e.contended).width(12),
+               sfmt(e.wait).width(12), sfmt(e.hold).width(12),
+               sfmt(e.maxwait).width(12), "  ", e.name);
+  }
+
+  s->println("top contended sites:  count        wait     avgwait"
+             "     maxwait  site                name");
+  int shown = 0;
+  for (auto &e : all) {
+    if (!e.site)
+      continue;
+    if (shown++ == LOCKPROF_TOP)
+      break;
+    s->println("  ", sfmt(e.contended).width(21), sfmt(e.wait).width(12),
+               sfmt(e.contended ? e.wait / e.contended : 0).width(12),
+               sfmt(e.maxwait).width(12), "  ",
+               shex(e.site).width(18).pad(' '), "  ", e.name);
+  }
+}
+
+static int
+lockprofread(mdev*, char *dst, u32 off, u32 n)
+{
+  window_stream s(dst, off, n);
+  print_lockprof(&s);
+  return s.get_used();
+}
+
+// "1" turns profiling on, "0" off, and "c" clears the counts.
+static int
+lockprofwrite(mdev*, const char *buf, u32 n)
+{
+  if (n < 1)
+    return -1;
+  switch (buf[0]) {
+  case '1':
+    lockprof_enabled = true;
+    break;
+  case '0':
+    lockprof_enabled = false;
+    break;
+  case 'c':
+    for (int c = 0; c < ncpu; c++) {
+      lockprof_table &t = lockprof_tables[c];
+      if (t.entries)
+        memset(t.entries, 0, LOCKPROF_SITES * sizeof(lockprof_entry));
+      t.dropped = 0;
+    }
+    break;
+  default:
+    return -1;
+  }
+  return n;
+}
+
+void
+initlockprof(void)
+{
+  for (int c = 0; c < ncpu; c++) {
+    auto e = (lockprof_entry*)
+      kalloc("lockprof", LOCKPROF_SITES * sizeof(lockprof_entry), c);
+    if (!e)
+      panic("initlockprof: out of memory");
+    memset(e, 0, LOCKPROF_SITES * sizeof(lockprof_entry));
+    lockprof_tables[c].entries = e;
+  }
+  devsw[MAJ_LOCKPROF].pread = lockprofread;
+  devsw[MAJ_LOCKPROF].write = lockprofwrite;
+}
@@ -42,17 +42,25 @@ void initinode_early(void);
 void recover_scalefs(void);
 void initinode_late(void);
 void initdisk(void);
+void initdisk_sched(void);
 void inituser(void);
 void initsamp(void);
 void inite1000(void);
 void initahci(void);
+void initnvme(void);
 void initpci(void);
 void initnet(void);
 void initsched(void);
 void initlockstat(void);
+void initlockprof(void);
+void initfsperf(void);
+void initioacct(void);
+void initmemacct(void);
+void initpagecopy(void);
+void initheapprof(void);
+void init_taskgroups(void);
 void initidle(void);
 void initcpprt(void);
-void initfutex(void);
 void initcmdline(void);
 void initrefcache(void);
 void initacpitables(void);
@@ -63,9 +71,12 @@ void initiommu(void);
 void initacpi(void);
 void initwd(void);
 void initdev(void);
+void inittxtrace(void);
+void initdisktrace(void);
 void inithpet(void);
 void initrtc(void);
 void initmfs(void);
+void initbio(void);
 void idleloop(void);
 void init_scalefs(void);
 
@@ -222,10 +233,11 @@ cmain(u64 mbmagic, u64 mbaddr)
   inithpet();              // Requires initacpitables
   initfpu();               // Requires nothing
   initmsr();               // Requires nothing
+  initpagecopy();          // Requires nothing
   initcmdline();
 #if MEMIDE
   initmemdisk();
-#elif AHCIIDE
+#elif AHCIIDE || NVMEIDE
   initidedisk();
 #endif
   initkalloc();            // Requires initpageinfo
@@ -236,17 +248,27 @@ cmain(u64 mbmagic, u64 mbaddr)
   initgc();        // gc epochs and threads
   initrefcache();  // Requires initsched
   initconsole();
-  initfutex();
   initsamp();
   initlockstat();
+  initlockprof();
+  initfsperf();
+  initioacct();
+  initmemacct();
+  initheapprof();
+  init_taskgroups();
   initacpi();              // Requires initacpitables, initkalloc?
   inite1000();             // Before initpci
   initahci();
+  initnvme();
   initpci();               // Suggests initacpi
   initnet();
   initrtc();               // Requires inithpet
   initdev();               // Misc /dev nodes
+  inittxtrace();
+  initdisktrace();
   initdisk();      // disk
+  initdisk_sched();  // Requires initahci, initnvme
+  initbio();       // buffer cache stats
 
   initinode_early();     // inode cache
   recover_scalefs();
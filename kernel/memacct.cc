@@ -0,0 +1,61 @@
+// File system memory footprint accounting; see memacct.hh.
+
+#include "types.h"
+#include "kernel.hh"
+#include "fs.h"
+#include "file.hh"
+#include "major.h"
+#include "kstream.hh"
+#include "gc.hh"
+#include "memacct.hh"
+
+DEFINE_PERCPU(struct memacct_counts, mymemacct, NO_CRITICAL);
+
+static const char *memacct_names[MEMACCT_NKINDS] = {
+  "none",
+  "bufcache bufdata",
+  "file pages",
+  "anon file pages",
+  "free block bitmap",
+  "free_inum",
+  "mdir buckets",
+  "mdir items",
+  "dir_entries slots",
+  "oplog ops",
+  "txn diskblocks",
+};
+
+static void
+print_memacct(print_stream *s)
+{
+  s64 total = 0;
+  s->println("      objects        KB  kind");
+  for (int k = MEMACCT_NONE + 1; k < MEMACCT_NKINDS; k++) {
+    s64 n = 0, bytes = 0;
+    for (int c = 0; c < ncpu; c++) {
+      n += mymemacct[c].objs[k].load(std::memory_order_relaxed);
+      bytes += mymemacct[c].bytes[k].load(std::memory_order_relaxed);
+    }
+    total += bytes;
+    s->println(sfmt(n).width(13), sfmt(bytes / 1024).width(10), "  ",
+               memacct_names[k]);
+  }
+  s->println(sfmt(total / 1024).width(23), "  total");
+  // Some of this is also counted above: freed chainhash tables and
+  // dir_entries tables stay counted until the gc frees them.
+  s->println(sfmt(gc_delayed_bytes() / 1024).width(23), "  gc deferred");
+}
+
+static int
+memacctread(mdev*, char *dst, u32 off, u32 n)
+{
+  window_stream s(dst, off, n);
+  print_memacct(&s);
+  return s.get_used();
+}
+
+void
+initmemacct(void)
+{
+  devsw[MAJ_MEMACCT].pread = memacctread;
+}
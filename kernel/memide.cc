@@ -12,6 +12,10 @@
 #include "disk.hh"
 #include "buf.hh"
 #include "ideconfig.hh"
+#include "file.hh"
+#include "major.h"
+#include "kstream.hh"
+#include "memide.h"
 #include <sys/time.h>
 
 extern u8 _fs_imgz_start[];
@@ -24,12 +28,24 @@ extern u64 _fs_imgz_size;
 static u64 nblocks = NMEGS * BLKS_PER_MEG;
 static const u64 _fs_img_size = nblocks * BSIZE;
 
+// The memory disk doesn't take any time to do I/O, so that on its own it
+// can't show how the file system's I/O scheduling, group commit and flush
+// batching would fare on a real disk. With a device model (see
+// struct memide_model), each I/O still moves its data when it is issued,
+// but then takes a queue slot and completes only once its transfer, which
+// shares the disk's bandwidth with the I/Os before it, and its latency are
+// over: a flush comes after all the writes before it. A thread delivers the
+// completions, as the disk's interrupt would; poll() delivers them too.
 class memdisk : public disk
 {
 public:
   NEW_DELETE_OPS(memdisk);
 
-  memdisk(u64 nbytes) : data_ptr_(nullptr), nbytes_(nbytes)
+  memdisk(u64 nbytes) : data_ptr_(nullptr), nbytes_(nbytes),
+                        lock_("memdisk", LOCKSTAT_BIO),
+                        slot_cv_("memdisk::slot"), done_cv_("memdisk::done"),
+                        npending_(0), busy_until_(0), writes_done_(0),
+                        stats_()
   {
     dk_nbytes = nbytes;
     snprintf(dk_busloc, sizeof(dk_busloc), "memide");
@@ -39,9 +55,232 @@ public:
     data_ptr_ = (u8**)kmalloc(dptr_size, "memide");
     assert(data_ptr_);
     memset(data_ptr_, 0, dptr_size);
+
+    model_.read_us = MEMIDE_READ_US;
+    model_.write_us = MEMIDE_WRITE_US;
+    model_.flush_us = MEMIDE_FLUSH_US;
+    model_.mbps = MEMIDE_MBPS;
+    model_.queue_depth = MEMIDE_QUEUE_DEPTH;
   }
 
   void readv(kiovec *iov, int iov_cnt, u64 off) override
+  {
+    if (!modeled()) {
+      copy_in(iov, iov_cnt, off);
+      return;
+    }
+    auto dc = sref<disk_completion>::transfer(new disk_completion());
+    areadv(iov, iov_cnt, off, dc);
+    dc->wait();
+  }
+
+  void writev(kiovec *iov, int iov_cnt, u64 off) override
+  {
+    if (!modeled()) {
+      copy_out(iov, iov_cnt, off);
+      return;
+    }
+    auto dc = sref<disk_completion>::transfer(new disk_completion());
+    awritev(iov, iov_cnt, off, dc);
+    dc->wait();
+  }
+
+  void flush() override
+  {
+    if (!modeled())
+      return;
+    auto dc = sref<disk_completion>::transfer(new disk_completion());
+    aflush(dc);
+    dc->wait();
+  }
+
+  void areadv(kiovec *iov, int iov_cnt, u64 off,
+              sref<disk_completion> dc) override
+  {
+    copy_in(iov, iov_cnt, off);
+    submit(OP_READ, iov_bytes(iov, iov_cnt), std::move(dc));
+  }
+
+  void awritev(kiovec *iov, int iov_cnt, u64 off,
+               sref<disk_completion> dc) override
+  {
+    copy_out(iov, iov_cnt, off);
+    submit(OP_WRITE, iov_bytes(iov, iov_cnt), std::move(dc));
+  }
+
+  void aflush(sref<disk_completion> dc) override
+  {
+    submit(OP_FLUSH, 0, std::move(dc));
+  }
+
+  void poll() override
+  {
+    deliver();
+  }
+
+  void print_stats() override
+  {
+    scoped_acquire a(&lock_);
+    cprintf("%s: %lu reads, %lu writes, %lu flushes, %u in flight, "
+            "%lu waits for a slot\n", dk_busloc, stats_.ops[OP_READ],
+            stats_.ops[OP_WRITE], stats_.ops[OP_FLUSH], npending_,
+            stats_.slot_waits);
+  }
+
+  // Change the model for the I/Os issued from now on (see /dev/memide).
+  void set_model(const memide_model &m)
+  {
+    scoped_acquire a(&lock_);
+    for (int i = 0; i < sizeof(m) / sizeof(u32); i++) {
+      u32 v = ((const u32 *)&m)[i];
+      if (v != MEMIDE_KEEP)
+        ((u32 *)&model_)[i] = v;
+    }
+    // Let submitters waiting for slots that no longer exist have them.
+    slot_cv_.wake_all();
+  }
+
+  void print_model(print_stream *s)
+  {
+    scoped_acquire a(&lock_);
+    s->println(dk_busloc, ": read ", model_.read_us, " us, write ",
+               model_.write_us, " us, flush ", model_.flush_us, " us, ",
+               model_.mbps, " MB/s, queue depth ", queue_depth(),
+               modeled() ? "" : " (off)");
+    s->println("  ", stats_.ops[OP_READ], " reads, ", stats_.ops[OP_WRITE],
+               " writes, ", stats_.ops[OP_FLUSH], " flushes, ",
+               stats_.bytes >> 10, " KB, ", npending_, " in flight, ",
+               stats_.slot_waits, " waits for a slot (",
+               stats_.slot_wait_ns / 1000, " us), ",
+               stats_.op_ns / 1000, " us issue to completion");
+  }
+
+  // The completion thread.
+  static void completer(void *arg)
+  {
+    memdisk *d = (memdisk *)arg;
+    for (;;) {
+      {
+        scoped_acquire a(&d->lock_);
+        while (!d->npending_)
+          d->done_cv_.sleep(&d->lock_);
+      }
+      d->deliver();
+      // The latencies are well below a scheduler tick, so wait out the
+      // next deadline by polling rather than with a timed sleep.
+      yield();
+    }
+  }
+
+private:
+  enum { OP_READ, OP_WRITE, OP_FLUSH, NOPS };
+
+  struct pending
+  {
+    u64 done_at;                // nsectime() at which it completes
+    u64 issued_at;
+    sref<disk_completion> dc;
+  };
+
+  // For the heap of pending I/Os, the earliest first
+  static bool later(const pending &a, const pending &b)
+  {
+    return a.done_at > b.done_at;
+  }
+
+  static u64 iov_bytes(kiovec *iov, int iov_cnt)
+  {
+    u64 n = 0;
+    for (int i = 0; i < iov_cnt; i++)
+      n += iov[i].iov_len;
+    return n;
+  }
+
+  // Racy, but the model only changes for later I/Os anyway.
+  bool modeled() const
+  {
+    return model_.read_us || model_.write_us || model_.flush_us ||
+      model_.mbps;
+  }
+
+  u32 queue_depth() const
+  {
+    u32 qd = model_.queue_depth;
+    return qd && qd < MEMIDE_MAX_QUEUE_DEPTH ? qd : MEMIDE_MAX_QUEUE_DEPTH;
+  }
+
+  // Queue an I/O whose data has moved, to complete when the model says.
+  void submit(int op, u64 bytes, sref<disk_completion> dc)
+  {
+    scoped_acquire a(&lock_);
+    if (!modeled()) {
+      stats_.ops[op]++;
+      stats_.bytes += bytes;
+      a.release();
+      dc->notify();
+      return;
+    }
+
+    u64 now = nsectime();
+    if (npending_ >= queue_depth()) {
+      stats_.slot_waits++;
+      while (npending_ >= queue_depth())
+        slot_cv_.sleep(&lock_);
+      u64 t = nsectime();
+      stats_.slot_wait_ns += t - now;
+      now = t;
+    }
+
+    u64 done_at;
+    if (op == OP_FLUSH) {
+      done_at = std::max(now, writes_done_) + model_.flush_us * 1000ull;
+    } else {
+      u64 start = std::max(now, busy_until_);
+      u64 xfer = model_.mbps ? bytes * 1000 / model_.mbps : 0;
+      busy_until_ = start + xfer;
+      done_at = busy_until_ +
+        (op == OP_READ ? model_.read_us : model_.write_us) * 1000ull;
+      if (op == OP_WRITE)
+        writes_done_ = std::max(writes_done_, done_at);
+    }
+    stats_.ops[op]++;
+    stats_.bytes += bytes;
+
+    pending &p = pending_[npending_++];
+    p.done_at = done_at;
+    p.issued_at = now;
+    p.dc = std::move(dc);
+    std::push_heap(pending_, pending_ + npending_, later);
+    if (npending_ == 1)
+      done_cv_.wake_all();
+  }
+
+  // Notify the completions of the I/Os whose time has come.
+  void deliver()
+  {
+    sref<disk_completion> done[16];
+    int ndone;
+    do {
+      ndone = 0;
+      scoped_acquire a(&lock_);
+      u64 now = nsectime();
+      while (npending_ && ndone < 16 && pending_[0].done_at <= now) {
+        std::pop_heap(pending_, pending_ + npending_, later);
+        pending &p = pending_[--npending_];
+        stats_.op_ns += now - p.issued_at;
+        done[ndone++] = std::move(p.dc);
+      }
+      if (ndone)
+        slot_cv_.wake_all();
+      a.release();
+      for (int i = 0; i < ndone; i++) {
+        done[i]->notify();
+        done[i].reset();
+      }
+    } while (ndone == 16);
+  }
+
+  void copy_in(kiovec *iov, int iov_cnt, u64 off)
   {
     u8 *p;
 
@@ -57,7 +296,7 @@ public:
     memmove(iov[0].iov_base, p, count);
   }
 
-  void writev(kiovec *iov, int iov_cnt, u64 off) override
+  void copy_out(kiovec *iov, int iov_cnt, u64 off)
   {
     u8 *p;
 
@@ -79,13 +318,29 @@ public:
     }
   }
 
-  void flush() override
-  {
-  }
-
 public:
   u8** data_ptr_;
   const u64 nbytes_;
+
+private:
+  spinlock lock_;
+  condvar slot_cv_;             // A queue slot was freed
+  condvar done_cv_;             // Something is pending
+  memide_model model_;
+  // The pending I/Os, as a heap ordered by later()
+  pending pending_[MEMIDE_MAX_QUEUE_DEPTH];
+  u32 npending_;
+  // When the transfers issued so far are over, and when the writes issued
+  // so far have completed (which flushes wait for).
+  u64 busy_until_;
+  u64 writes_done_;
+  struct {
+    u64 ops[NOPS];
+    u64 bytes;
+    u64 slot_waits;
+    u64 slot_wait_ns;
+    u64 op_ns;
+  } stats_;
 };
 
 static memdisk* md;
@@ -252,9 +507,31 @@ verify_backing_memory(u64 disk_size_bytes)
     assert(md->data_ptr_[i]);
 }
 
+static int
+memideread(mdev*, char *dst, u32 off, u32 n)
+{
+  window_stream s(dst, off, n);
+  if (md)
+    md->print_model(&s);
+  return s.get_used();
+}
+
+static int
+memidewrite(mdev*, const char *buf, u32 n)
+{
+  struct memide_model m;
+  if (n != sizeof(m) || !md)
+    return -1;
+  memcpy(&m, buf, sizeof(m));
+  md->set_model(m);
+  return n;
+}
+
 void
 initmemdisk(void)
 {
+  devsw[MAJ_MEMIDE].pread = memideread;
+  devsw[MAJ_MEMIDE].write = memidewrite;
 }
 
 void
@@ -262,6 +539,7 @@ initdisk(void)
 {
   md = new memdisk(_fs_img_size);
   disk_register(md);
+  threadpin(memdisk::completer, md, "memide", MEMIDE_CPU);
 
   struct timeval before, after;
 
@@ -4,6 +4,8 @@
 #include "major.h"
 #include "kstream.hh"
 #include "file.hh"
+#include "ioacct.hh"
+#include "pagecopy.hh"
 
 u64 root_mnum;
 mfs* root_fs;
@@ -59,6 +61,60 @@ skipelem(const char **rpath, char *name)
   return 1;
 }
 
+// The fast path of namex(), which walks path from m without taking
+// references to the directories along the way. With interrupts disabled,
+// refcache can't free an mnode that was linked into the tree while we were
+// looking at it, so finding a name in a directory is enough to keep the
+// mnode that it refers to around until we leave. Returns true and sets
+// *mnum to the mnode that namex() should return (or to 0 if there is none),
+// unless it gets to a directory that hasn't been loaded from the disk yet, or
+// to an mnode that isn't cached. Then it returns false, leaving *mnum at the
+// last directory it got to, and *path at the rest of the path.
+static bool
+namex_fast(mnode* m, const char** path, bool nameiparent,
+           strbuf<DIRSIZ>* name, u64* mnum)
+{
+  scoped_cli cli;
+  mfs *fs = m->fs_;
+  const char *p = *path;
+  const char *elem = p;
+
+  int r;
+  while ((r = skipelem(&p, name->buf_)) == 1) {
+    *mnum = 0;
+    if (m->type() != mnode::types::dir)
+      return true;
+
+    if (nameiparent && *p == '\0') {
+      *mnum = m->mnum_;
+      return true;
+    }
+
+    // as_dir() would load the directory, which can't happen here.
+    if (m->fs_ == root_fs && !m->is_initialized())
+      break;
+
+    u64 next;
+    if (!static_cast<mdir*>(m)->lookup_mnum(*name, &next))
+      return true;
+
+    mnode *nm = fs->mpeek(next);
+    if (!nm)
+      break;
+    m = nm;
+    elem = p;
+  }
+
+  if (r == 1) {
+    *mnum = m->mnum_;
+    *path = elem;
+    return false;
+  }
+
+  *mnum = (r == -1 || nameiparent) ? 0 : m->mnum_;
+  return true;
+}
+
 // Look up and return the mnode for a path name.  If nameiparent is true,
 // return the mnode for the parent and copy the final path element into name.
 static sref<mnode>
@@ -71,6 +127,27 @@ namex(sref<mnode> cwd, const char* path, bool nameiparent, strbuf<DIRSIZ>* name)
   else
     m = cwd;
 
+  // Only the mnode that we return is referenced, unless the fast path has to
+  // give up part way, in which case the rest of the walk takes references.
+  for (;;) {
+    const char *rest = path;
+    u64 mnum;
+    bool done = namex_fast(m.get(), &rest, nameiparent, name, &mnum);
+    if (done && !mnum)
+      return sref<mnode>();
+
+    // The mnode may have been freed between leaving namex_fast() and
+    // getting here, if it was unlinked meanwhile; then look again.
+    sref<mnode> next = m->fs_->mget(mnum);
+    if (!next)
+      continue;
+    if (done)
+      return next;
+    m = next;
+    path = rest;
+    break;
+  }
+
   int r;
   while ((r = skipelem(&path, name->buf_)) == 1) {
     if (m->type() != mnode::types::dir)
@@ -107,51 +184,110 @@ nameiparent(sref<mnode> cwd, const char* path, strbuf<DIRSIZ>* buf)
   return namex(cwd, path, true, buf);
 }
 
+// The number of pages that readm() and writem() look up at a time.
+enum { RW_BATCH_PAGES = 16 };
+
+// Copy between a file page and the buffer of a readm() or writem(). Returns
+// false if the buffer is a user one and the copy faulted.
+static bool
+copy_out(char *buf, const void *src, u64 len, bool user)
+{
+  if (user)
+    return putmem(buf, src, len) == 0;
+  if (len == PGSIZE)
+    pagecopy(buf, src);
+  else
+    memmove(buf, src, len);
+  return true;
+}
+
+static bool
+copy_in(void *dst, const char *buf, u64 len, bool user)
+{
+  if (user)
+    return fetchmem(dst, buf, len) == 0;
+  if (len == PGSIZE)
+    pagecopy(dst, buf);
+  else
+    memmove(dst, buf, len);
+  return true;
+}
+
 s64
-readm(sref<mnode> m, char* buf, u64 start, u64 nbytes)
+readm(sref<mnode> m, char* buf, u64 start, u64 nbytes, bool user)
 {
   if (m->type() != mnode::types::file)
     return -1;
 
+  mfile *mf = m->as_file();
+  sref<page_info> pis[RW_BATCH_PAGES];
   u64 end = start + nbytes;
   u64 off = 0;
+  bool faulted = false;
   while (start + off < end) {
-    u64 pos = start + off;
-    u64 pgbase = PGROUNDDOWN(pos);
-
-    mfile::page_state ps = m->as_file()->get_page(pgbase / PGSIZE);
-    sref<page_info> pi = ps.get_page_info();
-    if (!pi)
-      break;
+    u64 pgbase = PGROUNDDOWN(start + off);
+    u64 npages = (PGROUNDUP(end) - pgbase) / PGSIZE;
+
+    // Take the run of pages that are in memory in one go.
+    bool partial;
+    u32 n = mf->get_pages(pgbase / PGSIZE,
+                          std::min(npages, (u64)RW_BATCH_PAGES), pis, &partial);
+    if (!n) {
+      // Should this page have to come from the disk, bring the rest of the
+      // read's pages along with it.
+      mfile::page_state ps = mf->get_page(
+        pgbase / PGSIZE, std::min(npages - 1, (u64)READAHEAD_MAX_PAGES));
+      pis[0] = ps.get_page_info();
+      if (!pis[0])
+        break;
+      n = 1;
+      partial = ps.is_partial_page();
+    }
 
-    if (ps.is_partial_page()) {
-      u64 msize = *m->as_file()->read_size();
+    if (partial) {
+      u64 msize = *mf->read_size();
       if (end > msize)
         end = msize;
-      // Re-check loop condition, since end changed
-      if (pos >= end)
-        break;
     }
 
-    u64 pgoff = pos - pgbase;
-    u64 pgend = end - pgbase;
-    if (pgend > PGSIZE)
-      pgend = PGSIZE;
-
-    memmove(buf + off, (const char*) pi->va() + pgoff, pgend - pgoff);
-    off += (pgend - pgoff);
+    for (u32 i = 0; i < n; i++) {
+      // The loop condition is re-checked here, since end may have changed.
+      u64 pos = start + off;
+      if (pos < end) {
+        u64 pgoff = pos - pgbase;
+        u64 pgend = end - pgbase;
+        if (pgend > PGSIZE)
+          pgend = PGSIZE;
+
+        if (!copy_out(buf + off, (const char*) pis[i]->va() + pgoff,
+                      pgend - pgoff, user)) {
+          faulted = true;
+          end = start + off;
+        } else {
+          off += (pgend - pgoff);
+        }
+      }
+      pis[i].reset();
+      pgbase += PGSIZE;
+    }
   }
 
-  return off;
+  ioacct_charge(IOACCT_RBYTES, off, m->mnum_);
+  return (faulted && !off) ? -1 : (s64)off;
 }
 
 s64
 writem(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
-       mfile::resizer* parentresize)
+       mfile::resizer* parentresize, bool user)
 {
   if (m->type() != mnode::types::file)
     return -1;
 
+  if (!parentresize)
+    writeback_throttle();
+
+  mfile *mf = m->as_file();
+  sref<page_info> pis[RW_BATCH_PAGES];
   u64 end = start + nbytes;
   u64 off = 0;
   while (start + off < end) {
@@ -162,19 +298,72 @@ writem(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
     if (pgend > PGSIZE)
       pgend = PGSIZE;
 
+    // Overwrite the run of in-memory pages ahead in one go. The file's last
+    // page, if partial, may need resizing, so it is left to the
+    // page-at-a-time path below, along with pages that aren't in memory.
+    u64 npages = (PGROUNDUP(end) - pgbase) / PGSIZE;
+    if (npages > 1) {
+      bool partial;
+      u32 n = mf->get_pages(pgbase / PGSIZE,
+                            std::min(npages, (u64)RW_BATCH_PAGES), pis,
+                            &partial);
+      if (n && partial)
+        pis[--n].reset();
+      // Holes need a page of their own first (see below).
+      for (u32 i = 0; i < n; i++) {
+        if (is_zero_page(pis[i].get())) {
+          while (n > i)
+            pis[--n].reset();
+        }
+      }
+      if (n) {
+        u64 o = off;
+        u32 ncopied = n;
+        for (u32 i = 0; i < n; i++) {
+          u64 b = PGROUNDDOWN(start + o);
+          u64 e = std::min(end - b, (u64)PGSIZE);
+          // A fault may leave part of the page written, so it stays in the
+          // run to be marked dirty, but the write ends before it.
+          bool ok = copy_in((char*) pis[i]->va() + (start + o - b), buf + o,
+                            e - (start + o - b), user);
+          pis[i]->note_dirty_chunks(txn_chunk_mask(start + o - b,
+                                                   e - (start + o - b)));
+          if (!ok) {
+            ncopied = i;
+            while (n > i + 1)
+              pis[--n].reset();
+            end = start + o;
+            break;
+          }
+          o += e - (start + o - b);
+        }
+        mf->dirty(true);
+
+        // Pages reclaimed under us (see set_page_dirty()) get written again.
+        u32 ndone = std::min(mf->set_pages_dirty(pgbase / PGSIZE, n, pis),
+                             ncopied);
+        for (u32 i = 0; i < n; i++) {
+          if (i < ndone)
+            off += std::min(end, pgbase + (i + 1) * PGSIZE) - (start + off);
+          pis[i].reset();
+        }
+        continue;
+      }
+    }
+
     mfile::resizer *resize = parentresize;
     mfile::resizer scoped_resize;
 
     mfile::page_state ps = m->as_file()->get_page(pgbase / PGSIZE);
     sref<page_info> pi = ps.get_page_info();
+    if (is_zero_page(pi.get())) {
+      /* A hole: give it a page of its own to write to, then retry */
+      if (!m->as_file()->unshare_zero_page(pgbase / PGSIZE))
+        break;
+      continue;
+    }
     if (pi) {
       /* File already has the page we are about to update */
-      if (ps.is_partial_page() && resize == nullptr) {
-        if (pos + pgend - pgoff > *m->as_file()->read_size()) {
-          scoped_resize = m->as_file()->write_size();
-          resize = &scoped_resize;
-        }
-      }
 
       /*
        * What happens when writing past the end of the file but within
@@ -183,16 +372,41 @@ writem(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
        * is past the end of the file.  Our plan is to ensure that any
        * file truncate zeroes out any partial pages.  Currently, we only
        * have O_TRUNC, which discards all pages.
+       *
+       * The copy comes before taking the resizer: a fault on a user buffer
+       * mapped from this same file would need to read its size.
        */
-
-      memmove((char*) pi->va() + pgoff, buf + off, pgend - pgoff);
+      bool ok = copy_in((char*) pi->va() + pgoff, buf + off, pgend - pgoff,
+                        user);
+      pi->note_dirty_chunks(txn_chunk_mask(pgoff, pgend - pgoff));
       m->as_file()->dirty(true);
-      m->as_file()->set_page_dirty(pgbase / PGSIZE);
+      if (!ok) {
+        m->as_file()->set_page_dirty(pgbase / PGSIZE, pi.get());
+        break;
+      }
+
+      if (ps.is_partial_page() && resize == nullptr) {
+        if (pos + pgend - pgoff > *m->as_file()->read_size()) {
+          scoped_resize = m->as_file()->write_size();
+          resize = &scoped_resize;
+        }
+      }
+
+      if (!m->as_file()->set_page_dirty(pgbase / PGSIZE, pi.get()))
+        continue;  // Reclaimed under us; write to the page reloaded instead
 
       if (resize && *resize)
         resize->resize_nogrow(pos + pgend - pgoff);
     } else {
       /* File does not yet have the page we are about to update */
+      char* p = zalloc("file page");
+      if (!p)
+        break;
+      if (!copy_in(p + pgoff, buf + off, pgend - pgoff, user)) {
+        kfree(p);
+        break;
+      }
+
       if (!resize) {
         scoped_resize = m->as_file()->write_size();
         resize = &scoped_resize;
@@ -200,38 +414,27 @@ writem(sref<mnode> m, const char* buf, u64 start, u64 nbytes,
 
       /*
        * If this is a write past the end of the file, we may need
-       * to first zero out some memory locations, or even fill in
-       * a few zero pages.  We do not support sparse files -- the
-       * holes are filled in with zeroed pages.
+       * to first zero out the rest of the last page.  Any whole
+       * pages in between become holes, which share the zero page.
        */
       u64 msize = resize->read_size();
       while (msize < pgbase) {
-        if (msize % PGSIZE) {
+        if (msize % PGSIZE)
           resize->resize_nogrow(msize - (msize % PGSIZE) + PGSIZE);
-        } else {
-          char* p = zalloc("file page");
-          if (!p)
-            break;
-
-          pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
-          resize->resize_append(msize + PGSIZE, pi);
-        }
+        else
+          resize->resize_append_holes(pgbase);
 
         msize = resize->read_size();
       }
 
-      char* p = zalloc("file page");
-      if (!p)
-        break;
-
-      memmove(p + pgoff, buf + off, pgend - pgoff);
-      pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
+      pi = m->as_file()->new_page(p);
       resize->resize_append(pos + pgend - pgoff, pi);
     }
 
     off += (pgend - pgoff);
   }
 
+  ioacct_charge(IOACCT_WBYTES, off, m->mnum_);
   return off ?: -1;
 }
 
@@ -6,12 +6,163 @@
 #include "percpu.hh"
 #include "vm.hh"
 #include "file.hh"
+#include "condvar.hh"
+#include "shrinker.hh"
+#include "fsperf.hh"
+#include "ioacct.hh"
+#include "zcluster.hh"
+#include <algorithm>
 
 namespace {
   // 32MB mcache (XXX make this proportional to physical RAM)
   weakcache<pair<mfs*, u64>, mnode> mnode_cache(32 << 20);
+
+  // The clean-page candidates for the page-cache reclaimer. Every core keeps
+  // the pages that it brought into the page cache (by reading them from the
+  // disk, or by appending them to a file) in a list of its own, swept by its
+  // own reclaimer, so that there is no global LRU lock. An entry names the
+  // page by its file and index, since the mnode may be gone by the time the
+  // reclaimer gets to it; pi tells whether the page it saw is still the one
+  // in the file, and is null for entries that have been dropped.
+  struct pagecache_clock {
+    struct entry {
+      u64 mnum;
+      u64 pageidx;
+      page_info *pi;
+    };
+
+    spinlock lock;
+    std::vector<entry> entries;
+    size_t hand;   // The next entry to look at.
+    size_t ndead;  // Dropped entries, awaiting compaction.
+    size_t nlive;  // Live entries as of the last sweep.
+  };
+
+  percpu<pagecache_clock> pagecache_clocks;
+
+  // The number of dirty file pages, split across the cores so that writers
+  // don't share a counter. A core's count goes negative when it cleans pages
+  // dirtied on other cores; only the sum means anything.
+  percpu<std::atomic<s64>> dirty_page_counts;
+
+  void
+  count_dirty_pages(s64 n)
+  {
+    if (n)
+      dirty_page_counts.get_unchecked()->fetch_add(n);
+  }
+
+  s64
+  dirty_pages_total()
+  {
+    s64 n = 0;
+    for (int c = 0; c < NCPU; c++)
+      n += dirty_page_counts[c].load(std::memory_order_relaxed);
+    return n;
+  }
+
+  // The files that have been dirtied on a core, for its writeback thread to
+  // sync once they have stayed dirty for WRITEBACK_DIRTY_AGE_MS. A file shows
+  // up once for every time it goes from clean to dirty; entries of files that
+  // have since been synced are dropped as the writeback thread comes across
+  // them.
+  struct writeback_list {
+    spinlock lock;
+    condvar cv;
+    std::vector<u64> mnums;
+    bool kicked;
+  };
+
+  percpu<writeback_list> writeback_lists;
+
+  // The root_fs mnodes that have gone from clean to dirty on a core, for
+  // sync() to go through instead of the whole metadata-log table. Like the
+  // writeback lists, an mnode shows up once for every such transition, and
+  // entries of mnodes that are clean by the time sync() looks are dropped.
+  // The writeback threads prune the lists in between (see
+  // DIRTY_MNODE_LIST_PRUNE).
+  struct dirty_mnode_list {
+    spinlock lock;
+    std::vector<u64> mnums;
+  };
+
+  percpu<dirty_mnode_list> dirty_mnode_lists;
+
+  // Lookups waiting for pages being read in from the disk, hashed by page.
+  struct page_load_wait {
+    spinlock lock;
+    condvar cv;
+  };
+
+  page_load_wait page_load_waits[64];
+
+  size_t
+  page_load_hash(const mfile *mf, u64 pageidx)
+  {
+    return ((uptr)mf / sizeof(void *) + pageidx) % 64;
+  }
+
+  // Asynchronous readahead requests, to each CPU's readahead thread.
+  struct readahead_req {
+    sref<mnode> m;
+    u64 first;
+    u32 npages;
+  };
+
+  struct readahead_queue {
+    spinlock lock;
+    condvar cv;
+    std::vector<readahead_req> reqs;
+  };
+
+  percpu<readahead_queue> readahead_queues;
+
+  // Writers waiting for the dirty pages to go under the limit.
+  struct {
+    spinlock lock;
+    condvar cv;
+  } writeback_throttled;
+
+  void
+  pagecache_track(u64 mnum, u64 pageidx, page_info *pi)
+  {
+    if (!RECLAIM_LOW_PCT)
+      return;
+
+    auto &clock = *pagecache_clocks.get_unchecked();
+    auto l = clock.lock.guard();
+    clock.entries.push_back(pagecache_clock::entry{mnum, pageidx, pi});
+  }
+
+  // The page of zeros that every hole in every file shares. Nothing writes to
+  // it: writem() and file mappings put a private page in its place first (see
+  // mfile::unshare_zero_page()), so it never shows up in an rmap either.
+  // Allocated on first use, and never freed.
+  std::atomic<page_info*> zero_page;
 };
 
+sref<page_info>
+pagecache_zero_page(void)
+{
+  page_info *pi = zero_page.load(std::memory_order_acquire);
+  if (!pi) {
+    char *p = zalloc("zero page");
+    assert(p);
+    page_info *npi = new (page_info::of(p)) page_info();
+    if (zero_page.compare_exchange_strong(pi, npi))
+      pi = npi;
+    else
+      sref<page_info>::transfer(npi);  // Lost the race; drop ours
+  }
+  return sref<page_info>::newref(pi);
+}
+
+bool
+is_zero_page(const page_info *pi)
+{
+  return pi && pi == zero_page.load(std::memory_order_relaxed);
+}
+
 sref<mnode>
 mfs::mget(u64 mnum)
 {
@@ -29,6 +180,15 @@ mfs::mget(u64 mnum)
   }
 }
 
+mnode*
+mfs::mpeek(u64 mnum)
+{
+  mnode *m = mnode_cache.peek(make_pair(this, mnum));
+  if (!m || !m->valid_)
+    return nullptr;
+  return m;
+}
+
 mlinkref
 mfs::alloc(u8 type, u64 parent_mnum)
 {
@@ -66,7 +226,6 @@ mfs::alloc(u8 type, u64 parent_mnum)
 
   if (this == root_fs && (type == mnode::types::dir ||
                           type == mnode::types::file)) {
-    rootfs_interface->alloc_mnode_lock(mnum);
     rootfs_interface->alloc_metadata_log(mnum);
   }
   m->cache_pin(true);
@@ -77,8 +236,8 @@ mfs::alloc(u8 type, u64 parent_mnum)
 }
 
 mnode::mnode(mfs* fs, u64 mnum)
-  : fs_(fs), mnum_(mnum), initialized_(false), cache_pin_(false), dirty_(false),
-    valid_(false), delete_inode_(false)
+  : fs_(fs), mnum_(mnum), nlink_(mnumber(mnum).type()), initialized_(false),
+    cache_pin_(false), dirty_(false), valid_(false), delete_inode_(false), dirtied_at_(0)
 {
   kstats::inc(&kstats::mnode_alloc);
 }
@@ -100,7 +259,30 @@ mnode::dirty(bool flag)
 {
   if (dirty_ == flag)
     return;
-  cmpxch(&dirty_, !flag, flag);
+  if (!cmpxch(&dirty_, !flag, flag) || !flag)
+    return;
+
+  dirtied_at_ = nsectime();
+  if (fs_ != root_fs)
+    return;
+  bool prune;
+  {
+    auto &dl = *dirty_mnode_lists.get_unchecked();
+    auto l = dl.lock.guard();
+    dl.mnums.push_back(mnum_);
+    prune = dl.mnums.size() % DIRTY_MNODE_LIST_PRUNE == 0;
+  }
+  if (WRITEBACK_INTERVAL_MS && prune) {
+    auto &wb = *writeback_lists.get_unchecked();
+    auto l = wb.lock.guard();
+    wb.kicked = true;
+    wb.cv.wake_all();
+  }
+  if (WRITEBACK_INTERVAL_MS && type() == types::file) {
+    auto &wb = *writeback_lists.get_unchecked();
+    auto l = wb.lock.guard();
+    wb.mnums.push_back(mnum_);
+  }
 }
 
 bool
@@ -109,6 +291,72 @@ mnode::is_dirty()
   return dirty_;
 }
 
+static void
+sort_unique(std::vector<u64> *mnums)
+{
+  std::sort(mnums->begin(), mnums->end());
+  size_t n = 0;
+  for (size_t i = 0; i < mnums->size(); i++)
+    if (!n || (*mnums)[i] != (*mnums)[n - 1])
+      (*mnums)[n++] = (*mnums)[i];
+  while (mnums->size() > n)
+    mnums->pop_back();
+}
+
+// Move the numbers of the root_fs mnodes dirtied since the last call onto
+// mnums, sorted and without duplicates. Some of them may have been cleaned or
+// freed since.
+void
+take_dirty_mnodes(std::vector<u64> *mnums)
+{
+  for (int c = 0; c < NCPU; c++) {
+    std::vector<u64> v;
+    {
+      auto l = dirty_mnode_lists[c].lock.guard();
+      v.swap(dirty_mnode_lists[c].mnums);
+    }
+    for (auto mnum : v)
+      mnums->push_back(mnum);
+  }
+  sort_unique(mnums);
+}
+
+// Drop the entries of mnodes that are clean or gone, and duplicates, from a
+// core's dirty list. Without this, a file that fsync() cleans and a write
+// dirties again adds an entry every time, which only sync() would take.
+static void
+prune_dirty_mnodes(int cpu)
+{
+  auto &dl = dirty_mnode_lists[cpu];
+  std::vector<u64> v, keep;
+  {
+    auto l = dl.lock.guard();
+    v.swap(dl.mnums);
+  }
+  sort_unique(&v);
+  for (auto mnum : v) {
+    sref<mnode> m = root_fs->mget(mnum);
+    if (m && m->is_dirty())
+      keep.push_back(mnum);
+  }
+
+  // An mnode that is dirtied again in between has been re-added already;
+  // the next sync() drops the duplicate.
+  auto l = dl.lock.guard();
+  for (auto mnum : keep)
+    dl.mnums.push_back(mnum);
+}
+
+// Put back an mnode number taken by take_dirty_mnodes() whose mnode is still
+// dirty, so that the next sync() gets to it.
+void
+requeue_dirty_mnode(u64 mnum)
+{
+  auto &dl = *dirty_mnode_lists.get_unchecked();
+  auto l = dl.lock.guard();
+  dl.mnums.push_back(mnum);
+}
+
 void
 mnode::mark_inode_for_deletion()
 {
@@ -122,21 +370,50 @@ mnode::onzero()
 
   if (delete_inode_) {
     rootfs_interface->free_metadata_log(mnum_);
-    rootfs_interface->free_mnode_lock(mnum_);
 
     // Mark this inode for lazy deletion.
     auto l = rootfs_interface->delete_inums[cpu].lock.guard();
     rootfs_interface->delete_inums[cpu].mnum_list.push_back(mnum_);
   }
 
-  if (type() == types::file)
+  if (type() == types::file) {
     this->as_file()->remove_pgtable_mappings(0);
+    this->as_file()->uncount_dirty_pages();
+  }
 
   mnode_cache.cleanup(weakref_);
   kstats::inc(&kstats::mnode_free);
   delete this;
 }
 
+mnode::linkcount::linkcount(u8 type)
+  : snzi_((FS_NLINK_SNZI_TYPES & (1 << type)) ? new snzi_count(this) : nullptr)
+{
+}
+
+mnode::linkcount::~linkcount()
+{
+  delete snzi_;
+}
+
+void
+mnode::linkcount::snzi_count::onzero()
+{
+  // Runs with the SNZI's root locked, so it can't cross with the
+  // onnonzero() of a link that comes back.
+  mnode* m = container_from_member(lc_, &mnode::nlink_);
+  m->cache_pin(false);
+}
+
+void
+mnode::linkcount::snzi_count::onnonzero()
+{
+  // Whoever brought the link back holds a reference to the mnode, so
+  // it's still around to pin.
+  mnode* m = container_from_member(lc_, &mnode::nlink_);
+  m->cache_pin(true);
+}
+
 void
 mnode::linkcount::onzero()
 {
@@ -154,11 +431,33 @@ mfile::resizer::resize_nogrow(u64 newsize)
   u64 oldsize = mf_->size_;
   mf_->size_ = newsize;
   assert(PGROUNDUP(newsize) <= PGROUNDUP(oldsize));
+  if (newsize < mf_->trunc_size_.load(std::memory_order_relaxed))
+    mf_->trunc_size_.store(newsize, std::memory_order_relaxed);
   auto begin = mf_->pages_.find(PGROUNDUP(newsize) / PGSIZE);
   auto end = mf_->pages_.find(PGROUNDUP(oldsize) / PGSIZE);
   auto lock = mf_->pages_.acquire(begin, end);
+  s64 ndirty = 0;
+  mf_->pages_.for_each_set(begin.index(), end.index(),
+                           [&](size_t, size_t span, page_state &ps) {
+      if (ps.is_dirty_page())
+        ndirty += span;
+    });
+  count_dirty_pages(-ndirty);
   mf_->pages_.unset(begin, end);
 
+  if (ndirty) {
+    // Drop the truncated pages from the dirty list.
+    u64 npages = PGROUNDUP(newsize) / PGSIZE;
+    auto l = mf_->dirty_list_lock_.guard();
+    auto &list = mf_->dirty_list_;
+    size_t n = 0;
+    for (size_t i = 0; i < list.size(); i++)
+      if (list[i] < npages)
+        list[n++] = list[i];
+    while (list.size() > n)
+      list.pop_back();
+  }
+
   if (PGROUNDDOWN(newsize) > PGROUNDDOWN(oldsize)) {
     /* Grew to a multiple of PGSIZE */
     mf_->pages_.find(oldsize / PGSIZE)->set_partial_page(false);
@@ -193,14 +492,143 @@ mfile::resizer::resize_append(u64 size, sref<page_info> pi)
   mf_->pages_.fill(it, ps);
   mf_->size_ = size;
   mf_->dirty(true);
+  count_dirty_pages(1);
+  mf_->note_dirty_page(it.index());
+  if (mf_->fs_ == root_fs)
+    pagecache_track(mf_->mnum_, it.index(), pi.get());
+}
+
+// Grow the file, which must end on a page boundary, to the page boundary size
+// with holes. These all share the zero page instead of taking up memory of
+// their own, and being clean, they get no disk blocks either.
+void
+mfile::resizer::resize_append_holes(u64 size)
+{
+  assert(PGOFFSET(mf_->size_) == 0 && PGOFFSET(size) == 0);
+  assert(size > mf_->size_);
+
+  auto begin = mf_->pages_.find(mf_->size_ / PGSIZE);
+  auto end = mf_->pages_.find(size / PGSIZE);
+  auto lock = mf_->pages_.acquire(begin, end);
+  page_state ps(pagecache_zero_page());
+  mf_->pages_.fill(begin, end, ps);
+  mf_->size_ = size;
+  mf_->dirty(true);
 }
 
+// Grow the file to size over blocks that have just been preallocated on the
+// disk (see mfile::fallocate()): like the rest of the file on the disk, the
+// new pages are loaded on demand, and read as zeros.
 void
-mfile::set_page_dirty(u64 pageidx)
+mfile::resizer::resize_prealloc(u64 size)
+{
+  u64 oldsize = mf_->size_;
+  assert(size > oldsize);
+
+  if (PGROUNDDOWN(size) > PGROUNDDOWN(oldsize) && PGOFFSET(oldsize)) {
+    /* The old last page is now a whole page */
+    mf_->pages_.find(oldsize / PGSIZE)->set_partial_page(false);
+  }
+
+  auto begin = mf_->pages_.find(PGROUNDUP(oldsize) / PGSIZE);
+  auto end = mf_->pages_.find(PGROUNDUP(size) / PGSIZE);
+  auto lock = mf_->pages_.acquire(begin, end);
+  page_state ps(true);
+  mf_->pages_.fill(begin, end, ps);
+  mf_->size_ = size;
+}
+
+// Mark the page dirty, provided that it is still pi: the page-cache reclaimer
+// may have evicted the (then clean) page since the caller looked it up, in
+// which case the caller has to redo its write on a fresh copy of the page.
+bool
+mfile::set_page_dirty(u64 pageidx, page_info *pi)
 {
   auto it = pages_.find(pageidx);
   auto lock = pages_.acquire(it);
-  it->set_dirty_bit(true);
+  if (!it->has_page_info(pi))
+    return false;
+  if (!it->is_dirty_page()) {
+    it->set_dirty_bit(true);
+    count_dirty_pages(1);
+    note_dirty_page(pageidx);
+  }
+  return true;
+}
+
+// Put a page that has just gone from clean to dirty on the dirty list.
+void
+mfile::note_dirty_page(u64 pageidx)
+{
+  if (fs_ != root_fs)
+    return;
+  auto l = dirty_list_lock_.guard();
+  dirty_list_.push_back(pageidx);
+}
+
+// Take the pages on the dirty list that are still dirty, returning those in
+// [first, end) in *pages, sorted and without duplicates. Any outside it (not
+// asked for, or appended since the caller looked at the size) stay on the
+// list.
+void
+mfile::take_dirty_pages(u64 first, u64 end, std::vector<u32> *pages)
+{
+  std::vector<u64> list;
+  {
+    auto l = dirty_list_lock_.guard();
+    list.swap(dirty_list_);
+  }
+  std::sort(list.begin(), list.end());
+
+  for (size_t i = 0; i < list.size(); i++) {
+    u64 idx = list[i];
+    if (i && idx == list[i - 1])
+      continue;
+    auto it = pages_.find(idx);
+    if (!it.is_set() || !it->is_dirty_page())
+      continue;
+    if (idx >= first && idx < end) {
+      pages->push_back(idx);
+    } else {
+      auto l = dirty_list_lock_.guard();
+      dirty_list_.push_back(idx);
+    }
+  }
+}
+
+// The page_info of p, a page just allocated to hold a page of this file.
+sref<page_info>
+mfile::new_page(char *p)
+{
+  auto pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
+  pi->set_memacct(fs_ == root_fs ? MEMACCT_FILE_PAGES : MEMACCT_ANON_PAGES);
+  return pi;
+}
+
+// Replace the zero page at pageidx with a private page of zeros, which the
+// caller is about to write to. Returns false if out of memory. The caller has
+// to look the page up again either way, as it may have changed meanwhile.
+bool
+mfile::unshare_zero_page(u64 pageidx)
+{
+  char *p = zalloc("file page");
+  if (!p)
+    return false;
+  auto pi = new_page(p);
+
+  auto it = pages_.find(pageidx);
+  {
+    auto lock = pages_.acquire(it);
+    if (!it.is_set() || !is_zero_page(it->get_page_info().get()))
+      return true;
+    page_state ps(pi);
+    if (it->is_partial_page())
+      ps.set_partial_page(true);
+    pages_.fill(it, ps);
+  }
+  if (fs_ == root_fs)
+    pagecache_track(mnum_, pageidx, pi.get());
+  return true;
 }
 
 void
@@ -214,40 +642,471 @@ mfile::resizer::initialize_from_disk(u64 size)
   mf_->size_ = size;
 }
 
-mfile::page_state
-mfile::get_page(u64 pageidx)
+// Claim the page at pageidx for loading from the disk, if it is in the file
+// but not in memory, by installing a fresh page marked as loading: other
+// lookups of the page then wait for it rather than reading it in again.
+// Returns the claimed page, or null if there's nothing to load (or, for
+// readahead, no memory to load it into).
+sref<page_info>
+mfile::claim_page(u64 pageidx, bool readahead)
 {
   auto it = pages_.find(pageidx);
-  if (!it.is_set())
-    return mfile::page_state();
-  if (it->get_page_info() == nullptr && fs_ == root_fs) {
-      // We may block.  If scheduling is disabled, this could lead to
-      // deadlock, so throw a blocking_io exception with an IO retry.
-      // Currently this is used by pagefault and may need to be
-      // generalized to be used in other situations.
-      if (check_critical(critical_mask::NO_SCHED))
-        throw blocking_io(sref<mfile>::newref(this), pageidx);
-
-      // Read page from disk
-      char *p = zalloc("file page");
-      assert(p);
-
-      auto pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
-      size_t pos = pageidx * PGSIZE;
-      size_t nbytes = size_ - pos;
-      if (nbytes > PGSIZE)
-        nbytes = PGSIZE;
-
-      size_t bytes_read = rootfs_interface->load_file_page(mnum_, p, pos, nbytes);
+  if (!it.is_set() || it->get_page_info() != nullptr)
+    return sref<page_info>();
+
+  char *p = zalloc("file page");
+  if (!p && readahead)
+    return sref<page_info>();
+  assert(p);
+
+  auto pi = new_page(p);
+  auto lock = pages_.acquire(it);
+  if (!it.is_set() || it->get_page_info() != nullptr)
+    return sref<page_info>();
+  page_state ps(pi);
+  ps.set_loading(true);
+  pages_.fill(it, ps);
+  return pi;
+}
+
+// Claim the pages to be read ahead in [first, first + npages), up to the end
+// of the file.
+void
+mfile::claim_pages(u64 first, u64 npages, page_load_list *claimed)
+{
+  u64 end = std::min(first + npages, (u64)PGROUNDUP(size_) / PGSIZE);
+  for (u64 idx = first; idx < end; idx++) {
+    if (idx % (HUGE_PGSIZE / PGSIZE) == 0 && claim_huge_span(idx, claimed)) {
+      idx += HUGE_PGSIZE / PGSIZE - 1;
+      continue;
+    }
+    sref<page_info> pi = claim_page(idx, true);
+    if (pi)
+      claimed->push_back(std::make_pair(idx, std::move(pi)));
+  }
+}
+
+// For a big file, claim the whole 2MB-aligned span of pages around pageidx at
+// once, backed by one physically contiguous block, so that a read-only mmap
+// of the span can be mapped with a single large page (see
+// vmap::pagefault_huge()). The span must lie within the file and be entirely
+// out of memory. Returns false if it doesn't qualify or no 2MB block is free.
+bool
+mfile::claim_huge_span(u64 pageidx, page_load_list *claimed)
+{
+  const u64 npages = HUGE_PGSIZE / PGSIZE;
+  u64 first = pageidx & ~(npages - 1);
+  if (!HUGEPAGE_FILE_MIN_BYTES || size_ < HUGEPAGE_FILE_MIN_BYTES ||
+      (first + npages) * PGSIZE > size_)
+    return false;
+
+  auto begin = pages_.find(first);
+  auto end = pages_.find(first + npages);
+  for (auto it = begin; it < end; it += it.span())
+    if (!it.is_set() || it->get_page_info() != nullptr)
+      return false;
+
+  // Buddy blocks are naturally aligned, but don't count on it.
+  char *p = kalloc("file huge page", HUGE_PGSIZE);
+  if (!p)
+    return false;
+  if (v2p(p) % HUGE_PGSIZE) {
+    kfree(p, HUGE_PGSIZE);
+    return false;
+  }
+  memset(p, 0, HUGE_PGSIZE);
+
+  auto lock = pages_.acquire(begin, end);
+  for (auto it = begin; it < end; it += it.span()) {
+    if (!it.is_set() || it->get_page_info() != nullptr) {
+      kfree(p, HUGE_PGSIZE);
+      return false;
+    }
+  }
+
+  // Each page of the span gets a page_info of its own, so that it is
+  // reference counted, reclaimed and (the buddy allocator permitting) freed
+  // just like any other page.
+  auto it = begin;
+  for (u64 i = 0; i < npages; i++, ++it) {
+    auto pi = new_page(p + i * PGSIZE);
+    page_state ps(pi);
+    ps.set_loading(true);
+    pages_.fill(it, ps);
+    claimed->push_back(std::make_pair(first + i, std::move(pi)));
+  }
+  return true;
+}
+
+// Read the claimed pages in from the disk, fetching all of their blocks with
+// one batch of asynchronous reads, and hand them over to whoever is waiting.
+void
+mfile::load_pages(const page_load_list &claimed)
+{
+  if (claimed.empty())
+    return;
+
+  scoped_disk_tag tag(DISKTRACE_PAGEFILL);
+  u64 size = size_;
+  u64 first = claimed.front().first * PGSIZE;
+  u64 last = claimed.back().first * PGSIZE;
+  if (claimed.size() > 1 && first < size)
+    rootfs_interface->readahead_file(mnum_, first,
+                                     std::min(last + PGSIZE, size) - first);
+
+  for (auto &c : claimed) {
+    size_t pos = c.first * PGSIZE;
+    size_t nbytes = pos < size ? std::min((u64)PGSIZE, size - pos) : 0;
+    // A hole on the disk becomes the zero page instead.
+    bool hole = !nbytes || rootfs_interface->is_file_hole(mnum_, pos, nbytes);
+    if (!hole) {
+      size_t bytes_read = rootfs_interface->load_file_page(
+        mnum_, (char *)c.second->va(), pos, nbytes);
       assert(nbytes == bytes_read);
+      ioacct_charge(IOACCT_PAGEFILLS, 1, mnum_);
+    }
+
+    auto it = pages_.find(c.first);
+    bool installed = false;
+    {
       auto lock = pages_.acquire(it);
-      page_state ps(pi);
-      if (PGOFFSET(nbytes))
-        ps.set_partial_page(true);
-      pages_.fill(it, ps);
+      // A truncate may have dropped the page in the meantime.
+      if (it.is_set() && it->has_page_info(c.second.get())) {
+        if (hole) {
+          page_state ps(pagecache_zero_page());
+          pages_.fill(it, ps);
+        }
+        if (PGOFFSET(nbytes))
+          it->set_partial_page(true);
+        it->set_loading(false);
+        installed = !hole;
+      }
+    }
+    if (installed)
+      pagecache_track(mnum_, c.first, c.second.get());
+
+    auto &w = page_load_waits[page_load_hash(this, c.first)];
+    scoped_acquire a(&w.lock);
+    w.cv.wake_all();
+  }
+}
+
+void
+mfile::wait_for_load(u64 pageidx)
+{
+  auto &w = page_load_waits[page_load_hash(this, pageidx)];
+  scoped_acquire a(&w.lock);
+  for (;;) {
+    auto it = pages_.find(pageidx);
+    if (!it.is_set() || !it->is_loading())
+      return;
+    w.cv.sleep(&w.lock);
+  }
+}
+
+// If the page has to be loaded from the disk, the readahead_pages pages
+// following it are read in along with it. A page that someone else is
+// already loading is waited for.
+mfile::page_state
+mfile::get_page(u64 pageidx, u32 readahead_pages)
+{
+  FSPERF_REGION(FSPERF_PAGECACHE, "mfile::get_page");
+  for (;;) {
+    auto it = pages_.find(pageidx);
+    if (!it.is_set())
+      return mfile::page_state();
+    if (fs_ != root_fs ||
+        (it->get_page_info() != nullptr && !it->is_loading())) {
+      page_state ps = it->copy_consistent();
+      ps.mark_referenced();
+      return ps;
+    }
+
+    // We may block.  If scheduling is disabled, this could lead to
+    // deadlock, so throw a blocking_io exception with an IO retry.
+    // Currently this is used by pagefault and may need to be
+    // generalized to be used in other situations.
+    if (check_critical(critical_mask::NO_SCHED))
+      throw blocking_io(sref<mfile>::newref(this), pageidx);
+
+    if (it->is_loading()) {
+      wait_for_load(pageidx);
+      continue;
+    }
+
+    page_load_list claimed;
+    if (!claim_huge_span(pageidx, &claimed)) {
+      sref<page_info> pi = claim_page(pageidx, false);
+      if (!pi)
+        continue;  // Someone else got to it first
+      claimed.push_back(std::make_pair(pageidx, std::move(pi)));
+      claim_pages(pageidx + 1, readahead_pages, &claimed);
+    }
+    load_pages(claimed);
+  }
+}
+
+// Look up the pages [first, first + npages) with a single walk of the radix
+// array, for readm() and writem() to copy in one go, taking a reference on
+// each page found. Stops at the first page that has to come from the disk
+// (which is left to get_page()), and after the file's last page if that is a
+// partial page, setting *partial. Returns the number of pages found.
+u32
+mfile::get_pages(u64 first, u32 npages, sref<page_info> *pis, bool *partial)
+{
+  *partial = false;
+
+  // As in page_state::copy_consistent(), no page_info may be freed by
+  // refcache between reading the page state and taking the reference.
+  scoped_cli cli;
+  auto it = pages_.find(first);
+  u32 n = 0;
+  while (n < npages) {
+    if (!it.is_set() || it->is_loading())
+      break;
+    sref<page_info> pi = it->get_page_info();
+    if (!pi)
+      break;
+    pi->mark_referenced();
+    pis[n++] = std::move(pi);
+    if (it->is_partial_page()) {
+      *partial = true;
+      break;
+    }
+    ++it;
+  }
+  return n;
+}
+
+// Mark pages [first, first + npages) dirty, like set_page_dirty() but taking
+// the page locks all at once. Returns the number of leading pages that were
+// still the ones in pis; the writes to the rest have to be redone.
+u32
+mfile::set_pages_dirty(u64 first, u32 npages, const sref<page_info> *pis)
+{
+  auto begin = pages_.find(first);
+  auto end = pages_.find(first + npages);
+  auto lock = pages_.acquire(begin, end);
+  u32 n = 0;
+  s64 ndirty = 0;
+  for (auto it = begin; n < npages; ++it, n++) {
+    if (!it.is_set() || !it->has_page_info(pis[n].get()))
+      break;
+    if (!it->is_dirty_page()) {
+      it->set_dirty_bit(true);
+      ndirty++;
+      note_dirty_page(first + n);
+    }
+  }
+  count_dirty_pages(ndirty);
+  return n;
+}
+
+// Read in the pages [first, first + npages) that aren't in memory yet.
+void
+mfile::read_ahead(u64 first, u32 npages)
+{
+  page_load_list claimed;
+  claim_pages(first, npages, &claimed);
+  load_pages(claimed);
+}
+
+// Read the pages in in the background, on this CPU's readahead thread, so
+// that a sequential reader finds them in memory by the time it gets to them.
+// This is only a hint: it is dropped if the readahead thread is too far
+// behind.
+void
+mfile::readahead_async(u64 first, u32 npages)
+{
+  if (fs_ != root_fs || !npages)
+    return;
+
+  auto &q = *readahead_queues.get_unchecked();
+  auto l = q.lock.guard();
+  if (q.reqs.size() >= READAHEAD_ASYNC_QUEUE)
+    return;
+  if (q.reqs.empty())
+    q.cv.wake_all();
+  q.reqs.push_back(readahead_req{sref<mnode>::newref(this), first, npages});
+}
+
+// After a fault on page pageidx of a MADV_SEQUENTIAL mapping: once the
+// reader gets past the trigger page, read the next window in the background
+// and move the trigger half a window on, and drop the clean pages that are
+// more than two windows behind, which a sequential reader is done with. The
+// reader can skip over pages (fault-around maps them without a fault), so
+// both go by thresholds rather than exact pages. A reader that jumps back
+// starts over.
+void
+mfile::sequential_fault(u64 pageidx)
+{
+  const u64 window = READAHEAD_MAX_PAGES;
+
+  u64 next = seq_ra_next_.load(std::memory_order_relaxed);
+  if ((pageidx >= next || pageidx + window < next) &&
+      seq_ra_next_.compare_exchange_strong(next, pageidx + window / 2))
+    readahead_async(pageidx + window / 2, window);
+
+  if (pageidx < 2 * window)
+    return;
+  u64 end = pageidx - 2 * window + 1;
+  u64 first = seq_drop_next_.load(std::memory_order_relaxed);
+  if (first > end)
+    first = end - 1;
+  // Bound the work of one fault; whatever is left goes with the next one.
+  if (end - first > window)
+    end = first + window;
+  if (first < end && seq_drop_next_.compare_exchange_strong(first, end))
+    for (u64 i = first; i < end; i++)
+      put_page(i);
+}
+
+static void
+readahead_thread(void *arg)
+{
+  auto &q = readahead_queues[(int)(uptr)arg];
+  std::vector<readahead_req> reqs;
+
+  for (;;) {
+    {
+      auto l = q.lock.guard();
+      while (q.reqs.empty())
+        q.cv.sleep(&q.lock);
+      reqs.swap(q.reqs);
+    }
+
+    for (auto &r : reqs)
+      r.m->as_file()->read_ahead(r.first, r.npages);
+    reqs.clear();
   }
+}
 
-  return it->copy_consistent();
+void
+init_readahead(void)
+{
+  for (int c = 0; c < ncpu; c++) {
+    char namebuf[32];
+    snprintf(namebuf, sizeof(namebuf), "readahead_%u", c);
+    threadpin(readahead_thread, (void *)(uptr)c, namebuf, c);
+  }
+}
+
+// An O_APPEND write of up to APPEND_MAX_PAGES pages from buf (a user address
+// if user is set). Returns the number of bytes appended, or -1, and sets *end
+// to the offset just past them.
+//
+// The copy happens outside the resizer, in parallel with other appenders:
+// the writer reserves a range at the predicted end of the file and copies
+// into pages of its own laid out for it, plus a head buffer for the rest of
+// the file's last page. Only publishing them takes the resizer, in
+// reservation order. Should the file's size not be the predicted one by
+// then (another kind of write or a truncate got in, or a predecessor came
+// up short), the copied data goes in with writem() at the real end instead.
+s64
+mfile::append(const char *buf, u64 n, bool user, u64 *end)
+{
+  n = std::min(n, (u64)APPEND_MAX_PAGES * PGSIZE);
+  writeback_throttle();
+
+  u64 start = append_end_.fetch_add(n);
+  u64 head = std::min(n, PGROUNDUP(start) - start);
+  char *headbuf = nullptr;
+  char *pages[APPEND_MAX_PAGES];
+  u32 npages = 0;
+  u64 copied = 0;
+  auto copy_in = [user](char *dst, const char *src, u64 len) {
+    if (user)
+      return fetchmem(dst, src, len) == 0;
+    memmove(dst, src, len);
+    return true;
+  };
+  if (head) {
+    headbuf = kalloc("append head");
+    if (headbuf && copy_in(headbuf, buf, head))
+      copied = head;
+  }
+  while ((copied || !head) && copied < n) {
+    char *p = zalloc("file page");
+    if (!p)
+      break;
+    pages[npages++] = p;
+    u64 len = std::min(n - copied, (u64)PGSIZE);
+    if (!copy_in(p, buf + copied, len))
+      break;
+    copied += len;
+  }
+
+  {
+    scoped_acquire l(&append_lock_);
+    while (append_published_ != start)
+      append_cv_.sleep(&append_lock_);
+  }
+
+  u64 size, newsize;
+  {
+    resizer resize = write_size();
+    size = resize.read_size();
+    sref<page_info> pi;
+    if (size == start && head && copied) {
+      // The head goes into the file's last page, which may have to be
+      // reloaded if it was reclaimed while we copied.
+      for (;;) {
+        pi = get_page(start / PGSIZE).get_page_info();
+        if (!pi || is_zero_page(pi.get()))
+          break;
+        memmove((char*)pi->va() + PGOFFSET(start), headbuf, head);
+        pi->note_dirty_chunks(txn_chunk_mask(PGOFFSET(start), head));
+        dirty(true);
+        if (set_page_dirty(start / PGSIZE, pi.get()))
+          break;
+      }
+    }
+    if (size == start && (!head || (pi && !is_zero_page(pi.get())))) {
+      if (head && copied)
+        resize.resize_nogrow(start + head);
+      for (u32 i = 0; i < npages && start + head + i * PGSIZE < start + copied;
+           i++) {
+        pi = new_page(pages[i]);
+        pages[i] = nullptr;
+        resize.resize_append(std::min(start + copied,
+                                      start + head + (i + 1) * PGSIZE), pi);
+      }
+    } else if (copied) {
+      sref<mnode> m = sref<mnode>::newref(this);
+      u64 off = size;
+      if (head) {
+        writem(m, headbuf, off, head, &resize);
+        off += head;
+      }
+      for (u32 i = 0; off < size + copied; i++) {
+        u64 len = std::min(size + copied - off, (u64)PGSIZE);
+        writem(m, pages[i], off, len, &resize);
+        off += len;
+      }
+    }
+    newsize = resize.read_size();
+  }
+
+  {
+    // If no one has reserved past us, line the reservations back up with
+    // the file's size, for the next appender to predict right.
+    scoped_acquire l(&append_lock_);
+    u64 expected = start + n;
+    if (append_end_.compare_exchange_strong(expected, newsize))
+      append_published_ = newsize;
+    else
+      append_published_ = start + n;
+  }
+  append_cv_.wake_all();
+
+  if (headbuf)
+    kfree(headbuf);
+  for (u32 i = 0; i < npages; i++)
+    if (pages[i])
+      kfree(pages[i]);
+
+  *end = newsize;
+  return (newsize > size || !n) ? (s64)(newsize - size) : -1;
 }
 
 // Evict a (clean) page from the page-cache.
@@ -259,23 +1118,298 @@ mfile::put_page(u64 pageidx)
     return;
 
   sref<page_info> pi = it->get_page_info();
-  if (pi != nullptr && fs_ == root_fs) {
-    // Don't evict dirty pages.
-    if (it->is_dirty_page())
+  if (pi == nullptr || fs_ != root_fs)
+    return;
+
+  {
+    // Recheck under the lock: a concurrent put_page() or reclaim_page() may
+    // have taken the page out already, and only one of us may drop the page
+    // cache's reference.
+    auto lock = pages_.acquire(it);
+    if (!it->has_page_info(pi.get()))
+      return;
+    // Don't evict dirty pages, pages still being read in, or mlock()ed
+    // pages.
+    if (it->is_dirty_page() || it->is_loading() || pi->is_pinned())
       return;
+    // The page cache's reference to pi is now ours.
+    it->reset_page_info();
+  }
+
+  std::vector<page_info::rmap_entry> rmap_vec;
+  pi->get_rmap_vector(rmap_vec);
+  for (auto rmap_it = rmap_vec.begin(); rmap_it != rmap_vec.end(); rmap_it++)
+    rmap_it->first->clear_mapping(rmap_it->second);
 
+  pi->dec();
+}
+
+// Look at the page at pageidx for the page-cache reclaimer, which last saw
+// pi there: if the page is still pi and clean, and it hasn't been looked up
+// since the reclaimer's last look, evict it (if evict is set). Otherwise just
+// clear its referenced bit, so that it gets evicted next time unless it is
+// used in the meantime.
+mfile::reclaim_result
+mfile::reclaim_page(u64 pageidx, page_info *pi, bool evict)
+{
+  auto it = pages_.find(pageidx);
+  if (!it.is_set())
+    return reclaim_result::gone;
+
+  {
+    auto lock = pages_.acquire(it);
+    if (!it->has_page_info(pi))
+      return reclaim_result::gone;
+    if (!evict || it->is_dirty_page() || it->is_loading() ||
+        pi->is_pinned() || pi->test_and_clear_referenced())
+      return reclaim_result::kept;
+    // The page cache's reference to pi is now ours.
     it->reset_page_info();
+  }
+
+  std::vector<page_info::rmap_entry> rmap_vec;
+  pi->get_rmap_vector(rmap_vec);
+  for (auto rmap_it = rmap_vec.begin(); rmap_it != rmap_vec.end(); rmap_it++)
+    rmap_it->first->clear_mapping(rmap_it->second);
 
-    std::vector<page_info::rmap_entry> rmap_vec;
-    pi->get_rmap_vector(rmap_vec);
-    for (auto rmap_it = rmap_vec.begin(); rmap_it != rmap_vec.end(); rmap_it++)
-      rmap_it->first->clear_mapping(rmap_it->second);
+  pi->dec();
+  return reclaim_result::evicted;
+}
 
-    pi->dec();
+// Sweep CPU cpu's list of pages from the hand on, looking at up to
+// PAGECACHE_RECLAIM_BATCH of them, and dropping the entries of pages that
+// have been evicted or are no longer in the page cache. Returns the number of
+// pages evicted.
+static size_t
+pagecache_sweep(int cpu, bool evict)
+{
+  auto &clock = pagecache_clocks[cpu];
+  pagecache_clock::entry batch[PAGECACHE_RECLAIM_BATCH];
+  size_t slots[PAGECACHE_RECLAIM_BATCH];
+  size_t n = 0;
+
+  {
+    auto l = clock.lock.guard();
+    size_t size = clock.entries.size();
+    for (size_t i = 0; i < size && n < PAGECACHE_RECLAIM_BATCH; i++) {
+      if (clock.hand >= size)
+        clock.hand = 0;
+      size_t slot = clock.hand++;
+      if (!clock.entries[slot].pi)
+        continue;
+      batch[n] = clock.entries[slot];
+      slots[n++] = slot;
+    }
+  }
 
+  // Entries are only ever appended by other cores, and only the reclaimer
+  // moves or drops them, so the slots stay put while the lock is released.
+  size_t nevicted = 0, ndrop = 0;
+  for (size_t i = 0; i < n; i++) {
+    auto r = mfile::reclaim_result::gone;
+    sref<mnode> m = root_fs->mget(batch[i].mnum);
+    if (m && m->is_initialized())
+      r = m->as_file()->reclaim_page(batch[i].pageidx, batch[i].pi, evict);
+    if (r == mfile::reclaim_result::kept) {
+      slots[i] = ~0ul;
+      continue;
+    }
+    if (r == mfile::reclaim_result::evicted)
+      nevicted++;
+    ndrop++;
+  }
+
+  auto l = clock.lock.guard();
+  for (size_t i = 0; i < n; i++)
+    if (slots[i] != ~0ul)
+      clock.entries[slots[i]].pi = nullptr;
+  clock.ndead += ndrop;
+
+  // Squeeze out the dropped entries once they make up half the list,
+  // keeping the hand on the same live entry.
+  if (clock.ndead > clock.entries.size() / 2) {
+    size_t k = 0, hand = 0;
+    for (size_t i = 0; i < clock.entries.size(); i++) {
+      if (i == clock.hand)
+        hand = k;
+      if (clock.entries[i].pi)
+        clock.entries[k++] = clock.entries[i];
+    }
+    if (clock.hand >= clock.entries.size())
+      hand = k;
+    while (clock.entries.size() > k)
+      clock.entries.pop_back();
+    clock.hand = hand;
+    clock.ndead = 0;
+  }
+  return nevicted;
+}
+
+// The page-cache shrinker. Under memory pressure, it evicts clean pages from
+// the CPU's list in CLOCK order, giving up once a whole trip around the list
+// turns up nothing to evict. When there's no memory pressure it only prunes
+// the entries of pages that have gone away, once the list has doubled in size.
+class pagecache_shrinker : public shrinker
+{
+public:
+  pagecache_shrinker() : shrinker("pagecache") { }
+
+  size_t count(int cpu) override
+  {
+    auto &clock = pagecache_clocks[cpu];
+    auto l = clock.lock.guard();
+    return clock.entries.size() - clock.ndead;
+  }
+
+  size_t scan(int cpu, size_t nr) override
+  {
+    size_t scanned = 0, nevicted = 0;
+    while (nevicted < nr) {
+      // Every page gets one pass to clear its referenced bit, and one more
+      // to be evicted.
+      if (scanned > 2 * count(cpu))
+        break;
+      size_t n = pagecache_sweep(cpu, true);
+      nevicted += n;
+      if (n)
+        scanned = 0;
+      else
+        scanned += PAGECACHE_RECLAIM_BATCH;
+    }
+    update_nlive(cpu);
+    return nevicted;
+  }
+
+  void idle(int cpu) override
+  {
+    auto &clock = pagecache_clocks[cpu];
+    size_t size, nlive;
+    {
+      auto l = clock.lock.guard();
+      size = clock.entries.size();
+      nlive = clock.nlive;
+    }
+    if (size < 2 * nlive + PAGECACHE_RECLAIM_BATCH)
+      return;
+    for (size_t i = 0; i < size; i += PAGECACHE_RECLAIM_BATCH)
+      pagecache_sweep(cpu, false);
+    update_nlive(cpu);
+  }
+
+private:
+  static void update_nlive(int cpu)
+  {
+    auto &clock = pagecache_clocks[cpu];
+    auto l = clock.lock.guard();
+    clock.nlive = clock.entries.size() - clock.ndead;
+  }
+};
+
+static pagecache_shrinker the_pagecache_shrinker;
+
+// The writeback thread of CPU cpu. Every WRITEBACK_INTERVAL_MS (or as soon as
+// a throttled writer kicks it) it syncs the files dirtied on the CPU that
+// have stayed dirty for WRITEBACK_DIRTY_AGE_MS, or all of them while there
+// are more than WRITEBACK_BACKGROUND_PAGES dirty pages. The files go onto the
+// CPU's journal just like for an fsync, and the journal's flusher thread
+// commits them in the background, so writeback changes nothing about what a
+// crash can leave behind.
+static void
+writeback_thread(void *arg)
+{
+  int cpu = (uptr)arg;
+  auto &wb = writeback_lists[cpu];
+  std::vector<u64> mnums, keep;
+
+  for (;;) {
+    {
+      auto l = wb.lock.guard();
+      u64 deadline = nsectime() + (u64)WRITEBACK_INTERVAL_MS * 1000000ull;
+      while (!wb.kicked && nsectime() < deadline)
+        wb.cv.sleep_to(&wb.lock, deadline);
+      wb.kicked = false;
+      mnums.swap(wb.mnums);
+    }
+
+    bool all = dirty_pages_total() > WRITEBACK_BACKGROUND_PAGES;
+    u64 now = nsectime();
+    bool synced = false;
+    for (auto mnum : mnums) {
+      sref<mnode> m = root_fs->mget(mnum);
+      if (!m || !m->is_dirty())
+        continue;
+      if (!all && m->dirtied_at() +
+          (u64)WRITEBACK_DIRTY_AGE_MS * 1000000ull > now) {
+        keep.push_back(mnum);
+        continue;
+      }
+      rootfs_interface->process_metadata_log(get_tsc(), mnum, cpu);
+      m->as_file()->sync_file(cpu);
+      synced = true;
+    }
+    mnums.clear();
+
+    if (synced)
+      rootfs_interface->fsync_ticket(cpu);
+
+    {
+      auto l = wb.lock.guard();
+      for (auto mnum : keep)
+        wb.mnums.push_back(mnum);
+    }
+    keep.clear();
+
+    prune_dirty_mnodes(cpu);
+
+    scoped_acquire a(&writeback_throttled.lock);
+    writeback_throttled.cv.wake_all();
   }
 }
 
+void
+init_writeback(void)
+{
+  if (!WRITEBACK_INTERVAL_MS)
+    return;
+
+  for (int c = 0; c < ncpu; c++) {
+    char namebuf[32];
+    snprintf(namebuf, sizeof(namebuf), "writeback_%u", c);
+    threadpin(writeback_thread, (void *)(uptr)c, namebuf, c);
+  }
+}
+
+// Hold up a writer while there are WRITEBACK_DIRTY_LIMIT_PAGES dirty pages or
+// more, kicking the writeback threads to sync them, for up to
+// WRITEBACK_THROTTLE_MAX_MS. The caller must not be holding any mfile's
+// resizer, which writeback may need.
+void
+writeback_throttle(void)
+{
+  if (!WRITEBACK_INTERVAL_MS || !WRITEBACK_DIRTY_LIMIT_PAGES)
+    return;
+
+  // Only add up all the cores' counts once this core's count alone is over
+  // its share of the limit.
+  s64 local = dirty_page_counts.get_unchecked()->load(std::memory_order_relaxed);
+  if (local * ncpu < WRITEBACK_DIRTY_LIMIT_PAGES ||
+      dirty_pages_total() < WRITEBACK_DIRTY_LIMIT_PAGES)
+    return;
+
+  for (int c = 0; c < ncpu; c++) {
+    auto &wb = writeback_lists[c];
+    auto l = wb.lock.guard();
+    wb.kicked = true;
+    wb.cv.wake_all();
+  }
+
+  u64 deadline = nsectime() + (u64)WRITEBACK_THROTTLE_MAX_MS * 1000000ull;
+  scoped_acquire a(&writeback_throttled.lock);
+  while (dirty_pages_total() >= WRITEBACK_DIRTY_LIMIT_PAGES &&
+         nsectime() < deadline)
+    writeback_throttled.cv.sleep_to(&writeback_throttled.lock, deadline);
+}
+
 // This function gets called when a file is truncated. Page table mappings for
 // any pages that are no longer a part of the file need to be cleared from vmaps
 // that have the file mmapped. Each page_info object keeps track of these vmaps
@@ -283,21 +1417,33 @@ mfile::put_page(u64 pageidx)
 // truncated pages from the vmaps in question.
 void
 mfile::remove_pgtable_mappings(u64 start_offset) {
-  auto page_trunc_start = pages_.find(PGROUNDUP(start_offset) / PGSIZE);
-  for (auto it = page_trunc_start; it != pages_.end(); ) {
-    // Skip unset spans
-    if (!it.is_set()) {
-      it += it.base_span();
-      continue;
-    }
-    auto pg_info = it->get_page_info();
-    if (pg_info) {
-      std::vector<page_info::rmap_entry> rmap_vec;
-      pg_info->get_rmap_vector(rmap_vec);
-      for (auto rmap_it = rmap_vec.begin(); rmap_it != rmap_vec.end(); rmap_it++)
-        rmap_it->first->delete_mapping(rmap_it->second);
+  // Gather the mappings of all of the pages first, so that each vmap can
+  // drop all of its mappings of the range with one TLB shootdown.
+  std::vector<page_info::rmap_entry> rmap_vec;
+  pages_.for_each_set(PGROUNDUP(start_offset) / PGSIZE, pages_.size(),
+                      [&](size_t, size_t, page_state &ps) {
+      auto pg_info = ps.get_page_info();
+      if (pg_info)
+        pg_info->get_rmap_vector(rmap_vec);
+    });
+  if (rmap_vec.empty())
+    return;
+
+  std::vector<size_t> order;
+  for (size_t i = 0; i < rmap_vec.size(); i++)
+    order.push_back(i);
+  std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      auto &x = rmap_vec[a], &y = rmap_vec[b];
+      return x.first != y.first ? x.first < y.first : x.second < y.second;
+    });
+  std::vector<uptr> addrs;
+  for (size_t i = 0; i < order.size(); i++) {
+    auto &e = rmap_vec[order[i]];
+    addrs.push_back(e.second);
+    if (i + 1 == order.size() || rmap_vec[order[i + 1]].first != e.first) {
+      e.first->delete_mappings(addrs.data(), addrs.size());
+      addrs.clear();
     }
-    ++it;
   }
 }
 
@@ -330,42 +1476,150 @@ mfile::drop_pagecache()
   }
 }
 
+// Take the file's dirty pages out of the dirty page count, as the file is
+// going away without them ever being written.
 void
-mfile::sync_file(int cpu)
+mfile::uncount_dirty_pages()
+{
+  s64 ndirty = 0;
+  if (fs_ == root_fs) {
+    std::vector<u32> pages;
+    take_dirty_pages(0, PGROUNDUP(size_) / PGSIZE, &pages);
+    ndirty = pages.size();
+  } else {
+    pages_.for_each_set(0, PGROUNDUP(size_) / PGSIZE,
+                        [&](size_t, size_t span, page_state &ps) {
+        if (ps.is_dirty_page())
+          ndirty += span;
+      });
+  }
+  count_dirty_pages(-ndirty);
+}
+
+// Write the file's dirty pages back into a journal transaction, along with
+// its size. With datasync (fdatasync), the disk inode is only updated if
+// reading the data back needs it to be: if blocks were allocated, or the
+// size changed. Only the pages overlapping the bytes [start, end) are
+// written if a range is given (sync_file_range); the file stays dirty then,
+// for whoever syncs the rest of it. Returns -1 if the disk ran out of blocks
+// for some of the pages, which stay dirty, and 0 otherwise.
+int
+mfile::sync_file(int cpu, bool datasync, u64 start, u64 end)
 {
   if (!is_dirty())
-    return;
+    return 0;
 
+  kstats::timer timer(&kstats::fs_sync_file_cycles);
+  kstats::inc(&kstats::fs_sync_file_count);
   auto lock = fsync_lock_.guard();
 
+  u64 mlen = *read_size();
+  // A file small enough to go into its inode (see SB_INLINE) is written back
+  // there whole, whatever the range.
+  bool fits_inline = inline_fits(mlen);
+  if (fits_inline) {
+    start = 0;
+    end = ~0ull;
+  }
+  // So is a compressed one (see SB_COMPRESS), by clusters.
+  if (!fits_inline && rootfs_interface->file_compressed(mnum_)) {
+    return sync_compressed_file(cpu, datasync, mlen);
+  }
+  bool whole = start == 0 && end >= mlen;
+  u64 page_end = end >= mlen ? PGROUNDUP(mlen) / PGSIZE
+                             : PGROUNDUP(end) / PGSIZE;
+
+  // Flush the dirty file pages to disk. Collect them first, from the dirty
+  // list, so that the blocks they need can be allocated in one go, as one
+  // extent.
+  std::vector<u32> dirty_pages;
+  take_dirty_pages(start / PGSIZE, page_end, &dirty_pages);
+
+  // A few pages go into the journal instead (see DATA_JOURNAL_MAX_PAGES).
+  // Pages written in place must wait for any earlier logged copies of them
+  // to be applied first.
+  bool journal_data = DATA_JOURNAL_MAX_PAGES && whole && !fits_inline &&
+    !dirty_pages.empty() && dirty_pages.size() <= DATA_JOURNAL_MAX_PAGES;
+  if (!journal_data)
+    flush_journaled_data();
+
   auto guard = rootfs_interface->fs_journal[cpu]->commitq_insert_lock.guard();
 
   transaction *trans = new transaction();
-  u64 mlen = *read_size();
 
-  // Flush all in-memory file pages to disk.
+  // The inode gets the first page whole or, if the page isn't in the page
+  // cache, keeps what the file has on the disk, up to any truncation since
+  // the last sync. That replaces whatever blocks the file had.
+  if (fits_inline) {
+    auto it = pages_.find(0);
+    page_info *pi = nullptr;
+    if (it.is_set() && !it->is_loading())
+      pi = it->get_page_info().get();
+    bool was_dirty = it.is_set() && it->is_dirty_page();
+    if (was_dirty && pi)
+      pi->take_dirty_chunks();
+    u64 tsize = trunc_size_.exchange(~0ull);
+    bool synced = rootfs_interface->sync_inline_file(
+      mnum_, pi ? (const char*)pi->va() : nullptr, mlen,
+      std::min(tsize, mlen), trans);
+    assert(synced);
+    if (was_dirty) {
+      it->set_dirty_bit(false);
+      count_dirty_pages(-1);
+    }
+    rootfs_interface->add_transaction_to_queue(trans, cpu);
+    dirty(false);
+    return 0;
+  }
 
-  sref<inode> ip = rootfs_interface->prepare_sync_file_pages(mnum_, trans);
+  // Disk blocks past a truncation since the last sync may still hold old
+  // data, which would show through any holes the file has since grown over
+  // (see resize_append_holes()): free them before writing the pages back.
+  bool truncated = false;
+  u64 tsize = trunc_size_.exchange(~0ull);
+  if (tsize < mlen && rootfs_interface->get_file_size(mnum_) > tsize) {
+    rootfs_interface->truncate_file(mnum_, tsize, trans, false);
+    truncated = true;
+  }
 
-  auto page_end = pages_.find(PGROUNDUP(mlen) / PGSIZE);
-  for (auto it = pages_.begin(); it != page_end; ) {
-    // Skip unset spans
-    if (!it.is_set()) {
-      mlen = *read_size();
-      if (mlen <= it.index()*PGSIZE)
-        break;
-      it += it.base_span();
-      if (mlen <= it.index()*PGSIZE)
-        break;
-      continue;
-    }
+  // Only the chunks written since the last sync need logging for pages
+  // whose blocks are already up to date otherwise. That rules out new
+  // blocks, and pages whose tails a truncation zeroed.
+  std::vector<u8> log_delta;
+  if (journal_data) {
+    for (u32 pageidx : dirty_pages)
+      log_delta.push_back(tsize == ~0ull &&
+                          !rootfs_interface->is_file_hole(
+                            mnum_, (u64)pageidx * PGSIZE, PGSIZE));
+  }
 
-    if (!it->is_dirty_page()) {
-      ++it;
+  bool allocated, failed = false;
+  sref<inode> ip = rootfs_interface->prepare_sync_file_pages(mnum_, trans,
+                                                             dirty_pages,
+                                                             &allocated);
+
+  for (size_t i = 0; i < dirty_pages.size(); i++) {
+    // Skip pages truncated in the meantime.
+    auto it = pages_.find(dirty_pages[i]);
+    if (!it.is_set() || !it->is_dirty_page())
       continue;
-    }
 
     size_t pos = it.index() * PGSIZE;
+    page_info *pi = it->get_page_info().get();
+    u64 chunks = pi->take_dirty_chunks();
+    if (journal_data) {
+      if (!rootfs_interface->journal_file_page(ip, (char*)pi->va(), pos,
+                                               log_delta[i] && chunks ? chunks :
+                                               TXN_ALL_CHUNKS, trans)) {
+        pi->note_dirty_chunks(TXN_ALL_CHUNKS);
+        note_dirty_page(it.index());
+        failed = true;
+        continue;
+      }
+      it->set_dirty_bit(false);
+      count_dirty_pages(-1);
+      continue;
+    }
 
     // The actual number of bytes to be written is mlen - pos, but we use
     // PGSIZE as the size argument in order to avoid expensive Read-Modify-Writes
@@ -373,26 +1627,240 @@ mfile::sync_file(int cpu)
     // asynchronous writes]. Since the rest of the bytes in the page are
     // zero anyway, this is harmless; we won't leak any random bytes into the
     // file.
-    assert(PGSIZE == rootfs_interface->sync_file_page(ip,
-                    (char*)it->get_page_info()->va(), pos, PGSIZE, trans));
+    if (rootfs_interface->sync_file_page(ip, (char*)pi->va(), pos, PGSIZE,
+                                         trans) != PGSIZE) {
+      // Out of disk blocks (see alloc_file_pages()): keep the page dirty,
+      // for a later sync to try again.
+      pi->note_dirty_chunks(TXN_ALL_CHUNKS);
+      note_dirty_page(it.index());
+      failed = true;
+      continue;
+    }
     it->set_dirty_bit(false);
-    ++it;
+    count_dirty_pages(-1);
   }
 
   rootfs_interface->finish_sync_file_pages(ip, trans);
 
   u64 ilen = rootfs_interface->get_file_size(mnum_);
   // If the in-memory file is shorter, truncate the file on the disk.
-  if (ilen > mlen)
+  if (ilen > mlen) {
     rootfs_interface->truncate_file(mnum_, mlen, trans);
+    truncated = true;
+  }
 
-  // Update the size and the inode.
-  rootfs_interface->update_file_size(mnum_, mlen, trans);
+  // Update the size and the inode. Pages that went into blocks the file
+  // already had leave the disk inode as it was, which fdatasync can skip.
+  if (!datasync || allocated || truncated || ilen != mlen)
+    rootfs_interface->update_file_size(mnum_, mlen, trans);
+
+  // A transaction logging the file's data after one in another journal
+  // must not be applied before it.
+  if (journal_data && dj_enq_tsc_ && dj_cpu_ != cpu)
+    trans->dependent_txq.push_back(tx_queue_info(dj_cpu_, dj_enq_tsc_));
 
   // Add the fsync transaction to the journal's transaction queue. It will be
   // committed to disk later on by a call to flush_journal().
   rootfs_interface->add_transaction_to_queue(trans, cpu);
-  dirty(false);
+  if (journal_data) {
+    dj_cpu_ = cpu;
+    dj_enq_tsc_ = rootfs_interface->fs_journal[cpu]->get_last_enq_tsc();
+    rootfs_interface->note_journaled_data(cpu, dj_enq_tsc_);
+  }
+  if (whole && !failed)
+    dirty(false);
+  return failed ? -1 : 0;
+}
+
+// Write a compressed file (see SB_COMPRESS) of mlen bytes back: every
+// cluster with a dirty page is compressed and replaces the cluster's copy on
+// the disk whole, as does the cluster that a truncation since the last sync
+// cut into, whose old copy still holds what was past the cut. The pages are
+// compressed before the journal's commit queue lock is taken, so that syncs
+// of other files on this core aren't held up by it; the compressed copies
+// wait in memory until then, which the writeback limits on dirty pages keep
+// in bounds. Pages written to while they were being compressed stay dirty,
+// for the next sync, as do the clusters that the disk has no room for, in
+// which case this returns -1. The caller must hold fsync_lock_.
+int
+mfile::sync_compressed_file(int cpu, bool datasync, u64 mlen)
+{
+  struct zpending {
+    u32 c;
+    u32 npages;
+    sref<page_info> pis[ZCLUSTER_BLOCKS];
+    char *z;
+    u32 zlen;
+  };
+
+  u64 npages = PGROUNDUP(mlen) / PGSIZE;
+  std::vector<u32> dirty_pages;
+  take_dirty_pages(0, npages, &dirty_pages);
+  flush_journaled_data();
+
+  std::vector<u32> clusters;
+  for (u32 pg : dirty_pages)
+    if (clusters.empty() || clusters.back() != pg / ZCLUSTER_BLOCKS)
+      clusters.push_back(pg / ZCLUSTER_BLOCKS);
+  u64 tsize = trunc_size_.exchange(~0ull);
+  u64 cut = std::min(tsize, mlen);
+  if (tsize != ~0ull && cut % ZCLUSTER_BYTES) {
+    u32 c = cut / ZCLUSTER_BYTES;
+    auto pos = std::lower_bound(clusters.begin(), clusters.end(), c);
+    if (pos == clusters.end() || *pos != c) {
+      clusters.push_back(c);
+      std::sort(clusters.begin(), clusters.end());
+    }
+  }
+
+  char *scratch = nullptr;
+  if (!clusters.empty()) {
+    scratch = (char *)kmalloc(ZCLUSTER_BYTES, "zcluster");
+    if (!scratch)
+      throw_bad_alloc();
+  }
+  std::vector<zpending> pending;
+  pending.reserve(clusters.size());
+  for (size_t i = 0; i < clusters.size(); i++) {
+    pending.emplace_back();
+    zpending &p = pending.back();
+    u64 first = (u64)clusters[i] * ZCLUSTER_BLOCKS;
+    const char *va[ZCLUSTER_BLOCKS];
+    p.c = clusters[i];
+    p.npages = std::min((u64)ZCLUSTER_BLOCKS, npages - first);
+    for (u32 j = 0; j < p.npages; j++) {
+      // Pages truncated away in the meantime read as zeros.
+      p.pis[j] = get_page(first + j).get_page_info();
+      if (!p.pis[j])
+        p.pis[j] = pagecache_zero_page();
+      p.pis[j]->take_dirty_chunks();
+      va[j] = (const char *)p.pis[j]->va();
+    }
+    u32 rawlen = std::min((u64)ZCLUSTER_BYTES, mlen - first * PGSIZE);
+    p.zlen = zcluster_compress(va, p.npages, rawlen, scratch);
+    p.z = nullptr;
+    if (p.zlen) {
+      p.z = (char *)kmalloc(PGROUNDUP(p.zlen), "zcluster");
+      if (!p.z)
+        throw_bad_alloc();
+      memmove(p.z, scratch, PGROUNDUP(p.zlen));
+    }
+  }
+  if (scratch)
+    kmfree(scratch, ZCLUSTER_BYTES);
+
+  auto guard = rootfs_interface->fs_journal[cpu]->commitq_insert_lock.guard();
+
+  transaction *trans = new transaction();
+
+  bool truncated = false;
+  if (tsize < mlen && rootfs_interface->get_file_size(mnum_) > tsize) {
+    rootfs_interface->truncate_file(mnum_, tsize, trans, false);
+    truncated = true;
+  }
+
+  bool allocated, failed = false;
+  sref<inode> ip = rootfs_interface->prepare_sync_file_pages(
+    mnum_, trans, std::vector<u32>(), &allocated);
+  for (auto &p : pending) {
+    char *va[ZCLUSTER_BLOCKS];
+    for (u32 j = 0; j < p.npages; j++)
+      va[j] = (char *)p.pis[j]->va();
+    allocated = true;
+    if (!rootfs_interface->sync_file_cluster(ip, p.c, p.z, p.zlen, va,
+                                             p.npages, trans)) {
+      // The cluster's dirty pages get picked up again below.
+      for (u32 j = 0; j < p.npages; j++) {
+        auto it = pages_.find((u64)p.c * ZCLUSTER_BLOCKS + j);
+        if (it.is_set() && it->is_dirty_page() &&
+            it->has_page_info(p.pis[j].get()))
+          p.pis[j]->note_dirty_chunks(TXN_ALL_CHUNKS);
+      }
+      failed = true;
+    }
+  }
+  rootfs_interface->finish_sync_file_pages(ip, trans);
+  for (auto &p : pending)
+    if (p.z)
+      kmfree(p.z, PGROUNDUP(p.zlen));
+
+  u64 ilen = rootfs_interface->get_file_size(mnum_);
+  if (ilen > mlen) {
+    rootfs_interface->truncate_file(mnum_, mlen, trans);
+    truncated = true;
+  }
+  if (!datasync || allocated || truncated || ilen != mlen)
+    rootfs_interface->update_file_size(mnum_, mlen, trans);
+  rootfs_interface->add_transaction_to_queue(trans, cpu);
+
+  bool redirtied = false;
+  for (u32 pg : dirty_pages) {
+    auto it = pages_.find(pg);
+    if (!it.is_set() || !it->is_dirty_page())
+      continue;
+    page_info *pi = it->get_page_info().get();
+    u64 chunks = pi->take_dirty_chunks();
+    if (chunks) {
+      pi->note_dirty_chunks(chunks);
+      note_dirty_page(pg);
+      redirtied = true;
+      continue;
+    }
+    it->set_dirty_bit(false);
+    count_dirty_pages(-1);
+  }
+  if (!redirtied)
+    dirty(false);
+  return failed ? -1 : 0;
+}
+
+// Make sure that the journal no longer holds copies of the file's data
+// that are yet to be applied (see DATA_JOURNAL_MAX_PAGES), before its blocks
+// are written in place. The caller must hold fsync_lock_.
+void
+mfile::flush_journaled_data()
+{
+  if (!dj_enq_tsc_)
+    return;
+  rootfs_interface->apply_journaled_data(dj_cpu_, dj_enq_tsc_);
+  dj_enq_tsc_ = 0;
+}
+
+lock_guard<sleeplock>
+mfile::begin_direct_io()
+{
+  auto lock = fsync_lock_.guard();
+  flush_journaled_data();
+  return lock;
+}
+
+// Reserve disk blocks for the bytes [off, off + len) of the file, marked
+// unwritten so they need no zeroing (see preallocate()). The caller must have
+// synced the file first, so that the disk inode's size matches the mfile's.
+// The reservation goes into the journal as a transaction of its own.
+int
+mfile::fallocate(int cpu, u64 off, u64 len, bool keep_size)
+{
+  auto lock = fsync_lock_.guard();
+
+  // A truncate since the caller's sync would let the new pages read back the
+  // old contents of the disk blocks.
+  if (*read_size() < rootfs_interface->get_file_size(mnum_))
+    return -1;
+
+  auto guard = rootfs_interface->fs_journal[cpu]->commitq_insert_lock.guard();
+
+  transaction *trans = new transaction();
+  int r = rootfs_interface->preallocate_file(mnum_, off, len, keep_size,
+                                             trans);
+  if (r == 0 && !keep_size) {
+    auto resize = write_size();
+    if (off + len > resize.read_size())
+      resize.resize_prealloc(off + len);
+  }
+
+  rootfs_interface->add_transaction_to_queue(trans, cpu);
+  return r;
 }
 
 void
@@ -416,10 +1884,9 @@ mfsprint(print_stream *s)
   s->println("mnode cache:");
   s->println("  ", stats.items, " items");
   s->println("  ", stats.used_buckets, " used / ",
-             stats.total_buckets, " total buckets (",
+             stats.total_buckets, " total slots (",
              stats.used_buckets * 100 / stats.total_buckets, "%)");
-  s->println("  ", stats.max_chain, " max chain length");
-  s->println("  ", stats.items / stats.total_buckets, " avg chain length");
-  if (stats.used_buckets)
-    s->println("  ", stats.items / stats.used_buckets, " avg used chain length");
+  s->println("  ", stats.tombstones, " tombstones");
+  s->println("  ", stats.max_chain, " max probe length");
+  s->println("  ", stats.resizes, " resizes");
 }
@@ -94,6 +94,21 @@ initcpus(void)
   numa_nodes.back().cpus.push_back(&cpus[0]);
 }
 
+void
+numa_steal_order(int cpu, int *order, int n)
+{
+  const numa_node *local = cpu < ncpu ? cpus[cpu].node : nullptr;
+  int k = 0;
+  for (int pass = 0; pass < 2; pass++) {
+    for (int i = 1; i < n; i++) {
+      int c = (cpu + i) % n;
+      bool same = local && c < ncpu && cpus[c].node == local;
+      if (same == (pass == 0))
+        order[k++] = c;
+    }
+  }
+}
+
 void
 initextpic(void)
 {
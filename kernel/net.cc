@@ -8,6 +8,10 @@
 #include "net.hh"
 #include "major.h"
 #include "netdev.hh"
+#include "epoll.hh"
+#include "ilist.hh"
+#include "percpu.hh"
+#include "kstats.hh"
 #include <uk/socket.h>
 
 #ifdef LWIP
@@ -22,29 +26,160 @@ extern "C" {
 }
 
 err_t if_init(struct netif *netif);
-void if_input(struct netif *netif, void *buf, u16 len);
+void if_input(struct netif *netif, void *buf, u16 len, u32 csum_flags);
 #endif
 
 netdev *the_netdev;
 
+// Packet buffers.  Each core keeps a pool of page-sized buffers
+// carved from naturally aligned 2MB chunks, so allocating or freeing
+// one is a list operation with interrupts off rather than a trip
+// through kalloc.  A buffer always goes back to the pool of the core
+// whose chunk it came from: other cores push it on that pool's
+// lock-free remote list, which the owner takes all at once when its
+// own list runs dry.  Once a core has NET_POOL_CPU_CHUNKS chunks, or
+// can't get an aligned one, its misses come from kalloc directly.
+struct net_pool
+{
+  // Free buffers, linked through their first word
+  void *free;
+  // Buffers that other cores freed, linked the same way
+  std::atomic<void*> remote;
+  std::atomic<int> nchunks;
+};
+DEFINE_PERCPU(struct net_pool, net_pools, NO_INT);
+
+// The chunks, hashed by address, and the core that owns each.  Chunks
+// are never freed, and there are twice as many slots as chunks can
+// exist, so a lookup's probe ends at an empty slot.
+static struct {
+  std::atomic<uptr> base;
+  int owner;
+} net_chunks[2 * NCPU * NET_POOL_CPU_CHUNKS];
+static spinlock net_chunks_lock("net_chunks");
+
+static size_t
+net_chunk_slot(uptr base)
+{
+  return (base / HUGE_PGSIZE * 0x9e3779b97f4a7c15ull >> 32) %
+    NELEM(net_chunks);
+}
+
+// The core whose chunk va is in, or -1 if kalloc allocated it
+static int
+net_chunk_owner(void *va)
+{
+  uptr base = (uptr)va & ~(uptr)(HUGE_PGSIZE - 1);
+  for (size_t i = net_chunk_slot(base); ; i = (i + 1) % NELEM(net_chunks)) {
+    uptr b = net_chunks[i].base.load(std::memory_order_acquire);
+    if (b == base)
+      return net_chunks[i].owner;
+    if (!b)
+      return -1;
+  }
+}
+
+// Push the list from first to last on cpu's remote list
+static void
+net_pool_give(int cpu, void *first, void *last)
+{
+  auto &remote = net_pools[cpu].remote;
+  void *head = remote.load(std::memory_order_relaxed);
+  do {
+    *(void**)last = head;
+  } while (!remote.compare_exchange_weak(head, first,
+                                         std::memory_order_release));
+}
+
+// Add a chunk of buffers to cpu's pool.  Returns false if cpu can't
+// have another.
+static bool
+net_pool_grow(int cpu)
+{
+  net_pool &p = net_pools[cpu];
+  if (p.nchunks++ >= NET_POOL_CPU_CHUNKS)
+    return false;
+  char *c = kalloc("(netalloc)", HUGE_PGSIZE, cpu);
+  if (c && v2p(c) % HUGE_PGSIZE) {
+    kfree(c, HUGE_PGSIZE);
+    c = nullptr;
+  }
+  if (!c) {
+    // Memory is short or fragmented; stop trying
+    p.nchunks = NET_POOL_CPU_CHUNKS;
+    return false;
+  }
+
+  {
+    scoped_acquire l(&net_chunks_lock);
+    size_t i = net_chunk_slot((uptr)c);
+    while (net_chunks[i].base)
+      i = (i + 1) % NELEM(net_chunks);
+    net_chunks[i].owner = cpu;
+    net_chunks[i].base.store((uptr)c, std::memory_order_release);
+  }
+  for (size_t off = 0; off + PGSIZE < HUGE_PGSIZE; off += PGSIZE)
+    *(void**)(c + off) = c + off + PGSIZE;
+  net_pool_give(cpu, c, c + HUGE_PGSIZE - PGSIZE);
+  kstats::inc(&kstats::net_buf_chunk_count);
+  return true;
+}
+
 void
 netfree(void *va)
 {
-  kfree(va);
+  int owner = net_chunk_owner(va);
+  if (owner < 0) {
+    kfree(va);
+    return;
+  }
+  scoped_cli cli;
+  if (owner == myid()) {
+    net_pool &p = *net_pools;
+    *(void**)va = p.free;
+    p.free = va;
+  } else {
+    net_pool_give(owner, va, va);
+    kstats::inc(&kstats::net_buf_remote_free_count);
+  }
 }
 
 void *
 netalloc(void)
 {
-  return kalloc("(netalloc)");
+  for (;;) {
+    int cpu;
+    {
+      scoped_cli cli;
+      net_pool &p = *net_pools;
+      if (!p.free)
+        p.free = p.remote.exchange(nullptr, std::memory_order_acquire);
+      if (void *b = p.free) {
+        p.free = *(void**)b;
+        kstats::inc(&kstats::net_buf_alloc_count);
+        return b;
+      }
+      cpu = myid();
+    }
+    kstats::inc(&kstats::net_buf_miss_count);
+    if (!net_pool_grow(cpu))
+      return kalloc("(netalloc)");
+  }
 }
 
 int
-nettx(void *va, u16 len)
+nettx(void *va, u16 len, const struct net_txcsum *csum)
 {
   if (!the_netdev)
     return -1;
-  return the_netdev->transmit(va, len);
+  return the_netdev->transmit(va, len, csum);
+}
+
+void
+nettx_flush(void)
+{
+  if (the_netdev)
+    the_netdev->flush();
 }
 
 void
@@ -55,24 +190,279 @@ nethwaddr(u8 *hwaddr)
   the_netdev->get_hwaddr(hwaddr);
 }
 
+u32
+netfeatures(void)
+{
+  if (!the_netdev)
+    return 0;
+  return the_netdev->features();
+}
+
 #ifdef LWIP
 
+class file_lwip_socket;
+static void lwip_watch(file_lwip_socket *s);
+static void lwip_unwatch(file_lwip_socket *s);
+static void lwip_pollupdate(void);
+
+static struct netif nif;
+
+// A TCP connection between two sockets on this machine, which skips
+// lwIP altogether: each direction is a ring buffer that one socket
+// writes and the other reads.  Side 0 is the socket that connected and
+// side 1 the one that accept() returned.
+struct lwip_loop
+{
+  struct dir {
+    condvar cv;                 // The reader waits for data, the writer room
+    char *data;
+    std::atomic<u64> nread, nwrite;
+    std::atomic<bool> rclosed, wclosed;
+  };
+
+  spinlock lock;
+  dir dirs[2];                  // dirs[s] carries what side s writes
+  poll_slot pq[2];
+  std::atomic<int> refs;
+
+  lwip_loop() : lock("lwip_loop"), refs(2)
+  {
+    for (auto &d : dirs) {
+      d.cv = condvar("lwip_loop");
+      d.data = kalloc("lwip_loop", NET_LOOP_BUFSIZE);
+      d.nread = d.nwrite = 0;
+      d.rclosed = d.wclosed = false;
+    }
+  }
+
+  ~lwip_loop()
+  {
+    for (auto &d : dirs)
+      if (d.data)
+        kfree(d.data, NET_LOOP_BUFSIZE);
+  }
+  NEW_DELETE_OPS(lwip_loop);
+
+  static lwip_loop *alloc()
+  {
+    lwip_loop *l = new lwip_loop();
+    if (!l->dirs[0].data || !l->dirs[1].data) {
+      delete l;
+      return nullptr;
+    }
+    return l;
+  }
+
+  u32 readiness(int s)
+  {
+    dir &in = dirs[!s], &out = dirs[s];
+    u32 r = 0;
+    if (in.nwrite != in.nread)
+      r |= EPOLLIN;
+    if (in.wclosed)
+      r |= EPOLLIN | EPOLLHUP;
+    if (out.rclosed)
+      r |= EPOLLOUT | EPOLLERR;
+    else if (out.nwrite - out.nread < NET_LOOP_BUFSIZE)
+      r |= EPOLLOUT;
+    return r;
+  }
+
+  // Called with lock held
+  void pollupdate(int s, u32 happened)
+  {
+    pq[s].update(happened, [this, s](){ return readiness(s); });
+  }
+
+  ssize_t write(int s, const char *buf, size_t n)
+  {
+    dir &d = dirs[s];
+    size_t done = 0;
+    scoped_acquire l(&lock);
+    while (done < n) {
+      if (d.rclosed)
+        return done ? done : -1;
+      u64 room = NET_LOOP_BUFSIZE - (d.nwrite - d.nread);
+      if (!room) {
+        if (myproc()->killed)
+          return done ? done : -1;
+        d.cv.sleep(&lock);
+        continue;
+      }
+      size_t k = std::min((size_t)room, n - done);
+      size_t off = d.nwrite % NET_LOOP_BUFSIZE;
+      size_t first = std::min(k, NET_LOOP_BUFSIZE - off);
+      memmove(d.data + off, buf + done, first);
+      memmove(d.data, buf + done + first, k - first);
+      d.nwrite += k;
+      done += k;
+      d.cv.wake_all();
+      pollupdate(!s, EPOLLIN);
+    }
+    return done;
+  }
+
+  ssize_t read(int s, char *buf, size_t n)
+  {
+    dir &d = dirs[!s];
+    scoped_acquire l(&lock);
+    while (d.nwrite == d.nread) {
+      if (d.wclosed)
+        return 0;
+      if (myproc()->killed)
+        return -1;
+      d.cv.sleep(&lock);
+    }
+    size_t k = std::min(n, (size_t)(d.nwrite - d.nread));
+    size_t off = d.nread % NET_LOOP_BUFSIZE;
+    size_t first = std::min(k, NET_LOOP_BUFSIZE - off);
+    memmove(buf, d.data + off, first);
+    memmove(buf + first, d.data, k - first);
+    d.nread += k;
+    d.cv.wake_all();
+    pollupdate(!s, EPOLLOUT);
+    return k;
+  }
+
+  // Shut down side s.  Returns true if the other side already has, so
+  // the connection can be freed.
+  bool close(int s)
+  {
+    {
+      scoped_acquire l(&lock);
+      dirs[s].wclosed = true;
+      dirs[!s].rclosed = true;
+      for (auto &d : dirs)
+        d.cv.wake_all();
+      pq[s].shutdown();
+      pollupdate(!s, EPOLLIN | EPOLLHUP | EPOLLERR);
+    }
+    return --refs == 0;
+  }
+};
+
+// A connection that a listen group accepted for one of its members:
+// an lwIP socket, or the accepting end of a loopback connection
+struct lwip_conn
+{
+  int socket;
+  lwip_loop *loop;
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  ilink<lwip_conn> link;
+  NEW_DELETE_OPS(lwip_conn);
+};
+
+// The listening sockets bound to one address and port: either the
+// SO_REUSEPORT sockets that bound it, or a single other socket, which
+// gets its group at listen().  lwIP gives a SYN to the first listening
+// PCB that matches, so the members share one lwIP listening socket.
+// Whichever member is accepting pulls connections off it and queues
+// each on the member picked by a hash of the peer's address and port,
+// and a loopback connect() queues its connection the same way.  So
+// each worker's accept() sleeps on its own queue, and only one at a
+// time polls the lwIP socket.
+struct lwip_listen_group
+{
+  struct sockaddr_in addr;
+  // The shared lwIP listening socket, which doesn't block
+  int socket;
+  // Other SO_REUSEPORT sockets may join
+  bool reuseport;
+  bool listening;
+  // Protects the rest, and the members' accept queues
+  spinlock lock;
+  file_lwip_socket *members[NCPU];
+  int nmembers;
+  // Some member is pulling connections off socket
+  bool pulling;
+  // The puller's condvar while it sleeps until lwIP has run
+  condvar *sleeper;
+  // Bumped after lwIP has run, since that may queue connections on
+  // socket
+  u64 wakeups;
+  ilink<lwip_listen_group> link;
+
+  lwip_listen_group(const struct sockaddr_in &a, int s, bool reuseport)
+    : addr(a), socket(s), reuseport(reuseport), listening(false),
+      lock("lwip_listen_group"), nmembers(0), pulling(false),
+      sleeper(nullptr), wakeups(0) { }
+  NEW_DELETE_OPS(lwip_listen_group);
+
+  // The member that gets a connection from peer
+  file_lwip_socket *pick(const struct sockaddr_in *peer)
+  {
+    u64 h = ((u64)peer->sin_addr.s_addr << 16 | peer->sin_port) *
+      0x9e3779b97f4a7c15ull;
+    return members[(h >> 32) % nmembers];
+  }
+};
+
+// Listen groups by address.  Changed with both lwip_core_lock and
+// lwip_groups_lock held, so either one protects a reader.
+static ilist<lwip_listen_group, &lwip_listen_group::link> lwip_listen_groups;
+static spinlock lwip_groups_lock;
+// Members pulling connections off a group's lwIP socket
+static std::atomic<int> lwip_pullers;
+// Ports for the connecting ends of loopback connections
+static std::atomic<u16> lwip_loop_ports;
+
 class file_lwip_socket : public refcache::referenced, public file
 {
-  int socket_;
+  int socket_;                  // -1 once handed to or replaced by group_
   semaphore wsem_, rsem_;
+  poll_slot pq_;
+  std::atomic<bool> watched_;
+
+  // SO_REUSEPORT was set before bind()
+  bool reuseport_;
+  // The listen group this socket joined at bind() or listen(), if any
+  lwip_listen_group *group_;
+  // This member's index in group_->members, and the connections its
+  // accept() hasn't taken yet.  Protected by group_->lock.
+  int group_slot_;
+  ilist<lwip_conn, &lwip_conn::link> accepted_;
+  condvar accept_cv_;
+  bool accept_waiting_;
+
+  // The loopback connection this socket is an end of, if any
+  lwip_loop *loop_;
+  int loop_side_;
 
   ~file_lwip_socket()
   {
-    lwip_core_lock();
-    lwip_close(socket_);
-    lwip_core_unlock();
+    if (watched_)
+      lwip_unwatch(this);
+    if (loop_ && loop_->close(loop_side_))
+      delete loop_;
+    if (group_ || socket_ >= 0) {
+      lwip_core_lock();
+      if (group_)
+        group_leave();
+      if (socket_ >= 0)
+        lwip_close(socket_);
+      lwip_core_unlock();
+    }
   }
 
-public:
-  file_lwip_socket(int socket)
+  file_lwip_socket(int socket, lwip_loop *loop, int side)
     : socket_(socket), wsem_("file_lwip_socket::wsem", 1),
-      rsem_("file_lwip_socket::rsem", 1) { }
+      rsem_("file_lwip_socket::rsem", 1), watched_(false),
+      reuseport_(false), group_(nullptr), group_slot_(-1),
+      accept_cv_("file_lwip_socket::accept"), accept_waiting_(false),
+      loop_(loop), loop_side_(side) { }
+
+  int group_bind(const struct sockaddr *addr, size_t addrlen);
+  void group_join(lwip_listen_group *g);
+  int group_accept(struct sockaddr_storage *addr, size_t *addrlen,
+                   file **out);
+  void group_give(file_lwip_socket *m, lwip_conn *c);
+  void group_leave();
+  bool group_has_accepted();
+  int loop_connect(const struct sockaddr_in *sin);
+
+public:
+  file_lwip_socket(int socket) : file_lwip_socket(socket, nullptr, 0) { }
   NEW_DELETE_OPS(file_lwip_socket);
 
   void inc() override { referenced::inc(); }
@@ -81,6 +471,8 @@ public:
   ssize_t read(char *buf, size_t n) override
   {
     auto l = rsem_.guard();
+    if (loop_)
+      return loop_->read(loop_side_, buf, n);
     lwip_core_lock();
     int r = lwip_read(socket_, buf, n);
     lwip_core_unlock();
@@ -90,6 +482,8 @@ public:
   ssize_t write(const char *buf, size_t n) override
   {
     auto l = wsem_.guard();
+    if (loop_)
+      return loop_->write(loop_side_, buf, n);
     lwip_core_lock();
     int r = lwip_write(socket_, buf, n);
     lwip_core_unlock();
@@ -99,40 +493,471 @@ public:
   int bind(const struct sockaddr *addr, size_t addrlen) override
   {
     lwip_core_lock();
-    int r = lwip_bind(socket_, addr, addrlen);
+    int r;
+    if (reuseport_)
+      r = group_bind(addr, addrlen);
+    else
+      r = lwip_bind(socket_, addr, addrlen);
     lwip_core_unlock();
     return r;
   }
 
-  int listen(int backlog) override
+  int listen(int backlog) override;
+
+  int connect(const struct sockaddr *addr, size_t addrlen) override
   {
+    if (addrlen < sizeof(struct sockaddr_in) ||
+        addr->sa_family != AF_INET || loop_ || group_)
+      return -1;
     lwip_core_lock();
-    int r = lwip_listen(socket_, backlog);
+    int r = loop_connect((const struct sockaddr_in*)addr);
+    if (r > 0)
+      r = lwip_connect(socket_, addr, addrlen);
     lwip_core_unlock();
+    if (loop_)
+      // The listener's readiness changed without lwIP running
+      lwip_pollupdate();
     return r;
   }
 
-  int accept(struct sockaddr_storage* addr, size_t *addrlen, file **out)
+  int setsockopt(int level, int optname, const void *optval, size_t optlen)
     override
   {
+    if (level == SOL_SOCKET && optname == SO_REUSEPORT) {
+      // lwIP has the option name but doesn't implement it
+      if (optlen < sizeof(int) || group_)
+        return -1;
+      reuseport_ = *(const int*)optval != 0;
+      return 0;
+    }
+    if (loop_)
+      return -1;
     lwip_core_lock();
-    socklen_t len = sizeof(*addr);
-    int ss = lwip_accept(socket_, (struct sockaddr*)addr, &len);
+    int r = lwip_setsockopt(socket_, level, optname, optval, optlen);
     lwip_core_unlock();
-    if (ss < 0)
+    return r;
+  }
+
+  int accept(struct sockaddr_storage* addr, size_t *addrlen, file **out)
+    override
+  {
+    if (!group_)
       return -1;
-    *addrlen = len;
-    *out = new file_lwip_socket{ss};
-    return 0;
+    return group_accept(addr, addrlen, out);
+  }
+
+  // lwip has no readiness callbacks, so ask select() without waiting
+  u32 readiness()
+  {
+    if (loop_)
+      return loop_->readiness(loop_side_);
+    fd_set rset, wset, eset;
+    FD_ZERO(&rset);
+    FD_ZERO(&wset);
+    FD_ZERO(&eset);
+    struct timeval tv = { 0, 0 };
+    lwip_core_lock();
+    // A group member is readable when its own queue is, or when the
+    // shared listening socket is, since its accept() may pull the
+    // connection off that itself
+    int sock = group_ ? group_->socket : socket_;
+    FD_SET(sock, &rset);
+    FD_SET(sock, &wset);
+    FD_SET(sock, &eset);
+    int r = lwip_select(sock + 1, &rset, &wset, &eset, &tv);
+    lwip_core_unlock();
+    if (r < 0)
+      return EPOLLERR;
+    return (FD_ISSET(sock, &rset) ? EPOLLIN : 0) |
+      (FD_ISSET(sock, &wset) ? EPOLLOUT : 0) |
+      (FD_ISSET(sock, &eset) ? EPOLLERR : 0) |
+      (group_ && group_has_accepted() ? EPOLLIN : 0);
+  }
+
+  // Recheck the readiness, which may have changed for any event
+  void pollupdate()
+  {
+    pq_.update(EPOLLIN | EPOLLOUT, [this](){ return readiness(); });
+  }
+
+  sref<poll_queue> pollq() override
+  {
+    // Loopback connections keep their own readiness up to date
+    if (loop_)
+      return loop_->pq[loop_side_].get([this](){ return readiness(); });
+    auto q = pq_.get([this](){ return readiness(); });
+    if (!watched_.exchange(true))
+      lwip_watch(this);
+    return q;
   }
 
   void onzero() override
   {
     delete this;
   }
+
+  ilink<file_lwip_socket> watch_link;
+  // The core whose watch list this is on
+  int watch_cpu;
 };
 
-static struct netif nif;
+// Make a listen group for the lwIP socket sock, bound to addr.
+// Called with lwip_core_lock held.
+static lwip_listen_group *
+lwip_group_add(const struct sockaddr_in &addr, int sock, bool reuseport)
+{
+  auto g = new lwip_listen_group(addr, sock, reuseport);
+  scoped_acquire l(&lwip_groups_lock);
+  lwip_listen_groups.push_back(g);
+  return g;
+}
+
+// lwIP has run and may have queued connections on listening sockets,
+// so wake any puller that's waiting for that.
+static void
+lwip_wake_pullers(void)
+{
+  if (!lwip_pullers)
+    return;
+  scoped_acquire l(&lwip_groups_lock);
+  for (auto &g : lwip_listen_groups) {
+    scoped_acquire gl(&g.lock);
+    g.wakeups++;
+    if (g.sleeper)
+      g.sleeper->wake_all();
+  }
+}
+
+void
+file_lwip_socket::group_join(lwip_listen_group *g)
+{
+  scoped_acquire l(&g->lock);
+  group_slot_ = g->nmembers++;
+  g->members[group_slot_] = this;
+  group_ = g;
+}
+
+// Join, or start, the SO_REUSEPORT listen group for addr.  Called
+// with lwip_core_lock held.
+int
+file_lwip_socket::group_bind(const struct sockaddr *addr, size_t addrlen)
+{
+  if (group_ || addrlen < sizeof(struct sockaddr_in) ||
+      addr->sa_family != AF_INET)
+    return -1;
+  auto sin = (const struct sockaddr_in*)addr;
+  // Members find each other by port, so they must name one
+  if (!sin->sin_port)
+    return -1;
+
+  lwip_listen_group *g = nullptr;
+  for (auto &it : lwip_listen_groups) {
+    if (it.reuseport && it.addr.sin_port == sin->sin_port &&
+        it.addr.sin_addr.s_addr == sin->sin_addr.s_addr) {
+      g = &it;
+      break;
+    }
+  }
+  if (!g) {
+    if (lwip_bind(socket_, addr, addrlen) < 0)
+      return -1;
+    g = lwip_group_add(*sin, socket_, true);
+  } else {
+    if (g->nmembers == NCPU)
+      return -1;
+    lwip_close(socket_);
+  }
+  socket_ = -1;
+  group_join(g);
+  return 0;
+}
+
+int
+file_lwip_socket::listen(int backlog)
+{
+  lwip_core_lock();
+  auto unlock = scoped_cleanup([](){ lwip_core_unlock(); });
+  if (loop_)
+    return -1;
+  if (group_ && group_->listening)
+    return 0;
+  if (!group_) {
+    struct sockaddr_in sin;
+    socklen_t len = sizeof(sin);
+    if (lwip_listen(socket_, backlog) < 0 ||
+        lwip_getsockname(socket_, (struct sockaddr*)&sin, &len) < 0)
+      return -1;
+    group_join(lwip_group_add(sin, socket_, false));
+    socket_ = -1;
+  } else if (lwip_listen(group_->socket, backlog) < 0) {
+    return -1;
+  }
+  // Pullers poll the socket and sleep until lwIP has run, so that a
+  // loopback connect() can wake them too
+  u32_t on = 1;
+  lwip_ioctl(group_->socket, FIONBIO, &on);
+  group_->listening = true;
+  return 0;
+}
+
+// Queue c on member m of group_.  Called with group_->lock held, which
+// it may drop.
+void
+file_lwip_socket::group_give(file_lwip_socket *m, lwip_conn *c)
+{
+  m->accepted_.push_back(c);
+  m->accept_cv_.wake_all();
+  if (m->watched_) {
+    // The member's readiness changed without lwIP running
+    group_->lock.release();
+    lwip_pollupdate();
+    group_->lock.acquire();
+  }
+}
+
+// Take a connection from this member's queue or, if no other member
+// is doing it, pull connections off the group's listening socket
+// until one is for this member.
+int
+file_lwip_socket::group_accept(struct sockaddr_storage *addr,
+                               size_t *addrlen, file **out)
+{
+  lwip_listen_group *g = group_;
+  lwip_conn *c;
+  g->lock.acquire();
+  if (!g->listening) {
+    g->lock.release();
+    return -1;
+  }
+  for (;;) {
+    if (!accepted_.empty()) {
+      c = &accepted_.front();
+      accepted_.pop_front();
+      break;
+    }
+    if (g->pulling) {
+      accept_waiting_ = true;
+      accept_cv_.sleep(&g->lock);
+      accept_waiting_ = false;
+      continue;
+    }
+
+    // Count ourselves before polling, so lwip_wake_pullers() can't
+    // miss a connection that lwIP queues after the poll
+    g->pulling = true;
+    lwip_pullers++;
+    u64 seen = g->wakeups;
+    g->lock.release();
+    c = new lwip_conn;
+    c->loop = nullptr;
+    c->addrlen = sizeof(c->addr);
+    lwip_core_lock();
+    c->socket = lwip_accept(g->socket, (struct sockaddr*)&c->addr,
+                            &c->addrlen);
+    bool none = c->socket < 0 && errno == EWOULDBLOCK;
+    lwip_core_unlock();
+    g->lock.acquire();
+    if (none) {
+      delete c;
+      if (g->wakeups == seen && accepted_.empty()) {
+        g->sleeper = &accept_cv_;
+        accept_cv_.sleep(&g->lock);
+        g->sleeper = nullptr;
+      }
+    }
+    g->pulling = false;
+    lwip_pullers--;
+    if (none)
+      continue;
+    if (c->socket < 0)
+      break;
+    file_lwip_socket *m = g->pick((const struct sockaddr_in*)&c->addr);
+    if (m == this)
+      break;
+    group_give(m, c);
+  }
+
+  // Let a waiting member take over pulling
+  if (!g->pulling) {
+    for (int i = 0; i < g->nmembers; i++) {
+      if (g->members[i]->accept_waiting_) {
+        g->members[i]->accept_cv_.wake_all();
+        break;
+      }
+    }
+  }
+  g->lock.release();
+
+  if (c->socket < 0 && !c->loop) {
+    delete c;
+    return -1;
+  }
+  *addrlen = c->addrlen;
+  memmove(addr, &c->addr, c->addrlen);
+  *out = new file_lwip_socket(c->socket, c->loop, 1);
+  delete c;
+  return 0;
+}
+
+bool
+file_lwip_socket::group_has_accepted()
+{
+  scoped_acquire l(&group_->lock);
+  return !accepted_.empty();
+}
+
+// Leave group_, closing the connections this member never accepted,
+// and close the group once its last member leaves.  Called with
+// lwip_core_lock held.
+void
+file_lwip_socket::group_leave()
+{
+  lwip_listen_group *g = group_;
+  ilist<lwip_conn, &lwip_conn::link> dropped;
+  bool last;
+  {
+    scoped_acquire l(&g->lock);
+    file_lwip_socket *moved = g->members[--g->nmembers];
+    g->members[group_slot_] = moved;
+    moved->group_slot_ = group_slot_;
+    while (!accepted_.empty()) {
+      lwip_conn *c = &accepted_.front();
+      accepted_.pop_front();
+      dropped.push_back(c);
+    }
+    last = g->nmembers == 0;
+  }
+  group_ = nullptr;
+
+  // lwip_close() may drop the core lock, so take the group out of the
+  // list before anything can find it empty
+  if (last) {
+    scoped_acquire l(&lwip_groups_lock);
+    lwip_listen_groups.erase(lwip_listen_groups.iterator_to(g));
+  }
+  while (!dropped.empty()) {
+    lwip_conn *c = &dropped.front();
+    dropped.pop_front();
+    if (c->loop) {
+      if (c->loop->close(1))
+        delete c->loop;
+    } else {
+      lwip_close(c->socket);
+    }
+    delete c;
+  }
+  if (last) {
+    lwip_close(g->socket);
+    delete g;
+  }
+}
+
+// Connect to a listening socket on this machine directly, without
+// going through lwIP (which has no loopback interface anyway).
+// Returns 1 if sin isn't a local address.  Called with lwip_core_lock
+// held.
+int
+file_lwip_socket::loop_connect(const struct sockaddr_in *sin)
+{
+  u32 dst = sin->sin_addr.s_addr;
+  if (ntohl(dst) >> 24 != 127 && dst != nif.ip_addr.addr)
+    return 1;
+
+  lwip_listen_group *g = nullptr;
+  for (auto &it : lwip_listen_groups) {
+    if (it.listening && it.addr.sin_port == sin->sin_port &&
+        (it.addr.sin_addr.s_addr == INADDR_ANY ||
+         it.addr.sin_addr.s_addr == dst)) {
+      g = &it;
+      break;
+    }
+  }
+  if (!g)
+    return -1;
+  lwip_loop *loop = lwip_loop::alloc();
+  if (!loop)
+    return -1;
+
+  lwip_conn *c = new lwip_conn;
+  c->socket = -1;
+  c->loop = loop;
+  auto peer = (struct sockaddr_in*)&c->addr;
+  memset(peer, 0, sizeof(*peer));
+  peer->sin_len = sizeof(*peer);
+  peer->sin_family = AF_INET;
+  peer->sin_addr.s_addr = dst;
+  peer->sin_port = htons(49152 + lwip_loop_ports++ % 16384);
+  c->addrlen = sizeof(*peer);
+
+  lwip_close(socket_);
+  socket_ = -1;
+  loop_ = loop;
+  loop_side_ = 0;
+
+  g->lock.acquire();
+  file_lwip_socket *m = g->pick(peer);
+  m->accepted_.push_back(c);
+  m->accept_cv_.wake_all();
+  g->lock.release();
+  return 0;
+}
+
+// The sockets that some epoll watches, on the list of the core that
+// started watching them, so that sockets set up on different cores
+// don't share a lock.  lwip_pollupdate() rechecks all of them whenever
+// lwip has run, since lwip won't say which sockets an incoming packet
+// or timer affected.
+struct lwip_watchlist {
+  spinlock lock;
+  ilist<file_lwip_socket, &file_lwip_socket::watch_link> sockets;
+};
+static percpu<lwip_watchlist> lwip_watched;
+
+// Requests for a recheck, and whether one is running.  A recheck that
+// finds another one running leaves it to that one, which goes around
+// again if there were requests since it started.
+static std::atomic<u64> lwip_poll_requests;
+static std::atomic<bool> lwip_polling;
+
+static void
+lwip_watch(file_lwip_socket *s)
+{
+  int cpu = myid();
+  auto &w = lwip_watched[cpu];
+  scoped_acquire l(&w.lock);
+  s->watch_cpu = cpu;
+  w.sockets.push_back(s);
+}
+
+static void
+lwip_unwatch(file_lwip_socket *s)
+{
+  auto &w = lwip_watched[s->watch_cpu];
+  scoped_acquire l(&w.lock);
+  w.sockets.erase(w.sockets.iterator_to(s));
+}
+
+// Called without lwip_core_lock held
+static void
+lwip_pollupdate(void)
+{
+  lwip_wake_pullers();
+  lwip_poll_requests++;
+  if (lwip_polling.exchange(true))
+    return;
+  for (;;) {
+    u64 seen = lwip_poll_requests;
+    for (int c = 0; c < ncpu; c++) {
+      auto &w = lwip_watched[c];
+      scoped_acquire l(&w.lock);
+      for (auto &s : w.sockets)
+        s.pollupdate();
+    }
+    lwip_polling = false;
+    if (lwip_poll_requests == seen || lwip_polling.exchange(true))
+      return;
+  }
+}
 
 struct timer_thread {
   u64 nsec;
@@ -144,11 +969,12 @@ struct timer_thread {
 int errno;
 
 void
-netrx(void *va, u16 len)
+netrx(void *va, u16 len, u32 csum_flags)
 {
   lwip_core_lock();
-  if_input(&nif, va, len);
+  if_input(&nif, va, len, csum_flags);
   lwip_core_unlock();
+  lwip_pollupdate();
 }
 
 static void __attribute__((noreturn))
@@ -162,6 +988,7 @@ net_timer(void *x)
     lwip_core_lock();
     t->func();
     lwip_core_unlock();
+    lwip_pollupdate();
     acquire(&t->waitlk);
     t->waitcv.sleep_to(&t->waitlk, cur + t->nsec);
     release(&t->waitlk);
@@ -325,6 +1152,9 @@ initnet(void)
 {
   struct proc *t;
 
+  for (int c = 0; c < NCPU; c++)
+    lwip_watched[c].lock = spinlock("lwip_watch");
+  lwip_groups_lock = spinlock("lwip_groups");
   devsw[MAJ_NETIF].pread = netifread;
 
   t = threadalloc(initnet_worker, nullptr);
@@ -358,7 +1188,7 @@ initnet(void)
 }
 
 void
-netrx(void *va, u16 len)
+netrx(void *va, u16 len, u32 csum_flags)
 {
   netfree(va);
 }
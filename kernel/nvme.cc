@@ -0,0 +1,622 @@
+#include "types.h"
+#include "amd64.h"
+#include "kernel.hh"
+#include "pci.hh"
+#include "pcireg.hh"
+#include "disk.hh"
+#include "ideconfig.hh"
+#include "nvmereg.hh"
+#include "kstream.hh"
+#include "cpu.hh"
+
+// NVMe disks that we are allowed to overwrite with the filesystem image.
+static const struct {
+  char model[40];
+  char serial[20];
+} allowed_disks[] = {
+  { "QEMU NVMe Ctrl                         ", "scalefs0           " },
+};
+
+// Commands are queued on the NVMe controller through one submission and
+// completion queue pair per core, so that the cores issuing I/O (each with its
+// own journal and block queues) don't share any locks or cache lines in the
+// driver. Completions are reaped by the controller's interrupt, which is shared
+// by all the queues, or by poll().
+
+enum { ADMIN_QUEUE_DEPTH = 16 };
+enum { PRP_ENTRIES = PGSIZE / sizeof(u64) };
+
+struct nvme_queue
+{
+  nvme_queue(u16 qid, u32 depth, int cpu);
+  NEW_DELETE_OPS(nvme_queue);
+
+  // Commands waiting for a free slot sleep on slot_cv. lock protects the
+  // rest.
+  spinlock lock;
+  condvar slot_cv;
+
+  const u16 qid;
+  const u32 depth;  // Entries in each of the queues.
+  volatile nvme_cmd *sq;
+  volatile nvme_cpl *cq;
+  volatile u32 *sq_doorbell;
+  volatile u32 *cq_doorbell;
+  u32 sq_tail;
+  u32 cq_head;
+  u16 cq_phase;
+
+  // A queue of depth entries holds upto depth-1 commands. The command ID is
+  // the index of the command's slot, and each slot has a page for the PRP
+  // list of its command.
+  u64 free_slots;  // Bitmap.
+  sref<disk_completion> slot_dc[NVME_QUEUE_DEPTH];
+  u64 *prp_list[NVME_QUEUE_DEPTH];
+
+  u64 stat_cmds;
+};
+
+class nvme_ctrl : public disk, public irq_handler
+{
+public:
+  nvme_ctrl(struct pci_func *pcif, int id);
+  nvme_ctrl(const nvme_ctrl &) = delete;
+  nvme_ctrl &operator=(const nvme_ctrl &) = delete;
+
+  static int attach(struct pci_func *pcif);
+
+  void readv(kiovec *iov, int iov_cnt, u64 off) override;
+  void writev(kiovec *iov, int iov_cnt, u64 off) override;
+  void flush() override;
+
+  void areadv(kiovec *iov, int iov_cnt, u64 off,
+              sref<disk_completion> dc) override;
+  void awritev(kiovec *iov, int iov_cnt, u64 off,
+               sref<disk_completion> dc) override;
+  void aflush(sref<disk_completion> dc) override;
+  void print_stats() override;
+  void poll() override;
+
+  void handle_irq() override;
+
+  NEW_DELETE_OPS(nvme_ctrl);
+
+private:
+  const u32 membase;
+  volatile nvme_reg *const reg;
+  const u64 cap;
+  const int id;
+
+  u32 lba_shift;      // log2 of the LBA size.
+  u64 max_xfer;       // Most bytes transferred by one command.
+
+  nvme_queue *admin;
+  nvme_queue *ioq[NCPU];
+  int nioq;
+
+  volatile u32 *doorbell(int n) {
+    return (volatile u32 *)((char *)reg + NVME_DOORBELL_BASE +
+                            n * (4 << NVME_CAP_DSTRD(cap)));
+  }
+
+  bool wait_ready(bool ready);
+  int admin_cmd(nvme_cmd *cmd, u32 *result = nullptr);
+  bool create_io_queue(nvme_queue *q);
+
+  nvme_queue *my_queue() {
+    return ioq[myid() % nioq];
+  }
+
+  int next_split(kiovec *iov, int iov_cnt, int start);
+  void rw(u8 opc, kiovec *iov, int iov_cnt, u64 off,
+          sref<disk_completion> dc);
+  void submit(nvme_queue *q, nvme_cmd *cmd, kiovec *iov, int iov_cnt,
+              sref<disk_completion> dc);
+  void reap(nvme_queue *q);
+
+  void blocking_wait(sref<disk_completion> dc) {
+    while (!dc->done()) {
+      if (myproc()->get_state() == RUNNING) {
+        dc->wait();
+      } else {
+        poll();
+      }
+    }
+  };
+};
+
+void
+initnvme(void)
+{
+#if NVMEIDE
+  pci_register_class_driver(PCI_CLASS_MASS_STORAGE,
+                            PCI_SUBCLASS_MASS_STORAGE_NVM,
+                            &nvme_ctrl::attach);
+#endif
+}
+
+int
+nvme_ctrl::attach(struct pci_func *pcif)
+{
+  static int nctrl;
+
+  if (PCI_INTERFACE(pcif->dev_class) != 0x02) {
+    console.println("NVMe: not an NVM Express controller");
+    return 0;
+  }
+
+  console.println("NVMe: attaching");
+  pci_func_enable(pcif);
+  nvme_ctrl *c __attribute__((unused)) = new nvme_ctrl(pcif, nctrl++);
+  console.println("NVMe: done");
+  return 1;
+}
+
+nvme_queue::nvme_queue(u16 qid, u32 depth, int cpu)
+  : qid(qid), depth(depth), sq_tail(0), cq_head(0), cq_phase(1),
+    free_slots(((u64)1 << (depth - 1)) - 1), stat_cmds(0)
+{
+  assert(depth >= 2 && depth <= NVME_QUEUE_DEPTH);
+  static_assert(NVME_QUEUE_DEPTH <= 64, "Slots don't fit in free_slots");
+  static_assert(NVME_QUEUE_DEPTH * sizeof(nvme_cmd) <= PGSIZE,
+                "Submission queue larger than a page");
+
+  // The queues live on the node of the core that uses them.
+  sq = (volatile nvme_cmd *)kalloc("nvme_sq", PGSIZE, cpu);
+  cq = (volatile nvme_cpl *)kalloc("nvme_cq", PGSIZE, cpu);
+  assert(sq && cq);
+  memset((void *)sq, 0, PGSIZE);
+  memset((void *)cq, 0, PGSIZE);
+
+  for (u32 i = 0; i < depth - 1; i++) {
+    prp_list[i] = (u64 *)kalloc("nvme_prp", PGSIZE, cpu);
+    assert(prp_list[i]);
+  }
+}
+
+nvme_ctrl::nvme_ctrl(struct pci_func *pcif, int id)
+  : membase(pcif->reg_base[0]),
+    reg((nvme_reg *) p2v(membase)),
+    cap(reg->cap), id(id), lba_shift(0), max_xfer(0), admin(nullptr),
+    nioq(0)
+{
+  snprintf(dk_busloc, sizeof(dk_busloc), "nvme.%d", id);
+
+  if (NVME_CAP_MPSMIN(cap) != 0) {
+    cprintf("%s: controller doesn't support 4 KB pages\n", dk_busloc);
+    return;
+  }
+
+  // Reset the controller, and set up the admin queues.
+  reg->cc &= ~NVME_CC_EN;
+  if (!wait_ready(false)) {
+    cprintf("%s: cannot disable controller\n", dk_busloc);
+    return;
+  }
+
+  admin = new nvme_queue(0, ADMIN_QUEUE_DEPTH, 0);
+  admin->sq_doorbell = doorbell(0);
+  admin->cq_doorbell = doorbell(1);
+  reg->aqa = ((ADMIN_QUEUE_DEPTH - 1) << 16) | (ADMIN_QUEUE_DEPTH - 1);
+  reg->asq = v2p((void *)admin->sq);
+  reg->acq = v2p((void *)admin->cq);
+
+  reg->cc = NVME_CC_EN | NVME_CC_CSS_NVM | NVME_CC_MPS(PGSHIFT) |
+            NVME_CC_AMS_RR | NVME_CC_IOSQES(NVME_SQE_SHIFT) |
+            NVME_CC_IOCQES(NVME_CQE_SHIFT);
+  if (!wait_ready(true)) {
+    cprintf("%s: cannot enable controller\n", dk_busloc);
+    return;
+  }
+
+  // Identify the controller and namespace 1, which we use as the disk.
+  nvme_identify_ctrl *idc = (nvme_identify_ctrl *)kalloc("nvme_identify");
+  nvme_identify_ns *idns = (nvme_identify_ns *)kalloc("nvme_identify");
+  assert(idc && idns);
+
+  nvme_cmd cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.opc = NVME_ADMIN_IDENTIFY;
+  cmd.prp1 = v2p(idc);
+  cmd.cdw10 = NVME_IDENTIFY_CTRL;
+  if (admin_cmd(&cmd) != 0) {
+    cprintf("%s: cannot identify controller\n", dk_busloc);
+    return;
+  }
+
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.opc = NVME_ADMIN_IDENTIFY;
+  cmd.nsid = 1;
+  cmd.prp1 = v2p(idns);
+  cmd.cdw10 = NVME_IDENTIFY_NS;
+  if (admin_cmd(&cmd) != 0) {
+    cprintf("%s: cannot identify namespace 1\n", dk_busloc);
+    return;
+  }
+
+  memcpy(dk_model, idc->mn, sizeof(idc->mn));
+  dk_model[sizeof(dk_model) - 1] = '\0';
+  memcpy(dk_serial, idc->sn, sizeof(idc->sn));
+  dk_serial[sizeof(dk_serial) - 1] = '\0';
+  memcpy(dk_firmware, idc->fr, sizeof(idc->fr));
+  dk_firmware[sizeof(dk_firmware) - 1] = '\0';
+
+  lba_shift = idns->lbaf[idns->flbas & 0xf].lbads;
+  dk_nbytes = idns->nsze << lba_shift;
+
+  // A command's data is described by the first page pointer and a single PRP
+  // list page.
+  max_xfer = (u64)(PRP_ENTRIES + 1) * PGSIZE;
+  if (idc->mdts)
+    max_xfer = std::min(max_xfer, (u64)PGSIZE << idc->mdts);
+  bool vwc = idc->vwc & 1;
+
+  kfree(idc);
+  kfree(idns);
+
+  bool disk_allowed = false;
+  for (int i = 0; i < sizeof(allowed_disks) / sizeof(allowed_disks[0]); i++) {
+    if (!strcmp(dk_model,  allowed_disks[i].model) &&
+        !strcmp(dk_serial, allowed_disks[i].serial))
+      disk_allowed = true;
+  }
+
+  if (!disk_allowed) {
+    cprintf("%s: disallowed NVMe disk: <%s> <%s>\n",
+            dk_busloc, dk_model, dk_serial);
+    return;
+  }
+
+  if (lba_shift < 9 || lba_shift > PGSHIFT) {
+    cprintf("%s: unsupported LBA size %d\n", dk_busloc, 1 << lba_shift);
+    return;
+  }
+
+  if (vwc) {
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opc = NVME_ADMIN_SET_FEATURES;
+    cmd.cdw10 = NVME_FEAT_VWC;
+    cmd.cdw11 = 1;
+    if (admin_cmd(&cmd) != 0)
+      cprintf("%s: cannot enable write caching\n", dk_busloc);
+  }
+
+  // Ask for a queue pair per core; the controller may grant fewer, in which
+  // case cores share queues.
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.opc = NVME_ADMIN_SET_FEATURES;
+  cmd.cdw10 = NVME_FEAT_NUM_QUEUES;
+  cmd.cdw11 = ((ncpu - 1) << 16) | (ncpu - 1);
+  u32 granted;
+  if (admin_cmd(&cmd, &granted) != 0) {
+    cprintf("%s: cannot set the number of queues\n", dk_busloc);
+    return;
+  }
+  int nqueues = std::min(ncpu, (int)std::min(granted & 0xffff,
+                                             granted >> 16) + 1);
+
+  u32 depth = std::min((u64)NVME_QUEUE_DEPTH, NVME_CAP_MQES(cap) + 1);
+  for (int i = 0; i < nqueues; i++) {
+    nvme_queue *q = new nvme_queue(i + 1, depth, i);
+    if (!create_io_queue(q)) {
+      cprintf("%s: cannot create I/O queue %d\n", dk_busloc, i + 1);
+      delete q;
+      break;
+    }
+    ioq[nioq++] = q;
+  }
+
+  if (!nioq)
+    return;
+
+  irq nvme_irq;
+
+#ifdef HW_ben
+  nvme_irq = pci_map_msi_irq(pcif, id % ncpu);
+#endif
+
+  if (!nvme_irq.valid()) {
+    nvme_irq = extpic->map_pci_irq(pcif);
+    nvme_irq.enable();
+  }
+
+  nvme_irq.register_handler(this);
+
+  cprintf("%s: %d I/O queues of %d entries, %ld KB max transfer\n",
+          dk_busloc, nioq, depth, max_xfer / 1024);
+  disk_register(this);
+}
+
+bool
+nvme_ctrl::wait_ready(bool ready)
+{
+  // CAP.TO is the worst-case time to become (not) ready, in 500 ms units.
+  for (u64 ms = 0; ms <= NVME_CAP_TO(cap) * 500; ms++) {
+    u32 csts = reg->csts;
+    if (csts & NVME_CSTS_CFS)
+      return false;
+    if (!!(csts & NVME_CSTS_RDY) == ready)
+      return true;
+    microdelay(1000);
+  }
+  return false;
+}
+
+// Issue an admin command and wait for it to complete, by polling the admin
+// completion queue (admin commands are issued only while attaching, before the
+// interrupt is set up). Returns the command's status.
+int
+nvme_ctrl::admin_cmd(nvme_cmd *cmd, u32 *result)
+{
+  nvme_queue *q = admin;
+
+  cmd->cid = 0;
+  memcpy((void *)&q->sq[q->sq_tail], cmd, sizeof(*cmd));
+  q->sq_tail = (q->sq_tail + 1) % q->depth;
+  *q->sq_doorbell = q->sq_tail;
+
+  u64 ts_start = rdtsc();
+  for (;;) {
+    volatile nvme_cpl *cpl = &q->cq[q->cq_head];
+    u16 status = cpl->status;
+    if (NVME_CPL_PHASE(status) == q->cq_phase) {
+      if (result)
+        *result = cpl->dw0;
+      if (++q->cq_head == q->depth) {
+        q->cq_head = 0;
+        q->cq_phase ^= 1;
+      }
+      *q->cq_doorbell = q->cq_head;
+      return NVME_CPL_STATUS(status);
+    }
+
+    u64 ts_diff = rdtsc() - ts_start;
+    if (ts_diff > 1000 * 1000 * 1000) {
+      cprintf("%s: admin command 0x%x stuck for %lx cycles\n",
+              dk_busloc, cmd->opc, ts_diff);
+      return -1;
+    }
+  }
+}
+
+bool
+nvme_ctrl::create_io_queue(nvme_queue *q)
+{
+  nvme_cmd cmd;
+
+  q->sq_doorbell = doorbell(2 * q->qid);
+  q->cq_doorbell = doorbell(2 * q->qid + 1);
+
+  // All the completion queues share interrupt vector 0.
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.opc = NVME_ADMIN_CREATE_CQ;
+  cmd.prp1 = v2p((void *)q->cq);
+  cmd.cdw10 = ((q->depth - 1) << 16) | q->qid;
+  cmd.cdw11 = NVME_CQ_IRQ_ENABLED | NVME_QUEUE_PHYS_CONTIG;
+  if (admin_cmd(&cmd) != 0)
+    return false;
+
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.opc = NVME_ADMIN_CREATE_SQ;
+  cmd.prp1 = v2p((void *)q->sq);
+  cmd.cdw10 = ((q->depth - 1) << 16) | q->qid;
+  cmd.cdw11 = (q->qid << 16) | NVME_QUEUE_PHYS_CONTIG;
+  return admin_cmd(&cmd) == 0;
+}
+
+// A command's data must be described by page pointers: only the first buffer
+// may start in the middle of a page, and only the last one may end in the
+// middle of one. Return the end of the longest run of iov from start that
+// satisfies that and fits in one command.
+int
+nvme_ctrl::next_split(kiovec *iov, int iov_cnt, int start)
+{
+  u64 nbytes = iov[start].iov_len;
+  assert(nbytes <= max_xfer);
+
+  int i;
+  for (i = start + 1; i < iov_cnt; i++) {
+    if (PGOFFSET((uptr)iov[i - 1].iov_base + iov[i - 1].iov_len) ||
+        PGOFFSET((uptr)iov[i].iov_base) ||
+        nbytes + iov[i].iov_len > max_xfer)
+      break;
+    nbytes += iov[i].iov_len;
+  }
+  return i;
+}
+
+// Read or write iov, splitting it into as many commands as needed (see
+// next_split()); dc is notified once all of them are done.
+void
+nvme_ctrl::rw(u8 opc, kiovec *iov, int iov_cnt, u64 off,
+              sref<disk_completion> dc)
+{
+  int ncmds = 0;
+  for (int i = 0; i < iov_cnt; i = next_split(iov, iov_cnt, i))
+    ncmds++;
+  assert(ncmds > 0);
+  dc->expect_more(ncmds - 1);
+
+  nvme_queue *q = my_queue();
+  for (int i = 0, end; i < iov_cnt; i = end) {
+    end = next_split(iov, iov_cnt, i);
+
+    u64 nbytes = 0;
+    for (int j = i; j < end; j++)
+      nbytes += iov[j].iov_len;
+    assert(off % (1 << lba_shift) == 0 && nbytes % (1 << lba_shift) == 0);
+
+    nvme_cmd cmd;
+    memset(&cmd, 0, sizeof(cmd));
+    cmd.opc = opc;
+    cmd.nsid = 1;
+    u64 slba = off >> lba_shift;
+    cmd.cdw10 = slba & 0xffffffff;
+    cmd.cdw11 = slba >> 32;
+    cmd.cdw12 = (nbytes >> lba_shift) - 1;
+    submit(q, &cmd, &iov[i], end - i, dc);
+
+    off += nbytes;
+  }
+}
+
+void
+nvme_ctrl::submit(nvme_queue *q, nvme_cmd *cmd, kiovec *iov, int iov_cnt,
+                  sref<disk_completion> dc)
+{
+  scoped_acquire a(&q->lock);
+
+  while (!q->free_slots)
+    q->slot_cv.sleep(&q->lock);
+
+  int slot = __builtin_ctzll(q->free_slots);
+  q->free_slots &= ~((u64)1 << slot);
+  q->slot_dc[slot] = dc;
+  q->stat_cmds++;
+  cmd->cid = slot;
+
+  // The first page pointer may have an offset; the rest are whole pages,
+  // either in the second pointer or in the slot's PRP list.
+  if (iov_cnt) {
+    u64 *list = q->prp_list[slot];
+    int n = 0;
+    cmd->prp1 = v2p(iov[0].iov_base);
+    for (int i = 0; i < iov_cnt; i++) {
+      uptr pa = v2p(iov[i].iov_base);
+      uptr page = i ? pa : PGROUNDDOWN(pa) + PGSIZE;
+      for (; page < pa + iov[i].iov_len; page += PGSIZE) {
+        assert(n < PRP_ENTRIES);
+        list[n++] = page;
+      }
+    }
+
+    if (n == 1)
+      cmd->prp2 = list[0];
+    else if (n > 1)
+      cmd->prp2 = v2p(list);
+  }
+
+  memcpy((void *)&q->sq[q->sq_tail], cmd, sizeof(*cmd));
+  q->sq_tail = (q->sq_tail + 1) % q->depth;
+  *q->sq_doorbell = q->sq_tail;
+}
+
+// Notify the completions of the commands that the controller has finished.
+// Caller must hold q->lock.
+void
+nvme_ctrl::reap(nvme_queue *q)
+{
+  bool reaped = false;
+
+  for (;;) {
+    volatile nvme_cpl *cpl = &q->cq[q->cq_head];
+    u16 status = cpl->status;
+    if (NVME_CPL_PHASE(status) != q->cq_phase)
+      break;
+
+    u16 slot = cpl->cid;
+    if (NVME_CPL_STATUS(status))
+      panic("%s: queue %d: command %d failed with status 0x%x\n",
+            dk_busloc, q->qid, slot, NVME_CPL_STATUS(status));
+
+    assert(q->slot_dc[slot]);
+    q->slot_dc[slot]->notify();
+    q->slot_dc[slot].reset();
+    q->free_slots |= (u64)1 << slot;
+    reaped = true;
+
+    if (++q->cq_head == q->depth) {
+      q->cq_head = 0;
+      q->cq_phase ^= 1;
+    }
+  }
+
+  if (reaped) {
+    *q->cq_doorbell = q->cq_head;
+    q->slot_cv.wake_all();
+  }
+}
+
+void
+nvme_ctrl::handle_irq()
+{
+  for (int i = 0; i < nioq; i++) {
+    scoped_acquire a(&ioq[i]->lock);
+    reap(ioq[i]);
+  }
+}
+
+void
+nvme_ctrl::poll()
+{
+  // Like ahci_port::poll(), don't wait for queues that someone else is
+  // already reaping (or submitting to).
+  for (int i = 0; i < nioq; i++) {
+    if (!ioq[i]->lock.try_acquire())
+      continue;
+    reap(ioq[i]);
+    ioq[i]->lock.release();
+  }
+}
+
+void
+nvme_ctrl::readv(kiovec *iov, int iov_cnt, u64 off)
+{
+  auto dc = sref<disk_completion>::transfer(new disk_completion());
+  areadv(iov, iov_cnt, off, dc);
+  blocking_wait(dc);
+}
+
+void
+nvme_ctrl::areadv(kiovec *iov, int iov_cnt, u64 off,
+                  sref<disk_completion> dc)
+{
+  rw(NVME_CMD_READ, iov, iov_cnt, off, dc);
+}
+
+void
+nvme_ctrl::writev(kiovec *iov, int iov_cnt, u64 off)
+{
+  auto dc = sref<disk_completion>::transfer(new disk_completion());
+  awritev(iov, iov_cnt, off, dc);
+  blocking_wait(dc);
+}
+
+void
+nvme_ctrl::awritev(kiovec *iov, int iov_cnt, u64 off,
+                   sref<disk_completion> dc)
+{
+  rw(NVME_CMD_WRITE, iov, iov_cnt, off, dc);
+}
+
+void
+nvme_ctrl::flush()
+{
+  auto dc = sref<disk_completion>::transfer(new disk_completion());
+  aflush(dc);
+  blocking_wait(dc);
+}
+
+void
+nvme_ctrl::aflush(sref<disk_completion> dc)
+{
+  // Unlike FLUSH CACHE on SATA, an NVMe flush needn't wait for the other
+  // commands to drain: it covers all the writes completed before it was
+  // submitted, which are all the writes our callers wait for.
+  nvme_cmd cmd;
+  memset(&cmd, 0, sizeof(cmd));
+  cmd.opc = NVME_CMD_FLUSH;
+  cmd.nsid = 1;
+  submit(my_queue(), &cmd, nullptr, 0, dc);
+}
+
+void
+nvme_ctrl::print_stats()
+{
+  for (int i = 0; i < nioq; i++) {
+    scoped_acquire a(&ioq[i]->lock);
+    cprintf("%s: queue %d: %lu cmds, %d in flight\n", dk_busloc, ioq[i]->qid,
+            ioq[i]->stat_cmds,
+            (int)(ioq[i]->depth - 1) - __builtin_popcountll(ioq[i]->free_slots));
+  }
+}
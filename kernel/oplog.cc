@@ -0,0 +1,38 @@
+// Background flushing of OpLog's per-CPU logger caches.
+
+#include "types.h"
+#include "kernel.hh"
+#include "shrinker.hh"
+#include "oplog.hh"
+
+namespace {
+  // OpLog's loggers don't hold memory that flushing gives back (the
+  // operations move to the object until it's synchronized), so this
+  // only does housekeeping: once a CPU's cache has seen conflicts, it
+  // flushes the long loggers there so the ways they hold are free for
+  // the next miss.
+  class oplog_shrinker : public shrinker
+  {
+  public:
+    oplog_shrinker() : shrinker("oplog") { }
+
+    size_t count(int cpu) override
+    {
+      return 0;
+    }
+
+    size_t scan(int cpu, size_t nr) override
+    {
+      return 0;
+    }
+
+    void idle(int cpu) override
+    {
+      if (OPLOG_FLUSH_OPS)
+        oplog::logged_object<oplog::tsc_logger>::flush_long_logs(
+          cpu, OPLOG_FLUSH_OPS);
+    }
+  };
+
+  oplog_shrinker the_oplog_shrinker;
+}
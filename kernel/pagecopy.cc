@@ -0,0 +1,80 @@
+// Page copy and zero primitives; see pagecopy.hh.
+
+#include "types.h"
+#include "kernel.hh"
+#include "condvar.hh"
+#include "cpuid.hh"
+#include "pagecopy.hh"
+
+void (*pagecopy)(void *dst, const void *src) = pagecopy_movsq;
+void (*pagezero)(void *dst) = zpage;
+
+static void (*const copy_variants[])(void *, const void *) = {
+  pagecopy_movsq, pagecopy_movsb, pagecopy_unrolled, pagecopy_nt,
+};
+static_assert(NELEM(copy_variants) == PAGECOPY_NVARIANTS,
+              "copy_variants out of date");
+
+static void (*const zero_variants[])(void *) = {
+  pagezero_stosq, pagezero_stosb, zpage, zpage_nc,
+};
+
+void
+initpagecopy(void)
+{
+  // With ERMS, rep movsb and rep stosb move whole cache lines at a time
+  // and beat the quadword versions; without it they go byte by byte.
+  if (cpuid::features().erms) {
+    pagecopy = pagecopy_movsb;
+    pagezero = pagezero_stosb;
+  }
+}
+
+// Time rounds passes of the page copy (op 0) or zero (op 1) variant
+// variant over npages pages, for bin/pagebench.  Copies go from each of
+// npages source pages to a page of its own.  Returns nanoseconds, or -1.
+//SYSCALL
+long
+sys_pagebench(int op, int variant, u64 npages, u64 rounds)
+{
+  if (op < 0 || op > 1 || variant < 0 || !npages ||
+      npages > PAGEBENCH_MAX_PAGES)
+    return -1;
+  if (op == 0 && (u64)variant >= NELEM(copy_variants))
+    return -1;
+  if (op == 1 && (u64)variant >= NELEM(zero_variants))
+    return -1;
+
+  u64 nslots = op == 0 ? 2 * npages : npages;
+  char **pages = (char**)kmalloc(nslots * sizeof(char*), "pagebench");
+  if (!pages)
+    return -1;
+  u64 n = 0;
+  for (; n < nslots; n++) {
+    pages[n] = kalloc("pagebench");
+    if (!pages[n])
+      break;
+    memset(pages[n], n, PGSIZE);
+  }
+
+  long elapsed = -1;
+  if (n == nslots) {
+    u64 start = nsectime();
+    for (u64 r = 0; r < rounds; r++) {
+      for (u64 i = 0; i < npages; i++) {
+        if (op == 0)
+          copy_variants[variant](pages[npages + i], pages[i]);
+        else
+          zero_variants[variant](pages[i]);
+      }
+    }
+    // zpage_nc leaves its stores unordered
+    asm volatile("sfence" ::: "memory");
+    elapsed = nsectime() - start;
+  }
+
+  for (u64 i = 0; i < n; i++)
+    kfree(pages[i]);
+  kmfree(pages, nslots * sizeof(char*));
+  return elapsed;
+}
@@ -186,7 +186,7 @@ pci_scan_caplist(struct pci_func* f)
 }
 
 irq
-pci_map_msi_irq(struct pci_func *f)
+pci_map_msi_irq(struct pci_func *f, int cpu)
 {
   // PCI System Architecture, Fourth Edition
   bool is_64bit = false;
@@ -199,7 +199,7 @@ pci_map_msi_irq(struct pci_func *f)
   if (!res.reserve(nullptr, 0))
     return irq();
 
-  verbose.println("pci: Routing ", *f, " to MSI ", res);
+  verbose.println("pci: Routing ", *f, " to MSI ", res, " on CPU ", cpu);
 
   u32 cap_entry = pci_conf_read(f, f->msi_capreg);  
 
@@ -218,7 +218,7 @@ pci_map_msi_irq(struct pci_func *f)
   // If we're using an IOMMU, allocate an interrupt redirection entry
   uint64_t iommu_index = 0;
   if (iommu)
-    iommu_index = iommu->allocate_int(res, &cpus[0]);
+    iommu_index = iommu->allocate_int(res, &cpus[cpu]);
 
   // [PCI SA pg 253]
   // Step 4. Assign a dword-aligned memory address to the device's
@@ -228,7 +228,7 @@ pci_map_msi_irq(struct pci_func *f)
   // manual.)
   if (!iommu) {
     // Non-remapped ("compatibility format") interrupts
-    uint64_t dest = cpus[0].hwid.num;
+    uint64_t dest = cpus[cpu].hwid.num;
     pci_conf_write(f, f->msi_capreg + 4*1,
                    (0x0fee << 20) |   // magic constant for northbridge
                    (dest << 12) |     // destination ID
@@ -9,15 +9,30 @@
 #include "cpu.hh"
 #include "uk/unistd.h"
 #include "uk/fcntl.h"
+#include "atomic_util.hh"
+#include "epoll.hh"
+#include <uk/epoll.h>
 
 #define PIPESIZE (16*4096)
+#define PIPECORESIZE (4*4096)  // Bytes of each core's unordered buffer
 
 struct pipe {
   virtual ~pipe() { };
   virtual int write(const char *addr, int n) = 0;
   virtual int read(char *addr, int n) = 0;
   virtual int close(int writable) = 0;
+  // The readiness of the read (!writable) or write end for epoll
+  virtual u32 readiness(int writable) = 0;
+  virtual sref<poll_queue> pollq(int writable) {
+    return pq[writable].get([=](){ return readiness(writable); });
+  }
   NEW_DELETE_OPS(pipe);
+
+  void pollupdate(int writable, u32 happened) {
+    pq[writable].update(happened, [=](){ return readiness(writable); });
+  }
+
+  poll_slot pq[2];              // The read and write ends'
 };
 
 struct ordered : pipe {
@@ -70,12 +85,20 @@ struct ordered : pipe {
         scoped_acquire lclose(&lock_close);
         if (!readopen)
           return -1;
+        // Let readers drain what we've written so far
+        if (i > 0) {
+          empty.wake_all();
+          pollupdate(0, EPOLLIN);
+        }
         full.sleep(&lock, &lock_close);
       }
       data[nwrite++ % PIPESIZE] = addr[i];
     }
-    if (n > 0)
+    if (n > 0) {
       empty.wake_all();
+      pollupdate(0, EPOLLIN);
+      pollupdate(1, 0);
+    }
     return n;
   }
 
@@ -108,8 +131,11 @@ struct ordered : pipe {
         break;
       addr[i] = data[nread++ % PIPESIZE];
     }
-    if (i > 0)
+    if (i > 0) {
       full.wake_all();
+      pollupdate(1, EPOLLOUT);
+      pollupdate(0, 0);
+    }
     return i;
   }
 
@@ -117,8 +143,12 @@ struct ordered : pipe {
     scoped_acquire l(&lock_close);
     if(writable){
       writeopen = 0;
+      pq[1].shutdown();
+      pollupdate(0, EPOLLHUP);
     } else {
       readopen = 0;
+      pq[0].shutdown();
+      pollupdate(1, EPOLLERR);
     }
     empty.wake_all();
     if(readopen == 0 && writeopen == 0){
@@ -126,8 +156,224 @@ struct ordered : pipe {
     }
     return 0;
   }
+
+  virtual u32 readiness(int writable) override {
+    if (writable)
+      return !readopen ? EPOLLOUT | EPOLLERR :
+        nwrite != nread + PIPESIZE ? EPOLLOUT : 0;
+    return (nread != nwrite ? EPOLLIN : 0) |
+      (writeopen ? 0 : EPOLLIN | EPOLLHUP);
+  }
+
+  // Every change to the readiness happens under lock or lock_close
+  virtual sref<poll_queue> pollq(int writable) override {
+    scoped_acquire l(&lock);
+    scoped_acquire lclose(&lock_close);
+    return pipe::pollq(writable);
+  }
 };
 
+// A packet-mode pipe (pipe2 with O_DIRECT), for many writers feeding
+// one pipe.  Each write is a packet and each read returns one packet,
+// discarding whatever of it doesn't fit, as on Linux.  Writers append
+// to a buffer of their own core, allocated on the core's first write,
+// so writers on different cores share neither a lock nor cache lines.
+// Packets from one core come out in order; packets from different
+// cores are unordered.  Readers take packets from their own core's
+// buffer first, then from the others.  Writers only wake readers if
+// some are asleep, and readers only wake a core's writers once half
+// of its buffer is free.
+struct unordered : pipe {
+  struct corebuf {
+    struct spinlock lock;
+    struct condvar full;
+    // Bytes ever written and read.  Written with lock held; read
+    // without it to look for packets.
+    std::atomic<size_t> head;
+    std::atomic<size_t> tail;
+    int nfull;                  // Writers asleep on full
+    char data[PIPECORESIZE];
+
+    corebuf()
+      : lock("pipe:core", LOCKSTAT_PIPE), full("pipe:full"), head(0),
+        tail(0), nfull(0) { }
+    NEW_DELETE_OPS(corebuf);
+
+    bool empty() const { return head == tail; }
+    size_t space() const { return PIPECORESIZE - (head - tail); }
+
+    void copyin(size_t pos, const void *src, size_t n) {
+      size_t off = pos % PIPECORESIZE, cc = std::min(n, PIPECORESIZE - off);
+      memmove(data + off, src, cc);
+      memmove(data, (const char*)src + cc, n - cc);
+    }
+
+    void copyout(size_t pos, void *dst, size_t n) const {
+      size_t off = pos % PIPECORESIZE, cc = std::min(n, PIPECORESIZE - off);
+      memmove(dst, data + off, cc);
+      memmove((char*)dst + cc, data, n - cc);
+    }
+  };
+
+  std::atomic<corebuf*> bufs[NCPU];
+  struct spinlock lock;         // Protects sleeping readers and closing
+  struct condvar  empty;
+  std::atomic<int> nempty;      // Readers asleep (or about to be) on empty
+  std::atomic<bool> readopen;
+  std::atomic<bool> writeopen;
+  bool nonblock;
+
+  unordered(int flags)
+    : nempty(0), readopen(true), writeopen(true),
+      nonblock(flags & O_NONBLOCK)
+  {
+    for (int i = 0; i < NCPU; i++)
+      bufs[i] = nullptr;
+    lock = spinlock("pipe", LOCKSTAT_PIPE);
+    empty = condvar("pipe:empty");
+  }
+  ~unordered() override {
+    for (int i = 0; i < NCPU; i++)
+      delete bufs[i].load();
+  }
+  NEW_DELETE_OPS(unordered);
+
+  corebuf* mycorebuf() {
+    int id = myid();
+    for (;;) {
+      corebuf *cb = bufs[id];
+      if (cb)
+        return cb;
+      cb = new corebuf;
+      if (cmpxch(&bufs[id], (corebuf*) nullptr, cb))
+        return cb;
+      delete cb;
+    }
+  }
+
+  // Whether some core has a packet.  Sequentially consistent with the
+  // writers' publication of head.
+  bool available() const {
+    for (int i = 0; i < ncpu; i++) {
+      corebuf *cb = bufs[i];
+      if (cb && !cb->empty())
+        return true;
+    }
+    return false;
+  }
+
+  // Writes bigger than a page become several packets.
+  virtual int write(const char *addr, int n) override {
+    for (int done = 0; done < n; ) {
+      u32 len = std::min(n - done, PGSIZE);
+      if (!writepacket(addr + done, len))
+        return done ? done : -1;
+      done += len;
+    }
+    return n;
+  }
+
+  bool writepacket(const char *addr, u32 len) {
+    if (!readopen)
+      return false;
+
+    corebuf *cb = mycorebuf();
+    {
+      scoped_acquire l(&cb->lock);
+      while (cb->space() < sizeof(len) + len) {
+        if (nonblock || myproc()->killed || !readopen)
+          return false;
+        cb->nfull++;
+        auto cleanup = scoped_cleanup([cb](){ cb->nfull--; });
+        cb->full.sleep(&cb->lock);
+      }
+      size_t h = cb->head;
+      cb->copyin(h, &len, sizeof(len));
+      cb->copyin(h + sizeof(len), addr, len);
+      cb->head = h + sizeof(len) + len;
+    }
+
+    pollupdate(0, EPOLLIN);
+    if (nempty) {
+      scoped_acquire l(&lock);
+      empty.wake_all();
+    }
+    return true;
+  }
+
+  // Take a packet from cb, if it has one.  Returns the number of bytes
+  // read, or -1 if cb is empty.
+  int take(corebuf *cb, char *addr, int n) {
+    scoped_acquire l(&cb->lock);
+    if (cb->empty())
+      return -1;
+    u32 len;
+    size_t t = cb->tail;
+    cb->copyout(t, &len, sizeof(len));
+    int cc = std::min((int)len, n);
+    cb->copyout(t + sizeof(len), addr, cc);
+    cb->tail = t + sizeof(len) + len;
+    if (cb->nfull && cb->space() >= PIPECORESIZE / 2)
+      cb->full.wake_all();
+    return cc;
+  }
+
+  virtual int read(char *addr, int n) override {
+    for (;;) {
+      int id = myid();
+      for (int i = 0; i < ncpu; i++) {
+        corebuf *cb = bufs[(id + i) % ncpu];
+        if (cb && !cb->empty()) {
+          int r = take(cb, addr, n);
+          if (r >= 0) {
+            pollupdate(0, 0);
+            return r;
+          }
+        }
+      }
+
+      if (nonblock || myproc()->killed)
+        return -1;
+      scoped_acquire l(&lock);
+      nempty++;
+      auto cleanup = scoped_cleanup([this](){ nempty--; });
+      if (available())
+        continue;
+      if (!writeopen)
+        return 0;
+      empty.sleep(&lock);
+    }
+  }
+
+  virtual int close(int writable) override {
+    scoped_acquire l(&lock);
+    if (writable) {
+      writeopen = false;
+      pq[1].shutdown();
+      pollupdate(0, EPOLLHUP);
+      empty.wake_all();
+    } else {
+      readopen = false;
+      pq[0].shutdown();
+      pollupdate(1, EPOLLERR);
+      for (int i = 0; i < NCPU; i++) {
+        corebuf *cb = bufs[i];
+        if (cb) {
+          scoped_acquire cl(&cb->lock);
+          cb->full.wake_all();
+        }
+      }
+    }
+    return !readopen && !writeopen;
+  }
+
+  // Writers always have room somewhere, eventually
+  virtual u32 readiness(int writable) override {
+    if (writable)
+      return readopen ? EPOLLOUT : EPOLLOUT | EPOLLERR;
+    return (available() ? EPOLLIN : 0) | (writeopen ? 0 : EPOLLIN | EPOLLHUP);
+  }
+};
 
 int
 pipealloc(sref<file> *f0, sref<file> *f1, int flags)
@@ -135,7 +381,10 @@ pipealloc(sref<file> *f0, sref<file> *f1, int flags)
   struct pipe *p = nullptr;
   auto cleanup = scoped_cleanup([&](){delete p;});
   try {
-    p = new ordered(flags);
+    if (flags & O_DIRECT)
+      p = new unordered(flags);
+    else
+      p = new ordered(flags);
     *f0 = make_sref<file_pipe_reader>(p);
     *f1 = make_sref<file_pipe_writer>(p);
   } catch (std::bad_alloc &e) {
@@ -152,6 +401,12 @@ pipeclose(struct pipe *p, int writable)
     delete p;
 }
 
+sref<poll_queue>
+pipepollq(struct pipe *p, int writable)
+{
+  return p->pollq(writable);
+}
+
 int
 pipewrite(struct pipe *p, const char *addr, int n)
 {
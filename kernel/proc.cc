@@ -35,10 +35,10 @@ enum { sched_debug = 0 };
 proc::proc(int npid) :
   kstack(0), pid(npid), parent(0), tf(0), context(0), killed(0),
   tsc(0), curcycles(0), cpuid(0), fpu_state(nullptr),
-  cpu_pin(0), oncv(0), cv_wakeup(0),
-  futex_lock("proc::futex_lock", LOCKSTAT_PROC),
+  cpu_pin(0), home_cpu(-1), home_set_(false), oncv(0), cv_wakeup(0),
+  futex_key(nullptr), futex_bitset(0),
   user_fs_(0), unmap_tlbreq_(0), data_cpuid(-1), in_exec_(0), 
-  uaccess_(0), yield_(false),
+  uaccess_(0), yield_(false), disk_tag(0), cur_syscall(0),
   upath(nullptr), uargv(nullptr),
   exception_inuse(0), magic(PROC_MAGIC), unmapped_hint(0), state_(EMBRYO)
 {
@@ -102,12 +102,39 @@ proc::set_cpu_pin(int cpu)
   // post_swtch will put us on the new runq.
   cpuid = cpu;
   cpu_pin = 1;
+  if (!home_set_)
+    home_cpu = cpu;
   myproc()->set_state(RUNNABLE);
   sched();
   assert(mycpu()->id == cpu);
   return 0;
 }
 
+// Set the home core, or let it follow the proc again if cpu is -1.
+// This doesn't move the proc; set_cpu_pin() does that.
+int
+proc::set_home(int cpu)
+{
+  if (cpu < -1 || cpu >= ncpu)
+    return -1;
+  if (myproc() != this)
+    panic("set_home not implemented for non-current proc");
+  home_cpu = cpu;
+  home_set_ = cpu != -1;
+  return 0;
+}
+
+int
+myhome(void)
+{
+  proc *p = myproc();
+  if (!p)
+    return myid();
+  if (p->home_cpu < 0)
+    p->home_cpu = myid();
+  return p->home_cpu;
+}
+
 // Give up the CPU for one scheduling round.
 void
 yield(void)
@@ -407,6 +434,10 @@ doclone(clone_flags flags)
   np->parent = myproc();
   *np->tf = *myproc()->tf;
   np->cpu_pin = myproc()->cpu_pin;
+  if (myproc()->home_set_) {
+    np->home_cpu = myproc()->home_cpu;
+    np->home_set_ = true;
+  }
   np->data_cpuid = myproc()->data_cpuid;
   np->run_cpuid_ = myproc()->run_cpuid_;
   np->user_fs_ = myproc()->user_fs_;
@@ -2,6 +2,8 @@
 #include "proc.hh"
 #include "kstream.hh"
 #include "bitset.hh"
+#include "ipi.hh"
+#include "condvar.hh"
 
 #include <atomic>
 #include <iterator>
@@ -36,6 +38,16 @@ namespace refcache {
   static std::atomic<size_t> global_epoch_left __mpalign__;
 
   static __padout__ __attribute__((unused));
+
+  // When each of the last EPOCH_HISTORY global epochs started, for
+  // measuring how long objects take to be freed.
+  enum { EPOCH_HISTORY = 16 };
+  static uint64_t epoch_start_tsc[EPOCH_HISTORY];
+
+  // Pending request for the expediter thread
+  static std::atomic<bool> expedite_pending;
+  static spinlock expedite_lock;
+  static condvar expedite_cv;
 }
 
 void
@@ -80,6 +92,9 @@ refcache::cache::evict(struct refcache::cache::way *way,
       obj->review_epoch_ = local_epoch + (local_epoch_is_exact ? 2 : 3);
       obj->dirty_ = false;
       review_.push_back(obj);
+      ++review_len_;
+      if (REFCACHE_EXPEDITE_REVIEW && review_len_ == REFCACHE_EXPEDITE_REVIEW)
+        request_expedite();
       // If this object has a weak reference, mark it dying.
       if (obj->weak_) {
         weak_referenced *wobj = static_cast<weak_referenced*>(obj);
@@ -143,6 +158,7 @@ refcache::cache::review()
   auto review = reviewable.begin();
   auto review_end = reviewable.end();
   uint64_t nreviewed = 0, nrequeued = 0, ndisowned = 0;
+  uint64_t now = rdtsc();
   while (review != review_end) {
     auto obj = review++;
     ++nreviewed;
@@ -178,11 +194,20 @@ refcache::cache::review()
         obj->review_epoch_ = epoch + 2;
         scoped_cli cli;
         review_.push_back(&*obj);
+        ++review_len_;
         ++nrequeued;
       } else {
         // It was zero for the whole round.  Free it.
         if (SDEBUG)
           sdebug.println("refcache: CPU ", myid(), " freeing obj ", &*obj);
+        // Its count went to zero (for the last time) during epoch
+        // review_epoch_ - 2.
+        uint64_t zeroed = obj->review_epoch_ - 2;
+        if (epoch - zeroed < EPOCH_HISTORY) {
+          kstats::inc(&kstats::refcache_free_latency_count);
+          kstats::inc(&kstats::refcache_free_latency_cycles,
+                      now - epoch_start_tsc[zeroed % EPOCH_HISTORY]);
+        }
         obj->review_epoch_ = 0;
         l.release();
 
@@ -214,6 +239,11 @@ refcache::cache::review()
   //                   " freed ", nfreed, " requeued ", nrequeued,
   //                   " disowned ", ndisowned);
 
+  {
+    scoped_cli cli;
+    review_len_ -= nreviewed;
+  }
+
   kstats::inc(&kstats::refcache_item_reviewed_count, nreviewed);
   kstats::inc(&kstats::refcache_item_requeued_count, nrequeued);
   kstats::inc(&kstats::refcache_item_disowned_count, ndisowned);
@@ -265,6 +295,7 @@ refcache::cache::flush()
     // We're the last core to reach the global epoch.  Move to the
     // next epoch.
     global_epoch_left = ncpu;
+    epoch_start_tsc[(cur_global + 1) % EPOCH_HISTORY] = rdtsc();
     ++global_epoch;
   }
 
@@ -314,23 +345,25 @@ refcache::referenced::get_consistent()
 retry:
   for (;;) {
     uint64_t count = 0;
-    seqcount<uint32_t>::reader r[NCPU+1];
-    bitset<NCPU+1> cpus_;
+    // This object may be cached in any way of its set, so check all
+    // of them.
+    seqcount<uint32_t>::reader r[NCPU * CACHE_WAYS + 1];
     for (int i = 0; i < ncpu; i++) {
-      auto way = refcache::mycache[i].hash_way(this);
-      r[i] = way->seq.read_begin();
-      if (way->obj == this) {
-        count += way->delta;
-        cpus_.set(i);
+      auto ways = refcache::mycache[i].hash_way(this);
+      for (int w = 0; w < CACHE_WAYS; w++) {
+        auto way = &ways[w];
+        r[i * CACHE_WAYS + w] = way->seq.read_begin();
+        if (way->obj == this)
+          count += way->delta;
       }
     }
 
-    r[ncpu] = refcount_seq_.read_begin();
+    int n = ncpu * CACHE_WAYS;
+    r[n] = refcount_seq_.read_begin();
     count += refcount_;
-    cpus_.set(ncpu);
 
-    for (auto cpu : cpus_)
-      if (r[cpu].need_retry())
+    for (int i = 0; i <= n; i++)
+      if (r[i].need_retry())
         goto retry;
     return count;
   }
@@ -379,6 +412,48 @@ test(void *)
 }
 #endif
 
+void
+refcache::expedite()
+{
+  kstats::inc(&kstats::refcache_expedite_count);
+  kstats::timer timer(&kstats::refcache_expedite_cycles);
+
+  bitset<NCPU> all;
+  for (int i = 0; i < ncpu; i++)
+    all.set(i);
+  // Everything on a review list is reviewable by local_epoch + 3 of
+  // the core that put it there (see evict), and every round of
+  // flushes advances global_epoch by at least one.
+  for (int round = 0; round < 3; round++)
+    run_on_cpus(all, []() { mycache->flush(); });
+  run_on_cpus(all, []() { mycache->review(); });
+}
+
+void
+refcache::request_expedite()
+{
+  if (expedite_pending.load(std::memory_order_relaxed) ||
+      expedite_pending.exchange(true))
+    return;
+  scoped_acquire l(&expedite_lock);
+  expedite_cv.wake_all();
+}
+
+static void
+refcache_expediter(void*)
+{
+  for (;;) {
+    {
+      scoped_acquire l(&refcache::expedite_lock);
+      while (!refcache::expedite_pending)
+        refcache::expedite_cv.sleep(&refcache::expedite_lock);
+    }
+    // Requests that come in while we're running get another round
+    refcache::expedite_pending = false;
+    refcache::expedite();
+  }
+}
+
 static void
 refcache_reaper(void*)
 {
@@ -393,9 +468,12 @@ initrefcache(void)
   // no reviewer, so start the global epoch count at 1.
   refcache::global_epoch = 1;
   refcache::global_epoch_left = ncpu;
+  refcache::expedite_lock = spinlock("refcache::expedite_lock");
+  refcache::expedite_cv = condvar("refcache::expedite_cv");
 
   for (int i = 0; i < NCPU; i++)
     threadpin(refcache_reaper, nullptr, "refcache reaper", i);
+  threadpin(refcache_expediter, nullptr, "refcache expediter", 0);
 
 #ifdef TEST
   threadpin(test, nullptr, "refcache test", 0);
@@ -37,6 +37,8 @@
 #define MAX_PMCS 2
 
 static void enable_nehalem_workaround(void);
+static void samptag(struct pmuevent *ev);
+static void sampobj(struct pmuevent *ev);
 
 struct selector_state : public perf_selector
 {
@@ -70,6 +72,8 @@ public:
 };
 
 class pmu *pmu;
+// Whether there is a PMU, whose counters rdpmc can read
+static bool have_pmc;
 
 struct pmulog {
   u64 count;
@@ -425,6 +429,7 @@ private:
     pmuevent ev{};
     auto ds = &local->ds_area;
     char *pos = ds->pebs_base;
+    samptag(&ev);
     ev.count = 1;
     while (pos < ds->pebs_index) {
       auto record = (pebs_record_v1*)pos;
@@ -435,6 +440,7 @@ private:
         ev.latency = record->latency;
         ev.data_source = record->data_source;
         ev.load_address = record->data_linear_address;
+        sampobj(&ev);
       }
       pmulog->log(ev);
       pos += pebs_record_size;
@@ -629,10 +635,66 @@ sampintr(struct trapframe *tf)
   return r;
 }
 
+// Attribute ev to the syscall and process it interrupted.
+static void
+samptag(struct pmuevent *ev)
+{
+  struct proc *p = myproc();
+  if (!p)
+    return;
+  ev->sysno = p->cur_syscall;
+  ev->pid = p->pid;
+}
+
+// Find the object ev's load_address is in.
+static void
+sampobj(struct pmuevent *ev)
+{
+  extern char __percpu_end[];
+  uptr a = ev->load_address;
+  size_t percpusize = __percpu_end - __percpu_start;
+
+  ev->obj_base = a;
+  ev->obj_size = 0;
+  for (int c = 0; c < ncpu; c++) {
+    uptr start = (uptr)percpu_offsets[c];
+    if (start && start <= a && a < start + percpusize) {
+      ev->obj_kind = PERF_OBJ_PERCPU;
+      ev->obj_cpu = c;
+      ev->obj_base = (uptr)__percpu_start + (a - start);
+      return;
+    }
+  }
+  if (a >= KCODE) {
+    ev->obj_kind = PERF_OBJ_STATIC;
+    return;
+  }
+  if (a < KBASE || a >= KBASEEND) {
+    ev->obj_kind = a < USERTOP ? PERF_OBJ_USER : PERF_OBJ_NONE;
+    return;
+  }
+
+  const void *base;
+  u32 size;
+  int cpu;
+  if (kmalloc_object((void*)a, &base, &size, &cpu)) {
+    ev->obj_kind = PERF_OBJ_SLAB;
+    ev->obj_cpu = cpu;
+    ev->obj_base = (uptr)base;
+    ev->obj_size = size;
+  } else {
+    ev->obj_kind = PERF_OBJ_PAGE;
+    ev->obj_base = PGROUNDDOWN(a);
+    ev->obj_size = PGSIZE;
+  }
+  ev->obj_off = a - ev->obj_base;
+}
+
 static void
 samplog(int pmc, struct trapframe *tf)
 {
   struct pmuevent ev{};
+  samptag(&ev);
   ev.idle = (myproc() == idleproc());
   ev.ints_disabled = !(tf->rflags & FL_IF);
   ev.kernel = tf->rip >= KCODE;
@@ -646,6 +708,12 @@ samplog(int pmc, struct trapframe *tf)
   }
 }
 
+bool
+samphavepmc(void)
+{
+  return have_pmc;
+}
+
 static int
 readlog(char *dst, u32 off, u32 n)
 {
@@ -811,6 +879,7 @@ initsamp(void)
 
   if (pmu == &no_pmu)
     return;
+  have_pmc = true;
 
   // enable RDPMC at CPL > 0
   u64 cr4 = rcr4();
@@ -4,22 +4,54 @@
 #include "file.hh"
 #include "mnode.hh"
 #include "mfs.hh"
+#include "shrinker.hh"
 #include "scalefs.hh"
 #include "kstream.hh"
 #include "major.h"
+#include "crc32c.hh"
+#include "numa.hh"
+#include "txtrace.h"
+#include "fsperf.hh"
+#include "ioacct.hh"
+
+
+// Issue cache flushes to the given set of disks in parallel, and wait for all
+// of them to complete. This is on the commit path, so the completions are
+// polled for.
+static void
+flush_disk_caches(const bitset<NDISK> &disks)
+{
+  sref<disk_completion> dc_vec[NDISK];
+
+  if (disks.none())
+    return;
+  scoped_disk_tag tag(DISKTRACE_JOURNAL);
+  kstats::timer timer(&kstats::fs_commit_flush_cycles);
+  kstats::inc(&kstats::fs_commit_flush_count);
+  for (auto d : disks) {
+    dc_vec[d] = make_sref<disk_completion>();
+    disk_flush(d, dc_vec[d]);
+  }
 
+  for (auto d : disks) {
+    dc_vec[d]->poll_wait(DISK_COMMIT_POLL_US);
+    dc_vec[d].reset();
+  }
+}
 
 mfs_interface::mfs_interface()
 {
-  for (int cpu = 0; cpu < NCPU; cpu++)
+  for (int cpu = 0; cpu < NCPU; cpu++) {
     fs_journal[cpu] = new journal();
+    data_journal_tsc[cpu] = 0;
+  }
 
-  inum_to_mnum = new chainhash<u64, u64>(NINODES_PRIME);
-  mnum_to_inum = new chainhash<u64, u64>(NINODES_PRIME);
-  mnum_to_lock = new chainhash<u64, sleeplock*>(NINODES_PRIME);
-  mnum_to_name = new chainhash<u64, strbuf<DIRSIZ>>(NINODES_PRIME); // Debug
-  metadata_log_htab = new chainhash<u64, mfs_logical_log*>(NINODES_PRIME);
+  inum_to_mnum = new chainhash<u64, u64>(FS_MAP_MIN_BUCKETS);
+  mnum_to_inum = new chainhash<u64, u64>(FS_MAP_MIN_BUCKETS);
+  mnum_to_name = new chainhash<u64, strbuf<DIRSIZ>>(FS_MAP_MIN_BUCKETS); // Debug
+  metadata_log_htab = new chainhash<u64, mfs_logical_log*>(FS_MAP_MIN_BUCKETS);
   blocknum_to_queue = new chainhash<u32, tx_queue_info>(NINODEBITMAP_BLKS_PRIME);
+  orphan_slots = new chainhash<u32, u32>(NORPHANS);
 }
 
 bool
@@ -52,22 +84,6 @@ mfs_interface::mnode_lookup(u64 inum, u64 *mnumptr)
   return sref<mnode>();
 }
 
-void
-mfs_interface::alloc_mnode_lock(u64 mnum)
-{
-  mnum_to_lock->insert(mnum, new sleeplock());
-}
-
-void
-mfs_interface::free_mnode_lock(u64 mnum)
-{
-  sleeplock *mnode_lock;
-  if (mnum_to_lock->lookup(mnum, &mnode_lock)) {
-    mnum_to_lock->remove(mnum);
-    delete mnode_lock;
-  }
-}
-
 void
 mfs_interface::alloc_metadata_log(u64 mnum)
 {
@@ -129,6 +145,88 @@ mfs_interface::load_file_page(u64 mfile_mnum, char *p, size_t pos,
   return readi(i, p, pos, nbytes);
 }
 
+// Brings the given range of a file into the buffer-cache, so that the
+// load_file_page() calls for its pages don't have to wait for the disk.
+void
+mfs_interface::readahead_file(u64 mfile_mnum, size_t pos, size_t nbytes)
+{
+  scoped_gc_epoch e;
+  sref<inode> i = get_inode(mfile_mnum, "readahead_file");
+  readahead(i, pos, nbytes);
+}
+
+// Returns whether the given range of a file is a hole on the disk, so that
+// its page can be the shared zero page instead of a copy read in.
+bool
+mfs_interface::is_file_hole(u64 mfile_mnum, size_t pos, size_t nbytes)
+{
+  scoped_gc_epoch e;
+  sref<inode> i = get_inode(mfile_mnum, "is_file_hole");
+  return is_hole(i, pos, nbytes);
+}
+
+// O_DIRECT: read or write the pages [pos, pos + npages * PGSIZE) of a file
+// straight from or into the given buffers, one page each (at most
+// DIRECT_IO_BATCH_PAGES), bypassing the buffer cache. Holes read as zeros.
+// Inline and compressed files return false, for the caller to go through the
+// page cache. Writes only go to blocks the file already has, in place: if any
+// is missing (or unwritten), nothing is written and this returns false, for
+// the caller to go through the page cache. The written blocks go to the disk
+// before this returns, and their disks' caches are flushed by the core's next
+// commit, as the blocks of an fsync are. A written block that an earlier
+// buffered read left in the buffer cache is updated there too (see
+// transaction::write_block()), so reloading its page doesn't find the old
+// contents.
+bool
+mfs_interface::direct_io_file(u64 mfile_mnum, char **pages, u64 pos,
+                              u32 npages, bool write, int cpu)
+{
+  scoped_gc_epoch e;
+  sref<inode> ip = get_inode(mfile_mnum, "direct_io_file");
+  u32 blocks[DIRECT_IO_BATCH_PAGES];
+  assert(npages <= DIRECT_IO_BATCH_PAGES);
+
+  ilock(ip, READLOCK);
+  // Inline files (see SB_INLINE) have no blocks to go to, and the blocks of
+  // compressed ones (see SB_COMPRESS) don't hold their pages.
+  if (ip->inline_data() || ip->compressed()) {
+    iunlock(ip);
+    return false;
+  }
+  file_blocks(ip, pos / BSIZE, npages, blocks);
+
+  if (!write) {
+    read_queue q;
+    for (u32 i = 0; i < npages; i++) {
+      if (blocks[i])
+        q.read(pages[i], blocks[i]);
+      else
+        memset(pages[i], 0, PGSIZE);
+    }
+    q.submit();
+    q.wait();
+    iunlock(ip);
+    return true;
+  }
+
+  for (u32 i = 0; i < npages; i++) {
+    if (!blocks[i]) {
+      iunlock(ip);
+      return false;
+    }
+  }
+
+  transaction *trans = new transaction();
+  for (u32 i = 0; i < npages; i++)
+    trans->write_block(ip->dev, pages[i], blocks[i]);
+  trans->flush_block_queue();
+  iunlock(ip);
+
+  auto guard = fs_journal[cpu]->commitq_insert_lock.guard();
+  add_transaction_to_queue(trans, cpu);
+  return true;
+}
+
 // Reads the on-disk file size.
 u64
 mfs_interface::get_file_size(u64 mfile_mnum)
@@ -140,7 +238,7 @@ mfs_interface::get_file_size(u64 mfile_mnum)
 
 // Updates the file size on the disk.
 void
-mfs_interface::update_file_size(u64 mfile_mnum, u32 size, transaction *tr)
+mfs_interface::update_file_size(u64 mfile_mnum, u64 size, transaction *tr)
 {
   scoped_gc_epoch e;
   sref<inode> i = get_inode(mfile_mnum, "update_file_size");
@@ -148,7 +246,9 @@ mfs_interface::update_file_size(u64 mfile_mnum, u32 size, transaction *tr)
 }
 
 sref<inode>
-mfs_interface::prepare_sync_file_pages(u64 mfile_mnum, transaction *tr)
+mfs_interface::prepare_sync_file_pages(u64 mfile_mnum, transaction *tr,
+                                       const std::vector<u32> &pages,
+                                       bool *allocated)
 {
   scoped_gc_epoch e;
   sref<inode> ip = get_inode(mfile_mnum, "sync_file_page");
@@ -161,12 +261,113 @@ mfs_interface::prepare_sync_file_pages(u64 mfile_mnum, transaction *tr)
   acquire_inodebitmap_locks(inum_list, INODE_BLOCK, tr);
 
   ilock(ip, WRITELOCK);
+
+  // An inline file (see SB_INLINE) that no longer fits in its inode moves
+  // out to a block first. Then allocate the blocks that the pages need up
+  // front, laid out contiguously, so that sync_file_page() only has to look
+  // them up. *allocated says whether that changed the block map, which then
+  // needs an iupdate().
+  bool promoted = inline_promote(ip, tr);
+  *allocated = alloc_file_pages(ip, pages, tr) || promoted;
   return ip;
 }
 
+// SB_INLINE: write a file of size bytes back whole, into its inode, along
+// with its size. data is the file's first page, or null if it isn't in the
+// page cache, in which case the first keep bytes that the file has on the
+// disk stay (see inline_write()). Returns false, without doing anything, if
+// the file doesn't fit in the inode, for the caller to write its pages back
+// instead.
+bool
+mfs_interface::sync_inline_file(u64 mfile_mnum, const char *data, u64 size,
+                                u64 keep, transaction *tr)
+{
+  scoped_gc_epoch e;
+  if (!inline_fits(size))
+    return false;
+  sref<inode> ip = get_inode(mfile_mnum, "sync_inline_file");
+
+  std::vector<u64> inum_list;
+  inum_list.push_back(ip->inum);
+  acquire_inodebitmap_locks(inum_list, INODE_BLOCK, tr);
+
+  ilock(ip, WRITELOCK);
+  inline_write(ip, data, size, keep, tr);
+  iupdate(ip, tr);
+  iunlock(ip);
+  return true;
+}
+
+// Returns whether a file is written back compressed (see SB_COMPRESS).
+bool
+mfs_interface::file_compressed(u64 mfile_mnum)
+{
+  scoped_gc_epoch e;
+  if (!compress_supported())
+    return false;
+  sref<inode> ip = get_inode(mfile_mnum, "file_compressed");
+  return ip->compressed();
+}
+
+// SB_COMPRESS: write cluster c of a file back, compressed or not (see
+// zcluster_write()), between prepare_sync_file_pages() and
+// finish_sync_file_pages().
+bool
+mfs_interface::sync_file_cluster(borrowed<inode> ip, u32 c, const char *z,
+                                 u32 zlen, char *const *pages, u32 npages,
+                                 transaction *tr)
+{
+  scoped_gc_epoch e;
+  return zcluster_write(ip, c, z, zlen, pages, npages, tr);
+}
+
+// SB_COMPRESS: turn compression on or off for a directory, or for a file
+// that is empty on the disk (see set_compress()), in a transaction of its
+// own. Returns -1 if the file system has no compressed files, or the file
+// isn't empty.
+int
+mfs_interface::set_compress_flag(u64 mnum, bool on, int cpu)
+{
+  scoped_gc_epoch e;
+  if (!compress_supported())
+    return -1;
+  sref<inode> ip = get_inode(mnum, "set_compress_flag");
+
+  auto guard = fs_journal[cpu]->commitq_insert_lock.guard();
+  transaction *tr = new transaction();
+
+  std::vector<u64> inum_list;
+  inum_list.push_back(ip->inum);
+  acquire_inodebitmap_locks(inum_list, INODE_BLOCK, tr);
+
+  ilock(ip, WRITELOCK);
+  int r = set_compress(ip, on);
+  if (r == 0)
+    iupdate(ip, tr);
+  iunlock(ip);
+
+  add_transaction_to_queue(tr, cpu);
+  return r;
+}
+
+// SB_COMPRESS: a new file or directory, ip, is compressed if the directory
+// it is created in is. Returns whether it is; ip then needs an iupdate().
+// The caller must hold ilock() on ip for write.
+bool
+mfs_interface::inherit_compress_flag(u64 parent_mnum, borrowed<inode> ip)
+{
+  u64 parent_inum;
+  if (!compress_supported() || !inum_lookup(parent_mnum, &parent_inum))
+    return false;
+  sref<inode> dp = iget(1, parent_inum);
+  if (!(dp->major & DI_COMPRESS))
+    return false;
+  return set_compress(ip, true) == 0;
+}
+
 // Flushes out the contents of an in-memory file page to the disk.
 int
-mfs_interface::sync_file_page(sref<inode> ip, char *p, size_t pos,
+mfs_interface::sync_file_page(borrowed<inode> ip, char *p, size_t pos,
                               size_t nbytes, transaction *tr)
 {
   scoped_gc_epoch e;
@@ -174,20 +375,46 @@ mfs_interface::sync_file_page(sref<inode> ip, char *p, size_t pos,
   return writei(ip, p, pos, nbytes, tr, true, true, true);
 }
 
+// data=journal (see DATA_JOURNAL_MAX_PAGES): log the file page at pos, whose
+// block must already be allocated, in the transaction instead of writing it
+// in place. Only the given chunks of it go into the journal, so the rest of
+// the block on the disk must be up to date; the whole page goes to the block
+// when the transaction is applied. Returns false if the page has no block,
+// because the disk ran out of them (see alloc_file_pages()).
+bool
+mfs_interface::journal_file_page(borrowed<inode> ip, char *p, size_t pos,
+                                 u64 chunks, transaction *tr)
+{
+  scoped_gc_epoch e;
+  u32 bn;
+  file_blocks(ip, pos / BSIZE, 1, &bn);
+  if (!bn)
+    return false;
+
+  // The block goes to the disk behind the buffer-cache's back too.
+  buf::refresh(ip->dev, bn, p);
+  auto db = new transaction_diskblock(bn, p);
+  db->dirty_chunks = chunks;
+  tr->add_block(db);
+  return true;
+}
+
 void
-mfs_interface::finish_sync_file_pages(sref<inode> ip, transaction *tr)
+mfs_interface::finish_sync_file_pages(borrowed<inode> ip, transaction *tr)
 {
   scoped_gc_epoch e;
 
   // Make sure that there are no pending writes in the block-queue.
   tr->flush_block_queue();
   tr->add_dirty_blocks_lazy();
+  release_extent(ip);
   iunlock(ip);
 }
 
 // Truncates a file on disk to the specified size (offset).
 void
-mfs_interface::truncate_file(u64 mfile_mnum, u32 offset, transaction *tr)
+mfs_interface::truncate_file(u64 mfile_mnum, u64 offset, transaction *tr,
+                             bool unmap)
 {
   scoped_gc_epoch e;
 
@@ -196,19 +423,41 @@ mfs_interface::truncate_file(u64 mfile_mnum, u32 offset, transaction *tr)
   itrunc(ip, offset, tr);
   iunlock(ip);
 
+  if (!unmap)
+    return;
   sref<mnode> m = root_fs->mget(mfile_mnum);
   if (m)
     m->as_file()->remove_pgtable_mappings(offset);
 }
 
+// Reserves disk blocks for a range of a file (see preallocate()).
+int
+mfs_interface::preallocate_file(u64 mfile_mnum, u64 off, u64 len,
+                                bool keep_size, transaction *tr)
+{
+  scoped_gc_epoch e;
+  sref<inode> ip = get_inode(mfile_mnum, "preallocate_file");
+
+  std::vector<u64> inum_list;
+  inum_list.push_back(ip->inum);
+
+  // Lock ordering rule: Acquire all inode-block locks before performing any
+  // ilock().
+  acquire_inodebitmap_locks(inum_list, INODE_BLOCK, tr);
+
+  ilock(ip, WRITELOCK);
+  int r = preallocate(ip, off, len, keep_size, tr);
+  iunlock(ip);
+  return r;
+}
+
 // Returns an inode locked for write, on success.
 sref<inode>
 mfs_interface::alloc_inode_for_mnode(u64 mnum, u8 type)
 {
   sref<inode> ip;
-  sleeplock *mnode_lock;
-  assert(mnum_to_lock->lookup(mnum, &mnode_lock));
-  auto lk = mnode_lock->guard();
+  // Hash the whole number: its low byte is the mnode type.
+  auto lk = mnode_locks[hash(mnum) % MNODE_LOCKS].lock.guard();
 
   u64 inum;
   if (inum_lookup(mnum, &inum)) {
@@ -227,7 +476,8 @@ mfs_interface::alloc_inode_for_mnode(u64 mnum, u8 type)
 // Creates a new file on the disk if an mnode (mfile) does not have a
 // corresponding inode mapping.
 void
-mfs_interface::create_file(u64 mnum, u8 type, transaction *tr)
+mfs_interface::create_file(u64 mnum, u64 parent_mnum, u8 type,
+                           transaction *tr)
 {
   sref<inode> ip = alloc_inode_for_mnode(mnum, type);
   iunlock(ip);
@@ -240,6 +490,7 @@ mfs_interface::create_file(u64 mnum, u8 type, transaction *tr)
 
   // Buffer-cache updates start here.
   ilock(ip, WRITELOCK);
+  inherit_compress_flag(parent_mnum, ip);
   iupdate(ip, tr);
   iunlock(ip);
 }
@@ -274,6 +525,8 @@ mfs_interface::create_dir(u64 mnum, u64 parent_mnum, u8 type, transaction *tr)
 
   // Buffer-cache updates start here.
   ilock(subdir_ip, WRITELOCK);
+  if (inherit_compress_flag(parent_mnum, subdir_ip))
+    iupdate(subdir_ip, tr);
   dirlink(subdir_ip, "..", parent_inum, false, tr);
 
   // Flush parent inode too, if it was newly created above.
@@ -515,7 +768,7 @@ mfs_interface::inc_mfslog_linkcount(u64 mnum)
 {
   mfs_logical_log *mfs_log;
   assert(metadata_log_htab->lookup(mnum, &mfs_log));
-  int cpu = myid();
+  int cpu = myhome();
   scoped_acquire a(&mfs_log->link_lock[cpu]);
   mfs_log->link_count[cpu]++;
 }
@@ -525,7 +778,7 @@ mfs_interface::dec_mfslog_linkcount(u64 mnum)
 {
   mfs_logical_log *mfs_log;
   assert(metadata_log_htab->lookup(mnum, &mfs_log));
-  int cpu = myid();
+  int cpu = myhome();
   scoped_acquire a(&mfs_log->link_lock[cpu]);
   mfs_log->link_count[cpu]--;
 }
@@ -557,39 +810,50 @@ mfs_interface::get_mfslog_linkcount(u64 mnum)
 void
 mfs_interface::process_metadata_log_and_flush(int cpu)
 {
-  // Invoke process_metadata_log() on every dirty mnode.
-  std::vector<u64> mnum_list;
-  metadata_log_htab->enumerate([&](const u64 &mnum, mfs_logical_log* &mfs_log)->bool {
-
+  FSPERF_REGION(FSPERF_COMMIT, "process_metadata_log_and_flush");
+  // Invoke process_metadata_log() on every dirty mnode. Only the mnodes
+  // dirtied since the last sync() can be dirty, so there is no need to go
+  // through the whole metadata-log table.
+  //
+  // In process_metadata_log(), we make decisions based on the mnode's
+  // refcount (i.e., whether to free the on-disk inode or postpone it until
+  // reboot). So to avoid interference with the refcount, we keep the mnode
+  // numbers here, and not references to the mnodes themselves (which would
+  // have bumped up the refcount inadvertently!).
+  std::vector<u64> dirty_list, mnum_list;
+  take_dirty_mnodes(&dirty_list);
+  for (auto mnum : dirty_list) {
     sref<mnode> m = root_fs->mget(mnum);
-    if (m && m->is_dirty()) {
-      // In process_metadata_log(), we make decisions based on the mnode's
-      // refcount (i.e., whether to free the on-disk inode or postpone it until
-      // reboot). So to avoid interference with the refcount, we store the mnode
-      // numbers here, and not references to the mnodes themselves (which would
-      // have bumped up the refcount inadvertently!).
+    if (m && m->is_dirty() && metadata_log_htab->lookup(mnum))
       mnum_list.push_back(mnum);
-    }
-
-      // We call process_metadata_log() outside enumerate() because it does a
-      // lookup on metadata_log_htab itself, which causes weird interactions.
+  }
 
-    return false;
-  });
+  if (!SYNC_PARALLEL_MIN_MNODES || mnum_list.size() < SYNC_PARALLEL_MIN_MNODES) {
+    sync_mnodes(cpu, mnum_list);
+  } else {
+    // Deal the mnodes out among the cores, each of which processes its share
+    // into its own journal. Transactions that touch the same disk blocks from
+    // different journals are ordered through their dependent_txq, just as
+    // with concurrent fsync()s.
+    std::vector<u64> shares[NCPU];
+    for (u64 i = 0; i < mnum_list.size(); i++)
+      shares[(cpu + i) % ncpu].push_back(mnum_list[i]);
+
+    task_group g;
+    for (int c = 0; c < ncpu; c++)
+      if (!shares[c].empty())
+        g.spawn(c, [this, c, &shares]() { sync_mnodes(c, shares[c]); });
+    g.wait();
+  }
 
-  for (auto &mnum : mnum_list) {
+  // Anything still dirty (whether skipped above or dirtied again since) has
+  // to be looked at again by the next sync().
+  for (auto mnum : dirty_list) {
     sref<mnode> m = root_fs->mget(mnum);
     if (m && m->is_dirty())
-      process_metadata_log(get_tsc(), m->mnum_, cpu);
+      requeue_dirty_mnode(mnum);
   }
 
-  // Transactions enqueued to the same journal queue (indexed by the cpu number)
-  // are always flushed in the order they are enqueued. Hence the transactions
-  // generated by process_metadata_log() above go to disk first, followed by
-  // those generated by sync_dirty_files_and_dirs().
-
-  sync_dirty_files_and_dirs(cpu, mnum_list);
-
   {
     // Commit all these transactions via our CPU's per-core journal.
     auto commit_insert_guard = fs_journal[cpu]->commitq_insert_lock.guard();
@@ -618,9 +882,30 @@ mfs_interface::process_metadata_log_and_flush(int cpu)
   }
 
   // Commit and apply pending transactions from ALL the per-core queues, not
-  // just the queue we added transactions to above.
+  // just the queue we added transactions to above, but skip the queues whose
+  // transactions have all been applied already.
   for (int i = 0; i < NCPU; i++)
-    flush_transaction_queue(i, true);
+    if (!fs_journal[i]->all_applied())
+      flush_transaction_queue(i, true);
+}
+
+// Process the logical logs of the given mnodes and then write out their
+// contents, all into the given core's journal.
+void
+mfs_interface::sync_mnodes(int cpu, std::vector<u64> &mnum_list)
+{
+  for (auto &mnum : mnum_list) {
+    sref<mnode> m = root_fs->mget(mnum);
+    if (m && m->is_dirty())
+      process_metadata_log(get_tsc(), m->mnum_, cpu);
+  }
+
+  // Transactions enqueued to the same journal queue (indexed by the cpu number)
+  // are always flushed in the order they are enqueued. Hence the transactions
+  // generated by process_metadata_log() above go to disk first, followed by
+  // those generated by sync_dirty_files_and_dirs().
+
+  sync_dirty_files_and_dirs(cpu, mnum_list);
 }
 
 void
@@ -697,6 +982,9 @@ mfs_interface::evict_pagecache()
 //
 // To evict the (clean) pages cached in the page-cache, do:
 // $ echo 2 > /dev/evict_caches
+//
+// To empty both, evict the page-cache first: its pages keep the blocks they
+// were read from in the buffer-cache.
 static int
 evict_caches(mdev*, const char *buf, u32 n)
 {
@@ -717,7 +1005,7 @@ evict_caches(mdev*, const char *buf, u32 n)
 }
 
 void
-mfs_interface::apply_rename_pair(std::vector<rename_metadata> &rename_stack,
+mfs_interface::apply_rename_pair(arena_vector<rename_metadata> &rename_stack,
                                  int cpu)
 {
   // The top two operations on the rename stack form a pair.
@@ -832,19 +1120,170 @@ mfs_interface::add_op_to_transaction_queue(mfs_operation *op, int cpu,
   delete op;
 }
 
-// Absorbs file link and unlink operations that cancel each other. Absorption
-// is aborted if renames are encountered (i.e., operations are not cancelled
-// across renames).
+// Whether ops[idx] is the unlink half of the rename whose link half is rl,
+// and is no later than max_tsc.
+bool
+mfs_interface::is_rename_unlink_of(const mfs_operation_vec &ops,
+                                   unsigned long idx,
+                                   const mfs_operation_rename_link *rl,
+                                   u64 max_tsc)
+{
+  if (idx >= ops.size() || ops[idx]->timestamp > max_tsc ||
+      ops[idx]->operation_type != MFS_OP_RENAME_UNLINK_FILE ||
+      ops[idx]->timestamp != rl->timestamp)
+    return false;
+  auto ru = dynamic_cast<mfs_operation_rename_unlink*>(ops[idx]);
+  return ru && ru->mnode_mnum == rl->mnode_mnum &&
+    strbuf<DIRSIZ>(ru->name) == strbuf<DIRSIZ>(rl->name) &&
+    strbuf<DIRSIZ>(ru->newname) == strbuf<DIRSIZ>(rl->newname);
+}
+
+// Collapses chains of file renames within the directory into their net
+// effect: a rename of a file that was linked or renamed into the directory
+// earlier in the log (with nothing else using either name in between) is
+// folded into that link or rename. So creating a file under a temporary name
+// and renaming it into place logs a single link, and a file renamed several
+// times logs a single rename. Only operations up to max_tsc are rewritten,
+// and rewriting stops at the first cross-directory rename or barrier.
+//
+// Called with mfs_log's lock and the oplog's sync_lock_ held.
+void
+mfs_interface::absorb_file_renames(mfs_logical_log *mfs_log, u64 max_tsc)
+{
+  auto &ops = mfs_log->operation_vec;
+  inline_arena<ARENA_INLINE> scratch;
+  arena_vector<unsigned long> erase_indices(&scratch);
+  // The index of the last operation that used each name.
+  auto last_use = new chainhash<strbuf<DIRSIZ>, unsigned long>(ops.size() * 5);
+  auto note_use = [&](const strbuf<DIRSIZ> &name, unsigned long idx) {
+    last_use->remove(name);
+    last_use->insert(name, idx);
+  };
+
+  for (unsigned long i = 0; i < ops.size() && ops[i]->timestamp <= max_tsc; i++) {
+    switch (ops[i]->operation_type) {
+
+    case MFS_OP_LINK_FILE:
+    case MFS_OP_LINK_DIR:
+      note_use(strbuf<DIRSIZ>(dynamic_cast<mfs_operation_link*>(ops[i])->name), i);
+      break;
+
+    case MFS_OP_UNLINK_FILE:
+    case MFS_OP_UNLINK_DIR:
+      note_use(strbuf<DIRSIZ>(dynamic_cast<mfs_operation_unlink*>(ops[i])->name), i);
+      break;
+
+    case MFS_OP_RENAME_LINK_FILE:
+      {
+        auto rl = dynamic_cast<mfs_operation_rename_link*>(ops[i]);
+        // A rename within the directory logs its link part immediately
+        // followed by its unlink part (see sys_rename()). Both halves go, or
+        // neither does.
+        if (rl->src_parent_mnum != rl->dst_parent_mnum ||
+            !is_rename_unlink_of(ops, i + 1, rl, max_tsc))
+          goto out;
+
+        // Only fold if nothing earlier in the log uses the new name: if it
+        // did, this rename replaced whatever that op linked there, and
+        // dropping the rename would leave that link behind without the
+        // rename that undoes it.
+        strbuf<DIRSIZ> from(rl->name), to(rl->newname);
+        unsigned long from_idx, to_idx;
+        if (from != to && last_use->lookup(from, &from_idx) &&
+            !last_use->lookup(to, &to_idx)) {
+          mfs_operation *prev = ops[from_idx];
+          bool folded = false;
+
+          if (prev->operation_type == MFS_OP_LINK_FILE) {
+            // link(from) + rename(from -> to) == link(to)
+            auto l = dynamic_cast<mfs_operation_link*>(prev);
+            if (l->mnode_mnum == rl->mnode_mnum) {
+              strncpy(l->name, rl->newname, DIRSIZ);
+              folded = true;
+            }
+          } else if (prev->operation_type == MFS_OP_RENAME_LINK_FILE) {
+            // rename(a -> from) + rename(from -> to) == rename(a -> to),
+            // unless a == to, which is left alone.
+            auto pl = dynamic_cast<mfs_operation_rename_link*>(prev);
+            auto pu = is_rename_unlink_of(ops, from_idx + 1, pl, max_tsc) ?
+              dynamic_cast<mfs_operation_rename_unlink*>(ops[from_idx + 1]) :
+              nullptr;
+            if (pu && pl->mnode_mnum == rl->mnode_mnum &&
+                strbuf<DIRSIZ>(pl->newname) == from &&
+                strbuf<DIRSIZ>(pl->name) != to) {
+              strncpy(pl->newname, rl->newname, DIRSIZ);
+              strncpy(pu->newname, rl->newname, DIRSIZ);
+              folded = true;
+            }
+          }
+
+          if (folded) {
+            erase_indices.push_back(i);
+            erase_indices.push_back(i + 1);
+            // from was last used here, by the rename that is gone; keep it
+            // that way so that nothing folds across the rename.
+            note_use(from, i);
+            note_use(to, from_idx);
+            i++;
+            break;
+          }
+        }
+
+        note_use(from, i);
+        note_use(to, i);
+        i++;
+      }
+      break;
+
+    case MFS_OP_RENAME_LINK_DIR:
+    case MFS_OP_RENAME_UNLINK_FILE:
+    case MFS_OP_RENAME_UNLINK_DIR:
+    case MFS_OP_RENAME_BARRIER:
+      goto out;
+
+    default:
+      continue;
+    }
+  }
+
+out:
+  std::sort(erase_indices.begin(), erase_indices.end(),
+            std::greater<unsigned long>());
+
+  for (auto &idx : erase_indices) {
+    mfs_operation *op = ops.at(idx);
+    delete op;
+    ops.erase(ops.begin() + idx);
+  }
+
+  delete last_use;
+}
+
+// Runs the absorption passes over mfs_log: renames first, since folding a
+// rename into the earlier link lets a later unlink cancel that link.
 //
-// TODO: Perform absorption across file renames that don't cross directory
-// boundaries.
+// Called with mfs_log's lock and the oplog's sync_lock_ held.
+void
+mfs_interface::absorb_operations(mfs_logical_log *mfs_log, u64 max_tsc,
+                                 arena_vector<u64> &absorb_mnum_list)
+{
+  absorb_file_renames(mfs_log, max_tsc);
+  if (mfs_log->operation_vec.size() > 1)
+    absorb_file_link_unlink(mfs_log, absorb_mnum_list);
+}
+
+// Absorbs file link and unlink operations that cancel each other. Absorption
+// carries on across file renames within the directory (which just stop the
+// names they use from cancelling earlier links), but is aborted if any other
+// renames are encountered (i.e., operations are not cancelled across them).
 //
 // Called with mfs_log's lock and the oplog's sync_lock_ held.
 void
 mfs_interface::absorb_file_link_unlink(mfs_logical_log *mfs_log,
-                                       std::vector<u64> &absorb_mnum_list)
+                                       arena_vector<u64> &absorb_mnum_list)
 {
-  std::vector<unsigned long> erase_indices;
+  inline_arena<ARENA_INLINE> scratch;
+  arena_vector<unsigned long> erase_indices(&scratch);
   u64 htable_size = mfs_log->operation_vec.size() * 5;
   auto linkname_to_index =
                    new chainhash<strbuf<DIRSIZ>, unsigned long>(htable_size);
@@ -871,6 +1310,7 @@ mfs_interface::absorb_file_link_unlink(mfs_logical_log *mfs_log,
           // Mark these link and unlink ops for absorption.
           erase_indices.push_back(it - mfs_log->operation_vec.begin());
           erase_indices.push_back(index);
+          linkname_to_index->remove(name);
 
           dec_mfslog_linkcount(unlink_op->mnode_mnum);
           if (!get_mfslog_linkcount(unlink_op->mnode_mnum)) {
@@ -888,11 +1328,24 @@ mfs_interface::absorb_file_link_unlink(mfs_logical_log *mfs_log,
       break;
 
     case MFS_OP_RENAME_LINK_FILE:
+      {
+        // A file renamed within the directory: links of either name from
+        // before the rename must not be cancelled by unlinks after it.
+        auto rl = dynamic_cast<mfs_operation_rename_link*>(*it);
+        if (rl->src_parent_mnum != rl->dst_parent_mnum ||
+            it + 1 == mfs_log->operation_vec.end())
+          goto out;
+        linkname_to_index->remove(strbuf<DIRSIZ>(rl->name));
+        linkname_to_index->remove(strbuf<DIRSIZ>(rl->newname));
+        it++;  // Skip its rename-unlink part.
+      }
+      break;
+
     case MFS_OP_RENAME_LINK_DIR:
     case MFS_OP_RENAME_UNLINK_FILE:
     case MFS_OP_RENAME_UNLINK_DIR:
     case MFS_OP_RENAME_BARRIER:
-      // Don't absorb operations across a rename boundary.
+      // Don't absorb operations across any other rename boundary.
       goto out;
 
     default:
@@ -919,7 +1372,7 @@ out:
 // otherwise.
 void
 mfs_interface::absorb_delete_inode(mfs_logical_log *mfs_log, u64 mnum, int cpu,
-                                   std::vector<u64> &unlink_mnum_list)
+                                   arena_vector<u64> &unlink_mnum_list)
 {
 
   {
@@ -994,12 +1447,12 @@ enum {
 int
 mfs_interface::process_ops_from_oplog(
                     mfs_logical_log *mfs_log, u64 max_tsc, int count, int cpu,
-                    std::vector<pending_metadata> &pending_stack,
-                    std::vector<u64> &unlink_mnum_list,
-                    std::vector<dirunlink_metadata> &dirunlink_stack,
-                    std::vector<rename_metadata> &rename_stack,
-                    std::vector<rename_barrier_metadata> &rename_barrier_stack,
-                    std::vector<u64> &absorb_mnum_list)
+                    arena_vector<pending_metadata> &pending_stack,
+                    arena_vector<u64> &unlink_mnum_list,
+                    arena_vector<dirunlink_metadata> &dirunlink_stack,
+                    arena_vector<rename_metadata> &rename_stack,
+                    arena_vector<rename_barrier_metadata> &rename_barrier_stack,
+                    arena_vector<u64> &absorb_mnum_list)
 {
   int retval = RET_INVALID;
 
@@ -1032,7 +1485,7 @@ mfs_interface::process_ops_from_oplog(
   }
 
   if (mfs_log->operation_vec.size() > 1)
-    absorb_file_link_unlink(mfs_log, absorb_mnum_list);
+    absorb_operations(mfs_log, max_tsc, absorb_mnum_list);
 
   for (auto it = mfs_log->operation_vec.begin();
        it != mfs_log->operation_vec.end() && (*it)->timestamp <= max_tsc; ) {
@@ -1093,7 +1546,7 @@ mfs_interface::process_ops_from_oplog(
           // Retry absorption after processing a rename, if we are not exiting
           // this function.
           if (mfs_log->operation_vec.size() > 1) {
-            absorb_file_link_unlink(mfs_log, absorb_mnum_list);
+            absorb_operations(mfs_log, max_tsc, absorb_mnum_list);
             it = mfs_log->operation_vec.begin();
           }
           continue;
@@ -1113,7 +1566,7 @@ mfs_interface::process_ops_from_oplog(
           // Retry absorption after processing a rename, if we are not exiting
           // this function.
           if (mfs_log->operation_vec.size() > 1) {
-            absorb_file_link_unlink(mfs_log, absorb_mnum_list);
+            absorb_operations(mfs_log, max_tsc, absorb_mnum_list);
             it = mfs_log->operation_vec.begin();
           }
           continue;
@@ -1173,7 +1626,7 @@ mfs_interface::process_ops_from_oplog(
           // Retry absorption after processing a rename, if we are not exiting
           // this function.
           if (mfs_log->operation_vec.size() > 1) {
-            absorb_file_link_unlink(mfs_log, absorb_mnum_list);
+            absorb_operations(mfs_log, max_tsc, absorb_mnum_list);
             it = mfs_log->operation_vec.begin();
           }
           continue;
@@ -1209,7 +1662,7 @@ mfs_interface::process_ops_from_oplog(
           // Retry absorption after processing a rename, if we are not exiting
           // this function.
           if (mfs_log->operation_vec.size() > 1) {
-            absorb_file_link_unlink(mfs_log, absorb_mnum_list);
+            absorb_operations(mfs_log, max_tsc, absorb_mnum_list);
             it = mfs_log->operation_vec.begin();
           }
           continue;
@@ -1307,14 +1760,18 @@ out:
 void
 mfs_interface::process_metadata_log(u64 max_tsc, u64 mnode_mnum, int cpu)
 {
-  std::vector<pending_metadata> pending_stack;
-  std::vector<u64> unlink_mnum_list;
-  std::vector<dirunlink_metadata> dirunlink_stack;
-  std::vector<rename_metadata> rename_stack;
-  std::vector<rename_barrier_metadata> rename_barrier_stack;
-  std::vector<u64> absorb_mnum_list;
+  // The work lists of this call, all freed in one go on return.
+  inline_arena<ARENA_INLINE> scratch;
+  arena_vector<pending_metadata> pending_stack(&scratch);
+  arena_vector<u64> unlink_mnum_list(&scratch);
+  arena_vector<dirunlink_metadata> dirunlink_stack(&scratch);
+  arena_vector<rename_metadata> rename_stack(&scratch);
+  arena_vector<rename_barrier_metadata> rename_barrier_stack(&scratch);
+  arena_vector<u64> absorb_mnum_list(&scratch);
   int ret;
 
+  kstats::timer timer(&kstats::fs_process_log_cycles);
+  kstats::inc(&kstats::fs_process_log_count);
   auto commit_insert_guard = fs_journal[cpu]->commitq_insert_lock.guard();
 
   // Delete all the inodes marked for lazy deletion by mnode::onzero()
@@ -1415,7 +1872,6 @@ mfs_interface::process_metadata_log(u64 max_tsc, u64 mnode_mnum, int cpu)
       // So failing this lookup is a reliable indication (in this particular
       // context) that this mnode was deleted already.
       free_metadata_log(mnum);
-      free_mnode_lock(mnum);
     }
   }
 
@@ -1433,7 +1889,7 @@ mfs_interface::mfs_create(mfs_operation_create *op, transaction *tr)
   scoped_gc_epoch e;
 
   if (op->mnode_type == mnode::types::file)
-    create_file(op->mnode_mnum, op->mnode_type, tr);
+    create_file(op->mnode_mnum, op->parent_mnum, op->mnode_type, tr);
   else if (op->mnode_type == mnode::types::dir)
     create_dir(op->mnode_mnum, op->parent_mnum, op->mnode_type, tr);
 }
@@ -1516,6 +1972,7 @@ mfs_interface::add_transaction_to_queue(transaction *tr, int cpu)
   tr->enq_tsc = get_tsc();
   tr->last_group_txn_tsc = tr->enq_tsc;
   tr->txq_id = cpu;
+  txtrace(TXTRACE_ENQUEUE, cpu, tr->enq_tsc, tr->blocks.size());
 
   tx_queue_info my_txq(tr->txq_id, tr->enq_tsc);
 
@@ -1576,53 +2033,172 @@ mfs_interface::pre_process_transaction(transaction *tr)
 
   if (!tr->free_block_list.empty())
     bfree_on_disk(tr->free_block_list, tr);
+
+  if (!tr->orphan_updates.empty())
+    update_orphan_table(tr);
 }
 
+// Add the inodes that the transaction left as orphans to the on-disk orphan
+// table, and take out those it linked or freed. Only the last update of each
+// inode counts.
+//
+// The orphan block is shared by all the journals, so a transaction takes it
+// (and so depends on every other transaction that did) only if it really
+// changes the table. Whether an inode is listed can't change under us: every
+// transaction that updates it holds its inode block's lock.
 void
-mfs_interface::post_process_transaction(transaction *tr)
+mfs_interface::update_orphan_table(transaction *tr)
 {
-  tr->deduplicate_freeblock_list();
-  tr->deduplicate_freeinum_list();
+  scoped_gc_epoch e;
+  auto &updates = tr->orphan_updates;
+  for (size_t i = 0; i < updates.size(); ) {
+    bool superseded = false;
+    for (size_t j = i + 1; j < updates.size() && !superseded; j++)
+      superseded = updates[j].inum == updates[i].inum;
+    u32 slot;
+    if (superseded ||
+        updates[i].orphan == orphan_slots->lookup(updates[i].inum, &slot))
+      updates.erase(updates.begin() + i);
+    else
+      i++;
+  }
+  if (updates.empty())
+    return;
 
-  // Now that the transaction has been committed, mark the freed blocks as
-  // free in the in-memory free-bit-vector.
-  for (auto &f : tr->free_block_list)
-    free_block(f);
+  // The orphan table's lock is the last of the 2-Phase locks a transaction
+  // takes, and nothing else is acquired while holding it, so taking it out of
+  // block order cannot deadlock.
+  sleeplock *sl = inodebitmap_lock(ORPHAN_BLOCK);
+  sl->acquire();
+  tr->inodebitmap_locks.push_back(sl);
+  tr->inodebitmap_blk_list.push_back(ORPHAN_BLOCK);
+
+  sref<buf> bp = buf::get(1, ORPHAN_BLOCK);
+  auto locked = bp->write();
+  u32 *slots = (u32 *)(locked->data + ORPHAN_OFFSET);
+  u64 dirty_chunks = 0;
+  static bool warned_once = false;
 
-  // Make the freed inode numbers available again for reuse.
-  for (auto &inum : tr->free_inum_list)
-    free_inode_number(inum);
+  for (size_t i = 0; i < updates.size(); i++) {
+    u32 inum = updates[i].inum, slot;
+    bool listed = orphan_slots->lookup(inum, &slot);
+    if (updates[i].orphan && !listed) {
+      if (free_orphan_slots.empty()) {
+        // The inode is simply left out; at worst it leaks after a crash.
+        if (!warned_once) {
+          cprintf("WARNING: orphan table full, not listing inode %u\n", inum);
+          warned_once = true;
+        }
+        continue;
+      }
+      slot = free_orphan_slots.back();
+      free_orphan_slots.pop_back();
+      slots[slot] = inum;
+      assert(orphan_slots->insert(inum, slot));
+    } else if (!updates[i].orphan && listed) {
+      slots[slot] = 0;
+      orphan_slots->remove(inum);
+      free_orphan_slots.push_back(slot);
+    } else {
+      continue;
+    }
+    dirty_chunks |= txn_chunk_mask(ORPHAN_OFFSET + slot * sizeof(u32),
+                                   sizeof(u32));
+  }
+
+  if (dirty_chunks)
+    bp->add_to_transaction(tr, dirty_chunks);
 }
 
+namespace {
+  // The blocks freed by a committed transaction, on their way back to the
+  // allocator. readi() and the other lock-free readers map file blocks
+  // through an inode_meta snapshot inside a gc epoch, so a reader that took
+  // its snapshot before a truncate may still read a freed block: the
+  // blocks can only be reused once every such epoch has ended.
+  struct freed_blocks : public rcu_freed {
+    freed_blocks(std::vector<u32> &&b)
+      : rcu_freed("freed_blocks", this, sizeof(*this)), blocks(std::move(b))
+    {
+      _rcu_size += blocks.size() * sizeof(u32);
+    }
+    void do_gc() override {
+      rootfs_interface->release_freed_blocks(blocks);
+      delete this;
+    }
+    NEW_DELETE_OPS(freed_blocks);
+
+    std::vector<u32> blocks;
+  };
+}
+
+// Mark the given blocks as free in the in-memory free-bit-vector, or leave
+// that to the discarder once it has discarded them, or to
+// release_deferred_frees() once no journaled data is left to apply to them.
 void
-mfs_interface::apply_trans_on_disk(transaction *tr)
+mfs_interface::release_freed_blocks(const std::vector<u32> &blocks)
 {
-  // This transaction has been committed to the journal. Writeback the changes
+  if (!defer_block_frees(blocks) && !queue_discard(blocks))
+    for (auto &f : blocks)
+      free_block(f);
+}
+
+void
+mfs_interface::post_process_transaction(transaction *tr)
+{
+  tr->deduplicate_freeblock_list();
+  tr->deduplicate_freeinum_list();
+
+  // Now that the transaction has been committed, the freed blocks can go
+  // back to the allocator, after a gc epoch (see freed_blocks).
+  if (!tr->free_block_list.empty())
+    gc_delayed(new freed_blocks(std::move(tr->free_block_list)));
+
+  // Make the freed inode numbers available again for reuse.
+  for (auto &inum : tr->free_inum_list)
+    free_inode_number(inum);
+}
+
+// If writes_started is true, the caller has already issued the writes to the
+// original locations on the disk using transaction::start_write_to_disk(), and
+// we only need to wait for them to complete.
+void
+mfs_interface::apply_trans_on_disk(transaction *tr, bool writes_started)
+{
+  // This transaction has been committed to the journal. Writeback the changes
   // to the original locations on the disk.
-  tr->write_to_disk_and_flush();
+  kstats::timer timer(&kstats::fs_apply_cycles);
+  kstats::inc(&kstats::fs_apply_count);
+  scoped_disk_tag tag(DISKTRACE_APPLY);
+  if (writes_started)
+    tr->finish_write_to_disk_and_flush();
+  else
+    tr->write_to_disk_and_flush(DISK_SCHED_APPLY);
 
-  // Update the on-disk journal's skip block to indicate that this transaction
-  // should not be re-applied during crash-recovery.
+  // The journal space occupied by this transaction can now be reused. Update
+  // the on-disk journal's skip block to indicate that this transaction should
+  // not be re-applied during crash-recovery, and where the remaining unapplied
+  // transactions begin.
   int cpu = tr->txq_id;
-  u32 orig_offset = fs_journal[cpu]->current_offset();
-  fs_journal[cpu]->update_offset(0);
+  fs_journal[cpu]->update_tail_offset(tr->journal_end_off);
   write_journal_skip_block(tr->commit_tsc, cpu);
-  fs_journal[cpu]->update_offset(orig_offset);
 }
 
 void
 mfs_interface::commit_transaction_to_disk(int cpu, transaction *trans)
 {
+  FSPERF_REGION(FSPERF_COMMIT, "commit_transaction_to_disk");
   ilock(sv6_journal[cpu], WRITELOCK);
 
   // Write the transaction's start block and the data blocks to the on-disk
-  // journal.
+  // journal. The start block's checksum makes the transaction committed as
+  // soon as these writes are durable.
+  txtrace(TXTRACE_COMMIT_START, cpu, trans->enq_tsc, trans->blocks.size());
   write_journal_transaction_blocks(trans->blocks, trans->commit_tsc,
                                    trans->disks_written, cpu);
-
-  // Commit the transaction to the on-disk journal with the given timestamp.
-  write_journal_commit_block(trans->commit_tsc, cpu);
+  trans->journal_end_off = fs_journal[cpu]->current_offset();
   iunlock(sv6_journal[cpu]);
+  txtrace(TXTRACE_COMMIT_END, cpu, trans->enq_tsc, trans->blocks.size());
 
   post_process_transaction(trans);
 
@@ -1633,21 +2209,159 @@ mfs_interface::commit_transaction_to_disk(int cpu, transaction *trans)
 }
 
 void
-mfs_interface::apply_transaction_to_disk(int cpu, transaction *trans)
+mfs_interface::apply_transaction_to_disk(int cpu, transaction *trans,
+                                         bool writes_started)
 {
+  FSPERF_REGION(FSPERF_APPLY, "apply_transaction_to_disk");
   // Apply all the committed sub-transactions to their final destinations
   // on the disk.
-  apply_trans_on_disk(trans);
+  if (!writes_started)
+    txtrace(TXTRACE_APPLY_START, cpu, trans->enq_tsc, trans->blocks.size());
+  apply_trans_on_disk(trans, writes_started);
+  txtrace(TXTRACE_APPLY_END, cpu, trans->enq_tsc, trans->blocks.size());
+  lathists::record_since(mylathists->commit_apply, trans->commit_tsc);
 
   // Notify transactions (in other journal queues) which were waiting for
   // this particular batch of transactions to get applied to the on-disk
   // filesystem.
   u64 latest_apply_tsc = trans->last_group_txn_tsc;
   fs_journal[cpu]->notify_apply(latest_apply_tsc);
+  release_deferred_frees();
 
   delete trans;
 }
 
+// Note that the transaction enqueued at enq_tsc on cpu's journal logged file
+// data, whose blocks mustn't be reused before it is applied.
+void
+mfs_interface::note_journaled_data(int cpu, u64 enq_tsc)
+{
+  u64 old = data_journal_tsc[cpu];
+  while (old < enq_tsc && !data_journal_tsc[cpu].compare_exchange_weak(old,
+                                                                      enq_tsc))
+    ;
+}
+
+// Commit and apply cpu's journal up to the transaction enqueued at enq_tsc,
+// which logged file data, so that the data's blocks can be written in place.
+void
+mfs_interface::apply_journaled_data(int cpu, u64 enq_tsc)
+{
+  if (fs_journal[cpu]->get_applied_tsc() < enq_tsc)
+    flush_transaction_queue(cpu, true);
+}
+
+// Freed blocks may still have file data logged in a journal, not yet applied,
+// whose apply would overwrite them once reused: hold them back until all such
+// transactions logged so far are applied. Returns false if there are none.
+bool
+mfs_interface::defer_block_frees(const std::vector<u32> &blocks)
+{
+  if (!DATA_JOURNAL_MAX_PAGES || blocks.empty())
+    return false;
+
+  deferred_free d;
+  bool pending = false;
+  for (int c = 0; c < NCPU; c++) {
+    d.upto[c] = data_journal_tsc[c];
+    if (fs_journal[c]->get_applied_tsc() < d.upto[c])
+      pending = true;
+  }
+  if (!pending)
+    return false;
+
+  d.blocks = blocks;
+  auto l = deferred_frees_lock.guard();
+  deferred_frees.push_back(std::move(d));
+  return true;
+}
+
+// Free the blocks held back by defer_block_frees() whose transactions have
+// all been applied.
+void
+mfs_interface::release_deferred_frees()
+{
+  if (!DATA_JOURNAL_MAX_PAGES)
+    return;
+
+  std::vector<deferred_free> ready;
+  {
+    auto l = deferred_frees_lock.guard();
+    for (auto it = deferred_frees.begin(); it != deferred_frees.end(); ) {
+      bool applied = true;
+      for (int c = 0; c < NCPU; c++)
+        applied &= fs_journal[c]->get_applied_tsc() >= it->upto[c];
+      if (!applied) {
+        ++it;
+        continue;
+      }
+      ready.push_back(std::move(*it));
+      it = deferred_frees.erase(it);
+    }
+  }
+
+  for (auto &d : ready) {
+    if (!queue_discard(d.blocks))
+      for (auto &f : d.blocks)
+        free_block(f);
+  }
+}
+
+// Remove the transaction at the head of the given per-core journal's commit
+// queue, along with the transactions following it that don't have any
+// cross-queue dependencies, and merge them all into a single transaction that
+// can be committed to the journal in one go.
+// Caller must hold the journal's commitq_remove_lock and tx_commit_queue_lock,
+// and the commit queue must not be empty.
+transaction*
+mfs_interface::dequeue_commit_batch(int cpu)
+{
+  auto it = fs_journal[cpu]->tx_commit_queue.begin();
+  transaction *trans = *it;
+  it = fs_journal[cpu]->tx_commit_queue.erase(it);
+  u64 ntxns = 1;
+
+  for ( ; it != fs_journal[cpu]->tx_commit_queue.end(); ) {
+    if ((*it)->dependent_txq.empty() == false)
+      break;
+
+    // This transaction doesn't have cross-queue dependencies, so try to
+    // merge it with the other transaction and commit them together.
+    (*it)->deduplicate_blocks();
+    if (!fits_in_journal(trans->blocks.size() + (*it)->blocks.size(), cpu))
+      break;
+
+    trans->merge_blocks(*it);
+
+    for (auto d : (*it)->disks_written)
+      trans->disks_written.set(d);
+
+    if (!fits_in_journal(trans->blocks.size(), cpu)) {
+      cprintf("fits_in_journal failed, blocks-size %lu cpu %d "
+              "journal offset %d limit %lu\n", trans->blocks.size(), cpu,
+              fs_journal[cpu]->current_offset(),
+              (u64)fs_journal[cpu]->capacity());
+    }
+    assert(fits_in_journal(trans->blocks.size(), cpu));
+
+    trans->add_free_blocks(std::move((*it)->free_block_list));
+    trans->add_free_inums(std::move((*it)->free_inum_list));
+
+    trans->last_group_txn_tsc = (*it)->enq_tsc;
+    assert(trans->last_group_txn_tsc > trans->enq_tsc);
+    txtrace(TXTRACE_MERGE, cpu, trans->enq_tsc, (*it)->enq_tsc);
+
+    delete *it;
+    it = fs_journal[cpu]->tx_commit_queue.erase(it);
+    ntxns++;
+  }
+
+  kstats::inc(&kstats::fs_commit_batch_count);
+  kstats::inc(&kstats::fs_commit_batch_blocks, (u64)trans->blocks.size());
+  kstats::inc(&kstats::fs_commit_batch_txns, ntxns);
+  return trans;
+}
+
 void
 mfs_interface::commit_all_transactions(int cpu)
 {
@@ -1683,24 +2397,66 @@ mfs_interface::commit_all_transactions(int cpu)
       blocks_size = tr->blocks.size();
     }
 
+    // Make room in the journal by applying the oldest committed transactions,
+    // one batch at a time, until this one fits. We don't have to wait for the
+    // entire journal to drain. Applying the last transaction in the journal
+    // resets it, so this terminates.
     if (!fits_in_journal(blocks_size, cpu)) {
-      apply_all_transactions(cpu);
+      fs_journal[cpu]->space_stalls++;
+      kstats::inc(&kstats::fs_journal_stall_count);
+      kstats::timer stall_timer(&kstats::fs_journal_stall_cycles);
+
+      while (!fits_in_journal(blocks_size, cpu)) {
+        bool apply_queue_empty;
+        {
+          auto aq_guard = fs_journal[cpu]->tx_apply_queue_lock.guard();
+          apply_queue_empty = fs_journal[cpu]->tx_apply_queue.empty();
+        }
 
-      if (!fits_in_journal(blocks_size, cpu)) {
-        cprintf("fits_in_journal failed, blocks-size %lu cpu %d "
-                "journal offset %d limit %lu\n", blocks_size, cpu,
-                fs_journal[cpu]->current_offset(), PHYS_JOURNAL_SIZE);
+        // Even if the apply queue is empty, this waits for a concurrent
+        // thread (if any) to finish applying the last transaction and clear
+        // the journal.
+        apply_transactions(cpu, true);
+        if (apply_queue_empty)
+          break;
       }
-      assert(fits_in_journal(blocks_size, cpu));
     }
 
+    // Grow or shrink the journal according to its load, if it's empty now.
+    resize_journal(cpu, blocks_size);
+
+    if (!fits_in_journal(blocks_size, cpu)) {
+      cprintf("fits_in_journal failed, blocks-size %lu cpu %d "
+              "journal offset %d limit %lu\n", blocks_size, cpu,
+              fs_journal[cpu]->current_offset(),
+              (u64)fs_journal[cpu]->capacity());
+    }
+    assert(fits_in_journal(blocks_size, cpu));
+
     // Postpone committing this batch of transactions until all the dependent
     // transactions in other queues have been committed to the disk. It is
     // sufficient to look at the first transaction in the batch, since that's
     // the only transaction allowed to have any cross-queue dependencies.
+    //
+    // Don't just wait for the other queue's owner to flush it (which might
+    // not happen any time soon); if nobody is committing it, commit it on its
+    // behalf. Dependencies always point to transactions enqueued earlier, so
+    // this can't go around in circles.
     for (auto &dep_txn : dependent_txq) {
-      while (fs_journal[dep_txn.id_]->get_committed_tsc() < dep_txn.timestamp_)
-        fs_journal[dep_txn.id_]->wait_for_commit(dep_txn.timestamp_);
+      if (fs_journal[dep_txn.id_]->get_committed_tsc() >= dep_txn.timestamp_)
+        continue;
+      kstats::inc(&kstats::fs_dep_wait_count);
+      kstats::timer dep_timer(&kstats::fs_dep_wait_cycles);
+      txtrace(TXTRACE_DEP_WAIT_BEGIN, cpu, enq_tsc, dep_txn.timestamp_,
+              dep_txn.id_);
+      while (fs_journal[dep_txn.id_]->get_committed_tsc() < dep_txn.timestamp_) {
+        if (help_commit_transactions(dep_txn.id_, dep_txn.timestamp_))
+          continue;
+        fs_journal[dep_txn.id_]->wait_for_commit_until(dep_txn.timestamp_,
+                                   nsectime() + DEP_COMMIT_RETRY_US * 1000);
+      }
+      txtrace(TXTRACE_DEP_WAIT_END, cpu, enq_tsc, dep_txn.timestamp_,
+              dep_txn.id_);
     }
 
     transaction *trans = nullptr;
@@ -1713,42 +2469,7 @@ mfs_interface::commit_all_transactions(int cpu)
       assert(!fs_journal[cpu]->tx_commit_queue.empty());
       assert(fs_journal[cpu]->tx_commit_queue.front()->enq_tsc == enq_tsc);
 
-      auto it = fs_journal[cpu]->tx_commit_queue.begin();
-      trans = *it;
-      it = fs_journal[cpu]->tx_commit_queue.erase(it);
-
-      for ( ; it != fs_journal[cpu]->tx_commit_queue.end(); ) {
-        if ((*it)->dependent_txq.empty() == false)
-          break;
-
-        // This transaction doesn't have cross-queue dependencies, so try to
-        // merge it with the other transaction and commit them together.
-        (*it)->deduplicate_blocks();
-        if (!fits_in_journal(trans->blocks.size() + (*it)->blocks.size(), cpu))
-          break;
-
-        trans->add_blocks(std::move((*it)->blocks));
-        trans->deduplicate_blocks();
-
-        for (auto d : (*it)->disks_written)
-          trans->disks_written.set(d);
-
-        if (!fits_in_journal(trans->blocks.size(), cpu)) {
-          cprintf("fits_in_journal failed, blocks-size %lu cpu %d "
-                  "journal offset %d limit %lu\n", trans->blocks.size(), cpu,
-                  fs_journal[cpu]->current_offset(), PHYS_JOURNAL_SIZE);
-        }
-        assert(fits_in_journal(trans->blocks.size(), cpu));
-
-        trans->add_free_blocks(std::move((*it)->free_block_list));
-        trans->add_free_inums(std::move((*it)->free_inum_list));
-
-        trans->last_group_txn_tsc = (*it)->enq_tsc;
-        assert(trans->last_group_txn_tsc > trans->enq_tsc);
-
-        delete *it;
-        it = fs_journal[cpu]->tx_commit_queue.erase(it);
-      }
+      trans = dequeue_commit_batch(cpu);
     }
 
     trans->commit_tsc = get_tsc();
@@ -1767,6 +2488,17 @@ mfs_interface::commit_all_transactions(int cpu)
 void
 mfs_interface::apply_all_transactions(int cpu)
 {
+  apply_transactions(cpu, false);
+}
+
+// Apply the transactions committed to the given per-core journal (along with
+// the transactions in other journals that they depend on) to the on-disk
+// filesystem. If oldest_only is true, stop after applying the oldest committed
+// batch of transactions, which is enough to free up some journal space.
+void
+mfs_interface::apply_transactions(int cpu, bool oldest_only)
+{
+  FSPERF_REGION(FSPERF_APPLY, "apply_transactions");
   std::vector<tx_queue_info> dependent_txq;
   {
     auto apply_remove_guard = fs_journal[cpu]->applyq_remove_lock.guard();
@@ -1786,13 +2518,13 @@ mfs_interface::apply_all_transactions(int cpu)
     if (fs_journal[cpu]->tx_apply_queue.empty())
       return;
 
-    dependent_txq.push_back({cpu,
-                            fs_journal[cpu]->tx_apply_queue.back()->enq_tsc});
+    transaction *upto = oldest_only ? fs_journal[cpu]->tx_apply_queue.front() :
+                                      fs_journal[cpu]->tx_apply_queue.back();
+    dependent_txq.push_back({cpu, upto->enq_tsc});
   }
 
   while (dependent_txq.size()) {
     transaction *tr = nullptr;
-    bool group_apply = false;
     tx_queue_info txq = dependent_txq.back();
 
     int dep_cpu = txq.id_;
@@ -1849,26 +2581,25 @@ mfs_interface::apply_all_transactions(int cpu)
           break;
 
         // We don't have to check fits_in_journal() here.
-        tr->add_blocks(std::move((*it)->blocks));
-        group_apply = true;
+        tr->merge_blocks(*it);
         assert((*it)->last_group_txn_tsc > tr->last_group_txn_tsc);
         tr->last_group_txn_tsc = (*it)->last_group_txn_tsc;
         assert((*it)->commit_tsc > tr->commit_tsc);
         tr->commit_tsc = (*it)->commit_tsc;
+        tr->journal_end_off = (*it)->journal_end_off;
         delete *it;
         it = fs_journal[dep_cpu]->tx_apply_queue.erase(it);
       }
     }
 
-    if (group_apply)
-      tr->deduplicate_blocks();
-
     ilock(sv6_journal[dep_cpu], WRITELOCK);
 
+    // apply_transaction_to_disk() deletes the transaction.
+    u64 commit_tsc = tr->commit_tsc;
     apply_transaction_to_disk(dep_cpu, tr);
 
-    assert(tr->commit_tsc > fs_journal[dep_cpu]->last_applied_commit_tsc);
-    fs_journal[dep_cpu]->last_applied_commit_tsc = tr->commit_tsc;
+    assert(commit_tsc > fs_journal[dep_cpu]->last_applied_commit_tsc);
+    fs_journal[dep_cpu]->last_applied_commit_tsc = commit_tsc;
 
     iunlock(sv6_journal[dep_cpu]);
 
@@ -1888,11 +2619,118 @@ mfs_interface::apply_all_transactions(int cpu)
   }
 }
 
+// Commit and apply the transactions queued on a per-core journal in a
+// pipelined fashion: the journal blocks of batch N+1 are written out while the
+// home-location writes of batch N (which is already committed) are still in
+// flight. The pipeline drains as soon as it runs into a batch that has to wait
+// for other journals, or for space in this journal; the caller deals with the
+// remaining transactions the usual (serial) way.
+// Caller must hold the journal's journal_lock.
+void
+mfs_interface::pipeline_commit_apply(int cpu)
+{
+  // Committed batch whose home-location writes are in flight.
+  transaction *applying = nullptr;
+  bool applied = false;
+
+  // Hold the applyq_remove_lock throughout, so that nobody else applies (or
+  // resets) this journal while we have a batch in flight, just like
+  // apply_all_transactions().
+  auto apply_remove_guard = fs_journal[cpu]->applyq_remove_lock.guard();
+
+  for (;;) {
+    // Stage 1: Commit the next batch of transactions to the journal.
+    transaction *trans = dequeue_ready_commit_batch(cpu);
+    if (trans) {
+      trans->commit_tsc = get_tsc();
+      commit_transaction_to_disk(cpu, trans);
+
+      auto apply_insert_guard = fs_journal[cpu]->applyq_insert_lock.guard();
+      {
+        auto aq_guard = fs_journal[cpu]->tx_apply_queue_lock.guard();
+        fs_journal[cpu]->tx_apply_queue.push_back(trans);
+      }
+    }
+
+    // Stage 2: Wait for the previous batch to reach its home locations on the
+    // disk, and mark it as applied.
+    if (applying) {
+      ilock(sv6_journal[cpu], WRITELOCK);
+
+      u64 commit_tsc = applying->commit_tsc;
+      apply_transaction_to_disk(cpu, applying, true);
+      applying = nullptr;
+      applied = true;
+
+      assert(commit_tsc > fs_journal[cpu]->last_applied_commit_tsc);
+      fs_journal[cpu]->last_applied_commit_tsc = commit_tsc;
+
+      iunlock(sv6_journal[cpu]);
+    }
+
+    // Clear the journal if everything committed so far has been applied, so
+    // that the next batch has the whole journal available.
+    bool apply_queue_empty;
+    {
+      auto aq_guard = fs_journal[cpu]->tx_apply_queue_lock.guard();
+      apply_queue_empty = fs_journal[cpu]->tx_apply_queue.empty();
+    }
+
+    if (apply_queue_empty) {
+      bool reset = applied;
+      if (reset) {
+        ilock(sv6_journal[cpu], WRITELOCK);
+        reset_journal(cpu);
+        iunlock(sv6_journal[cpu]);
+        applied = false;
+      }
+
+      // Resetting the journal might have made room for the next batch.
+      if (!trans && !reset)
+        return;
+      continue;
+    }
+
+    // Stage 3: Start writing the oldest committed batch to its home locations,
+    // unless it has to wait for transactions in other journals to be applied.
+    {
+      auto aq_guard = fs_journal[cpu]->tx_apply_queue_lock.guard();
+      transaction *tr = fs_journal[cpu]->tx_apply_queue.front();
+
+      bool deps_applied = true;
+      for (auto &dep_txn : tr->dependent_txq) {
+        if (fs_journal[dep_txn.id_]->get_applied_tsc() < dep_txn.timestamp_) {
+          deps_applied = false;
+          break;
+        }
+      }
+
+      if (deps_applied) {
+        fs_journal[cpu]->tx_apply_queue.erase(
+          fs_journal[cpu]->tx_apply_queue.begin());
+        applying = tr;
+      }
+    }
+
+    if (!applying)
+      return;
+
+    txtrace(TXTRACE_APPLY_START, cpu, applying->enq_tsc,
+            applying->blocks.size());
+    scoped_disk_tag tag(DISKTRACE_APPLY);
+    applying->start_write_to_disk(DISK_SCHED_APPLY);
+  }
+}
+
 void
 mfs_interface::flush_transaction_queue(int cpu, bool apply_transactions)
 {
+  FSPERF_REGION(FSPERF_COMMIT, "flush_transaction_queue");
   auto journal_guard = fs_journal[cpu]->journal_lock.guard();
 
+  if (apply_transactions)
+    pipeline_commit_apply(cpu);
+
   commit_all_transactions(cpu);
 
   // Apply all the committed transactions from the per-core journal to the
@@ -1901,42 +2739,361 @@ mfs_interface::flush_transaction_queue(int cpu, bool apply_transactions)
     apply_all_transactions(cpu);
 }
 
+// Same as dequeue_commit_batch(), except that it returns nullptr instead of
+// blocking if the transaction at the head of the commit queue still has to wait
+// for cross-queue dependencies, or if it doesn't fit in the journal. Used by
+// group commit, which must not sleep waiting for other journals while it holds
+// several journals' locks.
+transaction*
+mfs_interface::dequeue_ready_commit_batch(int cpu)
+{
+  auto commit_remove_guard = fs_journal[cpu]->commitq_remove_lock.guard();
+  auto cq_guard = fs_journal[cpu]->tx_commit_queue_lock.guard();
+
+  if (fs_journal[cpu]->tx_commit_queue.empty())
+    return nullptr;
+
+  transaction *tr = fs_journal[cpu]->tx_commit_queue.front();
+  for (auto &dep_txn : tr->dependent_txq) {
+    if (fs_journal[dep_txn.id_]->get_committed_tsc() < dep_txn.timestamp_)
+      return nullptr;
+  }
+
+  tr->deduplicate_blocks();
+  if (!fits_in_journal(tr->blocks.size(), cpu))
+    return nullptr;
+
+  return dequeue_commit_batch(cpu);
+}
+
+// Commit the transactions queued on another core's journal, up to the one
+// enqueued at upto_enq_tsc, on behalf of a transaction that depends on them.
+// This is done only if nobody else is flushing that journal at the moment, and
+// only for batches that are ready to be committed (see
+// dequeue_ready_commit_batch()), so it never blocks waiting for yet another
+// journal. Returns true if it committed anything.
+bool
+mfs_interface::help_commit_transactions(int cpu, u64 upto_enq_tsc)
+{
+  if (!fs_journal[cpu]->journal_lock.try_acquire())
+    return false;
+
+  bool committed = false;
+  while (fs_journal[cpu]->get_committed_tsc() < upto_enq_tsc) {
+    transaction *trans = dequeue_ready_commit_batch(cpu);
+    if (!trans)
+      break;
+
+    trans->commit_tsc = get_tsc();
+    commit_transaction_to_disk(cpu, trans);
+    committed = true;
+
+    // Move the committed transaction to the apply queue.
+    auto apply_insert_guard = fs_journal[cpu]->applyq_insert_lock.guard();
+    {
+      auto aq_guard = fs_journal[cpu]->tx_apply_queue_lock.guard();
+      fs_journal[cpu]->tx_apply_queue.push_back(trans);
+    }
+  }
+
+  fs_journal[cpu]->journal_lock.release();
+  return committed;
+}
+
+// Commit the transactions queued on this core's journal as part of a group
+// commit that is shared with concurrent callers on other cores.
+//
+// The first caller opens a group-commit window and becomes its leader: it waits
+// for up to GROUP_COMMIT_WINDOW_US microseconds for other cores to join, and
+// then writes out the transactions of all the participating per-core journals
+// together, with a single cache flush per disk for the journal blocks of the
+// whole group (preceded by one for any blocks that the transactions wrote in
+// place, if there are such blocks). The other callers just wait for their
+// transactions to be committed, and are woken up via journal::notify_commit().
+void
+mfs_interface::group_commit_transactions(int cpu)
+{
+  FSPERF_REGION(FSPERF_COMMIT, "group_commit_transactions");
+  if (!GROUP_COMMIT_WINDOW_US) {
+    flush_transaction_queue(cpu);
+    return;
+  }
+
+  u64 wait_tsc;
+  {
+    auto cq_guard = fs_journal[cpu]->tx_commit_queue_lock.guard();
+
+    // Nothing queued, but a concurrent flush might still be committing our
+    // transactions. flush_transaction_queue() waits for it to finish.
+    if (fs_journal[cpu]->tx_commit_queue.empty()) {
+      cq_guard.release();
+      flush_transaction_queue(cpu);
+      return;
+    }
+    wait_tsc = fs_journal[cpu]->tx_commit_queue.back()->enq_tsc;
+  }
+
+  bitset<NCPU> members;
+  {
+    scoped_acquire l(&group_window.lock);
+    group_window.members.set(cpu);
+
+    if (group_window.open) {
+      // Somebody else is leading this window; they will commit our journal.
+      l.release();
+      fs_journal[cpu]->wait_for_commit(wait_tsc);
+      return;
+    }
+
+    group_window.open = true;
+    u64 deadline = nsectime() + GROUP_COMMIT_WINDOW_US * 1000;
+    while (nsectime() < deadline)
+      group_window.cv.sleep_to(&group_window.lock, deadline);
+
+    members = group_window.members;
+    group_window.members.reset();
+    group_window.open = false;
+  }
+
+  // Lock the journals taking part in this group commit, in increasing order of
+  // cpu to avoid deadlocks between concurrent group leaders. If some other
+  // thread is already flushing one of these journals, leave that journal out
+  // of the group rather than waiting for it while holding the other journals.
+  bitset<NCPU> locked;
+  transaction *batch[NCPU] = {};
+  bitset<NDISK> flush_disks;
+
+  for (auto c : members) {
+    if (!fs_journal[c]->journal_lock.try_acquire())
+      continue;
+    locked.set(c);
+    ilock(sv6_journal[c], WRITELOCK);
+
+    batch[c] = dequeue_ready_commit_batch(c);
+    if (batch[c]) {
+      for (auto d : batch[c]->disks_written)
+        flush_disks.set(d);
+    }
+  }
+
+  // Blocks written in place must be durable before the journal records that
+  // refer to them are.
+  flush_disk_caches(flush_disks);
+  flush_disks.reset();
+
+  for (auto c : locked) {
+    if (!batch[c])
+      continue;
+
+    batch[c]->commit_tsc = get_tsc();
+    txtrace(TXTRACE_COMMIT_START, c, batch[c]->enq_tsc,
+            batch[c]->blocks.size());
+    write_journal_transaction_blocks(batch[c]->blocks, batch[c]->commit_tsc,
+                                     batch[c]->disks_written, c, &flush_disks);
+    batch[c]->journal_end_off = fs_journal[c]->current_offset();
+  }
+
+  flush_disk_caches(flush_disks);
+
+  for (auto c : locked) {
+    iunlock(sv6_journal[c]);
+
+    transaction *trans = batch[c];
+    if (trans) {
+      txtrace(TXTRACE_COMMIT_END, c, trans->enq_tsc, trans->blocks.size());
+      post_process_transaction(trans);
+      fs_journal[c]->notify_commit(trans->last_group_txn_tsc);
+
+      // Move the committed transaction to the apply queue.
+      auto apply_insert_guard = fs_journal[c]->applyq_insert_lock.guard();
+      {
+        auto aq_guard = fs_journal[c]->tx_apply_queue_lock.guard();
+        fs_journal[c]->tx_apply_queue.push_back(trans);
+      }
+    }
+
+    fs_journal[c]->journal_lock.release();
+  }
+
+  // Commit whatever couldn't be made part of the group (transactions that
+  // depend on other journals, overflowing journals, journals that were busy)
+  // the usual way, one journal at a time.
+  for (auto c : members)
+    flush_transaction_queue(c);
+}
+
+// Tickets handed out by asynchronous fsyncs identify the per-core journal in
+// their top 8 bits, and the enqueue timestamp of the last transaction that has
+// to be committed in the remaining bits. A journal number of 0xff is never
+// handed out, so that ~0 (-1) is not a ticket, and the timestamp is stored
+// whole rather than wrapped, since it is compared with the journal's
+// unmasked commit watermark.
+static_assert(NCPU < 0xff, "fsync tickets have room for 255 journals");
+#define FSYNC_TICKET_TSC_MASK ((1ULL << 56) - 1)
+
+// Return a ticket that covers all the transactions enqueued to this core's
+// journal so far, and ask the journal's flusher thread to commit them.
+u64
+mfs_interface::fsync_ticket(int cpu)
+{
+  u64 tsc = fs_journal[cpu]->get_last_enq_tsc();
+  // 2^56 cycles is centuries of uptime
+  assert(tsc <= FSYNC_TICKET_TSC_MASK);
+  fs_journal[cpu]->request_flush(tsc);
+  return ((u64)cpu << 56) | tsc;
+}
+
+// Wait for the transactions covered by an fsync ticket to be committed.
+// Returns 0 once they are, or -1 if the ticket is invalid, or if nonblock is
+// set and they haven't been committed yet.
+int
+mfs_interface::wait_for_fsync_ticket(u64 ticket, bool nonblock)
+{
+  u32 cpu = ticket >> 56;
+  u64 tsc = ticket & FSYNC_TICKET_TSC_MASK;
+
+  if (cpu >= NCPU)
+    return -1;
+
+  if (fs_journal[cpu]->get_committed_tsc() >= tsc)
+    return 0;
+
+  if (nonblock)
+    return -1;
+
+  fs_journal[cpu]->wait_for_commit(tsc);
+  return 0;
+}
+
+// Body of the per-core journal flusher threads, which commit transactions on
+// behalf of asynchronous fsyncs.
+void
+mfs_interface::run_journal_flusher(int cpu)
+{
+  for (;;) {
+    fs_journal[cpu]->wait_for_flush_request();
+    group_commit_transactions(cpu);
+  }
+}
+
+static void
+journal_flusher(void *arg)
+{
+  rootfs_interface->run_journal_flusher((int)(uptr)arg);
+}
+
+static void
+discarder(void *arg)
+{
+  rootfs_interface->run_discarder();
+}
+
+void
+mfs_interface::init_discards()
+{
+  if (!DISK_DISCARD || !disk_discard_supported())
+    return;
+
+  discards.enabled = true;
+  threadpin(discarder, nullptr, "discard", 0);
+}
+
+// Hand the (sorted) blocks freed by a transaction to the discarder, unless
+// discards are disabled or the discarder is too far behind, in which case the
+// caller frees them right away. Returns whether the blocks were taken.
+bool
+mfs_interface::queue_discard(const std::vector<u32> &blocks)
+{
+  if (!discards.enabled || blocks.empty())
+    return false;
+
+  scoped_acquire a(&discards.lock);
+  if (discards.blocks.size() + blocks.size() > DISK_DISCARD_MAX_PENDING)
+    return false;
+
+  if (discards.blocks.empty())
+    discards.cv.wake_all();
+  for (auto b : blocks)
+    discards.blocks.push_back(b);
+  return true;
+}
+
+// Discard the queued blocks in the background, at most DISK_DISCARD_BATCH
+// blocks every DISK_DISCARD_INTERVAL_MS, so that discards (which ATA disks
+// can't queue along with other commands) never hold up an fsync for long.
+// Waiting out the interval also lets the blocks of many transactions gather,
+// which makes for longer contiguous extents and fewer commands.
+void
+mfs_interface::run_discarder()
+{
+  std::vector<u32> batch;
+
+  for (;;) {
+    discards.lock.acquire();
+    while (discards.blocks.empty())
+      discards.cv.sleep(&discards.lock);
+
+    u64 deadline = nsectime() + (u64)DISK_DISCARD_INTERVAL_MS * 1000000ull;
+    while (nsectime() < deadline)
+      discards.cv.sleep_to(&discards.lock, deadline);
+
+    while (!discards.blocks.empty() && batch.size() < DISK_DISCARD_BATCH) {
+      batch.push_back(discards.blocks.back());
+      discards.blocks.pop_back();
+    }
+    discards.lock.release();
+
+    std::sort(batch.begin(), batch.end());
+    transaction::compact_sorted_list(batch);
+
+    auto dc = make_sref<disk_completion>();
+    disk_discard(batch, dc);
+    dc->wait();
+
+    for (auto b : batch)
+      free_block(b);
+    batch.clear();
+  }
+}
+
 void
-mfs_interface::print_txq_stats()
+mfs_interface::print_txq_stats(print_stream *s)
 {
   // We intentionally avoid taking any locks here, because this function is
   // typically invoked by the user when the system has already deadlocked;
   // we don't want to make it any worse.
 
-  cprintf("TRANSACTION COMMIT QUEUES:\n");
+  s->println("TRANSACTION COMMIT QUEUES:");
   for (int cpu = 0; cpu < NCPU; cpu++) {
     if (fs_journal[cpu]->tx_commit_queue.empty())
       continue;
 
-    cprintf("CPU %d: committed_upto: %lu\n", cpu, fs_journal[cpu]->get_committed_tsc());
+    s->println("CPU ", cpu, ": committed_upto: ",
+               fs_journal[cpu]->get_committed_tsc());
     for (auto &t : fs_journal[cpu]->tx_commit_queue) {
-      cprintf("cpu %d txn %lu depends on \n", cpu, t->enq_tsc);
+      s->println("cpu ", cpu, " txn ", t->enq_tsc, " depends on ");
       for (auto &d : t->dependent_txq) {
-        cprintf("    dcpu %d dtxn %lu\n", d.id_, d.timestamp_);
+        s->println("    dcpu ", d.id_, " dtxn ", d.timestamp_);
       }
     }
   }
 
-  cprintf("TRANSACTION APPLY QUEUES:\n");
+  s->println("TRANSACTION APPLY QUEUES:");
   for (int cpu = 0; cpu < NCPU; cpu++) {
     if (fs_journal[cpu]->tx_apply_queue.empty())
       continue;
 
-    cprintf("CPU %d: applied_upto: %lu\n\n", cpu, fs_journal[cpu]->get_applied_tsc());
+    s->println("CPU ", cpu, ": applied_upto: ",
+               fs_journal[cpu]->get_applied_tsc(), "\n");
     for (auto &t : fs_journal[cpu]->tx_apply_queue) {
-      cprintf("cpu %d txn %lu depends on \n", cpu, t->enq_tsc);
+      s->println("cpu ", cpu, " txn ", t->enq_tsc, " depends on ");
       for (auto &d : t->dependent_txq) {
-        cprintf("    dcpu %d dtxn %lu\n", d.id_, d.timestamp_);
+        s->println("    dcpu ", d.id_, " dtxn ", d.timestamp_);
       }
     }
   }
 
-  cprintf("COMMIT DEPENDENCIES:\n");
+  s->println("COMMIT DEPENDENCIES:");
   for (int cpu = 0; cpu < NCPU; cpu++) {
     if (fs_journal[cpu]->tx_commit_queue.empty())
       continue;
@@ -1946,11 +3103,11 @@ mfs_interface::print_txq_stats()
       continue;
     for (auto &d : t->dependent_txq) {
       if (fs_journal[d.id_]->get_committed_tsc() < d.timestamp_)
-        cprintf("cpu %d waits for commit on dcpu %d\n", cpu, d.id_);
+        s->println("cpu ", cpu, " waits for commit on dcpu ", d.id_);
     }
   }
 
-  cprintf("APPLY DEPENDENCIES:\n");
+  s->println("APPLY DEPENDENCIES:");
   for (int cpu = 0; cpu < NCPU; cpu++) {
     if (fs_journal[cpu]->tx_apply_queue.empty())
       continue;
@@ -1960,15 +3117,34 @@ mfs_interface::print_txq_stats()
       continue;
     for (auto &d : t->dependent_txq) {
       if (fs_journal[d.id_]->get_applied_tsc() < d.timestamp_)
-        cprintf("cpu %d waits for apply on dcpu %d\n", cpu, d.id_);
+        s->println("cpu ", cpu, " waits for apply on dcpu ", d.id_);
     }
   }
+
+  s->println("JOURNAL SIZES:");
+  for (int cpu = 0; cpu < NCPU; cpu++) {
+    journal *j = fs_journal[cpu];
+    s->println("cpu ", cpu, " segments ", j->nsegments, " capacity ",
+               j->capacity(), " stalls ", j->space_stalls, " peak ",
+               j->peak_used, " used ", j->used_space());
+  }
 }
 
 void
 print_all_txq_stats()
 {
-  rootfs_interface->print_txq_stats();
+  rootfs_interface->print_txq_stats(&console);
+}
+
+// The same report as ^J on the console, for benchmarks to read (the
+// queues are usually empty unless something is stuck, so the journal
+// sizes are the interesting part).
+static int
+txqstatsread(mdev*, char *dst, u32 off, u32 n)
+{
+  window_stream s(dst, off, n);
+  rootfs_interface->print_txq_stats(&s);
+  return s.get_used();
 }
 
 bool
@@ -1977,108 +3153,436 @@ mfs_interface::fits_in_journal(size_t num_trans_blocks, int cpu)
   // Estimate the space requirements of this transaction in the journal.
 
   // Check if we can fit num_trans_blocks disk blocks of the transaction
-  // as well as the start and commit blocks in the journal. (And also an
-  // additional address block if necessary).
+  // as well as the start block in the journal. (And also the address blocks
+  // if necessary).
+
+  u64 trans_size = num_trans_blocks * BSIZE + sizeof(journal_header_block)
+                   + num_addr_blocks_for(num_trans_blocks) * BSIZE;
+
+  if (num_trans_blocks > max_txn_blocks)
+    return false;
 
-  u64 trans_size = num_trans_blocks * BSIZE + 2 * sizeof(journal_header_block)
-                   + sizeof(journal_addr_block);
+  // The first block of the journal is reserved for the skip block.
+  if (trans_size > fs_journal[cpu]->capacity() - sizeof(journal_header_block))
+    return false;
+
+  return fs_journal[cpu]->space_offset(trans_size) != 0;
+}
+
+// Look up the disk blocks backing the journal file once, so that journal writes
+// don't have to go through writei() and bmap(). mkfs lays out each journal
+// file within the extent recorded in the superblock's journal_blknums.
+// Caller must hold ilock on sv6_journal.
+void
+mfs_interface::map_journal_blocks(int cpu)
+{
+  superblock sb;
+  get_superblock(&sb);
+
+  for (u32 i = 0; i < PHYS_JOURNAL_SIZE / BSIZE; i++) {
+    u32 blocknum = inode_blocknum(sv6_journal[cpu], i);
+    assert(blocknum >= sb.journal_blknums[cpu].start_blknum &&
+           blocknum <= sb.journal_blknums[cpu].end_blknum);
+    journal_file_blocknums[cpu][i] = blocknum;
+  }
+}
+
+void
+mfs_interface::open_journal(int cpu)
+{
+  char jrnl_name[32];
+  snprintf(jrnl_name, sizeof(jrnl_name), "/sv6journal%d", cpu);
+  sv6_journal[cpu] = namei(sref<inode>(), jrnl_name);
+  assert(sv6_journal[cpu]);
+
+  ilock(sv6_journal[cpu], WRITELOCK);
+  map_journal_blocks(cpu);
+  iunlock(sv6_journal[cpu]);
+}
+
+// Make the journal of the given cpu consist of the given segments, in that
+// order. The journal must be empty.
+void
+mfs_interface::set_journal_segments(int cpu, const u32 *segs, u32 nsegs)
+{
+  journal *j = fs_journal[cpu];
+  assert(nsegs <= JOURNAL_MAX_SEGMENTS);
+
+  j->blocknums[0] = journal_file_blocknums[cpu][0];
+  for (u32 i = 0; i < nsegs; i++) {
+    u32 file = segs[i] / JOURNAL_FILE_SEGMENTS;
+    u32 first = 1 + (segs[i] % JOURNAL_FILE_SEGMENTS) * JOURNAL_SEGMENT_BLOCKS;
+
+    j->segments[i] = segs[i];
+    for (u32 k = 0; k < JOURNAL_SEGMENT_BLOCKS; k++)
+      j->blocknums[1 + i * JOURNAL_SEGMENT_BLOCKS + k] =
+        journal_file_blocknums[file][first + k];
+  }
+  j->nsegments = nsegs;
+
+  scoped_acquire l(&j->offset_lock);
+  j->capacity_ = (1 + nsegs * JOURNAL_SEGMENT_BLOCKS) * BSIZE;
+}
+
+// Hand out the journal segments at boot: every journal starts out with
+// JOURNAL_MIN_SEGMENTS segments from its own journal file, and the rest go to
+// the shared pool, from which busy journals can grow (see resize_journal()).
+void
+mfs_interface::init_journal_pool()
+{
+  scoped_acquire l(&journal_pool_lock);
+  journal_pool.clear();
+
+  for (int cpu = 0; cpu < NCPU; cpu++) {
+    u32 segs[JOURNAL_MIN_SEGMENTS];
+    u32 base = cpu * JOURNAL_FILE_SEGMENTS;
+
+    for (u32 i = 0; i < JOURNAL_MIN_SEGMENTS; i++)
+      segs[i] = base + i;
+    set_journal_segments(cpu, segs, JOURNAL_MIN_SEGMENTS);
+
+    for (u32 i = JOURNAL_MIN_SEGMENTS; i < JOURNAL_FILE_SEGMENTS; i++)
+      journal_pool.push_back(base + i);
+  }
+}
+
+// Adapt the size of a journal to its recent load. Journals that had to wait
+// for space to commit transactions double in size, taking segments from the
+// shared pool, and journals that used less than a quarter of their space for
+// a while give half of it back. The journal also grows (if it can) to make
+// room for a transaction of num_trans_blocks blocks.
+//
+// This only happens when the journal is empty. The new layout takes effect
+// once the skip block recording it is on the disk; segments are given back to
+// the pool only after that, so that no other journal can overwrite them while
+// crash-recovery might still look for our transactions there. Whatever other
+// journals left in the segments that we take is ignored by recovery, since
+// start blocks name the journal they belong to; and any of our own old
+// transactions there are older than the ones that follow the resize.
+//
+// Crash-recovery also relies on the journal files being cleared at boot (see
+// init_journal()), so that no segment holds transactions from earlier boots.
+//
+// Caller must hold the journal lock.
+void
+mfs_interface::resize_journal(int cpu, size_t num_trans_blocks)
+{
+  journal *j = fs_journal[cpu];
+  u32 nsegs = j->nsegments;
+  u32 want = nsegs;
+
+  if (j->space_stalls)
+    want = std::min(2 * nsegs, (u32)JOURNAL_MAX_SEGMENTS);
+  else if (j->commits_since_resize >= JOURNAL_RESIZE_INTERVAL &&
+           j->peak_used < j->capacity() / 4)
+    want = std::max(nsegs / 2, (u32)JOURNAL_MIN_SEGMENTS);
+
+  // Space needed for the transaction, like in fits_in_journal().
+  u64 trans_size = num_trans_blocks * BSIZE + sizeof(journal_header_block)
+                   + num_addr_blocks_for(num_trans_blocks) * BSIZE;
+  while (want < JOURNAL_MAX_SEGMENTS &&
+         (u64)(want * JOURNAL_SEGMENT_BLOCKS) * BSIZE < trans_size)
+    want++;
+
+  if (j->commits_since_resize >= JOURNAL_RESIZE_INTERVAL) {
+    j->space_stalls = 0;
+    j->peak_used = 0;
+    j->commits_since_resize = 0;
+  }
+
+  if (want == nsegs)
+    return;
 
-  if (trans_size > PHYS_JOURNAL_SIZE)
+  ilock(sv6_journal[cpu], WRITELOCK);
+  if (j->current_offset() != j->tail_offset()) {
+    iunlock(sv6_journal[cpu]);
+    return;
+  }
+
+  u32 segs[JOURNAL_MAX_SEGMENTS];
+  memmove(segs, j->segments, nsegs * sizeof(u32));
+  if (want > nsegs) {
+    scoped_acquire l(&journal_pool_lock);
+    while (nsegs < want && !journal_pool.empty()) {
+      segs[nsegs++] = journal_pool.back();
+      journal_pool.pop_back();
+    }
+  } else {
+    nsegs = want;
+  }
+
+  u32 old_nsegs = j->nsegments;
+  if (nsegs != old_nsegs) {
+    u32 data_start = sizeof(journal_header_block);
+    set_journal_segments(cpu, segs, nsegs);
+    j->update_offset(data_start);
+    j->update_tail_offset(data_start);
+    write_journal_skip_block(j->last_applied_commit_tsc, cpu);
+
+    if (nsegs < old_nsegs) {
+      scoped_acquire l(&journal_pool_lock);
+      for (u32 i = nsegs; i < old_nsegs; i++)
+        journal_pool.push_back(segs[i]);
+    }
+  }
+  iunlock(sv6_journal[cpu]);
+
+  j->space_stalls = 0;
+  j->peak_used = 0;
+  j->commits_since_resize = 0;
+}
+
+// Read the journal block at the given offset of a journal, as laid out by its
+// segments. Used during crash-recovery.
+bool
+mfs_interface::read_journal_block(int cpu, u32 offset, char *buf)
+{
+  assert(offset % BSIZE == 0);
+  if (offset + BSIZE > fs_journal[cpu]->capacity())
     return false;
 
-  if (fs_journal[cpu]->current_offset() + trans_size > PHYS_JOURNAL_SIZE)
+  disk_read(1, buf, BSIZE, (u64)fs_journal[cpu]->blocknums[offset / BSIZE] *
+            BSIZE);
+  return true;
+}
+
+// Synchronously read or write bufs from or to the disk blocks blocknums[0..
+// bufs.size()), with one scatter-gather I/O per run of blocks that are
+// contiguous on the disk (upto SG_IO_SIZE, and not crossing a stripe
+// boundary). Used during crash-recovery.
+static void
+recovery_block_io(const u32 *blocknums, const std::vector<char*> &bufs,
+                  bool write)
+{
+  const u32 stripe_blocks = DISK_STRIPE_SIZE / BSIZE;
+  std::vector<kiovec> iovs;
+  for (auto &b : bufs)
+    iovs.push_back({ (void *)b, BSIZE });
+
+  size_t start = 0;
+  for (size_t i = 1; i <= bufs.size(); i++) {
+    if (i < bufs.size() && blocknums[i] == blocknums[i - 1] + 1 &&
+        blocknums[i] % stripe_blocks != 0 && i - start < SG_IO_SIZE / BSIZE)
+      continue;
+
+    if (write)
+      disk_writev(1, &iovs[start], i - start, (u64)blocknums[start] * BSIZE);
+    else
+      disk_readv(1, &iovs[start], i - start, (u64)blocknums[start] * BSIZE);
+    start = i;
+  }
+}
+
+// Read bufs.size() consecutive journal blocks starting at the given offset
+// (see recovery_block_io()).
+bool
+mfs_interface::read_journal_blocks(int cpu, u32 offset,
+                                   const std::vector<char*> &bufs)
+{
+  assert(offset % BSIZE == 0);
+  if (offset + bufs.size() * BSIZE > fs_journal[cpu]->capacity())
     return false;
 
-  return true;
+  recovery_block_io(&fs_journal[cpu]->blocknums[offset / BSIZE], bufs, false);
+  return true;
+}
+
+// Add a block to be written to the on-disk journal at the journal's current
+// offset (its head) to the transaction tr.
+void
+mfs_interface::write_journal(char *buf, size_t size, transaction *tr, int cpu)
+{
+  u32 offset = fs_journal[cpu]->current_offset();
+
+  assert(offset % BSIZE == 0 && size == BSIZE);
+  tr->add_block(new transaction_diskblock(
+                  fs_journal[cpu]->blocknums[offset / BSIZE], buf, get_tsc(),
+                  true));
+
+  offset += size;
+  fs_journal[cpu]->update_offset(offset);
+}
+
+// Compute the checksum stored in a transaction's start block: CRC-32C over the
+// transaction's blocks in the journal (jblocks), in the order they are laid out
+// there. jblocks[0] is the start block, whose checksum field is taken as zero.
+u32
+mfs_interface::journal_checksum(const std::vector<const char*> &jblocks)
+{
+  journal_header_block hdr = *(const journal_header_block *)jblocks[0];
+  hdr.checksum = 0;
+
+  u32 crc = crc32c(~0U, (const u8 *)&hdr, sizeof(hdr));
+  for (auto it = jblocks.begin() + 1; it != jblocks.end(); it++)
+    crc = crc32c(crc, (const u8 *)*it, BSIZE);
+
+  return ~crc;
 }
 
+// Split a transaction's disk blocks into the ones to be logged whole (returned
+// in fullblocks) and the ones whose modified chunks are packed into delta
+// blocks instead (see journal_delta_record). The delta blocks are allocated
+// here and must be freed by the caller.
 void
-mfs_interface::write_journal(char *buf, size_t size, transaction *tr, int cpu)
+mfs_interface::pack_journal_deltas(
+    const std::vector<transaction_diskblock*> &datablocks,
+    std::vector<transaction_diskblock*> &fullblocks,
+    std::vector<char*> &deltablocks)
 {
-  u32 offset = fs_journal[cpu]->current_offset();
+  const u32 nchunks_max = BSIZE / TXN_CHUNK_SIZE;
+  char *dblk = nullptr;
+  u32 doff = BSIZE;
+
+  for (auto &b : datablocks) {
+    u32 nchunks = 0;
+    for (u32 c = 0; c < nchunks_max; c++)
+      nchunks += (b->dirty_chunks >> c) & 1;
+
+    // Logging a block whole is cheaper than as a delta, if most of it changed.
+    u32 rec_size = sizeof(journal_delta_record) + nchunks * TXN_CHUNK_SIZE;
+    if (!JOURNAL_DELTAS || rec_size > BSIZE / 2) {
+      fullblocks.push_back(b);
+      continue;
+    }
 
-  // Make sure we are writing BSIZE bytes at BSIZE-aligned offsets, so that
-  // we can skip reading the disk within writei().
-  assert(offset % BSIZE == 0 && size == BSIZE);
-  assert(writei(sv6_journal[cpu], buf, offset, size, tr) == size);
+    if (doff + rec_size > BSIZE) {
+      if (deltablocks.size() == 255) { // Limited by num_delta_blocks.
+        fullblocks.push_back(b);
+        continue;
+      }
+      dblk = kalloc("journal delta block", BSIZE);
+      memset(dblk, 0, BSIZE);
+      deltablocks.push_back(dblk);
+      doff = 0;
+    }
 
-  offset += size;
-  fs_journal[cpu]->update_offset(offset);
+    journal_delta_record *rec = (journal_delta_record *)(dblk + doff);
+    rec->blocknum = b->blocknum;
+    rec->chunk_mask = b->dirty_chunks;
+    doff += sizeof(*rec);
+
+    for (u32 c = 0; c < nchunks_max; c++) {
+      if (b->dirty_chunks & (1ULL << c)) {
+        memmove(dblk + doff, b->blockdata + c * TXN_CHUNK_SIZE, TXN_CHUNK_SIZE);
+        doff += TXN_CHUNK_SIZE;
+      }
+    }
+  }
 }
 
-// Write a transaction's disk blocks to the on-disk journal. The only thing
-// remaining to write to the journal on the disk after this function returns,
-// would be the commit block.
+// Write a transaction's start block, address block, disk blocks and delta
+// blocks to the on-disk journal. The start block carries a checksum over all of
+// them, so the transaction is committed once these writes reach stable storage;
+// there is no separate commit block to write and flush.
+//
+// disks_written are the disks that the transaction has already written blocks
+// to in place; those are flushed before the journal blocks are written, so
+// that a valid journal record never refers to data that didn't make it to the
+// disk. If flush_disks is given (group commit), the caller has taken care of
+// that, and the journal's disks are just added to flush_disks instead of being
+// flushed here.
 // Caller must hold ilock for write on sv6_journal.
 void
 mfs_interface::write_journal_transaction_blocks(
     const std::vector<transaction_diskblock*> &datablocks,
-    const u64 timestamp, bitset<NDISK> &disks_written, int cpu)
+    const u64 timestamp, bitset<NDISK> &disks_written, int cpu,
+    bitset<NDISK> *flush_disks)
 {
+  kstats::timer timer(&kstats::fs_journal_write_cycles);
+  kstats::inc(&kstats::fs_journal_write_count);
+  scoped_disk_tag tag(DISKTRACE_JOURNAL);
   journal_header_block hdr_start;
-  journal_addr_block hdr_addr;
   memset(&hdr_start, 0, sizeof(hdr_start));
-  memset(&hdr_addr, 0, sizeof(hdr_addr));
   hdr_start.timestamp = timestamp;
   hdr_start.header_type = JOURNAL_TXN_START;
+  hdr_start.cpu = cpu;
+
+  // Inode and bitmap blocks with only a few modified chunks are logged as
+  // deltas; the rest are logged whole.
+  std::vector<transaction_diskblock*> fullblocks;
+  std::vector<char*> deltablocks;
+  pack_journal_deltas(datablocks, fullblocks, deltablocks);
+  hdr_start.num_delta_blocks = deltablocks.size();
 
   // No. of block addresses that can fit in the start and the address blocks.
   u32 nslots_startblk = sizeof(hdr_start.blocknums) / sizeof(u32);
-  u32 nslots_addrblk = sizeof(hdr_addr.blocknums) / sizeof(u32);
-
-  assert(datablocks.size() <= nslots_startblk + nslots_addrblk);
-
-  int count = 0;
-  for (auto it = datablocks.begin(); it != datablocks.end(); it++, count++) {
+  u32 nslots_addrblk = sizeof(journal_addr_block::blocknums) / sizeof(u32);
+
+  u32 naddr = num_addr_blocks_for(fullblocks.size());
+  assert(naddr <= max_addr_blocks);
+  std::vector<journal_addr_block*> addrblocks;
+  for (u32 i = 0; i < naddr; i++) {
+    auto ab = (journal_addr_block *)kalloc("journal addr block", BSIZE);
+    memset(ab, 0, BSIZE);
+    addrblocks.push_back(ab);
+  }
+  hdr_start.num_addr_blocks = naddr;
 
-    // Fill the addresses in the start block itself, as far as possible, and use
-    // the dedicated address block if it spills over. We won't need more than 1
-    // address block, because our journal size is about 4 MB, which limits the
-    // number of data blocks for any transaction to about 1024 or so (roughly).
-    if (count < nslots_startblk)
+  // Fill the addresses in the start block itself, as far as possible, and use
+  // as many dedicated address blocks as it takes for the rest.
+  u32 count = 0;
+  for (auto it = fullblocks.begin(); it != fullblocks.end(); it++, count++) {
+    if (count < nslots_startblk) {
       hdr_start.blocknums[count] = (*it)->blocknum;
-    else
-      hdr_addr.blocknums[count - nslots_startblk] = (*it)->blocknum;
+    } else {
+      u32 slot = count - nslots_startblk;
+      addrblocks[slot / nslots_addrblk]->blocknums[slot % nslots_addrblk] =
+        (*it)->blocknum;
+    }
   }
 
-  if (datablocks.size() > nslots_startblk)
-    hdr_start.num_addr_blocks = 1;
-
-  // Write out the start block, (the addr block) and the data blocks.
-
+  std::vector<const char*> jblocks;
+  jblocks.push_back((const char *)&hdr_start);
+  for (auto &ab : addrblocks)
+    jblocks.push_back((const char *)ab);
+  for (auto &b : fullblocks)
+    jblocks.push_back(b->blockdata);
+  for (auto &d : deltablocks)
+    jblocks.push_back(d);
+  hdr_start.checksum = journal_checksum(jblocks);
+  ioacct_charge(IOACCT_JOURNAL, jblocks.size());
+
+  // Find space for the whole transaction in the journal. If it doesn't fit
+  // before the end of the journal, this wraps around to the beginning.
+  u64 trans_size = jblocks.size() * BSIZE;
+  u32 start_off = fs_journal[cpu]->space_offset(trans_size);
+  assert(start_off);
+  fs_journal[cpu]->update_offset(start_off);
+
+  // Write out the start block, the addr blocks, the data blocks and the delta
+  // blocks, in that order.
   transaction *jrnl_trans = new transaction();
+  for (auto &jb : jblocks)
+    write_journal((char *)jb, BSIZE, jrnl_trans, cpu);
 
-  write_journal((char *)&hdr_start, sizeof(hdr_start), jrnl_trans, cpu);
+  fs_journal[cpu]->commits_since_resize++;
+  fs_journal[cpu]->peak_used = std::max(fs_journal[cpu]->peak_used,
+                                        fs_journal[cpu]->used_space());
 
-  // Write out the address block(s), if we have any.
-  if (hdr_start.num_addr_blocks)
-    write_journal((char *)&hdr_addr, sizeof(hdr_addr), jrnl_trans, cpu);
+  for (auto &d : deltablocks)
+    kfree(d, BSIZE);
+  for (auto &ab : addrblocks)
+    kfree(ab, BSIZE);
 
-  // Write out the data blocks themselves to the in-memory journal.
-  for (auto &b : datablocks)
-    write_journal(b->blockdata, BSIZE, jrnl_trans, cpu);
-
-  // Merge the disks_written obtained from any previous disk writes by the
-  // given transaction.
-  for (auto d : disks_written)
-    jrnl_trans->disks_written.set(d);
+  if (!flush_disks) {
+    flush_disk_caches(disks_written);
+    disks_written.reset();
+  }
 
   // Finally, write the transaction's disk blocks to stable storage (disk).
-  jrnl_trans->write_to_disk_and_flush();
-
-  delete jrnl_trans;
-}
-
-// Caller must hold ilock for write on sv6_journal.
-void
-mfs_interface::write_journal_commit_block(u64 timestamp, int cpu)
-{
-  // The transaction ends with a commit block containing the same timestamp.
-  journal_header_block hdr_commit(timestamp, JOURNAL_TXN_COMMIT);
+  // If the caller is batching up the cache flushes itself (group commit), just
+  // note down the disks that need to be flushed.
+  if (flush_disks) {
+    jrnl_trans->write_to_disk(false, true);
+    for (auto d : jrnl_trans->disks_written)
+      flush_disks->set(d);
+  } else {
+    jrnl_trans->write_to_disk(false, true);
+    kstats::timer flush_timer(&kstats::fs_commit_flush_cycles);
+    kstats::inc(&kstats::fs_commit_flush_count);
+    jrnl_trans->flush_disks(true);
+  }
 
-  transaction *jrnl_trans = new transaction();
-  write_journal((char *)&hdr_commit, sizeof(hdr_commit), jrnl_trans, cpu);
-  jrnl_trans->write_to_disk_and_flush();
   delete jrnl_trans;
 }
 
@@ -2087,12 +3591,16 @@ void
 mfs_interface::write_journal_skip_block(u64 timestamp, int cpu,
                                         bool use_async_io)
 {
-  assert(fs_journal[cpu]->current_offset() == 0);
-
   journal_header_block hdr_skip(timestamp, JOURNAL_TXN_SKIP);
+  hdr_skip.tail_offset = fs_journal[cpu]->tail_offset();
+  hdr_skip.nsegments = fs_journal[cpu]->nsegments;
+  memmove(hdr_skip.segments, fs_journal[cpu]->segments,
+          hdr_skip.nsegments * sizeof(u32));
 
+  // The skip block always lives at the beginning of the journal, so write it
+  // out directly, without disturbing the journal's head.
   transaction *jrnl_trans = new transaction();
-  write_journal((char *)&hdr_skip, sizeof(hdr_skip), jrnl_trans, cpu);
+  jrnl_trans->add_block(fs_journal[cpu]->blocknums[0], (char *)&hdr_skip);
 
   if (use_async_io)
     jrnl_trans->write_to_disk_and_flush();
@@ -2107,12 +3615,9 @@ mfs_interface::get_txn_skip_block(int cpu, u64 *skip_upto_tsc)
 {
   static char skipbuf[BSIZE], zerobuf[BSIZE];
   size_t hdr_size = sizeof(journal_header_block);
-  u32 offset = fs_journal[cpu]->current_offset();
 
-  if (readi(sv6_journal[cpu], skipbuf, offset, hdr_size) != hdr_size)
-    return false;
-
-  fs_journal[cpu]->update_offset(offset + hdr_size);
+  // The skip block is the first block of this core's journal file.
+  disk_read(1, skipbuf, BSIZE, (u64)journal_file_blocknums[cpu][0] * BSIZE);
 
   if (!memcmp((void *)skipbuf, zerobuf, hdr_size))
     return false;
@@ -2122,6 +3627,31 @@ mfs_interface::get_txn_skip_block(int cpu, u64 *skip_upto_tsc)
   if (hdskipptr->header_type != JOURNAL_TXN_SKIP)
     return false;
 
+  // Lay out the journal the way it was when the skip block was written.
+  u32 nsegs = hdskipptr->nsegments;
+  if (nsegs > JOURNAL_MAX_SEGMENTS)
+    return false;
+  for (u32 i = 0; i < nsegs; i++) {
+    if (hdskipptr->segments[i] >= NCPU * JOURNAL_FILE_SEGMENTS)
+      return false;
+  }
+  set_journal_segments(cpu, hdskipptr->segments, nsegs);
+  if (!nsegs) {
+    // A skip block that doesn't record any segments: the journal is the
+    // whole of this core's journal file, as it was before journals were
+    // sized dynamically.
+    u32 segs[JOURNAL_FILE_SEGMENTS];
+    for (u32 i = 0; i < JOURNAL_FILE_SEGMENTS; i++)
+      segs[i] = cpu * JOURNAL_FILE_SEGMENTS + i;
+    set_journal_segments(cpu, segs, JOURNAL_FILE_SEGMENTS);
+  }
+
+  // Start scanning for unapplied transactions at the tail of the journal.
+  u32 tail = hdskipptr->tail_offset;
+  if (tail < hdr_size || tail >= fs_journal[cpu]->capacity())
+    tail = hdr_size;
+  fs_journal[cpu]->update_offset(tail);
+
   *skip_upto_tsc = hdskipptr->timestamp;
   return true;
 }
@@ -2133,111 +3663,194 @@ mfs_interface::get_txn_start_block(int cpu)
   size_t hdr_size = sizeof(journal_header_block);
   u32 offset = fs_journal[cpu]->current_offset();
 
-  if (readi(sv6_journal[cpu], startbuf, offset, hdr_size) != hdr_size)
+  if (!read_journal_block(cpu, offset, startbuf))
     return nullptr;
 
   fs_journal[cpu]->update_offset(offset + hdr_size);
 
   journal_header *hdstartptr = (journal_header *)startbuf;
 
-  if (hdstartptr->header_type != JOURNAL_TXN_START)
+  if (hdstartptr->header_type != JOURNAL_TXN_START ||
+      hdstartptr->cpu != cpu)
     return nullptr;
 
   return hdstartptr;
 }
 
+// Read the address, data and delta blocks of the transaction whose start block
+// was just read, and check them against the start block's checksum. Returns
+// false (and deletes trans) if the transaction is incomplete on the disk; such
+// a transaction was never committed. The block counts come from the disk, so
+// a header whose counts don't fit in the rest of the journal is rejected the
+// same way, before anything is allocated for it.
 bool
 mfs_interface::get_txn_data_blocks(int cpu, journal_header *hdstartptr,
                                    transaction *trans)
 {
   static char databuf[BSIZE];
   u32 offset = fs_journal[cpu]->current_offset();
-  int num_blks = sizeof(hdstartptr->blocknums) / sizeof(u32);
-  u32 datablock_offset = hdstartptr->num_addr_blocks ?
-                         offset + sizeof(journal_addr_block) : offset;
+  u32 nslots_startblk = sizeof(hdstartptr->blocknums) / sizeof(u32);
+  u32 nslots_addrblk = sizeof(journal_addr_block::blocknums) / sizeof(u32);
+  u32 naddr = hdstartptr->num_addr_blocks;
+  u32 ndelta = hdstartptr->num_delta_blocks;
+  u32 left = (fs_journal[cpu]->capacity() - offset) / BSIZE;
+  std::vector<const char*> jblocks;
+  std::vector<char*> addrblocks, datablocks, deltablocks, bufs;
+  std::vector<u32> blocknums;
+  bool ok = false;
+
+  jblocks.push_back((const char *)hdstartptr);
+
+  if (naddr > max_addr_blocks || naddr + ndelta > left)
+    goto out;
 
-  for (int i = 0; i < num_blks && hdstartptr->blocknums[i]; i++) {
+  // Read the address blocks first, since they tell how many data blocks
+  // follow, and then the data and delta blocks together.
+  for (u32 i = 0; i < naddr; i++)
+    addrblocks.push_back(kalloc("journal addr block", BSIZE));
+  if (!read_journal_blocks(cpu, offset, addrblocks))
+    goto out;
+  offset += naddr * BSIZE;
 
-    if (readi(sv6_journal[cpu], databuf, datablock_offset, BSIZE) != BSIZE) {
-      delete trans;
-      return false;
+  for (u32 i = 0; i < nslots_startblk + naddr * nslots_addrblk; i++) {
+    u32 blocknum;
+    if (i < nslots_startblk) {
+      blocknum = hdstartptr->blocknums[i];
+    } else {
+      u32 slot = i - nslots_startblk;
+      blocknum = ((journal_addr_block *)addrblocks[slot / nslots_addrblk])->
+                 blocknums[slot % nslots_addrblk];
     }
-
-    datablock_offset += BSIZE;
-    trans->add_block(hdstartptr->blocknums[i], databuf);
+    if (!blocknum)
+      break;
+    blocknums.push_back(blocknum);
   }
+  if (naddr + blocknums.size() + ndelta > left)
+    goto out;
 
-  assert(!hdstartptr->num_addr_blocks); // TODO: Handle this case later.
-  fs_journal[cpu]->update_offset(datablock_offset);
-  return true;
-}
-
-bool
-mfs_interface::get_txn_commit_block(int cpu, transaction *trans)
-{
-  static char commitbuf[BSIZE];
-  size_t hdr_size = sizeof(journal_header_block);
-  u32 offset = fs_journal[cpu]->current_offset();
+  for (size_t i = 0; i < blocknums.size(); i++)
+    datablocks.push_back(kalloc("journal data block", BSIZE));
+  for (u32 i = 0; i < ndelta; i++)
+    deltablocks.push_back(kalloc("journal delta block", BSIZE));
 
-  if (readi(sv6_journal[cpu], commitbuf, offset, hdr_size) != hdr_size) {
-    delete trans;
-    return false;
+  for (auto &b : addrblocks)
+    jblocks.push_back(b);
+  for (auto &b : datablocks) {
+    jblocks.push_back(b);
+    bufs.push_back(b);
+  }
+  for (auto &b : deltablocks) {
+    jblocks.push_back(b);
+    bufs.push_back(b);
   }
 
-  fs_journal[cpu]->update_offset(offset + hdr_size);
+  if (!read_journal_blocks(cpu, offset, bufs))
+    goto out;
+  offset += bufs.size() * BSIZE;
 
-  journal_header *hdcommitptr = (journal_header *)commitbuf;
+  if (journal_checksum(jblocks) != hdstartptr->checksum)
+    goto out;
 
-  if (hdcommitptr->header_type != JOURNAL_TXN_COMMIT ||
-      hdcommitptr->timestamp != trans->commit_tsc) {
-    delete trans;
-    return false;
+  for (size_t i = 0; i < blocknums.size(); i++)
+    trans->add_block(blocknums[i], datablocks[i]);
+
+  // Unpack the delta records. Each one becomes a diskblock that holds valid
+  // contents only in its dirty chunks; they are merged with the current
+  // contents of the block when the transaction is applied.
+  for (auto &dblk : deltablocks) {
+    u32 doff = 0;
+    while (doff + sizeof(journal_delta_record) <= BSIZE) {
+      const journal_delta_record *rec = (const journal_delta_record *)
+                                        (dblk + doff);
+      if (!rec->blocknum)
+        break;
+      doff += sizeof(*rec);
+
+      memset(databuf, 0, BSIZE);
+      for (u32 c = 0; c < BSIZE / TXN_CHUNK_SIZE; c++) {
+        if (rec->chunk_mask & (1ULL << c)) {
+          if (doff + TXN_CHUNK_SIZE > BSIZE)
+            goto out;
+          memmove(databuf + c * TXN_CHUNK_SIZE, dblk + doff, TXN_CHUNK_SIZE);
+          doff += TXN_CHUNK_SIZE;
+        }
+      }
+
+      trans->add_block(rec->blocknum, databuf);
+      trans->blocks.back()->dirty_chunks = rec->chunk_mask;
+    }
   }
 
-  return true;
-}
+  fs_journal[cpu]->update_offset(offset);
+  ok = true;
 
+out:
+  for (auto &a : addrblocks)
+    kfree(a, BSIZE);
+  for (auto &d : datablocks)
+    kfree(d, BSIZE);
+  for (auto &d : deltablocks)
+    kfree(d, BSIZE);
+  if (!ok)
+    delete trans;
+  return ok;
+}
 
 // Called on reboot after a crash. Returns the transaction last committed
 // to this journal (but perhaps not yet applied to the disk filesystem).
 void
 mfs_interface::recover_journal(int cpu, std::vector<transaction*> &trans_vec)
 {
-  char jrnl_name[32];
-  snprintf(jrnl_name, sizeof(jrnl_name), "/sv6journal%d", cpu);
-  sv6_journal[cpu] = namei(sref<inode>(), jrnl_name);
-  assert(sv6_journal[cpu]);
-
   bool dont_apply;
+  bool wrapped = false;
   u64 last_tsc = 0, skip_upto_tsc = 0;
+  const u32 data_start = sizeof(journal_header_block);
 
   ilock(sv6_journal[cpu], WRITELOCK);
 
   if (!get_txn_skip_block(cpu, &skip_upto_tsc))
     goto out;
 
-  while (fs_journal[cpu]->current_offset() < PHYS_JOURNAL_SIZE) {
+  // The journal is a ring buffer, so transactions are laid out in increasing
+  // timestamp order starting at the tail, possibly wrapping around to the
+  // beginning of the journal once (a transaction that didn't fit at the end
+  // of the journal was written at the beginning). So when we can't find the
+  // next transaction, look for it at the beginning of the journal before
+  // giving up.
+  for (;;) {
     dont_apply = false;
 
-    journal_header *hdstartptr = get_txn_start_block(cpu);
-    if (!hdstartptr || hdstartptr->timestamp < last_tsc)
-      break;
+    u32 txn_off = fs_journal[cpu]->current_offset();
+    journal_header *hdstartptr = nullptr;
+    transaction *trans = nullptr;
 
-    last_tsc = hdstartptr->timestamp;
+    if (txn_off < fs_journal[cpu]->capacity()) {
+      hdstartptr = get_txn_start_block(cpu);
+      if (hdstartptr && hdstartptr->timestamp < last_tsc)
+        hdstartptr = nullptr;
+    }
 
-    if (hdstartptr->timestamp <= skip_upto_tsc)
-      dont_apply = true;
+    if (hdstartptr) {
+      if (hdstartptr->timestamp <= skip_upto_tsc)
+        dont_apply = true;
 
-    transaction *trans = new transaction(hdstartptr->timestamp);
-    trans->commit_tsc = hdstartptr->timestamp;
+      trans = new transaction(hdstartptr->timestamp);
+      trans->commit_tsc = hdstartptr->timestamp;
 
-    if (!get_txn_data_blocks(cpu, hdstartptr, trans))
-      break;
+      // This deletes the transaction on failure.
+      if (!get_txn_data_blocks(cpu, hdstartptr, trans))
+        trans = nullptr;
+    }
 
-    if (!get_txn_commit_block(cpu, trans))
-      break;
+    if (!trans) {
+      if (wrapped || txn_off == data_start)
+        break;
+      wrapped = true;
+      fs_journal[cpu]->update_offset(data_start);
+      continue;
+    }
 
-    assert(trans);
+    last_tsc = trans->commit_tsc;
 
     if (dont_apply) {
       cprintf("recover_journal: skipping transaction %lu (skip-upto %lu)\n",
@@ -2252,31 +3865,184 @@ out:
   iunlock(sv6_journal[cpu]);
 }
 
+// Write the final versions of the recovered blocks (sorted by block number)
+// straight to the disk, without pulling them into the buffer cache (see
+// JOURNAL_REPLAY_DIRECT). Blocks whose journal records are all deltas are
+// merged into their current contents on the disk first. The buffer cache
+// only holds clean copies of disk blocks this early, so any cached copy of a
+// block is simply updated in place, and stays clean.
 void
-mfs_interface::init_journal(int cpu)
+mfs_interface::write_recovered_blocks(
+  const std::vector<transaction_diskblock*> &dbs)
 {
-  fs_journal[cpu]->update_offset(0);
-  write_journal_skip_block(0, cpu, false); // Use synchronous I/O.
+  std::vector<u32> blocknums;
+  std::vector<char*> bufs;
+  for (auto &db : dbs) {
+    if (db->dirty_chunks == TXN_ALL_CHUNKS)
+      continue;
+    blocknums.push_back(db->blocknum);
+    bufs.push_back(kalloc("recovered block", BSIZE));
+  }
+  recovery_block_io(blocknums.data(), bufs, false);
+
+  size_t k = 0;
+  for (auto &db : dbs) {
+    if (db->dirty_chunks == TXN_ALL_CHUNKS)
+      continue;
+    char *base = bufs[k++];
+    for (u32 c = 0; c < BSIZE / TXN_CHUNK_SIZE; c++) {
+      if (db->dirty_chunks & (1ULL << c))
+        memmove(base + c * TXN_CHUNK_SIZE, db->blockdata + c * TXN_CHUNK_SIZE,
+                TXN_CHUNK_SIZE);
+    }
+    memmove(db->blockdata, base, BSIZE);
+    db->dirty_chunks = TXN_ALL_CHUNKS;
+    kfree(base, BSIZE);
+  }
+
+  blocknums.clear();
+  bufs.clear();
+  for (auto &db : dbs) {
+    blocknums.push_back(db->blocknum);
+    bufs.push_back(db->blockdata);
+  }
+  recovery_block_io(blocknums.data(), bufs, true);
+
+  for (auto &db : dbs) {
+    if (!buf::in_bufcache(1, db->blocknum))
+      continue;
+    sref<buf> bp = buf::get(1, db->blocknum);
+    auto locked = bp->write_clean();
+    memmove(locked->data, db->blockdata, BSIZE);
+  }
+}
+
+// Apply the transactions recovered from the journals (one vector per journal,
+// each in commit order, as recover_journal() returns them) to the disk, and
+// delete them. Returns the number of blocks written. Only the final version of each block is written: the journals
+// are merged into commit order, and the versions of a block are folded into
+// one, with later delta records layered over earlier contents. The blocks are
+// then written out in block order.
+//
+// This runs before the other cores are up and before the process can sleep,
+// so the I/O is synchronous (see writeback_through_bufcache()).
+size_t
+mfs_interface::apply_recovered_transactions(std::vector<transaction*> *trans_vecs)
+{
+  // Merge the journals by commit timestamp.
+  size_t next[NCPU] = {};
+  std::vector<transaction*> txns;
+  for (;;) {
+    int min = -1;
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+      if (next[cpu] == trans_vecs[cpu].size())
+        continue;
+      if (min < 0 || trans_vecs[cpu][next[cpu]]->commit_tsc <
+                     trans_vecs[min][next[min]]->commit_tsc)
+        min = cpu;
+    }
+    if (min < 0)
+      break;
+    txns.push_back(trans_vecs[min][next[min]++]);
+  }
+  if (txns.empty())
+    return 0;
+
+  struct recovered_block {
+    u32 blocknum;
+    u64 seq;  // Position in commit order.
+    transaction_diskblock *db;
+  };
+  std::vector<recovered_block> blocks;
+  for (auto &tr : txns) {
+    tr->deduplicate_blocks();
+    for (auto &db : tr->blocks)
+      blocks.push_back({db->blocknum, blocks.size(), db});
+  }
+  std::sort(blocks.begin(), blocks.end(),
+            [](const recovered_block &a, const recovered_block &b) {
+              if (a.blocknum != b.blocknum)
+                return a.blocknum < b.blocknum;
+              return a.seq < b.seq;
+            });
+
+  cprintf("recover_scalefs: applying %lu transactions (%lu block versions) "
+          "upto commit timestamp %lu\n", txns.size(), blocks.size(),
+          txns.back()->commit_tsc);
+
+  std::vector<transaction_diskblock*> final_blocks;
+  for (size_t start = 0; start < blocks.size(); ) {
+    size_t end = start;
+    while (end < blocks.size() && blocks[end].blocknum == blocks[start].blocknum)
+      end++;
+
+    // Start from the last whole-block version, and layer the delta records
+    // that came after it on top.
+    size_t base = start;
+    for (size_t i = start; i < end; i++)
+      if (blocks[i].db->dirty_chunks == TXN_ALL_CHUNKS)
+        base = i;
+
+    transaction_diskblock *db = blocks[base].db;
+    for (size_t i = base + 1; i < end; i++) {
+      transaction_diskblock *delta = blocks[i].db;
+      for (u32 c = 0; c < BSIZE / TXN_CHUNK_SIZE; c++) {
+        if (delta->dirty_chunks & (1ULL << c))
+          memmove(db->blockdata + c * TXN_CHUNK_SIZE,
+                  delta->blockdata + c * TXN_CHUNK_SIZE, TXN_CHUNK_SIZE);
+      }
+      db->dirty_chunks |= delta->dirty_chunks;
+    }
+
+    final_blocks.push_back(db);
+    start = end;
+  }
+
+  if (JOURNAL_REPLAY_DIRECT)
+    write_recovered_blocks(final_blocks);
+  else
+    for (auto &db : final_blocks)
+      db->writeback_through_bufcache();
+
+  cprintf("recover_scalefs: wrote %lu blocks\n", final_blocks.size());
 
+  for (auto &tr : txns)
+    delete tr;
+  for (int cpu = 0; cpu < NCPU; cpu++)
+    trans_vecs[cpu].clear();
+  return final_blocks.size();
+}
+
+// Caller must have set up the journal's segments (see init_journal_pool()).
+void
+mfs_interface::init_journal(int cpu)
+{
   journal_header_block hdr_zero;
 
-  memset((char *)&hdr_zero, 0, sizeof(hdr_zero));
+  fs_journal[cpu]->update_tail_offset(sizeof(hdr_zero));
+  write_journal_skip_block(0, cpu, false); // Use synchronous I/O.
 
-  while (fs_journal[cpu]->current_offset() < PHYS_JOURNAL_SIZE) {
+  memset((char *)&hdr_zero, 0, sizeof(hdr_zero));
+  fs_journal[cpu]->update_offset(sizeof(hdr_zero));
 
+  // Clear this core's whole journal file, including the segments that went to
+  // the pool, so that no journal can mistake transactions from before this
+  // boot (whose timestamps are unrelated to the current ones) for its own.
+  for (u32 i = 1; i < PHYS_JOURNAL_SIZE / BSIZE; i++) {
     transaction *jrnl_trans = new transaction();
-    write_journal((char *)&hdr_zero, sizeof(hdr_zero), jrnl_trans, cpu);
+    jrnl_trans->add_block(journal_file_blocknums[cpu][i], (char *)&hdr_zero);
 
     jrnl_trans->write_to_disk_and_flush_raw();
     delete jrnl_trans;
   }
-
-  fs_journal[cpu]->update_offset(sizeof(hdr_zero));
 }
 
 // Reset the journal so that we can start writing to it again, from the
 // beginning. This is called after applying all the transactions committed to
-// this journal. To reset, we simply update the skip block of the journal with
+// this journal, i.e., when the journal is empty (after the last apply, its
+// head and tail are equal); it is not required to reuse journal space, since
+// the journal is a ring buffer, but starting afresh from the beginning helps
+// keep transactions from having to wrap around. To reset, we simply update the skip block of the journal with
 // the commit_tsc of the last transaction that was applied from this journal.
 // That ensures that we will never re-apply any of the transactions that the
 // journal currently holds, during crash-recovery. On the other hand, any new
@@ -2288,7 +4054,9 @@ mfs_interface::init_journal(int cpu)
 void
 mfs_interface::reset_journal(int cpu)
 {
-  fs_journal[cpu]->update_offset(0);
+  u32 data_start = sizeof(journal_header_block);
+  fs_journal[cpu]->update_offset(data_start);
+  fs_journal[cpu]->update_tail_offset(data_start);
   write_journal_skip_block(fs_journal[cpu]->last_applied_commit_tsc, cpu);
 }
 
@@ -2328,37 +4096,73 @@ mfs_interface::load_dir_entry(u64 inum, sref<mnode> parent)
 }
 
 void
-mfs_interface::load_dir(sref<inode> i, sref<mnode> m)
+mfs_interface::load_dir(borrowed<inode> i, sref<mnode> m)
 {
-  dirent de;
-  for (size_t pos = 0; pos < i->size; pos += sizeof(de)) {
-    assert(sizeof(de) == readi(i, (char*) &de, pos, sizeof(de)));
+  // Read the directory a block at a time, rather than a dirent at a time.
+  dirent *des = (dirent *) kalloc("load_dir", BSIZE);
+  if (!des)
+    throw_bad_alloc();
+  u32 nsubdirs = 0;
+
+  for (size_t pos = 0; pos < i->size; pos += sizeof(dirent)) {
+    size_t slot = (pos % BSIZE) / sizeof(dirent);
+    if (slot == 0) {
+      if (pos % (DIR_READAHEAD_BLOCKS * BSIZE) == 0)
+        readahead(i, pos, DIR_READAHEAD_BLOCKS * BSIZE);
+      u32 n = std::min((u64)BSIZE, i->size - pos);
+      assert(n == readi(i, (char*) des, pos, n));
+    }
+    dirent &de = des[slot];
     if (!de.inum)
       continue;
 
-    sref<mnode> mf = load_dir_entry(de.inum, m);
-    if (!mf)
-      continue;
-
     strbuf<DIRSIZ> name(de.name);
     // No links are held to the directory itself (via ".")
     // The root directory is an exception.
     if (name == "." || (name == ".." && i->inum != 1))
       continue;
 
-    mlinkref mlink(mf);
-    mlink.acquire();
-    assert(m->as_dir()->insert(name, &mlink));
-    mnum_name_insert(mf->mnum_, name);
+    // The mnodes for the entries are created as they are looked up, so that
+    // loading a directory reads neither the entries' contents nor their
+    // own entries. Only their inode types are read, to count the links
+    // that the subdirectories' ".." entries hold (see count_subdir_links()).
+    assert(static_cast<mdir*>(m.get())->insert_unloaded(name, de.inum));
+    if (name != ".." && iget(1, de.inum)->type.load() == T_DIR)
+      nsubdirs++;
+  }
+
+  kfree(des, BSIZE);
+  static_cast<mdir*>(m.get())->count_subdir_links(nsubdirs);
+}
 
-    // Add a link to the parent directory.
-    if (mf->mnum_ != root_mnum && mf->type() == mnode::types::dir) {
-      strbuf<DIRSIZ> parent_name("..");
-      mlinkref mlink(m);
-      mlink.acquire();
-      assert(mf->as_dir()->insert(parent_name, &mlink));
-    }
+void
+mfs_interface::load_dir_entry(sref<mnode> parent, const strbuf<DIRSIZ>& name,
+                              u64 entry)
+{
+  u64 inum = mnode::unloaded_inum(entry);
+  auto l = load_entry_locks[inum % LOAD_ENTRY_LOCKS].guard();
+  mdir *md = static_cast<mdir*>(parent.get());
+  u64 cur;
+  if (!md->lookup_mnum(name, &cur) || cur != entry)
+    return;  // Loaded, or changed, while we waited for the lock.
+
+  sref<mnode> mf = load_dir_entry(inum, parent);
+  if (!mf) {
+    md->remove_unloaded(name, entry);
+    return;
   }
+
+  mlinkref mlink(mf);
+  mlink.acquire();
+  if (!md->set_loaded(name, entry, &mlink))
+    return;
+  mnum_name_insert(mf->mnum_, name);
+
+  // Add the entry for the parent directory, whose link load_dir() counted
+  // already. This doesn't go through as_dir(), which would load the
+  // subdirectory's own entries; load_dir() skips "..".
+  if (mf->mnum_ != root_mnum && mf->type() == mnode::types::dir)
+    assert(static_cast<mdir*>(mf.get())->insert_dotdot(parent->mnum_));
 }
 
 sref<mnode>
@@ -2385,44 +4189,53 @@ void
 mfs_interface::initialize_freeblock_bitmap()
 {
   sref<buf> bp;
-  int b, bi, nbits;
+  u32 b, blocknum, first_free_bblock_bit = 0;
+  bool found_free_bblock = false;
   superblock sb;
-  u32 blocknum, first_free_bblock_bit = 0;
 
   get_superblock(&sb);
 
-  // Allocate the memory for the bit_vector in one shot, instead of doing it
-  // piecemeal using .push_back() in a loop.
-  freeblock_bitmap.bit_vector.reserve(sb.size);
+  static_assert(BPB % 64 == 0, "Bitmap blocks must hold whole words");
+  u32 nwords = (sb.size + 63) / 64;
+  freeblock_bitmap.nblocks = sb.size;
+  std::vector<u64> words;
+  words.reserve(nwords);
 
+  // The on-disk bitmap has a bit set for every block in use; copy it in
+  // inverted, one word at a time. The words move into their pools once the
+  // pools are laid out.
+  std::vector<sref<buf> > bufs;
   for (b = 0; b < sb.size; b += BPB) {
     blocknum = BBLOCK(b, sb.ninodes);
-    bp = buf::get(1, blocknum);
+    u32 k = b / BPB % METADATA_SCAN_BLOCKS;
+    if (k == 0) {
+      u32 n = std::min((u32)METADATA_SCAN_BLOCKS, (sb.size - b + BPB - 1) / BPB);
+      bufs = buf::get_range(1, blocknum, n);
+    }
+    bp = bufs[k];
     auto copy = bp->read();
+    const u64 *disk_words = (const u64 *)copy->data;
+
+    u32 nbits = std::min((u32)BPB, sb.size - b);
+    for (u32 i = 0; i < (nbits + 63) / 64; i++) {
+      u64 w = ~disk_words[i];
+      if (nbits - i * 64 < 64)
+        w &= (1ULL << (nbits - i * 64)) - 1;
+      words.push_back(w);
+    }
 
-    nbits = std::min((u32)BPB, sb.size - b);
-
-    for (bi = 0; bi < nbits; bi++) {
-      int m = 1 << (bi % 8);
-      bool f = ((copy->data[bi/8] & m) == 0) ? true : false;
-
-      // Maintain a vector as well as a linked-list representation of the
-      // free-bits, to speed up freeing and allocation of blocks, respectively.
-      free_bit *bit = new free_bit(b + bi, f);
-      freeblock_bitmap.bit_vector.push_back(bit);
-
-      // Make note of the first bitmap block (bit) that starts with a free bit
-      // (which is an approximation that, that entire bitmap block (and all
-      // the subsequent ones) contains only free bits). That's where we'll
-      // start allocating per-CPU resources from (further down in the code),
-      // in order to avoid initializing CPU0 with nearly no free bits.
-      if (!first_free_bblock_bit && f && bi == 0)
-        first_free_bblock_bit = b;
+    // Make note of the first bitmap block (bit) that starts with a free bit
+    // (which is an approximation that, that entire bitmap block (and all
+    // the subsequent ones) contains only free bits). That's where we'll
+    // start allocating per-CPU resources from (further down in the code),
+    // in order to avoid initializing CPU0 with nearly no free bits.
+    if (!found_free_bblock && (words[b / 64] & 1)) {
+      first_free_bblock_bit = b;
+      found_free_bblock = true;
     }
   }
 
-  // Distribute the blocks among the CPUs and add the free blocks to the per-CPU
-  // freelists.
+  // Distribute the blocks among the CPUs.
 
   // TODO: Remove this assert and handle cases where multiple CPUs have to share
   // the same bitmap blocks.
@@ -2433,48 +4246,42 @@ mfs_interface::initialize_freeblock_bitmap()
   u32 bitblocks_per_cpu = nbitblocks/NCPU;
   u32 bits_per_cpu = bitblocks_per_cpu * BPB;
 
-  for (int cpu = 0; cpu < NCPU; cpu++) {
-    auto list_lock = freeblock_bitmap.freelists[cpu].list_lock.guard();
+  freeblock_bitmap.cpu_start = first_free_bblock_bit;
+  freeblock_bitmap.blocks_per_cpu = bits_per_cpu;
 
+  for (int cpu = 0; cpu < NCPU; cpu++) {
     if (VERBOSE)
       cprintf("Per-CPU block allocator: CPU %d   blocks [%u - %u]\n",
               cpu, first_free_bblock_bit + cpu * bits_per_cpu,
               first_free_bblock_bit + ((cpu+1) * bits_per_cpu) - 1);
 
-    for (u32 bno = cpu * bits_per_cpu; bno < (cpu+1) * bits_per_cpu; bno++) {
-      auto bit = freeblock_bitmap.bit_vector.at(bno + first_free_bblock_bit);
-      bit->cpu = cpu;
-      if (bit->is_free)
-        freeblock_bitmap.freelists[cpu].bit_freelist.push_back(bit);
-    }
+    freeblock_bitmap.init_pool(freeblock_bitmap.pools[cpu],
+                               (first_free_bblock_bit + cpu * bits_per_cpu) / 64,
+                               bits_per_cpu / 64, cpu < ncpu ? cpu : -1);
+    freeblock_bitmap.stashes[cpu].nwords = 0;
+    freeblock_bitmap.stashes[cpu].nfree = 0;
   }
 
-  // Build a global reserve pool of free blocks using whatever is remaining,
-  // to be used when a per-CPU freelist runs out, before stealing free blocks
-  // from other CPUs' freelists.
-  if (NCPU * bitblocks_per_cpu < nbitblocks) {
-    auto list_lock = freeblock_bitmap.reserve_freelist.list_lock.guard();
-    for (u32 bno = NCPU * bits_per_cpu; bno + first_free_bblock_bit < sb.size;
-         bno++) {
-      auto bit = freeblock_bitmap.bit_vector.at(bno + first_free_bblock_bit);
-      bit->cpu = NCPU; // Invalid CPU number to denote reserve pool.
-      if (bit->is_free)
-        freeblock_bitmap.reserve_freelist.bit_freelist.push_back(bit);
-    }
-  }
+  // The global reserve pool gets whatever is remaining, both before
+  // first_free_bblock_bit and after the last CPU's blocks; it is used when a
+  // per-CPU pool runs out, before stealing free blocks from other CPUs. For
+  // simplicity its summary covers the whole bitmap, but only the words that
+  // belong to it ever show up in it.
+  freeblock_bitmap.init_pool(freeblock_bitmap.reserve, 0, nwords, -1);
 
-  // Any other leftover free bits from [0 to first_free_bblock_bit) also go
-  // to the reserve pool. Also make sure to set the CPU number for those bits
-  // irrespective of whether they are free.
-  {
-    auto list_lock = freeblock_bitmap.reserve_freelist.list_lock.guard();
-    for (u32 bno = 0; bno < first_free_bblock_bit; bno++) {
-      auto bit = freeblock_bitmap.bit_vector.at(bno);
-      bit->cpu = NCPU; // Invalid CPU number to denote reserve pool.
-      if (bit->is_free)
-        freeblock_bitmap.reserve_freelist.bit_freelist.push_back(bit);
-    }
+  for (u32 w = 0; w < nwords; w++) {
+    if (!words[w])
+      continue;
+
+    auto &p = freeblock_bitmap.pool_of(freeblock_bitmap.owner(w * 64));
+    auto pool_lock = p.lock.guard();
+    p.word(w) = words[w];
+    freeblock_bitmap.summarize_word(p, w);
+    p.nfree += __builtin_popcountll(words[w]);
   }
+
+  for (int cpu = 0; cpu < NCPU; cpu++)
+    numa_steal_order(cpu, freeblock_bitmap.steal_order[cpu], NCPU);
 }
 
 // Allocate a block from the freeblock_bitmap.
@@ -2483,27 +4290,25 @@ mfs_interface::alloc_block()
 {
   u32 bno;
   superblock sb;
-  int cpu = myid();
+  int cpu = myhome();
   static bool warned_once = false;
 
-  // Use the linked-list representation of the free-bits to perform block
-  // allocation in O(1) time. This list only contains the blocks that are
-  // actually free, so we can allocate any one of them.
+  auto &s = freeblock_bitmap.stashes[cpu];
+  {
+    // Blocks in the stash belong to other pools, so use them up first.
+    auto stash_lock = s.lock.guard();
+    if (freeblock_bitmap.stash_pop(s, &bno))
+      return bno;
+  }
 
   {
-    auto list_lock = freeblock_bitmap.freelists[cpu].list_lock.guard();
-
-    if (!freeblock_bitmap.freelists[cpu].bit_freelist.empty()) {
-      auto it = freeblock_bitmap.freelists[cpu].bit_freelist.begin();
-      assert(it->is_free);
-      it->is_free = false;
-      bno = it->bno_;
-      freeblock_bitmap.freelists[cpu].bit_freelist.erase(it);
+    auto &p = freeblock_bitmap.pools[cpu];
+    auto pool_lock = p.lock.guard();
+    if (freeblock_bitmap.alloc_from(p, &bno))
       return bno;
-    }
   }
 
-  // If we run out of blocks in our local CPU's freelist, tap into the global
+  // If we run out of blocks in our local CPU's pool, tap into the global
   // reserve pool first.
   if (VERBOSE && !warned_once) {
     cprintf("WARNING: alloc_block(): CPU %d allocating blocks from the global "
@@ -2512,46 +4317,42 @@ mfs_interface::alloc_block()
     warned_once = true;
   }
 
-  // TODO: Allocate from the reserve pool in bulk in order to reduce the
-  // chances of contention even further.
   {
-    if (freeblock_bitmap.reserve_freelist.bit_freelist.empty())
-      goto try_neighbor;
-
-    auto list_lock = freeblock_bitmap.reserve_freelist.list_lock.guard();
+    // Refill the stash in bulk, a bitmap block's worth at a time, so that
+    // the shared reserve lock (or another CPU's pool lock) is taken once per
+    // BPB blocks rather than once per block. Failing the reserve pool, steal
+    // from other CPUs, those on our own NUMA node first so that the bitmap
+    // words stay node-local. Each CPU starts its fallback-search at a
+    // different point, in order to avoid hotspots.
+    auto stash_lock = s.lock.guard();
+    if (freeblock_bitmap.stash_pop(s, &bno))
+      return bno;
 
-    if (!freeblock_bitmap.reserve_freelist.bit_freelist.empty()) {
-      auto it = freeblock_bitmap.reserve_freelist.bit_freelist.begin();
-      assert(it->is_free);
-      it->is_free = false;
-      bno = it->bno_;
-      freeblock_bitmap.reserve_freelist.bit_freelist.erase(it);
+    if (freeblock_bitmap.reserve.nfree &&
+        freeblock_bitmap.refill_stash(s, freeblock_bitmap.reserve) &&
+        freeblock_bitmap.stash_pop(s, &bno))
       return bno;
+
+    for (int i = 0; i < NCPU - 1; i++) {
+      auto &p = freeblock_bitmap.pools[freeblock_bitmap.steal_order[cpu][i]];
+
+      if (p.nfree && freeblock_bitmap.refill_stash(s, p) &&
+          freeblock_bitmap.stash_pop(s, &bno))
+        return bno;
     }
   }
 
-  // We failed to allocate even from the reserve pool. So steal free blocks
-  // from other CPUs. Each CPU starts its fallback-search at a different
-  // point, in order to avoid hotspots. Note that these blocks are only
-  // borrowed temporarily and are prompty returned to the original CPU's
-  // freelists upon being freed.
-try_neighbor:
-  for (int fallback_cpu = cpu + 1; fallback_cpu % NCPU != cpu; fallback_cpu++) {
-    int fcpu = fallback_cpu % NCPU;
+  // The only free blocks left, if any, are in other CPUs' stashes. Stash
+  // locks are never nested, so our own has to be released by now.
+  for (int i = 0; i < NCPU - 1; i++) {
+    auto &os = freeblock_bitmap.stashes[freeblock_bitmap.steal_order[cpu][i]];
 
-    if (freeblock_bitmap.freelists[fcpu].bit_freelist.empty())
+    if (!os.nfree)
       continue;
 
-    auto list_lock = freeblock_bitmap.freelists[fcpu].list_lock.guard();
-
-    if (!freeblock_bitmap.freelists[fcpu].bit_freelist.empty()) {
-      auto it = freeblock_bitmap.freelists[fcpu].bit_freelist.begin();
-      assert(it->is_free);
-      it->is_free = false;
-      bno = it->bno_;
-      freeblock_bitmap.freelists[fcpu].bit_freelist.erase(it);
+    auto stash_lock = os.lock.guard();
+    if (freeblock_bitmap.stash_pop(os, &bno))
       return bno;
-    }
   }
 
   panic("alloc_block(): Out of blocks on CPU %d\n", cpu);
@@ -2560,65 +4361,81 @@ try_neighbor:
   return sb.size; // out of blocks
 }
 
+// Allocate a contiguous extent of upto n blocks from this CPU's pool,
+// preferably starting at block goal (or else after it), and return its first
+// block. *len is set to the length of the extent, which may be shorter than n
+// if no long enough run of free blocks turns up nearby.
+u32
+mfs_interface::alloc_extent(u32 n, u32 goal, u32 *len)
+{
+  int cpu = myhome();
+  auto &p = freeblock_bitmap.pools[cpu];
+  u32 pool_start = p.first_word * 64;
+  u32 start;
+
+  assert(n > 0);
+  if (p.nfree) {
+    auto pool_lock = p.lock.guard();
+    u32 from = (goal && freeblock_bitmap.owner(goal) == cpu) ? goal : pool_start;
+    if (freeblock_bitmap.find_run(p, from, n, &start, len) ||
+        (from != pool_start &&
+         freeblock_bitmap.find_run(p, pool_start, n, &start, len))) {
+      freeblock_bitmap.take_run(p, start, *len);
+      return start;
+    }
+  }
+
+  *len = 1;
+  return alloc_block();
+}
+
 // Mark a block as free in the freeblock_bitmap.
 void
 mfs_interface::free_block(u32 bno)
 {
-  // Use the vector representation of the free-bits to free the block in
-  // O(1) time (by optimizing the blocknumber-to-free_bit lookup).
-  free_bit *bit = freeblock_bitmap.bit_vector.at(bno);
-
-  int cpu = bit->cpu;
-  if (cpu < NCPU) {
-    auto list_lock = freeblock_bitmap.freelists[cpu].list_lock.guard();
-    assert(!bit->is_free);
-    bit->is_free = true;
-    freeblock_bitmap.freelists[cpu].bit_freelist.push_back(bit);
-  } else {
-    // This block belongs to the global reserve pool.
-    auto list_lock = freeblock_bitmap.reserve_freelist.list_lock.guard();
-    assert(!bit->is_free);
-    bit->is_free = true;
-    freeblock_bitmap.reserve_freelist.bit_freelist.push_back(bit);
+  assert(bno < freeblock_bitmap.nblocks);
+  int cpu = myhome();
+  int owner = freeblock_bitmap.owner(bno);
+
+  // A block of another pool goes into this CPU's stash, to be reused here
+  // without touching the owner's lock; it only goes back to its owner when
+  // the stash is full.
+  if (owner != cpu) {
+    auto &s = freeblock_bitmap.stashes[cpu];
+    auto stash_lock = s.lock.guard();
+    if (freeblock_bitmap.stash_push(s, bno))
+      return;
   }
+
+  auto &p = freeblock_bitmap.pool_of(owner);
+  auto pool_lock = p.lock.guard();
+  freeblock_bitmap.free_to(p, bno);
 }
 
 void
 mfs_interface::print_free_blocks(print_stream *s)
 {
-  percpu<u32> count;
-  u32 total_count = 0, reserve_pool_count = 0;
+  u32 total_count = 0;
 
+  // The counts are read without the pool locks, since they are approximate
+  // (like a snapshot) anyway.
   for (int cpu = 0; cpu < NCPU; cpu++)
-    count[cpu] = 0;
-
-  // Traversing the bit_freelist would be faster because they contain only blocks
-  // that are actually free. However, to do that we would have to acquire the
-  // list_lock, which would prevent concurrent allocations and frees. So go through
-  // the bit_vector instead.
-
-  for (auto &b : freeblock_bitmap.bit_vector) {
-    if (b->is_free) {
-      // No need to re-confirm that it is free with the lock held, since this
-      // count is approximate (like a snapshot) anyway.
-      if (b->cpu < NCPU)
-        count[b->cpu]++;
-      else
-        reserve_pool_count++;
-      total_count++;
-    }
-  }
+    total_count += freeblock_bitmap.pools[cpu].nfree +
+                   freeblock_bitmap.stashes[cpu].nfree;
+  total_count += freeblock_bitmap.reserve.nfree;
 
   s->println();
   s->print("Total num free blocks: ", total_count);
-  s->print(" / ", freeblock_bitmap.bit_vector.size());
+  s->print(" / ", freeblock_bitmap.nblocks);
   s->println();
   for (int cpu = 0; cpu < NCPU; cpu++) {
-    s->print("Num free blocks (CPU ", cpu, "): ", count[cpu]);
+    s->print("Num free blocks (CPU ", cpu, "): ",
+             freeblock_bitmap.pools[cpu].nfree);
+    s->print(" + ", freeblock_bitmap.stashes[cpu].nfree, " stashed");
     s->println();
   }
   s->println();
-  s->print("Num free blocks (Reserve Pool): ", reserve_pool_count);
+  s->print("Num free blocks (Reserve Pool): ", freeblock_bitmap.reserve.nfree);
   s->println();
 }
 
@@ -2647,49 +4464,114 @@ blkstatsread(mdev*, char *dst, u32 off, u32 n)
   return s.get_used();
 }
 
-void
-mfs_interface::reclaim_unreachable_inodes()
+mount_phase_stats mount_stats[NMOUNT_PHASES];
+
+static int
+mountstatsread(mdev*, char *dst, u32 off, u32 n)
 {
-#if 0 // Resurrect this after rewriting the recovery code.
-  int cpu = myid();
-  bool do_flush = false;
+  static const char *names[NMOUNT_PHASES] = {
+    "recover", "recover_journal", "replay", "freeinum", "freeblock", "locks",
+    "orphans", "load_root",
+  };
+  window_stream s(dst, off, n);
+  for (int p = 0; p < NMOUNT_PHASES; p++)
+    s.println(names[p], ": ", mount_stats[p].cycles, " cycles ",
+              mount_stats[p].blocks_read, " blocks read ",
+              mount_stats[p].objects, " objects");
+  return s.get_used();
+}
 
+// The root file system's format flags (SB_* in fs.h), in decimal, so that
+// programs can tell which of the features that need mkfs options they can
+// expect to work.
+static int
+fsflagsread(mdev*, char *dst, u32 off, u32 n)
+{
   superblock sb;
   get_superblock(&sb);
+  window_stream s(dst, off, n);
+  s.println(sb.flags);
+  return s.get_used();
+}
 
-  for (u32 inum = 0; inum < sb.ninodes; inum += IPB) {
-    sref<buf> bp = buf::get(1, IBLOCK(inum));
-    auto copy = bp->read();
+// Read the orphan table left on the disk by the last mount (and by crash
+// recovery), before the file system is in use.
+void
+mfs_interface::load_orphan_table()
+{
+  sref<buf> bp = buf::get(1, ORPHAN_BLOCK);
+  auto copy = bp->read();
+  const u32 *slots = (const u32 *)(copy->data + ORPHAN_OFFSET);
+
+  static_assert(sizeof(superblock) <= ORPHAN_OFFSET,
+                "The orphan table must not overlap the superblock");
+  for (u32 slot = NORPHANS; slot-- > 0; ) {
+    if (!slots[slot]) {
+      free_orphan_slots.push_back(slot);
+      continue;
+    }
+    assert(orphan_slots->insert(slots[slot], slot));
+    mount_orphans.push_back(slots[slot]);
+  }
+}
 
-    int ninums = std::min((u32)IPB, sb.ninodes - inum);
+static void
+orphan_reclaimer(void *arg)
+{
+  rootfs_interface->reclaim_orphans();
+}
 
-    for (int i = 0; i < ninums; i++) {
-      const dinode *dip = (const struct dinode*)copy->data + (inum + i)%IPB;
+// If the last link to an on-disk file or directory is removed (unlinked) but
+// userspace still holds open file descriptors to it at the time of fsync, its
+// inode cannot be deleted from the disk at the time of fsync, but must be
+// postponed until reboot. Such inodes are listed in the orphan table, and the
+// ones found at mount are reclaimed here one at a time, in the background,
+// while the file system is already in use. They are unreachable, so nothing
+// else can get to them in the meantime.
+//
+// A new file that is fsynced without its parent directory is not listed (see
+// iupdate()); if we crash before the parent is flushed, its inode leaks.
+void
+mfs_interface::reclaim_orphans()
+{
+  int cpu = myid();
 
-      if (dip->nlink != 0)
-        continue;
+  for (auto inum : mount_orphans) {
+    scoped_gc_epoch e;
+    transaction *tr = new transaction();
+    sref<inode> ip = iget(1, inum);
 
-      u32 dead_inum = inum + i;
-      sref<inode> dead_ip = iget(1, dead_inum);
+    // Lock ordering rule: Acquire all inode-block locks before performing any
+    // ilock().
+    std::vector<u64> inum_list;
+    inum_list.push_back(inum);
+    acquire_inodebitmap_locks(inum_list, INODE_BLOCK, tr);
 
-      transaction *tr = new transaction();
-      ilock(dead_ip, WRITELOCK);
-      itrunc(dead_ip, 0, tr);
-      iunlock(dead_ip);
+    ilock(ip, WRITELOCK);
+    bool orphan = ip->type && !ip->nlink();
+    if (orphan)
+      itrunc(ip, 0, tr);
+    iunlock(ip);
 
-      // TODO: This works fine when deleting files or empty directories, but we
-      // will have to do a recursive unlink/delete when dealing with unreachable
-      // non-empty directories.
-      free_inode(dead_ip, tr);
+    // TODO: This works fine when deleting files or empty directories, but we
+    // will have to do a recursive unlink/delete when dealing with unreachable
+    // non-empty directories.
+    if (orphan)
+      free_inode(ip, tr);
+    else
+      tr->note_orphan(inum, false); // A stale entry; just drop it.
 
-      add_transaction_to_queue(tr, cpu);
-      do_flush = true;
-    }
+    auto guard = fs_journal[cpu]->commitq_insert_lock.guard();
+    add_transaction_to_queue(tr, cpu);
   }
 
-  if (do_flush)
+  if (!mount_orphans.empty()) {
+    if (VERBOSE)
+      cprintf("reclaim_orphans: reclaimed %lu orphan inodes\n",
+              mount_orphans.size());
     flush_transaction_queue(cpu, true);
-#endif
+  }
+  mount_orphans.clear();
 }
 
 // Allocates a lock for every inode block and every bitmap block.
@@ -2700,14 +4582,29 @@ mfs_interface::alloc_inodebitmap_locks()
   get_superblock(&sb);
 
   // The superblock is immediately followed by the inode blocks, which in turn
-  // are immediately followed by the bitmap blocks. So we allocate locks for
-  // block numbers 0 through the last bitmap block (inclusive).
-  int last_blocknum = BBLOCK(sb.size - 1, sb.ninodes);
-
-  inodebitmap_locks.reserve(last_blocknum + 1);
+  // are immediately followed by the bitmap blocks. So there are locks for
+  // block numbers 0 through the last bitmap block (inclusive). Only the table
+  // is allocated here; each lock is created the first time it is taken (see
+  // inodebitmap_lock()), since most inode blocks never are.
+  ninodebitmap_locks = BBLOCK(sb.size - 1, sb.ninodes) + 1;
+  inodebitmap_locks = new std::atomic<sleeplock*>[ninodebitmap_locks]();
+}
 
-  for (int i = 0; i <= last_blocknum; i++)
-    inodebitmap_locks.push_back(new sleeplock());
+// Return the lock of inode-block or bitmap-block blknum, creating it if this
+// is the first time anyone needs it.
+sleeplock *
+mfs_interface::inodebitmap_lock(u32 blknum)
+{
+  assert(blknum < ninodebitmap_locks);
+  sleeplock *sl = inodebitmap_locks[blknum].load();
+  if (sl)
+    return sl;
+
+  sleeplock *nsl = new sleeplock();
+  if (cmpxch(&inodebitmap_locks[blknum], (sleeplock*)nullptr, nsl))
+    return nsl;
+  delete nsl;  // Somebody else got there first.
+  return inodebitmap_locks[blknum].load();
 }
 
 // Acquire a set of inode-block or bitmap-block locks in the context of the
@@ -2767,7 +4664,7 @@ mfs_interface::acquire_inodebitmap_locks(std::vector<u64> &num_list, int type,
   // block numbers.
   std::sort(block_numbers.begin(), block_numbers.end());
   for (auto &blknum : block_numbers) {
-    sleeplock *sl = inodebitmap_locks.at(blknum);
+    sleeplock *sl = inodebitmap_lock(blknum);
     sl->acquire();
     tr->inodebitmap_locks.push_back(sl);
     tr->inodebitmap_blk_list.push_back(blknum);
@@ -2788,43 +4685,33 @@ mfs_interface::release_inodebitmap_locks(transaction *tr)
 void
 recover_scalefs()
 {
+  mount_phase_timer t(MOUNT_RECOVER);
   root_fs = new mfs();
   anon_fs = new mfs();
   rootfs_interface = new mfs_interface();
 
   // Check all the journals and reapply committed transactions
-  std::vector<transaction*> txns_to_apply;
+  std::vector<transaction*> txns_to_apply[NCPU];
   for (int cpu = 0; cpu < NCPU; cpu++)
-    rootfs_interface->recover_journal(cpu, txns_to_apply);
-
-  if (!txns_to_apply.empty()) {
-    std::sort(txns_to_apply.begin(), txns_to_apply.end(),
-              journal::compare_txn_tsc);
-
-    for (auto &tr : txns_to_apply) {
-      cprintf("recover_scalefs: applying transaction with commit timestamp %lu\n",
-              tr->commit_tsc);
-      tr->write_to_disk_update_bufcache();
-      delete tr;
+    rootfs_interface->open_journal(cpu);
+  {
+    mount_phase_timer tj(MOUNT_RECOVER_JOURNAL);
+    for (int cpu = 0; cpu < NCPU; cpu++)
+      rootfs_interface->recover_journal(cpu, txns_to_apply[cpu]);
+    for (int cpu = 0; cpu < NCPU; cpu++) {
+      t.add_objects(txns_to_apply[cpu].size());
+      tj.add_objects(txns_to_apply[cpu].size());
     }
-
-    txns_to_apply.clear();
+  }
+  {
+    mount_phase_timer tr(MOUNT_REPLAY);
+    tr.add_objects(
+      rootfs_interface->apply_recovered_transactions(txns_to_apply));
   }
 
+  rootfs_interface->init_journal_pool();
   for (int cpu = 0; cpu < NCPU; cpu++)
     rootfs_interface->init_journal(cpu);
-
-  // If a newly created file (or directory) is fsynced, but its link in the
-  // parent is not flushed (by fsyncing the parent directory), the file is
-  // potentially unreachable on the disk. If we indeed crash without fsyncing
-  // the parent directory, the file (or child directory) must be deleted/
-  // reclaimed during crash-recovery upon reboot. A similar situation arises
-  // if the last link to an on-disk file or directory is removed (unlinked)
-  // but userspace still holds open file descriptors to it at the time of
-  // fsync; in that case, its inode cannot be deleted from the disk at the
-  // time of fsync, but must be postponed until reboot. We reclaim such
-  // dead/unreachable inodes here during reboot.
-  rootfs_interface->reclaim_unreachable_inodes();
 }
 
 void
@@ -2833,13 +4720,40 @@ init_scalefs()
   // Initialize the free-bit-vector *after* processing the journal,
   // because those transactions could include updates to the free
   // bitmap blocks too!
-  rootfs_interface->initialize_freeblock_bitmap();
-
-  rootfs_interface->alloc_inodebitmap_locks();
+  {
+    mount_phase_timer t(MOUNT_FREEBLOCK);
+    rootfs_interface->initialize_freeblock_bitmap();
+  }
+  {
+    mount_phase_timer t(MOUNT_LOCKS);
+    rootfs_interface->alloc_inodebitmap_locks();
+  }
+  {
+    mount_phase_timer t(MOUNT_ORPHANS);
+    rootfs_interface->load_orphan_table();
+  }
 
   devsw[MAJ_BLKSTATS].pread = blkstatsread;
+  devsw[MAJ_MOUNTSTATS].pread = mountstatsread;
+  devsw[MAJ_FSFLAGS].pread = fsflagsread;
+  devsw[MAJ_TXQSTATS].pread = txqstatsread;
   devsw[MAJ_EVICTCACHES].write = evict_caches;
 
-  root_mnum = rootfs_interface->load_root()->mnum_;
+  for (int c = 0; c < ncpu; c++) {
+    char namebuf[32];
+    snprintf(namebuf, sizeof(namebuf), "jflush_%u", c);
+    threadpin(journal_flusher, (void *)(uptr)c, namebuf, c);
+  }
+
+  rootfs_interface->init_discards();
+  init_reclaim();
+  init_readahead();
+  init_writeback();
+  threadpin(orphan_reclaimer, nullptr, "orphanrec", 0);
+
+  {
+    mount_phase_timer t(MOUNT_LOAD_ROOT);
+    root_mnum = rootfs_interface->load_root()->mnum_;
+  }
   /* the root mnode gets an extra reference because of its own ".." */
 }
@@ -11,15 +11,15 @@
 #include "vm.hh"
 #include "major.h"
 #include "rnd.hh"
-#include "lb.hh"
 #include "work.hh"
 #include "ilist.hh"
 #include "kstream.hh"
 #include "file.hh"
+#include "apic.hh"
 
 enum { sched_debug = 0 };
 
-struct schedule : public balance_pool<schedule> {
+struct schedule {
 public:
   schedule(int id);
   ~schedule() {};
@@ -31,99 +31,150 @@ public:
   proc* deq();
   void dump(print_stream *);
 
-  void enq_dwork(dwork *w);
+  bool enq_dwork(dwork *w);
   void try_dwork();
+  void halt();
 
-  void balance_move_to(schedule *other);
-  u64 balance_count() const;
+  bool steal_to(schedule *target, bool remote);
 
   sched_stat stats_;
   u64 ncansteal_;
 private:
   void sanity(void);
+  bool push(proc *p);
+  proc* take(bool thief);
+  proc* take_locked();
 
   struct spinlock lock_ __mpalign__;
+  // Procs queued by other cores (wakeups, and procs moving here), and
+  // the overflow of the deque below.
   ilist<proc, &proc::sched_link> proc_;
-  isqueue<dwork, &dwork::link_> work_;
   volatile bool cansteal_ __mpalign__;
+
+  // Deferred work, pushed by any core onto a lock-free stack and taken
+  // all at once by this core.  idle_ is set while this core is halted
+  // (or about to be) in halt().
+  std::atomic<dwork*> work_ __mpalign__;
+  std::atomic<bool> idle_;
+
+  // Procs this core queued itself.  Only this core pushes, at
+  // bottom_, with interrupts disabled; this core and thieves take
+  // from top_ by CAS, so procs run in FIFO order.  The low bit of a
+  // slot marks a proc that could be stolen when it was queued.
+  std::atomic<u64> top_ __mpalign__;
+  std::atomic<u64> bottom_ __mpalign__;
+  std::atomic<uintptr_t> slots_[SCHED_DEQUE_SIZE];
   __padout__;
 };
 
+static_assert((SCHED_DEQUE_SIZE & (SCHED_DEQUE_SIZE - 1)) == 0,
+              "SCHED_DEQUE_SIZE must be a power of two");
+
 schedule::schedule(int id)
-  : balance_pool(1), id_(id), lock_("schedule::lock_", LOCKSTAT_SCHED)
+  : id_(id), lock_("schedule::lock_", LOCKSTAT_SCHED), work_(nullptr),
+    idle_(false), top_(0), bottom_(0)
 {
   ncansteal_ = 0;
-  stats_.enqs = 0;
-  stats_.deqs = 0;
-  stats_.steals = 0;
-  stats_.misses = 0;
-  stats_.idle = 0;
-  stats_.busy = 0;
-  stats_.schedstart = 0;
+  cansteal_ = false;
+  memset(&stats_, 0, sizeof(stats_));
 }
 
-u64 
-schedule::balance_count() const {
-  // 1 if the number of processes that in runnable state and have
-  // run long enough that they could be stolen is bigger than 1?
-  // XXX length of queue?
-  //
-  // XXX reading ncansteal could be expensive, but local core updates
-  // it and remote core reads it, experiencing a cache-line transfer
-  return cansteal_ > 0 ? 1 : 0;
+bool
+schedule::push(proc *p)
+{
+  u64 b = bottom_.load(std::memory_order_relaxed);
+  // A stale top_ is smaller, so this only errs towards full.
+  if (b - top_.load(std::memory_order_acquire) >= SCHED_DEQUE_SIZE)
+    return false;
+  slots_[b % SCHED_DEQUE_SIZE].store((uintptr_t)p | p->cansteal(true),
+                                     std::memory_order_relaxed);
+  bottom_.store(b + 1, std::memory_order_release);
+  return true;
 }
 
-void 
-schedule::balance_move_to(schedule* target)
+proc*
+schedule::take(bool thief)
 {
-  proc *victim = nullptr;
+  for (;;) {
+    u64 t = top_.load(std::memory_order_acquire);
+    if (t >= bottom_.load(std::memory_order_acquire))
+      return nullptr;
+    // The proc may already have been taken and be running (or gone)
+    // elsewhere, so don't look at it until the CAS wins.
+    uintptr_t e = slots_[t % SCHED_DEQUE_SIZE].load(std::memory_order_relaxed);
+    if (thief && !(e & 1))
+      return nullptr;
+    if (top_.compare_exchange_strong(t, t + 1))
+      return (proc*)(e & ~(uintptr_t)1);
+    if (thief)
+      return nullptr;
+  }
+}
 
+// Take the first stealable proc queued by other cores.
+proc*
+schedule::take_locked()
+{
   if (!cansteal_ || !tryacquire(&lock_))
-    return;
+    return nullptr;
 
+  proc *victim = nullptr;
   for (auto it = proc_.begin(); it != proc_.end(); ++it) {
     if ((*it).cansteal(true)) {
+      victim = &(*it);
       proc_.erase(it);
       if (--ncansteal_ == 0)
         cansteal_ = false;
       sanity();
-      victim = &(*it);
+      break;
     }
   }
   release(&lock_);
-  if (!victim) {
-    ++stats_.misses;
-    return;
-  }
+  return victim;
+}
+
+// Move a runnable proc from this core to target, which is the calling
+// core.  remote says whether the two are on different NUMA nodes.
+bool
+schedule::steal_to(schedule* target, bool remote)
+{
+  proc *victim = take(true);
+  if (!victim)
+    victim = take_locked();
+  if (!victim)
+    return false;
 
   acquire(&victim->lock);
-  if (victim->get_state() == RUNNABLE && !victim->cpu_pin &&
-      victim->curcycles != 0 && victim->curcycles > VICTIMAGE)
-  {
+  if (victim->get_state() == RUNNABLE && !victim->cpu_pin) {
     victim->curcycles = 0;
-    victim->cpuid = mycpu()->id;
+    victim->cpuid = target->id_;
+    if (!victim->home_set_)
+      victim->home_cpu = -1;
     target->enq(victim);
     release(&victim->lock);
-    //cprintf("%d: stole %s from %d\n", mycpu()->id, victim->name, id_);
-    ++stats_.steals;
-    return;
-  }
-  ++stats_.misses;
-  cprintf("%d: don't steal %s---hasn't run long enough\n", 
-          mycpu()->id, victim->name);
-#if 0
-  // XXX why is this code here?  you should only steal a runnable process
-  // it has run for a while on the cpu, or not all.
-  if (victim->get_state() == RUNNABLE) {
-    target->enq(victim);
+    ++target->stats_.steals;
+    if (remote)
+      ++target->stats_.remote_steals;
+    return true;
   }
-#endif
+  // It got pinned since it was queued; give it back.
+  enq(victim);
   release(&victim->lock);
+  ++target->stats_.misses;
+  return false;
 }
 
 void
 schedule::enq(proc* p)
 {
+  if (p->cpuid == id_) {
+    scoped_cli cli;
+    if (mycpu()->id == id_ && push(p)) {
+      stats_.enqs++;
+      return;
+    }
+  }
+
   scoped_acquire x(&lock_);
   proc_.push_back(p);
   if (p->cansteal(true))
@@ -131,32 +182,40 @@ schedule::enq(proc* p)
       cansteal_ = true;
     }
   sanity();
-  stats_.enqs++;
+  stats_.remote_enqs++;
 }
 
 proc*
 schedule::deq(void)
 {   
-  if (proc_.empty())
-    return nullptr;
-  // Remove from head
-  scoped_acquire x(&lock_);
-  if (proc_.empty()) 
-    return nullptr;
-  proc &p = proc_.front();
-  proc_.pop_front();
-  if (p.cansteal(true))
-    if (--ncansteal_ == 0)
-      cansteal_ = false;
-  sanity();
-  stats_.deqs++;
-  return &p;
+  // Procs queued by other cores first, so a core busy with its own
+  // procs can't starve them.
+  if (!proc_.empty()) {
+    scoped_acquire x(&lock_);
+    if (!proc_.empty()) {
+      proc &p = proc_.front();
+      proc_.pop_front();
+      if (p.cansteal(true))
+        if (--ncansteal_ == 0)
+          cansteal_ = false;
+      sanity();
+      stats_.deqs++;
+      return &p;
+    }
+  }
+  proc *p = take(false);
+  if (p)
+    stats_.deqs++;
+  return p;
 }
 
 void
 schedule::dump(print_stream *s)
 {
-  s->print(" enq ", stats_.enqs, " deqs ", stats_.deqs, " steals ", stats_.steals, " misses ", stats_.misses);
+  s->print(" enq ", stats_.enqs, " remote enqs ", stats_.remote_enqs,
+           " deqs ", stats_.deqs, " steals ", stats_.steals,
+           " remote steals ", stats_.remote_steals,
+           " misses ", stats_.misses, " failed steals ", stats_.steal_fails);
 }
 
 void
@@ -174,32 +233,60 @@ schedule::sanity(void)
 #endif
 }
 
-void
+// Queue w to run on this core.  Returns true if this core is halted
+// and needs a wakeup to get to it.
+bool
 schedule::enq_dwork(dwork *w)
 {
-  scoped_acquire x(&lock_);
-  work_.push_back(w);
+  w->next_ = work_.load(std::memory_order_relaxed);
+  while (!work_.compare_exchange_weak(w->next_, w))
+    ;
+  return idle_.exchange(false);
 }
 
 void
 schedule::try_dwork(void)
 {
-  auto l = lock_.guard();
-  while (!work_.empty()) {
-    auto &w = work_.front();
-    work_.pop_front();
-    l.release();
-    w.run();
-    l = lock_.guard();
+  while (work_.load(std::memory_order_relaxed)) {
+    // Take the whole batch and run it in the order it was pushed.
+    dwork *batch = work_.exchange(nullptr), *fifo = nullptr;
+    while (batch) {
+      dwork *next = batch->next_;
+      batch->next_ = fifo;
+      fifo = batch;
+      batch = next;
+    }
+    while (fifo) {
+      // run() may free the dwork.
+      dwork *next = fifo->next_;
+      fifo->run();
+      fifo = next;
+    }
   }
 }
 
+// Halt this (idle) core until an interrupt, unless deferred work is
+// already waiting, and then run the deferred work.
+void
+schedule::halt(void)
+{
+  cli();
+  idle_ = true;
+  if (!work_.load())
+    // sti only takes effect after the next instruction, so a wakeup
+    // IPI can't slip in between the check and hlt.
+    asm volatile("sti; hlt");
+  else
+    sti();
+  idle_ = false;
+  try_dwork();
+}
+
 struct sched_dir {
 private:
-  balancer<sched_dir, schedule> b_;
   percpu<schedule*> schedule_;
 public:
-  sched_dir() : b_(this) {
+  sched_dir() {
     for (int i = 0; i < NCPU; i++) {
       schedule_[i] = new schedule(i);
     }
@@ -207,16 +294,26 @@ public:
   ~sched_dir() {};
   NEW_DELETE_OPS(sched_dir);
 
-  schedule* balance_get(int id) const {
-    return schedule_[id];
-  }
-
-  void steal() {
+  // Steal a runnable proc for this core, trying the cores of its NUMA
+  // node before the others, each time starting with the next core
+  // over.  Returns whether it found one.
+  bool steal() {
     if (!SCHED_LOAD_BALANCE)
-      return;
-    pushcli();
-    b_.balance();
-    popcli();
+      return false;
+    scoped_cli cli;
+    int me = mycpu()->id;
+    schedule *target = schedule_[me];
+    for (int remote = 0; remote < 2; remote++) {
+      for (int i = 1; i < ncpu; i++) {
+        int c = (me + i) % ncpu;
+        if ((cpus[c].node != cpus[me].node) != remote)
+          continue;
+        if (schedule_[c]->steal_to(target, remote))
+          return true;
+      }
+    }
+    ++target->stats_.steal_fails;
+    return false;
   }
 
   void addrun(struct proc* p) {
@@ -225,7 +322,12 @@ public:
   }
 
   void pushwork(struct dwork *w, int cpu) {
-    schedule_[cpu]->enq_dwork(w);
+    if (schedule_[cpu]->enq_dwork(w) && cpu != myid())
+      lapic->send_wake(&cpus[cpu]);
+  }
+
+  void halt() {
+    schedule_[mycpu()->id]->halt();
   }
 
   void trywork() {
@@ -370,11 +472,16 @@ statread(mdev* m, char *dst, u32 off, u32 n)
   return s.get_used();
 }
 
+void
+idle_halt(void)
+{
+  thesched_dir.halt();
+}
+
 int
 steal(void)
 {
-  thesched_dir.steal();
-  return 0;
+  return thesched_dir.steal();
 }
 
 void
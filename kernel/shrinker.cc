@@ -0,0 +1,129 @@
+// Memory-pressure shrinkers and the per-core reclaimers that run them.
+
+#include "types.h"
+#include "kernel.hh"
+#include "spinlock.hh"
+#include "condvar.hh"
+#include "percpu.hh"
+#include "kstream.hh"
+#include "shrinker.hh"
+#include "refcache.hh"
+
+#include <atomic>
+
+namespace {
+  // Registered shrinkers.  Shrinkers are only ever added, so the
+  // reclaimers walk the list without a lock.
+  std::atomic<shrinker*> shrinkers;
+
+  struct reclaimer_state {
+    spinlock lock;
+    condvar cv;
+    std::atomic<bool> kicked;
+  };
+
+  percpu<reclaimer_state> reclaimers;
+
+  bool reclaim_started;
+}
+
+shrinker::shrinker(const char *name)
+  : name_(name), next_(nullptr), nscanned_(0), nfreed_(0)
+{
+  next_ = shrinkers.load(std::memory_order_relaxed);
+  while (!shrinkers.compare_exchange_weak(next_, this))
+    ;
+}
+
+void
+kick_reclaim(int cpu)
+{
+  if (!RECLAIM_LOW_PCT || !reclaim_started)
+    return;
+  auto &r = reclaimers[cpu];
+  if (r.kicked.exchange(true))
+    return;
+  auto l = r.lock.guard();
+  r.cv.wake_all();
+}
+
+// Ask every shrinker to scan for CPU cpu, a round at a time, until
+// the memory local to cpu is back above RECLAIM_HIGH_PCT percent free
+// or a round frees nothing.
+void
+reclaim_run(int cpu)
+{
+  while (kfree_percent(cpu) < RECLAIM_HIGH_PCT) {
+    size_t freed = 0;
+    for (shrinker *s = shrinkers.load(); s; s = s->next_) {
+      if (!s->count(cpu))
+        continue;
+      size_t n = s->scan(cpu, RECLAIM_BATCH);
+      s->nscanned_++;
+      s->nfreed_ += n;
+      freed += n;
+    }
+    if (!freed)
+      break;
+    // Much of what the shrinkers dropped is only freed once refcache
+    // notices, so get that done before checking free memory again.
+    refcache::expedite();
+  }
+}
+
+// Give every shrinker its housekeeping call for CPU cpu.
+void
+reclaim_idle(int cpu)
+{
+  for (shrinker *s = shrinkers.load(); s; s = s->next_)
+    s->idle(cpu);
+}
+
+// The reclaimer of CPU cpu.
+static void
+reclaimer(void *arg)
+{
+  int cpu = (uptr)arg;
+  auto &r = reclaimers[cpu];
+
+  for (;;) {
+    {
+      auto l = r.lock.guard();
+      u64 deadline = nsectime() + (u64)RECLAIM_INTERVAL_MS * 1000000ull;
+      while (!r.kicked && nsectime() < deadline)
+        r.cv.sleep_to(&r.lock, deadline);
+      r.kicked = false;
+    }
+
+    if (kfree_percent(cpu) < RECLAIM_LOW_PCT) {
+      reclaim_run(cpu);
+    } else {
+      reclaim_idle(cpu);
+    }
+  }
+}
+
+void
+init_reclaim(void)
+{
+  if (!RECLAIM_LOW_PCT)
+    return;
+
+  for (int c = 0; c < ncpu; c++) {
+    char namebuf[32];
+    snprintf(namebuf, sizeof(namebuf), "reclaim_%u", c);
+    threadpin(reclaimer, (void *)(uptr)c, namebuf, c);
+  }
+  reclaim_started = true;
+}
+
+void
+shrinker_print(print_stream *s)
+{
+  // Shrinkers of shared caches count everything for every core, so
+  // report what the current core sees.
+  int cpu = myid();
+  for (shrinker *sh = shrinkers.load(); sh; sh = sh->next_)
+    s->println("shrinker ", sh->name_, ": count ", sh->count(cpu), " scans ",
+               sh->nscanned_, " freed ", sh->nfreed_);
+}
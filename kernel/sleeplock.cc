@@ -0,0 +1,147 @@
+// Adaptive sleeping locks.
+
+#include "types.h"
+#include "kernel.hh"
+#include "amd64.h"
+#include "cpu.hh"
+#include "proc.hh"
+#include "sleeplock.hh"
+
+void
+sleeplock::acquire_slow()
+{
+  bool spun = false, slept = false;
+  u64 locking_ts = lockstat_ts();
+  u64 prof_start = lockprof_on() ? rdtsc() : 0;
+
+  // Spin while the holder is running on its CPU.  This only compares
+  // pointers, so it's fine if the holder has since gone away.
+  for (u64 n = 0; n < SLEEPLOCK_SPIN_MAX; n++) {
+    if (try_lock()) {
+      spun = true;
+      goto acquired;
+    }
+    struct proc *o = owner_.load(std::memory_order_relaxed);
+    int c = owner_cpu_.load(std::memory_order_relaxed);
+    if (o == nullptr || o == myproc() || cpus[c].proc != o)
+      break;
+    nop_pause();
+  }
+
+  {
+    scoped_acquire x(&spinlock_);
+    nwaiters_++;
+    auto cleanup = scoped_cleanup([this]() { nwaiters_--; });
+    while (!try_lock()) {
+      slept = true;
+      // The wait is charged to our caller, not to this condvar wait
+      cv_.sleep_at(&spinlock_, 0, nullptr, 0);
+    }
+  }
+
+acquired:
+  set_owner();
+  if (prof_start)
+    prof_acquired(rdtsc() - prof_start, (uptr)__builtin_return_address(0));
+  else if (lockprof_on())
+    prof_acquired(0, 0);
+  lockstat_acquired(locking_ts, spun, slept);
+}
+
+// Count an acquisition of the lock in the lock profile, which waited for
+// wait cycles at site if it was contended.
+void
+sleeplock::prof_acquired(u64 wait, uptr site)
+{
+  if (!name_)
+    return;
+  u64 contended = site ? 1 : 0;
+  lockprof_record(LOCKPROF_SLEEPLOCK, name_, 0, 1, contended, wait, 0);
+  if (site)
+    lockprof_record(LOCKPROF_SLEEPLOCK, name_, site, 1, 1, wait, 0);
+  prof_ts_ = rdtsc();
+}
+
+void
+sleeplock::prof_released()
+{
+  lockprof_record(LOCKPROF_SLEEPLOCK, name_, 0, 0, 0, 0, rdtsc() - prof_ts_);
+  prof_ts_ = 0;
+}
+
+sleeplock::sleeplock(sleeplock &&o)
+  : spinlock_(std::move(o.spinlock_)), cv_(std::move(o.cv_)),
+    held_(o.held_.load()), nwaiters_(0), owner_(nullptr), owner_cpu_(0),
+    name_(o.name_), prof_ts_(0)
+#if LOCKSTAT
+  , stat_(o.stat_), locked_ts_(0)
+#endif
+{
+  assert(o.nwaiters_ == 0);
+#if LOCKSTAT
+  o.stat_ = nullptr;
+#endif
+}
+
+sleeplock &
+sleeplock::operator=(sleeplock &&o)
+{
+  assert(nwaiters_ == 0 && o.nwaiters_ == 0);
+  spinlock_ = std::move(o.spinlock_);
+  cv_ = std::move(o.cv_);
+  held_ = o.held_.load();
+  owner_ = nullptr;
+  name_ = o.name_;
+  prof_ts_ = 0;
+#if LOCKSTAT
+  lockstat_stop(&stat_);
+  stat_ = o.stat_;
+  o.stat_ = nullptr;
+#endif
+  return *this;
+}
+
+#if LOCKSTAT
+sleeplock::~sleeplock()
+{
+  lockstat_stop(&stat_);
+}
+
+u64
+sleeplock::lockstat_ts()
+{
+  return stat_ && lockstat_enable ? rdtsc() : 0;
+}
+
+void
+sleeplock::lockstat_acquired(u64 locking_ts, bool spun, bool slept)
+{
+  if (!stat_ || !lockstat_enable)
+    return;
+  if (stat_ == &klockstat_lazy)
+    lockstat_init(&stat_, name_, true);
+
+  struct cpulockstat *s = &stat_->s.cpu[myid()];
+  u64 ts = rdtsc();
+  s->acquires++;
+  if (locking_ts) {
+    s->contends++;
+    s->locking += ts - locking_ts;
+  }
+  if (spun)
+    s->spins++;
+  if (slept)
+    s->sleeps++;
+  locked_ts_ = ts;
+}
+
+void
+sleeplock::lockstat_released()
+{
+  // locked_ts_ is 0 if lockstat was off when we acquired the lock
+  if (!lockstat_enable || stat_ == &klockstat_lazy || !locked_ts_)
+    return;
+  stat_->s.cpu[myid()].locked += rdtsc() - locked_ts_;
+  locked_ts_ = 0;
+}
+#endif
@@ -17,9 +17,7 @@
 // but have never been acquired.
 struct klockstat klockstat_lazy("<lazy>");
 
-static int lockstat_enable;
-
-void lockstat_init(struct spinlock *lk, bool lazy);
+int lockstat_enable;
 
 static inline struct cpulockstat *
 mylockstat(struct spinlock *lk)
@@ -57,7 +55,7 @@ locking(struct spinlock *lk)
 #if LOCKSTAT
   if (lockstat_enable && lk->stat != nullptr) {
     if (lk->stat == &klockstat_lazy)
-      lockstat_init(lk, true);
+      lockstat_init(&lk->stat, lk->name, true);
     mylockstat(lk)->locking_ts = rdtsc();
   }
 #endif
@@ -139,33 +137,33 @@ klockstat::klockstat(const char *name) :
 };
 
 void
-lockstat_init(struct spinlock *lk, bool lazy)
+lockstat_init(struct klockstat **stat, const char *name, bool lazy)
 {
-  klockstat *ls = new klockstat(lk->name);
+  klockstat *ls = new klockstat(name);
   if (!ls)
     return;
 
   if (lazy) {
-    if (!__sync_bool_compare_and_swap(&lk->stat, &klockstat_lazy, ls)) {
+    if (!__sync_bool_compare_and_swap(stat, &klockstat_lazy, ls)) {
       delete ls;
       return;
     }
   } else {
-    lk->stat = ls;
+    *stat = ls;
   }
 
   acquire(&lockstat_lock);
-  lockstat_list.push_front(lk->stat);
+  lockstat_list.push_front(*stat);
   //LIST_INSERT_HEAD(&lockstat_list, lk->stat, link);
   release(&lockstat_lock);
 }
 
-static void
-lockstat_stop(struct spinlock *lk)
+void
+lockstat_stop(struct klockstat **stat)
 {
-  if (lk->stat != nullptr) {
-    lk->stat->magic = 0;
-    lk->stat = nullptr;
+  if (*stat != nullptr) {
+    (*stat)->magic = 0;
+    *stat = nullptr;
   }
 }
 
@@ -302,7 +300,7 @@ spinlock::spinlock(spinlock &&o)
   memcpy(&pcs, &o.pcs, sizeof(pcs));
 #endif
 #if LOCKSTAT
-  lockstat_stop(&o);
+  lockstat_stop(&o.stat);
 #endif
 }
 
@@ -310,7 +308,7 @@ spinlock &
 spinlock::operator=(spinlock &&o)
 {
 #if LOCKSTAT
-  lockstat_stop(this);
+  lockstat_stop(&stat);
 #endif
 
 #if USE_CODEX_IMPL
@@ -335,7 +333,7 @@ spinlock::operator=(spinlock &&o)
 // Conflicts with constexpr
 // spinlock::~spinlock()
 // {
-//   lockstat_stop(this);
+//   lockstat_stop(&stat);
 // }
 #endif
 
@@ -112,10 +112,12 @@ syscall(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4, u64 a5, u64 num)
         u64 r;
         mtstart(syscalls[num], myproc());
         mtrec();
+        myproc()->cur_syscall = num;
         {
           mt_ascope ascope("syscall:%ld", num);
           r = syscalls[num](a0, a1, a2, a3, a4, a5);
         }
+        myproc()->cur_syscall = 0;
         mtstop(myproc());
         mtign();
         return r;
@@ -130,6 +132,7 @@ syscall(u64 a0, u64 a1, u64 a2, u64 a3, u64 a4, u64 a5, u64 num)
       gc_wakeup();
       yield();
     } catch (kill_exception &e) {
+      myproc()->cur_syscall = 0;
       return -1;
     }
 #endif
@@ -13,11 +13,15 @@
 #include "mfs.hh"
 #include <uk/fcntl.h>
 #include <uk/stat.h>
+#include <uk/uio.h>
+#include <uk/io_ring.h>
 #include "kstats.hh"
+#include "lathist.hh"
 #include <vector>
 #include "kstream.hh"
 #include <uk/spawn.h>
 #include "filetable.hh"
+#include "fsperf.hh"
 
 extern struct proc *bootproc;
 
@@ -132,6 +136,7 @@ sys_lseek(int fd, off_t offset, int whence)
 int
 sys_close(int fd)
 {
+  FSPERF_REGION(FSPERF_SYSCALL, "sys_close");
   sref<file> f = getfile(fd);
   if (!f)
     return -1;
@@ -144,8 +149,11 @@ sys_close(int fd)
 void
 sys_sync(void)
 {
-  int cpu = myid();
+  FSPERF_REGION(FSPERF_SYSCALL, "sys_sync");
+  u64 start = rdtsc();
+  int cpu = myhome();
   rootfs_interface->process_metadata_log_and_flush(cpu);
+  lathists::record_since(mylathists->sync, start);
 }
 
 
@@ -179,20 +187,116 @@ sys_sync(void)
 int
 sys_fsync(int fd)
 {
+  FSPERF_REGION(FSPERF_SYSCALL, "sys_fsync");
+  u64 start = rdtsc();
   sref<file> f = getfile(fd);
   if (!f)
     return -1;
-  return f->fsync();
+  int r = f->fsync();
+  lathists::record_since(mylathists->fsync, start);
+  return r;
+}
+
+// Like fsync(), but skips the inode when the file's data can be read back
+// without it: when the dirty pages all went into blocks the file already had,
+// and its size is unchanged.
+//SYSCALL
+int
+sys_fdatasync(int fd)
+{
+  FSPERF_REGION(FSPERF_SYSCALL, "sys_fdatasync");
+  sref<file> f = getfile(fd);
+  if (!f)
+    return -1;
+  return f->fdatasync(0, 0);
+}
+
+// Like fdatasync(), for just the bytes [offset, offset + nbytes) of a file,
+// or to its end if nbytes is 0. Unlike Linux's, this waits for the data to be
+// committed, as fsync() does.
+//SYSCALL
+int
+sys_sync_file_range(int fd, off_t offset, off_t nbytes)
+{
+  FSPERF_REGION(FSPERF_SYSCALL, "sys_sync_file_range");
+  sref<file> f = getfile(fd);
+  if (!f)
+    return -1;
+  return f->fdatasync(offset, nbytes);
+}
+
+// Like fsync(), except that it doesn't wait for the file's changes to be
+// committed to the disk. Stores a commit ticket in *ticket, which can be passed
+// to fsync_wait() to find out when they are.
+//SYSCALL
+int
+sys_fsync_async(int fd, userptr<u64> ticket)
+{
+  sref<file> f = getfile(fd);
+  if (!f)
+    return -1;
+
+  u64 t;
+  if (f->fsync_async(&t) < 0)
+    return -1;
+  if (!ticket.store(&t))
+    return -1;
+  return 0;
+}
+
+// Wait for the changes covered by a ticket from fsync_async() to be committed
+// to the disk. If nonblock is set, just check whether they have been: returns
+// 0 if so, and -1 otherwise.
+//SYSCALL
+int
+sys_fsync_wait(u64 ticket, int nonblock)
+{
+  return rootfs_interface->wait_for_fsync_ticket(ticket, nonblock);
+}
+
+// Reserve disk space for the bytes [offset, offset + len) of a file, so that
+// writing them later needs no block allocation and gets a contiguous layout.
+// The reserved blocks are not zeroed on the disk, but read as zeros until
+// they are written. Unless mode has FALLOC_FL_KEEP_SIZE, the file grows to
+// cover the range. Needs an extent-mapped file system (mkfs -e).
+//SYSCALL
+int
+sys_fallocate(int fd, int mode, off_t offset, off_t len)
+{
+  sref<file> f = getfile(fd);
+  if (!f)
+    return -1;
+  return f->fallocate(mode, offset, len);
+}
+
+// Have a file's data compressed on the disk from now on, or no longer (see
+// SB_COMPRESS in fs.h), or for a directory, the files and directories that
+// are created in it from now on. A file can only change while it is empty.
+// Needs a file system made with mkfs -z.
+//SYSCALL
+int
+sys_setcompress(int fd, int on)
+{
+  sref<file> f = getfile(fd);
+  if (!f)
+    return -1;
+  return f->setcompress(on);
 }
 
 //SYSCALL
 ssize_t
 sys_read(int fd, userptr<void> p, size_t n)
 {
+  FSPERF_REGION(FSPERF_SYSCALL, "sys_read");
   sref<file> f = getfile(fd);
   if (!f)
     return -1;
 
+  // Regular files copy straight from the page cache, whatever the size.
+  ssize_t res;
+  if (f->read_user(p, n, &res))
+    return res;
+
   char *b = kalloc("readbuf");
   if (!b)
     return -1;
@@ -200,7 +304,7 @@ sys_read(int fd, userptr<void> p, size_t n)
   // XXX(Austin) Too bad
   if (n > PGSIZE)
     n = PGSIZE;
-  ssize_t res = f->read(b, n);
+  res = f->read(b, n);
   if (res < 0)
     return -1;
   if (!p.store_bytes(b, res))
@@ -210,20 +314,26 @@ sys_read(int fd, userptr<void> p, size_t n)
 
 //SYSCALL
 ssize_t
-sys_pread(int fd, void *ubuf, size_t count, off_t offset)
+sys_pread(int fd, userptr<void> ubuf, size_t count, off_t offset)
 {
+  FSPERF_REGION(FSPERF_SYSCALL, "sys_pread");
   sref<file> f = getfile(fd);
   if (!f)
     return -1;
 
+  // Regular files copy straight from the page cache, a page at a time.
+  ssize_t r;
+  if (f->pread_user(ubuf, count, offset, &r))
+    return r;
+
   if (count > 4*1024*1024)
     count = 4*1024*1024;
 
   char* b = (char*) kmalloc(count, "preadbuf");
   auto cleanup = scoped_cleanup([&](){kmfree(b, count);});
-  ssize_t r = f->pread(b, count, offset);
-  if (r > 0)
-    putmem(ubuf, b, r);
+  r = f->pread(b, count, offset);
+  if (r > 0 && !ubuf.store_bytes(b, r))
+    return -1;
   return r;
 }
 
@@ -231,12 +341,16 @@ sys_pread(int fd, void *ubuf, size_t count, off_t offset)
 ssize_t
 sys_write(int fd, const userptr<void> p, size_t n)
 {
+  FSPERF_REGION(FSPERF_SYSCALL, "sys_write");
   kstats::timer timer_fill(&kstats::write_cycles);
   kstats::inc(&kstats::write_count);
 
   sref<file> f = getfile(fd);
   if (!f)
     return -1;
+  ssize_t res;
+  if (f->write_user(p, n, &res))
+    return res;
   char *b = kalloc("writebuf");
   if (!b)
     return -1;
@@ -251,25 +365,178 @@ sys_write(int fd, const userptr<void> p, size_t n)
 
 //SYSCALL
 ssize_t
-sys_pwrite(int fd, const void *ubuf, size_t count, off_t offset)
+sys_pwrite(int fd, const userptr<void> ubuf, size_t count, off_t offset)
 {
+  FSPERF_REGION(FSPERF_SYSCALL, "sys_pwrite");
   sref<file> f = getfile(fd);
   if (!f)
     return -1;
 
+  ssize_t r;
+  if (f->pwrite_user(ubuf, count, offset, &r))
+    return r;
+
   if (count > 4*1024*1024)
     count = 4*1024*1024;
 
   char* b = (char*)kmalloc(count, "pwritebuf");
   auto cleanup = scoped_cleanup([&](){kmfree(b, count);});
-  fetchmem(b, ubuf, count);
+  if (!ubuf.load_bytes(b, count))
+    return -1;
   return f->pwrite(b, count, offset);
 }
 
+// Copy in the iovec array of a vectored I/O syscall, or return nullptr if it
+// is invalid.
+static std::unique_ptr<struct iovec[]>
+load_iovec(const userptr<struct iovec> uiov, int iovcnt)
+{
+  if (iovcnt <= 0 || iovcnt > UIO_MAXIOV)
+    return nullptr;
+  std::unique_ptr<struct iovec[]> iov = uiov.load_alloc(iovcnt);
+  if (!iov)
+    return nullptr;
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    if (iov[i].iov_len > SIZE_MAX / 2 - total)
+      return nullptr;
+    total += iov[i].iov_len;
+  }
+  return iov;
+}
+
+// Files without a vectored path (devices and pipes) do one read() or write()
+// through a kernel page, scattered to or gathered from the iovecs.
+static ssize_t
+readv_bounce(file *f, const struct iovec *iov, int iovcnt, off_t offset)
+{
+  char *b = kalloc("readbuf");
+  if (!b)
+    return -1;
+  auto cleanup = scoped_cleanup([b](){kfree(b);});
+  size_t n = 0;
+  for (int i = 0; i < iovcnt && n < PGSIZE; i++)
+    n += std::min(iov[i].iov_len, PGSIZE - n);
+  ssize_t res = offset < 0 ? f->read(b, n) : f->pread(b, n, offset);
+  if (res <= 0)
+    return res;
+  size_t done = 0;
+  for (int i = 0; i < iovcnt && done < (size_t)res; i++) {
+    size_t len = std::min(iov[i].iov_len, res - done);
+    if (putmem(iov[i].iov_base, b + done, len) < 0)
+      return -1;
+    done += len;
+  }
+  return res;
+}
+
+static ssize_t
+writev_bounce(file *f, const struct iovec *iov, int iovcnt, off_t offset)
+{
+  char *b = kalloc("writebuf");
+  if (!b)
+    return -1;
+  auto cleanup = scoped_cleanup([b](){kfree(b);});
+  size_t n = 0;
+  for (int i = 0; i < iovcnt && n < PGSIZE; i++) {
+    size_t len = std::min(iov[i].iov_len, PGSIZE - n);
+    if (fetchmem(b + n, iov[i].iov_base, len) < 0)
+      return -1;
+    n += len;
+  }
+  return offset < 0 ? f->write(b, n) : f->pwrite(b, n, offset);
+}
+
+static ssize_t
+do_readv(int fd, const userptr<struct iovec> uiov, int iovcnt, off_t offset)
+{
+  sref<file> f = getfile(fd);
+  if (!f)
+    return -1;
+  std::unique_ptr<struct iovec[]> iov = load_iovec(uiov, iovcnt);
+  if (!iov)
+    return -1;
+  ssize_t r;
+  if (f->readv_user(iov.get(), iovcnt, offset, &r))
+    return r;
+  return readv_bounce(f.get(), iov.get(), iovcnt, offset);
+}
+
+static ssize_t
+do_writev(int fd, const userptr<struct iovec> uiov, int iovcnt, off_t offset)
+{
+  kstats::timer timer_fill(&kstats::write_cycles);
+  kstats::inc(&kstats::write_count);
+
+  sref<file> f = getfile(fd);
+  if (!f)
+    return -1;
+  std::unique_ptr<struct iovec[]> iov = load_iovec(uiov, iovcnt);
+  if (!iov)
+    return -1;
+  ssize_t r;
+  if (f->writev_user(iov.get(), iovcnt, offset, &r))
+    return r;
+  return writev_bounce(f.get(), iov.get(), iovcnt, offset);
+}
+
+//SYSCALL
+ssize_t
+sys_readv(int fd, const userptr<struct iovec> iov, int iovcnt)
+{
+  FSPERF_REGION(FSPERF_SYSCALL, "sys_readv");
+  return do_readv(fd, iov, iovcnt, -1);
+}
+
+//SYSCALL
+ssize_t
+sys_writev(int fd, const userptr<struct iovec> iov, int iovcnt)
+{
+  FSPERF_REGION(FSPERF_SYSCALL, "sys_writev");
+  return do_writev(fd, iov, iovcnt, -1);
+}
+
+//SYSCALL
+ssize_t
+sys_preadv(int fd, const userptr<struct iovec> iov, int iovcnt, off_t offset)
+{
+  if (offset < 0)
+    return -1;
+  return do_readv(fd, iov, iovcnt, offset);
+}
+
+//SYSCALL
+ssize_t
+sys_pwritev(int fd, const userptr<struct iovec> iov, int iovcnt, off_t offset)
+{
+  if (offset < 0)
+    return -1;
+  return do_writev(fd, iov, iovcnt, offset);
+}
+
+//SYSCALL
+ssize_t
+sys_sendfile(int out_fd, int in_fd, userptr<off_t> uoffset, size_t count)
+{
+  sref<file> out = getfile(out_fd);
+  sref<file> in = getfile(in_fd);
+  if (!out || !in)
+    return -1;
+
+  off_t offset;
+  if (uoffset && !uoffset.load(&offset))
+    return -1;
+  ssize_t r = in->sendfile(out.get(), uoffset ? &offset : nullptr, count);
+  if (r > 0 && uoffset && !uoffset.store(&offset))
+    return -1;
+  return r;
+}
+
 //SYSCALL
 int
 sys_fstatx(int fd, userptr<struct stat> st, enum stat_flags flags)
 {
+  FSPERF_REGION(FSPERF_SYSCALL, "sys_fstatx");
   struct stat st_buf;
   sref<file> f = getfile(fd);
   if (!f)
@@ -286,6 +553,7 @@ sys_fstatx(int fd, userptr<struct stat> st, enum stat_flags flags)
 int
 sys_link(userptr_str old_path, userptr_str new_path)
 {
+  FSPERF_REGION(FSPERF_SYSCALL, "sys_link");
   u64 tsc = 0;
   char old[PATH_MAX], newn[PATH_MAX];
   if (!old_path.load(old, sizeof old) || !new_path.load(newn, sizeof newn))
@@ -318,7 +586,7 @@ sys_link(userptr_str old_path, userptr_str new_path)
 
   assert(md->fs_ == root_fs);
 
-  int cpu = myid();
+  int cpu = myhome();
   lock_guard<sleeplock> guard;
 
   if (mflink.mn()->type() == mnode::types::file) {
@@ -348,6 +616,7 @@ sys_link(userptr_str old_path, userptr_str new_path)
 int
 sys_rename(userptr_str old_path, userptr_str new_path)
 {
+  FSPERF_REGION(FSPERF_SYSCALL, "sys_rename");
   u64 tsc = 0;
   char old[PATH_MAX], newn[PATH_MAX];
   if (!old_path.load(old, sizeof old) || !new_path.load(newn, sizeof newn))
@@ -416,82 +685,59 @@ sys_rename(userptr_str old_path, userptr_str new_path)
     }
 
     u64 tsc_val = get_tsc();
-    int cpu = myid();
+    int cpu = myhome();
+
+    // A directory moving to another parent puts rename barriers in the new
+    // parent and its ancestors, so that flushing any of them first flushes its
+    // parent up to the rename (see process_ops_from_oplog()). The root has no
+    // parent, so it gets no barrier, and isn't involved unless it is one of
+    // the parents; otherwise every such rename would log to it. Since we hold
+    // the global lock for directory renames, the hierarchy won't change here.
+    std::vector<sref<mnode>> barrier_dirs;
+    if (mdold != mdnew && mfold->type() == mnode::types::dir)
+      for (sref<mnode> md = mdnew; md->mnum_ != root_mnum;
+           md = md->as_dir()->lookup(strbuf<DIRSIZ>("..")))
+        barrier_dirs.push_back(md);
 
     // Lock ordering: Acquire the locks in increasing order of their mnode
-    // numbers.
+    // numbers. The old parent may also be an ancestor of the new one.
+    std::vector<u64> all_mnums;
+    all_mnums.push_back(mdnew->mnum_);
+    all_mnums.push_back(mdold->mnum_);
+    for (auto &md : barrier_dirs)
+      all_mnums.push_back(md->mnum_);
+    std::sort(all_mnums.begin(), all_mnums.end());
     std::vector<u64> mnode_mnums;
-    mnode_mnums.push_back(mdnew->mnum_);
-    if (mdold != mdnew) {
-      mnode_mnums.push_back(mdold->mnum_);
-
-      if (mfold->type() == mnode::types::dir) {
-        sref<mnode> mdparent, md = mdnew;
-        while (1) {
-          mdparent = md->as_dir()->lookup(strbuf<DIRSIZ>(".."));
-          // Don't add mdnew->mnum_ twice; we already added it once above.
-          if (md != mdnew)
-            mnode_mnums.push_back(md->mnum_);
-
-          if (md->mnum_ == root_mnum)
-            break;
-          md = mdparent;
-        }
-      }
-    }
+    for (auto mnum : all_mnums)
+      if (mnode_mnums.empty() || mnode_mnums.back() != mnum)
+        mnode_mnums.push_back(mnum);
 
-    std::sort(mnode_mnums.begin(), mnode_mnums.end());
     std::vector<lock_guard<sleeplock>> mfs_tsc_locks;
     for (auto &mnum : mnode_mnums)
       mfs_tsc_locks.push_back(rootfs_interface->metadata_op_lockguard(mnum, cpu));
 
-    rootfs_interface->metadata_op_start(mdnew->mnum_, cpu, tsc_val);
-    if (mdold != mdnew)
-      rootfs_interface->metadata_op_start(mdold->mnum_, cpu, tsc_val);
-
     // We need to call _op_start() on all the relevant mnodes *before*
     // performing the rename, to make sure that the linearization point of the
     // rename is contained strictly between all pairs of _op_start() and _op_end().
     // Thus, there should be no call to _op_start() after performing the rename.
-    // Since we hold a global lock for directory renames, the directory hierarchy
-    // won't change here, which makes this job easy.
-    if (mdold != mdnew && mfold->type() == mnode::types::dir) {
-      sref<mnode> mdparent, md = mdnew;
-      while (1) {
-        mdparent = md->as_dir()->lookup(strbuf<DIRSIZ>(".."));
-        // Don't add to mdnew twice; we already added to it once above.
-        if (md != mdnew)
-          rootfs_interface->metadata_op_start(md->mnum_, cpu, tsc_val);
-
-        if (md->mnum_ == root_mnum)
-          break;
-        md = mdparent;
-      }
-    }
+    for (auto &mnum : mnode_mnums)
+      rootfs_interface->metadata_op_start(mnum, cpu, tsc_val);
 
     // Perform the actual rename operation in MemFS.
-    if (mdnew->as_dir()->replace_from(newname, mfroadblock,
+    bool renamed = mdnew->as_dir()->replace_from(newname, mfroadblock,
           mdold, oldname, mfold,
           (mfold->type() == mnode::types::dir) ? mfold->as_dir() : nullptr,
-          &tsc)) {
-
-      if (mdold != mdnew && mfold->type() == mnode::types::dir) {
-
-        // Add rename barriers to the destination directory and all its
-        // in-memory ancestors, with the same timestamp.
-        mfs_operation *op_rename_barrier;
-        sref<mnode> mdparent, md = mdnew;
-        while (1) {
-          mdparent = md->as_dir()->lookup(strbuf<DIRSIZ>(".."));
-          op_rename_barrier = new mfs_operation_rename_barrier(rootfs_interface,
-                                  tsc, md->mnum_, mdparent->mnum_, mfold->type());
-
-          rootfs_interface->add_to_metadata_log(md->mnum_, cpu, op_rename_barrier);
-
-          if (md->mnum_ == root_mnum)
-            break;
-          md = mdparent;
-        }
+          &tsc);
+
+    if (renamed) {
+      // Add rename barriers to the destination directory and its in-memory
+      // ancestors below the root, with the same timestamp.
+      for (auto &md : barrier_dirs) {
+        sref<mnode> mdparent = md->as_dir()->lookup(strbuf<DIRSIZ>(".."));
+        mfs_operation *op_rename_barrier =
+          new mfs_operation_rename_barrier(rootfs_interface, tsc, md->mnum_,
+                                           mdparent->mnum_, mfold->type());
+        rootfs_interface->add_to_metadata_log(md->mnum_, cpu, op_rename_barrier);
       }
 
       mfs_operation *op_rename_link, *op_rename_unlink;
@@ -510,48 +756,14 @@ sys_rename(userptr_str old_path, userptr_str new_path)
                              oldname.buf_, mfold->mnum_, mdold->mnum_,
                              newname.buf_, mdnew->mnum_, mfold->type());
       rootfs_interface->add_to_metadata_log(mdold->mnum_, cpu, op_rename_unlink);
-
-      tsc_val = get_tsc();
-
-      if (mdold != mdnew && mfold->type() == mnode::types::dir) {
-        sref<mnode> mdparent, md = mdnew;
-        while (1) {
-          mdparent = md->as_dir()->lookup(strbuf<DIRSIZ>(".."));
-          // Don't add to mdnew twice; we will add to it again below anyway.
-          if (md != mdnew)
-            rootfs_interface->metadata_op_end(md->mnum_, cpu, tsc_val);
-
-          if (md->mnum_ == root_mnum)
-            break;
-          md = mdparent;
-        }
-      }
-
-      if (mdold != mdnew)
-        rootfs_interface->metadata_op_end(mdold->mnum_, cpu, tsc_val);
-      rootfs_interface->metadata_op_end(mdnew->mnum_, cpu, tsc_val);
-      return 0;
     }
 
     tsc_val = get_tsc();
+    for (auto &mnum : mnode_mnums)
+      rootfs_interface->metadata_op_end(mnum, cpu, tsc_val);
 
-    if (mdold != mdnew && mfold->type() == mnode::types::dir) {
-      sref<mnode> mdparent, md = mdnew;
-      while (1) {
-        mdparent = md->as_dir()->lookup(strbuf<DIRSIZ>(".."));
-        // Don't add to mdnew twice; we will add to it again below anyway.
-        if (md != mdnew)
-          rootfs_interface->metadata_op_end(md->mnum_, cpu, tsc_val);
-
-        if (md->mnum_ == root_mnum)
-          break;
-        md = mdparent;
-      }
-    }
-
-    if (mdold != mdnew)
-      rootfs_interface->metadata_op_end(mdold->mnum_, cpu, tsc_val);
-    rootfs_interface->metadata_op_end(mdnew->mnum_, cpu, tsc_val);
+    if (renamed)
+      return 0;
 
     /*
      * The inodes for the source and/or the destination file names
@@ -565,6 +777,7 @@ sys_rename(userptr_str old_path, userptr_str new_path)
 int
 sys_unlink(userptr_str path)
 {
+  FSPERF_REGION(FSPERF_SYSCALL, "sys_unlink");
   u64 tsc = 0;
   char path_copy[PATH_MAX];
   if (!path.load(path_copy, sizeof path_copy))
@@ -583,7 +796,7 @@ sys_unlink(userptr_str path)
     return -1;
 
   assert(md->fs_ == root_fs);
-  int cpu = myid();
+  int cpu = myhome();
   lock_guard<sleeplock> guard;
 
   if (mf->type() == mnode::types::file || mf->type() == mnode::types::dir) {
@@ -686,7 +899,7 @@ create(sref<mnode> cwd, const char *path, short type, short major, short minor,
     mf = ilink.mn();
     mf->initialized(true);
 
-    int cpu = myid();
+    int cpu = myhome();
     u64 tsc_val = get_tsc();
     lock_guard<sleeplock> l1, l2;
 
@@ -767,6 +980,7 @@ create(sref<mnode> cwd, const char *path, short type, short major, short minor,
 int
 sys_openat(int dirfd, userptr_str path, int omode, ...)
 {
+  FSPERF_REGION(FSPERF_SYSCALL, "sys_openat");
   sref<mnode> cwd;
   if (dirfd == AT_FDCWD) {
     cwd = myproc()->cwd_m;
@@ -803,7 +1017,8 @@ sys_openat(int dirfd, userptr_str path, int omode, ...)
       m->as_file()->write_size().resize_nogrow(0);
 
   sref<file> f = make_sref<file_mnode>(
-    m, !(rwmode == O_WRONLY), !(rwmode == O_RDONLY), !!(omode & O_APPEND));
+    m, !(rwmode == O_WRONLY), !(rwmode == O_RDONLY), !!(omode & O_APPEND),
+    !!(omode & O_DIRECT));
   return fdalloc(std::move(f), omode);
 }
 
@@ -811,6 +1026,7 @@ sys_openat(int dirfd, userptr_str path, int omode, ...)
 int
 sys_mkdirat(int dirfd, userptr_str path, mode_t mode)
 {
+  FSPERF_REGION(FSPERF_SYSCALL, "sys_mkdirat");
   sref<mnode> cwd;
   if (dirfd == AT_FDCWD) {
     cwd = myproc()->cwd_m;
@@ -973,6 +1189,120 @@ sys_readdir(int dirfd, const userptr<char> prevptr, userptr<char> nameptr)
   return 1;
 }
 
+// Fill ubuf with as many of the entries of directory dirfd as fit, carrying
+// on from where the last call on this open file left off. Returns the number
+// of bytes filled in, which is 0 at the end of the directory.
+//SYSCALL
+ssize_t
+sys_getdents(int dirfd, userptr<void> ubuf, size_t len)
+{
+  FSPERF_REGION(FSPERF_SYSCALL, "sys_getdents");
+  sref<file> df = getfile(dirfd);
+  if (!df)
+    return -1;
+
+  file* dff = df.get();
+  if (&typeid(*dff) != &typeid(file_mnode))
+    return -1;
+
+  file_mnode* dfm = static_cast<file_mnode*>(dff);
+  if (dfm->m->type() != mnode::types::dir)
+    return -1;
+
+  size_t n = std::min(len / sizeof(getdents_rec), (size_t)GETDENTS_MAX);
+  if (!n)
+    return -1;
+
+  auto names = std::make_unique<strbuf<DIRSIZ>[]>(n);
+  auto mnums = std::make_unique<u64[]>(n);
+  auto recs = std::make_unique<getdents_rec[]>(n);
+
+  auto l = dfm->off_lock.guard();
+  size_t got = dfm->m->as_dir()->enumerate(
+    dfm->dir_cursor_set ? &dfm->dir_cursor : nullptr,
+    names.get(), mnums.get(), n);
+
+  for (size_t i = 0; i < got; i++) {
+    getdents_rec *r = &recs[i];
+    memset(r, 0, sizeof(*r));
+    // The type of an entry that hasn't been looked up yet isn't known
+    // without reading its inode; leave it 0.
+    r->mnum = mnode::is_unloaded(mnums[i]) ? 0 : mnums[i];
+    switch (mnode::type_of(mnums[i])) {
+    case mnode::types::dir:  r->type = T_DIR;    break;
+    case mnode::types::file: r->type = T_FILE;   break;
+    case mnode::types::dev:  r->type = T_DEV;    break;
+    case mnode::types::sock: r->type = T_SOCKET; break;
+    }
+    memmove(r->name, names[i].buf_, DIRSIZ);
+  }
+
+  if (got && !ubuf.store_bytes(recs.get(), got * sizeof(getdents_rec)))
+    return -1;
+
+  if (got) {
+    dfm->dir_cursor = names[got - 1];
+    dfm->dir_cursor_set = true;
+  }
+  return got * sizeof(getdents_rec);
+}
+
+// Stat the entries named by recs (as getdents() returns them) in directory
+// dirfd, storing the results in ust, without opening them.  A name that
+// isn't in the directory gets a stat with st_ino 0.  Returns the number of
+// entries filled in, which is at most GETDENTS_MAX.
+//SYSCALL
+ssize_t
+sys_statat_many(int dirfd, const userptr<struct getdents_rec> urecs, size_t n,
+                userptr<struct stat> ust, enum stat_flags flags)
+{
+  sref<file> df = getfile(dirfd);
+  if (!df)
+    return -1;
+
+  file* dff = df.get();
+  if (&typeid(*dff) != &typeid(file_mnode))
+    return -1;
+
+  file_mnode* dfm = static_cast<file_mnode*>(dff);
+  if (dfm->m->type() != mnode::types::dir)
+    return -1;
+  mdir* md = dfm->m->as_dir();
+
+  n = std::min(n, (size_t)GETDENTS_MAX);
+  if (!n)
+    return 0;
+
+  auto recs = std::make_unique<getdents_rec[]>(n);
+  auto sts = std::make_unique<struct stat[]>(n);
+  if (!urecs.load(recs.get(), n))
+    return -1;
+
+  // Read the inodes of the names that haven't been looked up yet in one
+  // batch, rather than one at a time as each lookup() would.
+  std::vector<u32> inums;
+  for (size_t i = 0; i < n; i++) {
+    recs[i].name[DIRSIZ] = 0;
+    u64 mnum;
+    if (md->lookup_mnum(strbuf<DIRSIZ>(recs[i].name), &mnum) &&
+        mnode::is_unloaded(mnum))
+      inums.push_back(mnode::unloaded_inum(mnum));
+  }
+  if (!inums.empty())
+    iprefetch(1, inums);
+
+  for (size_t i = 0; i < n; i++) {
+    memset(&sts[i], 0, sizeof(sts[i]));
+    sref<mnode> m = md->lookup(strbuf<DIRSIZ>(recs[i].name));
+    if (m)
+      file_mnode::stat_mnode(m.get(), &sts[i], flags);
+  }
+
+  if (!ust.store(sts.get(), n))
+    return -1;
+  return n;
+}
+
 //SYSCALL {"uargs":["const char *upath", "char * const uargv[]", "const void *actions", "size_t actions_len"]}
 int
 sys_sys_spawn(userptr_str upath, userptr<userptr_str> uargv,
@@ -1084,3 +1414,112 @@ sys_preload_oplog(void)
 {
   rootfs_interface->preload_oplog();
 }
+
+// Run one submission ring entry, as the syscall it stands for would.
+static s64
+io_ring_op(const struct io_ring_sqe &sqe)
+{
+  userptr<void> addr((void*)sqe.addr);
+  switch (sqe.op) {
+  case IORING_OP_NOP:
+    return 0;
+  case IORING_OP_READ:
+    return sys_read(sqe.fd, addr, sqe.len);
+  case IORING_OP_WRITE:
+    return sys_write(sqe.fd, addr, sqe.len);
+  case IORING_OP_PREAD:
+    return sys_pread(sqe.fd, addr, sqe.len, sqe.off);
+  case IORING_OP_PWRITE:
+    return sys_pwrite(sqe.fd, addr, sqe.len, sqe.off);
+  case IORING_OP_FSYNC:
+    if (sqe.flags & IORING_FSYNC_DATASYNC)
+      return sys_fdatasync(sqe.fd);
+    return sys_fsync(sqe.fd);
+  case IORING_OP_OPENAT:
+    return sys_openat(sqe.fd, userptr_str((const char*)sqe.addr), sqe.flags);
+  case IORING_OP_CLOSE:
+    return sys_close(sqe.fd);
+  case IORING_OP_UNLINK:
+    return sys_unlink(userptr_str((const char*)sqe.addr));
+  case IORING_OP_RENAME:
+    return sys_rename(userptr_str((const char*)sqe.addr),
+                      userptr_str((const char*)sqe.addr2));
+  default:
+    return -1;
+  }
+}
+
+// Run up to to_submit entries of the ring's submission queue, inline and in
+// order, posting a completion for each (see <uk/io_ring.h>).  Submission
+// stops early when the completion ring is full.  Returns the number of
+// entries consumed, or -1 if the ring itself is bad.  An entry is consumed
+// before it runs, so that it never runs twice, even if its completion can't
+// be posted.
+//SYSCALL
+int
+sys_io_ring_enter(userptr<struct io_ring> uring, u32 to_submit)
+{
+  struct io_ring ring;
+  if (!uring.load(&ring))
+    return -1;
+  if (!ring.sq_entries || (ring.sq_entries & (ring.sq_entries - 1)) ||
+      !ring.cq_entries || (ring.cq_entries & (ring.cq_entries - 1)))
+    return -1;
+
+  struct io_ring *ur = uring.unsafe_get();
+  userptr<struct io_ring_sqe> sqes(ring.sqes);
+  userptr<struct io_ring_cqe> cqes(ring.cqes);
+  userptr<u64> usq_head((u64*)&ur->sq_head);
+  userptr<u64> ucq_tail((u64*)&ur->cq_tail);
+  u64 sq_head = ring.sq_head;
+  u64 cq_tail = ring.cq_tail;
+  bool bad = false;
+  u32 n;
+  for (n = 0; n < to_submit; n++) {
+    if (sq_head == ring.sq_tail)
+      break;
+    if (cq_tail - ring.cq_head >= ring.cq_entries) {
+      // Pick up completions the process has consumed since.
+      u64 cq_head;
+      if (!userptr<u64>((u64*)&ur->cq_head).load(&cq_head)) {
+        bad = true;
+        break;
+      }
+      ring.cq_head = cq_head;
+      if (cq_tail - ring.cq_head >= ring.cq_entries)
+        break;
+    }
+
+    struct io_ring_sqe sqe;
+    if (!(sqes + (sq_head & (ring.sq_entries - 1))).load(&sqe)) {
+      bad = true;
+      break;
+    }
+    sq_head++;
+    if (!usq_head.store(&sq_head)) {
+      bad = true;
+      break;
+    }
+
+    struct io_ring_cqe cqe;
+    cqe.user_data = sqe.user_data;
+    cqe.res = io_ring_op(sqe);
+    // Publish each completion as it's posted, for threads polling the ring.
+    if (!(cqes + (cq_tail & (ring.cq_entries - 1))).store(&cqe)) {
+      bad = true;
+      break;
+    }
+    cq_tail++;
+    if (!ucq_tail.store(&cq_tail)) {
+      bad = true;
+      break;
+    }
+  }
+
+  if (cq_tail != ring.cq_tail) {
+    futexkey_t key;
+    if (futexkey((u64*)&ur->cq_tail, myproc()->vmap.get(), &key) == 0)
+      futexwake(key, ~0ull);
+  }
+  return bad ? -1 : n;
+}
@@ -129,14 +129,13 @@ sys_mmap(userptr<void> addr, size_t len, int prot, int flags, int fd,
       return MAP_FAILED;
 
     if (flags & MAP_SHARED) {
+      // The pages start out as holes, which take no memory until
+      // pagelookup() gives each one a (pre-zeroed) page of its own on its
+      // first fault.
       m = anon_fs->alloc(mnode::types::file).mn();
-      auto resizer = m->as_file()->write_size();
-      for (size_t i = 0; i < len; i += PGSIZE) {
-        void* p = zalloc("MAP_ANON|MAP_SHARED");
-        if (!p)
-          throw_bad_alloc();
-        auto pi = sref<page_info>::transfer(new (page_info::of(p)) page_info());
-        resizer.resize_append(i + PGSIZE, pi);
+      if (len) {
+        auto resizer = m->as_file()->write_size();
+        resizer.resize_append_holes(PGROUNDUP(len));
       }
     }
   } else {
@@ -168,6 +167,8 @@ sys_mmap(userptr<void> addr, size_t len, int prot, int flags, int fd,
   if (m && (flags & MAP_PRIVATE))
     desc.flags |= vmdesc::FLAG_COW;
   uptr r = myproc()->vmap->insert(desc, start, end - start);
+  if (r != (uptr)-1 && (flags & MAP_POPULATE))
+    myproc()->vmap->willneed(r, end - start);
   return (void*)r;
 }
 
@@ -196,6 +197,18 @@ sys_madvise(userptr<void> addr, size_t len, int advice)
       return -1;
     return 0;
 
+  case MADV_NORMAL:
+  case MADV_SEQUENTIAL:
+    if (myproc()->vmap->set_sequential(align_addr, align_len,
+                                       advice == MADV_SEQUENTIAL) < 0)
+      return -1;
+    return 0;
+
+  case MADV_DONTNEED:
+    if (myproc()->vmap->dontneed(align_addr, align_len) < 0)
+      return -1;
+    return 0;
+
   case MADV_INVALIDATE_CACHE:
     if (myproc()->vmap->invalidate_cache(align_addr, align_len) < 0)
       return -1;
@@ -206,6 +219,26 @@ sys_madvise(userptr<void> addr, size_t len, int advice)
   }
 }
 
+//SYSCALL
+int
+sys_mlock(const userptr<void> addr, size_t len)
+{
+  uptr align_addr = PGROUNDDOWN((uptr)addr);
+  uptr align_len = PGROUNDUP((uptr)addr + len) - align_addr;
+  if (align_addr + align_len > USERTOP || align_addr + align_len < align_addr)
+    return -1;
+  return myproc()->vmap->mlock(align_addr, align_len);
+}
+
+//SYSCALL
+int
+sys_munlock(const userptr<void> addr, size_t len)
+{
+  uptr align_addr = PGROUNDDOWN((uptr)addr);
+  uptr align_len = PGROUNDUP((uptr)addr + len) - align_addr;
+  return myproc()->vmap->munlock(align_addr, align_len);
+}
+
 //SYSCALL
 int
 sys_mprotect(userptr<void> addr, size_t len, int prot)
@@ -268,11 +301,28 @@ sys_setaffinity(int cpu)
   return myproc()->set_cpu_pin(cpu);
 }
 
+// Set the home core whose FS resources this thread uses; -1 makes
+// it follow the thread again.
 //SYSCALL
+int
+sys_sethome(int cpu)
+{
+  return myproc()->set_home(cpu);
+}
+
+//SYSCALL
+int
+sys_gethome(void)
+{
+  return myhome();
+}
+
+//SYSCALL {"uargs":["const u64* addr", "int op", "u64 val", "u64 timer", "const u64* addr2", "u64 val3"]}
 long
-sys_futex(const u64* addr, int op, u64 val, u64 timer)
+sys_futex(const u64* addr, int op, u64 val, u64 timer, const u64* addr2,
+          u64 val3)
 {
-  futexkey_t key;
+  futexkey_t key, key2;
 
   if (futexkey(addr, myproc()->vmap.get(), &key) < 0)
     return -1;
@@ -284,6 +334,15 @@ sys_futex(const u64* addr, int op, u64 val, u64 timer)
     return futexwait(key, val, timer);
   case FUTEX_WAKE:
     return futexwake(key, val);
+  case FUTEX_REQUEUE:
+  case FUTEX_CMP_REQUEUE:
+    if (futexkey(addr2, myproc()->vmap.get(), &key2) < 0)
+      return -1;
+    return futexrequeue(key, val, timer, key2, op == FUTEX_CMP_REQUEUE, val3);
+  case FUTEX_WAIT_BITSET:
+    return futexwait(key, val, timer, val3);
+  case FUTEX_WAKE_BITSET:
+    return futexwake(key, val, val3);
   default:
     return -1;
   }
@@ -4,6 +4,7 @@
 #include <uk/fcntl.h>
 #include <uk/stat.h>
 #include <uk/socket.h>
+#include <uk/uio.h>
 
 // Copy *sa into *ss, where sa is sa_len bytes long, and make sure
 // there's a NUL after the end of the copied sockaddr.
@@ -52,6 +53,13 @@ int
 sys_socket(int domain, int type, int protocol)
 {
   extern int unixsocket(int domain, int type, int protocol, file **out);
+  static_assert(SOCK_ANYFD == O_ANYFD && SOCK_CLOEXEC == O_CLOEXEC,
+                "socket flags must match open flags");
+  int flags = type & (SOCK_ANYFD | SOCK_CLOEXEC);
+  if (type & ~(SOCK_TYPE_MASK | flags))
+    return -1;
+  type &= SOCK_TYPE_MASK;
+
   file *f;
   int r;
   if (domain == PF_LOCAL)
@@ -60,7 +68,7 @@ sys_socket(int domain, int type, int protocol)
     r = netsocket(domain, type, protocol, &f);
   if (r < 0)
     return r;
-  return fdalloc(sref<file>::transfer(f), 0);
+  return fdalloc(sref<file>::transfer(f), flags);
 }
 
 //SYSCALL
@@ -95,9 +103,30 @@ sys_listen(int xsock, int backlog)
 
 //SYSCALL
 int
-sys_accept(int xsock, userptr<struct sockaddr> xaddr,
-           userptr<uint32_t> xaddrlen)
+sys_setsockopt(int xsock, int level, int optname,
+               const userptr<void> xoptval, uint32_t xoptlen)
+{
+  sref<file> f = getfile(xsock);
+  if (!f)
+    return -1;
+
+  // Every option we know of is an int or a small struct
+  char optval[64];
+  if (xoptlen > sizeof optval)
+    return -1;
+  if (xoptlen && !xoptval.load_bytes(optval, xoptlen))
+    return -1;
+  return f->setsockopt(level, optname, optval, xoptlen);
+}
+
+//SYSCALL
+int
+sys_accept4(int xsock, userptr<struct sockaddr> xaddr,
+            userptr<uint32_t> xaddrlen, int flags)
 {
+  if (flags & ~(SOCK_ANYFD | SOCK_CLOEXEC))
+    return -1;
+
   sref<file> f = getfile(xsock);
   if (!f)
     return -1;
@@ -111,7 +140,15 @@ sys_accept(int xsock, userptr<struct sockaddr> xaddr,
   sref<file> newf(sref<file>::transfer(newfp));
   if ((r = sockaddr_to_user(xaddr, xaddrlen, &ss, ss_len)) < 0)
     return r;
-  return fdalloc(std::move(newf), 0);
+  return fdalloc(std::move(newf), flags);
+}
+
+//SYSCALL
+int
+sys_accept(int xsock, userptr<struct sockaddr> xaddr,
+           userptr<uint32_t> xaddrlen)
+{
+  return sys_accept4(xsock, xaddr, xaddrlen, 0);
 }
 
 //SYSCALL
@@ -159,11 +196,123 @@ sys_sendto(int sockfd, const userptr<void> buf, size_t len, int flags,
                    addrlen);
 }
 
+// Load the single iovec of a sendmmsg() or recvmmsg() message.
+static bool
+mmsg_iov(const struct msghdr &hdr, struct iovec *iov)
+{
+  if (hdr.msg_iovlen == 0) {
+    iov->iov_base = nullptr;
+    iov->iov_len = 0;
+    return true;
+  }
+  if (hdr.msg_iovlen != 1)
+    return false;
+  return userptr<struct iovec>(hdr.msg_iov).load(iov);
+}
+
+// Send up to vlen datagrams with one system call.  Returns the number
+// sent, or -1 if the first one fails.
+//SYSCALL
+int
+sys_sendmmsg(int sockfd, userptr<struct mmsghdr> msgvec, unsigned int vlen,
+             int flags)
+{
+  sref<file> f = getfile(sockfd);
+  if (!f)
+    return -1;
+  if (vlen > UIO_MAXIOV)
+    vlen = UIO_MAXIOV;
+
+  unsigned int i;
+  for (i = 0; i < vlen; i++) {
+    struct mmsghdr mh;
+    struct iovec iov;
+    if (!(msgvec + i).load(&mh) || !mmsg_iov(mh.msg_hdr, &iov))
+      break;
+
+    struct sockaddr_storage ss;
+    if (mh.msg_hdr.msg_name &&
+        sockaddr_from_user(&ss, userptr<struct sockaddr>(
+                             (struct sockaddr*)mh.msg_hdr.msg_name),
+                           mh.msg_hdr.msg_namelen) < 0)
+      break;
+
+    ssize_t r = f->sendto(userptr<void>(iov.iov_base), iov.iov_len, flags,
+                          mh.msg_hdr.msg_name ? (struct sockaddr*)&ss : nullptr,
+                          mh.msg_hdr.msg_namelen);
+    if (r < 0)
+      break;
+    mh.msg_len = r;
+    if (!(msgvec + i).store(&mh))
+      break;
+  }
+  return i ? i : -1;
+}
+
+// Receive up to vlen datagrams with one system call.  With
+// MSG_WAITFORONE, only waits for the first.  Returns the number
+// received, or -1 if none were.
+//SYSCALL
+int
+sys_recvmmsg(int sockfd, userptr<struct mmsghdr> msgvec, unsigned int vlen,
+             int flags, userptr<struct timespec> timeout)
+{
+  sref<file> f = getfile(sockfd);
+  if (!f)
+    return -1;
+  // Timeouts aren't supported
+  if (timeout)
+    return -1;
+  if (vlen > UIO_MAXIOV)
+    vlen = UIO_MAXIOV;
+
+  unsigned int i;
+  for (i = 0; i < vlen; i++) {
+    struct mmsghdr mh;
+    struct iovec iov;
+    if (!(msgvec + i).load(&mh) || !mmsg_iov(mh.msg_hdr, &iov))
+      break;
+
+    struct sockaddr_storage ss;
+    size_t ss_len;
+    ssize_t r = f->recvfrom(userptr<void>(iov.iov_base), iov.iov_len,
+                            flags & ~MSG_WAITFORONE,
+                            mh.msg_hdr.msg_name ? &ss : nullptr, &ss_len);
+    if (r < 0)
+      break;
+    if (mh.msg_hdr.msg_name) {
+      if (ss_len < mh.msg_hdr.msg_namelen)
+        mh.msg_hdr.msg_namelen = ss_len;
+      if (!userptr<void>(mh.msg_hdr.msg_name).store_bytes(
+            &ss, mh.msg_hdr.msg_namelen))
+        break;
+      mh.msg_hdr.msg_namelen = ss_len;
+    }
+    mh.msg_len = r;
+    if (!(msgvec + i).store(&mh))
+      break;
+    if (flags & MSG_WAITFORONE)
+      flags |= MSG_DONTWAIT;
+  }
+  return i ? i : -1;
+}
+
 //SYSCALL
 int
 sys_connect(int sockfd, const userptr<struct sockaddr> addr, u32 addrlen)
 {
-  return -1;
+  sref<file> f = getfile(sockfd);
+  if (!f)
+    return -1;
+
+  struct sockaddr_storage ss;
+  if (!addr)
+    return -1;
+  int r = sockaddr_from_user(&ss, addr, addrlen);
+  if (r < 0)
+    return r;
+
+  return f->connect((struct sockaddr*)&ss, addrlen);
 }
 
 //SYSCALL
@@ -0,0 +1,126 @@
+// Fork-join task groups and the per-core workers that run them.
+
+#include "types.h"
+#include "kernel.hh"
+#include "spinlock.hh"
+#include "condvar.hh"
+#include "percpu.hh"
+#include "proc.hh"
+#include "taskgroup.hh"
+
+namespace {
+  struct task_worker {
+    spinlock lock;
+    condvar cv;
+    task *head, *tail;
+    proc *thread;
+
+    task_worker()
+      : lock("task_worker"), cv("task_worker"), head(nullptr),
+        tail(nullptr), thread(nullptr) { }
+  };
+
+  percpu<task_worker> workers;
+}
+
+void
+task_group::submit(int cpu, task *t)
+{
+  t->group_ = this;
+  {
+    auto l = lock_.guard();
+    pending_++;
+    if (cpu < 0 || cpu >= ncpu || cpu == myid() || !workers[cpu].thread) {
+      if (local_tail_)
+        local_tail_->next_ = t;
+      else
+        local_ = t;
+      local_tail_ = t;
+      return;
+    }
+  }
+
+  auto &w = workers[cpu];
+  auto l = w.lock.guard();
+  if (w.tail) {
+    w.tail->next_ = t;
+  } else {
+    w.head = t;
+    w.cv.wake_all();
+  }
+  w.tail = t;
+}
+
+void
+task_group::run(task *t)
+{
+  task_group *g = t->group_;
+  if (!g->cancelled())
+    t->run();
+  delete t;
+
+  // The waiter may free g as soon as it sees pending_ drop to zero,
+  // so don't touch g after releasing its lock.
+  auto l = g->lock_.guard();
+  if (--g->pending_ == 0)
+    g->cv_.wake_all();
+}
+
+bool
+task_group::wait()
+{
+  assert(!workers[myid()].thread || workers[myid()].thread != myproc());
+
+  for (;;) {
+    task *t;
+    {
+      auto l = lock_.guard();
+      t = local_;
+      if (!t)
+        break;
+      local_ = t->next_;
+      if (!local_)
+        local_tail_ = nullptr;
+    }
+    run(t);
+  }
+
+  auto l = lock_.guard();
+  while (pending_)
+    cv_.sleep(&lock_);
+  return !cancelled_;
+}
+
+static void
+task_worker_thread(void *arg)
+{
+  auto &w = workers[(int)(uptr)arg];
+
+  for (;;) {
+    task *batch;
+    {
+      auto l = w.lock.guard();
+      while (!w.head)
+        w.cv.sleep(&w.lock);
+      batch = w.head;
+      w.head = w.tail = nullptr;
+    }
+
+    while (batch) {
+      task *next = batch->next_;
+      task_group::run(batch);
+      batch = next;
+    }
+  }
+}
+
+void
+init_taskgroups(void)
+{
+  for (int c = 0; c < ncpu; c++) {
+    char namebuf[32];
+    snprintf(namebuf, sizeof(namebuf), "kworker_%u", c);
+    workers[c].thread = threadpin(task_worker_thread, (void *)(uptr)c,
+                                  namebuf, c);
+  }
+}
@@ -255,6 +255,10 @@ trap(struct trapframe *tf)
     on_ipicall();
     break;
   }
+  case T_WAKE:
+    // Nothing to do but leave hlt; idle_halt() runs the work.
+    lapiceoi();
+    break;
   case T_DEVICE: {
     // Clear "task switched" flag to enable floating-point
     // instructions.  sched will set this again when it switches
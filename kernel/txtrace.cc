@@ -0,0 +1,50 @@
+// Per-core rings of ScaleFS transaction events; see txtrace.h.
+
+#include "types.h"
+#include "kernel.hh"
+#include "amd64.h"
+#include "fs.h"
+#include "file.hh"
+#include "major.h"
+#include "tracering.hh"
+#include "txtrace.h"
+
+static tracering<struct txtrace_event, TXTRACE_EVENTS> txtrace_ring;
+
+void
+txtrace(u8 type, int journal, u64 txn, u64 arg, u32 aux)
+{
+  txtrace_ring.log([&](txtrace_event *e) {
+      e->tsc = rdtsc();
+      e->txn = txn;
+      e->arg = arg;
+      e->aux = aux;
+      e->type = type;
+      e->journal = journal;
+      e->cpu = myid();
+      e->pad = 0;
+    });
+}
+
+// Drain as many whole events as fit in dst.  Reads consume the events,
+// so off is ignored.
+static int
+txtraceread(mdev*, char *dst, u32 off, u32 n)
+{
+  auto out = (struct txtrace_event*)dst;
+  u32 used = txtrace_ring.drain(out, n / sizeof(*out),
+                                [](txtrace_event *e, int cpu, u64 lost) {
+                                  e->tsc = rdtsc();
+                                  e->arg = lost;
+                                  e->type = TXTRACE_LOST;
+                                  e->cpu = cpu;
+                                });
+  return used * sizeof(*out);
+}
+
+void
+inittxtrace(void)
+{
+  txtrace_ring.init("txtrace");
+  devsw[MAJ_TXTRACE].pread = txtraceread;
+}
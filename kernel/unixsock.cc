@@ -7,33 +7,52 @@
 #include "atomic_util.hh"
 #include "proc.hh"
 #include "file.hh"
+#include "epoll.hh"
 #include <uk/socket.h>
 #include <uk/un.h>
 
-#define QUEUELEN 10   // Number of message per queue of a local socket
 #define LB 0          // Run with load balancer?
 
-struct msghdr {
+// A queued datagram.  The payload follows the header in the same
+// allocation, sized to the message.
+struct unixmsg {
   u32 len;
   struct sockaddr_un uaddr;
-  char *data;
-  islink<msghdr> link;
-  typedef isqueue<msghdr, &msghdr::link> list_t;
+  islink<unixmsg> link;
+  typedef isqueue<unixmsg, &unixmsg::link> list_t;
 
-  msghdr() {}
-  ~msghdr() {}
+  char *data() { return (char*)(this + 1); }
 
-  NEW_DELETE_OPS(msghdr);
+  static unixmsg* alloc(u32 len) {
+    void *p = kmalloc(sizeof(unixmsg) + len, "unixmsg");
+    if (!p)
+      return nullptr;
+    unixmsg *m = new(p) unixmsg();
+    m->len = len;
+    return m;
+  }
+
+  void free() {
+    u32 n = len;
+    this->~unixmsg();
+    kmfree(this, sizeof(unixmsg) + n);
+  }
 };
 
 struct coresocket : public balance_pool<coresocket> {
   int len;
   struct spinlock lock;
-  msghdr::list_t messages;
+  unixmsg::list_t messages;
 
-  coresocket() : balance_pool(QUEUELEN), len(0),
+  coresocket() : balance_pool(UNIXSOCK_QUEUELEN), len(0),
                  lock("coresocket", LOCKSTAT_LOCALSOCK) {}
-  ~coresocket() {}
+  ~coresocket() {
+    while (!messages.empty()) {
+      unixmsg &m = messages.front();
+      messages.pop_front();
+      m.free();
+    }
+  }
   NEW_DELETE_OPS(coresocket);
 
   u64 balance_count() const {
@@ -57,7 +76,7 @@ struct coresocket : public balance_pool<coresocket> {
       n++;
       target->len++;
       len--;
-      msghdr& m = messages.front();
+      unixmsg& m = messages.front();
       messages.pop_front();
       target->messages.push_back(&m);
     }
@@ -78,8 +97,13 @@ struct localsock {
   condvar rw_cv[NCPU];
   balancer<localsock, coresocket> b;
   atomic<int> nreader;
+  // Messages queued on all cores, for epoll.  An unordered socket is
+  // readable if any core has a message, though a reader only takes
+  // messages from its own core's queue.
+  atomic<int> nqueued;
+  poll_slot pq;
 
-  localsock(bool ordered) : ordered_(ordered), b(this), nreader(0) {
+  localsock(bool ordered) : ordered_(ordered), b(this), nreader(0), nqueued(0) {
     for (int i = 0; i < NCPU; i++)
       pipes[i] = 0;
     if (ordered)
@@ -135,7 +159,25 @@ struct localsock {
 #endif
   }
 
-  int write(msghdr *m) {
+  // Senders never wait for long, so the socket is always writable
+  u32 readiness() const {
+    return nqueued > 0 ? EPOLLIN | EPOLLOUT : EPOLLOUT;
+  }
+
+  void pollupdate(u32 happened) {
+    pq.update(happened, [this](){ return readiness(); });
+  }
+
+  sref<poll_queue> pollq() {
+    return pq.get([this](){ return readiness(); });
+  }
+
+  // The condvar that readers of cp sleep on
+  int cvidx() const {
+    return ordered_ ? 0 : myid();
+  }
+
+  int write(unixmsg *m) {
     bool toyield = true;
     for (;;) {
       if (myproc()->killed)
@@ -147,7 +189,7 @@ struct localsock {
       // perhaps useful if sender and receiver are not on the same core
       if (nreader > 1) {
         cp = mycoresocket();
-        if (cp->len >= QUEUELEN)
+        if (cp->len >= UNIXSOCK_QUEUELEN)
           balance();
       } else {
         cp = reader();
@@ -156,32 +198,35 @@ struct localsock {
         continue;
 #else
       cp = mycoresocket();
-      if (cp->len >= QUEUELEN && toyield) {
+      if (cp->len >= UNIXSOCK_QUEUELEN && toyield) {
         yield();
         toyield = false;
         continue;
       }
 
-      if (cp->len >= QUEUELEN)
+      if (cp->len >= UNIXSOCK_QUEUELEN)
         balance();
 #endif
 
-      int cpu = myid();
+      int cpu = cvidx();
       scoped_acquire a(&rw_cv_lock[cpu]);
 
       scoped_acquire l(&cp->lock);
-      if (cp->len < QUEUELEN) {
+      if (cp->len < UNIXSOCK_QUEUELEN) {
         // cprintf("w %d(%d): coresocket %p\n", myproc()->pid, myproc()->cpuid, cp);
         cp->messages.push_back(m);
         cp->len++;
+        nqueued++;
         // Wake up the sleeping reader
         rw_cv[cpu].wake_all();
+        pollupdate(EPOLLIN);
         return 0;
       }
     }
   }
 
-  msghdr* read() {
+  // If !block, returns null rather than wait for a message.
+  unixmsg* read(bool block) {
     //bool toyield = true;
     for (;;) {
       if (myproc()->killed)
@@ -207,19 +252,24 @@ struct localsock {
 
 #else // So sleep on a condition variable instead
 
-      int cpu = myid();
+      int cpu = cvidx();
       scoped_acquire a(&rw_cv_lock[cpu]);
-      while (cp->len <= 0)
+      while (cp->len <= 0) {
+        if (!block)
+          return NULL;
         rw_cv[cpu].sleep(&rw_cv_lock[cpu]);
+      }
 
 #endif
 
       scoped_acquire l(&cp->lock);
       if (cp->len > 0) {
         // cprintf("r %d(%d): coresocket %p\n", myproc()->pid, myproc()->cpuid, cp);
-        msghdr &m = cp->messages.front();
+        unixmsg &m = cp->messages.front();
         cp->messages.pop_front();
         cp->len--;
+        if (--nqueued == 0)
+          pollupdate(0);
         return &m;
       }
       // toyield = true;   // iterate between yielding and balancing
@@ -297,27 +347,22 @@ public:
     if (ip->type() != mnode::types::sock)
       return -1;
 
-    char *b = kalloc("writebuf");
-    if (!b)
-      return -1;
-
     if (len > PGSIZE)
       len = PGSIZE;
-    if (!buf.load_bytes(b, len)) {
-      kfree(b);
+    unixmsg *m = unixmsg::alloc(len);
+    if (!m)
+      return -1;
+    if (!buf.load_bytes(m->data(), len)) {
+      m->free();
       return -1;
     }
 
-    msghdr *m = new msghdr();
-    m->data = b;
-    m->len = len;
     m->uaddr.sun_family = AF_UNIX;
     strncpy(m->uaddr.sun_path, socketpath_, UNIX_PATH_MAX);
 
     int r = ip->as_sock()->get_sock()->write(m);
     if (r < 0) {
-      kfree(b);
-      delete m;
+      m->free();
       return -1;
     }
     return len;
@@ -332,7 +377,9 @@ public:
 
     ssize_t r = -1;
 
-    msghdr *m = localsock_->read();
+    unixmsg *m = localsock_->read(!(flags & MSG_DONTWAIT));
+    if (!m)
+      return -1;
     if (src_addr) {
       *(struct sockaddr_un*)src_addr = m->uaddr;
       *addrlen = sizeof(m->uaddr);
@@ -340,17 +387,22 @@ public:
     if (m->len > len)
       goto done;
 
-    if (!buf.store_bytes(m->data, m->len))
+    if (!buf.store_bytes(m->data(), m->len))
       goto done;
 
     r = m->len;
 
   done:
-    kfree(m->data);
-    delete m;
+    m->free();
     return r;
   }
 
+  sref<poll_queue>
+  pollq() override
+  {
+    return localsock_->pollq();
+  }
+
   void
   onzero() override
   {
@@ -16,6 +16,7 @@
 #include "page_info.hh"
 #include <algorithm>
 #include "kstats.hh"
+#include "pagecopy.hh"
 
 extern struct proc *bootproc;
 
@@ -39,6 +40,7 @@ void to_stream(class print_stream *s, const vmdesc &vmd)
         {"ANON", vmdesc::FLAG_ANON},
         {"WRITE", vmdesc::FLAG_WRITE},
         {"SHARED", vmdesc::FLAG_SHARED},
+        {"SEQUENTIAL", vmdesc::FLAG_SEQUENTIAL},
       }), " ");
   if (vmd.page)
     s->print((void*)vmd.page->pa(), "}");
@@ -131,24 +133,24 @@ vmap::alloc(void)
 }
 
 vmap::vmap() : 
-  brk_(0), brklock_("brk_lock", LOCKSTAT_VM)
+  brk_(0), brklock_("brk_lock", LOCKSTAT_VM),
+  mlock_lock_("mlock_lock", LOCKSTAT_VM)
 {
 }
 
 vmap::~vmap()
 {
-  for (auto it = vpfs_.begin(), end = vpfs_.end(); it != end; ) {
-    // Skip unset spans
-    if (!it.is_set()) {
-      it += it.base_span();
-      continue;
-    }
-    if (myproc() != bootproc && it->page && it->inode) {
-      std::pair<vmap*, uptr> rmap = std::make_pair(&*this, it.index()*PGSIZE);
-      it->page->remove_pte(rmap);
-    }
-    ++it;
-  }
+  for (auto &m : mlocked_)
+    m.second->unpin();
+  // A folded span has no page behind it, so a large untouched mapping
+  // is visited once rather than page by page.  The nodes themselves go
+  // with vpfs_.
+  vpfs_.for_each_set(0, vpfs_.size(), [&](size_t idx, size_t, vmdesc &desc) {
+      if (myproc() != bootproc && desc.page && desc.inode) {
+        std::pair<vmap*, uptr> rmap = std::make_pair(&*this, idx*PGSIZE);
+        desc.page->remove_pte(rmap);
+      }
+    });
 }
 
 sref<vmap>
@@ -161,41 +163,59 @@ vmap::copy()
   mmu::shootdown shootdown;
 
   {
-    auto out = nm->vpfs_.begin();
     auto lock = vpfs_.acquire(vpfs_.begin(), vpfs_.end());
-    for (auto it = vpfs_.begin(), end = vpfs_.end(); it != end; ) {
-      // Skip unset spans
-      if (!it.is_set()) {
-        // We can use the base span because we know we just reached this
-        // span.
-        out += it.base_span();
-        it += it.base_span();
-        continue;
-      }
+
+    // Pages newly marked COW are invalidated a run of consecutive pages
+    // at a time, rather than one by one.
+    size_t cow_begin = 0, cow_pages = 0;
+    auto flush_cow = [&]() {
+      if (cow_pages)
+        cache.invalidate(cow_begin * PGSIZE, cow_pages * PGSIZE,
+                         vpfs_.find(cow_begin), &shootdown);
+      cow_pages = 0;
+    };
+
+    vpfs_.for_each_set(0, vpfs_.size(),
+                       [&](size_t idx, size_t span, vmdesc &desc) {
+      // Unset pages end a run
+      if (cow_pages && idx != cow_begin + cow_pages)
+        flush_cow();
       if (SDEBUG)
-        sdebug.println("vm: dup ", *it, " at ", shex(it.index() * PGSIZE));
-
-      // If the original vmdesc isn't COW, mark it so and fix the page
-      // table.
-      if (it->page && !(it->flags & vmdesc::FLAG_SHARED) && !(it->flags & vmdesc::FLAG_COW)) {
-        if (SDEBUG)
-          sdebug.println("vm: mark COW");
-        it->flags |= vmdesc::FLAG_COW;
-        // XXX(Austin) Should we try to invalidate in larger chunks?
-        cache.invalidate(it.index() * PGSIZE, PGSIZE, it, &shootdown);
+        sdebug.println("vm: dup ", desc, " at ", shex(idx * PGSIZE));
+
+      // A span of pages that haven't been faulted in yet all share one
+      // descriptor, which needs no COW marking: copy it as a span.
+      if (!desc.page && span > 1) {
+        flush_cow();
+        nm->vpfs_.fill(nm->vpfs_.find(idx), nm->vpfs_.find(idx + span),
+                       desc.dup());
+        return;
       }
 
-      // Copy the descriptor
-      nm->vpfs_.fill(out, it->dup());
-      if (myproc() != bootproc && out->page && out->inode) {
-        std::pair<vmap*, uptr> rmap = std::make_pair(&*(nm.get()), out.index()*PGSIZE);
-        out->page->add_pte(rmap);
+      for (size_t i = idx; i < idx + span; i++) {
+        // If the original vmdesc isn't COW, mark it so and fix the page
+        // table.
+        if (desc.page && !(desc.flags & vmdesc::FLAG_SHARED) && !(desc.flags & vmdesc::FLAG_COW)) {
+          if (SDEBUG)
+            sdebug.println("vm: mark COW");
+          desc.flags |= vmdesc::FLAG_COW;
+          if (!cow_pages)
+            cow_begin = i;
+          cow_pages++;
+        } else {
+          flush_cow();
+        }
+
+        // Copy the descriptor
+        auto out = nm->vpfs_.find(i);
+        nm->vpfs_.fill(out, desc.dup());
+        if (myproc() != bootproc && out->page && out->inode) {
+          std::pair<vmap*, uptr> rmap = std::make_pair(&*(nm.get()), i*PGSIZE);
+          out->page->add_pte(rmap);
+        }
       }
-
-      // Next page
-      ++out;
-      ++it;
-    }
+    });
+    flush_cow();
 
     shootdown.perform();
   }
@@ -299,6 +319,7 @@ vmap::remove(uptr start, uptr len)
     shootdown.perform();
   }
 
+  unpin_range(start, len);
   return 0;
 }
 
@@ -314,6 +335,20 @@ vmap::delete_mapping(uptr addr)
   shootdown.perform();
 }
 
+void
+vmap::delete_mappings(const uptr *addrs, size_t n)
+{
+  mmu::shootdown shootdown;
+  for (size_t i = 0; i < n; i++) {
+    auto vpf = vpfs_.find(addrs[i]/PGSIZE);
+    auto lock = vpfs_.acquire(vpf,vpf+1);
+    if (vpf.is_set())
+      vpfs_.unset(vpf,vpf+1);
+    cache.invalidate(addrs[i], PGSIZE, vpf, &shootdown);
+  }
+  shootdown.perform();
+}
+
 void
 vmap::clear_mapping(uptr addr)
 {
@@ -337,9 +372,47 @@ vmap::clear_mapping(uptr addr)
   shootdown.perform();
 }
 
+void
+vmap::readahead_range(uptr start, uptr len)
+{
+  struct run {
+    sref<mnode> m;
+    u64 first, npages;
+  };
+  std::vector<run> runs;
+
+  {
+    auto begin = vpfs_.find(start / PGSIZE);
+    auto end = vpfs_.find((start + len) / PGSIZE);
+    auto lock = vpfs_.acquire(begin, end);
+    for (auto it = begin; it < end; it += it.span()) {
+      if (!it.is_set() || it->page || !it->inode ||
+          (it->flags & vmdesc::FLAG_ANON))
+        continue;
+      u64 pageidx = (it.index() * PGSIZE - it->start) / PGSIZE;
+      if (!runs.empty() && runs.back().m == it->inode &&
+          runs.back().first + runs.back().npages == pageidx)
+        runs.back().npages++;
+      else
+        runs.push_back(run{it->inode, pageidx, 1});
+    }
+  }
+
+  // The readahead threads skip the pages that are already in memory.
+  for (auto &r : runs)
+    for (u64 i = 0; i < r.npages; i += READAHEAD_MAX_PAGES)
+      r.m->as_file()->readahead_async(
+        r.first + i, std::min(r.npages - i, (u64)READAHEAD_MAX_PAGES));
+}
+
 int
 vmap::willneed(uptr start, uptr len)
 {
+  // Get the reads going in big batches, so that populating the range
+  // below mostly waits for reads that are already under way instead of
+  // reading a page at a time.
+  readahead_range(start, len);
+
 retry:
   try {
     auto begin = vpfs_.find(start / PGSIZE);
@@ -405,6 +478,145 @@ vmap::invalidate_cache(uptr start, uptr len)
   return 0;
 }
 
+int
+vmap::set_sequential(uptr start, uptr len, bool seq)
+{
+  auto begin = vpfs_.find(start / PGSIZE);
+  auto end = vpfs_.find((start + len) / PGSIZE);
+  auto lock = vpfs_.acquire(begin, end);
+
+  for (auto it = begin; it < end; it += it.span()) {
+    if (!it.is_set())
+      return -1;                // ENOMEM
+    if (seq)
+      it->flags |= vmdesc::FLAG_SEQUENTIAL;
+    else
+      it->flags &= ~vmdesc::FLAG_SEQUENTIAL;
+  }
+  return 0;
+}
+
+int
+vmap::dontneed(uptr start, uptr len)
+{
+  // The page-cache pages to release, once the range lock is dropped
+  // (releasing a page clears its other mappings, which takes their
+  // locks).
+  std::vector<std::pair<sref<mnode>, u64>> cached;
+
+  {
+    auto begin = vpfs_.find(start / PGSIZE);
+    auto end = vpfs_.find((start + len) / PGSIZE);
+    auto lock = vpfs_.acquire(begin, end);
+
+    page_holder pages;
+    mmu::shootdown shootdown;
+
+    for (auto it = begin; it < end; it += it.span()) {
+      if (!it.is_set())
+        return -1;              // ENOMEM
+      if (!it->page)
+        continue;
+
+      // A private copy of a file page isn't the file's to release.
+      bool file_page = it->inode &&
+        ((it->flags & vmdesc::FLAG_SHARED) || (it->flags & vmdesc::FLAG_COW));
+      if (file_page)
+        cached.push_back(std::make_pair(
+          it->inode, (it.index() * PGSIZE - it->start) / PGSIZE));
+
+      sref<page_info> old_page = it->page;
+      if (myproc() != bootproc && it->inode) {
+        std::pair<vmap*, uptr> rmap = std::make_pair(&*this, it.index()*PGSIZE);
+        pages.add(std::move(old_page), rmap);
+      } else {
+        pages.add(std::move(old_page));
+      }
+
+      // A private file mapping goes back to copying the file's page on
+      // a write; anonymous memory just gets a fresh page.
+      u64 nflags = it->flags;
+      if (!it->inode)
+        nflags &= ~vmdesc::FLAG_COW;
+      else if (!(it->flags & vmdesc::FLAG_SHARED))
+        nflags |= vmdesc::FLAG_COW;
+      if (it.base_span() == 1) {
+        // Safe to update in place
+        it->page = sref<page_info>();
+        it->flags = nflags;
+      } else {
+        vmdesc n(*it);
+        n.page = sref<page_info>();
+        n.flags = nflags;
+        vpfs_.fill(it, std::move(n));
+      }
+      cache.invalidate(it.index() * PGSIZE, PGSIZE, it, &shootdown);
+    }
+    shootdown.perform();
+  }
+
+  for (auto &c : cached)
+    c.first->as_file()->put_page(c.second);
+  return 0;
+}
+
+int
+vmap::mlock(uptr start, uptr len)
+{
+  if (willneed(start, len) < 0)
+    return -1;
+
+  std::vector<std::pair<uptr, sref<page_info>>> pages;
+  {
+    auto begin = vpfs_.find(start / PGSIZE);
+    auto end = vpfs_.find((start + len) / PGSIZE);
+    auto lock = vpfs_.acquire(begin, end);
+    for (auto it = begin; it < end; it += it.span()) {
+      if (!it.is_set())
+        return -1;              // ENOMEM
+      // Anonymous memory is never reclaimed, so only file pages need
+      // pinning.
+      if (it->page && it->inode)
+        pages.push_back(std::make_pair(it.index() * PGSIZE, it->page));
+    }
+  }
+
+  // Drop any earlier pins of the range first, so a page is pinned once
+  // per address however many times it's locked.
+  unpin_range(start, len);
+  scoped_acquire l(&mlock_lock_);
+  for (auto &p : pages) {
+    p.second->pin();
+    mlocked_.push_back(std::move(p));
+  }
+  return 0;
+}
+
+int
+vmap::munlock(uptr start, uptr len)
+{
+  unpin_range(start, len);
+  return 0;
+}
+
+void
+vmap::unpin_range(uptr start, uptr len)
+{
+  scoped_acquire l(&mlock_lock_);
+  for (size_t i = 0; i < mlocked_.size(); ) {
+    if (mlocked_[i].first >= start && mlocked_[i].first - start < len) {
+      mlocked_[i].second->unpin();
+      if (i + 1 != mlocked_.size()) {
+        mlocked_[i].first = mlocked_.back().first;
+        mlocked_[i].second = std::move(mlocked_.back().second);
+      }
+      mlocked_.pop_back();
+    } else {
+      i++;
+    }
+  }
+}
+
 int
 vmap::mprotect(uptr start, uptr len, uint64_t flags)
 {
@@ -493,12 +705,29 @@ vmap::pagefault(uptr va, u32 err)
   // If we replace a page, hold a reference until after the shootdown.
   sref<class page_info> old_page;
 
+  // The file and page of a fault on a MADV_SEQUENTIAL mapping.
+  sref<mnode> seq_file;
+  u64 seq_idx = 0;
+
   // When we clear from va to va+PGSIZE, make sure that's just this
   // page.
   va = PGROUNDDOWN(va);
 
  retry:
   try {
+    if (HUGEPAGE_ANON && pagefault_huge_anon(va)) {
+      kstats::inc(&kstats::page_fault_alloc_count);
+      timer_fill.abort();
+      return 1;
+    }
+
+    if (HUGEPAGE_FILE_MIN_BYTES && type == access_type::READ &&
+        pagefault_huge(va)) {
+      kstats::inc(&kstats::page_fault_fill_count);
+      timer_alloc.abort();
+      return 1;
+    }
+
     auto it = vpfs_.find(va / PGSIZE);
     auto lock = vpfs_.acquire(it);
     if (!it.is_set())
@@ -525,6 +754,11 @@ vmap::pagefault(uptr va, u32 err)
       cache.invalidate(va, PGSIZE, it, &shootdown);
     }
 
+    if ((desc.flags & vmdesc::FLAG_SEQUENTIAL) && desc.inode) {
+      seq_file = desc.inode;
+      seq_idx = (it.index() * PGSIZE - desc.start) / PGSIZE;
+    }
+
     // Ensure we have a backing page and copy COW pages
     bool allocated;
     page_info *page = ensure_page(it, type, &allocated);
@@ -556,9 +790,195 @@ vmap::pagefault(uptr va, u32 err)
     e.retry();
     goto retry;
   }
+
+  if (FAULT_AROUND_PAGES && type == access_type::READ)
+    fault_around(va);
+  if (seq_file)
+    seq_file->as_file()->sequential_fault(seq_idx);
   return 1;
 }
 
+void
+vmap::fault_around(uptr va)
+{
+  static_assert(!(FAULT_AROUND_PAGES & (FAULT_AROUND_PAGES - 1)),
+                "FAULT_AROUND_PAGES must be a power of two");
+  uptr start = va & ~(uptr)(FAULT_AROUND_PAGES * PGSIZE - 1);
+  uptr end = std::min(start + FAULT_AROUND_PAGES * PGSIZE, (uptr)USERTOP);
+
+  auto begin = vpfs_.find(start / PGSIZE);
+  auto last = vpfs_.find(end / PGSIZE);
+  auto lock = vpfs_.acquire(begin, last);
+  try {
+    for (auto it = begin; it < last; it += it.span()) {
+      if (!it.is_set() || it->page || !it->inode ||
+          (it->flags & vmdesc::FLAG_ANON))
+        continue;
+
+      // Only take pages that are in memory now; this is just an
+      // optimization, so never wait for the disk.
+      u64 pageidx = (it.index() * PGSIZE - it->start) / PGSIZE;
+      sref<page_info> pi;
+      bool partial;
+      if (!it->inode->as_file()->get_pages(pageidx, 1, &pi, &partial) ||
+          is_zero_page(pi.get()))
+        continue;
+      if (ensure_page(it, access_type::READ) != pi.get())
+        continue;
+      cache.insert(it.index() * PGSIZE, &*it, pi->pa() | PTE_P | PTE_U);
+    }
+  } catch (blocking_io &e) {
+    // The page was evicted since get_pages() found it; leave the rest
+    // to their own faults.
+  }
+}
+
+bool
+vmap::pagefault_huge_anon(uptr va)
+{
+  const u64 npages = HUGE_PGSIZE / PGSIZE;
+  uptr hva = va & ~(uptr)(HUGE_PGSIZE - 1);
+  if (hva + HUGE_PGSIZE > USERTOP)
+    return false;
+
+  // A COW page has to be copied on a write and may be shared with
+  // another process, so only plain anonymous memory qualifies.
+  auto qualifies = [](const vmdesc &desc) {
+    return (desc.flags & vmdesc::FLAG_ANON) &&
+      !(desc.flags & (vmdesc::FLAG_COW | vmdesc::FLAG_SHARED));
+  };
+
+  {
+    auto it = vpfs_.find(va / PGSIZE);
+    auto lock = vpfs_.acquire(it);
+    if (!it.is_set() || !qualifies(*it))
+      return false;
+  }
+
+  auto begin = vpfs_.find(hva / PGSIZE);
+  auto end = vpfs_.find((hva + HUGE_PGSIZE) / PGSIZE);
+  auto lock = vpfs_.acquire(begin, end);
+  if (!begin.is_set())
+    return false;
+  u64 writable = begin->flags & vmdesc::FLAG_WRITE;
+  bool untouched = !begin->page;
+  for (auto it = begin; it < end; it += it.span())
+    if (!it.is_set() || !qualifies(*it) ||
+        (it->flags & vmdesc::FLAG_WRITE) != writable ||
+        !it->page != untouched)
+      return false;
+
+  paddr base;
+  if (untouched) {
+    // Buddy blocks are naturally aligned, but don't count on it.
+    char *p = kalloc("anon huge page", HUGE_PGSIZE);
+    if (!p)
+      return false;
+    if (v2p(p) % HUGE_PGSIZE) {
+      kfree(p, HUGE_PGSIZE);
+      return false;
+    }
+    memset(p, 0, HUGE_PGSIZE);
+
+    // Each page gets a page_info and a vmdesc of its own, so that an
+    // munmap or fork of part of the span later works page by page
+    // (once the large page has been shot down).
+    auto it = begin;
+    for (u64 i = 0; i < npages; i++, ++it) {
+      vmdesc n(*it);
+      n.page = sref<page_info>::transfer(
+        new (page_info::of(p + i * PGSIZE)) page_info());
+      vpfs_.fill(it, std::move(n));
+    }
+    base = v2p(p);
+  } else {
+    // Another core faulted the span in; map the same block here.
+    base = begin->page->pa();
+    if (base % HUGE_PGSIZE)
+      return false;
+    auto it = begin;
+    for (u64 i = 0; i < npages; i++, ++it)
+      if (it->page->pa() != base + i * PGSIZE)
+        return false;
+  }
+
+  pme_t pte = base | PTE_P | PTE_U;
+  if (writable)
+    pte |= PTE_W;
+  // If this core already maps part of the span with small pages, the
+  // pages are still installed and the normal fault path maps them.
+  return cache.insert_huge(hva, vpfs_.find(hva / PGSIZE), pte);
+}
+
+bool
+vmap::pagefault_huge(uptr va)
+{
+  const u64 npages = HUGE_PGSIZE / PGSIZE;
+  uptr hva = va & ~(uptr)(HUGE_PGSIZE - 1);
+  if (hva + HUGE_PGSIZE > USERTOP)
+    return false;
+
+  auto qualifies = [hva](const vmdesc &desc) {
+    return !(desc.flags & (vmdesc::FLAG_WRITE | vmdesc::FLAG_COW |
+                           vmdesc::FLAG_ANON)) &&
+      desc.inode && (hva - (uptr)desc.start) % HUGE_PGSIZE == 0;
+  };
+
+  // Check the faulting page alone first: it has to be a read-only file
+  // page, already in memory, at its offset within a 2MB physical span.
+  {
+    auto it = vpfs_.find(va / PGSIZE);
+    auto lock = vpfs_.acquire(it);
+    if (!it.is_set() || !qualifies(*it))
+      return false;
+    u64 pageidx = (va - it->start) / PGSIZE;
+    sref<page_info> pi = it->page;
+    bool partial;
+    if (!pi && !it->inode->as_file()->get_pages(pageidx, 1, &pi, &partial))
+      return false;
+    if ((pi->pa() / PGSIZE) % npages != pageidx % npages)
+      return false;
+  }
+
+  auto begin = vpfs_.find(hva / PGSIZE);
+  auto end = vpfs_.find((hva + HUGE_PGSIZE) / PGSIZE);
+  auto lock = vpfs_.acquire(begin, end);
+  if (!begin.is_set())
+    return false;
+  mnode *ip = begin->inode.get();
+  intptr_t start = begin->start;
+  for (auto it = begin; it < end; it += it.span())
+    if (!it.is_set() || !qualifies(*it) || it->inode.get() != ip ||
+        it->start != start)
+      return false;
+
+  // Install each page in its vmdesc as ensure_page would, checking that
+  // they make up one 2MB-aligned physical span.
+  enum { BATCH = 64 };
+  sref<page_info> pis[BATCH];
+  u64 first = (hva - start) / PGSIZE;
+  paddr base = 0;
+  auto it = begin;
+  for (u64 i = 0; i < npages; i += BATCH) {
+    bool partial;
+    if (ip->as_file()->get_pages(first + i, BATCH, pis, &partial) != BATCH ||
+        partial)
+      return false;
+    if (i == 0)
+      base = pis[0]->pa();
+    if (base % HUGE_PGSIZE)
+      return false;
+    for (u32 j = 0; j < BATCH; j++, ++it) {
+      if (pis[j]->pa() != base + (i + j) * PGSIZE ||
+          ensure_page(it, access_type::READ) != pis[j].get())
+        return false;
+    }
+  }
+
+  return cache.insert_huge(hva, vpfs_.find(hva / PGSIZE),
+                           base | PTE_P | PTE_U);
+}
+
 int
 pagefault(vmap *vmap, uptr va, u32 err)
 {
@@ -615,6 +1035,48 @@ retry:
   }
 }
 
+sref<page_info>
+vmap::pin_page(uptr va, bool write)
+{
+  if (va >= USERTOP)
+    return sref<page_info>();
+
+  // Pages of files are left to the page cache, which keeps track of what is
+  // written to them.
+  mmu::shootdown shootdown;
+  sref<page_info> old_page;
+  auto it = vpfs_.find(va / PGSIZE);
+  auto lock = vpfs_.acquire(it);
+  if (!it.is_set() || it->inode)
+    return sref<page_info>();
+
+  auto &desc = *it;
+  if (write && !(desc.flags & vmdesc::FLAG_WRITE))
+    return sref<page_info>();
+
+  // As for a copy-on-write fault, the old page has to stay put until the
+  // TLBs no longer map it.
+  if (write && (desc.flags & vmdesc::FLAG_COW)) {
+    old_page = desc.page;
+    cache.invalidate(va, PGSIZE, it, &shootdown);
+  }
+
+  page_info *pi;
+#if EXCEPTIONS
+  try {
+#endif
+    pi = ensure_page(it, write ? access_type::WRITE : access_type::READ);
+#if EXCEPTIONS
+  } catch (std::bad_alloc &e) {
+    pi = nullptr;
+  }
+#endif
+  shootdown.perform();
+  if (!pi)
+    return sref<page_info>();
+  return sref<page_info>::newref(pi);
+}
+
 void*
 pagelookup(vmap* vmap, uptr va)
 {
@@ -798,7 +1260,16 @@ vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
       page = sref<page_info>::transfer(new(page_info::of(p)) page_info());
     } else {
       u64 page_idx = (it.index() * PGSIZE - desc.start) / PGSIZE;
-      page = desc.inode->as_file()->get_page(page_idx).get_page_info();
+      mfile *mf = desc.inode->as_file();
+      page = mf->get_page(page_idx).get_page_info();
+      // A hole's zero page is shared by all files, so it can't be
+      // written through a mapping or tracked in an rmap: map a page of
+      // the file's own instead.
+      while (is_zero_page(page.get())) {
+        if (!mf->unshare_zero_page(page_idx))
+          throw_bad_alloc();
+        page = mf->get_page(page_idx).get_page_info();
+      }
       if (!page)
         return nullptr;
     }
@@ -815,7 +1286,7 @@ vmap::ensure_page(const vmap::vpf_array::iterator &it, vmap::access_type type,
     if (SDEBUG)
       sdebug.println("vm: COW copy to ", (void*)p, " from ", page->va(),
                      ' ', page.get());
-    memmove(p, page->va(), PGSIZE);
+    pagecopy(p, page->va());
     page = sref<page_info>::transfer(new(page_info::of(p)) page_info());
   }
 
@@ -6,9 +6,7 @@
 #include "ilist.hh"
 #include "mtrace.h"
 #include "work.hh"
-
-extern "C" void zpage(void*);
-extern "C" void zpage_nc(void*);
+#include "pagecopy.hh"
 
 static const bool prezero = true;
 
@@ -44,6 +42,7 @@ struct zwork : public dwork {
       z_->pages.push_front(r);
       ++z_->nPages;
     }
+    asm volatile("sfence" ::: "memory");
     frame_->dec();
     delete this;
   }
@@ -57,15 +56,48 @@ static void
 tryrefill(void)
 {
   int cpu = myid();
-  if (prezero && z_[cpu].nPages < 16 && z_[cpu].frame.zero()) {
+  if (prezero && z_[cpu].nPages < ZPOOL_LOW_PAGES && z_[cpu].frame.zero()) {
     zwork* w = new zwork(&z_[cpu].frame);
-    // XXX This is higher priority than doing actual work.  We should
-    // only do background zeroing if we would otherwise be idle.
+    // This is higher priority than doing actual work, so it only
+    // keeps a core that never goes idle from running dry; idle cores
+    // fill their pools in zrefill_idle().
     if (dwork_push(w, cpu) < 0)
       delete w;
   }
 }
 
+// Called by the idle loop: zero up to ZPOOL_IDLE_BATCH pages into this
+// core's pool, with non-temporal stores so as not to evict whatever the
+// core was running from its cache.  Returns true if it did any work (and
+// there may be more to do).
+bool
+zrefill_idle(void)
+{
+  if (!prezero)
+    return false;
+
+  int n = 0;
+  for (; n < ZPOOL_IDLE_BATCH; n++) {
+    {
+      scoped_cli cli;
+      if (z_->nPages >= ZPOOL_MAX_PAGES)
+        break;
+    }
+    auto *r = (struct free_page*)kalloc("zpage");
+    if (r == nullptr)
+      break;
+    zpage_nc(r);
+    scoped_cli cli;
+    z_->pages.push_front(r);
+    ++z_->nPages;
+  }
+  if (n)
+    // Make the non-temporal stores visible before the pages can be
+    // handed to another core.
+    asm volatile("sfence" ::: "memory");
+  return n > 0;
+}
+
 // Allocate a zeroed page.  This page can be freed with kfree or, if
 // it is known to be zeroed when it is freed, zfree.
 char*
@@ -85,7 +117,7 @@ zalloc(const char* name)
   if (p == nullptr) {
     p = kalloc(name);
     if (p != nullptr)
-      zpage(p);
+      pagezero(p);
   } else {
     mtunlabel(mtrace_label_block, p);
     mtlabel(mtrace_label_block, p, PGSIZE, name, strlen(name));
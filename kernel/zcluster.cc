@@ -0,0 +1,182 @@
+// Compressed file clusters; see zcluster.hh.
+
+#include "types.h"
+#include "kernel.hh"
+#include "fs.h"
+#include "buf.hh"
+#include "percpu.hh"
+#include "sleeplock.hh"
+#include "kstats.hh"
+#include "zlib.h"
+#include "zlib-decompress.hh"
+#include "zcluster.hh"
+#include <atomic>
+
+static_assert(PGSIZE == BSIZE, "a cluster's pages are its blocks");
+static_assert(sizeof(dzcluster) < BSIZE, "dzcluster doesn't fit in a block");
+
+// Bumped by zcluster_forget(), so that decompressed clusters from before
+// then are never used again.
+static std::atomic<u64> zcluster_epoch;
+
+struct zdeflater {
+  sleeplock lock;
+  bool ready;
+  z_stream zs;
+};
+
+struct zinflater {
+  sleeplock lock;
+  bool ready;
+  z_stream zs;
+  // The cluster in data[]: its first disk block and the epoch it was
+  // decompressed in. addr 0 is none.
+  u32 dev;
+  u32 addr;
+  u64 epoch;
+  char *data;
+};
+
+static percpu<zdeflater> zdeflaters;
+static percpu<zinflater> zinflaters;
+
+static void
+zstream_init(z_stream *zs, const char *name)
+{
+  memset(zs, 0, sizeof(*zs));
+  zs->zalloc = zlib_alloc;
+  zs->zfree = zlib_free;
+  zs->opaque = (void *)name;
+}
+
+u32
+zcluster_compress(const char *const *pages, u32 npages, u32 rawlen,
+                  char *dst)
+{
+  assert(rawlen && rawlen <= npages * PGSIZE && npages <= ZCLUSTER_BLOCKS);
+  kstats::timer timer(&kstats::fs_compress_cycles);
+  kstats::inc(&kstats::fs_compress_count);
+  kstats::inc(&kstats::fs_compress_bytes_in, (u64)rawlen);
+
+  // Worth it only if at least a block less holds the zlib stream and its
+  // header.
+  u32 rawblocks = (rawlen + BSIZE - 1) / BSIZE;
+  if (rawblocks < 2)
+    return 0;
+  u32 room = (rawblocks - 1) * BSIZE - sizeof(dzcluster);
+
+  auto &d = *zdeflaters.get_unchecked();
+  auto l = d.lock.guard();
+  if (!d.ready) {
+    zstream_init(&d.zs, "zdeflate");
+    if (deflateInit(&d.zs, ZCLUSTER_LEVEL) != Z_OK)
+      panic("zcluster_compress: deflateInit() failed");
+    d.ready = true;
+  } else if (deflateReset(&d.zs) != Z_OK) {
+    panic("zcluster_compress: deflateReset() failed");
+  }
+
+  d.zs.next_out = (Bytef *)dst + sizeof(dzcluster);
+  d.zs.avail_out = room;
+  int err = Z_OK;
+  for (u32 i = 0; i < npages && err == Z_OK; i++) {
+    d.zs.next_in = (Bytef *)pages[i];
+    d.zs.avail_in = std::min((u32)PGSIZE, rawlen - i * PGSIZE);
+    err = deflate(&d.zs, i == npages - 1 ? Z_FINISH : Z_NO_FLUSH);
+    // Out of room for the output: it doesn't compress well enough.
+    if (d.zs.avail_out == 0 && err != Z_STREAM_END)
+      return 0;
+  }
+  if (err != Z_STREAM_END)
+    return 0;
+
+  u32 zlen = d.zs.total_out;
+  dzcluster *h = (dzcluster *)dst;
+  h->magic = ZCLUSTER_MAGIC;
+  h->zlen = zlen;
+  h->rawlen = rawlen;
+  h->pad = 0;
+  u32 size = sizeof(dzcluster) + zlen;
+  memset(dst + size, 0, PGROUNDUP(size) - size);
+  kstats::inc(&kstats::fs_compress_bytes_out, (u64)size);
+  return size;
+}
+
+// Decompress the cluster in the nblocks blocks from addr into z->data.
+static void
+zcluster_inflate(zinflater *z, u32 dev, u32 addr, u32 nblocks)
+{
+  kstats::timer timer(&kstats::fs_decompress_cycles);
+  kstats::inc(&kstats::fs_decompress_count);
+
+  if (!z->ready) {
+    zstream_init(&z->zs, "zinflate");
+    if (inflateInit(&z->zs) != Z_OK)
+      panic("zcluster_read: inflateInit() failed");
+    z->data = (char *)kmalloc(ZCLUSTER_BYTES, "zcluster");
+    if (!z->data)
+      panic("zcluster_read: out of memory");
+    z->ready = true;
+  } else if (inflateReset(&z->zs) != Z_OK) {
+    panic("zcluster_read: inflateReset() failed");
+  }
+
+  z->zs.next_out = (Bytef *)z->data;
+  z->zs.avail_out = ZCLUSTER_BYTES;
+  u32 left = 0, rawlen = 0;
+  int err = Z_OK;
+  for (u32 i = 0; i < nblocks && err == Z_OK; i++) {
+    sref<buf> bp = buf::get(dev, addr + i);
+    auto copy = bp->read();
+    const char *p = copy->data;
+    u32 n = BSIZE;
+    if (i == 0) {
+      const dzcluster *h = (const dzcluster *)p;
+      if (h->magic != ZCLUSTER_MAGIC || h->rawlen > ZCLUSTER_BYTES ||
+          h->zlen > nblocks * BSIZE - sizeof(*h))
+        panic("zcluster_read: bad compressed cluster at block %u", addr);
+      left = h->zlen;
+      rawlen = h->rawlen;
+      p += sizeof(*h);
+      n -= sizeof(*h);
+    }
+    z->zs.next_in = (Bytef *)p;
+    z->zs.avail_in = std::min(n, left);
+    left -= z->zs.avail_in;
+    err = inflate(&z->zs, Z_NO_FLUSH);
+  }
+  if (err != Z_STREAM_END || z->zs.total_out != rawlen)
+    panic("zcluster_read: corrupt compressed cluster at block %u (%d)",
+          addr, err);
+
+  memset(z->data + rawlen, 0, ZCLUSTER_BYTES - rawlen);
+  kstats::inc(&kstats::fs_decompress_bytes, (u64)rawlen);
+}
+
+void
+zcluster_read(u32 dev, u32 addr, u32 nblocks, u32 off, char *dst, u32 n)
+{
+  assert(addr && nblocks < ZCLUSTER_BLOCKS && off + n <= ZCLUSTER_BYTES);
+
+  auto &z = *zinflaters.get_unchecked();
+  auto l = z.lock.guard();
+  // Read the epoch first: a cluster freed while this decompresses it is
+  // left behind as stale.
+  u64 epoch = zcluster_epoch.load(std::memory_order_acquire);
+  if (z.addr == addr && z.dev == dev && z.epoch == epoch) {
+    kstats::inc(&kstats::fs_decompress_hit_count);
+  } else {
+    z.addr = 0;
+    zcluster_inflate(&z, dev, addr, nblocks);
+    z.dev = dev;
+    z.addr = addr;
+    z.epoch = epoch;
+  }
+  memmove(dst, z.data + off, n);
+}
+
+void
+zcluster_forget(void)
+{
+  zcluster_epoch.fetch_add(1, std::memory_order_release);
+}
@@ -2,6 +2,7 @@
 #include "kernel.hh"
 #include "zlib.h"
 #include "fs.h"
+#include "zlib-decompress.hh"
 
 void *
 zlib_alloc(void *opaque, unsigned count, unsigned nbytes)
@@ -0,0 +1,503 @@
+// Fibers over per-core workers (see <xv6/fiber.h>).
+//
+// Each worker is a kernel thread pinned to a core, with a FIFO run
+// queue, an epoll instance for fiber_wait(), an io_ring with an I/O
+// thread for fiber_io(), and a non-blocking wake pipe that the epoll
+// also watches.  Only the worker's own thread polls its epoll and
+// reaps its ring, so a fiber can arm them before switching out without
+// racing its own wakeup.  An idle worker sleeps in epoll_wait(); the
+// wake pipe gets it up for new fibers and ring completions.
+
+#include "types.h"
+#include "user.h"
+#include "amd64.h"
+#include "pthread.h"
+#include "futex.h"
+#include <xv6/fiber.h>
+#include <sys/epoll.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <atomic>
+
+enum { stack_size = 16384 };
+enum { max_workers = 32 };
+enum { ring_entries = 64 };     // Ops in flight per worker
+enum { poll_interval = 64 };    // Dispatches between epoll checks
+enum { max_events = 32 };
+
+extern "C" void fiber_swtch(u64 **from_sp, u64 *to_sp);
+
+enum fiber_state { RUNNABLE, RUNNING, PARKED, DEAD };
+
+struct fiber {
+  u64 *sp;                      // Saved stack pointer while switched out
+  char *stack;
+  void (*fn)(void *);
+  void *arg;
+  fiber *next;                  // On a run queue
+  fiber_state state;
+  int wait_fd;
+  int wait_res;
+  s64 io_res;
+};
+
+namespace {
+  class spinlock {
+    std::atomic<bool> locked_;
+  public:
+    spinlock() : locked_(false) { }
+    void acquire() {
+      while (locked_.exchange(true, std::memory_order_acquire))
+        while (locked_.load(std::memory_order_relaxed))
+          nop_pause();
+    }
+    void release() { locked_.store(false, std::memory_order_release); }
+  };
+
+  struct worker {
+    int id;
+    pthread_t thread, iothread;
+    u64 *sched_sp;              // The scheduler's stack, while a fiber runs
+    fiber *cur;
+
+    spinlock lock;              // Protects the run queue
+    fiber *head, *tail;
+    std::atomic<int> nrun;
+
+    int epfd;
+    int wakefd[2];
+    std::atomic<bool> idle;     // Asleep (or about to be) in epoll_wait()
+
+    struct io_ring ring;
+    struct io_ring_sqe sqes[ring_entries];
+    struct io_ring_cqe cqes[ring_entries];
+    std::atomic<bool> io_sleeping;
+  } __mpalign__;
+}
+
+static worker workers[max_workers];
+static int nworkers;
+static std::atomic<int> nidle;
+static std::atomic<long> nfibers;
+static std::atomic<bool> done;
+static __thread worker *my_worker;
+
+// A fiber can move to another worker at any switch, so reread this
+// after every one rather than let the compiler keep the TLS address.
+static __attribute__((noinline)) worker *
+myworker(void)
+{
+  asm volatile("" ::: "memory");
+  return my_worker;
+}
+
+static void
+poke(worker *w)
+{
+  char c = 0;
+  // If the pipe is full, w has wakeups pending anyway.
+  if (write(w->wakefd[1], &c, 1) < 0)
+    return;
+}
+
+static void
+enqueue(worker *w, fiber *f)
+{
+  f->state = RUNNABLE;
+  f->next = nullptr;
+  w->lock.acquire();
+  if (w->tail)
+    w->tail->next = f;
+  else
+    w->head = f;
+  w->tail = f;
+  // Sequentially consistent with idle workers' nidle increment
+  w->nrun++;
+  w->lock.release();
+
+  if (nidle) {
+    for (int i = 0; i < nworkers; i++) {
+      worker *v = &workers[(w->id + i) % nworkers];
+      if (v != myworker() && v->idle) {
+        poke(v);
+        break;
+      }
+    }
+  }
+}
+
+static fiber *
+dequeue(worker *w)
+{
+  if (!w->nrun)
+    return nullptr;
+  w->lock.acquire();
+  fiber *f = w->head;
+  if (f) {
+    w->head = f->next;
+    if (!w->head)
+      w->tail = nullptr;
+    w->nrun--;
+  }
+  w->lock.release();
+  return f;
+}
+
+static fiber *
+steal(worker *w)
+{
+  for (int i = 1; i < nworkers; i++) {
+    fiber *f = dequeue(&workers[(w->id + i) % nworkers]);
+    if (f)
+      return f;
+  }
+  return nullptr;
+}
+
+// Switch from the running fiber to its worker's scheduler.
+static void
+sched(fiber *f, fiber_state s)
+{
+  f->state = s;
+  fiber_swtch(&f->sp, myworker()->sched_sp);
+}
+
+static void
+run(worker *w, fiber *f)
+{
+  f->state = RUNNING;
+  w->cur = f;
+  fiber_swtch(&w->sched_sp, f->sp);
+  w->cur = nullptr;
+
+  // f's context is saved, so only now may another worker pick it up.
+  if (f->state == RUNNABLE) {
+    enqueue(w, f);
+  } else if (f->state == DEAD) {
+    free(f->stack);
+    delete f;
+    if (--nfibers == 0) {
+      done = true;
+      for (int i = 0; i < nworkers; i++) {
+        poke(&workers[i]);
+        futex((u64*)&workers[i].ring.sq_tail, FUTEX_WAKE, ~0ull, 0,
+              nullptr, 0);
+      }
+    }
+  }
+}
+
+// Take the completions off w's ring.
+static void
+reap(worker *w)
+{
+  struct io_ring &r = w->ring;
+  u64 head = r.cq_head;
+  while (head != r.cq_tail) {
+    struct io_ring_cqe *cqe = &w->cqes[head & (ring_entries - 1)];
+    fiber *f = (fiber*)cqe->user_data;
+    f->io_res = cqe->res;
+    asm volatile("" ::: "memory");
+    r.cq_head = ++head;
+    enqueue(w, f);
+  }
+}
+
+// Run the fibers whose fds are ready.  Returns whether there were
+// any events.
+static bool
+poll(worker *w, int timeout)
+{
+  struct epoll_event evs[max_events];
+  int n = epoll_wait(w->epfd, evs, max_events, timeout);
+  for (int i = 0; i < n; i++) {
+    fiber *f = (fiber*)evs[i].data.ptr;
+    if (!f) {
+      char buf[64];
+      while (read(w->wakefd[0], buf, sizeof(buf)) > 0)
+        ;
+      continue;
+    }
+    epoll_ctl(w->epfd, EPOLL_CTL_DEL, f->wait_fd, nullptr);
+    f->wait_res = evs[i].events;
+    enqueue(w, f);
+  }
+  return n > 0;
+}
+
+static void
+idle(worker *w)
+{
+  w->idle = true;
+  nidle++;
+  // Recheck for work now that enqueue() and the I/O thread can see
+  // we're idle.
+  bool work = done || w->ring.cq_head != w->ring.cq_tail;
+  for (int i = 0; i < nworkers && !work; i++)
+    work = workers[i].nrun > 0;
+  if (!work)
+    poll(w, -1);
+  nidle--;
+  w->idle = false;
+}
+
+static void
+worker_loop(worker *w)
+{
+  my_worker = w;
+  setaffinity(w->id);
+
+  for (unsigned ticks = 0; !done; ticks++) {
+    reap(w);
+    if (ticks % poll_interval == 0)
+      poll(w, 0);
+    fiber *f = dequeue(w);
+    if (!f)
+      f = steal(w);
+    if (!f && !poll(w, 0)) {
+      idle(w);
+      continue;
+    }
+    if (f)
+      run(w, f);
+  }
+}
+
+static void *
+worker_main(void *arg)
+{
+  worker_loop((worker*)arg);
+  return nullptr;
+}
+
+// Run the operations queued on w's ring, on w's core.
+static void *
+io_main(void *arg)
+{
+  worker *w = (worker*)arg;
+  struct io_ring &r = w->ring;
+  setaffinity(w->id);
+
+  while (!done) {
+    u64 tail = r.sq_tail;
+    if (tail == r.sq_head) {
+      w->io_sleeping = true;
+      if (r.sq_tail == r.sq_head && !done)
+        futex((u64*)&r.sq_tail, FUTEX_WAIT, tail, 0, nullptr, 0);
+      w->io_sleeping = false;
+      continue;
+    }
+    io_ring_enter(&r, tail - r.sq_head);
+    // The completions are out; wake w if it went idle before they were.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (w->idle)
+      poke(w);
+  }
+  return nullptr;
+}
+
+static void
+fiber_start(void)
+{
+  fiber *f = myworker()->cur;
+  f->fn(f->arg);
+  fiber_exit();
+}
+
+static fiber *
+fiber_alloc(void (*fn)(void *), void *arg)
+{
+  fiber *f = new fiber();
+  f->stack = (char*)malloc(stack_size);
+  if (!f->stack) {
+    delete f;
+    return nullptr;
+  }
+  f->fn = fn;
+  f->arg = arg;
+
+  // fiber_swtch() pops six registers and returns into fiber_start,
+  // which then sees a null return address and an ABI-aligned stack.
+  u64 *sp = (u64*)(((uptr)f->stack + stack_size) & ~15ul) - 8;
+  memset(sp, 0, 8 * sizeof(*sp));
+  sp[6] = (u64)fiber_start;
+  f->sp = sp;
+  nfibers++;
+  return f;
+}
+
+int
+fiber_run(int n, void (*fn)(void *), void *arg)
+{
+  if (n < 1 || n > max_workers)
+    return -1;
+  nworkers = n;
+  done = false;
+
+  for (int i = 0; i < n; i++) {
+    worker *w = &workers[i];
+    w->id = i;
+    w->head = w->tail = nullptr;
+    w->nrun = 0;
+    w->idle = false;
+    w->io_sleeping = false;
+    w->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (w->epfd < 0 || pipe2(w->wakefd, O_NONBLOCK | O_CLOEXEC) < 0)
+      return -1;
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = nullptr;
+    if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wakefd[0], &ev) < 0)
+      return -1;
+
+    memset(&w->ring, 0, sizeof(w->ring));
+    w->ring.sq_entries = w->ring.cq_entries = ring_entries;
+    w->ring.sqes = w->sqes;
+    w->ring.cqes = w->cqes;
+  }
+
+  fiber *f = fiber_alloc(fn, arg);
+  if (!f)
+    return -1;
+  enqueue(&workers[0], f);
+
+  for (int i = 0; i < n; i++) {
+    if (pthread_create(&workers[i].iothread, nullptr, io_main,
+                       &workers[i]) < 0)
+      die("fiber_run: pthread_create failed");
+    if (i > 0 && pthread_create(&workers[i].thread, nullptr, worker_main,
+                                &workers[i]) < 0)
+      die("fiber_run: pthread_create failed");
+  }
+
+  worker_loop(&workers[0]);
+  my_worker = nullptr;
+  setaffinity(-1);
+
+  for (int i = 0; i < n; i++) {
+    if (i > 0)
+      pthread_join(workers[i].thread, nullptr);
+    pthread_join(workers[i].iothread, nullptr);
+    close(workers[i].epfd);
+    close(workers[i].wakefd[0]);
+    close(workers[i].wakefd[1]);
+  }
+  return 0;
+}
+
+int
+fiber_spawn(void (*fn)(void *), void *arg)
+{
+  fiber *f = fiber_alloc(fn, arg);
+  if (!f)
+    return -1;
+  enqueue(myworker(), f);
+  return 0;
+}
+
+fiber_t *
+fiber_self(void)
+{
+  worker *w = myworker();
+  return w ? w->cur : nullptr;
+}
+
+void
+fiber_yield(void)
+{
+  sched(fiber_self(), RUNNABLE);
+}
+
+void
+fiber_exit(void)
+{
+  sched(fiber_self(), DEAD);
+  die("fiber_exit: dead fiber resumed");
+}
+
+int
+fiber_wait(int fd, uint32_t events)
+{
+  fiber *f = fiber_self();
+  struct epoll_event ev;
+  ev.events = events | EPOLLONESHOT;
+  ev.data.ptr = f;
+  f->wait_fd = fd;
+  if (epoll_ctl(myworker()->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+    return -1;
+  sched(f, PARKED);
+  return f->wait_res;
+}
+
+int64_t
+fiber_io(struct io_ring_sqe *sqe)
+{
+  fiber *f = fiber_self();
+  worker *w;
+  // Keep the ops in flight within the completion ring.
+  for (;;) {
+    w = myworker();
+    if (w->ring.sq_tail - w->ring.cq_head < ring_entries)
+      break;
+    fiber_yield();
+  }
+
+  struct io_ring &r = w->ring;
+  sqe->user_data = (u64)f;
+  w->sqes[r.sq_tail & (ring_entries - 1)] = *sqe;
+  asm volatile("" ::: "memory");
+  r.sq_tail = r.sq_tail + 1;
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  if (w->io_sleeping)
+    futex((u64*)&r.sq_tail, FUTEX_WAKE, 1, 0, nullptr, 0);
+
+  // Only this worker reaps the ring, and not until f is switched out.
+  sched(f, PARKED);
+  return f->io_res;
+}
+
+static int64_t
+rw_op(u32 op, int fd, const void *buf, size_t n, off_t off)
+{
+  struct io_ring_sqe sqe;
+  memset(&sqe, 0, sizeof(sqe));
+  sqe.op = op;
+  sqe.fd = fd;
+  sqe.addr = (u64)buf;
+  sqe.len = n;
+  sqe.off = off;
+  return fiber_io(&sqe);
+}
+
+ssize_t
+fiber_read(int fd, void *buf, size_t n)
+{
+  return rw_op(IORING_OP_READ, fd, buf, n, 0);
+}
+
+ssize_t
+fiber_write(int fd, const void *buf, size_t n)
+{
+  return rw_op(IORING_OP_WRITE, fd, buf, n, 0);
+}
+
+ssize_t
+fiber_pread(int fd, void *buf, size_t n, off_t off)
+{
+  return rw_op(IORING_OP_PREAD, fd, buf, n, off);
+}
+
+ssize_t
+fiber_pwrite(int fd, const void *buf, size_t n, off_t off)
+{
+  return rw_op(IORING_OP_PWRITE, fd, buf, n, off);
+}
+
+int
+fiber_fsync(int fd)
+{
+  return rw_op(IORING_OP_FSYNC, fd, nullptr, 0, 0);
+}
@@ -8,6 +8,8 @@
 #include <linux/unistd.h>       // __NR_gettid
 #endif
 
+#include <algorithm>
+#include <atomic>
 #include <memory>
 #include <new>
 #include <utility>
@@ -17,12 +19,14 @@
 #include "log2.hh"
 
 // This allocator strongly weighs its own scalability over other forms
-// of efficiency.  In particular, when memory is freed via a given
-// thread, only that thread can then reuse that memory.  Also, after a
-// page is carved up in to sub-page regions, it can never be used for
-// any other size class (allocations that involve a page or more of
-// memory can be re-partitioned, however).  It also never returns
-// memory to the system.
+// of efficiency.  In particular, memory freed via a given thread goes
+// on that thread's free lists; only sub-page fragments beyond a
+// per-thread limit are handed to other threads, in batches, through a
+// shared depot.  Also, after a page is carved up in to sub-page
+// regions, it can never be used for any other size class (allocations
+// that involve a page or more of memory can be re-partitioned,
+// however).  Large frees return the pages of the freed region to the
+// system with MADV_DONTNEED, but the address space stays reserved.
 
 // == Overall architecture ==
 //
@@ -77,6 +81,28 @@
 // which allocator to free back to using the pointer's alignment: if
 // it is page-aligned it must have come from the large allocator;
 // otherwise it must have come from the small allocator.
+//
+// == Huge-page arenas ==
+//
+// Once a thread's large allocator has mapped HUGE_PGSIZE bytes, it
+// maps further memory as HUGE_PGSIZE-aligned arenas of at least
+// HUGE_PGSIZE bytes and carves size classes out of them, so the kernel
+// can back a large heap with 2MB pages.  Small heaps stay on
+// min_map_bytes mappings so they don't pay for 2MB of memory.
+//
+// == Returning memory ==
+//
+// When a large allocation of at least TRIM_BYTES is freed, its pages
+// are released with madvise(MADV_DONTNEED), except for the first page
+// of each free run, which holds the run's free-list link.  The next
+// allocation of those pages faults in zero-filled memory.
+//
+// A thread that frees more than LOCAL_FRAGMENTS fragments of one size
+// class (say, a consumer freeing what a producer allocated) moves
+// DEPOT_BATCH of them to a global per-class depot, which holds about
+// DEPOT_MAX_BATCHES batches at most.  A thread whose free list runs dry takes a
+// whole batch from the depot before carving up a new page.  Only batch
+// heads are touched under the depot lock.
 
 // Uncomment to enable additional debugging.
 //#define UMALLOC_DEBUG
@@ -95,6 +121,16 @@ namespace {
   // Must be >= 4096 and a valid size class
   size_t min_map_bytes = 256 * 1024;
 
+  // Large frees of at least this many bytes are returned to the system
+  enum { TRIM_BYTES = 64 * 1024 };
+
+  // Large page size; see "Huge-page arenas" above
+  enum { HUGE_PGSIZE = 2 * 1024 * 1024 };
+
+  // Fragment depot limits (see "Returning memory" above)
+  enum { DEPOT_BATCH = 32, LOCAL_FRAGMENTS = 2 * DEPOT_BATCH,
+         DEPOT_MAX_BATCHES = 64 };
+
   pid_t gettid()
   {
 #if defined(XV6_USER)
@@ -391,7 +427,10 @@ namespace {
 
   // Add a free run of size bytes starting at run.  The run must not
   // be on any free list or contained within any run on any free list.
-  void add_free_run(void *run, size_t bytes)
+  // The pages of [trim_lo, trim_hi) are returned to the system, except
+  // the heads of the free runs this creates.
+  void add_free_run(void *run, size_t bytes,
+                    void *trim_lo = nullptr, void *trim_hi = nullptr)
   {
     assert(bytes >= PGSIZE);
     assert(bytes % PGSIZE == 0);
@@ -413,6 +452,12 @@ namespace {
         pages.fill(it, nextit, page_info(-tid));
         it = nextit;
       }
+      if (trim_lo) {
+        char *lo = std::max((char*)run + PGSIZE, (char*)trim_lo);
+        char *hi = std::min((char*)run + fbytes, (char*)trim_hi);
+        if (lo < hi)
+          madvise(lo, hi - lo, MADV_DONTNEED);
+      }
       run = (char*)run + fbytes;
       assert((uintptr_t)run % PGSIZE == 0);
       assert(idx(run) == it.index());
@@ -446,6 +491,40 @@ namespace {
     return run;
   }
 
+  // Bytes the large allocator of this thread has mapped
+  __thread size_t large_mapped_bytes;
+
+  // Map bytes of fresh memory for the large allocator.  Multiples of
+  // HUGE_PGSIZE are aligned to HUGE_PGSIZE.
+  void *map_large(size_t bytes)
+  {
+    void *p;
+    if (bytes % HUGE_PGSIZE) {
+      p = mmap(0, bytes, PROT_READ|PROT_WRITE,
+               MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    } else {
+      // Over-map and cut off the unaligned ends
+      size_t over = bytes + HUGE_PGSIZE - PGSIZE;
+      char *m = (char*)mmap(0, over, PROT_READ|PROT_WRITE,
+                            MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+      if (m == MAP_FAILED)
+        return MAP_FAILED;
+      char *aligned = (char*)(((uintptr_t)m + HUGE_PGSIZE - 1) &
+                              ~(uintptr_t)(HUGE_PGSIZE - 1));
+      if (aligned != m)
+        munmap(m, aligned - m);
+      if (aligned + bytes != m + over)
+        munmap(aligned + bytes, m + over - (aligned + bytes));
+      p = aligned;
+#ifdef MADV_HUGEPAGE
+      madvise(p, bytes, MADV_HUGEPAGE);
+#endif
+    }
+    if (p != MAP_FAILED)
+      large_mapped_bytes += bytes;
+    return p;
+  }
+
   // Allocate bytes bytes from the large allocator.
   void *alloc_large(size_t bytes)
   {
@@ -460,13 +539,16 @@ namespace {
     // Can't satisfy request.  Get more pages from the system.
     size_t map_bytes = class_max_size(sc);
     size_t map_sc = sc;
-    if (map_bytes < min_map_bytes) {
-      map_bytes = min_map_bytes;
+    size_t min_bytes = min_map_bytes;
+    if (large_mapped_bytes >= HUGE_PGSIZE && min_bytes < HUGE_PGSIZE)
+      // The heap is big enough to use huge-page arenas
+      min_bytes = HUGE_PGSIZE;
+    if (map_bytes < min_bytes) {
+      map_bytes = min_bytes;
       map_sc = size_to_class(map_bytes);
       assert(class_max_size(map_sc) == map_bytes);
     }
-    void *run = mmap(0, map_bytes, PROT_READ|PROT_WRITE,
-                     MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    void *run = map_large(map_bytes);
     if (run == MAP_FAILED)
       return nullptr;
     pdebug("alloc_large mapped %p for class %zu\n", run, map_sc);
@@ -527,7 +609,11 @@ namespace {
     // should be a way to avoid this.
     pdebug("free_large %p of %lu pages (expanded %p %lu pages)\n",
            ptr, end - start, idx_to_ptr(pre.index()), post - pre);
-    add_free_run(idx_to_ptr(pre.index()), (post - pre) * PGSIZE);
+    if ((end - start) * PGSIZE >= TRIM_BYTES)
+      add_free_run(idx_to_ptr(pre.index()), (post - pre) * PGSIZE,
+                   ptr, idx_to_ptr(end.index()));
+    else
+      add_free_run(idx_to_ptr(pre.index()), (post - pre) * PGSIZE);
   }
 
   // Get the allocated size of the large allocation at ptr.
@@ -553,6 +639,88 @@ namespace {
   // must be at least sizeof(block_list::block), so the smaller
   // classes are unused.
   __thread block_list free_fragments[13] = {};
+  __thread size_t nfree_fragments[13];
+
+  // A batch of fragments in the depot.  This overlays the first
+  // fragment of the batch; the rest are chained through next.
+  struct depot_batch
+  {
+    depot_batch *next_batch;
+    block_list::block *rest;
+  };
+  static_assert(sizeof(depot_batch) <= sizeof(block_list::block),
+                "depot_batch doesn't fit in a fragment");
+
+  // Fragment batches handed between threads, by size class
+  struct fragment_depot
+  {
+    std::atomic<bool> lock;
+    depot_batch *batches;
+    size_t nbatches;
+
+    void acquire()
+    {
+      while (lock.exchange(true, std::memory_order_acquire))
+        ;
+    }
+
+    void release()
+    {
+      lock.store(false, std::memory_order_release);
+    }
+  } depot[13];
+
+  // Move DEPOT_BATCH fragments of class sc from this thread's free
+  // list to the depot, unless the depot is full.
+  void depot_put(size_t sc)
+  {
+    depot[sc].acquire();
+    bool full = depot[sc].nbatches >= DEPOT_MAX_BATCHES;
+    depot[sc].release();
+    if (full)
+      return;
+
+    // Build the batch without holding the lock
+    depot_batch *b = static_cast<depot_batch*>(free_fragments[sc].pop(sc));
+    block_list::block *rest = nullptr;
+    for (int i = 1; i < DEPOT_BATCH; ++i) {
+      auto f = static_cast<block_list::block*>(free_fragments[sc].pop(sc));
+      f->next = rest;
+      rest = f;
+    }
+    b->rest = rest;
+    nfree_fragments[sc] -= DEPOT_BATCH;
+
+    depot[sc].acquire();
+    b->next_batch = depot[sc].batches;
+    depot[sc].batches = b;
+    depot[sc].nbatches++;
+    depot[sc].release();
+  }
+
+  // Move a batch of fragments of class sc from the depot to this
+  // thread's free list.  Returns false if the depot is empty.
+  bool depot_get(size_t sc)
+  {
+    depot[sc].acquire();
+    depot_batch *b = depot[sc].batches;
+    if (b) {
+      depot[sc].batches = b->next_batch;
+      depot[sc].nbatches--;
+    }
+    depot[sc].release();
+    if (!b)
+      return false;
+
+    for (block_list::block *f = b->rest, *next; f; f = next) {
+      next = f->next;
+      free_fragments[sc].push(f, sc);
+    }
+    free_fragments[sc].push(b, sc);
+    nfree_fragments[sc] += DEPOT_BATCH;
+    pdebug("alloc_small took a batch of class %zu from the depot\n", sc);
+    return true;
+  }
 
   // Header for pages owned by the small allocator.  Following this
   // header, a page is divided into equal-size fragments.
@@ -574,7 +742,7 @@ namespace {
 
     // Check for a free fragment
     size_t sc = size_to_class(bytes);
-    if (!free_fragments[sc]) {
+    if (!free_fragments[sc] && !depot_get(sc)) {
       // There are no free fragments of this size.  Get a page from
       // the large allocator and chop it up.
       void *page = alloc_large(PGSIZE);
@@ -594,10 +762,12 @@ namespace {
       int i = 0;
       for (; fragment <= last; fragment += sbytes, ++i)
         free_fragments[sc].push(fragment, sc);
+      nfree_fragments[sc] += i;
       pdebug("alloc_small growing class %zu by %d objects\n", sc, i);
     }
 
     void *ptr = free_fragments[sc].pop(sc);
+    nfree_fragments[sc]--;
     pdebug("alloc_small %zu bytes from class %zu => %p\n", bytes, sc, ptr);
     return ptr;
   }
@@ -610,7 +780,10 @@ namespace {
     if (hdr->magic != PAGE_HDR_MAGIC)
       throw std::runtime_error("Bad free or corrupted page magic");
     pdebug("free_small %p to class %zu\n", ptr, hdr->size_class);
-    free_fragments[hdr->size_class].push(ptr, hdr->size_class);
+    size_t sc = hdr->size_class;
+    free_fragments[sc].push(ptr, sc);
+    if (++nfree_fragments[sc] > LOCAL_FRAGMENTS)
+      depot_put(sc);
   }
 
   // Get the allocated size of the small allocation at ptr.
@@ -0,0 +1,227 @@
+// usage: blkbench [-t threads] [-n txs] [-b blocks] [-m private|shared]
+//                 [-f] [-s] [-w workers] [-M MB] [-v] [image...]
+//
+// Drive the block layer's write paths (see disk.hh) from many host threads,
+// the way the file system's commit pipeline does: each thread writes
+// transactions of blocks blocks, either through a private polling block
+// queue as journal commits do, or through a shared one into the
+// system-wide I/O scheduler as applying transactions does, and with -f
+// flushes the disks' caches after each one. The blocks come from the
+// thread's own part of the disks, at random or (-s) one after another.
+// The disks are the image files, striped with the kernel's disk layout,
+// or a memory disk of MB megabytes; -w gives each disk that many threads
+// to complete I/Os asynchronously. Prints the transaction rate and
+// latencies, and with -v reads the last transaction of each thread back
+// through a read_queue and checks it.
+
+#include "types.h"
+#include "kernel.hh"
+#include "disk.hh"
+#include "hostdisk.hh"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+void initdisk_sched(void);
+
+static int nthreads = ncpu;
+static int ntxs = 1000;
+static int nblocks = 16;
+static bool shared;
+static bool cache_flush;
+static bool sequential;
+static u64 region_blocks;
+
+struct worker
+{
+  pthread_t tid;
+  int id;
+  char *bufs;
+  std::vector<u64> last;        // Block numbers of the last transaction
+  std::vector<u64> lat_ns;
+};
+
+// The contents of block b as thread id writes it in transaction tx.
+static void
+fill(char *buf, int id, int tx, u64 b)
+{
+  u64 *p = (u64 *)buf;
+  for (size_t i = 0; i < BSIZE / sizeof(u64); i++)
+    p[i] = ((u64)id << 48) ^ ((u64)tx << 24) ^ b ^ i;
+}
+
+static void *
+run(void *arg)
+{
+  worker *w = (worker *)arg;
+  u64 base = region_blocks * w->id, next = 0;
+  unsigned seed = w->id + 1;
+  w->lat_ns.reserve(ntxs);
+
+  for (int tx = 0; tx < ntxs; tx++) {
+    w->last.clear();
+    for (int i = 0; i < nblocks; i++) {
+      u64 b;
+      if (sequential)
+        b = base + next++ % region_blocks;
+      else
+        b = base + ((u64)rand_r(&seed) << 16 ^ rand_r(&seed)) % region_blocks;
+      // Keep the blocks of a transaction distinct, as the file system does.
+      if (std::find(w->last.begin(), w->last.end(), b) != w->last.end()) {
+        i--;
+        continue;
+      }
+      w->last.push_back(b);
+      fill(w->bufs + i * BSIZE, w->id, tx, b);
+    }
+
+    u64 start = nsectime();
+    block_queue bq(shared, !shared);
+    for (int i = 0; i < nblocks; i++)
+      bq.write(1, w->bufs + i * BSIZE, BSIZE, w->last[i] * BSIZE);
+    bq.flush();
+    if (cache_flush)
+      for (u32 dev = 0; dev < num_disks(); dev++)
+        disk_flush(dev);
+    w->lat_ns.push_back(nsectime() - start);
+  }
+  return nullptr;
+}
+
+// Read the blocks of w's last transaction back, and compare them with what
+// it wrote.
+static bool
+verify(worker *w)
+{
+  std::vector<char> back(nblocks * BSIZE);
+  read_queue rq;
+  for (int i = 0; i < nblocks; i++)
+    rq.read(&back[i * BSIZE], w->last[i]);
+  rq.submit();
+  rq.wait();
+
+  char want[BSIZE];
+  for (int i = 0; i < nblocks; i++) {
+    fill(want, w->id, ntxs - 1, w->last[i]);
+    if (memcmp(want, &back[i * BSIZE], BSIZE) != 0) {
+      fprintf(stderr, "blkbench: thread %d: block %lu reads back wrong\n",
+              w->id, w->last[i]);
+      return false;
+    }
+  }
+  return true;
+}
+
+static void
+usage(const char *prog)
+{
+  fprintf(stderr, "usage: %s [-t threads] [-n txs] [-b blocks] "
+          "[-m private|shared] [-f] [-s] [-w workers] [-M MB] [-v] "
+          "[image...]\n", prog);
+  exit(2);
+}
+
+int
+main(int argc, char *argv[])
+{
+  u64 mb = 1024;
+  int nworkers = 4;
+  bool check = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "t:n:b:m:fsw:M:v")) != -1) {
+    switch (opt) {
+    case 't':
+      nthreads = atoi(optarg);
+      break;
+    case 'n':
+      ntxs = atoi(optarg);
+      break;
+    case 'b':
+      nblocks = atoi(optarg);
+      break;
+    case 'm':
+      if (strcmp(optarg, "shared") == 0)
+        shared = true;
+      else if (strcmp(optarg, "private") != 0)
+        usage(argv[0]);
+      break;
+    case 'f':
+      cache_flush = true;
+      break;
+    case 's':
+      sequential = true;
+      break;
+    case 'w':
+      nworkers = atoi(optarg);
+      break;
+    case 'M':
+      mb = atoi(optarg);
+      break;
+    case 'v':
+      check = true;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (nthreads < 1 || ntxs < 1 || nblocks < 1 || nworkers < 0 || !mb ||
+      argc - optind > NDISK)
+    usage(argv[0]);
+
+  u64 disk_bytes = mb << 20;
+  if (optind == argc)
+    host_disk_create(nullptr, disk_bytes, nworkers);
+  for (int i = optind; i < argc; i++)
+    host_disk_create(argv[i], disk_bytes, nworkers);
+  initdisk_sched();
+
+  // Whole stripes, so that every region takes the same share of each disk.
+  u64 stripe_blocks = DISK_STRIPE_SIZE / BSIZE;
+  u64 total = disk_bytes / BSIZE / stripe_blocks * stripe_blocks *
+              num_disks();
+  region_blocks = total / nthreads;
+  if (region_blocks < (u64)nblocks)
+    usage(argv[0]);
+
+  std::vector<worker> workers(nthreads);
+  u64 start = nsectime();
+  for (int i = 0; i < nthreads; i++) {
+    workers[i].id = i;
+    workers[i].bufs = kalloc("blkbench", nblocks * BSIZE);
+    if (pthread_create(&workers[i].tid, nullptr, run, &workers[i]) != 0)
+      panic("blkbench: cannot start thread %d", i);
+  }
+  std::vector<u64> lat;
+  for (auto &w : workers) {
+    pthread_join(w.tid, nullptr);
+    lat.insert(lat.end(), w.lat_ns.begin(), w.lat_ns.end());
+  }
+  double secs = (nsectime() - start) / 1e9;
+
+  std::sort(lat.begin(), lat.end());
+  u64 ntotal = lat.size();
+  printf("%d threads, %u disks, %s queues%s: %lu txs in %.3f s, "
+         "%.0f txs/s, %.1f MB/s\n", nthreads, num_disks(),
+         shared ? "shared" : "private", cache_flush ? ", flushed" : "",
+         ntotal, secs, ntotal / secs,
+         ntotal * nblocks * (double)BSIZE / secs / 1e6);
+  printf("latency us: p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+         lat[ntotal / 2] / 1e3, lat[ntotal * 9 / 10] / 1e3,
+         lat[ntotal * 99 / 100] / 1e3, lat.back() / 1e3);
+  disk_print_stats();
+
+  bool ok = true;
+  for (auto &w : workers) {
+    if (check && ok)
+      ok = verify(&w);
+    kfree(w.bufs, nblocks * BSIZE);
+  }
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,348 @@
+// The host's stand-ins for the kernel services that the block layer uses
+// (see libscalefs/include), and disks over image files and memory.
+
+#include "types.h"
+#include "kernel.hh"
+#include "disk.hh"
+#include "kstats.hh"
+#include "lathist.hh"
+#include "proc.hh"
+#include "file.hh"
+#include "hostdisk.hh"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <deque>
+
+int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+struct devsw devsw[NDEV];
+
+DEFINE_PERCPU(struct kstats, mykstats, NO_CRITICAL);
+DEFINE_PERCPU(struct lathists, mylathists, NO_CRITICAL);
+
+void
+cprintf(const char *fmt, ...)
+{
+  va_list ap;
+  va_start(ap, fmt);
+  vprintf(fmt, ap);
+  va_end(ap);
+}
+
+void
+panic(const char *fmt, ...)
+{
+  va_list ap;
+  fflush(stdout);
+  fprintf(stderr, "panic: ");
+  va_start(ap, fmt);
+  vfprintf(stderr, fmt, ap);
+  va_end(ap);
+  fprintf(stderr, "\n");
+  abort();
+}
+
+char *
+kalloc(const char *name, size_t size, int cpu)
+{
+  void *p;
+  if (posix_memalign(&p, PGSIZE, size) != 0)
+    return nullptr;
+  return (char *)p;
+}
+
+void
+kfree(void *p, size_t size)
+{
+  free(p);
+}
+
+void *
+kmalloc(u64 nbytes, const char *name, int cpu)
+{
+  return malloc(nbytes);
+}
+
+void
+kmfree(void *p, u64 nbytes)
+{
+  free(p);
+}
+
+int
+myid(void)
+{
+  return sched_getcpu();
+}
+
+u64
+nsectime(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void
+condvar::sleep_to(struct spinlock *lk, u64 timeout, struct spinlock *lk2)
+{
+  pthread_mutex_lock(&mutex);
+  lk->release();
+  if (lk2)
+    lk2->release();
+  if (timeout) {
+    struct timespec ts = { (time_t)(timeout / 1000000000),
+                           (long)(timeout % 1000000000) };
+    pthread_cond_timedwait(&cond, &mutex, &ts);
+  } else {
+    pthread_cond_wait(&cond, &mutex);
+  }
+  pthread_mutex_unlock(&mutex);
+  lk->acquire();
+  if (lk2)
+    lk2->acquire();
+}
+
+proc *
+myproc(void)
+{
+  static thread_local proc p;
+  return &p;
+}
+
+void
+yield(void)
+{
+  sched_yield();
+}
+
+namespace {
+  struct thread_start {
+    void (*fn)(void*);
+    void *arg;
+  };
+
+  void *
+  thread_main(void *a)
+  {
+    thread_start st = *(thread_start *)a;
+    delete (thread_start *)a;
+    st.fn(st.arg);
+    return nullptr;
+  }
+}
+
+struct proc *
+threadpin(void (*fn)(void*), void *arg, const char *name, int cpu)
+{
+  pthread_t t;
+  auto st = new thread_start{fn, arg};
+  if (pthread_create(&t, nullptr, thread_main, st) != 0)
+    panic("threadpin: cannot start %s", name);
+  pthread_detach(t);
+  return nullptr;
+}
+
+namespace {
+  class host_disk : public disk
+  {
+  public:
+    NEW_DELETE_OPS(host_disk);
+
+    host_disk(const char *path, u64 nbytes, u32 nworkers)
+      : fd_(-1), mem_(nullptr), lock_("host_disk"), cv_("host_disk")
+    {
+      dk_nbytes = nbytes;
+      snprintf(dk_model, sizeof(dk_model), "host %s", path ? "file" : "memory");
+      snprintf(dk_busloc, sizeof(dk_busloc), "%s", path ? path : "memory");
+      snprintf(dk_serial, sizeof(dk_serial), "-");
+      snprintf(dk_firmware, sizeof(dk_firmware), "-");
+
+      if (path) {
+        fd_ = open(path, O_RDWR | O_CREAT, 0666);
+        if (fd_ < 0)
+          panic("host_disk: cannot open %s: %s", path, strerror(errno));
+        struct stat st;
+        if (fstat(fd_, &st) < 0)
+          panic("host_disk: cannot stat %s", path);
+        if (S_ISREG(st.st_mode) && (u64)st.st_size < nbytes &&
+            ftruncate(fd_, nbytes) < 0)
+          panic("host_disk: cannot extend %s to %lu bytes", path, nbytes);
+      } else {
+        mem_ = (char *)mmap(nullptr, nbytes, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                            -1, 0);
+        if (mem_ == MAP_FAILED)
+          panic("host_disk: cannot map %lu bytes", nbytes);
+      }
+
+      for (u32 i = 0; i < nworkers; i++) {
+        pthread_t t;
+        if (pthread_create(&t, nullptr, worker, this) != 0)
+          panic("host_disk: cannot start a worker");
+        workers_.push_back(t);
+      }
+    }
+
+    void readv(kiovec *iov, int iov_cnt, u64 off) override
+    {
+      check(iov, iov_cnt, off);
+      if (mem_) {
+        for (int i = 0; i < iov_cnt; off += iov[i++].iov_len)
+          memcpy(iov[i].iov_base, mem_ + off, iov[i].iov_len);
+        return;
+      }
+      transfer(false, iov, iov_cnt, off);
+    }
+
+    void writev(kiovec *iov, int iov_cnt, u64 off) override
+    {
+      check(iov, iov_cnt, off);
+      if (mem_) {
+        for (int i = 0; i < iov_cnt; off += iov[i++].iov_len)
+          memcpy(mem_ + off, iov[i].iov_base, iov[i].iov_len);
+        return;
+      }
+      transfer(true, iov, iov_cnt, off);
+    }
+
+    void flush() override
+    {
+      if (fd_ >= 0 && fdatasync(fd_) < 0 && errno != EINVAL)
+        panic("host_disk: fdatasync %s: %s", dk_busloc, strerror(errno));
+    }
+
+    void areadv(kiovec *iov, int iov_cnt, u64 off,
+                sref<disk_completion> dc) override
+    {
+      queue(OP_READ, iov, iov_cnt, off, std::move(dc));
+    }
+
+    void awritev(kiovec *iov, int iov_cnt, u64 off,
+                 sref<disk_completion> dc) override
+    {
+      queue(OP_WRITE, iov, iov_cnt, off, std::move(dc));
+    }
+
+    void aflush(sref<disk_completion> dc) override
+    {
+      queue(OP_FLUSH, nullptr, 0, 0, std::move(dc));
+    }
+
+  private:
+    enum { OP_READ, OP_WRITE, OP_FLUSH };
+
+    // An asynchronous I/O. Callers may reuse their kiovec arrays as soon as
+    // the I/O is issued, so it has a copy.
+    struct request {
+      int op;
+      std::vector<kiovec> iov;
+      u64 off;
+      sref<disk_completion> dc;
+    };
+
+    void check(kiovec *iov, int iov_cnt, u64 off)
+    {
+      u64 n = 0;
+      for (int i = 0; i < iov_cnt; i++)
+        n += iov[i].iov_len;
+      if (off + n > dk_nbytes)
+        panic("host_disk: I/O out of range: offset %lu, count %lu", off, n);
+    }
+
+    void transfer(bool write, kiovec *iov, int iov_cnt, u64 off)
+    {
+      // struct kiovec is laid out like struct iovec. Transfers of more than
+      // IOV_MAX vectors are split, as are short ones.
+      static_assert(sizeof(kiovec) == sizeof(struct iovec), "kiovec");
+      std::vector<struct iovec> v((struct iovec *)iov,
+                                  (struct iovec *)iov + iov_cnt);
+      size_t i = 0;
+      while (i < v.size()) {
+        int cnt = std::min(v.size() - i, (size_t)1024);
+        ssize_t r = write ? pwritev(fd_, &v[i], cnt, off)
+                          : preadv(fd_, &v[i], cnt, off);
+        if (r < 0 && errno == EINTR)
+          continue;
+        if (r <= 0)
+          panic("host_disk: %s %s at %lu: %s", write ? "write" : "read",
+                dk_busloc, off, r < 0 ? strerror(errno) : "end of file");
+        off += r;
+        for (; i < v.size() && (size_t)r >= v[i].iov_len; i++)
+          r -= v[i].iov_len;
+        if (r) {
+          v[i].iov_base = (char *)v[i].iov_base + r;
+          v[i].iov_len -= r;
+        }
+      }
+    }
+
+    void queue(int op, kiovec *iov, int iov_cnt, u64 off,
+               sref<disk_completion> dc)
+    {
+      if (workers_.empty()) {
+        if (op == OP_READ)
+          readv(iov, iov_cnt, off);
+        else if (op == OP_WRITE)
+          writev(iov, iov_cnt, off);
+        else
+          flush();
+        dc->notify();
+        return;
+      }
+
+      check(iov, iov_cnt, off);
+      auto l = lock_.guard();
+      requests_.push_back({ op, std::vector<kiovec>(iov, iov + iov_cnt), off,
+                            std::move(dc) });
+      cv_.wake_all();
+    }
+
+    static void *worker(void *arg)
+    {
+      host_disk *d = (host_disk *)arg;
+      for (;;) {
+        d->lock_.acquire();
+        while (d->requests_.empty())
+          d->cv_.sleep(&d->lock_);
+        request r = std::move(d->requests_.front());
+        d->requests_.pop_front();
+        d->lock_.release();
+
+        if (r.op == OP_READ)
+          d->readv(r.iov.data(), r.iov.size(), r.off);
+        else if (r.op == OP_WRITE)
+          d->writev(r.iov.data(), r.iov.size(), r.off);
+        else
+          d->flush();
+        r.dc->notify();
+      }
+      return nullptr;
+    }
+
+    int fd_;
+    char *mem_;
+    spinlock lock_;
+    condvar cv_;
+    std::deque<request> requests_;
+    std::vector<pthread_t> workers_;
+  };
+}
+
+disk *
+host_disk_create(const char *path, u64 nbytes, u32 nworkers)
+{
+  disk *d = new host_disk(path, nbytes, nworkers);
+  disk_register(d);
+  return d;
+}
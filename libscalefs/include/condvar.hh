@@ -0,0 +1,54 @@
+#pragma once
+
+// Host stand-in for the kernel's condvar, over a pthread condition
+// variable.  A sleeper takes the condvar's mutex before it drops the
+// spinlock, and wakers take it too, so that as in the kernel a wakeup
+// issued under the spinlock can't be missed.
+
+#include "types.h"
+#include "spinlock.hh"
+#include <pthread.h>
+
+struct condvar {
+  condvar() { init(); }
+  condvar(const char *name) { init(); }
+  condvar(const condvar &o) = delete;
+  condvar &operator=(const condvar &o) = delete;
+  // Not destroyed: a static condvar is torn down at exit while a
+  // threadpin() thread may still sleep on it, and pthread_cond_destroy()
+  // would wait for that thread forever.
+  ~condvar() {}
+
+  void sleep(struct spinlock *lk, struct spinlock *lk2 = nullptr)
+  {
+    sleep_to(lk, 0, lk2);
+  }
+
+  // Sleep until woken or until nsectime() reaches timeout, if non-zero.
+  void sleep_to(struct spinlock *lk, u64 timeout,
+                struct spinlock *lk2 = nullptr);
+
+  void wake_all(int yield = false, struct proc *callerproc = nullptr)
+  {
+    pthread_mutex_lock(&mutex);
+    pthread_cond_broadcast(&cond);
+    pthread_mutex_unlock(&mutex);
+  }
+
+private:
+  void init()
+  {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&mutex, nullptr);
+  }
+
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+};
+
+// CLOCK_MONOTONIC, in nanoseconds.
+u64             nsectime(void);
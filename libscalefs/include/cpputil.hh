@@ -0,0 +1,77 @@
+#pragma once
+
+// Host stand-in for cpputil.hh, which the host build can't use as is: its
+// kernel half has a std::ostream of its own, which clashes with libstdc++'s.
+// These are the rest of its definitions, unchanged.
+
+#include "kernel.hh"
+
+#include <string.h>
+#include <type_traits>
+#include <utility>
+#include <new>
+
+using std::pair;
+using std::make_pair;
+
+#define NEW_DELETE_OPS(classname)                                   \
+  static void* operator new(unsigned long nbytes,                   \
+                            const std::nothrow_t&) noexcept {       \
+    assert(nbytes == sizeof(classname));                            \
+    return kmalloc(sizeof(classname), #classname);                  \
+  }                                                                 \
+                                                                    \
+  static void* operator new(unsigned long nbytes) {                 \
+    void *p = classname::operator new(nbytes, std::nothrow);        \
+    if (p == nullptr)                                               \
+      throw_bad_alloc();                                            \
+    return p;                                                       \
+  }                                                                 \
+                                                                    \
+  static void* operator new(unsigned long nbytes, classname *buf) { \
+    assert(nbytes == sizeof(classname));                            \
+    return buf;                                                     \
+  }                                                                 \
+                                                                    \
+  static void operator delete(void *p,                              \
+                              const std::nothrow_t&) noexcept {     \
+    kmfree(p, sizeof(classname));                                   \
+  }                                                                 \
+                                                                    \
+  static void operator delete(void *p) {                            \
+    classname::operator delete(p, std::nothrow);                    \
+  }
+
+template<class T>
+class scoped_cleanup_obj {
+ private:
+  T handler_;
+  bool active_;
+
+ public:
+  scoped_cleanup_obj(const T& h) : handler_(h), active_(true) {};
+  ~scoped_cleanup_obj() { if (active_) handler_(); }
+  void dismiss() { active_ = false; }
+
+  void operator=(const scoped_cleanup_obj&) = delete;
+  scoped_cleanup_obj(const scoped_cleanup_obj&) = delete;
+  scoped_cleanup_obj(scoped_cleanup_obj&& other) :
+    handler_(other.handler_), active_(other.active_) { other.dismiss(); }
+};
+
+template<class T>
+scoped_cleanup_obj<T>
+scoped_cleanup(const T& h)
+{
+  return scoped_cleanup_obj<T>(h);
+}
+
+static void inline
+throw_bad_alloc()
+{
+#if EXCEPTIONS
+  throw std::bad_alloc();
+#else
+  panic("bad alloc");
+#endif
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+// Host stand-in for file.hh: the device switch, which host code registers
+// device handlers in like the kernel does, although nothing reads them.
+
+#include "types.h"
+
+struct mdev;
+struct stat;
+
+struct devsw {
+  int (*read)(mdev*, char*, u32);
+  int (*pread)(mdev*, char*, u32, u32);
+  int (*write)(mdev*, const char*, u32);
+  int (*pwrite)(mdev*, const char*, u32, u32);
+  void (*stat)(mdev*, struct stat*);
+};
+
+extern struct devsw devsw[];
@@ -0,0 +1,16 @@
+#pragma once
+
+// Disks for the host build of the block layer (see libscalefs/Makefrag).
+
+#include "types.h"
+
+class disk;
+
+// A disk of nbytes backed by the image file at path, which is created or
+// extended as needed, or by anonymous memory if path is null.
+// Asynchronous I/Os are queued to nworkers threads of the disk's own,
+// which do them with preadv()/pwritev() (or memcpy()) and notify their
+// completions, as a disk's interrupt would; with no workers, they
+// complete before areadv()/awritev()/aflush() return. Flushes are
+// fdatasync()s. The disk is registered with disk_register().
+disk *host_disk_create(const char *path, u64 nbytes, u32 nworkers);
@@ -0,0 +1,35 @@
+#pragma once
+
+// Host stand-in for the kernel's kernel.hh: just the parts of the kernel's
+// runtime that the block layer uses, on top of libc.  See
+// libscalefs/Makefrag.
+
+#include "types.h"
+#include "mmu.h"
+#include "fs.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <cassert>
+#include <atomic>
+#include "ref.hh"
+
+void            cprintf(const char*, ...) __attribute__((format(printf, 1, 2)));
+void            panic(const char*, ...)
+                  __attribute__((noreturn, format(printf, 1, 2)));
+
+char*           kalloc(const char *name, size_t size = PGSIZE, int cpu = -1);
+void            kfree(void*, size_t size = PGSIZE);
+void*           kmalloc(u64 nbytes, const char *name, int cpu = -1);
+void            kmfree(void*, u64 nbytes);
+
+// The host's core count, for loops over the "cores", and the one this
+// thread happens to be running on.
+extern int      ncpu;
+int             myid(void);
+
+// Start a thread running fn(arg); the host doesn't pin it to cpu.
+struct proc*    threadpin(void (*fn)(void*), void *arg, const char *name,
+                          int cpu);
+
+#include "cpputil.hh"
+#include "condvar.hh"
@@ -0,0 +1,6 @@
+#pragma once
+
+// Host stand-in for mmu.h: the page size, which is a block.
+
+#define PGSIZE          4096
+#define PGROUNDUP(a)    (((a)+PGSIZE-1) & ~(PGSIZE-1))
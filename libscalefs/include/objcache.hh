@@ -0,0 +1,6 @@
+#pragma once
+
+// Host stand-in for objcache.hh: objects that the kernel allocates from
+// per-class object caches come straight from kmalloc(), that is, malloc().
+
+#define NEW_DELETE_OPS_CACHED(classname) NEW_DELETE_OPS(classname)
@@ -0,0 +1,16 @@
+#pragma once
+
+// Host stand-in for proc.hh: each thread has a proc of its own, with just
+// the fields the block layer touches.
+
+#include "types.h"
+#include "disktrace.h"
+
+struct proc {
+  u8 disk_tag;
+
+  proc() : disk_tag(DISKTRACE_OTHER) {}
+};
+
+proc *myproc(void);
+void yield(void);
@@ -0,0 +1,20 @@
+#pragma once
+
+// Host stand-in for spercpu.hh: each thread stands in for a core, so a
+// per-CPU variable is a thread_local one, that * and -> reach as they
+// reach the current core's copy in the kernel.
+
+template<class T>
+struct host_percpu
+{
+  T v;
+  T *get() { return &v; }
+  T *get_unchecked() { return &v; }
+  T &operator*() { return v; }
+  T *operator->() { return &v; }
+};
+
+#define DECLARE_PERCPU(type, name, ...) \
+  extern thread_local host_percpu<type> name
+#define DEFINE_PERCPU(type, name, ...) \
+  thread_local host_percpu<type> name
@@ -0,0 +1,84 @@
+#pragma once
+
+// Host stand-in for the kernel's spinlock: a test-and-test-and-set lock on
+// an atomic flag, which spins with pause like the real one, but has no
+// interrupts to disable and no lockstat to count.
+
+#include <atomic>
+#include "amd64.h"
+
+template<class Lock>
+class lock_guard
+{
+public:
+  lock_guard(Lock *l) : l_(l)
+  {
+    l_->acquire();
+  }
+  constexpr lock_guard() : l_(nullptr) { }
+  ~lock_guard()
+  {
+    release();
+  }
+  lock_guard(const lock_guard &) = delete;
+  lock_guard &operator=(const lock_guard &) = delete;
+  lock_guard(lock_guard &&o) : l_(o.l_)
+  {
+    o.l_ = nullptr;
+  }
+
+  // Explicitly release the lock held by this ::lock_guard.
+  void release()
+  {
+    if (l_)
+      l_->release();
+    l_ = nullptr;
+  }
+
+private:
+  Lock *l_;
+};
+
+struct spinlock {
+  constexpr spinlock() : locked(false), name("") {}
+  constexpr spinlock(const char *name, bool lockstat = false)
+    : locked(false), name(name) {}
+  spinlock(const spinlock &o) = delete;
+  spinlock &operator=(const spinlock &o) = delete;
+
+  void acquire()
+  {
+    for (;;) {
+      if (!locked.exchange(true, std::memory_order_acquire))
+        return;
+      while (locked.load(std::memory_order_relaxed))
+        nop_pause();
+    }
+  }
+
+  bool try_acquire()
+  {
+    return !locked.load(std::memory_order_relaxed) &&
+      !locked.exchange(true, std::memory_order_acquire);
+  }
+
+  void release()
+  {
+    locked.store(false, std::memory_order_release);
+  }
+
+  bool holding() const
+  {
+    return locked.load(std::memory_order_relaxed);
+  }
+
+  lock_guard<spinlock> guard()
+  {
+    return lock_guard<spinlock>(this);
+  }
+
+  std::atomic<bool> locked;
+  const char *name;
+};
+
+typedef lock_guard<spinlock> scoped_acquire;
@@ -173,6 +173,9 @@ public:
     bool apic : 1;              // "APIC on chip"
     bool ds : 1;                // Debug store
 
+    // 7.EBX
+    bool erms : 1;              // Enhanced rep movsb/stosb
+
     // 80000001.EDX
     bool page1GB : 1;
     bool rdtscp : 1;            // Is rdtscp supported
@@ -153,6 +153,41 @@ private:
   T *ptr_;
 };
 
+// A borrowed reference: a pointer to an object that someone else holds
+// an sref to, for passing down call chains without touching the
+// reference count.  It's valid for as long as the sref it was borrowed
+// from; for objects freed through gc, such as inodes, the memory also
+// stays around until the end of the current gc epoch, but the object
+// may already be dead by then.  Use ref() to keep the object past the
+// lender's sref.  Like a string_view, one borrowed from a temporary
+// sref is only good until the end of the full expression.
+template<class T>
+class borrowed {
+public:
+  constexpr borrowed() noexcept : ptr_(nullptr) { }
+  borrowed(const sref<T> &o) noexcept : ptr_(o.get()) { }
+  template<typename U, typename = typename
+           std::enable_if<std::is_convertible<U*, T*>::value>::type>
+  borrowed(const sref<U> &o) noexcept : ptr_(o.get()) { }
+
+  // Take a reference of our own.
+  sref<T> ref() const { return sref<T>::newref(ptr_); }
+
+  bool operator==(borrowed o) const { return ptr_ == o.ptr_; }
+  bool operator!=(borrowed o) const { return ptr_ != o.ptr_; }
+  bool operator==(const sref<T> &o) const { return ptr_ == o.get(); }
+  bool operator!=(const sref<T> &o) const { return ptr_ != o.get(); }
+
+  explicit operator bool() const noexcept { return !!ptr_; }
+
+  T * operator->() const noexcept { return ptr_; }
+  T & operator*() const noexcept { return *ptr_; }
+  T * get() const noexcept { return ptr_; }
+
+private:
+  T *ptr_;
+};
+
 template<typename T, typename... Args>
 sref<T> make_sref(Args&&... args)
 {
@@ -167,6 +202,23 @@ public:
   // The number of valid references is:
   //   ref_.invalid ? 0 : ref_.count+1;
 
+#ifdef __SANITIZE_THREAD__
+  // ThreadSanitizer can't see the atomicity of the asm versions below, so
+  // it would report every object freed by its last dec() as a race.
+  inline void inc() {
+    __atomic_fetch_add(&ref_.v, 1, __ATOMIC_SEQ_CST);
+  }
+
+  inline bool tryinc() {
+    __atomic_fetch_add(&ref_.count, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&ref_.invalid, __ATOMIC_SEQ_CST) == 0;
+  }
+
+  inline void dec() {
+    if ((int64_t)__atomic_sub_fetch(&ref_.v, 1, __ATOMIC_SEQ_CST) < 0)
+      onzero();
+  }
+#else
   inline void inc() {
     asm volatile("lock; incq %0" : "+m" (ref_.v) :: "memory", "cc");
   }
@@ -191,6 +243,7 @@ public:
     if (c)
       onzero();
   }
+#endif
 
   uint64_t get_consistent() const {
     return ref_.invalid ? 0 : (ref_.count + 1);
@@ -22,6 +22,7 @@
 #define fstatx(a, b, c) fstat((a), (b))
 
 #define SOCK_DGRAM_UNORDERED SOCK_DGRAM
+#define SOCK_ANYFD 0
 
 #include <time.h>
 static inline void nsleep(unsigned long long nsecs)
@@ -0,0 +1,422 @@
+/* Word count over input files in the file system, with per-core output.
+ *
+ * Unlike wrmem, which makes up its input in anonymous memory, this mmaps
+ * the files dir/in.0 .. dir/in.(n-1), so the map phase faults the input in
+ * through the page cache (and its readahead), and after the MapReduce each
+ * core writes its share of the sorted <word, count> pairs to a file of its
+ * own, dir/out.<core>, and fsyncs it.  With -g it first writes the input
+ * files, of random words, and fsyncs them; with -e it drops the page and
+ * buffer caches before mapping them, so that they come in from the disk.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <ctype.h>
+#include <time.h>
+#include <strings.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sched.h>
+#include "mr-sched.h"
+#include "bench.h"
+
+enum { max_key_len = 256 };
+enum { max_files = 64 };
+enum { io_chunk = 64 * 1024 };
+
+typedef struct {
+    char *fdata;
+    uint64_t flen;
+} wc_file_t;
+
+typedef struct {
+    wc_file_t files[max_files];
+    int nfiles;
+    int cur;			/* file the next split comes from */
+    uint64_t fpos;		/* and where in it */
+    uint64_t split_size;
+    int nsplits;
+    pthread_mutex_t mu;
+} wc_data_t;
+
+typedef struct {
+    const char *dir;
+    final_data_kv_t *vals;
+    int core;
+    int ncores;
+    uint64_t bytes;
+    uint64_t fsync_time;
+} wc_out_t;
+
+static int
+is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == 0;
+}
+
+/* Divide the input on word borders; splits don't span files. */
+static int
+wc_splitter(void *arg, split_t * out, int ncores)
+{
+    wc_data_t *data = (wc_data_t *) arg;
+    assert(arg && out);
+    pthread_mutex_lock(&data->mu);
+    if (data->split_size == 0) {
+	uint64_t total = 0;
+	if (data->nsplits == 0)
+	    data->nsplits = ncores * def_nsplits_per_core;
+	for (int i = 0; i < data->nfiles; i++)
+	    total += data->files[i].flen;
+	data->split_size = max(total / data->nsplits, 1);
+    }
+    while (data->cur < data->nfiles &&
+	   data->fpos >= data->files[data->cur].flen) {
+	data->cur++;
+	data->fpos = 0;
+    }
+    /* EOF, return FALSE for no more data */
+    if (data->cur == data->nfiles) {
+	pthread_mutex_unlock(&data->mu);
+	return 0;
+    }
+    wc_file_t *f = &data->files[data->cur];
+    out->data = (void *) &f->fdata[data->fpos];
+    out->length = data->split_size;
+    if (data->fpos + out->length > f->flen)
+	out->length = f->flen - data->fpos;
+
+    /* set the length to end at a space */
+    for (data->fpos += out->length;
+	 data->fpos < f->flen && !is_space(f->fdata[data->fpos]);
+	 data->fpos++, out->length++) ;
+
+    pthread_mutex_unlock(&data->mu);
+    return 1;
+}
+
+/* Go through the allocated portion of the input and count the words. */
+static void
+wc_map(split_t * args)
+{
+    enum { IN_WORD, NOT_IN_WORD };
+    int state = NOT_IN_WORD;
+    assert(args);
+    char *data = (char *) args->data;
+    assert(data);
+    char tmp_key[max_key_len];
+    int ilen = 0;
+    for (uint32_t i = 0; i < args->length; i++) {
+	char curr_ltr = toupper(data[i]);
+	switch (state) {
+	case IN_WORD:
+	    if ((curr_ltr < 'A' || curr_ltr > 'Z') && curr_ltr != '\'') {
+		tmp_key[ilen] = 0;
+		mr_map_emit(tmp_key, (void *) 1, ilen);
+		state = NOT_IN_WORD;
+	    } else {
+		tmp_key[ilen++] = curr_ltr;
+		assert(ilen < max_key_len);
+	    }
+	    break;
+	default:
+	    if (curr_ltr >= 'A' && curr_ltr <= 'Z') {
+		tmp_key[0] = curr_ltr;
+		ilen = 1;
+		state = IN_WORD;
+	    }
+	    break;
+	}
+    }
+
+    /* add the last word */
+    if (state == IN_WORD) {
+	tmp_key[ilen] = 0;
+	mr_map_emit(tmp_key, (void *) 1, ilen);
+    }
+}
+
+static void *
+wc_vm(void *oldv, void *newv, int isnew)
+{
+    if (isnew)
+	return newv;
+    return (void *) ((uint64_t) oldv + (uint64_t) newv);
+}
+
+static void *
+keycopy(void *src, size_t s)
+{
+    char *key;
+    assert(key = malloc(s + 1));
+    memcpy(key, src, s);
+    key[s] = 0;
+    return key;
+}
+
+static void
+do_mapreduce(int nprocs, int nsplits, int reduce_tasks, wc_data_t * wc_data,
+	     final_data_kv_t * wc_vals)
+{
+    mr_param_t mr_param;
+    wc_data->cur = 0;
+    wc_data->fpos = 0;
+    wc_data->split_size = 0;
+    wc_data->nsplits = nsplits;
+    pthread_mutex_init(&wc_data->mu, 0);
+
+    memset(&mr_param, 0, sizeof(mr_param_t));
+    memset(wc_vals, 0, sizeof(*wc_vals));
+    mr_param.nr_cpus = nprocs;
+    mr_param.app_arg.atype = atype_mapreduce;
+    mr_param.app_arg.mapreduce.results = wc_vals;
+    mr_param.app_arg.mapreduce.reduce_tasks = reduce_tasks;
+    mr_param.app_arg.mapreduce.vm = wc_vm;
+    // No outcmp: the results come out sorted by word, which splits them
+    // evenly between the output files.
+    mr_param.app_arg.mapreduce.outcmp = NULL;
+    mr_param.keycopy = keycopy;
+    mr_param.map_func = wc_map;
+    mr_param.part_func = NULL;
+    mr_param.key_cmp = (key_cmp_t) strcmp;
+    mr_param.split_func = wc_splitter;
+    mr_param.split_arg = wc_data;
+    assert(mr_run_scheduler(&mr_param) == 0);
+}
+
+/* Write nbytes of random words of wordlen letters to path, and fsync it. */
+static void
+generate(const char *path, uint64_t nbytes, int wordlen, uint32_t seed)
+{
+    static char buf[io_chunk];
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+	eprint("wcfile: cannot create %s\n", path);
+    for (uint64_t off = 0; off < nbytes; off += sizeof(buf)) {
+	size_t n = min(sizeof(buf), nbytes - off);
+	for (size_t i = 0; i < n; i++) {
+	    if ((off + i + 1) % (wordlen + 1))
+		buf[i] = rnd(&seed) % 26 + 'A';
+	    else
+		buf[i] = ' ';
+	}
+	if (write(fd, buf, n) != (ssize_t) n)
+	    eprint("wcfile: write %s failed\n", path);
+    }
+    if (fsync(fd) < 0)
+	eprint("wcfile: fsync %s failed\n", path);
+    close(fd);
+}
+
+static void
+evict_caches(void)
+{
+#ifdef XV6_USER
+    int fd = open("/dev/evict_caches", O_WRONLY);
+    if (fd < 0)
+	eprint("wcfile: cannot open /dev/evict_caches\n");
+    // Both caches, so the map phase reads the input from the disk; the
+    // kernel's evict_caches() says why in this order.
+    assert(write(fd, "2", 1) == 1);
+    assert(write(fd, "1", 1) == 1);
+    close(fd);
+#else
+    sync();
+    int fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd < 0 || write(fd, "3", 1) != 1)
+	eprint("wcfile: cannot drop caches\n");
+    close(fd);
+#endif
+}
+
+/* Write this core's share of the results to dir/out.<core>, and fsync it. */
+static void *
+output_worker(void *arg)
+{
+    wc_out_t *o = (wc_out_t *) arg;
+    char path[256];
+    char *buf = malloc(io_chunk);
+    assert(buf);
+    affinity_set(o->core);
+    snprintf(path, sizeof(path), "%s/out.%d", o->dir, o->core);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+	eprint("wcfile: cannot create %s\n", path);
+
+    size_t start = o->vals->length * o->core / o->ncores;
+    size_t end = o->vals->length * (o->core + 1) / o->ncores;
+    size_t used = 0;
+    for (size_t i = start; i < end; i++) {
+	keyval_t *kv = &o->vals->data[i];
+	if (used + max_key_len + 32 > io_chunk) {
+	    if (write(fd, buf, used) != (ssize_t) used)
+		eprint("wcfile: write %s failed\n", path);
+	    o->bytes += used;
+	    used = 0;
+	}
+	used += snprintf(buf + used, io_chunk - used, "%s %" PRIu64 "\n",
+			 (char *) kv->key, (uint64_t) kv->val);
+    }
+    if (used && write(fd, buf, used) != (ssize_t) used)
+	eprint("wcfile: write %s failed\n", path);
+    o->bytes += used;
+
+    uint64_t t0 = read_tsc();
+    if (fsync(fd) < 0)
+	eprint("wcfile: fsync %s failed\n", path);
+    o->fsync_time = read_tsc() - t0;
+    close(fd);
+    free(buf);
+    return NULL;
+}
+
+/* Write the results with one thread per core; returns the bytes written. */
+static uint64_t
+write_output(const char *dir, final_data_kv_t * wc_vals, int ncores)
+{
+    wc_out_t *outs = calloc(ncores, sizeof(*outs));
+    pthread_t *tids = calloc(ncores, sizeof(*tids));
+    assert(outs && tids);
+    uint64_t t0 = read_tsc();
+    for (int i = 0; i < ncores; i++) {
+	outs[i].dir = dir;
+	outs[i].vals = wc_vals;
+	outs[i].core = i;
+	outs[i].ncores = ncores;
+	tids[i] = pthread_start(output_worker, (uintptr_t) & outs[i]);
+    }
+    uint64_t bytes = 0, max_fsync = 0;
+    for (int i = 0; i < ncores; i++) {
+	assert(pthread_join(tids[i], NULL) == 0);
+	bytes += outs[i].bytes;
+	max_fsync = max(max_fsync, outs[i].fsync_time);
+    }
+    uint64_t t = read_tsc() - t0;
+    printf("Output: %" PRIu64 " bytes to %d files in %" PRIu64
+	   " ms (slowest fsync %" PRIu64 " ms)\n", bytes, ncores,
+	   t * 1000 / get_cpu_freq(), max_fsync * 1000 / get_cpu_freq());
+    free(outs);
+    free(tids);
+    return bytes;
+}
+
+static inline void
+wc_usage(char *prog)
+{
+    printf("usage: %s [options] dir\n", prog);
+    printf("options:\n");
+    printf
+	("  -p #procs : # of processors to use (use all cores by default)\n");
+    printf
+	("  -m #map tasks : # of map tasks (16 tasks per core by default)\n");
+    printf
+	("  -r #reduce tasks : # of reduce tasks (determined by sampling by default)\n");
+    printf("  -n #files : # of input files dir/in.N (1 by default)\n");
+    printf("  -g : generate the input files first\n");
+    printf("  -s inputsize : size of each generated file in MB\n");
+    printf("  -w wordlength : letters per generated word (5 by default)\n");
+    printf("  -e : drop the caches before reading the input\n");
+    printf("  -q : quiet output (for batch test)\n");
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    affinity_set(0);
+    final_data_kv_t wc_vals;
+    static wc_data_t wc_data;
+    int nprocs = 0, map_tasks = 0, reduce_tasks = 0, quiet = 0;
+    int nfiles = 1, gen = 0, evict = 0, wordlen = 5;
+    uint64_t filesize = 1024ULL * 1024 * 1024;
+    char path[256];
+    int c;
+    while ((c = getopt(argc, argv, "p:m:r:n:gs:w:eq")) != -1) {
+	switch (c) {
+	case 'p':
+	    nprocs = atoi(optarg);
+	    printf("# --cores=%d\n", nprocs);
+	    break;
+	case 'm':
+	    map_tasks = atoi(optarg);
+	    break;
+	case 'r':
+	    reduce_tasks = atoi(optarg);
+	    break;
+	case 'n':
+	    nfiles = atoi(optarg);
+	    break;
+	case 'g':
+	    gen = 1;
+	    break;
+	case 's':
+	    filesize = atol(optarg) * 1024 * 1024;
+	    break;
+	case 'w':
+	    wordlen = atoi(optarg);
+	    break;
+	case 'e':
+	    evict = 1;
+	    break;
+	case 'q':
+	    quiet = 1;
+	    break;
+	default:
+	    wc_usage(argv[0]);
+	    break;
+	}
+    }
+    if (optind != argc - 1 || nfiles < 1 || nfiles > max_files ||
+	wordlen < 1 || wordlen >= max_key_len || filesize == 0)
+	wc_usage(argv[0]);
+    const char *dir = argv[optind];
+
+    if (gen) {
+	uint64_t t0 = read_tsc();
+	for (int i = 0; i < nfiles; i++) {
+	    snprintf(path, sizeof(path), "%s/in.%d", dir, i);
+	    generate(path, filesize, wordlen, i + 1);
+	}
+	printf("Input: wrote %d x %" PRIu64 " MB in %" PRIu64 " ms\n",
+	       nfiles, filesize >> 20,
+	       (read_tsc() - t0) * 1000 / get_cpu_freq());
+    }
+    if (evict)
+	evict_caches();
+
+    uint64_t total = 0;
+    int fds[max_files];
+    for (int i = 0; i < nfiles; i++) {
+	struct stat st;
+	snprintf(path, sizeof(path), "%s/in.%d", dir, i);
+	fds[i] = open(path, O_RDONLY);
+	if (fds[i] < 0 || fstat(fds[i], &st) < 0 || st.st_size == 0)
+	    eprint("wcfile: cannot open %s (make it with -g)\n", path);
+	char *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fds[i], 0);
+	if (p == MAP_FAILED)
+	    eprint("wcfile: cannot mmap %s\n", path);
+	wc_data.files[i].fdata = p;
+	wc_data.files[i].flen = st.st_size;
+	total += st.st_size;
+    }
+    wc_data.nfiles = nfiles;
+    printf("# --input=%d files, %" PRIu64 " MB\n", nfiles, total >> 20);
+
+    do_mapreduce(nprocs, map_tasks, reduce_tasks, &wc_data, &wc_vals);
+    mr_print_stats();
+    if (!quiet)
+	printf("wcfile: %zu distinct words\n", wc_vals.length);
+    write_output(dir, &wc_vals, nprocs ? nprocs : (int) get_core_count());
+
+    for (int i = 0; i < nfiles; i++) {
+	assert(munmap(wc_data.files[i].fdata, wc_data.files[i].flen) == 0);
+	close(fds[i]);
+    }
+    free(wc_vals.data);
+    mr_finalize();
+    return 0;
+}
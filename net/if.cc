@@ -1,9 +1,11 @@
 extern "C" {
 #include "lwip/stats.h"
+#include "lwip/ip.h"
 #include "netif/etharp.h"
 }
 
 #include "kernel.hh"
+#include "netdev.hh"
 
 #include <string.h>
 
@@ -33,6 +35,124 @@ low_level_init(struct netif *netif)
   /* Do whatever else is needed to initialize interface. */  
 }
 
+#if !CHECKSUM_GEN_IP && !CHECKSUM_GEN_TCP && \
+  !CHECKSUM_CHECK_IP && !CHECKSUM_CHECK_TCP
+/*
+ * lwIP leaves the IPv4 and TCP checksums to us (see lwipopts.h).  On
+ * transmit the device fills them in if it can, and we do otherwise; on
+ * receive we check whichever ones the device didn't.  Frames are
+ * contiguous here, with the IPv4 header right after the Ethernet one.
+ */
+#define IF_CSUM 1
+
+static u32
+csum_add(const u8 *p, u32 len, u32 sum)
+{
+  for (; len > 1; p += 2, len -= 2)
+    sum += (p[0] << 8) | p[1];
+  if (len)
+    sum += p[0] << 8;
+  return sum;
+}
+
+static u16
+csum_fold(u32 sum)
+{
+  while (sum >> 16)
+    sum = (sum & 0xffff) + (sum >> 16);
+  return sum;
+}
+
+static void
+csum_put(u8 *p, u16 v)
+{
+  p[0] = v >> 8;
+  p[1] = v;
+}
+
+// The sum of the pseudo-header for l4len bytes of proto after the
+// IPv4 header ip.
+static u32
+pseudo_sum(const u8 *ip, u8 proto, u32 l4len)
+{
+  return csum_add(ip + 12, 8, 0) + proto + l4len;
+}
+
+// Returns the IPv4 header of frame f, or null if it doesn't have a
+// whole one, and its length and the IP packet's.
+static u8 *
+ip_header(u8 *f, u32 len, u32 *ihl, u32 *iplen)
+{
+  if (len < SIZEOF_ETH_HDR + IP_HLEN || f[12] != 0x08 || f[13] != 0x00)
+    return nullptr;
+  u8 *ip = f + SIZEOF_ETH_HDR;
+  *ihl = (ip[0] & 0xf) * 4;
+  *iplen = (ip[2] << 8) | ip[3];
+  if (*ihl < IP_HLEN || *iplen < *ihl || SIZEOF_ETH_HDR + *iplen > len)
+    return nullptr;
+  return ip;
+}
+
+// Fill in the checksums of a frame to transmit or, if the device can
+// do that itself, describe them in *cs and return true.
+static bool
+tx_checksums(u8 *f, u32 len, struct net_txcsum *cs)
+{
+  u32 ihl, iplen;
+  u8 *ip = ip_header(f, len, &ihl, &iplen);
+  if (!ip)
+    return false;
+  u8 *tcp = ip[9] == IP_PROTO_TCP && iplen >= ihl + 20 ? ip + ihl : nullptr;
+  u32 l4len = iplen - ihl;
+
+  ip[10] = ip[11] = 0;
+  if (netfeatures() & NETDEV_TX_CSUM) {
+    cs->ip_start = SIZEOF_ETH_HDR;
+    cs->ip_end = SIZEOF_ETH_HDR + ihl - 1;
+    cs->l4_start = cs->l4_sum = 0;
+    if (tcp) {
+      cs->l4_start = SIZEOF_ETH_HDR + ihl;
+      cs->l4_sum = cs->l4_start + 16;
+      csum_put(tcp + 16, csum_fold(pseudo_sum(ip, IP_PROTO_TCP, l4len)));
+    }
+    return true;
+  }
+
+  csum_put(ip + 10, ~csum_fold(csum_add(ip, ihl, 0)));
+  if (tcp) {
+    tcp[16] = tcp[17] = 0;
+    csum_put(tcp + 16, ~csum_fold(csum_add(tcp, l4len,
+                                           pseudo_sum(ip, IP_PROTO_TCP,
+                                                      l4len))));
+  }
+  return false;
+}
+
+// Check the checksums of a received frame that the device didn't
+// (csum_flags are NETRX_*).
+static bool
+rx_checksums_ok(u8 *f, u32 len, u32 csum_flags)
+{
+  u32 ihl, iplen;
+  u8 *ip = ip_header(f, len, &ihl, &iplen);
+  if (!ip)
+    // Not IPv4, or too short for us to check; lwIP drops the latter
+    return true;
+  if (!(csum_flags & NETRX_IP_CSUM_OK) &&
+      csum_fold(csum_add(ip, ihl, 0)) != 0xffff)
+    return false;
+  if (ip[9] != IP_PROTO_TCP || (csum_flags & NETRX_L4_CSUM_OK))
+    return true;
+  // lwIP would reassemble a TCP fragment without checking it, and we
+  // can't check it until it's reassembled
+  if ((ip[6] & 0x3f) | ip[7])
+    return false;
+  u32 l4len = iplen - ihl;
+  return csum_fold(csum_add(ip + ihl, l4len,
+                            pseudo_sum(ip, IP_PROTO_TCP, l4len))) == 0xffff;
+}
+#endif
+
 /**
  * This function should do the actual transmission of the packet. The packet is
  * contained in the pbuf that is passed to the function. This pbuf
@@ -75,20 +195,64 @@ low_level_output(struct netif *netif, struct pbuf *p)
     size += q->len;
   }
 
-  nettx(buf, size);
+#if IF_CSUM
+  struct net_txcsum cs;
+  int r = nettx(buf, size, tx_checksums(buf, size, &cs) ? &cs : nullptr);
+#else
+  int r = nettx(buf, size);
+#endif
 
 #if ETH_PAD_SIZE
   pbuf_header(p, ETH_PAD_SIZE); /* reclaim the padding word */
 #endif
+
+  if (r < 0) {
+    /* The TX ring stayed full */
+    netfree(buf);
+    LINK_STATS_INC(link.drop);
+    return ERR_IF;
+  }
   
   LINK_STATS_INC(link.xmit);
 
   return ERR_OK;
 }
 
+#if LWIP_SUPPORT_CUSTOM_PBUF && ETH_PAD_SIZE == 0
+/*
+ * A received packet's buffer is a page from netalloc(), of which the
+ * NIC fills at most the first 2k.  The pbuf that loans it to lwIP goes
+ * at the end of the page, and freeing the pbuf frees the page, back
+ * to the pool of the core that allocated it.
+ */
+static void
+rx_pbuf_free(struct pbuf *p)
+{
+  netfree((void*) ((uptr) p & ~(uptr) (PGSIZE - 1)));
+}
+
+static struct pbuf *
+low_level_input(struct netif *netif, void *buf, u16_t len)
+{
+  struct pbuf_custom *pc =
+    (struct pbuf_custom*) ((char*) buf + PGSIZE - sizeof(*pc));
+  if (len > PGSIZE - sizeof(*pc)) {
+    netfree(buf);
+    LINK_STATS_INC(link.lenerr);
+    LINK_STATS_INC(link.drop);
+    return nullptr;
+  }
+
+  pc->custom_free_function = rx_pbuf_free;
+  struct pbuf *p = pbuf_alloced_custom(PBUF_RAW, len, PBUF_REF, pc, buf,
+                                       PGSIZE - sizeof(*pc));
+  LINK_STATS_INC(link.recv);
+  return p;
+}
+#else
 /**
  * Should allocate a pbuf and transfer the bytes of the incoming
- * packet from the interface into the pbuf.
+ * packet from the interface into the pbuf.  Frees buf.
  *
  * @param netif the lwip network interface structure for this ethernetif
  * @return a pbuf filled with the received packet (including MAC header)
@@ -141,8 +305,10 @@ low_level_input(struct netif *netif, void *buf, u16_t len)
     LINK_STATS_INC(link.drop);
   }
 
+  netfree(buf);
   return p;  
 }
+#endif
 
 /**
  * This function should be called when a packet is ready to be read
@@ -154,14 +320,22 @@ low_level_input(struct netif *netif, void *buf, u16_t len)
  * @param netif the lwip network interface structure for this ethernetif
  */
 void
-if_input(struct netif *netif, void *buf, u16 len)
+if_input(struct netif *netif, void *buf, u16 len, u32 csum_flags)
 {
   struct eth_hdr *ethhdr;
   struct pbuf *p;
 
+#if IF_CSUM
+  if (!rx_checksums_ok((u8*) buf, len, csum_flags)) {
+    netfree(buf);
+    LINK_STATS_INC(link.chkerr);
+    LINK_STATS_INC(link.drop);
+    return;
+  }
+#endif
+
   /* move received packet into a new pbuf */
   p = low_level_input(netif, buf, len);
-  netfree(buf);
   /* no packet could be read, silently ignore this */
   if (p == nullptr) return;
   /* points to packet payload, which starts with an Ethernet header */
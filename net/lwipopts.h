@@ -25,6 +25,17 @@
 
 #define PBUF_POOL_SIZE		512
 #define PBUF_POOL_BUFSIZE	2000
+// Loan received NIC buffers to lwIP instead of copying them into pool
+// pbufs (see net/if.cc)
+#define LWIP_SUPPORT_CUSTOM_PBUF 1
+
+// Leave IPv4 and TCP checksums to net/if.cc, which has the NIC do them
+// if it can.  UDP checksums stay in lwIP, since it may fragment UDP
+// datagrams and a device can only sum one frame at a time.
+#define CHECKSUM_GEN_IP		0
+#define CHECKSUM_GEN_TCP	0
+#define CHECKSUM_CHECK_IP	0
+#define CHECKSUM_CHECK_TCP	0
 
 #define TCP_MSS			1460
 #define TCP_WND			24000
@@ -269,6 +269,8 @@ sys_init(void)
 void
 lwip_core_unlock(void)
 {
+  // Send whatever lwIP queued while it ran
+  nettx_flush();
   release(&lwprot.lk);  
 }
 
@@ -281,6 +283,7 @@ lwip_core_lock(void)
 void
 lwip_core_sleep(struct condvar *c, uint64_t deadline)
 {
+  nettx_flush();
   if (deadline == ~0)
     c->sleep(&lwprot.lk);
   else
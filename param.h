@@ -3,9 +3,9 @@
 #define KSTACKSIZE 32768 // size of per-process kernel stack
 
 // Originally NOFILE was 100. We increased it to 250 for dbench.
-// Be careful though; using large values for NOFILE can slow down
-// fork/exec/clone/spawn etc because filetable::copy() will take
-// longer to complete.
+// filetable::copy() shares the FD arrays copy-on-write, but the first
+// change to a shared array after a fork, and an exec or spawn with
+// O_CLOEXEC FDs open, copy all NOFILE slots.
 #define NOFILE      250  // open files per process
 
 #if 0 // These parameters are currently unused.
@@ -14,7 +14,7 @@
 #define NINODE     5000  // maximum number of active i-nodes
 #endif
 
-#define NDEV         16  // maximum major device number
+#define NDEV         28  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
 #define MAXARGLEN    64  // max exec argument length
@@ -24,8 +24,250 @@
 #define CACHELINE    64  // cache line size
 #define CPUKSTACKS   (NPROC + NCPU*2)
 #define VICTIMAGE 1000000 // cycles a proc executes before an eligible victim
+// Likewise, for stealing a proc from its home core (see proc::home_cpu),
+// whose per-core FS resources it would then use from afar.
+#define HOME_VICTIMAGE 100000000
 #define NDISK         8  // maximum number of hard disks in the machine
-#define USE_SATA_NCQ  0  // Native Command Queuing for SATA hard disks
+#define USE_SATA_NCQ  1  // Native Command Queuing for SATA hard disks
+// The CPU that takes the (MSI) interrupts of the first AHCI controller; further
+// controllers go to the following CPUs, so that with one disk per controller
+// each disk's completions are handled on a different core.  MSI sends all of
+// a controller's ports to one CPU, so they can't follow the submitting core;
+// this starts past CPU 0, which already takes the timer and legacy device
+// interrupts.
+#define AHCI_IRQ_CPU  1
+// Entries in each of the per-core NVMe submission (and completion) queues.
+#define NVME_QUEUE_DEPTH 64
+// Packets the e1000 driver queues before writing the TX tail register;
+// the network stack flushes partial batches when it's done running.
+#define E1000_TX_BATCH 8
+// How long (us) a transmit waits for room on a full e1000 TX ring
+// before dropping the packet.
+#define E1000_TX_WAIT_US 100
+// Packets the e1000 RX poller handles before yielding the CPU, with
+// RX interrupts off until it finds the ring empty.
+#define E1000_RX_BUDGET 64
+// Minimum gap between e1000 interrupts, in 256 ns units (0 is none).
+#define E1000_ITR 256
+// 2MB chunks of packet buffers each core's pool may carve; past that a
+// core allocates packet buffers with kalloc.
+#define NET_POOL_CPU_CHUNKS 4
+// Bytes buffered in each direction of a TCP connection between two local
+// sockets, which bypasses lwIP.
+#define NET_LOOP_BUFSIZE (16*4096)
+// The memory disk's device model (see include/memide.h): the latency in
+// microseconds of each read, write and cache flush on top of its transfer,
+// which goes at most MEMIDE_MBPS MB/s (0 for no cap), and the most I/Os each
+// memory disk keeps in flight, upto MEMIDE_MAX_QUEUE_DEPTH.  With all of the
+// latencies and the cap 0, I/Os complete as soon as they are issued.  Their
+// completions are delivered by a thread on MEMIDE_CPU, which polls for them
+// while any are pending.
+#define MEMIDE_READ_US   0
+#define MEMIDE_WRITE_US  0
+#define MEMIDE_FLUSH_US  0
+#define MEMIDE_MBPS      0
+#define MEMIDE_QUEUE_DEPTH 32
+#define MEMIDE_MAX_QUEUE_DEPTH 256
+#define MEMIDE_CPU       0
+// Largest scatter-gather I/O that the block layer issues in one command, and
+// the stripe unit when striping the filesystem across multiple disks (this
+// determines where each block lives, so existing disks can't be reused after
+// changing it).  AHCI takes upto 32MB - 512 bytes in one command
+// (a 16-bit sector count), which ahci.cc checks at compile time; NVMe splits
+// I/Os past the controller's limit (its MDTS, and at most one PRP list page)
+// into several commands, so going past that gains nothing there.
+#define DISK_IO_SIZE     (64*1024)
+#define DISK_STRIPE_SIZE (64*1024)
+// How the filesystem is laid out on the disks (see disk_layout): striped
+// across all of them (RAID-0), or striped across mirrored pairs of disks
+// (RAID-10, which needs an even number of disks). Like the stripe unit, this
+// can't be changed for existing disks.
+#define DISK_LAYOUT_RAID0  0
+#define DISK_LAYOUT_RAID10 1
+#define DISK_LAYOUT DISK_LAYOUT_RAID0
+// Sequential reads of a file read ahead this many pages at first, doubling up
+// to READAHEAD_MAX_PAGES as long as the reads stay sequential. Once a run of
+// sequential reads is under way, the next window is read in asynchronously,
+// by per-core readahead threads with up to READAHEAD_ASYNC_QUEUE requests
+// queued each.
+#define READAHEAD_MIN_PAGES 4
+#define READAHEAD_MAX_PAGES 64
+#define READAHEAD_ASYNC_QUEUE 32
+// Each core runs the registered shrinkers (see shrinker.hh) once the free
+// memory local to it drops below RECLAIM_LOW_PCT percent, until it is back
+// above RECLAIM_HIGH_PCT percent, asking each for up to RECLAIM_BATCH objects
+// a round. The reclaimers check every RECLAIM_INTERVAL_MS, or as soon as
+// kalloc() runs out of local memory. 0 for RECLAIM_LOW_PCT disables reclaim.
+#define RECLAIM_LOW_PCT 10
+#define RECLAIM_HIGH_PCT 15
+#define RECLAIM_INTERVAL_MS 10
+#define RECLAIM_BATCH 256
+// Objects normally wait two or three timer ticks between their count reaching
+// zero and being freed. Once a core's refcache review list holds
+// REFCACHE_EXPEDITE_REVIEW objects, or after a reclaim round frees something,
+// the epochs are pushed forward right away by IPI. 0 disables the review-list
+// trigger.
+#define REFCACHE_EXPEDITE_REVIEW 4096
+// Once a core's OpLog logger cache has had conflicts, its reclaimer flushes the
+// cached loggers holding at least OPLOG_FLUSH_OPS operations back to their
+// objects on its next housekeeping wakeup. 0 disables this.
+#define OPLOG_FLUSH_OPS 64
+// The page-cache shrinker evicts clean pages with a CLOCK sweep over the
+// pages each core brought in, PAGECACHE_RECLAIM_BATCH pages at a time.
+#define PAGECACHE_RECLAIM_BATCH 256
+// zalloc() hands out pages from a per-core pool of pre-zeroed pages, which
+// idle cores top up to ZPOOL_MAX_PAGES, ZPOOL_IDLE_BATCH pages at a time
+// between checks for work. A busy core that never idles refills its pool in
+// the background once it drops below ZPOOL_LOW_PAGES.
+#define ZPOOL_MAX_PAGES 256
+#define ZPOOL_IDLE_BATCH 8
+#define ZPOOL_LOW_PAGES 16
+// Under memory pressure, the reclaimers also evict the in-memory indexes of
+// on-disk directories that haven't been used since the last sweep, looking at
+// up to DIR_RECLAIM_BATCH directories at a time.
+#define DIR_RECLAIM_BATCH 64
+// They also unpin clean buffer-cache blocks that haven't been looked up since
+// the last sweep (and whose contents are on the disk), up to BUF_RECLAIM_BATCH
+// at a time. The buffer cache's hash table gets one byte for every
+// BUFCACHE_HASH_RATIO bytes of physical memory.
+#define BUF_RECLAIM_BATCH 256
+#define BUFCACHE_HASH_RATIO 256
+// Loading a directory reads its blocks into the buffer cache up to
+// DIR_READAHEAD_BLOCKS at a time, in one batch of disk requests, rather than
+// one block after another.
+#define DIR_READAHEAD_BLOCKS 256
+// The boot-time scan of the block bitmap reads METADATA_SCAN_BLOCKS blocks at
+// a time.
+#define METADATA_SCAN_BLOCKS 256
+// The free inode numbers are found one group of INODE_GROUP_BLOCKS inode
+// blocks at a time, the first time a group is allocated from or freed into,
+// rather than by reading the whole inode table at mount. A group is read in
+// one batch of disk requests.
+#define INODE_GROUP_BLOCKS 64
+// Once a core reads two consecutive inode blocks from the disk, it reads the
+// next INODE_READAHEAD_BLOCKS inode blocks ahead.
+#define INODE_READAHEAD_BLOCKS 16
+// Directory entries are loaded into mnodes under one of LOAD_ENTRY_LOCKS
+// locks, picked by inode number.
+#define LOAD_ENTRY_LOCKS 64
+// Allocating the inode of an mnode is serialized per mnode by one of
+// MNODE_LOCKS locks, picked by a hash of the mnode number.
+#define MNODE_LOCKS 256
+// Per-core writeback threads sync files that have been dirty for
+// WRITEBACK_DIRTY_AGE_MS, checking every WRITEBACK_INTERVAL_MS, and any dirty
+// files at all once there are WRITEBACK_BACKGROUND_PAGES dirty pages. Writers
+// wait (up to WRITEBACK_THROTTLE_MAX_MS per write) while there are
+// WRITEBACK_DIRTY_LIMIT_PAGES or more. 0 for WRITEBACK_INTERVAL_MS disables
+// writeback, leaving dirty pages to sync and fsync.
+#define WRITEBACK_INTERVAL_MS 500
+#define WRITEBACK_DIRTY_AGE_MS 5000
+#define WRITEBACK_BACKGROUND_PAGES 8192
+#define WRITEBACK_DIRTY_LIMIT_PAGES 32768
+#define WRITEBACK_THROTTLE_MAX_MS 100
+// The writeback threads also drop the entries of clean mnodes from their
+// core's list of dirtied mnodes (which sync() goes through), and a core kicks
+// its writeback thread once that list holds DIRTY_MNODE_LIST_PRUNE entries,
+// so that fsync()-cleaned files don't pile up between sync()s.
+#define DIRTY_MNODE_LIST_PRUNE 4096
+
+// sync() splits the dirty mnodes among the cores' task workers (see
+// taskgroup.hh), each processing its share into its own journal, once
+// there are at least SYNC_PARALLEL_MIN_MNODES of them. 0 always
+// processes them on the calling core.
+#define SYNC_PARALLEL_MIN_MNODES 64
+// Files of at least HUGEPAGE_FILE_MIN_BYTES are cached in physically
+// contiguous HUGE_PGSIZE spans wherever a whole aligned span lies within the
+// file, and read-only mappings of such a span use a single 2MB page (with
+// per-core page tables). 0 disables huge page-cache spans.
+#define HUGEPAGE_FILE_MIN_BYTES (64ull << 20)
+// Private anonymous memory (the heap, MAP_ANONYMOUS|MAP_PRIVATE) is faulted
+// in a 2MB-aligned span at a time, backed by one physically contiguous
+// block and mapped with a single large page, wherever the whole span is
+// mapped and untouched. 0 faults anonymous memory a page at a time.
+#define HUGEPAGE_ANON 1
+// A read fault on a file mapping also maps whichever pages of the aligned
+// FAULT_AROUND_PAGES-page window around it are already in the page cache
+// (read-only, so writes still fault). 0 maps only the faulting page.
+#define FAULT_AROUND_PAGES 16
+// O_DIRECT I/O pins the user's pages and issues them to the disk this many
+// pages at a time.
+#define DIRECT_IO_BATCH_PAGES 64
+// An O_APPEND write copies up to this many pages outside the file's resizer
+// lock (see mfile::append()); longer writes are split into appends this long.
+#define APPEND_MAX_PAGES 16
+// The chained hash tables of directories double their buckets when there are
+// more than CHAINHASH_LOAD keys per bucket, and halve them when there are
+// fewer than CHAINHASH_LOAD/8.
+#define CHAINHASH_LOAD 2
+// Weak caches (the buffer and mnode caches) are rebuilt once an insert probes
+// WEAKCACHE_PROBE slots and more than WEAKCACHE_LOAD_PCT percent of the slots
+// hold items or tombstones. The new table is at most half that full.
+#define WEAKCACHE_PROBE 16
+#define WEAKCACHE_LOAD_PCT 50
+// Initial (and minimum) number of buckets in a directory's hash table.
+#define MDIR_MIN_BUCKETS 4
+// Initial (and minimum) number of buckets in the file system's per-inode and
+// per-mnode tables (the inode cache, the inum<->mnum maps, ...), which grow
+// with the number of inodes in use.
+#define FS_MAP_MIN_BUCKETS 1024
+// Maximum number of entries that one getdents() call returns.
+#define GETDENTS_MAX 256
+// Maximum time (in microseconds) that fsync waits for fsyncs on other cores
+// to join its group commit, so that all their per-core journals can be
+// committed with a single cache flush per disk. 0 disables group commit.
+#define GROUP_COMMIT_WINDOW_US 0
+// If 1, transactions log buffer-cache blocks by referencing their contents
+// (copy-on-write) instead of copying them.
+#define TXN_ZERO_COPY 1
+// If 1, the journal logs only the modified parts of inode and bitmap blocks,
+// rather than the whole blocks.
+#define JOURNAL_DELTAS 1
+// If 1, crash recovery writes the replayed blocks straight to the disk, in
+// runs of contiguous blocks, and only refreshes the copies of them that are
+// already in the buffer cache; mount reads whatever else it needs lazily. 0
+// writes every replayed block through the buffer cache, one at a time.
+#define JOURNAL_REPLAY_DIRECT 1
+// zlib level (1-9) that compressed files (see SB_COMPRESS) are written back
+// at. Decompression runs at about the same speed whatever the level.
+#define ZCLUSTER_LEVEL 1
+// fsyncs of files with at most DATA_JOURNAL_MAX_PAGES dirty pages log the
+// pages in the journal (data=journal), only the parts written since the last
+// sync if the blocks already exist, instead of writing the pages in place;
+// the pages reach their blocks when the journal is applied. 0 writes all file
+// data in place.
+#define DATA_JOURNAL_MAX_PAGES 0
+// How long (in microseconds) a commit that depends on another core's journal
+// waits for that journal to be committed, before trying to commit it itself.
+#define DEP_COMMIT_RETRY_US 1000
+// If 1, transactions are applied to the disk through the system-wide I/O
+// scheduler, which coalesces their writes with those of other cores.
+#define DISK_SCHED_APPLY 1
+// How long (in microseconds) journal commits poll the disk for the completion
+// of their writes and cache flushes, before going to sleep until the disk's
+// interrupt. 0 means commits always sleep.
+#define DISK_COMMIT_POLL_US 50
+// If 1, the blocks freed by applied transactions are discarded (TRIMmed) on
+// disks that support it, before they are reused. A background thread issues
+// the discards of at most DISK_DISCARD_BATCH blocks every
+// DISK_DISCARD_INTERVAL_MS milliseconds; if more than DISK_DISCARD_MAX_PENDING
+// blocks are waiting, further freed blocks are reused without a discard.
+#define DISK_DISCARD 1
+#define DISK_DISCARD_INTERVAL_MS 100
+#define DISK_DISCARD_BATCH 8192
+#define DISK_DISCARD_MAX_PENDING 16384
+// Per-core journals are made up of segments taken from a pool shared by all
+// the cores (see class journal). Each journal keeps at least
+// JOURNAL_MIN_SEGMENTS and at most JOURNAL_MAX_SEGMENTS segments, and its
+// size can be reconsidered after every JOURNAL_RESIZE_INTERVAL commits.
+#define JOURNAL_MIN_SEGMENTS 4
+#define JOURNAL_MAX_SEGMENTS 64
+#define JOURNAL_RESIZE_INTERVAL 1024
+// While block I/O tracing is on, each core keeps the last DISKTRACE_RECS
+// disk I/Os it completed (see disktrace.h) until /dev/disktrace drains them.
+#define DISKTRACE_RECS 4096
+// Each core keeps the last TXTRACE_EVENTS transaction lifecycle events it
+// logged (see txtrace.h) until /dev/txtrace drains them.
+#define TXTRACE_EVENTS 4096
 #define VERBOSE       0  // print kernel diagnostics
 #define SPINLOCK_DEBUG DEBUG // Debug spin locks
 #define RCU_TYPE_DEBUG DEBUG
@@ -39,6 +281,12 @@
 #define USTACKPAGES   8
 #define GCINTERVAL    10000 // max. time between GC runs (in msec)
 #define GC_GLOBAL     true
+// Once a core has GC_EXPEDITE_BYTES of deferred frees outstanding, its GC
+// thread runs right away and then every GC_EXPEDITE_MS (waking the other
+// cores' GC threads too, so the epoch can advance) until it is back under.
+// 0 disables this.
+#define GC_EXPEDITE_BYTES 4194304  // 4 MB
+#define GC_EXPEDITE_MS 1
 // The MMU scheme.  One of:
 //  mmu_shared_page_table
 //  mmu_per_core_page_table
@@ -54,22 +302,85 @@
 #define PAGE_REFCOUNT refcache::
 // The maximum number of recently freed pages to cache per core.
 #define KALLOC_HOT_PAGES 128
+// Per core, kalloc() also caches up to KALLOC_HOT_BLOCKS recently freed
+// blocks of each of 2, 4, 8 and 16 pages, and KALLOC_HOT_HUGE_BLOCKS
+// 2MB blocks.
+#define KALLOC_HOT_BLOCKS 16
+#define KALLOC_HOT_HUGE_BLOCKS 2
+// kmalloc() caches up to KMALLOC_MAGAZINE freed objects per core and
+// size class before handing half of them back to their slabs, and keeps
+// KMALLOC_EMPTY_SLABS fully free slabs per core and size class before
+// returning slab pages to kalloc().
+#define KMALLOC_MAGAZINE 32
+#define KMALLOC_EMPTY_SLABS 1
+// Free objects an objcache<T> keeps per core in front of kmalloc().
+#define OBJCACHE_MAGAZINE 16
+// Bytes an arena (see arena.hh) takes from kalloc at a time, and the
+// bytes an inline_arena<ARENA_INLINE> carries inline.
+#define ARENA_CHUNK PGSIZE
+#define ARENA_INLINE 256
 // How to balance memory load.  If 1, dynamically load balance pages
 // between buddy allocators.  If 0, directly steal and return memory
 // from remote buddy allocators.
 #define KALLOC_LOAD_BALANCE 0
+// With KALLOC_LOAD_BALANCE, once a pool is down to this percent of
+// the memory it started with, kalloc pulls memory into it from pools
+// with at least twice as much free, same NUMA node first.
+#define KALLOC_BALANCE_LOW_PCT 25
+// Minimum time between two such proactive balances into one pool.
+#define KALLOC_BALANCE_INTERVAL_US 1000
+// Most memory moved into a pool by one balance.
+#define KALLOC_BALANCE_MAX_BYTES (16*1024*1024)
 // Buddy allocator granularity.  If 0, create a buddy per NUMA node.
 // If 1, create a buddy per CPU.
 #define KALLOC_BUDDY_PER_CPU 1
-// Whether or not to load balance in the scheduler.
-#define SCHED_LOAD_BALANCE 0
+// Whether or not to load balance in the scheduler.  If 1, idle cores
+// steal runnable procs from other cores, same NUMA node first.
+#define SCHED_LOAD_BALANCE 1
+// Slots of each core's run deque (a power of two).  Procs past this
+// go on the core's locked run list.
+#define SCHED_DEQUE_SIZE 64
+// Buckets of the futex wait hash table.  Waiters of every futex that
+// hashes to a bucket share its lock and wait list.
+#define FUTEX_HASH_BUCKETS 256
+// Most pauses a contended sleeplock acquire spins for while the
+// holder is running, before it sleeps.  0 means always sleep.
+#define SLEEPLOCK_SPIN_MAX 4096
+// Entries in each core's table of the lock profile (see lockprof.hh): one
+// per named sleeplock and one per call site that waited on a sleeplock or
+// a condvar.
+#define LOCKPROF_SITES 512
+// Entries in each core's table of the I/O accounting (see ioacct.hh): one
+// per process and, while per-file accounting is on, one per file that
+// core charged I/O to.
+#define IOACCT_SLOTS 1024
+// Largest working set, in pages, that sys_pagebench will time page
+// copies over (it allocates twice that).
+#define PAGEBENCH_MAX_PAGES 8192
+// Messages a UNIX datagram socket queues per core before senders
+// block.
+#define UNIXSOCK_QUEUELEN 256
 // Reference counting scheme for inode's nlink.  One of:
 //  :: for shared reference counters
 //  refcache:: for refcache counters
 #define FS_NLINK_REFCOUNT refcache::
+// Bit mask of the mnode types (1 << mnode::types::x) whose link counts
+// are SNZIs instead, which notice a zero link count at once rather than
+// refcache epochs later, but cost O(NCPU) per stat() and a per-mnode
+// tree.  Files (1 << 2) is where the delay holds on to disk space, but
+// that costs every file's mnode NCPU leaf locks, so it is off until
+// linkbench shows it pays for itself.
+#define FS_NLINK_SNZI_TYPES 0
 #define RANDOMIZE_KMALLOC 1
 // Track kernel memory usage
 #define KERNEL_HEAP_PROFILE 0
+// With KERNEL_HEAP_PROFILE, record the call stack of one allocation
+// per this many bytes allocated, per arena and CPU...
+#define HEAP_PROFILE_SAMPLE (64*1024)
+// ... in a table of this many distinct stacks per arena and CPU.
+#define HEAP_PROFILE_STACKS 512
+// Buckets of the allocation lifetime histograms (powers of two ns)
+#define HEAP_PROFILE_LIFETIMES 40
 
 // Configuring MEMIDE/AHCIIDE in param.h is deprecated.
 // Use include/ideconfig.hh instead.
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "compiler.h"
+#include <uk/epoll.h>
+
+BEGIN_DECLS
+
+int epoll_create1(int flags);
+int epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
+int epoll_wait(int epfd, struct epoll_event *events, int maxevents,
+               int timeout);
+
+END_DECLS
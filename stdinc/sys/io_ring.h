@@ -0,0 +1,10 @@
+#pragma once
+
+#include "compiler.h"
+#include <uk/io_ring.h>
+
+BEGIN_DECLS
+
+int io_ring_enter(struct io_ring *ring, unsigned int to_submit);
+
+END_DECLS
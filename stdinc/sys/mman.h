@@ -9,6 +9,8 @@ void *mmap(void *addr, size_t length, int prot, int flags,
            int fd, off_t offset);
 int munmap(void *addr, size_t length);
 int mprotect(void *addr, size_t length, int prot);
+int mlock(const void *addr, size_t len);
+int munlock(const void *addr, size_t len);
 int madvise(void *addr, size_t length, int advice);
 
 END_DECLS
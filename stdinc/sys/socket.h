@@ -3,12 +3,17 @@
 #include "compiler.h"
 #include <uk/socket.h>
 
+struct timespec;
+
 BEGIN_DECLS
 
 int accept(int sockfd, struct sockaddr *addr, socklen_t *addrlen);
+int accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
 int bind(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
 int connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen);
 int listen(int sockfd, int backlog);
+int setsockopt(int sockfd, int level, int optname, const void *optval,
+               socklen_t optlen);
 ssize_t send(int sockfd, const void *msg, size_t len, int flags);
 ssize_t sendto(int sockfd, const void *msg, size_t len, int flags,
                const struct sockaddr *dest_addr, socklen_t addrlen);
@@ -16,5 +21,8 @@ int socket(int domain, int type, int protocol);
 ssize_t recv(int sockfd, void *buf, size_t len, int flags);
 ssize_t recvfrom(int sockfd, void *buf, size_t len, int flags,
                  struct sockaddr *src_addr, socklen_t *addrlen);
+int sendmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags);
+int recvmmsg(int sockfd, struct mmsghdr *msgvec, unsigned int vlen, int flags,
+             struct timespec *timeout);
 
 END_DECLS
@@ -0,0 +1,33 @@
+// User/kernel shared epoll definitions
+#pragma once
+
+#include <stdint.h>
+
+// epoll_create1() flags
+#define EPOLL_CLOEXEC   0x2000    // Same as O_CLOEXEC
+
+// epoll_ctl() ops
+#define EPOLL_CTL_ADD   1
+#define EPOLL_CTL_DEL   2
+#define EPOLL_CTL_MOD   3
+
+// Events
+#define EPOLLIN         0x001
+#define EPOLLOUT        0x004
+#define EPOLLERR        0x008     // Always reported
+#define EPOLLHUP        0x010     // Always reported
+// Flags
+#define EPOLLET         (1u << 31)  // Edge-triggered
+#define EPOLLONESHOT    (1u << 30)  // Disable after one event, until MOD
+
+typedef union epoll_data {
+  void *ptr;
+  int fd;
+  uint32_t u32;
+  uint64_t u64;
+} epoll_data_t;
+
+struct epoll_event {
+  uint32_t events;
+  epoll_data_t data;
+} __attribute__((packed));
@@ -13,7 +13,12 @@
 #define O_CLOEXEC 0x2000
 #define O_NONBLOCK 0x4000
 #define O_NDELAY  O_NONBLOCK
+#define O_DIRECT  0x8000 // Block-aligned pread/pwrite bypass the page cache;
+                         // for pipe2, a packet-mode, per-core pipe
 #define O_LARGEFILE 0     // for compatibility with fxmark
 #define O_DIRECTORY 0
 
 #define AT_FDCWD  -100
+
+// fallocate() modes
+#define FALLOC_FL_KEEP_SIZE 0x01 // Don't extend the file
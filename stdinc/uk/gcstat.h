@@ -5,5 +5,6 @@ struct gc_stat {
   u64 nrun;
   u64 ncycles;
   u64 nop;
+  u64 delayed_bytes;         /* bytes queued but not freed yet */
 };
 
@@ -0,0 +1,56 @@
+// User/kernel shared submission/completion ring definitions
+#pragma once
+
+#include <stdint.h>
+
+// A process queues operations in the submission ring and calls
+// io_ring_enter(), which runs them in order and posts one completion for
+// each to the completion ring.  Both rings are arrays in user memory of a
+// power-of-two number of entries, indexed by free-running head and tail
+// counters masked by the ring size.  The process advances sq_tail and
+// cq_head; the kernel advances sq_head and cq_tail.  A thread can wait for
+// completions posted by another thread's io_ring_enter() with FUTEX_WAIT on
+// cq_tail, which io_ring_enter() wakes after each batch.
+enum io_ring_op {
+  IORING_OP_NOP = 0,
+  IORING_OP_READ,               // fd, addr, len
+  IORING_OP_WRITE,              // fd, addr, len
+  IORING_OP_PREAD,              // fd, addr, len, off
+  IORING_OP_PWRITE,             // fd, addr, len, off
+  IORING_OP_FSYNC,              // fd, flags
+  IORING_OP_OPENAT,             // fd (directory), addr (path), flags
+  IORING_OP_CLOSE,              // fd
+  IORING_OP_UNLINK,             // addr (path)
+  IORING_OP_RENAME,             // addr (old path), addr2 (new path)
+};
+
+// IORING_OP_FSYNC flags
+#define IORING_FSYNC_DATASYNC 0x1
+
+struct io_ring_sqe {
+  uint32_t op;                  // enum io_ring_op
+  int32_t fd;
+  uint64_t addr;
+  uint64_t addr2;
+  uint64_t len;
+  int64_t off;
+  uint32_t flags;
+  uint32_t pad;
+  uint64_t user_data;           // Copied to the completion
+};
+
+struct io_ring_cqe {
+  uint64_t user_data;
+  int64_t res;                  // The operation's return value
+};
+
+struct io_ring {
+  volatile uint64_t sq_head;
+  volatile uint64_t sq_tail;
+  volatile uint64_t cq_head;
+  volatile uint64_t cq_tail;
+  uint32_t sq_entries;
+  uint32_t cq_entries;
+  struct io_ring_sqe *sqes;
+  struct io_ring_cqe *cqes;
+};
@@ -9,6 +9,10 @@ struct cpulockstat {
   u64 contends;
   u64 locking;
   u64 locked;
+  // Sleeplocks only: contended acquires that got the lock by
+  // spinning, and that slept.
+  u64 spins;
+  u64 sleeps;
 
   u64 locking_ts;
   u64 locked_ts;
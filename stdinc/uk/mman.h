@@ -10,10 +10,14 @@
 #define MAP_PRIVATE   0x2
 #define MAP_FIXED     0x4
 #define MAP_ANONYMOUS 0x8
+#define MAP_POPULATE  0x10 // Fault the whole mapping in up front
 
 #define MAP_FAILED ((void*)-1)
 
-#define MADV_WILLNEED 3
+#define MADV_NORMAL     0
+#define MADV_SEQUENTIAL 2
+#define MADV_WILLNEED   3
+#define MADV_DONTNEED   4
 
 // xv6 extension: invalidate all page tables
 #define MADV_INVALIDATE_CACHE 1000
@@ -47,6 +47,36 @@ struct __attribute__((__aligned__(__BIGGEST_ALIGNMENT__))) sockaddr_storage
 #define PF_UNIX AF_UNIX
 
 #define SOCK_DGRAM_UNORDERED 3
+
+// Flags that may be or'd into socket()'s type or passed to accept4().
+// These share their values with the corresponding open() flags.
+#define SOCK_ANYFD   0x1000 // (xv6) no need for lowest FD
+#define SOCK_CLOEXEC 0x2000
+#define SOCK_TYPE_MASK 0xfff
+
+// send and recv flags
+#define MSG_DONTWAIT   0x40    // Don't block
+#define MSG_WAITFORONE 0x10000 // recvmmsg: block for the first message only
+
+// sendmmsg() and recvmmsg() take one iovec per message.
+struct iovec;
+
+struct msghdr
+{
+  void *msg_name;
+  socklen_t msg_namelen;
+  struct iovec *msg_iov;
+  size_t msg_iovlen;
+  void *msg_control;
+  size_t msg_controllen;
+  int msg_flags;
+};
+
+struct mmsghdr
+{
+  struct msghdr msg_hdr;
+  unsigned int msg_len;         // Bytes sent or received
+};
 #ifdef __cplusplus
 static_assert(SOCK_DGRAM_UNORDERED != SOCK_STREAM,
               "SOCK_DGRAM_UNORDERED == SOCK_STREAM");
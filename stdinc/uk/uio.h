@@ -0,0 +1,12 @@
+// User/kernel shared vectored I/O definitions
+#pragma once
+
+#include <stddef.h>
+
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
+
+// The most iovecs that one readv() or writev() takes
+#define UIO_MAXIOV 1024
@@ -0,0 +1,57 @@
+#pragma once
+
+// Fibers: user-level threads multiplexed over a few kernel threads.
+//
+// fiber_run() starts one worker thread per core (pinned to cores 0 to
+// nworkers - 1), each with its own run queue.  Workers with nothing to
+// run steal fibers from the others.  Fibers are cooperative: they run
+// until they yield, wait or exit.
+//
+// Each worker owns an io_ring and an I/O thread that runs the ring's
+// operations.  fiber_io() queues an operation there and parks the
+// fiber, and the worker runs other fibers until the completion comes
+// back.  The ring runs its operations in order, so a blocked operation
+// holds up the ones queued after it.  For pipes and sockets, which can
+// block indefinitely, wait for readiness with fiber_wait() before
+// reading or writing them.
+//
+// A fiber must not switch (yield, wait or do I/O) while it is throwing
+// an exception or using thread-local data, since it may resume on a
+// different worker.
+
+#include "compiler.h"
+#include <sys/types.h>
+#include <uk/io_ring.h>
+
+BEGIN_DECLS
+
+typedef struct fiber fiber_t;
+
+// Run fn(arg) as the first fiber over nworkers workers, and return
+// once every fiber has exited.  Returns -1 if the workers couldn't be
+// started.
+int fiber_run(int nworkers, void (*fn)(void *), void *arg);
+
+// Start fn(arg) in a new fiber on the calling fiber's worker.
+int fiber_spawn(void (*fn)(void *), void *arg);
+
+fiber_t *fiber_self(void);
+void fiber_yield(void);
+void fiber_exit(void) __noret__;
+
+// Wait until fd is ready for one of events (EPOLLIN, EPOLLOUT).
+// Returns the ready events, or -1 if fd can't be waited for.  Only
+// one fiber per worker may wait for a given fd at a time.
+int fiber_wait(int fd, uint32_t events);
+
+// Run *sqe through the worker's io_ring and return its result.
+// sqe->user_data is overwritten.
+int64_t fiber_io(struct io_ring_sqe *sqe);
+
+ssize_t fiber_read(int fd, void *buf, size_t n);
+ssize_t fiber_write(int fd, const void *buf, size_t n);
+ssize_t fiber_pread(int fd, void *buf, size_t n, off_t off);
+ssize_t fiber_pwrite(int fd, const void *buf, size_t n, off_t off);
+int fiber_fsync(int fd);
+
+END_DECLS
@@ -3,12 +3,17 @@ import subprocess
 import bisect
 import collections
 
-SAMP = struct.Struct("IIQ4QIIQ")
+SAMP = struct.Struct("BxHIQ16QIIQIBBxxQII")
 
 class SamplerFile(object):
-    NTRACE = 4
-    FLAGS, COUNT, RIP, TRACE0 = range(4)
-    LATENCY, SOURCE, LOAD_ADDRESS = range(TRACE0+NTRACE, TRACE0+NTRACE+3)
+    NTRACE = 16
+    FLAGS, SYSNO, COUNT, RIP, TRACE0 = range(5)
+    LATENCY, SOURCE, LOAD_ADDRESS, PID, \
+        OBJ_KIND, OBJ_CPU, OBJ_BASE, OBJ_SIZE, OBJ_OFF = \
+        range(TRACE0+NTRACE, TRACE0+NTRACE+9)
+
+    # enum perf_obj_kind
+    OBJ_NONE, OBJ_STATIC, OBJ_PERCPU, OBJ_SLAB, OBJ_PAGE, OBJ_USER = range(6)
 
     def __init__(self, fp):
         if isinstance(fp, basestring):
@@ -197,6 +202,9 @@ LL_SOURCE_STR = [
     "I/O memory",
     "un-cacheable memory"]
 
+# The line was modified in another core's cache
+LL_SOURCE_HITM = 0x6
+
 def ll_source_str(source):
     if source < 0 or source >= len(LL_SOURCE_STR):
         return "unknown source %#x" % source
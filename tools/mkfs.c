@@ -4,6 +4,8 @@
 #include <string.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "include/types.h"
 #include "include/fs.h"
@@ -12,12 +14,25 @@ int ninodes = NINODES;
 u32 size = NMEGS * BLKS_PER_MEG;
 
 int fsfd;
+// The image is built in place through a shared mapping of the whole file,
+// which starts out as one big hole (reading as zeros), so that blocks that
+// are never written cost nothing and the rest reach the file in large,
+// sequential writebacks rather than one write() per block.
+char *img;
 struct superblock sb;
-char zeroes[BSIZE];
 u32 freeblock;
 u32 usedblocks;
 u32 bitblocks;
 u32 freeinode = 1;
+int extents;
+int largefile;
+int hashdir;
+int inlinedata;
+int compress;
+
+// With -H, the root directory's entries, laid out once they are all known.
+struct dirent *rootents;
+int nrootents;
 
 void balloc(int);
 void wsect(u32, void*);
@@ -26,6 +41,10 @@ void rinode(u32 inum, struct dinode *ip);
 void rsect(u32 sec, void *buf);
 u32 ialloc(u16 type);
 void iappend(u32 inum, void *p, int n);
+u32 emap(struct dinode *din, u32 fbn);
+void rootlink(u32 rootino, u32 inum, const char *name);
+void hashdir_write(u32 rootino);
+void journal_place(u32 inum, int jnum, int fd);
 
 // convert to intel byte order
 u16
@@ -55,13 +74,33 @@ main(int argc, char *argv[])
 {
   int i, cc, fd;
   u32 rootino, inum, off;
-  struct dirent de;
   char buf[BSIZE];
   struct dinode din;
   int nblocks;
 
+  for(; argc > 1 && argv[1][0] == '-'; argc--, argv++){
+    if(strcmp(argv[1], "-e") == 0){
+      extents = 1;
+    } else if(strcmp(argv[1], "-l") == 0){
+      // 64-bit file sizes live in the extent map.
+      extents = 1;
+      largefile = 1;
+    } else if(strcmp(argv[1], "-H") == 0){
+      hashdir = 1;
+    } else if(strcmp(argv[1], "-i") == 0){
+      inlinedata = 1;
+    } else if(strcmp(argv[1], "-z") == 0){
+      // Compressed clusters are extents; files opt in with setcompress().
+      extents = 1;
+      compress = 1;
+    } else {
+      argc = 0;
+      break;
+    }
+  }
+
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-e] [-l] [-H] [-i] [-z] fs.img files...\n");
     exit(1);
   }
 
@@ -83,25 +122,30 @@ main(int argc, char *argv[])
   printf("used %d (bit %d ninode %zu) free %u total %d\n", usedblocks,
          bitblocks, ninodes/IPB + 1, freeblock, nblocks+usedblocks);
 
-  for(i = 0; i < nblocks + usedblocks; i++)
-    wsect(i, zeroes);
+  if(ftruncate(fsfd, size * (off_t)BSIZE) < 0){
+    perror("ftruncate");
+    exit(1);
+  }
+  img = mmap(0, size * (size_t)BSIZE, PROT_READ|PROT_WRITE, MAP_SHARED, fsfd, 0);
+  if(img == MAP_FAILED){
+    perror("mmap");
+    exit(1);
+  }
 
   sb.size = xint(size);
   sb.nblocks = xint(nblocks); // so whole disk is size sectors
   sb.ninodes = xint(ninodes);
+  sb.flags = xint((extents ? SB_EXTENTS : 0) | (largefile ? SB_LARGEFILE : 0) |
+                  (hashdir ? SB_HASHDIR : 0) | (inlinedata ? SB_INLINE : 0) |
+                  (compress ? SB_COMPRESS : 0));
 
   rootino = ialloc(T_DIR);
   assert(rootino == ROOTINO);
 
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, ".");
-  iappend(rootino, &de, sizeof(de));
-
-  bzero(&de, sizeof(de));
-  de.inum = xshort(rootino);
-  strcpy(de.name, "..");
-  iappend(rootino, &de, sizeof(de));
+  rootents = calloc(argc, sizeof(struct dirent));
+  assert(rootents);
+  rootlink(rootino, rootino, ".");
+  rootlink(rootino, rootino, "..");
 
   for(i = 2; i < argc; i++){
     if((fd = open(argv[i], 0)) < 0){
@@ -121,23 +165,38 @@ main(int argc, char *argv[])
       ++argv[i];
 
     inum = ialloc(T_FILE);
+    rootlink(rootino, inum, argv[i]);
 
-    bzero(&de, sizeof(de));
-    de.inum = xshort(inum);
-    strncpy(de.name, argv[i], DIRSIZ);
-    iappend(rootino, &de, sizeof(de));
-
-    int jnum;
+    int jnum = -1;
 
     if (strncmp(argv[i], "sv6journal", 10) == 0) {
       jnum = atoi(argv[i]+10);
+      journal_place(inum, jnum, fd);
       sb.journal_blknums[jnum].start_blknum = xint(freeblock);
     }
 
-    while((cc = read(fd, buf, sizeof(buf))) > 0)
-      iappend(inum, buf, cc);
+    struct stat st;
+    if(inlinedata && jnum < 0 && fstat(fd, &st) == 0 &&
+       st.st_size <= DINODE_INLINE_SIZE){
+      // Small files go into their inodes (see SB_INLINE).
+      rinode(inum, &din);
+      cc = read(fd, din.addrs, st.st_size);
+      assert(cc == st.st_size);
+      din.major = xshort(DI_INLINE);
+      din.size = xint(cc);
+      winode(inum, &din);
+    } else {
+      while((cc = read(fd, buf, sizeof(buf))) > 0)
+        iappend(inum, buf, cc);
+    }
 
     if (strncmp(argv[i], "sv6journal", 10) == 0) {
+      rinode(inum, &din);
+      if(!extents && xint(din.addrs[NDIRECT]) == freeblock){
+        // The indirect block reserved by journal_place().
+        freeblock++;
+        usedblocks++;
+      }
       sb.journal_blknums[jnum].end_blknum = xint(freeblock - 1); // Inclusive
     }
 
@@ -148,29 +207,34 @@ main(int argc, char *argv[])
   memmove(buf, &sb, sizeof(sb));
   wsect(1, buf);
 
-  // fix size of root inode dir
-  rinode(rootino, &din);
-  off = xint(din.size);
-  off = ((off/BSIZE) + 1) * BSIZE;
-  din.size = xint(off);
-  winode(rootino, &din);
+  if(hashdir){
+    hashdir_write(rootino);
+  } else {
+    // fix size of root inode dir
+    rinode(rootino, &din);
+    off = xint(din.size);
+    off = ((off/BSIZE) + 1) * BSIZE;
+    din.size = xint(off);
+    winode(rootino, &din);
+  }
 
   balloc(usedblocks);
 
+  if(munmap(img, size * (size_t)BSIZE) < 0 || close(fsfd) < 0){
+    perror(argv[1]);
+    exit(1);
+  }
   exit(0);
 }
 
 void
 wsect(u32 sec, void *buf)
 {
-  if(lseek(fsfd, sec * (long)BSIZE, 0) != sec * (long)BSIZE){
-    perror("lseek");
-    exit(1);
-  }
-  if(write(fsfd, buf, BSIZE) != BSIZE){
-    perror("write");
+  if(sec >= size){
+    fprintf(stderr, "wsect: block %u past the end of the image\n", sec);
     exit(1);
   }
+  memmove(img + sec * (size_t)BSIZE, buf, BSIZE);
 }
 
 u32
@@ -209,14 +273,11 @@ rinode(u32 inum, struct dinode *ip)
 void
 rsect(u32 sec, void *buf)
 {
-  if(lseek(fsfd, sec * (long)BSIZE, 0) != sec * (long)BSIZE){
-    perror("lseek");
-    exit(1);
-  }
-  if(read(fsfd, buf, BSIZE) != BSIZE){
-    perror("read");
+  if(sec >= size){
+    fprintf(stderr, "rsect: block %u past the end of the image\n", sec);
     exit(1);
   }
+  memmove(buf, img + sec * (size_t)BSIZE, BSIZE);
 }
 
 u32
@@ -254,6 +315,92 @@ balloc(int used)
   }
 }
 
+// Add (name, inum) to the root directory: right away, or with -H, once all
+// the entries are known.
+void
+rootlink(u32 rootino, u32 inum, const char *name)
+{
+  struct dirent de;
+
+  bzero(&de, sizeof(de));
+  de.inum = xshort(inum);
+  strncpy(de.name, name, DIRSIZ);
+  if(hashdir)
+    rootents[nrootents++] = de;
+  else
+    iappend(rootino, &de, sizeof(de));
+}
+
+// Write out the root directory as a hashed directory (SB_HASHDIR), with as
+// few blocks as it takes for every entry to fit in the block it hashes to.
+void
+hashdir_write(u32 rootino)
+{
+  u32 nblocks, b, *count;
+  struct dirent *blocks;
+  int i, full;
+
+  for(nblocks = 1;; nblocks++){
+    count = calloc(nblocks, sizeof(u32));
+    assert(count);
+    full = 0;
+    for(i = 0; i < nrootents; i++){
+      b = dirent_block(dirent_hash(rootents[i].name), nblocks);
+      if(++count[b] > DIRENTS_PER_BLOCK)
+        full = 1;
+    }
+    free(count);
+    if(!full)
+      break;
+  }
+
+  blocks = calloc(nblocks, BSIZE);
+  count = calloc(nblocks, sizeof(u32));
+  assert(blocks && count);
+  for(i = 0; i < nrootents; i++){
+    b = dirent_block(dirent_hash(rootents[i].name), nblocks);
+    blocks[b * DIRENTS_PER_BLOCK + count[b]++] = rootents[i];
+  }
+  iappend(rootino, blocks, nblocks * BSIZE);
+  free(blocks);
+  free(count);
+}
+
+// Place the journal file of core jnum, about to be appended to inum from fd,
+// so that its blocks form a single contiguous run on the disk. The run starts
+// at a stripe unit (DISK_STRIPE_SIZE) boundary, on the stripe unit that
+// RAID-0 puts on disk jnum % NDISK (for any number of disks that divides
+// NDISK), so that the journals of neighbouring cores start out on different
+// disks; the blocks skipped to get there stay unused. Without extents, the
+// indirect block goes right after the data rather than in the middle of it.
+void
+journal_place(u32 inum, int jnum, int fd)
+{
+  const u32 stripe_blocks = DISK_STRIPE_SIZE / BSIZE;
+  struct stat st;
+  struct dinode din;
+  u32 n;
+
+  if(fstat(fd, &st) < 0){
+    perror("fstat");
+    exit(1);
+  }
+  n = (st.st_size + BSIZE - 1) / BSIZE;
+  assert(n <= NDIRECT + NINDIRECT);
+
+  while(freeblock % stripe_blocks != 0 ||
+        freeblock / stripe_blocks % NDISK != jnum % NDISK){
+    freeblock++;
+    usedblocks++;
+  }
+
+  if(!extents && n > NDIRECT){
+    rinode(inum, &din);
+    din.addrs[NDIRECT] = xint(freeblock + n);
+    winode(inum, &din);
+  }
+}
+
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
 void
@@ -272,7 +419,9 @@ iappend(u32 inum, void *xp, int n)
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
+    if(extents){
+      x = emap(&din, fbn);
+    } else if(fbn < NDIRECT){
       if(xint(din.addrs[fbn]) == 0){
         din.addrs[fbn] = xint(freeblock++);
         usedblocks++;
@@ -330,3 +479,55 @@ iappend(u32 inum, void *xp, int n)
   din.size = xint(off);
   winode(inum, &din);
 }
+
+// Return the block that holds file block fbn of an extent-mapped inode,
+// allocating it if need be (see struct dextent_map).
+u32
+emap(struct dinode *din, u32 fbn)
+{
+  struct dextent_map *map = (struct dextent_map*)din->addrs;
+  struct dextent ext[NOEXTENT];
+  struct dextent *e;
+  u32 n = xint(map->nextents);
+  u32 i, x;
+
+  assert(sizeof(*map) <= sizeof(din->addrs));
+  if(n <= NIEXTENT)
+    memmove(ext, map->ext, n * sizeof(ext[0]));
+  else
+    rsect(xint(map->overflow), (char*)ext);
+
+  // Files only ever grow at the end here.
+  for(i = 0; i < n; i++){
+    e = &ext[i];
+    if(fbn >= xint(e->fbn) && fbn < xint(e->fbn) + xint(e->len))
+      return xint(e->addr) + fbn - xint(e->fbn);
+  }
+
+  x = freeblock++;
+  usedblocks++;
+  e = n ? &ext[n - 1] : 0;
+  if(e && xint(e->fbn) + xint(e->len) == fbn && xint(e->addr) + xint(e->len) == x){
+    e->len = xint(xint(e->len) + 1);
+  } else {
+    assert(n < NOEXTENT);
+    e = &ext[n++];
+    e->fbn = xint(fbn);
+    e->addr = xint(x);
+    e->len = xint(1);
+  }
+
+  if(n <= NIEXTENT){
+    memmove(map->ext, ext, n * sizeof(ext[0]));
+  } else {
+    if(xint(map->nextents) <= NIEXTENT){
+      map->overflow = xint(freeblock++);
+      usedblocks++;
+      memset(map->ext, 0, sizeof(map->ext));
+    }
+    memset(&ext[n], 0, (NOEXTENT - n) * sizeof(ext[0]));
+    wsect(xint(map->overflow), (char*)ext);
+  }
+  map->nextents = xint(n);
+  return x;
+}
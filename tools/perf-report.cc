@@ -1,3 +1,15 @@
+// usage: perf-report [-s | -f] [-c cpu] [-y syscall] sample-file elf-file
+//
+// Report a drain of /dev/sampler (see bin/perf and include/sampler.h)
+// against the kernel it was taken on.  By default, list the sampled call
+// stacks by count.  -s instead breaks the samples down by the syscall
+// they were taken in, with the file system functions each spent most of
+// them in, and -f by file system function: the samples taken in each
+// (self, for the innermost file system function of the stack) and under
+// each (incl).  -c takes only the samples of one core and -y only those
+// of one syscall, by name or number.  So "where do fsync cycles go on
+// core 12" is perf-report -f -c 12 -y fsync.
+
 #define __STDC_FORMAT_MACROS
 
 #include <sys/mman.h>
@@ -13,16 +25,32 @@
 #include <stdlib.h>
 #include <stdarg.h>
 
+#include <algorithm>
 #include <unordered_map>
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 
 #include "include/types.h"
 #include "include/sampler.h"
+#include "syscallnames.h"
 
 static bool stacktrace_mode = true;
 static bool ignoreidle_mode = false;
+static int cpu_filter = -1;
+static int syscall_filter = -1;
+
+static const int nsyscall_names =
+  sizeof(syscall_names) / sizeof(syscall_names[0]);
+
+// Source files of the file system and of the block layer under it, as
+// addr2line -s names them
+static const char *fs_files[] = {
+  "scalefs.cc", "scalefs.hh", "mnode.cc", "mnode.hh", "mfs.cc", "mfs.hh",
+  "fs.cc", "file.cc", "file.hh", "sysfile.cc", "bio.cc", "buf.hh",
+  "disk.cc", "disk.hh",
+};
 
 static void __attribute__((noreturn)) 
 edie(const char* errstr, ...) 
@@ -176,6 +204,172 @@ Addr2line::lookup(uint64_t pc, std::vector<line_info> *out) const
   return 0;
 }
 
+// Addr2line, remembering what it told us about each pc
+class Symbolizer
+{
+  const Addr2line &addr2line_;
+  std::unordered_map<uint64_t, std::vector<line_info> > cache_;
+
+public:
+  explicit Symbolizer(const Addr2line &addr2line) : addr2line_(addr2line) {}
+
+  const std::vector<line_info> &lookup(uint64_t pc)
+  {
+    auto it = cache_.find(pc);
+    if (it != cache_.end())
+      return it->second;
+    std::vector<line_info> &li = cache_[pc];
+    addr2line_.lookup(pc, &li);
+    return li;
+  }
+};
+
+static std::string
+syscall_name(int sysno)
+{
+  if (sysno == 0)
+    return "(none)";
+  if (sysno < nsyscall_names && syscall_names[sysno])
+    return syscall_names[sysno];
+  char buf[16];
+  snprintf(buf, sizeof(buf), "#%d", sysno);
+  return buf;
+}
+
+static int
+parse_syscall(const char *s)
+{
+  char *end;
+  long n = strtol(s, &end, 10);
+  if (*s && !*end)
+    return n;
+  for (int i = 1; i < nsyscall_names; i++)
+    if (syscall_names[i] && !strcmp(syscall_names[i], s))
+      return i;
+  fprintf(stderr, "unknown syscall %s\n", s);
+  exit(EXIT_FAILURE);
+}
+
+static bool
+fs_file(const std::string &file)
+{
+  for (auto f : fs_files)
+    if (file == f)
+      return true;
+  return false;
+}
+
+// The file system functions on the stack of e, innermost first, each
+// once.
+static std::vector<std::string>
+fs_functions(Symbolizer &sym, const pmuevent *e)
+{
+  std::vector<std::string> out;
+  if (!e->kernel)
+    return out;
+  for (int i = -1; i < NCALLCHAIN; i++) {
+    uint64_t pc = i < 0 ? e->rip : e->trace[i];
+    if (!pc)
+      break;
+    for (auto &l : sym.lookup(pc))
+      if (fs_file(l.file) &&
+          std::find(out.begin(), out.end(), l.func) == out.end())
+        out.push_back(l.func);
+  }
+  return out;
+}
+
+struct fs_count
+{
+  uint64_t self, incl;
+  fs_count() : self(0), incl(0) {}
+};
+
+static void
+count_fs(Symbolizer &sym, const pmuevent *e,
+         std::map<std::string, fs_count> *counts)
+{
+  auto funcs = fs_functions(sym, e);
+  if (funcs.empty()) {
+    fs_count &c = (*counts)["(outside the file system)"];
+    c.self += e->count;
+    c.incl += e->count;
+    return;
+  }
+  (*counts)[funcs[0]].self += e->count;
+  for (auto &f : funcs)
+    (*counts)[f].incl += e->count;
+}
+
+typedef std::pair<std::string, fs_count> fs_entry;
+
+static std::vector<fs_entry>
+sorted_fs(const std::map<std::string, fs_count> &counts, bool self)
+{
+  std::vector<fs_entry> v(counts.begin(), counts.end());
+  std::sort(v.begin(), v.end(), [self](const fs_entry &a, const fs_entry &b) {
+      return self ? a.second.self > b.second.self :
+        a.second.incl > b.second.incl;
+    });
+  return v;
+}
+
+// One line per syscall, by samples, each followed by the file system
+// functions it spent most of them in (self).
+static void
+print_syscalls(Symbolizer &sym, const std::vector<const pmuevent*> &events,
+               uint64_t total)
+{
+  struct sys_count
+  {
+    uint64_t samples, kernel;
+    std::map<std::string, fs_count> fs;
+    sys_count() : samples(0), kernel(0) {}
+  };
+  std::map<int, sys_count> bysys;
+  for (auto e : events) {
+    sys_count &c = bysys[e->sysno];
+    c.samples += e->count;
+    if (e->kernel)
+      c.kernel += e->count;
+    count_fs(sym, e, &c.fs);
+  }
+
+  std::vector<std::pair<uint64_t, int> > order;
+  for (auto &s : bysys)
+    order.push_back(std::make_pair(s.second.samples, s.first));
+  std::sort(order.rbegin(), order.rend());
+
+  printf("%-20s %10s %6s %8s\n", "syscall", "samples", "%", "kernel%");
+  for (auto &o : order) {
+    sys_count &c = bysys[o.second];
+    printf("%-20s %10" PRIu64 " %5.1f%% %7.1f%%\n",
+           syscall_name(o.second).c_str(), c.samples,
+           100.0 * c.samples / total, 100.0 * c.kernel / c.samples);
+    auto fs = sorted_fs(c.fs, true);
+    for (size_t i = 0; i < fs.size() && i < 3; i++)
+      printf("    %5.1f%% %s\n", 100.0 * fs[i].second.self / c.samples,
+             fs[i].first.c_str());
+  }
+}
+
+// One line per file system function, by the samples taken in it or
+// under it.
+static void
+print_fs(Symbolizer &sym, const std::vector<const pmuevent*> &events,
+         uint64_t total)
+{
+  std::map<std::string, fs_count> counts;
+  for (auto e : events)
+    count_fs(sym, e, &counts);
+
+  printf("%10s %6s %10s %6s  %s\n", "self", "%", "incl", "%", "function");
+  for (auto &c : sorted_fs(counts, false))
+    printf("%10" PRIu64 " %5.1f%% %10" PRIu64 " %5.1f%%  %s\n",
+           c.second.self, 100.0 * c.second.self / total,
+           c.second.incl, 100.0 * c.second.incl / total, c.first.c_str());
+}
+
 struct gt
 {
   bool operator()(int x0, int x1) const
@@ -189,7 +383,7 @@ struct pmuevent_ops {
     size_t h = std::hash<u64>()(x->rip);
     if (!stacktrace_mode)
       return h;
-    for (int i = 0; i < NTRACE; i++)
+    for (int i = 0; i < NCALLCHAIN; i++)
       h ^= std::hash<u64>()(x->trace[i]);
     return h;
   }
@@ -199,7 +393,7 @@ struct pmuevent_ops {
       return false;
     if (!stacktrace_mode)
       return true;
-    for (int i = 0; i < NTRACE; i++)
+    for (int i = 0; i < NCALLCHAIN; i++)
       if (x0->trace[i] != x1->trace[i])
         return false;
     return true;
@@ -207,16 +401,16 @@ struct pmuevent_ops {
 };
 
 static void
-print_entry(Addr2line &addr2line, uint64_t count, uint64_t total,
+print_entry(Symbolizer &sym, uint64_t count, uint64_t total,
             struct pmuevent *e)
 {
-  std::vector<line_info> li;
-  addr2line.lookup(e->rip, &li);
+  std::vector<line_info> li(sym.lookup(e->rip));
   if (stacktrace_mode) {
-    for (int i = 0; i < NTRACE; i++) {
+    for (int i = 0; i < NCALLCHAIN; i++) {
       if (e->trace[i] == 0)
         break;
-      addr2line.lookup(e->trace[i], &li);
+      for (auto &l : sym.lookup(e->trace[i]))
+        li.push_back(l);
     }
   }
 
@@ -283,15 +477,35 @@ main(int ac, char **av)
   char *x;
   int fd;
 
-  if (ac < 3) {
-    fprintf(stderr, "usage: %s sample-file elf-file\n", av[0]);
+  char view = 0;
+  int opt;
+  while ((opt = getopt(ac, av, "sfc:y:")) != -1) {
+    switch (opt) {
+    case 's':
+    case 'f':
+      view = opt;
+      break;
+    case 'c':
+      cpu_filter = atoi(optarg);
+      break;
+    case 'y':
+      syscall_filter = parse_syscall(optarg);
+      break;
+    default:
+      ac = 0;
+    }
+  }
+
+  if (ac - optind != 2) {
+    fprintf(stderr, "usage: %s [-s | -f] [-c cpu] [-y syscall] "
+            "sample-file elf-file\n", av[0]);
     exit(EXIT_FAILURE);
   }
 
   selfless();
 
-  sample = av[1];
-  elf = av[2];
+  sample = av[optind];
+  elf = av[optind + 1];
 
   fd = open(sample, O_RDONLY);
   if (fd < 0) {
@@ -300,6 +514,7 @@ main(int ac, char **av)
   }
 
   Addr2line addr2line(elf);
+  Symbolizer sym(addr2line);
   
   if (fstat(fd, &buf) < 0)
     edie("fstat");
@@ -314,13 +529,18 @@ main(int ac, char **av)
   uint64_t samples = 0, idle_samples = 0,
     ints_disabled_samples = 0, kernel_samples = 0;
   std::unordered_map<struct pmuevent*, int, pmuevent_ops, pmuevent_ops> map;
+  std::vector<const pmuevent*> events;
   for (u32 i = 0; i < header->ncpus; i++) {
     struct pmuevent *p;
     struct pmuevent *q;
 
+    if (cpu_filter >= 0 && i != (u32)cpu_filter)
+      continue;
     p = (struct pmuevent*)(x + header->cpu[i].offset);
     q = (struct pmuevent*)(x + header->cpu[i].offset + header->cpu[i].size);
     for (; p < q; p++) {
+      if (syscall_filter >= 0 && p->sysno != syscall_filter)
+        continue;
       if (p->idle)
         idle_samples += p->count;
       if (p->ints_disabled)
@@ -330,6 +550,7 @@ main(int ac, char **av)
       samples += p->count;
       if (ignoreidle_mode && p->idle)
         continue;
+      events.push_back(p);
       auto it = map.find(p);
       if (it == map.end())
         map[p] = p->count;
@@ -338,10 +559,15 @@ main(int ac, char **av)
     }
   }
   
-  std::map<uint64_t, struct pmuevent*, gt> sorted;
+  if (!samples) {
+    printf("no samples\n");
+    return 0;
+  }
+
+  std::multimap<uint64_t, struct pmuevent*, gt> sorted;
   int total = 0;
   for (std::pair<struct pmuevent* const, int> &p : map) {
-    sorted[p.second] = p.first;
+    sorted.insert(std::make_pair(p.second, p.first));
     total += p.second;
   }
 
@@ -356,8 +582,16 @@ main(int ac, char **av)
          ints_disabled_samples, (int)(ints_disabled_samples * 100 / samples));
   printf("\n");
 
+  if (view == 's') {
+    print_syscalls(sym, events, total);
+    return 0;
+  }
+  if (view == 'f') {
+    print_fs(sym, events, total);
+    return 0;
+  }
   for (std::pair<const uint64_t, struct pmuevent*> &p : sorted)
-    print_entry(addr2line, p.first, total, p.second);
+    print_entry(sym, p.first, total, p.second);
 
   return 0;
 }
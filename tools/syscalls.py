@@ -9,6 +9,8 @@ def main():
                       help="output user syscall stubs")
     parser.add_option("--udecls", action="store_true",
                       help="output user syscall declarations")
+    parser.add_option("--names", action="store_true",
+                      help="output a table of syscall names by number")
     (options, args) = parser.parse_args()
 
     if len(args) < 1:
@@ -91,6 +93,16 @@ SYS_%(uname)s = %(num)d
         print
         print "END_DECLS"
 
+    if options.names:
+        bynum = dict((s.num, s) for s in syscalls)
+        print "static const char *syscall_names[] = {"
+        for num in range(max(bynum.keys()) + 1):
+            if num not in bynum:
+                print '  nullptr,'
+            else:
+                print '  "%s",' % bynum[num].basename
+        print "};"
+
 class Syscall(object):
     def __init__(self, fp, kname, rettype, kargs, flags, num=None):
         self.kname, self.rettype, self.kargs, self.flags, self.num = \
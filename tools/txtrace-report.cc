@@ -0,0 +1,282 @@
+// usage: txtrace-report [-s] trace-file [mhz]
+//
+// Reconstruct the commit pipeline of each ScaleFS journal from a drain of
+// /dev/txtrace (see include/txtrace.h): one line per batch of transactions,
+// in commit order, with the time it spent in each stage, followed by a
+// summary of the stages over all batches. A batch's critical stage is the
+// one it spent longest in. Times are in microseconds given the TSC rate in
+// MHz, and in cycles otherwise. -s prints only the summary.
+
+#define __STDC_FORMAT_MACROS
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "include/txtrace.h"
+
+static void __attribute__((noreturn))
+edie(const char* errstr, ...)
+{
+  va_list ap;
+
+  va_start(ap, errstr);
+  vfprintf(stderr, errstr, ap);
+  va_end(ap);
+  fprintf(stderr, ": %s\n", strerror(errno));
+  exit(EXIT_FAILURE);
+}
+
+enum stage { QUEUE, DEP_WAIT, COMMIT, APPLY_QUEUE, APPLY, NSTAGES };
+
+static const char *stage_names[NSTAGES] = {
+  "queue", "depwait", "commit", "applyq", "apply",
+};
+
+struct dep_wait
+{
+  int journal;
+  uint64_t begin, end;
+};
+
+struct batch
+{
+  int journal;
+  uint64_t txn;
+  uint64_t enqueue, commit_start, commit_end, apply_start, apply_end;
+  uint64_t blocks;
+  int ntxns;
+  std::vector<dep_wait> deps;
+
+  batch() : journal(0), txn(0), enqueue(0), commit_start(0), commit_end(0),
+            apply_start(0), apply_end(0), blocks(0), ntxns(1) {}
+
+  bool complete() const
+  {
+    return enqueue && commit_start && commit_end && apply_start && apply_end;
+  }
+
+  uint64_t dep_cycles() const
+  {
+    uint64_t t = 0;
+    for (auto &d : deps)
+      if (d.end)
+        t += d.end - d.begin;
+    return t;
+  }
+
+  // Cycles spent in stage s, once the batch is complete
+  uint64_t cycles(stage s) const
+  {
+    switch (s) {
+    case QUEUE: {
+      uint64_t wait = commit_start - enqueue, dep = dep_cycles();
+      return wait > dep ? wait - dep : 0;
+    }
+    case DEP_WAIT:
+      return dep_cycles();
+    case COMMIT:
+      return commit_end - commit_start;
+    case APPLY_QUEUE:
+      return apply_start - commit_end;
+    case APPLY:
+      return apply_end - apply_start;
+    default:
+      return 0;
+    }
+  }
+
+  uint64_t total() const
+  {
+    return apply_end - enqueue;
+  }
+};
+
+static double mhz;
+
+static std::string
+fmt_time(uint64_t cycles)
+{
+  char buf[32];
+  if (mhz)
+    snprintf(buf, sizeof(buf), "%.1f", cycles / mhz);
+  else
+    snprintf(buf, sizeof(buf), "%" PRIu64, cycles);
+  return buf;
+}
+
+int
+main(int ac, char **av)
+{
+  bool summary_only = false;
+  int argi = 1;
+  struct stat st;
+
+  if (argi < ac && strcmp(av[argi], "-s") == 0) {
+    summary_only = true;
+    argi++;
+  }
+  if (argi >= ac) {
+    fprintf(stderr, "usage: %s [-s] trace-file [mhz]\n", av[0]);
+    exit(EXIT_FAILURE);
+  }
+  if (argi + 1 < ac)
+    mhz = atof(av[argi + 1]);
+
+  int fd = open(av[argi], O_RDONLY);
+  if (fd < 0)
+    edie("open %s", av[argi]);
+  if (fstat(fd, &st) < 0)
+    edie("fstat");
+  if (st.st_size % sizeof(struct txtrace_event)) {
+    fprintf(stderr, "%s: not a whole number of events\n", av[argi]);
+    exit(EXIT_FAILURE);
+  }
+  size_t nevents = st.st_size / sizeof(struct txtrace_event);
+  if (!nevents) {
+    printf("no events\n");
+    return 0;
+  }
+  auto x = (const struct txtrace_event*)mmap(0, st.st_size, PROT_READ,
+                                             MAP_PRIVATE, fd, 0);
+  if (x == MAP_FAILED)
+    edie("mmap");
+
+  // The drain is grouped by core; put it back in time order
+  std::vector<struct txtrace_event> ev(x, x + nevents);
+  std::stable_sort(ev.begin(), ev.end(),
+                   [](const txtrace_event &a, const txtrace_event &b) {
+                     return a.tsc < b.tsc;
+                   });
+
+  // Batches by (journal, first transaction), and the transactions that
+  // were merged into some other batch
+  std::map<std::pair<int, uint64_t>, batch> batches;
+  std::set<std::pair<int, uint64_t>> merged;
+  std::map<std::pair<int, uint64_t>, uint64_t> enqueued;
+  uint64_t lost = 0;
+
+  for (auto &e : ev) {
+    auto key = std::make_pair((int)e.journal, e.txn);
+    if (e.type == TXTRACE_LOST) {
+      lost += e.arg;
+      continue;
+    }
+    if (e.type == TXTRACE_ENQUEUE) {
+      enqueued[key] = e.tsc;
+      continue;
+    }
+
+    batch &b = batches[key];
+    b.journal = e.journal;
+    b.txn = e.txn;
+    switch (e.type) {
+    case TXTRACE_DEP_WAIT_BEGIN:
+      b.deps.push_back({(int)e.aux, e.tsc, 0});
+      break;
+    case TXTRACE_DEP_WAIT_END:
+      for (auto &d : b.deps)
+        if (d.journal == (int)e.aux && !d.end)
+          d.end = e.tsc;
+      break;
+    case TXTRACE_MERGE:
+      merged.insert(std::make_pair((int)e.journal, e.arg));
+      b.ntxns++;
+      break;
+    case TXTRACE_COMMIT_START:
+      b.commit_start = e.tsc;
+      b.blocks = e.arg;
+      break;
+    case TXTRACE_COMMIT_END:
+      b.commit_end = e.tsc;
+      break;
+    case TXTRACE_APPLY_START:
+      b.apply_start = e.tsc;
+      break;
+    case TXTRACE_APPLY_END:
+      b.apply_end = e.tsc;
+      break;
+    }
+  }
+
+  std::vector<const batch*> order;
+  for (auto &kv : batches) {
+    if (merged.count(kv.first))
+      continue;
+    auto it = enqueued.find(kv.first);
+    if (it != enqueued.end())
+      kv.second.enqueue = it->second;
+    order.push_back(&kv.second);
+  }
+  std::sort(order.begin(), order.end(), [](const batch *a, const batch *b) {
+      return a->commit_start < b->commit_start;
+    });
+
+  uint64_t t0 = ev.front().tsc;
+  uint64_t sum[NSTAGES] = {}, max[NSTAGES] = {}, critical[NSTAGES] = {};
+  uint64_t ncomplete = 0, total_sum = 0, total_max = 0;
+
+  if (!summary_only)
+    printf("%-3s %12s %5s %6s %10s %10s %10s %10s %10s %10s %-8s %s\n",
+           "jnl", "start", "txns", "blocks", "queue", "depwait", "commit",
+           "applyq", "apply", "total", "critical", "waits on");
+  for (auto b : order) {
+    if (!b->complete())
+      continue;
+    ncomplete++;
+    int crit = 0;
+    uint64_t c[NSTAGES];
+    for (int s = 0; s < NSTAGES; s++) {
+      c[s] = b->cycles((stage)s);
+      sum[s] += c[s];
+      max[s] = std::max(max[s], c[s]);
+      if (c[s] > c[crit])
+        crit = s;
+    }
+    critical[crit]++;
+    total_sum += b->total();
+    total_max = std::max(total_max, b->total());
+
+    if (summary_only)
+      continue;
+    std::string deps;
+    for (auto &d : b->deps)
+      deps += (deps.empty() ? "" : ",") + std::to_string(d.journal);
+    printf("%-3d %12s %5d %6" PRIu64, b->journal,
+           fmt_time(b->enqueue - t0).c_str(), b->ntxns, b->blocks);
+    for (int s = 0; s < NSTAGES; s++)
+      printf(" %10s", fmt_time(c[s]).c_str());
+    printf(" %10s %-8s %s\n", fmt_time(b->total()).c_str(),
+           stage_names[crit], deps.c_str());
+  }
+
+  if (!summary_only)
+    printf("\n");
+  printf("%" PRIu64 " events, %" PRIu64 " lost, %" PRIu64 " complete batches"
+         " (%zu seen), times in %s\n", (uint64_t)nevents, lost, ncomplete,
+         order.size(), mhz ? "usec" : "cycles");
+  if (!ncomplete)
+    return 0;
+  printf("%-8s %12s %12s %8s\n", "stage", "avg", "max", "critical");
+  for (int s = 0; s < NSTAGES; s++)
+    printf("%-8s %12s %12s %8" PRIu64 "\n", stage_names[s],
+           fmt_time(sum[s] / ncomplete).c_str(), fmt_time(max[s]).c_str(),
+           critical[s]);
+  printf("%-8s %12s %12s\n", "total", fmt_time(total_sum / ncomplete).c_str(),
+         fmt_time(total_max).c_str());
+  return 0;
+}